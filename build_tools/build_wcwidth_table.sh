@@ -0,0 +1,115 @@
+#!/bin/sh
+
+# Builds the two-level character width table used by fish_wcwidth().
+# Usage: build_wcwidth_table.sh < src/fallback.cpp > src/wcwidth_table.h
+#
+# The combining intervals are read from mk_wcwidth() in fallback.cpp, and the wide ranges below
+# mirror its final expression, so the table always agrees with that function.
+
+/usr/bin/env awk '
+BEGIN { n = 0 }
+/combining\[\] = \{/ { in_table = 1; next }
+in_table {
+    line = $0
+    while (match(line, /\{0x[0-9A-Fa-f]+, 0x[0-9A-Fa-f]+\}/)) {
+        pair = substr(line, RSTART + 1, RLENGTH - 2)
+        split(pair, bounds, ", ")
+        first[n] = hex(bounds[1])
+        last[n] = hex(bounds[2])
+        n++
+        line = substr(line, RSTART + RLENGTH)
+    }
+    if ($0 ~ /\};/) in_table = 0
+}
+
+function hex(s,    i, c, v) {
+    v = 0
+    s = toupper(substr(s, 3))
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789ABCDEF", substr(s, i, 1)) - 1
+        v = v * 16 + c
+    }
+    return v
+}
+
+function is_combining(ucs,    lo, hi, mid) {
+    lo = 0
+    hi = n - 1
+    if (ucs < first[0] || ucs > last[hi]) return 0
+    while (hi >= lo) {
+        mid = int((lo + hi) / 2)
+        if (ucs > last[mid]) lo = mid + 1
+        else if (ucs < first[mid]) hi = mid - 1
+        else return 1
+    }
+    return 0
+}
+
+function width(ucs) {
+    if (ucs == 0) return 0
+    if (ucs < 32 || (ucs >= 127 && ucs < 160)) return -1
+    if (is_combining(ucs)) return 0
+    if (ucs >= 4352 && (ucs <= 4447 || ucs == 9001 || ucs == 9002 ||
+                        (ucs >= 11904 && ucs <= 42191 && ucs != 12351) ||
+                        (ucs >= 44032 && ucs <= 55203) || (ucs >= 63744 && ucs <= 64255) ||
+                        (ucs >= 65040 && ucs <= 65049) || (ucs >= 65072 && ucs <= 65135) ||
+                        (ucs >= 65280 && ucs <= 65376) || (ucs >= 65504 && ucs <= 65510) ||
+                        (ucs >= 131072 && ucs <= 196605) || (ucs >= 196608 && ucs <= 262141)))
+        return 2
+    return 1
+}
+
+END {
+    if (n == 0) {
+        print "build_wcwidth_table.sh: no combining table found" > "/dev/stderr"
+        exit 1
+    }
+    block_size = 256
+    block_count = 4352
+    unique = 0
+    for (b = 0; b < block_count; b++) {
+        key = ""
+        for (i = 0; i < block_size; i++) key = key width(b * block_size + i) ","
+        if (!(key in block_of)) {
+            block_of[key] = unique
+            block_text[unique] = key
+            unique++
+        }
+        index_of[b] = block_of[key]
+    }
+
+    print "// Two-level character width table used by fish_wcwidth()."
+    print "//"
+    print "// Generated by build_tools/build_wcwidth_table.sh from src/fallback.cpp. Do not edit."
+    print "#ifndef FISH_WCWIDTH_TABLE_H"
+    print "#define FISH_WCWIDTH_TABLE_H"
+    print ""
+    print "/// Each block covers 1 << WCWIDTH_BLOCK_BITS consecutive code points."
+    print "#define WCWIDTH_BLOCK_BITS 8"
+    print "/// The first code point not covered by the table."
+    print "#define WCWIDTH_TABLE_LIMIT 0x110000"
+    print ""
+    print "/// The block holding the widths of each range of code points."
+    printf "static const unsigned char wcwidth_block_index[%d] = {", block_count
+    for (b = 0; b < block_count; b++) {
+        if (b % 24 == 0) printf "\n   "
+        printf " %d,", index_of[b]
+    }
+    print "\n};"
+    print ""
+    print "/// The distinct blocks of widths, -1 marking control characters."
+    printf "static const signed char wcwidth_blocks[%d][%d] = {\n", unique, block_size
+    for (u = 0; u < unique; u++) {
+        split(block_text[u], widths, ",")
+        printf "    {"
+        for (i = 1; i <= block_size; i++) {
+            if ((i - 1) % 16 == 0) printf "\n       "
+            printf " %s,", widths[i]
+        }
+        print "\n    },"
+    }
+    print "};"
+    print ""
+    print "#endif"
+}
+'
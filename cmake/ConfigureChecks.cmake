@@ -41,6 +41,8 @@ CHECK_FUNCTION_EXISTS(gettext HAVE_GETTEXT)
 CHECK_FUNCTION_EXISTS(killpg HAVE_KILLPG)
 CHECK_FUNCTION_EXISTS(lrand48_r HAVE_LRAND48_R)
 CHECK_FUNCTION_EXISTS(mkostemp HAVE_MKOSTEMP)
+CHECK_FUNCTION_EXISTS(pipe2 HAVE_PIPE2)
+CHECK_FUNCTION_EXISTS(tee HAVE_TEE)
 SET(HAVE_NCURSES_CURSES_H ${CURSES_HAVE_NCURSES_CURSES_H})
 SET(HAVE_NCURSES_H ${CURSES_HAVE_NCURSES_H})
 CHECK_INCLUDE_FILE_CXX("ncurses/term.h" HAVE_NCURSES_TERM_H)
@@ -56,6 +58,8 @@ CHECK_STRUCT_HAS_MEMBER("struct stat" st_mtimespec.tv_nsec "sys/stat.h"
 CHECK_STRUCT_HAS_MEMBER("struct stat" st_mtim.tv_nsec "sys/stat.h" HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
     LANGUAGE CXX)
 CHECK_CXX_SYMBOL_EXISTS(sys_errlist stdio.h HAVE_SYS_ERRLIST)
+CHECK_INCLUDE_FILE_CXX(sys/event.h HAVE_SYS_EVENT_H)
+CHECK_INCLUDE_FILE_CXX(sys/inotify.h HAVE_SYS_INOTIFY_H)
 CHECK_INCLUDE_FILE_CXX(sys/ioctl.h HAVE_SYS_IOCTL_H)
 CHECK_INCLUDE_FILE_CXX(sys/select.h HAVE_SYS_SELECT_H)
 CHECK_INCLUDE_FILES("sys/types.h;sys/sysctl.h" HAVE_SYS_SYSCTL_H)
@@ -113,4 +117,41 @@ IF(NOT TPARM_TAKES_VARARGS)
   SET(TPARM_SOLARIS_KLUDGE 1)
 ENDIF()
 
+# USDT trace points, for profiling with perf or bpftrace. See src/trace.h.
+INCLUDE(FeatureSummary)
+OPTION(WITH_TRACE_POINTS "add USDT trace points, which need <sys/sdt.h>" OFF)
+IF(WITH_TRACE_POINTS)
+  CHECK_INCLUDE_FILE_CXX(sys/sdt.h HAVE_SYS_SDT_H)
+  IF(NOT HAVE_SYS_SDT_H)
+    MESSAGE(FATAL_ERROR "WITH_TRACE_POINTS needs <sys/sdt.h>, from SystemTap's development headers")
+  ENDIF()
+  SET(FISH_TRACE_POINTS 1)
+ENDIF()
+ADD_FEATURE_INFO(trace-points FISH_TRACE_POINTS "USDT trace points for perf and bpftrace")
+
+# Run-time checks of the shell's state and of which thread calls what, for finding bugs. They are
+# left out of release builds by default.
+IF(CMAKE_BUILD_TYPE MATCHES "^(Release|MinSizeRel)$")
+  SET(SANITY_CHECKS_DEFAULT OFF)
+ELSE()
+  SET(SANITY_CHECKS_DEFAULT ON)
+ENDIF()
+OPTION(WITH_SANITY_CHECKS "check the shell's state and thread use at run time"
+       ${SANITY_CHECKS_DEFAULT})
+IF(NOT WITH_SANITY_CHECKS)
+  SET(FISH_NO_SANITY_CHECKS 1)
+ENDIF()
+ADD_FEATURE_INFO(sanity-checks WITH_SANITY_CHECKS "run-time checks of the shell's state")
+
+# zlib, for compressed history files.
+OPTION(WITH_ZLIB "support compressed history files if zlib is available" ON)
+IF(WITH_ZLIB)
+  FIND_PACKAGE(ZLIB)
+  IF(ZLIB_FOUND)
+    SET(HAVE_ZLIB 1)
+    INCLUDE_DIRECTORIES(${ZLIB_INCLUDE_DIRS})
+  ENDIF()
+ENDIF()
+ADD_FEATURE_INFO(zlib HAVE_ZLIB "compressed history files")
+
 FIND_PROGRAM(SED sed)
@@ -4,6 +4,7 @@ SET(PCRE2_BUILD_PCRE2_8 OFF CACHE BOOL "Build 8bit PCRE2 library")
 SET(PCRE2_BUILD_PCRE2_${PCRE2_WIDTH} ON CACHE BOOL "Build ${PCRE2_WIDTH}bit PCRE2 library")
 SET(PCRE2_SHOW_REPORT OFF CACHE BOOL "Show the final configuration report")
 SET(PCRE2_BUILD_PCRE2GREP OFF CACHE BOOL "Build pcre2grep")
+SET(PCRE2_SUPPORT_JIT ON CACHE BOOL "Enable support for Just-in-time compiling")
 
 
 SET(PCRE2_MIN_VERSION 10.21)
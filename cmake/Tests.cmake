@@ -3,6 +3,20 @@ ADD_EXECUTABLE(fish_tests EXCLUDE_FROM_ALL
                src/fish_tests.cpp)
 FISH_LINK_DEPS(fish_tests)
 
+# Define fish_latency_bench, which times the interactive reader. It drives fish over a
+# pseudo-terminal, so it does not link against fish itself.
+ADD_EXECUTABLE(fish_latency_bench EXCLUDE_FROM_ALL
+               src/fish_latency_bench.cpp)
+
+# Define fish_script_bench, which times the scripts in tests/benchmarks. It runs fish as a program
+# too.
+ADD_EXECUTABLE(fish_script_bench EXCLUDE_FROM_ALL
+               src/fish_script_bench.cpp)
+
+# Another fish to compare the scripts' throughput with, such as one installed from a previous build.
+SET(BENCHMARK_BASELINE_FISH "" CACHE FILEPATH
+    "fish to compare with in the benchmark_scripts target")
+
 # The "test" directory.
 SET(TEST_DIR ${CMAKE_CURRENT_BINARY_DIR}/test)
 
@@ -34,6 +48,38 @@ ADD_CUSTOM_TARGET(test_low_level
   DEPENDS fish_tests)
 ADD_DEPENDENCIES(test test_low_level)
 
+# The 'benchmark' target times history operations on large synthetic histories, for loops, short
+# command lines, the test builtin, looking up builtins and keywords, the pager, key input,
+# background requests, string conversion, escaping and sourcing files. It prints one tab-separated line per measurement:
+# "benchmark", the operation, the history size or iteration count, and msec.
+ADD_CUSTOM_TARGET(benchmark
+  COMMAND ${CMAKE_COMMAND} -E make_directory test/data test/home
+  COMMAND env XDG_DATA_HOME=test/data XDG_CONFIG_HOME=test/home ./fish_tests benchmark_history benchmark_for_loop benchmark_execution benchmark_test_builtin benchmark_dispatch benchmark_pager benchmark_input benchmark_iothread benchmark_convert benchmark_escape benchmark_source
+  WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+  DEPENDS fish_tests)
+
+# The 'benchmark_latency' target times how long the fish installed for the tests takes to respond
+# to typed keystrokes. It prints one tab-separated line per kind of keystroke: "latency", the kind,
+# the number of keystrokes, and the 50th, 90th and 99th percentile and maximum msec.
+ADD_CUSTOM_TARGET(benchmark_latency
+  COMMAND env XDG_DATA_HOME=test/data XDG_CONFIG_HOME=test/home ./fish_latency_bench
+          ${TEST_ROOT_DIR}/bin/fish
+  WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+  DEPENDS test_prep fish_latency_bench)
+
+# The 'benchmark_scripts' target times the scripts in tests/benchmarks, each of which exercises one
+# part of the language, with the fish installed for the tests. If BENCHMARK_BASELINE_FISH is set,
+# that fish runs them too, first, and is the reference the other is compared with. It prints one
+# tab-separated line per script and fish: the script, which fish, the number of operations, msec,
+# operations per second, operations per second relative to the reference, peak resident set size
+# and minor page faults.
+ADD_CUSTOM_TARGET(benchmark_scripts
+  COMMAND env XDG_DATA_HOME=test/data XDG_CONFIG_HOME=test/home ./fish_script_bench
+          -d ${CMAKE_CURRENT_SOURCE_DIR}/tests/benchmarks
+          ${BENCHMARK_BASELINE_FISH} ${TEST_ROOT_DIR}/bin/fish
+  WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+  DEPENDS test_prep fish_script_bench)
+
 # Make the directory in which to run tests.
 # Also symlink fish to where the tests expect it to be.
 ADD_CUSTOM_TARGET(tests_buildroot_target
@@ -104,7 +150,8 @@ ADD_CUSTOM_TARGET(test_high_level
 ADD_DEPENDENCIES(test test_high_level)
 
 # Group test targets into a TestTargets folder
-SET_PROPERTY(TARGET test test_low_level test_high_level tests_dir
+SET_PROPERTY(TARGET test test_low_level benchmark benchmark_latency benchmark_scripts
+                    test_high_level tests_dir
                     test_invocation test_fishscript test_prep
                     tests_buildroot_target build_lexicon_filter
                     symlink_functions
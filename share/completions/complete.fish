@@ -12,5 +12,7 @@ complete -c complete -s u -l unauthorative -d "Option list is not complete"
 complete -c complete -s e -l erase -d "Remove completion"
 complete -c complete -s h -l help -d "Display help and exit"
 complete -c complete -s C -l do-complete -d "Print all completions for the specified commandline"
+complete -c complete -l profile -d "With -C, print the time spent in each source of completions"
+complete -c complete -l cache-ttl -x -d "Seconds for which to reuse the evaluated arguments"
 complete -c complete -s n -l condition -d "The completion should only be used if the specified command has a zero exit status" -r
 complete -c complete -s w -l wraps -d "Inherit completions from the specified command"
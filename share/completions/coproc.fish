@@ -0,0 +1,9 @@
+set -l __fish_coproc_commands list send start stop
+
+complete -c coproc -s h -l help -d 'Display help and exit'
+complete -f -c coproc -n "not __fish_seen_subcommand_from $__fish_coproc_commands" -a start -d 'Start a co-process'
+complete -f -c coproc -n "not __fish_seen_subcommand_from $__fish_coproc_commands" -a send -d 'Send a request to a co-process and print its answer'
+complete -f -c coproc -n "not __fish_seen_subcommand_from $__fish_coproc_commands" -a stop -d 'Stop co-processes'
+complete -f -c coproc -n "not __fish_seen_subcommand_from $__fish_coproc_commands" -a list -d 'List the running co-processes'
+complete -c coproc -n "__fish_seen_subcommand_from send" -s t -l timeout -x -d 'Milliseconds to wait for an answer'
+complete -f -c coproc -n "__fish_seen_subcommand_from send stop" -a "(coproc list)" -d 'Co-process'
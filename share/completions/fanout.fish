@@ -0,0 +1,4 @@
+
+complete -c fanout -s h -l help -d 'Display help and exit'
+complete -c fanout -s j -l jobs -x -d 'Number of commands to run at a time'
+complete -c fanout -d "Command to run" -xa "(__fish_complete_subcommand -- -j --jobs)"
@@ -5,4 +5,7 @@ complete -c fish -s n -l no-execute -d "Only parse input, do not execute"
 complete -c fish -s i -l interactive -d "Run in interactive mode"
 complete -c fish -s l -l login -d "Run in login mode"
 complete -c fish -s p -l profile -d "Output profiling information to specified file" -f
+complete -c fish -l profile-format -d "Format of profiling information" -x -a "raw aggregate collapsed"
+complete -c fish -l startup-trace -d "Report the time taken by each phase of startup"
+complete -c fish -l editor-server -d "Answer completion, highlighting and indentation requests on stdin"
 complete -c fish -s d -l debug -d "Run with the specified verbosity level"
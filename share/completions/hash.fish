@@ -0,0 +1,4 @@
+complete -c hash -s h -l help -d 'Display help and exit'
+complete -c hash -s d -l delete -d 'Forget where the given commands were found'
+complete -c hash -s r -l reset -d 'Forget where all commands were found'
+complete -c hash -x -a '(__fish_complete_command)'
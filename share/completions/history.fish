@@ -1,5 +1,5 @@
 # Note that when a completion file is sourced a new block scope is created so `set -l` works.
-set -l __fish_history_all_commands search delete save merge clear
+set -l __fish_history_all_commands search delete save merge clear stats export
 
 # Note that these options are only valid with the "search" and "delete" subcommands.
 complete -c history -n '__fish_seen_subcommand_from search delete' \
@@ -23,3 +23,7 @@ complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_c
     -a merge -d "Incorporate history changes from other sessions"
 complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_commands" \
     -a clear -d "Clears history file"
+complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_commands" \
+    -a stats -d "Reports the memory used by history"
+complete -f -c history -n "not __fish_seen_subcommand_from $__fish_history_all_commands" \
+    -a export -d "Writes history in the format of the history file"
@@ -0,0 +1,13 @@
+set -l __fish_path_commands filter resolve
+
+complete -c path -s h -l help -d 'Display help and exit'
+complete -f -c path -n "not __fish_seen_subcommand_from $__fish_path_commands" -a filter -d 'Print the paths that pass the checks'
+complete -f -c path -n "not __fish_seen_subcommand_from $__fish_path_commands" -a resolve -d 'Print the absolute paths with symbolic links resolved'
+complete -c path -n "__fish_seen_subcommand_from filter" -s f -l file -d 'Keep regular files'
+complete -c path -n "__fish_seen_subcommand_from filter" -s d -l dir -d 'Keep directories'
+complete -c path -n "__fish_seen_subcommand_from filter" -s l -l link -d 'Keep symbolic links'
+complete -c path -n "__fish_seen_subcommand_from filter" -s r -l readable -d 'Keep readable paths'
+complete -c path -n "__fish_seen_subcommand_from filter" -s w -l writable -d 'Keep writable paths'
+complete -c path -n "__fish_seen_subcommand_from filter" -s x -l executable -d 'Keep executable paths'
+complete -c path -n "__fish_seen_subcommand_from filter" -s v -l invert -d 'Print the paths that fail the checks'
+complete -c path -n "__fish_seen_subcommand_from $__fish_path_commands" -s q -l quiet -d 'Print nothing, only set the status'
@@ -10,4 +10,5 @@ complete -c read -s c -l command -d "Initial contents of read buffwhen reading i
 complete -c read -s s -l shell -d "Use syntax highlighting, tab completions and command termination suitable for entering shellscript code"
 complete -c read -s n -l nchars -d "Read the specified number of characters"
 complete -c read -s a -l array -d "Store the results as an array"
+complete -c read -s A -l array-from-stream -d "Store every line of input as an element of an array"
 complete -c read -s R -l right-prompt -d "Set right-hand prompt command" -x
@@ -1,5 +1,5 @@
 # Note that when a completion file is sourced a new block scope is created so `set -l` works.
-set -l __fish_status_all_commands is-login is-interactive is-block is-breakpoint is-command-substitution is-no-job-control is-interactive-job-control is-full-job-control current-filename current-line-number print-stack-trace job-control
+set -l __fish_status_all_commands is-login is-interactive is-block is-breakpoint is-command-substitution is-no-job-control is-interactive-job-control is-full-job-control current-filename current-line-number print-stack-trace job-control autoload-stats cache-stats complete-condition-stats memory resource-usage start-sampling stop-sampling
 
 # These are the recognized flags.
 complete -c status -s h -l help -d "Display help and exit"
@@ -21,6 +21,13 @@ complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_com
 
 # The job-control command changes fish state.
 complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a job-control -d "Set which jobs are under job control"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a autoload-stats -d "Print how the caches of autoloaded functions and completions are doing"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a cache-stats -d "Print the counters of all caches for scripts"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a complete-condition-stats -d "Print how the cache of completion conditions is doing"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a memory -d "Print how much memory parts of fish use"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a resource-usage -d "Print the CPU time and memory used by fish and its children"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a start-sampling -d "Start the sampling profiler"
+complete -f -c status -n "not __fish_seen_subcommand_from $__fish_status_all_commands" -a stop-sampling -d "Stop the sampling profiler and print its samples"
 complete -f -c status -n "__fish_seen_subcommand_from job-control" -a full -d "Set all jobs under job control"
 complete -f -c status -n "__fish_seen_subcommand_from job-control" -a interactive -d "Set only interactive jobs under job control"
 complete -f -c status -n "__fish_seen_subcommand_from job-control" -a none -d "Set no jobs under job control"
@@ -19,6 +19,8 @@ complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains --
 complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "match"
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s n -l index -d "Report index and length of the matches"
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s v -l invert -d "Report only non-matching input"
+complete -x -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s p -l pattern -d "Pattern to match (may be repeated)"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match" -s w -l which -d "Report which pattern matched"
 complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "replace"
 # All replace options are also valid for match
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] match replace" -s a -l all -d "Report all matches per line/string"
@@ -28,3 +30,7 @@ complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "repeat"
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] repeat" -s n -l count -a "(seq 1 10)" -d "Repetition count"
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] repeat" -s m -l max -a "(seq 1 10)" -d "Maximum number of printed char"
 complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] repeat" -s N -l no-newline -d "Remove newline"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "sort"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] sort" -s r -l reverse -d "Sort in descending order"
+complete -f -c string -n "test (count (commandline -opc)) -ge 2; and contains -- (commandline -opc)[2] sort" -s u -l unique -d "Print equal strings only once"
+complete -f -c string -n "test (count (commandline -opc)) -lt 2" -a "unique"
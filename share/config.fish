@@ -222,6 +222,7 @@ __fish_set_locale
 # As last part of initialization, source the conf directories.
 # Implement precedence (User > Admin > Extra (e.g. vendors) > Fish) by basically doing "basename".
 set -l sourcelist
+set -l conffiles
 for file in $configdir/fish/conf.d/*.fish $__fish_sysconfdir/conf.d/*.fish $__extra_confdir/*.fish
     set -l basename (string replace -r '^.*/' '' -- $file)
     contains -- $basename $sourcelist
@@ -230,7 +231,13 @@ for file in $configdir/fish/conf.d/*.fish $__fish_sysconfdir/conf.d/*.fish $__ex
     # Also skip non-files or unreadable files.
     # This allows one to use e.g. symlinks to /dev/null to "mask" something (like in systemd).
     [ -f $file -a -r $file ]
-    and source $file
+    and set conffiles $conffiles $file
+end
+# Read and parse the snippets in the background while the first ones run.
+set -q conffiles[2]
+and builtin source --prefetch $conffiles
+for file in $conffiles
+    source $file
 end
 
 # Upgrade pre-existing abbreviations from the old "key=value" to the new "key value" syntax.
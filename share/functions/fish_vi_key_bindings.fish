@@ -99,8 +99,8 @@ function fish_vi_key_bindings --description 'vi-like key bindings for fish'
         bind $key beginning-of-line
     end
 
-    bind u history-search-backward
-    bind \cr history-search-forward
+    bind u undo
+    bind \cr redo
 
     bind [ history-token-search-backward
     bind ] history-token-search-forward
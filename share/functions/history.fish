@@ -68,7 +68,7 @@ function history --description "display or manipulate interactive command histor
     # command. This allows the flags to appear before or after the subcommand.
     if not set -q hist_cmd[1]
         and set -q argv[1]
-        if contains $argv[1] search delete merge save clear
+        if contains $argv[1] search delete merge save clear stats export
             set hist_cmd $argv[1]
             set -e argv[1]
         end
@@ -166,6 +166,18 @@ function history --description "display or manipulate interactive command histor
 
             builtin history merge -- $argv
 
+        case stats # report how much memory the interactive command history uses
+            __fish_unexpected_hist_args $argv
+            and return 1
+
+            builtin history stats -- $argv
+
+        case export # write the history in the format of the history file
+            __fish_unexpected_hist_args $argv
+            and return 1
+
+            builtin history export -- $argv
+
         case clear # clear the interactive command history
             __fish_unexpected_hist_args $argv
             and return 1
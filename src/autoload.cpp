@@ -1,6 +1,7 @@
 // The classes responsible for autoloading functions and completions.
 #include "config.h"  // IWYU pragma: keep
 
+#include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
 #include <stddef.h>
@@ -8,10 +9,13 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -19,11 +23,20 @@
 #include "common.h"
 #include "env.h"
 #include "exec.h"
+#include "iothread.h"
+#include "parse_util.h"
+#include "trace.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 /// The time before we'll recheck an autoloaded file.
 static const int kAutoloadStalenessInterval = 15;
 
+/// The default number of commands whose lookups an autoloader caches.
+static const size_t kAutoloadDefaultLimit = 1024;
+
+/// The most commands an autoloader caches when growing its cache to avoid thrashing.
+static const size_t kAutoloadMaxAdaptiveLimit = 16 * 1024;
+
 file_access_attempt_t access_file(const wcstring &path, int mode) {
     // fwprintf(stderr, L"Touch %ls\n", path.c_str());
     file_access_attempt_t result = {};
@@ -46,19 +59,165 @@ file_access_attempt_t access_file(const wcstring &path, int mode) {
     return result;
 }
 
+/// A cached listing of the .fish files in an autoload directory.
+struct autoload_dir_listing_t {
+    /// Modification time of the directory when it was listed.
+    time_t mod_time = 0;
+    /// When we listed the directory.
+    time_t listed_at = 0;
+    /// When we last compared the directory's modification time to mod_time.
+    time_t last_checked = 0;
+    /// The names of the .fish files in the directory.
+    std::unordered_set<wcstring> names;
+};
+
+/// Directory listings, keyed by directory path. These are shared by all autoloaders and may be
+/// consulted from background threads.
+static owning_lock<std::unordered_map<wcstring, autoload_dir_listing_t>> s_dir_listings;
+
+/// Read the .fish files in the directory \p dir into \p listing.
+static void list_autoload_dir(const wcstring &dir, autoload_dir_listing_t *listing) {
+    listing->names.clear();
+    DIR *dirp = wopendir(dir);
+    if (!dirp) return;
+    wcstring name;
+    while (wreaddir(dirp, name)) {
+        if (string_suffixes_string(L".fish", name)) listing->names.insert(name);
+    }
+    closedir(dirp);
+}
+
+/// Return the listing of the directory \p dir, which is refreshed when the directory's modification
+/// time changes, or NULL if the directory is missing. If \p allow_recent is set, a listing that was
+/// checked earlier in the current second is trusted without a stat. Modification times only have a
+/// resolution of one second, so a listing taken in the same second that the directory was modified
+/// is never trusted. \p listings is the locked value of s_dir_listings.
+static const autoload_dir_listing_t *get_dir_listing(
+    std::unordered_map<wcstring, autoload_dir_listing_t> &listings, const wcstring &dir,
+    bool allow_recent) {
+    const time_t now = time(NULL);
+    auto where = listings.find(dir);
+    if (where != listings.end()) {
+        const autoload_dir_listing_t &listing = where->second;
+        if (allow_recent && listing.last_checked == now && listing.mod_time < listing.listed_at) {
+            return &listing;
+        }
+    }
+
+    struct stat statbuf;
+    if (wstat(dir, &statbuf)) {
+        // The directory is missing; forget anything we knew about it.
+        if (where != listings.end()) listings.erase(where);
+        return NULL;
+    }
+
+    if (where == listings.end()) {
+        where = listings.emplace(dir, autoload_dir_listing_t()).first;
+    } else if (where->second.mod_time == statbuf.st_mtime &&
+               where->second.mod_time < where->second.listed_at) {
+        where->second.last_checked = now;
+        return &where->second;
+    }
+
+    autoload_dir_listing_t &listing = where->second;
+    list_autoload_dir(dir, &listing);
+    listing.mod_time = statbuf.st_mtime;
+    listing.listed_at = now;
+    listing.last_checked = now;
+    return &listing;
+}
+
+/// Return whether the directory \p dir contains a file called \p name. See get_dir_listing.
+static bool autoload_dir_contains(const wcstring &dir, const wcstring &name, bool allow_recent) {
+    auto &&locker = s_dir_listings.acquire();
+    const autoload_dir_listing_t *listing = get_dir_listing(locker.value, dir, allow_recent);
+    return listing && listing->names.count(name) > 0;
+}
+
+void autoload_list_dir(const wcstring &dir, wcstring_list_t *names) {
+    auto &&locker = s_dir_listings.acquire();
+    const autoload_dir_listing_t *listing = get_dir_listing(locker.value, dir, false);
+    if (!listing) return;
+    for (const wcstring &name : listing->names) {
+        names->push_back(name.substr(0, name.size() - wcslen(L".fish")));
+    }
+}
+
 autoload_t::autoload_t(const wcstring &env_var_name_var,
-                       command_removed_function_t cmd_removed_callback)
-    : lock(), env_var_name(env_var_name_var), command_removed(cmd_removed_callback) {}
+                       command_removed_function_t cmd_removed_callback,
+                       const wcstring &limit_var_name_var, file_loader_function_t loader)
+    : lru_cache_t(kAutoloadDefaultLimit),
+      lock(),
+      env_var_name(env_var_name_var),
+      command_removed(cmd_removed_callback),
+      file_loader(loader),
+      limit_var_name(limit_var_name_var) {}
 
 void autoload_t::entry_was_evicted(wcstring key, autoload_function_t node) {
     // This should only ever happen on the main thread.
     ASSERT_IS_MAIN_THREAD();
 
+    // Remember commands evicted to respect the limit, so we notice if we need them again.
+    if (!removing_explicitly) {
+        evictions++;
+        if (recently_evicted.size() >= this->max_size()) recently_evicted.clear();
+        recently_evicted.insert(key);
+    }
+
     // Tell ourselves that the command was removed if it was loaded.
     if (node.is_loaded) this->command_removed(std::move(key));
 }
 
-int autoload_t::unload(const wcstring &cmd) { return this->evict_node(cmd); }
+int autoload_t::unload(const wcstring &cmd) {
+    removing_explicitly = true;
+    int result = this->evict_node(cmd);
+    removing_explicitly = false;
+    return result;
+}
+
+/// Read the limit on the number of cached commands from our limit variable, if it has changed.
+void autoload_t::update_limit() {
+    ASSERT_IS_MAIN_THREAD();
+    if (limit_var_name.empty()) return;
+    const uint64_t generation = env_get_generation(limit_var_name);
+    if (generation == limit_var_generation) return;
+    limit_var_generation = generation;
+
+    size_t limit = kAutoloadDefaultLimit;
+    bool adaptive = true;
+    auto limit_var = env_get(limit_var_name);
+    if (!limit_var.missing_or_empty()) {
+        unsigned long long value = fish_wcstoull(limit_var->as_string().c_str());
+        if (errno || value == 0) {
+            debug(1, "Ignoring %ls since it is not valid", limit_var_name.c_str());
+        } else {
+            limit = (size_t)value;
+            adaptive = false;
+        }
+    }
+
+    scoped_lock locker(lock);
+    adaptive_limit = adaptive;
+    this->set_max_size(limit);
+}
+
+/// Count a lookup of the given command that missed the cache. If we evicted it recently, the cache
+/// may be too small for the commands in use; grow it, unless its limit was set explicitly.
+void autoload_t::note_miss(const wcstring &cmd) {
+    ASSERT_IS_LOCKED(lock);
+    misses++;
+    if (recently_evicted.erase(cmd) == 0) return;
+    reloads++;
+    const size_t limit = this->max_size();
+    if (adaptive_limit && reloads * 4 > evictions && limit < kAutoloadMaxAdaptiveLimit) {
+        this->set_max_size(std::min(kAutoloadMaxAdaptiveLimit, limit + limit / 4 + 1));
+    }
+}
+
+autoload_stats_t autoload_t::stats() {
+    scoped_lock locker(lock);
+    return {this->size(), this->max_size(), hits, misses, evictions, reloads};
+}
 
 int autoload_t::load(const wcstring &cmd, bool reload) {
     int res;
@@ -71,15 +230,21 @@ int autoload_t::load(const wcstring &cmd, bool reload) {
     if (path_var.missing_or_empty()) return 0;
 
     // Check if the lookup path has changed. If so, drop all loaded files. path_var may only be
-    // inspected on the main thread.
-    if (*path_var != this->last_path) {
+    // inspected on the main thread. An unchanged generation means the values are the same, so the
+    // comparison of the lists can be skipped.
+    if (path_var->get_generation() != this->last_path.get_generation() &&
+        *path_var != this->last_path) {
         this->last_path = *path_var;
         this->last_path_tokenized.clear();
         this->last_path.to_list(this->last_path_tokenized);
 
         scoped_lock locker(lock);
+        removing_explicitly = true;
         this->evict_all_nodes();
+        removing_explicitly = false;
+        recently_evicted.clear();
     }
+    update_limit();
 
     // Mark that we're loading this. Hang onto the iterator for fast erasing later. Note that
     // std::set has guarantees about not invalidating iterators, so this is safe to do across the
@@ -99,12 +264,44 @@ int autoload_t::load(const wcstring &cmd, bool reload) {
         return 1;
     }
     // Try loading it.
+    FISH_TRACE1(autoload_start, cmd.c_str());
     res = this->locate_file_and_maybe_load_it(cmd, true, reload, this->last_path_tokenized);
+    FISH_TRACE2(autoload_done, cmd.c_str(), res);
     // Clean up.
     is_loading_set.erase(where);
     return res;
 }
 
+/// The most prefetch requests we remember, to avoid prefetching a command twice.
+#define AUTOLOAD_MAX_PREFETCH_REQUESTS 256
+
+void autoload_t::prefetch(const wcstring &cmd) {
+    ASSERT_IS_MAIN_THREAD();
+    {
+        scoped_lock locker(lock);
+        const autoload_function_t *func = this->get(cmd);
+        if (func && (func->is_loaded || func->is_placeholder)) return;
+    }
+    if (prefetch_requested_set.size() >= AUTOLOAD_MAX_PREFETCH_REQUESTS) {
+        prefetch_requested_set.clear();
+    }
+    if (!prefetch_requested_set.insert(cmd).second) return;
+
+    auto path_var = env_get(env_var_name);
+    if (path_var.missing_or_empty()) return;
+    wcstring_list_t path_list;
+    path_var->to_list(path_list);
+    const wcstring filename = cmd + L".fish";
+    iothread_perform([=]() {
+        for (const wcstring &dir : path_list) {
+            if (autoload_dir_contains(dir, filename, true)) {
+                parse_util_prefetch_file(dir + L"/" + filename);
+                break;
+            }
+        }
+    });
+}
+
 bool autoload_t::can_load(const wcstring &cmd, const env_vars_snapshot_t &vars) {
     auto path_var = vars.get(env_var_name);
     if (path_var.missing_or_empty()) return false;
@@ -179,21 +376,31 @@ bool autoload_t::locate_file_and_maybe_load_it(const wcstring &cmd, bool really_
 
         // If we can use this function, return whether we were able to access it.
         if (use_cached(func, really_load, allow_stale_functions)) {
+            hits++;
             return func->access.accessible;
         }
+        note_miss(cmd);
     }
 
-    // The source of the script will end up here.
+    // The source of the script will end up here, and the path of the file it sources here.
     wcstring script_source;
+    wcstring script_path;
 
     // Whether we found an accessible file.
     bool found_file = false;
 
     // Iterate over path searching for suitable completion files.
     for (size_t i = 0; i < path_list.size() && !found_file; i++) {
-        wcstring next = path_list.at(i);
-        wcstring path = next + L"/" + cmd + L".fish";
+        const wcstring &next = path_list.at(i);
+        const wcstring filename = cmd + L".fish";
+
+        // Consult the directory listing first, so a missing file costs no more than a hash probe.
+        // Only background checks may use a listing from earlier in this second.
+        if (!autoload_dir_contains(next, filename, !really_load)) {
+            continue;
+        }
 
+        wcstring path = next + L"/" + filename;
         const file_access_attempt_t access = access_file(path, R_OK);
         if (!access.accessible) {
             continue;
@@ -210,6 +417,7 @@ bool autoload_t::locate_file_and_maybe_load_it(const wcstring &cmd, bool really_
         if (need_to_load_function) {
             // Generate the script source.
             script_source = L"source " + escape_string(path, ESCAPE_ALL);
+            script_path = path;
 
             // Remove any loaded command because we are going to reload it. Note that this
             // will deadlock if command_removed calls back into us.
@@ -256,7 +464,8 @@ bool autoload_t::locate_file_and_maybe_load_it(const wcstring &cmd, bool really_
     }
 
     // If we have a script, either built-in or a file source, then run it.
-    if (really_load && !script_source.empty()) {
+    if (really_load && !script_source.empty() &&
+        (file_loader == NULL || !file_loader(script_path))) {
         // Do nothing on failure.
         exec_subshell(script_source, false /* do not apply exit status */);
     }
@@ -27,6 +27,11 @@ struct file_access_attempt_t {
 };
 file_access_attempt_t access_file(const wcstring &path, int mode);
 
+/// Add the names of the .fish files in the directory \p dir, without the suffix, to \p names. The
+/// directory is listed again only when its modification time changes, using the same listings
+/// that autoloading uses to find files.
+void autoload_list_dir(const wcstring &dir, wcstring_list_t *names);
+
 struct autoload_function_t {
     explicit autoload_function_t(bool placeholder)
         : access(), is_loaded(false), is_placeholder(placeholder) {}
@@ -40,6 +45,19 @@ struct autoload_function_t {
     bool is_placeholder;
 };
 
+/// Counters describing how well an autoloader's cache of lookups is working.
+struct autoload_stats_t {
+    /// The number of commands in the cache, and the most it may hold.
+    size_t entries;
+    size_t limit;
+    /// Lookups answered from the cache, and those that had to go to the disk.
+    uint64_t hits;
+    uint64_t misses;
+    /// Commands evicted to stay within the limit, and how many of those were looked up again.
+    uint64_t evictions;
+    uint64_t reloads;
+};
+
 class env_vars_snapshot_t;
 
 /// Class representing a path from which we can autoload and the autoloaded contents.
@@ -56,12 +74,34 @@ class autoload_t : public lru_cache_t<autoload_t, autoload_function_t> {
     /// A table containing all the files that are currently being loaded.
     /// This is here to help prevent recursion.
     std::unordered_set<wcstring> is_loading_set;
+    /// Commands we have asked to have prefetched. This is only accessed on the main thread.
+    std::unordered_set<wcstring> prefetch_requested_set;
     // Function invoked when a command is removed
     typedef void (*command_removed_function_t)(const wcstring &);
     const command_removed_function_t command_removed;
+    // Function invoked to load a file other than by sourcing it, which returns false if the file
+    // must be sourced after all.
+    typedef bool (*file_loader_function_t)(const wcstring &path);
+    const file_loader_function_t file_loader;
+    /// The variable that sets the most commands we cache, and its generation when we last read
+    /// it.
+    const wcstring limit_var_name;
+    uint64_t limit_var_generation = 0;
+    /// Whether the limit grows when evicted commands keep being looked up again. This is the case
+    /// unless the limit is set explicitly.
+    bool adaptive_limit = true;
+    /// Set while we remove commands other than to stay within the limit.
+    bool removing_explicitly = false;
+    /// Commands recently evicted to stay within the limit.
+    std::unordered_set<wcstring> recently_evicted;
+    /// Usage counters, protected by the lock.
+    uint64_t hits = 0, misses = 0, evictions = 0, reloads = 0;
 
     void remove_all_functions() { this->evict_all_nodes(); }
 
+    void update_limit();
+    void note_miss(const wcstring &cmd);
+
     bool locate_file_and_maybe_load_it(const wcstring &cmd, bool really_load, bool reload,
                                        const wcstring_list_t &path_list);
 
@@ -72,8 +112,12 @@ class autoload_t : public lru_cache_t<autoload_t, autoload_function_t> {
     // CRTP override
     void entry_was_evicted(wcstring key, autoload_function_t node);
 
-    // Create an autoload_t for the given environment variable name.
-    autoload_t(const wcstring &env_var_name_var, command_removed_function_t callback);
+    // Create an autoload_t for the given environment variable name. If limit_var_name is not
+    // empty, it names the variable setting the most commands to cache. If loader is not NULL, it
+    // is tried before sourcing each file.
+    autoload_t(const wcstring &env_var_name_var, command_removed_function_t callback,
+               const wcstring &limit_var_name = wcstring(),
+               file_loader_function_t loader = NULL);
 
     /// Autoload the specified file, if it exists in the specified path. Do not load it multiple
     /// times unless its timestamp changes or parse_util_unload is called.
@@ -82,6 +126,11 @@ class autoload_t : public lru_cache_t<autoload_t, autoload_function_t> {
     /// @param reload wheter to recheck file timestamps on already loaded files
     int load(const wcstring &cmd, bool reload);
 
+    /// Locate, read and parse the file for the specified command on a background thread, so that
+    /// a later load need not parse it. Does nothing if the command is loaded or known to be
+    /// missing, or was prefetched before.
+    void prefetch(const wcstring &cmd);
+
     /// Check whether we have tried loading the given command. Does not do any I/O.
     bool has_tried_loading(const wcstring &cmd);
 
@@ -91,5 +140,8 @@ class autoload_t : public lru_cache_t<autoload_t, autoload_function_t> {
 
     /// Check whether the given command could be loaded, but do not load it.
     bool can_load(const wcstring &cmd, const env_vars_snapshot_t &vars);
+
+    /// Return the counters describing the cache.
+    autoload_stats_t stats();
 };
 #endif
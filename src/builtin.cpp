@@ -38,15 +38,19 @@
 #include "builtin_commandline.h"
 #include "builtin_complete.h"
 #include "builtin_contains.h"
+#include "builtin_coproc.h"
 #include "builtin_disown.h"
 #include "builtin_echo.h"
 #include "builtin_emit.h"
 #include "builtin_exit.h"
+#include "builtin_fanout.h"
 #include "builtin_fg.h"
 #include "builtin_functions.h"
+#include "builtin_hash.h"
 #include "builtin_history.h"
 #include "builtin_jobs.h"
 #include "builtin_math.h"
+#include "builtin_path.h"
 #include "builtin_printf.h"
 #include "builtin_pwd.h"
 #include "builtin_random.h"
@@ -70,6 +74,7 @@
 #include "parse_constants.h"
 #include "parse_util.h"
 #include "parser.h"
+#include "perfect_hash.h"
 #include "proc.h"
 #include "reader.h"
 #include "wgetopt.h"
@@ -426,6 +431,7 @@ static const builtin_data_t builtin_datas[] = {
     {L"contains", &builtin_contains, N_(L"Search for a specified string in a list")},
     {L"continue", &builtin_break_continue,
      N_(L"Skip the rest of the current lap of the innermost loop")},
+    {L"coproc", &builtin_coproc, N_(L"Start long-lived helper processes and send them requests")},
     {L"count", &builtin_count, N_(L"Count the number of arguments")},
     {L"disown", &builtin_disown, N_(L"Remove job from job list")},
     {L"echo", &builtin_echo, N_(L"Print arguments")},
@@ -435,16 +441,19 @@ static const builtin_data_t builtin_datas[] = {
     {L"exec", &builtin_generic, N_(L"Run command in current process")},
     {L"exit", &builtin_exit, N_(L"Exit the shell")},
     {L"false", &builtin_false, N_(L"Return an unsuccessful result")},
+    {L"fanout", &builtin_fanout, N_(L"Run a command for each input line, several at a time")},
     {L"fg", &builtin_fg, N_(L"Send job to foreground")},
     {L"for", &builtin_generic, N_(L"Perform a set of commands multiple times")},
     {L"function", &builtin_generic, N_(L"Define a new function")},
     {L"functions", &builtin_functions, N_(L"List or remove functions")},
+    {L"hash", &builtin_hash, N_(L"Show or forget where commands were found in $PATH")},
     {L"history", &builtin_history, N_(L"History of commands executed by user")},
     {L"if", &builtin_generic, N_(L"Evaluate block if condition is true")},
     {L"jobs", &builtin_jobs, N_(L"Print currently running jobs")},
     {L"math", &builtin_math, N_(L"Evaluate math expressions")},
     {L"not", &builtin_generic, N_(L"Negate exit status of job")},
     {L"or", &builtin_generic, N_(L"Execute command if previous command failed")},
+    {L"path", &builtin_path, N_(L"Filter or resolve many paths at once")},
     {L"printf", &builtin_printf, N_(L"Prints formatted text")},
     {L"pwd", &builtin_pwd, N_(L"Print the working directory")},
     {L"random", &builtin_random, N_(L"Generate random number")},
@@ -474,12 +483,13 @@ static const builtin_data_t builtin_datas[] = {
 ///    Pointer to a builtin_data_t
 ///
 static const builtin_data_t *builtin_lookup(const wcstring &name) {
-    const builtin_data_t *array_end = builtin_datas + BUILTIN_COUNT;
-    const builtin_data_t *found = std::lower_bound(builtin_datas, array_end, name);
-    if (found != array_end && name == found->name) {
-        return found;
-    }
-    return NULL;
+    // Every command run or highlighted is looked up here, so use a perfect hash of the names.
+    static const perfect_hash_t<const builtin_data_t *> builtin_table = [] {
+        std::vector<perfect_hash_t<const builtin_data_t *>::entry_t> entries;
+        for (const builtin_data_t &data : builtin_datas) entries.emplace_back(data.name, &data);
+        return perfect_hash_t<const builtin_data_t *>(entries, NULL);
+    }();
+    return builtin_table.get(name);
 }
 
 /// Initialize builtin data.
@@ -103,6 +103,11 @@ class builtin_commandline_scoped_transient_t {
     ~builtin_commandline_scoped_transient_t();
 };
 
+/// Gets the command line and cursor position the commandline builtin would see if it ran now: the
+/// transient command line if there is one, otherwise the reader's. The buffer is empty if there is
+/// no command line.
+void builtin_commandline_get_state(wcstring *out_buffer, size_t *out_cursor_pos);
+
 wcstring builtin_help_get(parser_t &parser, const wchar_t *cmd);
 
 void builtin_print_help(parser_t &parser, io_streams_t &streams, const wchar_t *cmd,
@@ -9,7 +9,6 @@
 #include <wchar.h>
 
 #include <algorithm>
-#include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -27,6 +26,7 @@
 #include "exec.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "lru.h"
 #include "wgetopt.h"  // IWYU pragma: keep
 #include "wutil.h"    // IWYU pragma: keep
 
@@ -68,12 +68,25 @@ class argparse_cmd_opts_t {
     std::unordered_map<wchar_t, option_spec_t *> options;
     std::unordered_map<wcstring, wchar_t> long_to_short_flag;
     std::vector<std::vector<wchar_t>> exclusive_flag_sets;
+    // The option strings handed to wgetopt_long() when parsing the caller's arguments. The long
+    // option names point into the long_flag of the option specs above.
+    wcstring short_options;
+    std::vector<woption> long_options;
 
     ~argparse_cmd_opts_t() {
         for (auto it : options) {
             delete it.second;
         }
     }
+
+    /// Forget the results of a previous parse so the option specs can be used again.
+    void reset_results() {
+        argv.clear();
+        for (auto it : options) {
+            it.second->vals.clear();
+            it.second->num_seen = 0;
+        }
+    }
 };
 
 static const wchar_t *short_options = L"+:hn:sx:N:X:";
@@ -432,10 +445,9 @@ static int parse_cmd_opts(argparse_cmd_opts_t &opts, int *optind,  //!OCLINT(hig
     return collect_option_specs(opts, optind, argc, argv, streams);
 }
 
-static void populate_option_strings(
-    argparse_cmd_opts_t &opts, wcstring &short_options,
-    std::unique_ptr<woption, std::function<void(woption *)>> &long_options) {
-    int i = 0;
+static void populate_option_strings(argparse_cmd_opts_t &opts) {
+    wcstring &short_options = opts.short_options;
+    short_options = opts.stop_nonopt ? L"+:" : L":";
     for (auto it : opts.options) {
         option_spec_t *opt_spec = it.second;
         if (opt_spec->short_flag_valid) short_options.push_back(opt_spec->short_flag);
@@ -450,11 +462,11 @@ static void populate_option_strings(
         }
 
         if (!opt_spec->long_flag.empty()) {
-            long_options.get()[i++] = {opt_spec->long_flag.c_str(), arg_type, NULL,
-                                       opt_spec->short_flag};
+            opts.long_options.push_back(
+                {opt_spec->long_flag.c_str(), arg_type, NULL, opt_spec->short_flag});
         }
     }
-    long_options.get()[i] = {NULL, 0, NULL, 0};
+    opts.long_options.push_back({NULL, 0, NULL, 0});
 }
 
 static int validate_arg(argparse_cmd_opts_t &opts, option_spec_t *opt_spec, bool is_long_flag,
@@ -556,10 +568,11 @@ static int handle_flag(argparse_cmd_opts_t &opts, option_spec_t *opt_spec, int l
     return STATUS_CMD_OK;
 }
 
-static int argparse_parse_flags(argparse_cmd_opts_t &opts, const wchar_t *short_options,
-                                const woption *long_options, const wchar_t *cmd, int argc,
+static int argparse_parse_flags(argparse_cmd_opts_t &opts, const wchar_t *cmd, int argc,
                                 wchar_t **argv, int *optind, parser_t &parser,
                                 io_streams_t &streams) {
+    const wchar_t *short_options = opts.short_options.c_str();
+    const woption *long_options = opts.long_options.data();
     int opt;
     int long_idx = -1;
     wgetopter_t w;
@@ -599,14 +612,6 @@ static int argparse_parse_args(argparse_cmd_opts_t &opts, const wcstring_list_t
                                parser_t &parser, io_streams_t &streams) {
     if (args.empty()) return STATUS_CMD_OK;
 
-    wcstring short_options = opts.stop_nonopt ? L"+:" : L":";
-    size_t nflags = opts.options.size();
-    // This assumes every option has a long flag. Which is the worst case and isn't worth optimizing
-    // since the number of options is always quite small.
-    auto long_options = std::unique_ptr<woption, std::function<void(woption *)>>(
-        new woption[nflags + 1], [](woption *p) { delete[] p; });
-    populate_option_strings(opts, short_options, long_options);
-
     const wchar_t *cmd = opts.name.c_str();
     int argc = static_cast<int>(args.size());
 
@@ -616,8 +621,7 @@ static int argparse_parse_args(argparse_cmd_opts_t &opts, const wcstring_list_t
     auto argv = (wchar_t **)argv_container.get();
 
     int optind;
-    int retval = argparse_parse_flags(opts, short_options.c_str(), long_options.get(), cmd, argc,
-                                      argv, &optind, parser, streams);
+    int retval = argparse_parse_flags(opts, cmd, argc, argv, &optind, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
 
     retval = check_for_mutually_exclusive_flags(opts, streams);
@@ -668,6 +672,63 @@ static void set_argparse_result_vars(argparse_cmd_opts_t &opts) {
     env_set(L"argv", ENV_LOCAL, opts.argv);
 }
 
+#define ARGPARSE_SPEC_CACHE_SIZE 64
+
+namespace {
+/// Compiled option specs keyed by the argparse arguments that define them, so a function calling
+/// argparse every time it runs only parses its option specs once.
+class argparse_spec_cache_t
+    : public lru_cache_t<argparse_spec_cache_t, std::shared_ptr<argparse_cmd_opts_t>> {
+    typedef lru_cache_t<argparse_spec_cache_t, std::shared_ptr<argparse_cmd_opts_t>> super;
+
+   public:
+    argparse_spec_cache_t() : super(ARGPARSE_SPEC_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static argparse_spec_cache_t s_spec_cache;
+
+/// Get the compiled form of argparse's own flags and the option specs that follow them, reusing a
+/// cached one when the same arguments were seen before. On success `*optind` is set to the index of
+/// the first argument after the `--` that ends the option specs.
+static int get_cmd_opts(std::shared_ptr<argparse_cmd_opts_t> *out, int *optind, int argc,
+                        wchar_t **argv, parser_t &parser, io_streams_t &streams) {
+    // The key is everything up to and including the first `--`. That is usually where the option
+    // specs end, but not always (e.g., `--name --`), so only entries for which it is are cached.
+    int key_end = 1;
+    while (key_end < argc && wcscmp(argv[key_end], L"--") != 0) key_end++;
+    wcstring key;
+    if (key_end < argc) {
+        for (int i = 1; i <= key_end; i++) {
+            key.append(argv[i]);
+            key.push_back(L'\0');
+        }
+        std::shared_ptr<argparse_cmd_opts_t> *cached = s_spec_cache.get(key);
+        // A validation command can run a function calling argparse with the same specs while they
+        // are still in use by this call. Such a nested call gets its own copy.
+        if (cached && cached->use_count() == 1) {
+            (*cached)->reset_results();
+            *out = *cached;
+            *optind = key_end + 1;
+            return STATUS_CMD_OK;
+        }
+    }
+
+    auto opts = std::make_shared<argparse_cmd_opts_t>();
+    int retval = parse_cmd_opts(*opts, optind, argc, argv, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    if (!opts->print_help) {
+        retval = parse_exclusive_args(*opts, streams);
+        if (retval != STATUS_CMD_OK) return retval;
+        populate_option_strings(*opts);
+        if (!key.empty() && *optind == key_end + 1) s_spec_cache.insert(std::move(key), opts);
+    }
+
+    *out = std::move(opts);
+    return STATUS_CMD_OK;
+}
+
 /// The argparse builtin. This is explicitly not compatible with the BSD or GNU version of this
 /// command. That's because fish doesn't have the weird quoting problems of POSIX shells. So we
 /// don't need to support flags like `--unquoted`. Similarly we don't want to support introducing
@@ -678,11 +739,12 @@ static void set_argparse_result_vars(argparse_cmd_opts_t &opts) {
 int builtin_argparse(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     const wchar_t *cmd = argv[0];
     int argc = builtin_count_args(argv);
-    argparse_cmd_opts_t opts;
+    std::shared_ptr<argparse_cmd_opts_t> opts_ptr;
 
     int optind;
-    int retval = parse_cmd_opts(opts, &optind, argc, argv, parser, streams);
+    int retval = get_cmd_opts(&opts_ptr, &optind, argc, argv, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
+    argparse_cmd_opts_t &opts = *opts_ptr;
 
     if (opts.print_help) {
         builtin_print_help(parser, streams, cmd, streams.out);
@@ -693,9 +755,6 @@ int builtin_argparse(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     args.push_back(opts.name);
     while (optind < argc) args.push_back(argv[optind++]);
 
-    retval = parse_exclusive_args(opts, streams);
-    if (retval != STATUS_CMD_OK) return retval;
-
     retval = argparse_parse_args(opts, args, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
 
@@ -81,6 +81,16 @@ builtin_commandline_scoped_transient_t::~builtin_commandline_scoped_transient_t(
     stack.pop_back();
 }
 
+void builtin_commandline_get_state(wcstring *out_buffer, size_t *out_cursor_pos) {
+    if (get_top_transient(out_buffer)) {
+        *out_cursor_pos = out_buffer->size();
+        return;
+    }
+    const wchar_t *buffer = reader_get_buffer();
+    out_buffer->assign(buffer ? buffer : L"");
+    *out_cursor_pos = buffer ? reader_get_cursor_pos() : 0;
+}
+
 /// Replace/append/insert the selection with/at/after the specified string.
 ///
 /// \param begin beginning of selection
@@ -1,6 +1,7 @@
 // Functions used for implementing the complete builtin.
 #include "config.h"  // IWYU pragma: keep
 
+#include <errno.h>
 #include <stddef.h>
 #include <wchar.h>
 
@@ -30,28 +31,28 @@
 static void builtin_complete_add2(const wchar_t *cmd, int cmd_type, const wchar_t *short_opt,
                                   const wcstring_list_t &gnu_opt, const wcstring_list_t &old_opt,
                                   int result_mode, const wchar_t *condition, const wchar_t *comp,
-                                  const wchar_t *desc, int flags) {
+                                  const wchar_t *desc, int flags, int cache_ttl) {
     size_t i;
     const wchar_t *s;
 
     for (s = short_opt; *s; s++) {
         complete_add(cmd, cmd_type, wcstring(1, *s), option_type_short, result_mode, condition,
-                     comp, desc, flags);
+                     comp, desc, flags, cache_ttl);
     }
 
     for (i = 0; i < gnu_opt.size(); i++) {
         complete_add(cmd, cmd_type, gnu_opt.at(i), option_type_double_long, result_mode, condition,
-                     comp, desc, flags);
+                     comp, desc, flags, cache_ttl);
     }
 
     for (i = 0; i < old_opt.size(); i++) {
         complete_add(cmd, cmd_type, old_opt.at(i), option_type_single_long, result_mode, condition,
-                     comp, desc, flags);
+                     comp, desc, flags, cache_ttl);
     }
 
     if (old_opt.empty() && gnu_opt.empty() && wcslen(short_opt) == 0) {
         complete_add(cmd, cmd_type, wcstring(), option_type_args_only, result_mode, condition, comp,
-                     desc, flags);
+                     desc, flags, cache_ttl);
     }
 }
 
@@ -60,15 +61,15 @@ static void builtin_complete_add(const wcstring_list_t &cmd, const wcstring_list
                                  const wchar_t *short_opt, wcstring_list_t &gnu_opt,
                                  wcstring_list_t &old_opt, int result_mode,
                                  const wchar_t *condition, const wchar_t *comp, const wchar_t *desc,
-                                 int flags) {
+                                 int flags, int cache_ttl) {
     for (size_t i = 0; i < cmd.size(); i++) {
         builtin_complete_add2(cmd.at(i).c_str(), COMMAND, short_opt, gnu_opt, old_opt, result_mode,
-                              condition, comp, desc, flags);
+                              condition, comp, desc, flags, cache_ttl);
     }
 
     for (size_t i = 0; i < path.size(); i++) {
         builtin_complete_add2(path.at(i).c_str(), PATH, short_opt, gnu_opt, old_opt, result_mode,
-                              condition, comp, desc, flags);
+                              condition, comp, desc, flags, cache_ttl);
     }
 }
 
@@ -112,9 +113,80 @@ static void builtin_complete_remove(const wcstring_list_t &cmd, const wcstring_l
 
 /// The complete builtin. Used for specifying programmable tab-completions. Calls the functions in
 // complete.cpp for any heavy lifting.
-int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+/// Print where the time of a completion went, in the style of fish --profile: the time spent in each
+/// source itself, the time including the sources it ran, and how often it ran. The last line is the
+/// completion as a whole.
+static void builtin_complete_print_profile(const complete_profile_t &times,
+                                           io_streams_t &streams) {
+    streams.err.append(_(L"Time\tSum\tCalls\tSource\n"));
+    long long self_usec = times.total_usec;
+    for (size_t i = 0; i < complete_source_count; i++) {
+        const complete_profile_t::source_t &source = times.sources[i];
+        self_usec -= source.self_usec;
+        if (source.calls == 0) continue;
+        streams.err.append_format(L"%lld\t%lld\t%llu\t%ls\n", source.self_usec,
+                                  source.total_usec, (unsigned long long)source.calls,
+                                  complete_source_name(static_cast<complete_source_t>(i)));
+    }
+    streams.err.append_format(L"%lld\t%lld\t1\tcomplete\n", self_usec, times.total_usec);
+}
+
+wcstring_list_t builtin_complete_do_complete(const wcstring &cmdline, complete_profile_t *times) {
     ASSERT_IS_MAIN_THREAD();
     static int recursion_level = 0;
+    wcstring_list_t result;
+
+    const wchar_t *token;
+    parse_util_token_extent(cmdline.c_str(), cmdline.size(), &token, 0, 0, 0);
+
+    // Create a scoped transient command line, so that bulitin_commandline will see our argument,
+    // not the reader buffer.
+    builtin_commandline_scoped_transient_t temp_buffer(cmdline);
+
+    if (recursion_level < 1) {
+        recursion_level++;
+
+        std::vector<completion_t> comp;
+        complete(cmdline, &comp, COMPLETION_REQUEST_DEFAULT, times);
+
+        for (size_t i = 0; i < comp.size(); i++) {
+            const completion_t &next = comp.at(i);
+
+            // Make a fake commandline, and then apply the completion to it.
+            const wcstring faux_cmdline = token;
+            size_t tmp_cursor = faux_cmdline.size();
+            wcstring faux_cmdline_with_completion = completion_apply_to_command_line(
+                next.completion, next.flags, faux_cmdline, &tmp_cursor, false);
+
+            // completion_apply_to_command_line will append a space unless COMPLETE_NO_SPACE is
+            // set. We don't want to set COMPLETE_NO_SPACE because that won't close quotes. What we
+            // want is to close the quote, but not append the space. So we just look for the space
+            // and clear it.
+            if (!(next.flags & COMPLETE_NO_SPACE) &&
+                string_suffixes_string(L" ", faux_cmdline_with_completion)) {
+                faux_cmdline_with_completion.resize(faux_cmdline_with_completion.size() - 1);
+            }
+
+            // The input data is meant to be something like you would have on the command line,
+            // e.g. includes backslashes. The output should be raw, i.e. unescaped. So we need to
+            // unescape the command line. See #1127.
+            unescape_string_in_place(&faux_cmdline_with_completion, UNESCAPE_DEFAULT);
+
+            // Append any description.
+            if (!next.description.empty()) {
+                faux_cmdline_with_completion.push_back(L'\t');
+                faux_cmdline_with_completion.append(next.description);
+            }
+            result.push_back(std::move(faux_cmdline_with_completion));
+        }
+
+        recursion_level--;
+    }
+    return result;
+}
+
+int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+    ASSERT_IS_MAIN_THREAD();
 
     wchar_t *cmd = argv[0];
     int argc = builtin_count_args(argv);
@@ -129,6 +201,8 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     wcstring_list_t path;
     wcstring_list_t wrap_targets;
     bool preserve_order = false;
+    bool profile = false;
+    int cache_ttl = 0;
 
     static const wchar_t *short_options = L":a:c:p:s:l:o:d:frxeuAn:C::w:hk";
     static const struct woption long_options[] = {{L"exclusive", no_argument, NULL, 'x'},
@@ -149,6 +223,8 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
                                                   {L"do-complete", optional_argument, NULL, 'C'},
                                                   {L"help", no_argument, NULL, 'h'},
                                                   {L"keep-order", no_argument, NULL, 'k'},
+                                                  {L"profile", no_argument, NULL, 1},
+                                                  {L"cache-ttl", required_argument, NULL, 2},
                                                   {NULL, 0, NULL, 0}};
 
     int opt;
@@ -171,6 +247,19 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
                 preserve_order = true;
                 break;
             }
+            case 1: {
+                profile = true;
+                break;
+            }
+            case 2: {
+                cache_ttl = fish_wcstoi(w.woptarg);
+                if (errno || cache_ttl < 0) {
+                    streams.err.append_format(_(L"%ls: Invalid cache time '%ls'\n"), cmd,
+                                              w.woptarg);
+                    return STATUS_INVALID_ARGS;
+                }
+                break;
+            }
             case 'p':
             case 'c': {
                 wcstring tmp;
@@ -274,6 +363,11 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         return STATUS_INVALID_ARGS;
     }
 
+    if (profile && !do_complete) {
+        streams.err.append_format(_(L"%ls: --profile requires --do-complete\n"), cmd);
+        return STATUS_INVALID_ARGS;
+    }
+
     if (condition && wcslen(condition)) {
         const wcstring condition_string = condition;
         parse_error_list_t errors;
@@ -305,59 +399,17 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     }
 
     if (do_complete) {
-        const wchar_t *token;
-
-        parse_util_token_extent(do_complete_param.c_str(), do_complete_param.size(), &token, 0, 0,
-                                0);
-
-        // Create a scoped transient command line, so that bulitin_commandline will see our
-        // argument, not the reader buffer.
-        builtin_commandline_scoped_transient_t temp_buffer(do_complete_param);
-
-        if (recursion_level < 1) {
-            recursion_level++;
-
-            std::vector<completion_t> comp;
-            complete(do_complete_param, &comp, COMPLETION_REQUEST_DEFAULT);
-
-            for (size_t i = 0; i < comp.size(); i++) {
-                const completion_t &next = comp.at(i);
-
-                // Make a fake commandline, and then apply the completion to it.
-                const wcstring faux_cmdline = token;
-                size_t tmp_cursor = faux_cmdline.size();
-                wcstring faux_cmdline_with_completion = completion_apply_to_command_line(
-                    next.completion, next.flags, faux_cmdline, &tmp_cursor, false);
-
-                // completion_apply_to_command_line will append a space unless COMPLETE_NO_SPACE
-                // is set. We don't want to set COMPLETE_NO_SPACE because that won't close
-                // quotes. What we want is to close the quote, but not append the space. So we
-                // just look for the space and clear it.
-                if (!(next.flags & COMPLETE_NO_SPACE) &&
-                    string_suffixes_string(L" ", faux_cmdline_with_completion)) {
-                    faux_cmdline_with_completion.resize(faux_cmdline_with_completion.size() - 1);
-                }
-
-                // The input data is meant to be something like you would have on the command
-                // line, e.g. includes backslashes. The output should be raw, i.e. unescaped. So
-                // we need to unescape the command line. See #1127.
-                unescape_string_in_place(&faux_cmdline_with_completion, UNESCAPE_DEFAULT);
-                streams.out.append(faux_cmdline_with_completion);
-
-                // Append any description.
-                if (!next.description.empty()) {
-                    streams.out.push_back(L'\t');
-                    streams.out.append(next.description);
-                }
-                streams.out.push_back(L'\n');
-            }
-
-            recursion_level--;
+        complete_profile_t times;
+        for (const wcstring &line :
+             builtin_complete_do_complete(do_complete_param, profile ? &times : NULL)) {
+            streams.out.append(line);
+            streams.out.push_back(L'\n');
         }
+        if (profile) builtin_complete_print_profile(times, streams);
     } else if (cmd_to_complete.empty() && path.empty()) {
         // No arguments specified, meaning we print the definitions of all specified completions
         // to stdout.
-        streams.out.append(complete_print());
+        complete_print(streams.out);
     } else {
         int flags = COMPLETE_AUTO_SPACE;
         if (preserve_order) {
@@ -368,7 +420,7 @@ int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
             builtin_complete_remove(cmd_to_complete, path, short_opt.c_str(), gnu_opt, old_opt);
         } else {
             builtin_complete_add(cmd_to_complete, path, short_opt.c_str(), gnu_opt, old_opt,
-                                 result_mode, condition, comp, desc, flags);
+                                 result_mode, condition, comp, desc, flags, cache_ttl);
         }
 
         // Handle wrap targets (probably empty). We only wrap commands, not paths.
@@ -6,7 +6,17 @@
 
 #include <cstring>
 
+#include "common.h"
+
 class parser_t;
+struct complete_profile_t;
+struct io_streams_t;
 
 int builtin_complete(parser_t &parser, io_streams_t &streams, wchar_t **argv);
+
+/// Complete the given command line as `complete --do-complete` does. Returns a line for each
+/// completion: the token being completed with the completion applied, unescaped, followed by a tab
+/// and the description if there is one. If times is given, it is filled in as by complete().
+wcstring_list_t builtin_complete_do_complete(const wcstring &cmdline,
+                                             complete_profile_t *times = NULL);
 #endif
@@ -7,6 +7,7 @@
 #include "builtin.h"
 #include "builtin_contains.h"
 #include "common.h"
+#include "env.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
 #include "wgetopt.h"
@@ -15,10 +16,13 @@
 struct contains_cmd_opts_t {
     bool print_help = false;
     bool print_index = false;
+    const wchar_t *set_var = NULL;
 };
-static const wchar_t *short_options = L"+:hi";
-static const struct woption long_options[] = {
-    {L"help", no_argument, NULL, 'h'}, {L"index", no_argument, NULL, 'i'}, {NULL, 0, NULL, 0}};
+static const wchar_t *short_options = L"+:his:";
+static const struct woption long_options[] = {{L"help", no_argument, NULL, 'h'},
+                                              {L"index", no_argument, NULL, 'i'},
+                                              {L"set", required_argument, NULL, 's'},
+                                              {NULL, 0, NULL, 0}};
 
 static int parse_cmd_opts(contains_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
                           parser_t &parser, io_streams_t &streams) {
@@ -35,6 +39,10 @@ static int parse_cmd_opts(contains_cmd_opts_t &opts, int *optind, int argc, wcha
                 opts.print_index = true;
                 break;
             }
+            case 's': {
+                opts.set_var = w.woptarg;
+                break;
+            }
             case ':': {
                 builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
                 return STATUS_INVALID_ARGS;
@@ -70,6 +78,26 @@ int builtin_contains(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         return STATUS_CMD_OK;
     }
 
+    if (opts.set_var) {
+        // Look up every key in the list variable. The variable keeps a hash index of its values,
+        // so this does not scan the list for each key.
+        if (optind == argc) {
+            streams.err.append_format(_(L"%ls: Key not specified\n"), cmd);
+            return STATUS_CMD_ERROR;
+        }
+        const auto var = env_get(opts.set_var);
+        retval = STATUS_CMD_OK;
+        for (int i = optind; i < argc; i++) {
+            size_t pos = var ? var->find_value(argv[i]) : 0;
+            if (pos == 0) {
+                retval = STATUS_CMD_ERROR;
+            } else if (opts.print_index) {
+                streams.out.append_format(L"%lu\n", static_cast<unsigned long>(pos));
+            }
+        }
+        return retval;
+    }
+
     wchar_t *needle = argv[optind];
     if (!needle) {
         streams.err.append_format(_(L"%ls: Key not specified\n"), cmd);
@@ -0,0 +1,216 @@
+// Implementation of the coproc builtin, which starts long-lived helper processes and sends them
+// requests.
+#include "config.h"  // IWYU pragma: keep
+
+#include <errno.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "builtin.h"
+#include "builtin_coproc.h"
+#include "common.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "io.h"
+#include "path.h"
+#include "proc.h"
+#include "wgetopt.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+enum coproc_cmd_t { COPROC_LIST = 1, COPROC_SEND, COPROC_START, COPROC_STOP, COPROC_UNDEF };
+
+// Must be sorted by string, not enum or random.
+const enum_map<coproc_cmd_t> coproc_enum_map[] = {{COPROC_LIST, L"list"},
+                                                  {COPROC_SEND, L"send"},
+                                                  {COPROC_START, L"start"},
+                                                  {COPROC_STOP, L"stop"},
+                                                  {COPROC_UNDEF, NULL}};
+#define coproc_enum_map_len (sizeof coproc_enum_map / sizeof *coproc_enum_map)
+
+struct coproc_cmd_opts_t {
+    bool print_help = false;
+    long timeout_ms = -1;
+};
+static const wchar_t *short_options = L"+:ht:";
+static const struct woption long_options[] = {{L"help", no_argument, NULL, 'h'},
+                                              {L"timeout", required_argument, NULL, 't'},
+                                              {NULL, 0, NULL, 0}};
+
+/// Parse the options, which follow the subcommand. argv[0] is the subcommand, or the name of the
+/// builtin if there is none.
+static int parse_cmd_opts(coproc_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
+                          const wchar_t *cmd, parser_t &parser, io_streams_t &streams) {
+    int opt;
+    wgetopter_t w;
+    while ((opt = w.wgetopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': {
+                opts.print_help = true;
+                break;
+            }
+            case 't': {
+                opts.timeout_ms = fish_wcstol(w.woptarg);
+                if (errno || opts.timeout_ms < 0) {
+                    streams.err.append_format(_(L"%ls: Invalid timeout '%ls'\n"), cmd, w.woptarg);
+                    return STATUS_INVALID_ARGS;
+                }
+                break;
+            }
+            case ':': {
+                builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            case '?': {
+                builtin_unknown_option(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            default: {
+                DIE("unexpected retval from wgetopt_long");
+                break;
+            }
+        }
+    }
+
+    *optind = w.woptind;
+    return STATUS_CMD_OK;
+}
+
+static int coproc_start_cmd(const wchar_t *cmd, const wcstring_list_t &args,
+                            io_streams_t &streams) {
+    if (args.size() < 2) {
+        streams.err.append_format(BUILTIN_ERR_MIN_ARG_COUNT1, cmd, 2, (int)args.size());
+        return STATUS_INVALID_ARGS;
+    }
+    const wcstring &name = args.at(0);
+    const wcstring_list_t names = coproc_get_names();
+    if (contains(names, name)) {
+        streams.err.append_format(_(L"%ls: '%ls' is already running\n"), cmd, name.c_str());
+        return STATUS_CMD_ERROR;
+    }
+
+    const wcstring_list_t command(args.begin() + 1, args.end());
+    wcstring path;
+    if (!path_get_path(command.at(0), &path)) {
+        streams.err.append_format(_(L"%ls: Unknown command '%ls'\n"), cmd,
+                                  command.at(0).c_str());
+        return STATUS_CMD_UNKNOWN;
+    }
+    int err = coproc_start(name, path, command);
+    if (err) {
+        streams.err.append_format(_(L"%ls: Failed to run '%ls': %s\n"), cmd, path.c_str(),
+                                  strerror(err));
+        return STATUS_CMD_ERROR;
+    }
+    return STATUS_CMD_OK;
+}
+
+static int coproc_send_cmd(const wchar_t *cmd, const coproc_cmd_opts_t &opts,
+                           const wcstring_list_t &args, io_streams_t &streams) {
+    if (args.empty()) {
+        streams.err.append_format(BUILTIN_ERR_MIN_ARG_COUNT1, cmd, 1, 0);
+        return STATUS_INVALID_ARGS;
+    }
+    const wcstring &name = args.at(0);
+    wcstring request;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (i > 1) request.push_back(L' ');
+        request.append(args.at(i));
+    }
+    if (request.find(L'\n') != wcstring::npos) {
+        streams.err.append_format(_(L"%ls: A request must be a single line\n"), cmd);
+        return STATUS_INVALID_ARGS;
+    }
+
+    wcstring_list_t response;
+    switch (coproc_request(name, request, opts.timeout_ms, &response)) {
+        case COPROC_OK: {
+            for (const wcstring &line : response) {
+                streams.out.append(line);
+                streams.out.push_back(L'\n');
+            }
+            return STATUS_CMD_OK;
+        }
+        case COPROC_UNKNOWN: {
+            streams.err.append_format(_(L"%ls: No co-process named '%ls'\n"), cmd, name.c_str());
+            break;
+        }
+        case COPROC_EXITED: {
+            streams.err.append_format(_(L"%ls: '%ls' exited without answering\n"), cmd,
+                                      name.c_str());
+            break;
+        }
+        case COPROC_TIMED_OUT: {
+            streams.err.append_format(_(L"%ls: '%ls' did not answer in time, and was stopped\n"),
+                                      cmd, name.c_str());
+            break;
+        }
+    }
+    return STATUS_CMD_ERROR;
+}
+
+/// The coproc builtin, for starting, using and stopping co-processes. See proc.h.
+int builtin_coproc(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+    wchar_t *cmd = argv[0];
+    int argc = builtin_count_args(argv);
+
+    // The subcommand comes first, so that options after a command to start are left to it.
+    coproc_cmd_t subcmd = COPROC_UNDEF;
+    int first = 0;
+    if (argc > 1 && argv[1][0] != L'-') {
+        subcmd = str_to_enum(argv[1], coproc_enum_map, coproc_enum_map_len);
+        if (subcmd == COPROC_UNDEF) {
+            streams.err.append_format(BUILTIN_ERR_INVALID_SUBCMD, cmd, argv[1]);
+            return STATUS_INVALID_ARGS;
+        }
+        first = 1;
+    }
+
+    coproc_cmd_opts_t opts;
+    int optind;
+    int retval =
+        parse_cmd_opts(opts, &optind, argc - first, argv + first, cmd, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    if (opts.print_help) {
+        builtin_print_help(parser, streams, cmd, streams.out);
+        return STATUS_CMD_OK;
+    }
+
+    const wcstring_list_t args(argv + first + optind, argv + argc);
+    switch (subcmd) {
+        case COPROC_UNDEF: {
+            streams.err.append_format(BUILTIN_ERR_MISSING_SUBCMD, cmd);
+            builtin_print_help(parser, streams, cmd, streams.err);
+            return STATUS_INVALID_ARGS;
+        }
+        case COPROC_START: {
+            return coproc_start_cmd(cmd, args, streams);
+        }
+        case COPROC_SEND: {
+            return coproc_send_cmd(cmd, opts, args, streams);
+        }
+        case COPROC_STOP: {
+            for (const wcstring &name : args) {
+                if (!coproc_stop(name)) {
+                    streams.err.append_format(_(L"%ls: No co-process named '%ls'\n"), cmd,
+                                              name.c_str());
+                    retval = STATUS_CMD_ERROR;
+                }
+            }
+            return retval;
+        }
+        case COPROC_LIST: {
+            if (!args.empty()) {
+                streams.err.append_format(BUILTIN_ERR_ARG_COUNT2, cmd, L"list", 0,
+                                          (int)args.size());
+                return STATUS_INVALID_ARGS;
+            }
+            for (const wcstring &name : coproc_get_names()) {
+                streams.out.append(name);
+                streams.out.push_back(L'\n');
+            }
+            return STATUS_CMD_OK;
+        }
+    }
+    DIE("unexpected coproc subcommand");
+    return STATUS_CMD_ERROR;
+}
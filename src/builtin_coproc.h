@@ -0,0 +1,9 @@
+// Prototypes for executing builtin_coproc function.
+#ifndef FISH_BUILTIN_COPROC_H
+#define FISH_BUILTIN_COPROC_H
+
+class parser_t;
+struct io_streams_t;
+
+int builtin_coproc(parser_t &parser, io_streams_t &streams, wchar_t **argv);
+#endif
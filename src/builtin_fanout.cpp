@@ -0,0 +1,369 @@
+// Implementation of the fanout builtin, which runs a command once per line of its input with
+// several of those commands running at a time.
+#include "config.h"  // IWYU pragma: keep
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "builtin.h"
+#include "builtin_fanout.h"
+#include "builtin_functions.h"
+#include "common.h"
+#include "env.h"
+#include "exec.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "function.h"
+#include "io.h"
+#include "parser.h"
+#include "path.h"
+#include "postfork.h"
+#include "proc.h"
+#include "reader.h"
+#include "wgetopt.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+/// Number of bytes read from stdin or a child's output at a time.
+#define FANOUT_CHUNK_SIZE 65536
+
+/// How long to wait for a child that has closed its output to exit, in milliseconds, before
+/// checking again.
+#define FANOUT_EXIT_POLL_MS 10
+
+/// The text that is replaced by the input in the command's arguments.
+#define FANOUT_PLACEHOLDER L"{}"
+
+struct fanout_cmd_opts_t {
+    bool print_help = false;
+    long max_jobs = 0;
+};
+static const wchar_t *short_options = L"+:hj:";
+static const struct woption long_options[] = {
+    {L"help", no_argument, NULL, 'h'}, {L"jobs", required_argument, NULL, 'j'}, {NULL, 0, NULL, 0}};
+
+static int parse_cmd_opts(fanout_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
+                          parser_t &parser, io_streams_t &streams) {
+    wchar_t *cmd = argv[0];
+    int opt;
+    wgetopter_t w;
+    while ((opt = w.wgetopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': {
+                opts.print_help = true;
+                break;
+            }
+            case 'j': {
+                opts.max_jobs = fish_wcstol(w.woptarg);
+                if (errno || opts.max_jobs < 1) {
+                    streams.err.append_format(_(L"%ls: Invalid number of jobs '%ls'\n"), cmd,
+                                              w.woptarg);
+                    return STATUS_INVALID_ARGS;
+                }
+                break;
+            }
+            case ':': {
+                builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            case '?': {
+                builtin_unknown_option(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            default: {
+                DIE("unexpected retval from wgetopt_long");
+                break;
+            }
+        }
+    }
+
+    *optind = w.woptind;
+    return STATUS_CMD_OK;
+}
+
+namespace {
+/// Yields the lines of stdin, reading it a block at a time as more lines are needed.
+class fanout_input_t {
+    int fd;
+    std::string buffer;
+    size_t start = 0;
+    bool at_eof = false;
+
+   public:
+    explicit fanout_input_t(int fd_) : fd(fd_) {}
+
+    /// Store the next line in *out and return true, or return false if there are no more.
+    bool next(wcstring *out) {
+        for (;;) {
+            size_t newline = buffer.find('\n', start);
+            if (newline != std::string::npos) {
+                *out = str2wcstring(buffer.data() + start, newline - start);
+                start = newline + 1;
+                return true;
+            }
+            if (at_eof) {
+                // The last line need not end in a newline.
+                if (start == buffer.size()) return false;
+                *out = str2wcstring(buffer.data() + start, buffer.size() - start);
+                start = buffer.size();
+                return true;
+            }
+
+            buffer.erase(0, start);
+            start = 0;
+            size_t old_size = buffer.size();
+            buffer.resize(old_size + FANOUT_CHUNK_SIZE);
+            long rc = read_blocked(fd, &buffer[old_size], FANOUT_CHUNK_SIZE);
+            buffer.resize(old_size + (rc > 0 ? rc : 0));
+            if (rc <= 0) at_eof = true;
+        }
+    }
+};
+
+/// One run of the command, and the output it has written so far.
+struct fanout_job_t {
+    pid_t pid = -1;
+    // The read ends of the pipes for the child's stdout and stderr, or -1 once they are at EOF.
+    int fds[2] = {-1, -1};
+    std::string output[2];
+    int status = 0;
+    bool exited = false;
+
+    bool output_closed() const { return fds[0] < 0 && fds[1] < 0; }
+    bool finished() const { return exited && output_closed(); }
+};
+}  // anonymous namespace
+
+/// Return \p arg with every placeholder replaced by \p input.
+static wcstring fanout_substitute(const wcstring &arg, const wcstring &input) {
+    const size_t placeholder_len = wcslen(FANOUT_PLACEHOLDER);
+    wcstring result;
+    size_t start = 0, found;
+    while ((found = arg.find(FANOUT_PLACEHOLDER, start)) != wcstring::npos) {
+        result.append(arg, start, found - start);
+        result.append(input);
+        start = found + placeholder_len;
+    }
+    result.append(arg, start, wcstring::npos);
+    return result;
+}
+
+/// Start a job for the given arguments. If it could not be started, the job is finished with an
+/// error message as its output.
+static void fanout_start(fanout_job_t *job, const std::string &path, const wcstring_list_t &args) {
+    std::vector<std::string> narrow_args;
+    narrow_args.reserve(args.size());
+    for (const wcstring &arg : args) narrow_args.push_back(wcs2string(arg));
+    null_terminated_array_t<char> argv_array(narrow_args);
+
+    int out_pipe[2], err_pipe[2];
+    if (exec_pipe(out_pipe) != 0) {
+        job->output[1] = wcs2string(format_string(_(L"fanout: Could not create pipe: %s\n"),
+                                                  strerror(errno)));
+        job->status = STATUS_CMD_ERROR;
+        job->exited = true;
+        return;
+    }
+    if (exec_pipe(err_pipe) != 0) {
+        job->output[1] = wcs2string(format_string(_(L"fanout: Could not create pipe: %s\n"),
+                                                  strerror(errno)));
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        job->status = STATUS_CMD_ERROR;
+        job->exited = true;
+        return;
+    }
+
+    job->pid = spawn_with_output_fds(path.c_str(), argv_array.get(), env_export_arr(),
+                                     out_pipe[1], err_pipe[1]);
+    int spawn_errno = errno;
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (job->pid < 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        job->output[1] = wcs2string(format_string(_(L"fanout: Failed to run '%s': %s\n"),
+                                                  path.c_str(), strerror(spawn_errno)));
+        job->status = spawn_errno == ENOENT ? STATUS_CMD_UNKNOWN : STATUS_NOT_EXECUTABLE;
+        job->exited = true;
+        return;
+    }
+    job->fds[0] = out_pipe[0];
+    job->fds[1] = err_pipe[0];
+}
+
+/// Wait until one of the running jobs writes output or may have exited, and collect that.
+static void fanout_wait(std::deque<fanout_job_t> &jobs) {
+    std::vector<struct pollfd> pollfds;
+    std::vector<std::pair<fanout_job_t *, int>> owners;
+    bool awaiting_exit = false;
+    for (fanout_job_t &job : jobs) {
+        for (int i = 0; i < 2; i++) {
+            if (job.fds[i] < 0) continue;
+            struct pollfd pfd = {job.fds[i], POLLIN, 0};
+            pollfds.push_back(pfd);
+            owners.push_back(std::make_pair(&job, i));
+        }
+        if (!job.exited && job.output_closed()) awaiting_exit = true;
+    }
+
+    int timeout = awaiting_exit ? FANOUT_EXIT_POLL_MS : -1;
+    int ready = poll(pollfds.data(), pollfds.size(), timeout);
+    if (ready < 0 && errno != EINTR) wperror(L"poll");
+
+    char buff[FANOUT_CHUNK_SIZE];
+    for (size_t i = 0; ready > 0 && i < pollfds.size(); i++) {
+        if (!pollfds[i].revents) continue;
+        fanout_job_t *job = owners[i].first;
+        int which = owners[i].second;
+        long rc = read(job->fds[which], buff, sizeof buff);
+        if (rc > 0) {
+            job->output[which].append(buff, rc);
+        } else if (rc == 0 || (errno != EINTR && errno != EAGAIN)) {
+            close(job->fds[which]);
+            job->fds[which] = -1;
+        }
+    }
+
+    // A child closing its output usually means it is about to exit. Children are only waited for
+    // once they have, so that a full pipe can never keep one from exiting.
+    for (fanout_job_t &job : jobs) {
+        if (job.exited || !job.output_closed()) continue;
+        int status;
+        pid_t pid = waitpid(job.pid, &status, WNOHANG);
+        if (pid == job.pid) {
+            job.status = proc_format_status(status);
+            job.exited = true;
+        } else if (pid < 0 && errno != EINTR) {
+            job.status = STATUS_CMD_ERROR;
+            job.exited = true;
+        }
+    }
+}
+
+/// The fanout builtin. Each line of stdin is passed to a run of the command, and up to --jobs of
+/// those run at the same time. The output of each run is collected and written in input order.
+int builtin_fanout(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+    const wchar_t *cmd = argv[0];
+    int argc = builtin_count_args(argv);
+    fanout_cmd_opts_t opts;
+
+    int optind;
+    int retval = parse_cmd_opts(opts, &optind, argc, argv, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    if (opts.print_help) {
+        builtin_print_help(parser, streams, cmd, streams.out);
+        return STATUS_CMD_OK;
+    }
+
+    if (optind == argc) {
+        streams.err.append_format(BUILTIN_ERR_MIN_ARG_COUNT1, cmd, 1, 0);
+        builtin_print_help(parser, streams, cmd, streams.err);
+        return STATUS_INVALID_ARGS;
+    }
+    if (!streams.stdin_is_directly_redirected) {
+        streams.err.append_format(_(L"%ls: Expected the inputs on standard input\n"), cmd);
+        return STATUS_INVALID_ARGS;
+    }
+
+    if (opts.max_jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opts.max_jobs = cpus > 0 ? cpus : 1;
+    }
+
+    // Functions and builtins only exist in this shell, so they are run by a child fish that is
+    // given the function's definition.
+    const wcstring command = argv[optind];
+    wcstring_list_t template_args(argv + optind, argv + argc);
+    std::string path;
+    wcstring script_prefix;
+    bool in_child_shell = function_exists(command) || builtin_exists(command);
+    if (in_child_shell) {
+        const auto bin_dir = env_get(L"__fish_bin_dir");
+        if (!bin_dir) {
+            streams.err.append_format(_(L"%ls: Could not find the fish executable\n"), cmd);
+            return STATUS_CMD_ERROR;
+        }
+        path = wcs2string(bin_dir->as_string() + L"/fish");
+        if (function_exists(command)) script_prefix = functions_def(command) + L"\n";
+    } else {
+        wcstring actual_cmd;
+        if (!path_get_path(command, &actual_cmd)) {
+            streams.err.append_format(_(L"%ls: Unknown command '%ls'\n"), cmd, command.c_str());
+            return STATUS_CMD_UNKNOWN;
+        }
+        path = wcs2string(actual_cmd);
+    }
+
+    bool has_placeholder = false;
+    for (size_t i = 1; i < template_args.size(); i++) {
+        if (template_args[i].find(FANOUT_PLACEHOLDER) != wcstring::npos) has_placeholder = true;
+    }
+
+    fanout_input_t inputs(streams.stdin_fd);
+    std::deque<fanout_job_t> jobs;  // in input order; the front is the next to be written
+    long running = 0;
+    bool more_input = true;
+    bool interrupted = false;
+    retval = STATUS_CMD_OK;
+    for (;;) {
+        while (more_input && running < opts.max_jobs && !interrupted) {
+            wcstring input;
+            if (!inputs.next(&input)) {
+                more_input = false;
+                break;
+            }
+
+            wcstring_list_t args = template_args;
+            if (has_placeholder) {
+                for (size_t i = 1; i < args.size(); i++) {
+                    args[i] = fanout_substitute(args[i], input);
+                }
+            } else {
+                args.push_back(std::move(input));
+            }
+            if (in_child_shell) {
+                wcstring script = script_prefix;
+                for (size_t i = 0; i < args.size(); i++) {
+                    if (i > 0) script.push_back(L' ');
+                    script.append(escape_string(args[i], ESCAPE_ALL));
+                }
+                args = {L"fish", L"-c", std::move(script)};
+            }
+
+            jobs.emplace_back();
+            fanout_start(&jobs.back(), path, args);
+            if (!jobs.back().finished()) running++;
+        }
+
+        while (!jobs.empty() && jobs.front().finished()) {
+            const fanout_job_t &job = jobs.front();
+            streams.out.append(str2wcstring(job.output[0]));
+            streams.err.append(str2wcstring(job.output[1]));
+            if (job.status != STATUS_CMD_OK && retval == STATUS_CMD_OK) retval = job.status;
+            jobs.pop_front();
+        }
+
+        if (running == 0 && (!more_input || interrupted)) break;
+
+        // The children are in our process group, so they get the same SIGINT; stop starting new
+        // ones and let the running ones finish.
+        fanout_wait(jobs);
+        if (reader_interrupted()) interrupted = true;
+        running = 0;
+        for (const fanout_job_t &job : jobs) {
+            if (!job.finished()) running++;
+        }
+    }
+
+    if (interrupted) return 128 + SIGINT;
+    return retval;
+}
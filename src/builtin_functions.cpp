@@ -5,7 +5,6 @@
 #include <unistd.h>
 #include <wchar.h>
 
-#include <algorithm>
 #include <map>
 #include <memory>
 #include <string>
@@ -107,13 +106,15 @@ static int parse_cmd_opts(functions_cmd_opts_t &opts, int *optind,  //!OCLINT(hi
     return STATUS_CMD_OK;
 }
 
-/// Return a definition of the specified function. Used by the functions builtin.
-static wcstring functions_def(const wcstring &name) {
+/// Return a definition of the specified function. Used by the functions and fanout builtins.
+wcstring functions_def(const wcstring &name) {
     CHECK(!name.empty(), L"");  //!OCLINT(multiple unary operator)
     wcstring out;
-    wcstring desc, def;
+    wcstring desc;
     function_get_desc(name, &desc);
-    function_get_definition(name, &def);
+    const function_definition_ref_t props = function_get_definition_ref(name);
+    if (!props) return out;
+    const wcstring &def = props->source;
     event_t search(EVENT_ANY);
     search.function_name = name;
     std::vector<std::shared_ptr<event_t>> ev;
@@ -172,7 +173,7 @@ static wcstring functions_def(const wcstring &name) {
         }
     }
 
-    wcstring_list_t named = function_get_named_arguments(name);
+    const wcstring_list_t &named = props->named_arguments;
     if (!named.empty()) {
         append_format(out, L" --argument");
         for (size_t i = 0; i < named.size(); i++) {
@@ -187,7 +188,7 @@ static wcstring functions_def(const wcstring &name) {
     }
 
     // Output any inherited variables as `set -l` lines.
-    std::map<wcstring, env_var_t> inherit_vars = function_get_inherit_vars(name);
+    const std::map<wcstring, env_var_t> &inherit_vars = props->inherit_vars;
     for (std::map<wcstring, env_var_t>::const_iterator it = inherit_vars.begin(),
                                                        end = inherit_vars.end();
          it != end; ++it) {
@@ -314,8 +315,7 @@ int builtin_functions(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     }
 
     if (opts.list || argc == optind) {
-        wcstring_list_t names = function_get_names(opts.show_hidden);
-        std::sort(names.begin(), names.end());
+        const wcstring_list_t names = function_get_names(opts.show_hidden);
         bool is_screen = !streams.out_is_redirected && isatty(STDOUT_FILENO);
         if (is_screen) {
             wcstring buff;
@@ -2,8 +2,13 @@
 #ifndef FISH_BUILTIN_FUNCTIONS_H
 #define FISH_BUILTIN_FUNCTIONS_H
 
+#include "common.h"
+
 class parser_t;
 struct io_streams_t;
 
 int builtin_functions(parser_t &parser, io_streams_t &streams, wchar_t **argv);
+
+/// Return a definition of the specified function, as printed by `functions NAME`.
+wcstring functions_def(const wcstring &name);
 #endif
@@ -0,0 +1,112 @@
+// Implementation of the hash builtin.
+#include "config.h"  // IWYU pragma: keep
+
+#include <wchar.h>
+
+#include <vector>
+
+#include "builtin.h"
+#include "builtin_hash.h"
+#include "common.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "io.h"
+#include "path.h"
+#include "wgetopt.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+struct hash_cmd_opts_t {
+    bool print_help = false;
+    bool reset = false;
+    bool forget = false;
+};
+static const wchar_t *short_options = L":dhr";
+static const struct woption long_options[] = {{L"delete", no_argument, NULL, 'd'},
+                                              {L"help", no_argument, NULL, 'h'},
+                                              {L"reset", no_argument, NULL, 'r'},
+                                              {NULL, 0, NULL, 0}};
+
+static int parse_cmd_opts(hash_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
+                          parser_t &parser, io_streams_t &streams) {
+    wchar_t *cmd = argv[0];
+    int opt;
+    wgetopter_t w;
+    while ((opt = w.wgetopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': {
+                opts.forget = true;
+                break;
+            }
+            case 'h': {
+                opts.print_help = true;
+                break;
+            }
+            case 'r': {
+                opts.reset = true;
+                break;
+            }
+            case ':': {
+                builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            case '?': {
+                builtin_unknown_option(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            default: {
+                DIE("unexpected retval from wgetopt_long");
+                break;
+            }
+        }
+    }
+
+    *optind = w.woptind;
+    return STATUS_CMD_OK;
+}
+
+/// The hash builtin, for showing and resetting the cache of where commands were found in $PATH.
+int builtin_hash(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+    const wchar_t *cmd = argv[0];
+    int argc = builtin_count_args(argv);
+    hash_cmd_opts_t opts;
+
+    int optind;
+    int retval = parse_cmd_opts(opts, &optind, argc, argv, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    if (opts.print_help) {
+        builtin_print_help(parser, streams, cmd, streams.out);
+        return STATUS_CMD_OK;
+    }
+
+    if (opts.reset) {
+        if (opts.forget || optind != argc) {
+            streams.err.append_format(BUILTIN_ERR_COMBO, cmd);
+            return STATUS_INVALID_ARGS;
+        }
+        path_cache_reset();
+        return STATUS_CMD_OK;
+    }
+
+    if (opts.forget && optind == argc) {
+        streams.err.append_format(BUILTIN_ERR_MIN_ARG_COUNT1, cmd, 1, 0);
+        return STATUS_INVALID_ARGS;
+    }
+
+    if (optind == argc) {
+        for (const path_cache_item_t &item : path_cache_items()) {
+            streams.out.append_format(L"%lu\t%ls\n", item.hits, item.path.c_str());
+        }
+        return STATUS_CMD_OK;
+    }
+
+    // Forget or look up the given commands; the latter remembers them.
+    retval = STATUS_CMD_OK;
+    for (int i = optind; i < argc; i++) {
+        bool found = opts.forget ? path_cache_forget(argv[i]) : path_get_path(argv[i], NULL);
+        if (!found) {
+            streams.err.append_format(_(L"%ls: %ls: not found\n"), cmd, argv[i]);
+            retval = STATUS_CMD_ERROR;
+        }
+    }
+    return retval;
+}
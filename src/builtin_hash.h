@@ -0,0 +1,9 @@
+// Prototypes for executing builtin_hash function.
+#ifndef FISH_BUILTIN_HASH_H
+#define FISH_BUILTIN_HASH_H
+
+class parser_t;
+struct io_streams_t;
+
+int builtin_hash(parser_t &parser, io_streams_t &streams, wchar_t **argv);
+#endif
@@ -19,12 +19,22 @@
 #include "wgetopt.h"
 #include "wutil.h"  // IWYU pragma: keep
 
-enum hist_cmd_t { HIST_SEARCH = 1, HIST_DELETE, HIST_CLEAR, HIST_MERGE, HIST_SAVE, HIST_UNDEF };
+enum hist_cmd_t {
+    HIST_SEARCH = 1,
+    HIST_DELETE,
+    HIST_CLEAR,
+    HIST_MERGE,
+    HIST_SAVE,
+    HIST_STATS,
+    HIST_EXPORT,
+    HIST_UNDEF
+};
 
 // Must be sorted by string, not enum or random.
-const enum_map<hist_cmd_t> hist_enum_map[] = {{HIST_CLEAR, L"clear"},   {HIST_DELETE, L"delete"},
-                                              {HIST_MERGE, L"merge"},   {HIST_SAVE, L"save"},
-                                              {HIST_SEARCH, L"search"}, {HIST_UNDEF, NULL}};
+const enum_map<hist_cmd_t> hist_enum_map[] = {
+    {HIST_CLEAR, L"clear"},   {HIST_DELETE, L"delete"}, {HIST_EXPORT, L"export"},
+    {HIST_MERGE, L"merge"},   {HIST_SAVE, L"save"},     {HIST_SEARCH, L"search"},
+    {HIST_STATS, L"stats"},   {HIST_UNDEF, NULL}};
 #define hist_enum_map_len (sizeof hist_enum_map / sizeof *hist_enum_map)
 
 struct history_cmd_opts_t {
@@ -293,6 +303,35 @@ int builtin_history(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
             history->save();
             break;
         }
+        case HIST_EXPORT: {
+            CHECK_FOR_UNEXPECTED_HIST_ARGS(opts.hist_cmd)
+            history->export_records(streams.out);
+            break;
+        }
+        case HIST_STATS: {
+            CHECK_FOR_UNEXPECTED_HIST_ARGS(opts.hist_cmd)
+            const history_memory_stats_t stats = history->memory_stats();
+            streams.out.append_format(_(L"new items: %lu (%lu bytes)\n"),
+                                      (unsigned long)stats.new_item_count,
+                                      (unsigned long)stats.new_item_bytes);
+            streams.out.append_format(_(L"old items: %lu (%lu bytes of offsets)\n"),
+                                      (unsigned long)stats.old_item_count,
+                                      (unsigned long)stats.old_item_offset_bytes);
+            streams.out.append_format(_(L"decoded item cache: %lu (%lu bytes)\n"),
+                                      (unsigned long)stats.decoded_item_count,
+                                      (unsigned long)stats.decoded_item_bytes);
+            streams.out.append_format(
+                _(L"item text: %lu bytes as UTF-8 (%lu as wide characters)\n"),
+                (unsigned long)stats.item_text_bytes, (unsigned long)stats.item_text_wide_bytes);
+            streams.out.append_format(_(L"trigram index: %lu bytes\n"),
+                                      (unsigned long)stats.trigram_index_bytes);
+            streams.out.append_format(_(L"shared trigram index: %lu (%lu bytes)\n"),
+                                      (unsigned long)stats.shared_index_item_count,
+                                      (unsigned long)stats.shared_index_bytes);
+            streams.out.append_format(_(L"memory limit: %lu bytes\n"),
+                                      (unsigned long)stats.limit);
+            break;
+        }
         case HIST_UNDEF: {
             DIE("Unexpected HIST_UNDEF seen");
             break;
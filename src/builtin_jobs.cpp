@@ -26,28 +26,27 @@ enum {
 };
 
 #ifdef HAVE__PROC_SELF_STAT
-/// Calculates the cpu usage (in percent) of the specified job.
-static int cpu_use(const job_t *j) {
+/// Calculates the cpu usage (in percent) of the specified job between the two latest samples of its
+/// processes. Processes are only read again if they lack a second sample, or if their latest sample
+/// is older than jiffies_sample_interval_ms.
+static int cpu_use(job_t *j) {
     double u = 0;
 
+    proc_refresh_jiffies(j);
     for (const process_ptr_t &p : j->processes) {
-        struct timeval t;
-        int jiffies;
-        gettimeofday(&t, 0);
-        jiffies = proc_get_jiffies(p.get());
+        double t1 = 1000000.0 * p->prev_time.tv_sec + p->prev_time.tv_usec;
+        double t2 = 1000000.0 * p->last_time.tv_sec + p->last_time.tv_usec;
+        // There is nothing to compare until the process has been sampled twice.
+        if (p->prev_time.tv_sec == 0 || t2 <= t1) continue;
 
-        double t1 = 1000000.0 * p->last_time.tv_sec + p->last_time.tv_usec;
-        double t2 = 1000000.0 * t.tv_sec + t.tv_usec;
-
-        // fwprintf( stderr, L"t1 %f t2 %f p1 %d p2 %d\n", t1, t2, jiffies, p->last_jiffies );
-        u += ((double)(jiffies - p->last_jiffies)) / (t2 - t1);
+        u += ((double)(p->last_jiffies - p->prev_jiffies)) / (t2 - t1);
     }
     return u * 1000000;
 }
 #endif
 
 /// Print information about the specified job.
-static void builtin_jobs_print(const job_t *j, int mode, int header, io_streams_t &streams) {
+static void builtin_jobs_print(job_t *j, int mode, int header, io_streams_t &streams) {
     switch (mode) {
         case JOBS_DEFAULT: {
             if (header) {
@@ -163,7 +162,7 @@ int builtin_jobs(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     if (print_last) {
         // Ignore unconstructed jobs, i.e. ourself.
         job_iterator_t jobs;
-        const job_t *j;
+        job_t *j;
         while ((j = jobs.next())) {
             if ((j->flags & JOB_CONSTRUCTED) && !job_is_completed(j)) {
                 builtin_jobs_print(j, mode, !streams.out_is_redirected, streams);
@@ -182,7 +181,7 @@ int builtin_jobs(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
                     return STATUS_INVALID_ARGS;
                 }
 
-                const job_t *j = job_get_from_pid(pid);
+                job_t *j = job_get_from_pid(pid);
 
                 if (j && !job_is_completed(j)) {
                     builtin_jobs_print(j, mode, false, streams);
@@ -194,7 +193,7 @@ int builtin_jobs(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
             }
         } else {
             job_iterator_t jobs;
-            const job_t *j;
+            job_t *j;
             while ((j = jobs.next())) {
                 // Ignore unconstructed jobs, i.e. ourself.
                 if ((j->flags & JOB_CONSTRUCTED) && !job_is_completed(j)) {
@@ -5,13 +5,17 @@
 #include <stddef.h>
 
 #include <algorithm>
+#include <deque>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "builtin.h"
 #include "builtin_math.h"
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "lru.h"
 #include "wgetopt.h"
 #include "wutil.h"  // IWYU pragma: keep
 
@@ -22,12 +26,15 @@
 struct math_cmd_opts_t {
     bool print_help = false;
     int scale = 0;
+    /// With --each, the name of the var that holds each number read from stdin.
+    wcstring bulk_var;
 };
 
 // This command is atypical in using the "+" (REQUIRE_ORDER) option for flag parsing.
 // This is needed because of the minus, `-`, operator in math expressions.
-static const wchar_t *short_options = L"+:hs:";
+static const wchar_t *short_options = L"+:e:hs:";
 static const struct woption long_options[] = {{L"scale", required_argument, NULL, 's'},
+                                              {L"each", required_argument, NULL, 'e'},
                                               {L"help", no_argument, NULL, 'h'},
                                               {NULL, 0, NULL, 0}};
 
@@ -47,6 +54,14 @@ static int parse_cmd_opts(math_cmd_opts_t &opts, int *optind,  //!OCLINT(high nc
                 }
                 break;
             }
+            case 'e': {
+                if (!valid_var_name(w.woptarg)) {
+                    streams.err.append_format(BUILTIN_ERR_VARNAME, cmd, w.woptarg);
+                    return STATUS_INVALID_ARGS;
+                }
+                opts.bulk_var = w.woptarg;
+                break;
+            }
             case 'h': {
                 opts.print_help = true;
                 break;
@@ -72,6 +87,9 @@ static int parse_cmd_opts(math_cmd_opts_t &opts, int *optind,  //!OCLINT(high nc
     return STATUS_CMD_OK;
 }
 
+/// How much of stdin to read at a time in bulk mode.
+#define MATH_READ_CHUNK_SIZE 4096
+
 // We read from stdin if we are the second or later process in a pipeline.
 static bool math_args_from_stdin(const io_streams_t &streams) {
     return streams.stdin_is_directly_redirected;
@@ -115,27 +133,16 @@ static const wchar_t *math_get_arg(int *argidx, wchar_t **argv, wcstring *storag
     return math_get_arg_argv(argidx, argv);
 }
 
-// The MuParser mechanism for dynamic lookup of variables requires that we return a unique address
-// for each variable. The following limit is arbitrary but anyone writing a math expression in fish
-// that references more than one hundred unique variables is abusing fish.
-#define MAX_RESULTS 100
-static double double_results[MAX_RESULTS];
-static int next_result = 0;
-
-/// Return a fish var converted to a double. This allows the user to use a bar var name in the
-/// expression. That is `math a + 1` rather than `math $a + 1`.
-static double *retrieve_var(const wchar_t *var_name, void *user_data) {
-    UNUSED(user_data);
-    static double zero_result = 0.0;
-
+/// Return the first element of a fish var converted to a double. Missing and empty vars are zero.
+static double get_var_value(const wchar_t *var_name) {
     auto var = env_get(var_name, ENV_DEFAULT);
     if (!var) {
         // We could report an error but we normally don't treat missing vars as a fatal error.
         // throw mu::ParserError(L"Var '%ls' does not exist.");
-        return &zero_result;
+        return 0.0;
     }
     if (var->empty()) {
-        return &zero_result;
+        return 0.0;
     }
 
     const wchar_t *first_val = var->as_list()[0].c_str();
@@ -148,46 +155,103 @@ static double *retrieve_var(const wchar_t *var_name, void *user_data) {
                  _(L"Var '%ls' not a valid floating point number: '%ls'."), var_name, first_val);
         throw mu::ParserError(errmsg);
     }
+    return result;
+}
+
+/// Implement integer modulo math operator.
+static double moduloOperator(double v, double w) { return (int)v % std::max(1, (int)w); };
+
+static double *retrieve_var(const wchar_t *var_name, void *user_data);
+
+/// A parsed expression together with the storage for the bare var names it uses. MuParser binds
+/// each var to an address when it parses the expression, so a parsed expression can be evaluated
+/// again after reloading the values at those addresses.
+struct math_expression_t {
+    mu::Parser parser;
+    /// How many values each var holds. This is one except in bulk mode, where MuParser reads the
+    /// value for the i'th evaluation from the i'th slot.
+    size_t bulk_size;
+    /// The bare var names MuParser asked for while parsing.
+    wcstring_list_t var_names;
+    /// The values of those vars. A deque so the addresses handed to MuParser stay valid.
+    std::deque<std::vector<double>> var_values;
+
+    math_expression_t(const wcstring &expression, size_t bulk_size_) : bulk_size(bulk_size_) {
+        // Setup callback so variables can be retrieved dynamically.
+        parser.SetVarFactory(retrieve_var, this);
+        // MuParser doesn't implement the modulo operator so we add it ourselves since there are
+        // likely users of our old math wrapper around bc that expect it to be available.
+        parser.DefineOprtChars(L"%");
+        parser.DefineOprt(L"%", moduloOperator, mu::prINFIX);
+        parser.SetExpr(expression);
+    }
+
+    /// Store the current values of the vars used by an already parsed expression.
+    void reload_vars() {
+        for (size_t i = 0; i < var_names.size(); i++) {
+            double value = get_var_value(var_names.at(i).c_str());
+            std::fill(var_values.at(i).begin(), var_values.at(i).end(), value);
+        }
+    }
+};
+
+/// Return a fish var converted to a double. This allows the user to use a bar var name in the
+/// expression. That is `math a + 1` rather than `math $a + 1`.
+static double *retrieve_var(const wchar_t *var_name, void *user_data) {
+    math_expression_t *expr = static_cast<math_expression_t *>(user_data);
+    double value = get_var_value(var_name);
 
     // We need to return a unique address for the var. If we used a `static double` var and returned
     // it's address then multiple vars in the expression would all refer to the same value.
-    if (next_result == MAX_RESULTS - 1) {
-        wchar_t errmsg[500];
-        swprintf(errmsg, sizeof(errmsg) / sizeof(wchar_t),
-                 _(L"More than %d var names in math expression."), MAX_RESULTS);
-        throw mu::ParserError(errmsg);
-    }
-    double_results[next_result++] = result;
-    return double_results + next_result - 1;
+    expr->var_names.push_back(var_name);
+    expr->var_values.emplace_back(expr->bulk_size, value);
+    return expr->var_values.back().data();
 }
 
-/// Implement integer modulo math operator.
-static double moduloOperator(double v, double w) { return (int)v % std::max(1, (int)w); };
+#define MATH_EXPRESSION_CACHE_SIZE 64
+
+namespace {
+/// Parsed expressions keyed by their text, so a `math` in a loop only parses its expression once.
+class math_expression_cache_t
+    : public lru_cache_t<math_expression_cache_t, std::shared_ptr<math_expression_t>> {
+    typedef lru_cache_t<math_expression_cache_t, std::shared_ptr<math_expression_t>> super;
+
+   public:
+    math_expression_cache_t() : super(MATH_EXPRESSION_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static math_expression_cache_t s_expression_cache;
+
+/// Write one result in the format selected by --scale.
+static void print_result(io_streams_t &streams, const math_cmd_opts_t &opts, double value) {
+    if (opts.scale == 0) {
+        streams.out.append_format(L"%ld\n", static_cast<long>(value));
+    } else {
+        streams.out.append_format(L"%.*lf\n", opts.scale, value);
+    }
+}
 
 /// Evaluate math expressions.
 static int evaluate_expression(wchar_t *cmd, parser_t &parser, io_streams_t &streams,
                                math_cmd_opts_t &opts, wcstring &expression) {
     UNUSED(parser);
-    next_result = 0;
 
     try {
-        mu::Parser p;
-        // Setup callback so variables can be retrieved dynamically.
-        p.SetVarFactory(retrieve_var, nullptr);
-        // MuParser doesn't implement the modulo operator so we add it ourselves since there are
-        // likely users of our old math wrapper around bc that expect it to be available.
-        p.DefineOprtChars(L"%");
-        p.DefineOprt(L"%", moduloOperator, mu::prINFIX);
-
-        p.SetExpr(expression);
         int nNum;
-        mu::value_type *v = p.Eval(nNum);
+        mu::value_type *v;
+        if (std::shared_ptr<math_expression_t> *cached = s_expression_cache.get(expression)) {
+            std::shared_ptr<math_expression_t> expr = *cached;
+            expr->reload_vars();
+            v = expr->parser.Eval(nNum);
+        } else {
+            // The expression is parsed by the first evaluation. Only cache it if that worked.
+            auto expr = std::make_shared<math_expression_t>(expression, 1);
+            v = expr->parser.Eval(nNum);
+            s_expression_cache.insert(expression, expr);
+        }
         for (int i = 0; i < nNum; ++i) {
-            if (opts.scale == 0) {
-                streams.out.append_format(L"%ld\n", static_cast<long>(v[i]));
-            } else {
-                streams.out.append_format(L"%.*lf\n", opts.scale, v[i]);
-            }
+            print_result(streams, opts, v[i]);
         }
         return STATUS_CMD_OK;
     } catch (mu::Parser::exception_type &e) {
@@ -196,6 +260,66 @@ static int evaluate_expression(wchar_t *cmd, parser_t &parser, io_streams_t &str
     }
 }
 
+/// Read one number per line from stdin for bulk mode. Returns false after reporting a line that
+/// is not a number.
+static bool math_read_bulk_input(const wchar_t *cmd, io_streams_t &streams,
+                                 std::vector<double> *values) {
+    if (!math_args_from_stdin(streams)) return true;
+
+    std::string input;
+    char buf[MATH_READ_CHUNK_SIZE];
+    long rc;
+    while ((rc = read_blocked(streams.stdin_fd, buf, sizeof buf)) > 0) {
+        input.append(buf, rc);
+    }
+
+    size_t line_start = 0;
+    while (line_start < input.size()) {
+        size_t line_end = input.find('\n', line_start);
+        if (line_end == std::string::npos) line_end = input.size();
+        wcstring line = str2wcstring(input.data() + line_start, line_end - line_start);
+        line_start = line_end + 1;
+
+        const wchar_t *str = line.c_str();
+        wchar_t *endptr;
+        errno = 0;
+        double value = wcstod(str, &endptr);
+        if (line.empty() || *endptr != L'\0' || errno) {
+            streams.err.append_format(BUILTIN_ERR_NOT_NUMBER, cmd, str);
+            return false;
+        }
+        values->push_back(value);
+    }
+    return true;
+}
+
+/// Evaluate the expression once for each number on stdin, with the number bound to the var named
+/// by --each. This uses MuParser's bulk mode, which evaluates the bytecode over arrays of var values
+/// instead of being called once per value.
+static int evaluate_bulk(wchar_t *cmd, io_streams_t &streams, math_cmd_opts_t &opts,
+                         const wcstring &expression) {
+    std::vector<double> inputs;
+    if (!math_read_bulk_input(cmd, streams, &inputs)) return STATUS_CMD_ERROR;
+    if (inputs.empty()) return STATUS_CMD_OK;
+
+    std::vector<double> results(inputs.size());
+    try {
+        // Bulk evaluation always parses the expression again, so there is nothing to gain from
+        // the cache here.
+        math_expression_t expr(expression, inputs.size());
+        expr.parser.DefineVar(opts.bulk_var, inputs.data());
+        expr.parser.Eval(results.data(), static_cast<int>(inputs.size()));
+    } catch (mu::Parser::exception_type &e) {
+        streams.err.append_format(_(L"%ls: Invalid expression: %ls\n"), cmd, e.GetMsg().c_str());
+        return STATUS_CMD_ERROR;
+    }
+
+    for (double result : results) {
+        print_result(streams, opts, result);
+    }
+    return STATUS_CMD_OK;
+}
+
 /// The math builtin evaluates math expressions.
 int builtin_math(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     wchar_t *cmd = argv[0];
@@ -215,6 +339,15 @@ int builtin_math(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     }
 
     wcstring expression;
+    if (!opts.bulk_var.empty()) {
+        // In bulk mode stdin holds the values, so the expression only comes from argv.
+        while (const wchar_t *arg = math_get_arg_argv(&optind, argv)) {
+            if (!expression.empty()) expression.push_back(L' ');
+            expression.append(arg);
+        }
+        return evaluate_bulk(cmd, streams, opts, expression);
+    }
+
     wcstring storage;
     while (const wchar_t *arg = math_get_arg(&optind, argv, &storage, streams)) {
         if (!expression.empty()) expression.push_back(L' ');
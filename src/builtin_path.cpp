@@ -0,0 +1,225 @@
+// Implementation of the path builtin, which checks or resolves many paths at once.
+#include "config.h"  // IWYU pragma: keep
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "builtin.h"
+#include "builtin_path.h"
+#include "common.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "io.h"
+#include "iothread.h"
+#include "wgetopt.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+/// Paths are checked on background threads, in chunks of this many, once there is more than one
+/// chunk. Each check is a system call or two, which is not worth handing to another thread alone.
+#define PATH_CHUNK_SIZE 64
+
+/// Maximum number of background threads checking paths.
+#define PATH_PARALLEL_THREADS 8
+
+enum path_cmd_t { PATH_FILTER = 1, PATH_RESOLVE, PATH_UNDEF };
+
+// Must be sorted by string, not enum or random.
+const enum_map<path_cmd_t> path_enum_map[] = {
+    {PATH_FILTER, L"filter"}, {PATH_RESOLVE, L"resolve"}, {PATH_UNDEF, NULL}};
+#define path_enum_map_len (sizeof path_enum_map / sizeof *path_enum_map)
+
+/// The types of file that `path filter` may ask for. A path passes if it is any of them.
+enum { PATH_TYPE_FILE = 1 << 0, PATH_TYPE_DIR = 1 << 1, PATH_TYPE_LINK = 1 << 2 };
+
+struct path_cmd_opts_t {
+    bool print_help = false;
+    bool invert = false;
+    bool quiet = false;
+    int types = 0;
+    /// The access() modes that a path must all have.
+    int perms = 0;
+};
+static const wchar_t *short_options = L"+:dfhlqrvwx";
+static const struct woption long_options[] = {{L"dir", no_argument, NULL, 'd'},
+                                              {L"file", no_argument, NULL, 'f'},
+                                              {L"help", no_argument, NULL, 'h'},
+                                              {L"link", no_argument, NULL, 'l'},
+                                              {L"quiet", no_argument, NULL, 'q'},
+                                              {L"readable", no_argument, NULL, 'r'},
+                                              {L"invert", no_argument, NULL, 'v'},
+                                              {L"writable", no_argument, NULL, 'w'},
+                                              {L"executable", no_argument, NULL, 'x'},
+                                              {NULL, 0, NULL, 0}};
+
+/// Parse the options, which follow the subcommand. argv[0] is the subcommand, or the name of the
+/// builtin if there is none.
+static int parse_cmd_opts(path_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
+                          const wchar_t *cmd, parser_t &parser, io_streams_t &streams) {
+    int opt;
+    wgetopter_t w;
+    while ((opt = w.wgetopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': {
+                opts.types |= PATH_TYPE_DIR;
+                break;
+            }
+            case 'f': {
+                opts.types |= PATH_TYPE_FILE;
+                break;
+            }
+            case 'h': {
+                opts.print_help = true;
+                break;
+            }
+            case 'l': {
+                opts.types |= PATH_TYPE_LINK;
+                break;
+            }
+            case 'q': {
+                opts.quiet = true;
+                break;
+            }
+            case 'r': {
+                opts.perms |= R_OK;
+                break;
+            }
+            case 'v': {
+                opts.invert = true;
+                break;
+            }
+            case 'w': {
+                opts.perms |= W_OK;
+                break;
+            }
+            case 'x': {
+                opts.perms |= X_OK;
+                break;
+            }
+            case ':': {
+                builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            case '?': {
+                builtin_unknown_option(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            default: {
+                DIE("unexpected retval from wgetopt_long");
+                break;
+            }
+        }
+    }
+
+    *optind = w.woptind;
+    return STATUS_CMD_OK;
+}
+
+/// Returns whether \p path exists and is of one of the types and has all the permissions asked
+/// for. A symbolic link passes --link even if what it points to is missing.
+static bool path_passes_filter(const wcstring &path, const path_cmd_opts_t &opts) {
+    const std::string narrow = wcs2string(path);
+    struct stat buf;
+    const bool exists = stat(narrow.c_str(), &buf) == 0;
+    bool is_link = false;
+    if (opts.types & PATH_TYPE_LINK) {
+        struct stat link_buf;
+        is_link = lstat(narrow.c_str(), &link_buf) == 0 && S_ISLNK(link_buf.st_mode);
+    }
+    if (!exists && !is_link) return false;
+
+    if (opts.types && !is_link) {
+        if (!((opts.types & PATH_TYPE_FILE) && S_ISREG(buf.st_mode)) &&
+            !((opts.types & PATH_TYPE_DIR) && S_ISDIR(buf.st_mode))) {
+            return false;
+        }
+    }
+    return !opts.perms || access(narrow.c_str(), opts.perms) == 0;
+}
+
+/// Calls func(i) for every path index i below count, in chunks on background threads if there are
+/// enough paths to make that worthwhile.
+static void for_each_path(size_t count, const std::function<void(size_t)> &func) {
+    if (count <= PATH_CHUNK_SIZE) {
+        for (size_t i = 0; i < count; i++) func(i);
+        return;
+    }
+    static const size_t threads =
+        std::min((size_t)PATH_PARALLEL_THREADS,
+                 (size_t)std::max(1u, std::thread::hardware_concurrency()) - 1);
+    const size_t chunks = (count + PATH_CHUNK_SIZE - 1) / PATH_CHUNK_SIZE;
+    iothread_perform_parallel(chunks, threads, [&](size_t chunk) {
+        const size_t end = std::min(count, (chunk + 1) * PATH_CHUNK_SIZE);
+        for (size_t i = chunk * PATH_CHUNK_SIZE; i < end; i++) func(i);
+    });
+}
+
+/// The path builtin, for filtering paths by their type and permissions and resolving them, many
+/// at once.
+int builtin_path(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
+    wchar_t *cmd = argv[0];
+    int argc = builtin_count_args(argv);
+
+    path_cmd_t subcmd = PATH_UNDEF;
+    int first = 0;
+    if (argc > 1 && argv[1][0] != L'-') {
+        subcmd = str_to_enum(argv[1], path_enum_map, path_enum_map_len);
+        if (subcmd == PATH_UNDEF) {
+            streams.err.append_format(BUILTIN_ERR_INVALID_SUBCMD, cmd, argv[1]);
+            return STATUS_INVALID_ARGS;
+        }
+        first = 1;
+    }
+
+    path_cmd_opts_t opts;
+    int optind;
+    int retval = parse_cmd_opts(opts, &optind, argc - first, argv + first, cmd, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    if (opts.print_help) {
+        builtin_print_help(parser, streams, cmd, streams.out);
+        return STATUS_CMD_OK;
+    }
+
+    if (subcmd == PATH_UNDEF) {
+        streams.err.append_format(BUILTIN_ERR_MISSING_SUBCMD, cmd);
+        builtin_print_help(parser, streams, cmd, streams.err);
+        return STATUS_INVALID_ARGS;
+    }
+    if (subcmd == PATH_RESOLVE && (opts.types || opts.perms || opts.invert)) {
+        streams.err.append_format(BUILTIN_ERR_COMBO2, cmd, _(L"resolve only takes --quiet"));
+        return STATUS_INVALID_ARGS;
+    }
+
+    const wcstring_list_t paths(argv + first + optind, argv + argc);
+    const size_t count = paths.size();
+    // Whether each path passed, and for resolve, what it resolved to.
+    std::vector<char> passed(count, false);
+    wcstring_list_t resolved(subcmd == PATH_RESOLVE ? count : 0);
+    for_each_path(count, [&](size_t i) {
+        if (subcmd == PATH_FILTER) {
+            passed[i] = path_passes_filter(paths[i], opts) != opts.invert;
+        } else if (!waccess(paths[i], F_OK)) {
+            // wrealpath allows the last component to be missing, hence the check above.
+            if (auto real_path = wrealpath(paths[i])) {
+                resolved[i] = std::move(*real_path);
+                passed[i] = true;
+            }
+        }
+    });
+
+    retval = STATUS_CMD_ERROR;
+    for (size_t i = 0; i < count; i++) {
+        if (!passed[i]) continue;
+        retval = STATUS_CMD_OK;
+        if (opts.quiet) break;
+        streams.out.append(subcmd == PATH_FILTER ? paths[i] : resolved[i]);
+        streams.out.push_back(L'\n');
+    }
+    return retval;
+}
@@ -0,0 +1,9 @@
+// Prototypes for executing builtin_path function.
+#ifndef FISH_BUILTIN_PATH_H
+#define FISH_BUILTIN_PATH_H
+
+class parser_t;
+struct io_streams_t;
+
+int builtin_path(parser_t &parser, io_streams_t &streams, wchar_t **argv);
+#endif
@@ -62,13 +62,58 @@
 #include <wchar.h>
 #include <wctype.h>
 
+#include <memory>
+#include <vector>
+
 #include "builtin.h"
 #include "common.h"
 #include "io.h"
+#include "lru.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 class parser_t;
 
+/// One piece of a compiled format string.
+struct format_piece_t {
+    enum kind_t {
+        /// Text to output as is. This includes `%%` directives.
+        literal,
+        /// A \ escape sequence, which is interpreted when printed because it can stop the output.
+        escape,
+        /// The `%b` directive.
+        escaped_string,
+        /// Any other % directive.
+        directive,
+    } kind;
+    /// For literal pieces the text. For directives the printf format for the conversion, with an
+    /// intmax_t or long double wide length modifier; if the directive is invalid, its text as
+    /// written instead.
+    wcstring text;
+    /// For escapes, the offset of the backslash in the format string.
+    size_t start;
+    /// For directives, the conversion specifier and whether it was valid.
+    wchar_t conversion;
+    bool valid;
+    /// For directives, whether the field width and precision are taken from the arguments.
+    bool width_from_arg;
+    bool precision_from_arg;
+
+    explicit format_piece_t(kind_t k)
+        : kind(k),
+          start(0),
+          conversion(0),
+          valid(true),
+          width_from_arg(false),
+          precision_from_arg(false) {}
+};
+
+/// A format string split into the pieces that make it up, so that it is only scanned once however
+/// many times it is used.
+struct compiled_format_t {
+    wcstring format;
+    std::vector<format_piece_t> pieces;
+};
+
 struct builtin_printf_state_t {
     // Out and err streams. Note this is a captured reference!
     io_streams_t &streams;
@@ -85,10 +130,10 @@ struct builtin_printf_state_t {
 
     void verify_numeric(const wchar_t *s, const wchar_t *end, int errcode);
 
-    void print_direc(const wchar_t *start, size_t length, wchar_t conversion, bool have_field_width,
+    void print_direc(const wchar_t *fmt, wchar_t conversion, bool have_field_width,
                      int field_width, bool have_precision, int precision, wchar_t const *argument);
 
-    int print_formatted(const wchar_t *format, int argc, wchar_t **argv);
+    int print_formatted(const compiled_format_t &format, int argc, wchar_t **argv);
 
     void fatal_error(const wchar_t *format, ...);
 
@@ -232,9 +277,8 @@ void builtin_printf_state_t::append_format_output(const wchar_t *fmt, ...) {
 
     va_list va;
     va_start(va, fmt);
-    wcstring tmp = vformat_string(fmt, va);
+    streams.out.append_formatv(fmt, va);
     va_end(va);
-    streams.out.append(tmp);
 }
 
 void builtin_printf_state_t::verify_numeric(const wchar_t *s, const wchar_t *end, int errcode) {
@@ -416,6 +460,27 @@ long builtin_printf_state_t::print_esc(const wchar_t *escstart, bool octal_0) {
     return p - escstart - 1;
 }
 
+/// Return the number of characters besides the backslash in the \ escape sequence in a format string
+/// starting at ESCSTART. This must agree with what print_esc consumes when OCTAL_0 is false.
+static long esc_length(const wchar_t *escstart) {
+    const wchar_t *p = escstart + 1;
+    if (*p == L'x') {
+        ++p;
+        for (int i = 0; i < 2 && is_hex_digit(*p); ++i) ++p;
+    } else if (is_octal_digit(*p)) {
+        for (int i = 0; i < 3 && is_octal_digit(*p); ++i) ++p;
+    } else if (*p && wcschr(L"\"\\abcefnrtv", *p)) {
+        ++p;
+    } else if (*p == L'u' || *p == L'U') {
+        int max_digits = *p == L'u' ? 4 : 8;
+        ++p;
+        for (int i = 0; i < max_digits && is_hex_digit(*p); ++i) ++p;
+    } else if (*p) {
+        ++p;
+    }
+    return p - escstart - 1;
+}
+
 /// Print string STR, evaluating \ escapes.
 void builtin_printf_state_t::print_esc_string(const wchar_t *str) {
     for (; *str; str++)
@@ -425,66 +490,28 @@ void builtin_printf_state_t::print_esc_string(const wchar_t *str) {
             this->append_output(*str);
 }
 
-/// Evaluate a printf conversion specification.  START is the start of the directive, LENGTH is its
-/// length, and CONVERSION specifies the type of conversion.  LENGTH does not include any length
-/// modifier or the conversion specifier itself.  FIELD_WIDTH and PRECISION are the field width and
-/// precision for '*' values, if HAVE_FIELD_WIDTH and HAVE_PRECISION are true, respectively.
+/// Evaluate a printf conversion specification. FMT is the directive as prepared by compile_format,
+/// and CONVERSION specifies the type of conversion. FIELD_WIDTH and PRECISION are the field width
+/// and precision for '*' values, if HAVE_FIELD_WIDTH and HAVE_PRECISION are true, respectively.
 /// ARGUMENT is the argument to be formatted.
-void builtin_printf_state_t::print_direc(const wchar_t *start, size_t length, wchar_t conversion,
+void builtin_printf_state_t::print_direc(const wchar_t *fmt, wchar_t conversion,
                                          bool have_field_width, int field_width,
                                          bool have_precision, int precision,
                                          wchar_t const *argument) {
-    // Start with everything except the conversion specifier.
-    wcstring fmt(start, length);
-
-    // Create a copy of the % directive, with an intmax_t-wide width modifier substituted for any
-    // existing integer length modifier.
-    switch (conversion) {
-        case L'x':
-        case L'X':
-        case L'd':
-        case L'i':
-        case L'o':
-        case L'u': {
-            fmt.append(L"ll");
-            break;
-        }
-        case L'a':
-        case L'e':
-        case L'f':
-        case L'g':
-        case L'A':
-        case L'E':
-        case L'F':
-        case L'G': {
-            fmt.append(L"L");
-            break;
-        }
-        case L's':
-        case L'c': {
-            fmt.append(L"l");
-            break;
-        }
-        default: { break; }
-    }
-
-    // Append the conversion itself.
-    fmt.push_back(conversion);
-
     switch (conversion) {
         case L'd':
         case L'i': {
             intmax_t arg = string_to_scalar_type<intmax_t>(argument, this);
             if (!have_field_width) {
                 if (!have_precision)
-                    this->append_format_output(fmt.c_str(), arg);
+                    this->append_format_output(fmt, arg);
                 else
-                    this->append_format_output(fmt.c_str(), precision, arg);
+                    this->append_format_output(fmt, precision, arg);
             } else {
                 if (!have_precision)
-                    this->append_format_output(fmt.c_str(), field_width, arg);
+                    this->append_format_output(fmt, field_width, arg);
                 else
-                    this->append_format_output(fmt.c_str(), field_width, precision, arg);
+                    this->append_format_output(fmt, field_width, precision, arg);
             }
             break;
         }
@@ -495,14 +522,14 @@ void builtin_printf_state_t::print_direc(const wchar_t *start, size_t length, wc
             uintmax_t arg = string_to_scalar_type<uintmax_t>(argument, this);
             if (!have_field_width) {
                 if (!have_precision)
-                    this->append_format_output(fmt.c_str(), arg);
+                    this->append_format_output(fmt, arg);
                 else
-                    this->append_format_output(fmt.c_str(), precision, arg);
+                    this->append_format_output(fmt, precision, arg);
             } else {
                 if (!have_precision)
-                    this->append_format_output(fmt.c_str(), field_width, arg);
+                    this->append_format_output(fmt, field_width, arg);
                 else
-                    this->append_format_output(fmt.c_str(), field_width, precision, arg);
+                    this->append_format_output(fmt, field_width, precision, arg);
             }
             break;
         }
@@ -517,39 +544,39 @@ void builtin_printf_state_t::print_direc(const wchar_t *start, size_t length, wc
             long double arg = string_to_scalar_type<long double>(argument, this);
             if (!have_field_width) {
                 if (!have_precision) {
-                    this->append_format_output(fmt.c_str(), arg);
+                    this->append_format_output(fmt, arg);
                 } else {
-                    this->append_format_output(fmt.c_str(), precision, arg);
+                    this->append_format_output(fmt, precision, arg);
                 }
             } else {
                 if (!have_precision) {
-                    this->append_format_output(fmt.c_str(), field_width, arg);
+                    this->append_format_output(fmt, field_width, arg);
                 } else {
-                    this->append_format_output(fmt.c_str(), field_width, precision, arg);
+                    this->append_format_output(fmt, field_width, precision, arg);
                 }
             }
             break;
         }
         case L'c': {
             if (!have_field_width) {
-                this->append_format_output(fmt.c_str(), *argument);
+                this->append_format_output(fmt, *argument);
             } else {
-                this->append_format_output(fmt.c_str(), field_width, *argument);
+                this->append_format_output(fmt, field_width, *argument);
             }
             break;
         }
         case L's': {
             if (!have_field_width) {
                 if (!have_precision) {
-                    this->append_format_output(fmt.c_str(), argument);
+                    this->append_format_output(fmt, argument);
                 } else {
-                    this->append_format_output(fmt.c_str(), precision, argument);
+                    this->append_format_output(fmt, precision, argument);
                 }
             } else {
                 if (!have_precision) {
-                    this->append_format_output(fmt.c_str(), field_width, argument);
+                    this->append_format_output(fmt, field_width, argument);
                 } else {
-                    this->append_format_output(fmt.c_str(), field_width, precision, argument);
+                    this->append_format_output(fmt, field_width, precision, argument);
                 }
             }
             break;
@@ -570,40 +597,40 @@ static inline void modify_allowed_format_specifiers(bool ok[UCHAR_MAX + 1], cons
     }
 }
 
-/// Print the text in FORMAT, using ARGV (with ARGC elements) for arguments to any `%' directives.
-/// Return the number of elements of ARGV used.
-int builtin_printf_state_t::print_formatted(const wchar_t *format, int argc, wchar_t **argv) {
-    int save_argc = argc;        /* Preserve original value.  */
-    const wchar_t *f;            /* Pointer into `format'.  */
-    const wchar_t *direc_start;  /* Start of % directive.  */
-    size_t direc_length;         /* Length of % directive.  */
-    bool have_field_width;       /* True if FIELD_WIDTH is valid.  */
-    int field_width = 0;         /* Arg to first '*'.  */
-    bool have_precision;         /* True if PRECISION is valid.  */
-    int precision = 0;           /* Arg to second '*'.  */
-    bool ok[UCHAR_MAX + 1] = {}; /* ok['x'] is true if %x is allowed.  */
+/// Split FORMAT into the literal text, escapes and directives that make it up. Scanning stops after
+/// an invalid directive, since printing stops there.
+static std::shared_ptr<const compiled_format_t> compile_format(const wchar_t *format) {
+    auto result = std::make_shared<compiled_format_t>();
+    result->format = format;
+    std::vector<format_piece_t> &pieces = result->pieces;
+    format = result->format.c_str();
 
-    for (f = format; *f != L'\0'; ++f) {
+    // Return the literal piece at the end of the list, adding one if needed.
+    auto literal = [&]() -> wcstring & {
+        if (pieces.empty() || pieces.back().kind != format_piece_t::literal) {
+            pieces.emplace_back(format_piece_t::literal);
+        }
+        return pieces.back().text;
+    };
+
+    bool ok[UCHAR_MAX + 1] = {}; /* ok['x'] is true if %x is allowed.  */
+    for (const wchar_t *f = format; *f != L'\0'; ++f) {
         switch (*f) {
             case L'%': {
-                direc_start = f++;
-                direc_length = 1;
-                have_field_width = have_precision = false;
+                const wchar_t *direc_start = f++;
+                size_t direc_length = 1;
                 if (*f == L'%') {
-                    this->append_output(L'%');
+                    literal().push_back(L'%');
                     break;
                 }
                 if (*f == L'b') {
                     // FIXME: Field width and precision are not supported for %b, even though POSIX
                     // requires it.
-                    if (argc > 0) {
-                        print_esc_string(*argv);
-                        ++argv;
-                        --argc;
-                    }
+                    pieces.emplace_back(format_piece_t::escaped_string);
                     break;
                 }
 
+                format_piece_t piece(format_piece_t::directive);
                 modify_allowed_format_specifiers(ok, "aAcdeEfFgGiosuxX", true);
                 for (bool continue_looking_for_flags = true; continue_looking_for_flags;) {
                     switch (*f) {
@@ -639,18 +666,7 @@ int builtin_printf_state_t::print_formatted(const wchar_t *format, int argc, wch
                 if (*f == L'*') {
                     ++f;
                     ++direc_length;
-                    if (argc > 0) {
-                        intmax_t width = string_to_scalar_type<intmax_t>(*argv, this);
-                        if (INT_MIN <= width && width <= INT_MAX)
-                            field_width = static_cast<int>(width);
-                        else
-                            this->fatal_error(_(L"invalid field width: %ls"), *argv);
-                        ++argv;
-                        --argc;
-                    } else {
-                        field_width = 0;
-                    }
-                    have_field_width = true;
+                    piece.width_from_arg = true;
                 } else {
                     while (iswdigit(*f)) {
                         ++f;
@@ -664,23 +680,7 @@ int builtin_printf_state_t::print_formatted(const wchar_t *format, int argc, wch
                     if (*f == L'*') {
                         ++f;
                         ++direc_length;
-                        if (argc > 0) {
-                            intmax_t prec = string_to_scalar_type<intmax_t>(*argv, this);
-                            if (prec < 0) {
-                                // A negative precision is taken as if the precision were omitted,
-                                // so -1 is safe here even if prec < INT_MIN.
-                                precision = -1;
-                            } else if (INT_MAX < prec)
-                                this->fatal_error(_(L"invalid precision: %ls"), *argv);
-                            else {
-                                precision = static_cast<int>(prec);
-                            }
-                            ++argv;
-                            --argc;
-                        } else {
-                            precision = 0;
-                        }
-                        have_precision = true;
+                        piece.precision_from_arg = true;
                     } else {
                         while (iswdigit(*f)) {
                             ++f;
@@ -694,23 +694,161 @@ int builtin_printf_state_t::print_formatted(const wchar_t *format, int argc, wch
                     ++f;
                 }
 
-                wchar_t conversion = *f;
-                if (conversion > 0xFF || !ok[conversion]) {
-                    this->fatal_error(_(L"%.*ls: invalid conversion specification"),
-                                      (int)(f + 1 - direc_start), direc_start);
-                    return 0;
+                piece.conversion = *f;
+                if (piece.conversion > 0xFF || !ok[piece.conversion]) {
+                    piece.valid = false;
+                    piece.text.assign(direc_start, f + (*f ? 1 : 0));
+                    pieces.push_back(std::move(piece));
+                    return result;
                 }
 
-                print_direc(direc_start, direc_length, *f, have_field_width, field_width,
-                            have_precision, precision, (argc <= 0 ? L"" : (argc--, *argv++)));
+                // Start with everything except the conversion specifier, then substitute an
+                // intmax_t-wide width modifier for any existing integer length modifier.
+                piece.text.assign(direc_start, direc_length);
+                switch (piece.conversion) {
+                    case L'x':
+                    case L'X':
+                    case L'd':
+                    case L'i':
+                    case L'o':
+                    case L'u': {
+                        piece.text.append(L"ll");
+                        break;
+                    }
+                    case L'a':
+                    case L'e':
+                    case L'f':
+                    case L'g':
+                    case L'A':
+                    case L'E':
+                    case L'F':
+                    case L'G': {
+                        piece.text.append(L"L");
+                        break;
+                    }
+                    case L's':
+                    case L'c': {
+                        piece.text.append(L"l");
+                        break;
+                    }
+                    default: { break; }
+                }
+                piece.text.push_back(piece.conversion);
+                pieces.push_back(std::move(piece));
                 break;
             }
             case L'\\': {
-                f += print_esc(f, false);
+                format_piece_t piece(format_piece_t::escape);
+                piece.start = f - format;
+                pieces.push_back(std::move(piece));
+                f += esc_length(f);
                 break;
             }
             default: {
-                this->append_output(*f);
+                literal().push_back(*f);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+#define PRINTF_FORMAT_CACHE_SIZE 64
+
+namespace {
+/// Compiled format strings keyed by their text, so a printf in a loop only scans its format once.
+class printf_format_cache_t
+    : public lru_cache_t<printf_format_cache_t, std::shared_ptr<const compiled_format_t>> {
+    typedef lru_cache_t<printf_format_cache_t, std::shared_ptr<const compiled_format_t>> super;
+
+   public:
+    printf_format_cache_t() : super(PRINTF_FORMAT_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static printf_format_cache_t s_format_cache;
+
+/// The format most recently used. A printf in a loop usually has the same format each time, which
+/// this finds without building a key for the cache.
+static std::shared_ptr<const compiled_format_t> s_last_format;
+
+/// Return the compiled form of the format string, compiling it if it is not in the cache.
+static std::shared_ptr<const compiled_format_t> get_compiled_format(const wchar_t *format) {
+    if (s_last_format && s_last_format->format == format) return s_last_format;
+
+    wcstring key = format;
+    if (std::shared_ptr<const compiled_format_t> *cached = s_format_cache.get(key)) {
+        s_last_format = *cached;
+    } else {
+        s_last_format = compile_format(format);
+        s_format_cache.insert(std::move(key), s_last_format);
+    }
+    return s_last_format;
+}
+
+/// Print the text in FORMAT, using ARGV (with ARGC elements) for arguments to any `%' directives.
+/// Return the number of elements of ARGV used.
+int builtin_printf_state_t::print_formatted(const compiled_format_t &format, int argc,
+                                            wchar_t **argv) {
+    int save_argc = argc; /* Preserve original value.  */
+
+    for (const format_piece_t &piece : format.pieces) {
+        switch (piece.kind) {
+            case format_piece_t::literal: {
+                this->append_output(piece.text.c_str());
+                break;
+            }
+            case format_piece_t::escape: {
+                const wchar_t *escstart = format.format.c_str() + piece.start;
+                long length = print_esc(escstart, false);
+                assert(length == esc_length(escstart));
+                UNUSED(length);
+                break;
+            }
+            case format_piece_t::escaped_string: {
+                if (argc > 0) {
+                    print_esc_string(*argv);
+                    ++argv;
+                    --argc;
+                }
+                break;
+            }
+            case format_piece_t::directive: {
+                int field_width = 0; /* Arg to first '*'.  */
+                int precision = 0;   /* Arg to second '*'.  */
+                if (piece.width_from_arg && argc > 0) {
+                    intmax_t width = string_to_scalar_type<intmax_t>(*argv, this);
+                    if (INT_MIN <= width && width <= INT_MAX)
+                        field_width = static_cast<int>(width);
+                    else
+                        this->fatal_error(_(L"invalid field width: %ls"), *argv);
+                    ++argv;
+                    --argc;
+                }
+                if (piece.precision_from_arg && argc > 0) {
+                    intmax_t prec = string_to_scalar_type<intmax_t>(*argv, this);
+                    if (prec < 0) {
+                        // A negative precision is taken as if the precision were omitted,
+                        // so -1 is safe here even if prec < INT_MIN.
+                        precision = -1;
+                    } else if (INT_MAX < prec)
+                        this->fatal_error(_(L"invalid precision: %ls"), *argv);
+                    else {
+                        precision = static_cast<int>(prec);
+                    }
+                    ++argv;
+                    --argc;
+                }
+
+                if (!piece.valid) {
+                    this->fatal_error(_(L"%ls: invalid conversion specification"),
+                                      piece.text.c_str());
+                    return 0;
+                }
+
+                print_direc(piece.text.c_str(), piece.conversion, piece.width_from_arg,
+                            field_width, piece.precision_from_arg, precision,
+                            (argc <= 0 ? L"" : (argc--, *argv++)));
                 break;
             }
         }
@@ -742,12 +880,12 @@ int builtin_printf(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
 
     builtin_printf_state_t state(streams);
     int args_used;
-    wchar_t *format = argv[0];
+    std::shared_ptr<const compiled_format_t> format = get_compiled_format(argv[0]);
     argc--;
     argv++;
 
     do {
-        args_used = state.print_formatted(format, argc, argv);
+        args_used = state.print_formatted(*format, argc, argv);
         argc -= args_used;
         argv += args_used;
     } while (args_used > 0 && argc > 0 && !state.early_exit);
@@ -2,6 +2,7 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -45,13 +46,14 @@ struct read_cmd_opts_t {
     wcstring delimiter;
     bool shell = false;
     bool array = false;
+    bool array_from_stream = false;
     bool silent = false;
     bool split_null = false;
     bool to_stdout = false;
     int nchars = 0;
 };
 
-static const wchar_t *short_options = L":ac:ghilm:n:p:d:suxzP:UR:";
+static const wchar_t *short_options = L":aAc:ghilm:n:p:d:suxzP:UR:";
 static const struct woption long_options[] = {{L"export", no_argument, NULL, 'x'},
                                               {L"global", no_argument, NULL, 'g'},
                                               {L"local", no_argument, NULL, 'l'},
@@ -67,6 +69,7 @@ static const struct woption long_options[] = {{L"export", no_argument, NULL, 'x'
                                               {L"delimiter", required_argument, NULL, 'd'},
                                               {L"shell", no_argument, NULL, 's'},
                                               {L"array", no_argument, NULL, 'a'},
+                                              {L"array-from-stream", no_argument, NULL, 'A'},
                                               {L"null", no_argument, NULL, 'z'},
                                               {L"help", no_argument, NULL, 'h'},
                                               {NULL, 0, NULL, 0}};
@@ -155,6 +158,10 @@ static int parse_cmd_opts(read_cmd_opts_t &opts, int *optind,  //!OCLINT(high nc
                 opts.array = true;
                 break;
             }
+            case 'A': {
+                opts.array_from_stream = true;
+                break;
+            }
             case L'i': {
                 opts.silent = true;
                 break;
@@ -282,9 +289,75 @@ static int read_in_chunks(int fd, wcstring &buff, bool split_null) {
     return exit_res;
 }
 
+#ifdef HAVE_TEE
+/// Read from a pipe in chunks until we see newline or null, as requested. Each chunk is copied out
+/// of the pipe with tee(2), which leaves the data in the pipe, and then only the bytes up to and
+/// including the separator are consumed. Whatever reads the pipe next, such as a command in the body
+/// of a `while read` loop, still sees the rest of the input, just as with read_one_char_at_a_time.
+///
+/// Returns an exit status, or -1 without having read anything if the fd is not a pipe.
+static int read_pipe_in_chunks(int fd, wcstring &buff, bool split_null) {
+    // The pipe the chunks are copied into. It is created once and always left empty.
+    static int peek_pipe[2] = {-1, -1};
+    if (peek_pipe[0] == -1 && fish_pipe_cloexec(peek_pipe) == -1) return -1;
+
+    int exit_res = STATUS_CMD_OK;
+    std::string str;
+    bool eof = false;
+    bool finished = false;
+
+    while (!finished) {
+        ssize_t bytes_peeked;
+        do {
+            bytes_peeked = tee(fd, peek_pipe[1], READ_CHUNK_SIZE, 0);
+        } while (bytes_peeked == -1 && errno == EINTR);
+
+        if (bytes_peeked == -1 && errno == EINVAL && str.empty()) {
+            return -1;  // not a pipe
+        }
+        if (bytes_peeked <= 0) {
+            eof = true;
+            break;
+        }
+
+        char inbuf[READ_CHUNK_SIZE];
+        if (read_blocked(peek_pipe[0], inbuf, bytes_peeked) != bytes_peeked) {
+            eof = true;
+            break;
+        }
+
+        const char *end = std::find(inbuf, inbuf + bytes_peeked, split_null ? '\0' : '\n');
+        long bytes_consumed = end - inbuf;
+        str.append(inbuf, bytes_consumed);
+        if (bytes_consumed < bytes_peeked) {
+            // We found a splitter. The +1 because we need to treat the splitter as consumed, but
+            // not append it to the string.
+            bytes_consumed++;
+            finished = true;
+        } else if (str.size() > read_byte_limit) {
+            exit_res = STATUS_READ_TOO_MUCH;
+            finished = true;
+        }
+
+        // Now take the bytes we used out of the pipe. They are already there, so this won't block.
+        if (read_blocked(fd, inbuf, bytes_consumed) != bytes_consumed) {
+            eof = true;
+            break;
+        }
+    }
+
+    buff = str2wcstring(str);
+    if (buff.empty() && eof) {
+        exit_res = STATUS_CMD_ERROR;
+    }
+
+    return exit_res;
+}
+#endif
+
 /// Read from the fd on char at a time until we've read the requested number of characters or a
 /// newline or null, as appropriate, is seen. This is inefficient so should only be used when the
-/// fd is not seekable.
+/// fd is neither seekable nor a pipe we can read with read_pipe_in_chunks.
 static int read_one_char_at_a_time(int fd, wcstring &buff, int nchars, bool split_null) {
     int exit_res = STATUS_CMD_OK;
     bool eof = false;
@@ -337,6 +410,39 @@ static int read_one_char_at_a_time(int fd, wcstring &buff, int nchars, bool spli
     return exit_res;
 }
 
+/// How much to read at a time when consuming a whole stream.
+#define READ_STREAM_CHUNK_SIZE 65536
+
+/// Read everything from the fd and split it into lines, or into null terminated strings if
+/// requested. This is used for `read --array-from-stream`, which has no reason to leave any input
+/// unread, so it reads in large chunks whatever the fd is.
+///
+/// Returns an exit status.
+static int read_stream_lines(int fd, wcstring_list_t &lines, bool split_null) {
+    std::string str;
+    for (;;) {
+        size_t old_size = str.size();
+        str.resize(old_size + READ_STREAM_CHUNK_SIZE);
+        long bytes_read = read_blocked(fd, &str[old_size], READ_STREAM_CHUNK_SIZE);
+        str.resize(old_size + std::max(bytes_read, 0L));
+        if (bytes_read <= 0) break;
+        if (str.size() > read_byte_limit) return STATUS_READ_TOO_MUCH;
+    }
+
+    if (str.empty()) return STATUS_CMD_ERROR;
+
+    const char sep = split_null ? '\0' : '\n';
+    const char *cursor = str.data();
+    const char *end = cursor + str.size();
+    while (cursor < end) {
+        const char *line_end = static_cast<const char *>(memchr(cursor, sep, end - cursor));
+        if (!line_end) line_end = end;
+        lines.push_back(str2wcstring(cursor, line_end - cursor));
+        cursor = line_end + 1;
+    }
+    return STATUS_CMD_OK;
+}
+
 /// Validate the arguments given to `read` and provide defaults where needed.
 static int validate_read_args(const wchar_t *cmd, read_cmd_opts_t &opts, int argc,
                               const wchar_t *const *argv, parser_t &parser, io_streams_t &streams) {
@@ -372,11 +478,17 @@ static int validate_read_args(const wchar_t *cmd, read_cmd_opts_t &opts, int arg
         return STATUS_INVALID_ARGS;
     }
 
-    if (opts.array && argc != 1) {
+    if ((opts.array || opts.array_from_stream) && argc != 1) {
         streams.err.append_format(BUILTIN_ERR_ARG_COUNT1, cmd, 1, argc);
         return STATUS_INVALID_ARGS;
     }
 
+    if (opts.array_from_stream && (opts.array || opts.nchars)) {
+        streams.err.append_format(BUILTIN_ERR_COMBO2, cmd,
+                                  _(L"--array-from-stream can't be used with --array or --nchars"));
+        return STATUS_INVALID_ARGS;
+    }
+
     // Verify all variable names.
     for (int i = 0; i < argc; i++) {
         if (!valid_var_name(argv[i])) {
@@ -418,6 +530,18 @@ int builtin_read(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     retval = validate_read_args(cmd, opts, argc, argv, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
 
+    if (opts.array_from_stream) {
+        // Each line becomes an element of the var, which is set once at the end.
+        wcstring_list_t lines;
+        exit_res = read_stream_lines(streams.stdin_fd, lines, opts.split_null);
+        if (exit_res != STATUS_CMD_OK) {
+            env_set_empty(argv[0], opts.place);
+            return exit_res;
+        }
+        env_set(argv[0], opts.place, std::move(lines));
+        return exit_res;
+    }
+
     // TODO: Determine if the original set of conditions for interactive reads should be reinstated:
     // if (isatty(0) && streams.stdin_fd == STDIN_FILENO && !split_null) {
     int stream_stdin_is_a_tty = isatty(streams.stdin_fd);
@@ -430,7 +554,16 @@ int builtin_read(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
                lseek(streams.stdin_fd, 0, SEEK_CUR) != -1) {
         exit_res = read_in_chunks(streams.stdin_fd, buff, opts.split_null);
     } else {
-        exit_res = read_one_char_at_a_time(streams.stdin_fd, buff, opts.nchars, opts.split_null);
+        exit_res = -1;
+#ifdef HAVE_TEE
+        if (!opts.nchars && !stream_stdin_is_a_tty) {
+            exit_res = read_pipe_in_chunks(streams.stdin_fd, buff, opts.split_null);
+        }
+#endif
+        if (exit_res == -1) {
+            exit_res =
+                read_one_char_at_a_time(streams.stdin_fd, buff, opts.nchars, opts.split_null);
+        }
     }
 
     if (exit_res != STATUS_CMD_OK) {
@@ -342,9 +342,9 @@ static int parse_index(std::vector<long> &indexes, wchar_t *src, int scope, io_s
     *p = L'\0';        // split the var name from the indexes/slices
     p++;
 
+    // Only the number of values is needed, to resolve negative indexes.
     auto var_str = env_get(src, scope);
-    wcstring_list_t var;
-    if (var_str) var_str->to_list(var);
+    const long var_size = var_str ? static_cast<long>(var_str->as_list().size()) : 0;
 
     int count = 0;
 
@@ -358,7 +358,7 @@ static int parse_index(std::vector<long> &indexes, wchar_t *src, int scope, io_s
         p = (wchar_t *)end;
 
         // Convert negative index to a positive index.
-        if (l_ind < 0) l_ind = var.size() + l_ind + 1;
+        if (l_ind < 0) l_ind = var_size + l_ind + 1;
 
         if (*p == L'.' && *(p + 1) == L'.') {
             p += 2;
@@ -369,7 +369,7 @@ static int parse_index(std::vector<long> &indexes, wchar_t *src, int scope, io_s
             p = (wchar_t *)end;
 
             // Convert negative index to a positive index.
-            if (l_ind2 < 0) l_ind2 = var.size() + l_ind2 + 1;
+            if (l_ind2 < 0) l_ind2 = var_size + l_ind2 + 1;
 
             int direction = l_ind2 < l_ind ? -1 : 1;
             for (long jjj = l_ind; jjj * direction <= l_ind2 * direction; jjj += direction) {
@@ -624,6 +624,10 @@ static int builtin_set_erase(const wchar_t *cmd, set_cmd_opts_t &opts, int argc,
 
     if (idx_count == 0) {  // unset the var
         retval = env_remove(dest, scope);
+    } else if (env_modify_in_place(dest, scope | ENV_USER, [&](wcstring_list_t &list) {
+                   erase_values(list, indexes);
+               })) {
+        retval = STATUS_CMD_OK;
     } else {  // remove just the specified indexes of the var
         const auto dest_var = env_get(dest, scope);
         if (!dest_var) return STATUS_CMD_ERROR;
@@ -699,6 +703,34 @@ static int set_var_slices(const wchar_t *cmd, set_cmd_opts_t &opts, const wchar_
     return STATUS_CMD_OK;
 }
 
+/// Try to apply `set` with --append, --prepend or slices to an existing variable in place, rather
+/// than building its new values from a copy of the old ones. This keeps growing a list one element
+/// at a time linear. Returns false if this was not possible, and nothing was changed.
+static bool set_var_in_place(set_cmd_opts_t &opts, const wchar_t *varname,
+                             const std::vector<long> &indexes, int argc, wchar_t **argv) {
+    int scope = compute_scope(opts);
+    if (indexes.empty()) {
+        if (!opts.append && !opts.prepend) return false;
+        return env_modify_in_place(varname, scope | ENV_USER, [&](wcstring_list_t &list) {
+            if (opts.prepend) list.insert(list.begin(), argv, argv + argc);
+            if (opts.append) list.insert(list.end(), argv, argv + argc);
+        });
+    }
+
+    // Leave the error cases to set_var_slices().
+    if (opts.append || opts.prepend || indexes.size() != static_cast<size_t>(argc)) return false;
+    for (long idx : indexes) {
+        if (idx < 1) return false;
+    }
+    return env_modify_in_place(varname, scope | ENV_USER, [&](wcstring_list_t &list) {
+        for (size_t i = 0; i < indexes.size(); i++) {
+            size_t ind = indexes[i] - 1;
+            if (ind >= list.size()) list.resize(ind + 1);
+            list[ind] = argv[i];
+        }
+    });
+}
+
 /// Set a variable.
 static int builtin_set_set(const wchar_t *cmd, set_cmd_opts_t &opts, int argc, wchar_t **argv,
                            parser_t &parser, io_streams_t &streams) {
@@ -726,6 +758,10 @@ static int builtin_set_set(const wchar_t *cmd, set_cmd_opts_t &opts, int argc, w
         return STATUS_INVALID_ARGS;
     }
 
+    if (set_var_in_place(opts, varname, indexes, argc, argv)) {
+        return check_global_scope_exists(cmd, opts, varname, streams);
+    }
+
     int retval;
     wcstring_list_t new_values;
     if (idx_count == 0) {
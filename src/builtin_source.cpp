@@ -13,21 +13,72 @@
 #include "fallback.h"  // IWYU pragma: keep
 #include "intern.h"
 #include "io.h"
+#include "parse_util.h"
 #include "parser.h"
 #include "proc.h"
 #include "reader.h"
+#include "wgetopt.h"
 #include "wutil.h"  // IWYU pragma: keep
 
+struct source_cmd_opts_t {
+    bool print_help = false;
+    bool prefetch = false;
+    bool stream = false;
+};
+static const wchar_t *short_options = L"+:hps";
+static const struct woption long_options[] = {{L"help", no_argument, NULL, 'h'},
+                                              {L"prefetch", no_argument, NULL, 'p'},
+                                              {L"stream", no_argument, NULL, 's'},
+                                              {NULL, 0, NULL, 0}};
+
+static int parse_cmd_opts(source_cmd_opts_t &opts, int *optind, int argc, wchar_t **argv,
+                          parser_t &parser, io_streams_t &streams) {
+    wchar_t *cmd = argv[0];
+    int opt;
+    wgetopter_t w;
+    while ((opt = w.wgetopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': {
+                opts.print_help = true;
+                break;
+            }
+            case 'p': {
+                opts.prefetch = true;
+                break;
+            }
+            case 's': {
+                opts.stream = true;
+                break;
+            }
+            case ':': {
+                builtin_missing_argument(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            case '?': {
+                builtin_unknown_option(parser, streams, cmd, argv[w.woptind - 1]);
+                return STATUS_INVALID_ARGS;
+            }
+            default: {
+                DIE("unexpected retval from wgetopt_long");
+                break;
+            }
+        }
+    }
+
+    *optind = w.woptind;
+    return STATUS_CMD_OK;
+}
+
 /// The  source builtin, sometimes called `.`. Evaluates the contents of a file in the current
 /// context.
 int builtin_source(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     ASSERT_IS_MAIN_THREAD();
     const wchar_t *cmd = argv[0];
     int argc = builtin_count_args(argv);
-    help_only_cmd_opts_t opts;
+    source_cmd_opts_t opts;
 
     int optind;
-    int retval = parse_help_only_cmd_opts(opts, &optind, argc, argv, parser, streams);
+    int retval = parse_cmd_opts(opts, &optind, argc, argv, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
 
     if (opts.print_help) {
@@ -35,9 +86,16 @@ int builtin_source(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         return STATUS_CMD_OK;
     }
 
+    if (opts.prefetch) {
+        // Read and parse the files in the background, so that sourcing them later only runs them.
+        parse_util_prefetch_files(wcstring_list_t(argv + optind, argv + argc));
+        return STATUS_CMD_OK;
+    }
+
     int fd;
     struct stat buf;
     const wchar_t *fn, *fn_intern;
+    const wchar_t *cache_path = NULL;
 
     if (argc == optind || wcscmp(argv[optind], L"-") == 0) {
         // Either a bare `source` which means to implicitly read from stdin or an explicit `-`.
@@ -67,6 +125,9 @@ int builtin_source(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         }
 
         fn_intern = intern(argv[optind]);
+        // Regular files are typically sourced again by every new shell; this is how autoloaded
+        // functions and completions are read. So their parse trees are worth caching.
+        cache_path = fn_intern;
     }
 
     const source_block_t *sb = parser.push_block<source_block_t>(fn_intern);
@@ -76,7 +137,8 @@ int builtin_source(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     // points to the end of argv. Otherwise we want to skip the file name to get to the args if any.
     env_set_argv(argv + optind + (argc == optind ? 0 : 1));
 
-    retval = reader_read(fd, streams.io_chain ? *streams.io_chain : io_chain_t());
+    retval = reader_read(fd, streams.io_chain ? *streams.io_chain : io_chain_t(), cache_path,
+                         opts.stream);
 
     parser.pop_block(sb);
 
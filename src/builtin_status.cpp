@@ -1,19 +1,35 @@
 // Implementation of the status builtin.
 #include "config.h"  // IWYU pragma: keep
 
+#include <errno.h>
 #include <stddef.h>
+#include <sys/resource.h>
 #include <wchar.h>
 
+#include <initializer_list>
 #include <string>
 
+#include "autoload.h"
 #include "builtin.h"
 #include "builtin_status.h"
 #include "common.h"
+#include "complete.h"
+#include "complete_db.h"
+#include "env.h"
+#include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "function.h"
+#include "highlight.h"
+#include "history.h"
 #include "io.h"
+#include "kill.h"
+#include "lru.h"
 #include "parser.h"
 #include "proc.h"
+#include "reader.h"
+#include "screen.h"
 #include "wgetopt.h"
+#include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 enum status_cmd_t {
@@ -28,13 +44,23 @@ enum status_cmd_t {
     STATUS_FILENAME,
     STATUS_FUNCTION,
     STATUS_LINE_NUMBER,
+    STATUS_MEMORY,
+    STATUS_RESOURCE_USAGE,
     STATUS_SET_JOB_CONTROL,
     STATUS_STACK_TRACE,
+    STATUS_AUTOLOAD_STATS,
+    STATUS_CACHE_STATS,
+    STATUS_CONDITION_STATS,
+    STATUS_START_SAMPLING,
+    STATUS_STOP_SAMPLING,
     STATUS_UNDEF
 };
 
 // Must be sorted by string, not enum or random.
 const enum_map<status_cmd_t> status_enum_map[] = {
+    {STATUS_AUTOLOAD_STATS, L"autoload-stats"},
+    {STATUS_CACHE_STATS, L"cache-stats"},
+    {STATUS_CONDITION_STATS, L"complete-condition-stats"},
     {STATUS_FILENAME, L"current-filename"},
     {STATUS_FUNCTION, L"current-function"},
     {STATUS_LINE_NUMBER, L"current-line-number"},
@@ -50,8 +76,12 @@ const enum_map<status_cmd_t> status_enum_map[] = {
     {STATUS_IS_NO_JOB_CTRL, L"is-no-job-control"},
     {STATUS_SET_JOB_CONTROL, L"job-control"},
     {STATUS_LINE_NUMBER, L"line-number"},
+    {STATUS_MEMORY, L"memory"},
     {STATUS_STACK_TRACE, L"print-stack-trace"},
+    {STATUS_RESOURCE_USAGE, L"resource-usage"},
     {STATUS_STACK_TRACE, L"stack-trace"},
+    {STATUS_START_SAMPLING, L"start-sampling"},
+    {STATUS_STOP_SAMPLING, L"stop-sampling"},
     {STATUS_UNDEF, NULL}};
 #define status_enum_map_len (sizeof status_enum_map / sizeof *status_enum_map)
 
@@ -236,6 +266,153 @@ static int parse_cmd_opts(status_cmd_opts_t &opts, int *optind,  //!OCLINT(high
     return STATUS_CMD_OK;
 }
 
+/// A counter reported by `status cache-stats` or `status memory`.
+struct counter_t {
+    const wchar_t *name;
+    unsigned long long value;
+};
+
+/// Print one line describing a part of fish: its name, then each counter as name=value, separated
+/// by spaces.
+static void append_counters(io_streams_t &streams, const wchar_t *name,
+                            std::initializer_list<counter_t> counters) {
+    streams.out.append(name);
+    for (const counter_t &counter : counters) {
+        streams.out.append_format(L" %ls=%llu", counter.name, counter.value);
+    }
+    streams.out.push_back(L'\n');
+}
+
+/// Print the counters of fish's caches for `status cache-stats`.
+static void print_cache_stats(io_streams_t &streams) {
+    const struct {
+        const wchar_t *name;
+        autoload_stats_t stats;
+    } autoloaders[] = {{L"function-autoload", function_autoload_stats()},
+                       {L"completion-autoload", complete_autoload_stats()}};
+    for (const auto &autoloader : autoloaders) {
+        const autoload_stats_t &stats = autoloader.stats;
+        append_counters(streams, autoloader.name,
+                        {{L"entries", stats.entries},
+                         {L"limit", stats.limit},
+                         {L"hits", stats.hits},
+                         {L"misses", stats.misses},
+                         {L"evictions", stats.evictions},
+                         {L"reloads", stats.reloads}});
+    }
+
+    const complete_db_stats_t database = complete_db_stats();
+    append_counters(streams, L"completion-database",
+                    {{L"entries", database.entries},
+                     {L"hits", database.hits},
+                     {L"misses", database.misses}});
+
+    const complete_condition_stats_t conditions = complete_condition_stats();
+    append_counters(streams, L"complete-conditions",
+                    {{L"entries", conditions.entries},
+                     {L"hits", conditions.hits},
+                     {L"misses", conditions.misses},
+                     {L"flushes", conditions.flushes}});
+
+    const abbreviation_stats_t abbreviations = abbreviation_stats();
+    append_counters(streams, L"abbreviations",
+                    {{L"entries", abbreviations.entries},
+                     {L"hits", abbreviations.hits},
+                     {L"misses", abbreviations.misses}});
+
+    const screen_cache_stats_t screen = screen_cache_stats();
+    append_counters(streams, L"escape-sequences",
+                    {{L"entries", screen.escape_entries},
+                     {L"hits", screen.escape_hits},
+                     {L"misses", screen.escape_misses}});
+    append_counters(streams, L"prompt-layouts",
+                    {{L"entries", screen.prompt_entries},
+                     {L"hits", screen.prompt_hits},
+                     {L"misses", screen.prompt_misses}});
+
+    const wildcard_cache_stats_t wildcards = wildcard_cache_stats();
+    append_counters(streams, L"wildcards",
+                    {{L"hits", wildcards.hits}, {L"misses", wildcards.misses}});
+
+    const lru_cache_stats_t probes = highlight_path_probe_stats();
+    append_counters(streams, L"path-probes",
+                    {{L"entries", probes.entries},
+                     {L"hits", probes.hits},
+                     {L"misses", probes.misses},
+                     {L"evictions", probes.evictions},
+                     {L"expirations", probes.expirations}});
+
+    // Only report on a history that is already in use, rather than loading one to describe it.
+    if (history_t *history = reader_get_history()) {
+        const history_memory_stats_t stats = history->memory_stats();
+        append_counters(streams, L"history",
+                        {{L"new-items", stats.new_item_count},
+                         {L"new-item-bytes", stats.new_item_bytes},
+                         {L"old-items", stats.old_item_count},
+                         {L"decoded-items", stats.decoded_item_count},
+                         {L"decoded-item-bytes", stats.decoded_item_bytes},
+                         {L"trigram-index-bytes", stats.trigram_index_bytes},
+                         {L"limit", stats.limit}});
+    }
+}
+
+/// Print the approximate memory used by parts of fish for `status memory`.
+static void print_memory_usage(io_streams_t &streams) {
+    // Only report on a history that is already in use, rather than loading one to describe it.
+    if (history_t *history = reader_get_history()) {
+        const history_memory_stats_t stats = history->memory_stats();
+        append_counters(streams, L"history",
+                        {{L"new-items", stats.new_item_count},
+                         {L"new-item-bytes", stats.new_item_bytes},
+                         {L"old-items", stats.old_item_count},
+                         {L"old-item-offset-bytes", stats.old_item_offset_bytes},
+                         {L"decoded-item-bytes", stats.decoded_item_bytes},
+                         {L"trigram-index-bytes", stats.trigram_index_bytes},
+                         {L"mmap-bytes", stats.mmap_bytes},
+                         {L"item-text-bytes", stats.item_text_bytes},
+                         {L"item-text-wide-bytes", stats.item_text_wide_bytes}});
+    }
+
+    const struct {
+        const wchar_t *name;
+        memory_usage_t usage;
+    } parts[] = {{L"variables", env_memory_usage()},
+                 {L"functions", function_memory_usage()},
+                 {L"completions", complete_memory_usage()},
+                 {L"kill-ring", kill_memory_usage()}};
+    for (const auto &part : parts) {
+        append_counters(streams, part.name,
+                        {{L"count", part.usage.count}, {L"bytes", part.usage.bytes}});
+    }
+}
+
+/// Print the resources used by fish itself and by the processes it started for `status
+/// resource-usage`.
+static void print_resource_usage(io_streams_t &streams) {
+    struct rusage self;
+    if (getrusage(RUSAGE_SELF, &self) == 0) {
+        unsigned long long max_rss_kb = self.ru_maxrss;
+#ifdef __APPLE__
+        max_rss_kb /= 1024;  // macOS reports bytes rather than kilobytes
+#endif
+        append_counters(streams, L"shell",
+                        {{L"user-usec", (unsigned long long)self.ru_utime.tv_sec * 1000000 +
+                                            self.ru_utime.tv_usec},
+                         {L"system-usec", (unsigned long long)self.ru_stime.tv_sec * 1000000 +
+                                              self.ru_stime.tv_usec},
+                         {L"max-rss-kb", max_rss_kb}});
+    }
+
+    const proc_usage_t children = proc_get_usage();
+    append_counters(streams, L"children",
+                    {{L"user-usec", children.user_usec},
+                     {L"system-usec", children.system_usec},
+                     {L"max-rss-kb", children.max_rss_kb},
+                     {L"reaped", children.reaped},
+                     {L"spawned", children.spawned},
+                     {L"spawn-usec", children.spawn_usec}});
+}
+
 /// The status builtin. Gives various status information on fish.
 int builtin_status(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     wchar_t *cmd = argv[0];
@@ -374,6 +551,73 @@ int builtin_status(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
             streams.out.append(parser.stack_trace());
             break;
         }
+        case STATUS_AUTOLOAD_STATS: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            const struct {
+                const wchar_t *name;
+                autoload_stats_t stats;
+            } autoloaders[] = {{L"functions", function_autoload_stats()},
+                               {L"completions", complete_autoload_stats()}};
+            for (const auto &autoloader : autoloaders) {
+                const autoload_stats_t &stats = autoloader.stats;
+                streams.out.append_format(
+                    _(L"%ls: %lu of %lu entries, %llu hits, %llu misses, %llu evictions, "
+                      L"%llu reloads\n"),
+                    autoloader.name, (unsigned long)stats.entries, (unsigned long)stats.limit,
+                    (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                    (unsigned long long)stats.evictions, (unsigned long long)stats.reloads);
+            }
+            break;
+        }
+        case STATUS_CACHE_STATS: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            print_cache_stats(streams);
+            break;
+        }
+        case STATUS_MEMORY: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            print_memory_usage(streams);
+            break;
+        }
+        case STATUS_RESOURCE_USAGE: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            print_resource_usage(streams);
+            break;
+        }
+        case STATUS_CONDITION_STATS: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            const complete_condition_stats_t stats = complete_condition_stats();
+            streams.out.append_format(_(L"%lu entries, %llu hits, %llu misses, %llu flushes\n"),
+                                      (unsigned long)stats.entries, (unsigned long long)stats.hits,
+                                      (unsigned long long)stats.misses,
+                                      (unsigned long long)stats.flushes);
+            break;
+        }
+        case STATUS_START_SAMPLING: {
+            if (args.size() > 1) {
+                const wchar_t *subcmd_str = enum_to_str(opts.status_cmd, status_enum_map);
+                streams.err.append_format(BUILTIN_ERR_ARG_COUNT2, cmd, subcmd_str, 1, args.size());
+                return STATUS_INVALID_ARGS;
+            }
+            long interval_msec = 10;
+            if (args.size() == 1) {
+                interval_msec = fish_wcstol(args[0].c_str());
+                if (errno || interval_msec <= 0) {
+                    streams.err.append_format(BUILTIN_ERR_NOT_NUMBER, cmd, args[0].c_str());
+                    return STATUS_INVALID_ARGS;
+                }
+            }
+            if (!parser.start_sampling(interval_msec * 1000)) {
+                streams.err.append_format(_(L"%ls: Could not start the sampling timer\n"), cmd);
+                return STATUS_CMD_ERROR;
+            }
+            break;
+        }
+        case STATUS_STOP_SAMPLING: {
+            CHECK_FOR_UNEXPECTED_STATUS_ARGS(opts.status_cmd)
+            streams.out.append(parser.stop_sampling());
+            break;
+        }
     }
 
     return retval;
@@ -11,15 +11,18 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 #include <wctype.h>
 
 #include <algorithm>
 #include <cwctype>
+#include <functional>
 #include <iterator>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -27,6 +30,7 @@
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "lru.h"
 #include "parse_util.h"
 #include "pcre2.h"
 #include "wcstringutil.h"
@@ -57,44 +61,85 @@ static bool string_args_from_stdin(const io_streams_t &streams) {
     return streams.stdin_is_directly_redirected;
 }
 
-static const wchar_t *string_get_arg_stdin(wcstring *storage, const io_streams_t &streams) {
-    std::string arg;
-    for (;;) {
-        char ch = '\0';
-        long rc = read_blocked(streams.stdin_fd, &ch, 1);
+static const wchar_t *string_get_arg_argv(int *argidx, wchar_t **argv) {
+    return argv && argv[*argidx] ? argv[(*argidx)++] : NULL;
+}
 
-        if (rc < 0) {  // failure
-            return NULL;
-        }
+/// Number of bytes read from stdin at a time.
+#define STRING_CHUNK_SIZE 65536
+
+/// Yields the arguments of a string subcommand: the rest of argv, or the lines of stdin if we are
+/// reading from it. Stdin is read in large blocks, not a byte at a time.
+class arg_iterator_t {
+    wchar_t **argv;
+    int argidx;
+    const io_streams_t &streams;
+    // Bytes read from stdin. Those before buffer_start have already been returned.
+    std::string buffer;
+    size_t buffer_start;
+    // There is no newline in the buffer before this offset.
+    size_t newline_search_start;
+    bool at_eof;
+    // Backing storage for a line read from stdin.
+    wcstring storage;
 
-        if (rc == 0) {  // EOF
-            if (arg.empty()) {
-                return NULL;
-            }
-            break;
-        }
+    const wchar_t *next_from_stdin();
 
-        if (ch == '\n') {
-            break;
+   public:
+    arg_iterator_t(wchar_t **argv_, int argidx_, const io_streams_t &streams_)
+        : argv(argv_),
+          argidx(argidx_),
+          streams(streams_),
+          buffer_start(0),
+          newline_search_start(0),
+          at_eof(false) {}
+
+    /// Returns the next argument, or NULL if there are no more.
+    const wchar_t *next() {
+        if (string_args_from_stdin(streams)) {
+            return next_from_stdin();
         }
-
-        arg += ch;
+        return string_get_arg_argv(&argidx, argv);
     }
+};
 
-    *storage = str2wcstring(arg);
-    return storage->c_str();
-}
+const wchar_t *arg_iterator_t::next_from_stdin() {
+    for (;;) {
+        const char *newline = static_cast<const char *>(memchr(
+            buffer.data() + newline_search_start, '\n', buffer.size() - newline_search_start));
+        if (newline != NULL) {
+            size_t line_end = newline - buffer.data();
+            storage = str2wcstring(buffer.data() + buffer_start, line_end - buffer_start);
+            buffer_start = newline_search_start = line_end + 1;
+            return storage.c_str();
+        }
+        newline_search_start = buffer.size();
 
-static const wchar_t *string_get_arg_argv(int *argidx, wchar_t **argv) {
-    return argv && argv[*argidx] ? argv[(*argidx)++] : NULL;
-}
+        if (at_eof) {
+            // The last line need not end in a newline.
+            if (buffer_start == buffer.size()) {
+                return NULL;
+            }
+            storage = str2wcstring(buffer.data() + buffer_start, buffer.size() - buffer_start);
+            buffer_start = newline_search_start = buffer.size();
+            return storage.c_str();
+        }
 
-static const wchar_t *string_get_arg(int *argidx, wchar_t **argv, wcstring *storage,
-                                     const io_streams_t &streams) {
-    if (string_args_from_stdin(streams)) {
-        return string_get_arg_stdin(storage, streams);
+        // Drop the lines we have returned, and read another block.
+        buffer.erase(0, buffer_start);
+        newline_search_start -= buffer_start;
+        buffer_start = 0;
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + STRING_CHUNK_SIZE);
+        long rc = read_blocked(streams.stdin_fd, &buffer[old_size], STRING_CHUNK_SIZE);
+        buffer.resize(old_size + (rc > 0 ? rc : 0));
+        if (rc < 0) {  // failure
+            return NULL;
+        }
+        if (rc == 0) {
+            at_eof = true;
+        }
     }
-    return string_get_arg_argv(argidx, argv);
 }
 
 // This is used by the string subcommands to communicate with the option parser which flags are
@@ -113,11 +158,15 @@ typedef struct {  //!OCLINT(too many fields)
     bool max_valid = false;
     bool no_newline_valid = false;
     bool no_quoted_valid = false;
+    bool pattern_valid = false;
     bool quiet_valid = false;
     bool regex_valid = false;
+    bool reverse_valid = false;
     bool right_valid = false;
     bool start_valid = false;
     bool style_valid = false;
+    bool unique_valid = false;
+    bool which_valid = false;
 
     bool all = false;
     bool entire = false;
@@ -130,7 +179,10 @@ typedef struct {  //!OCLINT(too many fields)
     bool no_quoted = false;
     bool quiet = false;
     bool regex = false;
+    bool reverse = false;
     bool right = false;
+    bool unique = false;
+    bool which = false;
 
     long count = 0;
     long length = 0;
@@ -140,6 +192,8 @@ typedef struct {  //!OCLINT(too many fields)
     const wchar_t *chars_to_trim = L" \f\n\r\t";
     const wchar_t *arg1 = NULL;
     const wchar_t *arg2 = NULL;
+    // Patterns given with --pattern. These take the place of the first argument.
+    wcstring_list_t patterns;
 
     escape_string_style_t escape_style = STRING_STYLE_SCRIPT;
 } options_t;
@@ -305,6 +359,9 @@ static int handle_flag_r(wchar_t **argv, parser_t &parser, io_streams_t &streams
     if (opts->regex_valid) {
         opts->regex = true;
         return STATUS_CMD_OK;
+    } else if (opts->reverse_valid) {
+        opts->reverse = true;
+        return STATUS_CMD_OK;
     } else if (opts->right_valid) {
         opts->right = true;
         return STATUS_CMD_OK;
@@ -330,6 +387,26 @@ static int handle_flag_s(wchar_t **argv, parser_t &parser, io_streams_t &streams
     return STATUS_INVALID_ARGS;
 }
 
+static int handle_flag_p(wchar_t **argv, parser_t &parser, io_streams_t &streams, wgetopter_t &w,
+                         options_t *opts) {
+    if (opts->pattern_valid) {
+        opts->patterns.push_back(w.woptarg);
+        return STATUS_CMD_OK;
+    }
+    string_unknown_option(parser, streams, argv[0], argv[w.woptind - 1]);
+    return STATUS_INVALID_ARGS;
+}
+
+static int handle_flag_u(wchar_t **argv, parser_t &parser, io_streams_t &streams, wgetopter_t &w,
+                         options_t *opts) {
+    if (opts->unique_valid) {
+        opts->unique = true;
+        return STATUS_CMD_OK;
+    }
+    string_unknown_option(parser, streams, argv[0], argv[w.woptind - 1]);
+    return STATUS_INVALID_ARGS;
+}
+
 static int handle_flag_v(wchar_t **argv, parser_t &parser, io_streams_t &streams, wgetopter_t &w,
                          options_t *opts) {
     if (opts->invert_valid) {
@@ -340,6 +417,16 @@ static int handle_flag_v(wchar_t **argv, parser_t &parser, io_streams_t &streams
     return STATUS_INVALID_ARGS;
 }
 
+static int handle_flag_w(wchar_t **argv, parser_t &parser, io_streams_t &streams, wgetopter_t &w,
+                         options_t *opts) {
+    if (opts->which_valid) {
+        opts->which = true;
+        return STATUS_CMD_OK;
+    }
+    string_unknown_option(parser, streams, argv[0], argv[w.woptind - 1]);
+    return STATUS_INVALID_ARGS;
+}
+
 /// This constructs the wgetopt() short options string based on which arguments are valid for the
 /// subcommand. We have to do this because many short flags have multiple meanings and may or may
 /// not require an argument depending on the meaning.
@@ -358,10 +445,14 @@ static wcstring construct_short_opts(options_t *opts) {  //!OCLINT(high npath co
     if (opts->max_valid) short_opts.append(L"m:");
     if (opts->no_newline_valid) short_opts.append(L"N");
     if (opts->no_quoted_valid) short_opts.append(L"n");
+    if (opts->pattern_valid) short_opts.append(L"p:");
     if (opts->quiet_valid) short_opts.append(L"q");
     if (opts->regex_valid) short_opts.append(L"r");
+    if (opts->reverse_valid) short_opts.append(L"r");
     if (opts->right_valid) short_opts.append(L"r");
     if (opts->start_valid) short_opts.append(L"s:");
+    if (opts->unique_valid) short_opts.append(L"u");
+    if (opts->which_valid) short_opts.append(L"w");
     return short_opts;
 }
 
@@ -380,18 +471,23 @@ static const struct woption long_options[] = {{L"all", no_argument, NULL, 'a'},
                                               {L"max", required_argument, NULL, 'm'},
                                               {L"no-newline", no_argument, NULL, 'N'},
                                               {L"no-quoted", no_argument, NULL, 'n'},
+                                              {L"pattern", required_argument, NULL, 'p'},
                                               {L"quiet", no_argument, NULL, 'q'},
                                               {L"regex", no_argument, NULL, 'r'},
+                                              {L"reverse", no_argument, NULL, 'r'},
                                               {L"right", no_argument, NULL, 'r'},
                                               {L"start", required_argument, NULL, 's'},
                                               {L"style", required_argument, NULL, 1},
+                                              {L"unique", no_argument, NULL, 'u'},
+                                              {L"which", no_argument, NULL, 'w'},
                                               {NULL, 0, NULL, 0}};
 
 static std::unordered_map<char, decltype(*handle_flag_N)> flag_to_function = {
     {'N', handle_flag_N}, {'a', handle_flag_a}, {'c', handle_flag_c}, {'e', handle_flag_e},
     {'f', handle_flag_f}, {'i', handle_flag_i}, {'l', handle_flag_l}, {'m', handle_flag_m},
-    {'n', handle_flag_n}, {'q', handle_flag_q}, {'r', handle_flag_r}, {'s', handle_flag_s},
-    {'v', handle_flag_v}, {1, handle_flag_1}};
+    {'n', handle_flag_n}, {'p', handle_flag_p}, {'q', handle_flag_q}, {'r', handle_flag_r},
+    {'s', handle_flag_s}, {'u', handle_flag_u}, {'v', handle_flag_v}, {'w', handle_flag_w},
+    {1, handle_flag_1}};
 
 /// Parse the arguments for flags recognized by a specific string subcommand.
 static int parse_opts(options_t *opts, int *optind, int n_req_args, int argc, wchar_t **argv,
@@ -419,6 +515,9 @@ static int parse_opts(options_t *opts, int *optind, int n_req_args, int argc, wc
 
     *optind = w.woptind;
 
+    // Patterns given with --pattern take the place of the first required arg.
+    if (n_req_args && !opts->patterns.empty()) n_req_args--;
+
     // If the caller requires one or two mandatory args deal with that here.
     if (n_req_args) {
         opts->arg1 = string_get_arg_argv(optind, argv);
@@ -447,12 +546,12 @@ static int parse_opts(options_t *opts, int *optind, int n_req_args, int argc, wc
 /// Escape a string so that it can be used in a fish script without further word splitting.
 static int string_escape_script(options_t &opts, int optind, wchar_t **argv,
                                 io_streams_t &streams) {
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     escape_flags_t flags = ESCAPE_ALL;
     if (opts.no_quoted) flags |= ESCAPE_NO_QUOTED;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         streams.out.append(escape_string(arg, flags, STRING_STYLE_SCRIPT));
         streams.out.append(L'\n');
         nesc++;
@@ -464,11 +563,11 @@ static int string_escape_script(options_t &opts, int optind, wchar_t **argv,
 /// Escape a string so that it can be used as a URL.
 static int string_escape_url(options_t &opts, int optind, wchar_t **argv, io_streams_t &streams) {
     UNUSED(opts);
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     escape_flags_t flags = 0;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         streams.out.append(escape_string(arg, flags, STRING_STYLE_URL));
         streams.out.append(L'\n');
         nesc++;
@@ -480,11 +579,11 @@ static int string_escape_url(options_t &opts, int optind, wchar_t **argv, io_str
 /// Escape a string so that it can be used as a fish var name.
 static int string_escape_var(options_t &opts, int optind, wchar_t **argv, io_streams_t &streams) {
     UNUSED(opts);
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     escape_flags_t flags = 0;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         streams.out.append(escape_string(arg, flags, STRING_STYLE_VAR));
         streams.out.append(L'\n');
         nesc++;
@@ -497,11 +596,11 @@ static int string_escape_var(options_t &opts, int optind, wchar_t **argv, io_str
 static int string_unescape_script(options_t &opts, int optind, wchar_t **argv,
                                   io_streams_t &streams) {
     UNUSED(opts);
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     unescape_flags_t flags = 0;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         wcstring result;
         if (unescape_string(arg, &result, flags, STRING_STYLE_SCRIPT)) {
             streams.out.append(result);
@@ -516,11 +615,11 @@ static int string_unescape_script(options_t &opts, int optind, wchar_t **argv,
 /// Unescape an encoded URL.
 static int string_unescape_url(options_t &opts, int optind, wchar_t **argv, io_streams_t &streams) {
     UNUSED(opts);
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     unescape_flags_t flags = 0;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         wcstring result;
         if (unescape_string(arg, &result, flags, STRING_STYLE_URL)) {
             streams.out.append(result);
@@ -535,11 +634,11 @@ static int string_unescape_url(options_t &opts, int optind, wchar_t **argv, io_s
 /// Unescape an encoded var name.
 static int string_unescape_var(options_t &opts, int optind, wchar_t **argv, io_streams_t &streams) {
     UNUSED(opts);
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     int nesc = 0;
     unescape_flags_t flags = 0;
 
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    while (const wchar_t *arg = aiter.next()) {
         wcstring result;
         if (unescape_string(arg, &result, flags, STRING_STYLE_VAR)) {
             streams.out.append(result);
@@ -607,8 +706,8 @@ static int string_join(parser_t &parser, io_streams_t &streams, int argc, wchar_
     const wchar_t *sep = opts.arg1;
     int nargs = 0;
     const wchar_t *arg;
-    wcstring storage;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != 0) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while ((arg = aiter.next()) != 0) {
         if (!opts.quiet) {
             if (nargs > 0) {
                 streams.out.append(sep);
@@ -633,8 +732,8 @@ static int string_length(parser_t &parser, io_streams_t &streams, int argc, wcha
 
     const wchar_t *arg;
     int nnonempty = 0;
-    wcstring storage;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != 0) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while ((arg = aiter.next()) != 0) {
         size_t n = wcslen(arg);
         if (n > 0) {
             nnonempty++;
@@ -653,6 +752,8 @@ class string_matcher_t {
     options_t opts;
     io_streams_t &streams;
     int total_matched;
+    // Printed at the start of each line of output, e.g. the number of the pattern with --which.
+    wcstring line_prefix;
 
    public:
     string_matcher_t(const options_t &opts_, io_streams_t &streams_)
@@ -660,17 +761,20 @@ class string_matcher_t {
 
     virtual ~string_matcher_t() {}
     virtual bool report_matches(const wchar_t *arg) = 0;
+    /// Returns whether the pattern matches the argument, ignoring --invert and without output.
+    /// Errors count as a match, so that report_matches() gets to report them.
+    virtual bool matches(const wchar_t *arg) = 0;
     int match_count() { return total_matched; }
+    void set_line_prefix(const wcstring &prefix) { line_prefix = prefix; }
 };
 
 class wildcard_matcher_t : public string_matcher_t {
    private:
-    wcstring wcpattern;
+    // The pattern is prepared once, as it is matched against every argument.
+    const wildcard_pattern_t wcpattern;
 
-   public:
-    wildcard_matcher_t(const wchar_t * /*argv0*/, const wchar_t *pattern, const options_t &opts,
-                       io_streams_t &streams)
-        : string_matcher_t(opts, streams), wcpattern(parse_util_unescape_wildcards(pattern)) {
+    static wcstring make_pattern(const wchar_t *pattern, const options_t &opts) {
+        wcstring wcpattern = parse_util_unescape_wildcards(pattern);
         if (opts.ignore_case) {
             for (size_t i = 0; i < wcpattern.length(); i++) {
                 wcpattern[i] = towlower(wcpattern[i]);
@@ -680,28 +784,35 @@ class wildcard_matcher_t : public string_matcher_t {
             if (wcpattern.front() != ANY_STRING) wcpattern.insert(0, 1, ANY_STRING);
             if (wcpattern.back() != ANY_STRING) wcpattern.push_back(ANY_STRING);
         }
+        return wcpattern;
     }
 
-    virtual ~wildcard_matcher_t() {}
+   public:
+    wildcard_matcher_t(const wchar_t * /*argv0*/, const wchar_t *pattern, const options_t &opts,
+                       io_streams_t &streams)
+        : string_matcher_t(opts, streams), wcpattern(make_pattern(pattern, opts)) {}
 
-    bool report_matches(const wchar_t *arg) {
-        // Note: --all is a no-op for glob matching since the pattern is always matched
-        // against the entire argument.
-        bool match;
+    virtual ~wildcard_matcher_t() {}
 
+    bool matches(const wchar_t *arg) {
         if (opts.ignore_case) {
             wcstring s = arg;
             for (size_t i = 0; i < s.length(); i++) {
                 s[i] = towlower(s[i]);
             }
-            match = wildcard_match(s, wcpattern, false);
-        } else {
-            match = wildcard_match(arg, wcpattern, false);
+            return wcpattern.matches(s);
         }
-        if (match ^ opts.invert_match) {
+        return wcpattern.matches(arg);
+    }
+
+    bool report_matches(const wchar_t *arg) {
+        // Note: --all is a no-op for glob matching since the pattern is always matched
+        // against the entire argument.
+        if (matches(arg) ^ opts.invert_match) {
             total_matched++;
 
             if (!opts.quiet) {
+                streams.out.append(line_prefix);
                 if (opts.index) {
                     streams.out.append_format(L"1 %lu\n", wcslen(arg));
                 } else {
@@ -720,55 +831,119 @@ static wcstring pcre2_strerror(int err_code) {
     return buf;
 }
 
+/// Number of compiled regular expressions kept between invocations of string.
+#define REGEX_CACHE_SIZE 64
+
+/// A compiled regular expression, with match data sized for it.
 struct compiled_regex_t {
     pcre2_code *code;
     pcre2_match_data *match;
 
-    compiled_regex_t(const wchar_t *argv0, const wchar_t *pattern, bool ignore_case,
-                     io_streams_t &streams)
-        : code(0), match(0) {
-        // Disable some sequences that can lead to security problems.
-        uint32_t options = PCRE2_NEVER_UTF;
-#if PCRE2_CODE_UNIT_WIDTH < 32
-        options |= PCRE2_NEVER_BACKSLASH_C;
-#endif
-
-        int err_code = 0;
-        PCRE2_SIZE err_offset = 0;
-
-        code =
-            pcre2_compile(PCRE2_SPTR(pattern), PCRE2_ZERO_TERMINATED,
-                          options | (ignore_case ? PCRE2_CASELESS : 0), &err_code, &err_offset, 0);
-        if (code == 0) {
-            string_error(streams, _(L"%ls: Regular expression compile error: %ls\n"), argv0,
-                         pcre2_strerror(err_code).c_str());
-            string_error(streams, L"%ls: %ls\n", argv0, pattern);
-            string_error(streams, L"%ls: %*ls\n", argv0, err_offset, L"^");
-            return;
-        }
-
-        match = pcre2_match_data_create_from_pattern(code, 0);
+    explicit compiled_regex_t(pcre2_code *code_)
+        : code(code_), match(pcre2_match_data_create_from_pattern(code_, 0)) {
         assert(match);
+        // Failure just means the pattern is interpreted, e.g. if PCRE2 was built without JIT.
+        pcre2_jit_compile(code, PCRE2_JIT_COMPLETE);
     }
 
+    compiled_regex_t(const compiled_regex_t &) = delete;
+    void operator=(const compiled_regex_t &) = delete;
+
     ~compiled_regex_t() {
-        if (match != 0) {
-            pcre2_match_data_free(match);
+        pcre2_match_data_free(match);
+        pcre2_code_free(code);
+    }
+
+    /// pcre2_match() into our match data. Patterns that run out of JIT stack are retried with the
+    /// interpreter, which is only limited by the match limit.
+    int run_match(const wchar_t *arg, PCRE2_SIZE arglen, PCRE2_SIZE offset, uint32_t options) {
+        int rc = pcre2_match(code, PCRE2_SPTR(arg), arglen, offset, options, match, 0);
+        if (rc == PCRE2_ERROR_JIT_STACKLIMIT) {
+            rc = pcre2_match(code, PCRE2_SPTR(arg), arglen, offset, options | PCRE2_NO_JIT, match,
+                             0);
         }
-        if (code != 0) {
-            pcre2_code_free(code);
+        return rc;
+    }
+
+    /// pcre2_substitute() using our match data, with the same JIT stack fallback as run_match().
+    int run_substitute(const wchar_t *arg, PCRE2_SIZE arglen, uint32_t options,
+                       const wcstring &replacement, wchar_t *output, PCRE2_SIZE *outlen) {
+        PCRE2_SIZE bufsize = *outlen;
+        int rc = pcre2_substitute(code, PCRE2_SPTR(arg), arglen, 0, options, match, 0,
+                                  PCRE2_SPTR(replacement.c_str()), PCRE2_ZERO_TERMINATED,
+                                  (PCRE2_UCHAR *)output, outlen);
+        if (rc == PCRE2_ERROR_JIT_STACKLIMIT) {
+            *outlen = bufsize;
+            rc = pcre2_substitute(code, PCRE2_SPTR(arg), arglen, 0, options | PCRE2_NO_JIT, match,
+                                  0, PCRE2_SPTR(replacement.c_str()), PCRE2_ZERO_TERMINATED,
+                                  (PCRE2_UCHAR *)output, outlen);
         }
+        return rc;
     }
 };
 
+namespace {
+/// Compiled regular expressions keyed by pattern and flags. Loops run string match -r and string
+/// replace -r with the same pattern over and over.
+class regex_cache_t : public lru_cache_t<regex_cache_t, std::shared_ptr<compiled_regex_t>> {
+    typedef lru_cache_t<regex_cache_t, std::shared_ptr<compiled_regex_t>> super;
+
+   public:
+    regex_cache_t() : super(REGEX_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+/// Main thread only.
+static regex_cache_t s_regex_cache;
+
+/// Returns the compiled form of the pattern, compiling it if it is not in the cache. On a compile
+/// error, reports it and returns null. Errors are not cached, so they are reported every time.
+static std::shared_ptr<compiled_regex_t> get_compiled_regex(const wchar_t *argv0,
+                                                            const wchar_t *pattern,
+                                                            bool ignore_case,
+                                                            io_streams_t &streams) {
+    ASSERT_IS_MAIN_THREAD();
+    // The flag goes last, so it can't run into the pattern.
+    wcstring key = pattern;
+    key.push_back(ignore_case ? L'i' : L'c');
+    if (std::shared_ptr<compiled_regex_t> *cached = s_regex_cache.get(key)) {
+        return *cached;
+    }
+
+    // Disable some sequences that can lead to security problems.
+    uint32_t options = PCRE2_NEVER_UTF;
+#if PCRE2_CODE_UNIT_WIDTH < 32
+    options |= PCRE2_NEVER_BACKSLASH_C;
+#endif
+
+    int err_code = 0;
+    PCRE2_SIZE err_offset = 0;
+
+    pcre2_code *code =
+        pcre2_compile(PCRE2_SPTR(pattern), PCRE2_ZERO_TERMINATED,
+                      options | (ignore_case ? PCRE2_CASELESS : 0), &err_code, &err_offset, 0);
+    if (code == 0) {
+        string_error(streams, _(L"%ls: Regular expression compile error: %ls\n"), argv0,
+                     pcre2_strerror(err_code).c_str());
+        string_error(streams, L"%ls: %ls\n", argv0, pattern);
+        string_error(streams, L"%ls: %*ls\n", argv0, err_offset, L"^");
+        return nullptr;
+    }
+
+    auto regex = std::make_shared<compiled_regex_t>(code);
+    s_regex_cache.insert(std::move(key), regex);
+    return regex;
+}
+
 class pcre2_matcher_t : public string_matcher_t {
     const wchar_t *argv0;
-    compiled_regex_t regex;
+    std::shared_ptr<compiled_regex_t> regex;
 
     int report_match(const wchar_t *arg, int pcre2_rc) {
         // Return values: -1 = error, 0 = no match, 1 = match.
         if (pcre2_rc == PCRE2_ERROR_NOMATCH) {
             if (opts.invert_match && !opts.quiet) {
+                streams.out.append(line_prefix);
                 if (opts.index) {
                     streams.out.append_format(L"1 %lu\n", wcslen(arg));
                 } else {
@@ -791,16 +966,18 @@ class pcre2_matcher_t : public string_matcher_t {
         }
 
         if (opts.entire) {
+            streams.out.append(line_prefix);
             streams.out.append(arg);
             streams.out.push_back(L'\n');
         }
 
-        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(regex.match);
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(regex->match);
         for (int j = (opts.entire ? 1 : 0); j < pcre2_rc; j++) {
             PCRE2_SIZE begin = ovector[2 * j];
             PCRE2_SIZE end = ovector[2 * j + 1];
 
             if (begin != PCRE2_UNSET && end != PCRE2_UNSET && !opts.quiet) {
+                streams.out.append(line_prefix);
                 if (opts.index) {
                     streams.out.append_format(L"%lu %lu", (unsigned long)(begin + 1),
                                               (unsigned long)(end - begin));
@@ -820,14 +997,20 @@ class pcre2_matcher_t : public string_matcher_t {
                     io_streams_t &streams)
         : string_matcher_t(opts, streams),
           argv0(argv0_),
-          regex(argv0_, pattern, opts.ignore_case, streams) {}
+          regex(get_compiled_regex(argv0_, pattern, opts.ignore_case, streams)) {}
 
     virtual ~pcre2_matcher_t() {}
 
+    bool matches(const wchar_t *arg) {
+        if (!regex) return true;  // pcre2_compile() failed
+        int rc = regex->run_match(arg, wcslen(arg), 0, 0);
+        return rc != PCRE2_ERROR_NOMATCH;
+    }
+
     bool report_matches(const wchar_t *arg) {
         // A return value of true means all is well (even if no matches were found), false indicates
         // an unrecoverable error.
-        if (regex.code == 0) {
+        if (!regex) {
             // pcre2_compile() failed.
             return false;
         }
@@ -836,8 +1019,7 @@ class pcre2_matcher_t : public string_matcher_t {
 
         // See pcre2demo.c for an explanation of this logic.
         PCRE2_SIZE arglen = wcslen(arg);
-        int rc = report_match(
-            arg, pcre2_match(regex.code, PCRE2_SPTR(arg), arglen, 0, 0, regex.match, 0));
+        int rc = report_match(arg, regex->run_match(arg, arglen, 0, 0));
         if (rc < 0) {  // pcre2 match error.
             return false;
         } else if (rc == 0) {  // no match
@@ -851,7 +1033,7 @@ class pcre2_matcher_t : public string_matcher_t {
         }
 
         // Report any additional matches.
-        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(regex.match);
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(regex->match);
         while (opts.all || matched == 0) {
             uint32_t options = 0;
             PCRE2_SIZE offset = ovector[1];  // start at end of previous match
@@ -863,8 +1045,7 @@ class pcre2_matcher_t : public string_matcher_t {
                 options = PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
             }
 
-            rc = report_match(arg, pcre2_match(regex.code, PCRE2_SPTR(arg), arglen, offset, options,
-                                               regex.match, 0));
+            rc = report_match(arg, regex->run_match(arg, arglen, offset, options));
             if (rc < 0) {
                 return false;
             }
@@ -893,33 +1074,58 @@ static int string_match(parser_t &parser, io_streams_t &streams, int argc, wchar
     opts.quiet_valid = true;
     opts.regex_valid = true;
     opts.index_valid = true;
+    opts.pattern_valid = true;
+    opts.which_valid = true;
     int optind;
     int retval = parse_opts(&opts, &optind, 1, argc, argv, parser, streams);
     if (retval != STATUS_CMD_OK) return retval;
-    const wchar_t *pattern = opts.arg1;
 
     if (opts.entire && opts.index) {
         streams.err.append_format(BUILTIN_ERR_COMBO2, cmd,
                                   _(L"--entire and --index are mutually exclusive"));
         return STATUS_INVALID_ARGS;
     }
+    if (opts.which && opts.invert_match) {
+        streams.err.append_format(BUILTIN_ERR_COMBO2, cmd,
+                                  _(L"--which and --invert are mutually exclusive"));
+        return STATUS_INVALID_ARGS;
+    }
 
-    std::unique_ptr<string_matcher_t> matcher;
-    if (opts.regex) {
-        matcher = make_unique<pcre2_matcher_t>(cmd, pattern, opts, streams);
-    } else {
-        matcher = make_unique<wildcard_matcher_t>(cmd, pattern, opts, streams);
+    if (opts.patterns.empty()) opts.patterns.push_back(opts.arg1);
+    std::vector<std::unique_ptr<string_matcher_t>> matchers;
+    for (const wcstring &pattern : opts.patterns) {
+        std::unique_ptr<string_matcher_t> matcher;
+        if (opts.regex) {
+            matcher = make_unique<pcre2_matcher_t>(cmd, pattern.c_str(), opts, streams);
+        } else {
+            matcher = make_unique<wildcard_matcher_t>(cmd, pattern.c_str(), opts, streams);
+        }
+        if (opts.which) matcher->set_line_prefix(to_string(long(matchers.size() + 1)) + L" ");
+        matchers.push_back(std::move(matcher));
     }
 
     const wchar_t *arg;
-    wcstring storage;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != 0) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while ((arg = aiter.next()) != 0) {
+        // Each argument is reported by the first pattern that matches it. With --invert, it is
+        // reported if no pattern matches; the first pattern then prints it.
+        string_matcher_t *matcher = matchers.front().get();
+        if (matchers.size() > 1) {
+            auto match = std::find_if(matchers.begin(), matchers.end(),
+                                      [&](const std::unique_ptr<string_matcher_t> &m) {
+                                          return m->matches(arg);
+                                      });
+            if ((match != matchers.end()) == opts.invert_match) continue;
+            if (match != matchers.end()) matcher = match->get();
+        }
         if (!matcher->report_matches(arg)) {
             return STATUS_INVALID_ARGS;
         }
     }
 
-    return matcher->match_count() > 0 ? STATUS_CMD_OK : STATUS_CMD_ERROR;
+    int match_count = 0;
+    for (const auto &matcher : matchers) match_count += matcher->match_count();
+    return match_count > 0 ? STATUS_CMD_OK : STATUS_CMD_ERROR;
 }
 
 class string_replacer_t {
@@ -971,14 +1177,14 @@ static wcstring interpret_escapes(const wchar_t *orig) {
 }
 
 class regex_replacer_t : public string_replacer_t {
-    compiled_regex_t regex;
+    std::shared_ptr<compiled_regex_t> regex;
     wcstring replacement;
 
    public:
     regex_replacer_t(const wchar_t *argv0, const wchar_t *pattern, const wchar_t *replacement_,
                      const options_t &opts, io_streams_t &streams)
         : string_replacer_t(argv0, opts, streams),
-          regex(argv0, pattern, opts.ignore_case, streams),
+          regex(get_compiled_regex(argv0, pattern, opts.ignore_case, streams)),
           replacement(interpret_escapes(replacement_)) {}
 
     bool replace_matches(const wchar_t *arg);
@@ -993,6 +1199,20 @@ bool literal_replacer_t::replace_matches(const wchar_t *arg) {
     if (patlen == 0) {
         replacement_occurred = true;
         result = arg;
+    } else if (!opts.ignore_case) {
+        // Copy the text between matches in one go.
+        const wchar_t *cur = arg;
+        const wchar_t *end = arg + wcslen(arg);
+        while (opts.all || !replacement_occurred) {
+            const wchar_t *match = wcs_find(cur, end, pattern, patlen);
+            if (match == end) break;
+            result.append(cur, match);
+            result += replacement;
+            cur = match + patlen;
+            replacement_occurred = true;
+            total_replaced++;
+        }
+        result.append(cur, end);
     } else {
         auto &cmp_func = opts.ignore_case ? wcsncasecmp : wcsncmp;
         const wchar_t *cur = arg;
@@ -1020,7 +1240,7 @@ bool literal_replacer_t::replace_matches(const wchar_t *arg) {
 /// A return value of true means all is well (even if no replacements were performed), false
 /// indicates an unrecoverable error.
 bool regex_replacer_t::replace_matches(const wchar_t *arg) {
-    if (!regex.code) return false;  // pcre2_compile() failed
+    if (!regex) return false;  // pcre2_compile() failed
 
     uint32_t options = PCRE2_SUBSTITUTE_OVERFLOW_LENGTH | PCRE2_SUBSTITUTE_EXTENDED |
                        (opts.all ? PCRE2_SUBSTITUTE_GLOBAL : 0);
@@ -1034,12 +1254,7 @@ bool regex_replacer_t::replace_matches(const wchar_t *arg) {
         assert(output);
 
         PCRE2_SIZE outlen = bufsize;
-        pcre2_rc = pcre2_substitute(regex.code, PCRE2_SPTR(arg), arglen,
-                                    0,  // start offset
-                                    options, regex.match,
-                                    0,  // match context
-                                    PCRE2_SPTR(replacement.c_str()), PCRE2_ZERO_TERMINATED,
-                                    (PCRE2_UCHAR *)output, &outlen);
+        pcre2_rc = regex->run_substitute(arg, arglen, options, replacement, output, &outlen);
 
         if (pcre2_rc != PCRE2_ERROR_NOMEMORY || bufsize >= outlen) {
             done = true;
@@ -1089,8 +1304,8 @@ static int string_replace(parser_t &parser, io_streams_t &streams, int argc, wch
         replacer = make_unique<literal_replacer_t>(argv[0], pattern, replacement, opts, streams);
     }
 
-    wcstring storage;
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while (const wchar_t *arg = aiter.next()) {
         if (!replacer->replace_matches(arg)) return STATUS_INVALID_ARGS;
     }
 
@@ -1112,9 +1327,9 @@ static int string_split(parser_t &parser, io_streams_t &streams, int argc, wchar
 
     wcstring_list_t splits;
     size_t arg_count = 0;
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     const wchar_t *arg;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != 0) {
+    while ((arg = aiter.next()) != 0) {
         const wchar_t *arg_end = arg + wcslen(arg);
         if (opts.right) {
             typedef std::reverse_iterator<const wchar_t *> reverser;
@@ -1158,15 +1373,6 @@ static wcstring wcsrepeat(const wcstring &to_repeat, size_t count) {
     return repeated;
 }
 
-// Helper function to abstract the repeat until logic from string_repeat
-// returns the to_repeat string, repeated until max char has been reached.
-static wcstring wcsrepeat_until(const wcstring &to_repeat, size_t max) {
-    size_t count = max / to_repeat.length();
-    size_t mod = max % to_repeat.length();
-
-    return wcsrepeat(to_repeat, count) + to_repeat.substr(0, mod);
-}
-
 static int string_repeat(parser_t &parser, io_streams_t &streams, int argc, wchar_t **argv) {
     options_t opts;
     opts.count_valid = true;
@@ -1178,19 +1384,26 @@ static int string_repeat(parser_t &parser, io_streams_t &streams, int argc, wcha
     if (retval != STATUS_CMD_OK) return retval;
 
     const wchar_t *to_repeat;
-    wcstring storage;
+    arg_iterator_t aiter(argv, optind, streams);
     bool is_empty = true;
 
-    if ((to_repeat = string_get_arg(&optind, argv, &storage, streams)) != NULL && *to_repeat) {
+    if ((to_repeat = aiter.next()) != NULL && *to_repeat) {
         const wcstring word(to_repeat);
         const bool limit_repeat =
             (opts.max > 0 && word.length() * opts.count > (size_t)opts.max) || !opts.count;
-        const wcstring repeated =
-            limit_repeat ? wcsrepeat_until(word, opts.max) : wcsrepeat(word, opts.count);
-        is_empty = repeated.empty();
+        const size_t total = limit_repeat ? opts.max : word.length() * opts.count;
+        is_empty = total == 0;
 
         if (!opts.quiet && !is_empty) {
-            streams.out.append(repeated);
+            // Output a chunk of whole repetitions at a time, so that output which is passed on as
+            // it goes never has to be held in full.
+            const wcstring chunk = wcsrepeat(word, std::max(size_t(1), 4096 / word.length()));
+            size_t remaining = total;
+            for (; remaining >= chunk.size(); remaining -= chunk.size()) {
+                streams.out.append(chunk);
+            }
+            // The chunk starts at a repetition boundary, so its start continues the output.
+            streams.out.append(chunk.data(), remaining);
             if (!opts.no_newline) streams.out.append(L"\n");
         }
     }
@@ -1210,8 +1423,8 @@ static int string_sub(parser_t &parser, io_streams_t &streams, int argc, wchar_t
 
     int nsub = 0;
     const wchar_t *arg;
-    wcstring storage;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != NULL) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while ((arg = aiter.next()) != NULL) {
         typedef wcstring::size_type size_type;
         size_type pos = 0;
         size_type count = wcstring::npos;
@@ -1261,8 +1474,8 @@ static int string_trim(parser_t &parser, io_streams_t &streams, int argc, wchar_
     size_t ntrim = 0;
 
     wcstring argstr;
-    wcstring storage;
-    while ((arg = string_get_arg(&optind, argv, &storage, streams)) != 0) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while ((arg = aiter.next()) != 0) {
         argstr = arg;
         // Begin and end are respectively the first character to keep on the left, and first
         // character to trim on the right. The length is thus end - start.
@@ -1295,8 +1508,8 @@ static int string_lower(parser_t &parser, io_streams_t &streams, int argc, wchar
     if (retval != STATUS_CMD_OK) return retval;
 
     int n_transformed = 0;
-    wcstring storage;
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while (const wchar_t *arg = aiter.next()) {
         wcstring transformed(arg);
         std::transform(transformed.begin(), transformed.end(), transformed.begin(), std::towlower);
         if (wcscmp(transformed.c_str(), arg)) n_transformed++;
@@ -1318,8 +1531,8 @@ static int string_upper(parser_t &parser, io_streams_t &streams, int argc, wchar
     if (retval != STATUS_CMD_OK) return retval;
 
     int n_transformed = 0;
-    wcstring storage;
-    while (const wchar_t *arg = string_get_arg(&optind, argv, &storage, streams)) {
+    arg_iterator_t aiter(argv, optind, streams);
+    while (const wchar_t *arg = aiter.next()) {
         wcstring transformed(arg);
         std::transform(transformed.begin(), transformed.end(), transformed.begin(), std::towupper);
         if (wcscmp(transformed.c_str(), arg)) n_transformed++;
@@ -1332,6 +1545,71 @@ static int string_upper(parser_t &parser, io_streams_t &streams, int argc, wchar
     return n_transformed > 0 ? STATUS_CMD_OK : STATUS_CMD_ERROR;
 }
 
+/// Implementation of `string sort`.
+static int string_sort(parser_t &parser, io_streams_t &streams, int argc, wchar_t **argv) {
+    options_t opts;
+    opts.quiet_valid = true;
+    opts.reverse_valid = true;
+    opts.unique_valid = true;
+    int optind;
+    int retval = parse_opts(&opts, &optind, 0, argc, argv, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    wcstring_list_t strings;
+    arg_iterator_t aiter(argv, optind, streams);
+    while (const wchar_t *arg = aiter.next()) strings.push_back(arg);
+
+    // Strings are ordered by code point, like `LC_ALL=C sort`. Equal strings are identical, so a
+    // stable sort would not change anything.
+    bool changed;
+    if (opts.reverse) {
+        changed = !std::is_sorted(strings.begin(), strings.end(), std::greater<wcstring>());
+        if (changed) std::sort(strings.begin(), strings.end(), std::greater<wcstring>());
+    } else {
+        changed = !std::is_sorted(strings.begin(), strings.end());
+        if (changed) std::sort(strings.begin(), strings.end());
+    }
+    if (opts.unique) {
+        auto last = std::unique(strings.begin(), strings.end());
+        if (last != strings.end()) changed = true;
+        strings.erase(last, strings.end());
+    }
+
+    if (!opts.quiet) {
+        for (const wcstring &str : strings) {
+            streams.out.append(str);
+            streams.out.append(L'\n');
+        }
+    }
+
+    return changed ? STATUS_CMD_OK : STATUS_CMD_ERROR;
+}
+
+/// Implementation of `string unique`.
+static int string_unique(parser_t &parser, io_streams_t &streams, int argc, wchar_t **argv) {
+    options_t opts;
+    opts.quiet_valid = true;
+    int optind;
+    int retval = parse_opts(&opts, &optind, 0, argc, argv, parser, streams);
+    if (retval != STATUS_CMD_OK) return retval;
+
+    // Keep the first of each string, in the order they were given.
+    bool removed = false;
+    std::unordered_set<wcstring> seen;
+    arg_iterator_t aiter(argv, optind, streams);
+    while (const wchar_t *arg = aiter.next()) {
+        auto inserted = seen.emplace(arg);
+        if (!inserted.second) {
+            removed = true;
+        } else if (!opts.quiet) {
+            streams.out.append(*inserted.first);
+            streams.out.append(L'\n');
+        }
+    }
+
+    return removed ? STATUS_CMD_OK : STATUS_CMD_ERROR;
+}
+
 static const struct string_subcommand {
     const wchar_t *name;
     int (*handler)(parser_t &, io_streams_t &, int argc,  //!OCLINT(unused param)
@@ -1349,7 +1627,9 @@ string_subcommands[] = {{L"escape", &string_escape},
                         {L"lower", &string_lower},
                         {L"upper", &string_upper},
                         {L"repeat", &string_repeat},
+                        {L"sort", &string_sort},
                         {L"unescape", &string_unescape},
+                        {L"unique", &string_unique},
                         {NULL, NULL}};
 
 /// The string builtin, for manipulating strings.
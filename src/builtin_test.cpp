@@ -73,9 +73,9 @@ enum token_t {
     test_paren_close,  // ")", close paren
 };
 
-static bool binary_primary_evaluate(test_expressions::token_t token, const wcstring &left,
-                                    const wcstring &right, wcstring_list_t &errors);
-static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg,
+static bool binary_primary_evaluate(test_expressions::token_t token, const wchar_t *left,
+                                    const wchar_t *right, wcstring_list_t &errors);
+static bool unary_primary_evaluate(test_expressions::token_t token, const wchar_t *arg,
                                    wcstring_list_t &errors);
 
 enum { UNARY_PRIMARY = 1 << 0, BINARY_PRIMARY = 1 << 1 };
@@ -120,15 +120,17 @@ static const struct token_info_t {
                    {test_paren_open, L"(", 0},
                    {test_paren_close, L")", 0}};
 
-const token_info_t *token_for_string(const wcstring &str) {
+const token_info_t *token_for_string(const wchar_t *str) {
     for (size_t i = 0; i < sizeof token_infos / sizeof *token_infos; i++) {
-        if (str == token_infos[i].string) {
+        if (!wcscmp(str, token_infos[i].string)) {
             return &token_infos[i];
         }
     }
     return &token_infos[0];  // unknown
 }
 
+const token_info_t *token_for_string(const wcstring &str) { return token_for_string(str.c_str()); }
+
 // Grammar.
 //
 //  <expr> = <combining_expr>
@@ -535,11 +537,11 @@ unique_ptr<expression> test_parser::parse_args(const wcstring_list_t &args, wcst
 }
 
 bool unary_primary::evaluate(wcstring_list_t &errors) {
-    return unary_primary_evaluate(token, arg, errors);
+    return unary_primary_evaluate(token, arg.c_str(), errors);
 }
 
 bool binary_primary::evaluate(wcstring_list_t &errors) {
-    return binary_primary_evaluate(token, arg_left, arg_right, errors);
+    return binary_primary_evaluate(token, arg_left.c_str(), arg_right.c_str(), errors);
 }
 
 bool unary_operator::evaluate(wcstring_list_t &errors) {
@@ -602,24 +604,24 @@ bool parenthetical_expression::evaluate(wcstring_list_t &errors) {
 // example, should we interpret 0x10 as 0, 10, or 16? Here we use only base 10 and use wcstoll,
 // which allows for leading + and -, and whitespace. This is consistent, albeit a bit more lenient
 // since we allow trailing whitespace, with other implementations such as bash.
-static bool parse_number(const wcstring &arg, long long *out, wcstring_list_t &errors) {
-    *out = fish_wcstoll(arg.c_str());
+static bool parse_number(const wchar_t *arg, long long *out, wcstring_list_t &errors) {
+    *out = fish_wcstoll(arg);
     if (errno) {
-        errors.push_back(format_string(_(L"invalid integer '%ls'"), arg.c_str()));
+        errors.push_back(format_string(_(L"invalid integer '%ls'"), arg));
     }
     return !errno;
 }
 
-static bool binary_primary_evaluate(test_expressions::token_t token, const wcstring &left,
-                                    const wcstring &right, wcstring_list_t &errors) {
+static bool binary_primary_evaluate(test_expressions::token_t token, const wchar_t *left,
+                                    const wchar_t *right, wcstring_list_t &errors) {
     using namespace test_expressions;
     long long left_num, right_num;
     switch (token) {
         case test_string_equal: {
-            return left == right;
+            return !wcscmp(left, right);
         }
         case test_string_not_equal: {
-            return left != right;
+            return wcscmp(left, right) != 0;
         }
         case test_number_equal: {
             return parse_number(left, &left_num, errors) &&
@@ -652,7 +654,7 @@ static bool binary_primary_evaluate(test_expressions::token_t token, const wcstr
     }
 }
 
-static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg,
+static bool unary_primary_evaluate(test_expressions::token_t token, const wchar_t *arg,
                                    wcstring_list_t &errors) {
     using namespace test_expressions;
     struct stat buf;
@@ -718,10 +720,10 @@ static bool unary_primary_evaluate(test_expressions::token_t token, const wcstri
             return !waccess(arg, X_OK);
         }
         case test_string_n: {  // "-n", non-empty string
-            return !arg.empty();
+            return arg[0] != L'\0';
         }
         case test_string_z: {  // "-z", true if length of string is 0
-            return arg.empty();
+            return arg[0] == L'\0';
         }
         default: {
             errors.push_back(format_string(L"Unknown token type in %s", __func__));
@@ -729,8 +731,50 @@ static bool unary_primary_evaluate(test_expressions::token_t token, const wcstri
         }
     }
 }
+
+/// Evaluate the two and three argument forms that make up most uses of test directly from argv,
+/// without copying the arguments or building an expression tree: `OP ARG`, `! ARG`, `ARG OP ARG`
+/// and `! OP ARG`. These give the same result test_parser would. Returns false if the arguments
+/// are some other form, which the caller must parse.
+static bool evaluate_simple_expression(wchar_t *const *args, size_t argc, bool *result,
+                                       wcstring_list_t &errors) {
+    if (argc == 2) {
+        const token_info_t *first = token_for_string(args[0]);
+        if (first->flags & UNARY_PRIMARY) {
+            *result = unary_primary_evaluate(first->tok, args[1], errors);
+            return true;
+        }
+        if (first->tok == test_bang && token_for_string(args[1])->tok == test_unknown) {
+            *result = args[1][0] == L'\0';
+            return true;
+        }
+    } else if (argc == 3) {
+        const token_info_t *center = token_for_string(args[1]);
+        if (center->flags & BINARY_PRIMARY) {
+            *result = binary_primary_evaluate(center->tok, args[0], args[2], errors);
+            return true;
+        }
+        if ((center->flags & UNARY_PRIMARY) && token_for_string(args[0])->tok == test_bang) {
+            *result = !unary_primary_evaluate(center->tok, args[2], errors);
+            return true;
+        }
+    }
+    return false;
+}
 };  // namespace test_expressions
 
+/// Report any errors from evaluating an expression and return the exit status for its result.
+static int test_result_status(bool result, const wcstring_list_t &eval_errors,
+                              io_streams_t &streams) {
+    if (!eval_errors.empty() && !should_suppress_stderr_for_tests()) {
+        streams.err.append(L"test returned eval errors:\n");
+        for (size_t i = 0; i < eval_errors.size(); i++) {
+            streams.err.append_format(L"\t%ls\n", eval_errors.at(i).c_str());
+        }
+    }
+    return result ? STATUS_CMD_OK : STATUS_CMD_ERROR;
+}
+
 /// Evaluate a conditional expression given the arguments. If fromtest is set, the caller is the
 /// test or [ builtin; with the pointer giving the name of the command. for POSIX conformance this
 /// supports a more limited range of functionality.
@@ -762,16 +806,22 @@ int builtin_test(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         }
     }
 
-    // Collect the arguments into a list.
-    const wcstring_list_t args(argv + 1, argv + 1 + argc);
-
     if (argc == 0) {
         return STATUS_CMD_ERROR;  // Per 1003.1, exit false.
     } else if (argc == 1) {
         // Per 1003.1, exit true if the arg is non-empty.
-        return args.at(0).empty() ? STATUS_CMD_ERROR : STATUS_CMD_OK;
+        return argv[1][0] == L'\0' ? STATUS_CMD_ERROR : STATUS_CMD_OK;
+    }
+
+    wcstring_list_t eval_errors;
+    bool result;
+    if (evaluate_simple_expression(argv + 1, argc, &result, eval_errors)) {
+        return test_result_status(result, eval_errors, streams);
     }
 
+    // Collect the arguments into a list.
+    const wcstring_list_t args(argv + 1, argv + 1 + argc);
+
     // Try parsing
     wcstring err;
     unique_ptr<expression> expr = test_parser::parse_args(args, err, program_name);
@@ -787,13 +837,6 @@ int builtin_test(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         return STATUS_CMD_ERROR;
     }
 
-    wcstring_list_t eval_errors;
-    bool result = expr->evaluate(eval_errors);
-    if (!eval_errors.empty() && !should_suppress_stderr_for_tests()) {
-        streams.err.append(L"test returned eval errors:\n");
-        for (size_t i = 0; i < eval_errors.size(); i++) {
-            streams.err.append_format(L"\t%ls\n", eval_errors.at(i).c_str());
-        }
-    }
-    return result ? STATUS_CMD_OK : STATUS_CMD_ERROR;
+    result = expr->evaluate(eval_errors);
+    return test_result_status(result, eval_errors, streams);
 }
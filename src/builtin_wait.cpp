@@ -1,5 +1,9 @@
 // Functions for waiting for processes completed.
-#include <vector>
+#include <errno.h>
+#include <signal.h>
+
+#include <unordered_map>
+#include <unordered_set>
 
 #include "builtin.h"
 #include "builtin_wait.h"
@@ -10,95 +14,74 @@
 
 #include <sys/wait.h>
 
-static int retval;
-
-static bool all_jobs_finished() {
-    job_iterator_t jobs;
-    while (job_t *j = jobs.next()) {
-        // If any job is not completed, return false.
-        // If there are stopped jobs, they are ignored.
-        if ((j->flags & JOB_CONSTRUCTED) && !job_is_completed(j) && !job_is_stopped(j)) {
-            return false;
-        }
-    }
-    return true;
-}
-
-static bool any_jobs_finished(size_t jobs_len) {
-    job_iterator_t jobs;
-    bool no_jobs_running = true;
-
-    // If any job is removed from list, return true.
-    if (jobs_len != jobs.count()) {
-        return true;
-    }
-    while (job_t *j = jobs.next()) {
-        // If any job is completed, return true.
-        if ((j->flags & JOB_CONSTRUCTED) && (job_is_completed(j) || job_is_stopped(j))) {
-            return true;
+/// The jobs that a wait is for. Each job is looked at again only when one of its processes changes
+/// state, so waiting costs about the same per finished child however many jobs are waited for.
+class waited_jobs_t {
+    /// The job id of each process of the jobs that are still running.
+    std::unordered_map<pid_t, job_id_t> job_of_pid;
+    /// The ids of the jobs that are still running.
+    std::unordered_set<job_id_t> running;
+    /// How many of the jobs have finished or stopped.
+    size_t done_count = 0;
+
+    /// Returns whether wait is done with a job. Stopped jobs are not waited for.
+    static bool job_is_done(const job_t *j) { return job_is_completed(j) || job_is_stopped(j); }
+
+   public:
+    /// Add a job to wait for. Jobs that are not yet constructed are ignored.
+    void add(const job_t *j) {
+        if (!(j->flags & JOB_CONSTRUCTED) || running.count(j->job_id)) return;
+        if (job_is_done(j)) {
+            done_count++;
+            return;
         }
-        // Check for jobs running exist or not.
-        if ((j->flags & JOB_CONSTRUCTED) && !job_is_stopped(j)) {
-            no_jobs_running = false;
+        running.insert(j->job_id);
+        for (const process_ptr_t &p : j->processes) {
+            if (p->pid > 0) job_of_pid[p->pid] = j->job_id;
         }
     }
-    if (no_jobs_running) {
-        return true;
-    }
-    return false;
-}
-
-static void wait_for_backgrounds(bool any_flag) {
-    job_iterator_t jobs;
-    size_t jobs_len = jobs.count();
 
-    while ((!any_flag && !all_jobs_finished()) || (any_flag && !any_jobs_finished(jobs_len))) {
-        pid_t pid = proc_wait_any();
-        if (pid == -1 && errno == EINTR) {
-            retval = 128 + SIGINT;
-            return;
-        }
+    /// Returns whether the wait is over. With any_flag, that is once any job is done.
+    bool finished(bool any_flag) const {
+        return running.empty() || (any_flag && done_count > 0);
     }
-}
 
-static bool all_specified_jobs_finished(const std::vector<int> &wjobs_pid) {
-    for (auto pid : wjobs_pid) {
-        if (job_t *j = job_get_from_pid(pid)) {
-            // If any specified job is not completed, return false.
-            // If there are stopped jobs, they are ignored.
-            if ((j->flags & JOB_CONSTRUCTED) && !job_is_completed(j) && !job_is_stopped(j)) {
-                return false;
+    /// Note that the given child changed state.
+    void child_changed(pid_t pid) {
+        auto where = job_of_pid.find(pid);
+        if (where == job_of_pid.end()) return;
+        job_id_t job_id = where->second;
+        if (!running.count(job_id)) return;
+
+        // The job may have been reaped and its id given to a new job, so make sure it is ours.
+        job_t *j = job_get(job_id);
+        bool ours = false;
+        if (j) {
+            for (const process_ptr_t &p : j->processes) {
+                ours = ours || p->pid == pid;
             }
         }
-    }
-    return true;
-}
-
-static bool any_specified_jobs_finished(const std::vector<int> &wjobs_pid) {
-    job_t *j;
-    for (auto pid : wjobs_pid) {
-        if ((j = job_get_from_pid(pid))) {
-            // If any specified job is completed, return true.
-            if ((j->flags & JOB_CONSTRUCTED) && (job_is_completed(j) || job_is_stopped(j))) {
-                return true;
-            }
-        } else {
-            // If any specified job is removed from list, return true.
-            return true;
+        if (!ours || job_is_done(j)) {
+            running.erase(job_id);
+            done_count++;
         }
     }
-    return false;
-}
+};
 
-static void wait_for_backgrounds_specified(const std::vector<int> &wjobs_pid, bool any_flag) {
-    while ((!any_flag && !all_specified_jobs_finished(wjobs_pid)) ||
-           (any_flag && !any_specified_jobs_finished(wjobs_pid))) {
+/// Block until the given jobs are done, reaping children as they change state. Returns the exit
+/// status of wait.
+static int wait_for_jobs(waited_jobs_t &jobs, bool any_flag) {
+    while (!jobs.finished(any_flag)) {
         pid_t pid = proc_wait_any();
-        if (pid == -1 && errno == EINTR) {
-            retval = 128 + SIGINT;
-            return;
+        if (pid == -1) {
+            if (errno == EINTR) return 128 + SIGINT;
+            // There are no children left to wait for.
+            if (errno == ECHILD) break;
+            continue;
         }
+        jobs.child_changed(pid);
     }
+    return STATUS_CMD_OK;
 }
 
 int builtin_wait(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
@@ -134,12 +117,13 @@ int builtin_wait(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
         }
     }
 
+    waited_jobs_t waited;
     if (w.woptind == argc) {
         // no jobs specified
-        wait_for_backgrounds(any_flag);
+        while ((j = jobs.next())) waited.add(j);
     } else {
         // jobs specified
-        std::vector<int> waited_jobs_pid;
+        bool found_any = false;
 
         for (int i = w.woptind; i < argc; i++) {
             int pid = fish_wcstoi(argv[i]);
@@ -148,27 +132,25 @@ int builtin_wait(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
                                           argv[i]);
                 continue;
             }
-            if (job_get_from_pid(pid)) {
-                waited_jobs_pid.push_back(pid);
-            } else {
+            j = job_get_from_pid(pid);
+            if (!j) {
                 // If a specified process has already finished but the job hasn't,
                 // job_get_from_pid(pid) doesn't work properly, so check the pgid here.
+                jobs.reset();
                 while ((j = jobs.next())) {
-                    if (j->pgid == pid) {
-                        waited_jobs_pid.push_back(pid);
-                        break;
-                    }
-                }
-                if (!j) {
-                    streams.err.append_format(_(L"%ls: Could not find job '%d'\n"), cmd, pid);
+                    if (j->pgid == pid) break;
                 }
             }
+            if (j) {
+                waited.add(j);
+                found_any = true;
+            } else {
+                streams.err.append_format(_(L"%ls: Could not find job '%d'\n"), cmd, pid);
+            }
         }
 
-        if (waited_jobs_pid.empty()) return STATUS_INVALID_ARGS;
-
-        wait_for_backgrounds_specified(waited_jobs_pid, any_flag);
+        if (!found_any) return STATUS_INVALID_ARGS;
     }
 
-    return retval;
+    return wait_for_jobs(waited, any_flag);
 }
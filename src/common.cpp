@@ -6,6 +6,7 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <langinfo.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -14,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <termios.h>
@@ -71,6 +73,11 @@ static std::mutex termsize_lock;
 static struct winsize termsize = {USHRT_MAX, USHRT_MAX, USHRT_MAX, USHRT_MAX};
 static volatile bool termsize_valid = false;
 
+/// Whether the current locale encodes characters as UTF-8, which lets the string conversions below
+/// do the work themselves rather than calling mbrtowc() and wcrtomb() for every character. Updated
+/// by fish_setlocale().
+static bool locale_is_utf8 = false;
+
 static char *wcs2str_internal(const wchar_t *in, char *out);
 static void debug_shared(const wchar_t msg_level, const wcstring &msg);
 
@@ -200,6 +207,87 @@ int fgetws2(wcstring *s, FILE *f) {
     }
 }
 
+/// Returns the number of leading bytes of \c in, which holds \c len bytes, that are ASCII. Checks a
+/// machine word at a time so long runs of plain text go quickly.
+static size_t ascii_prefix_length(const char *in, size_t len) {
+    const uint64_t high_bits = 0x8080808080808080ULL;
+    size_t pos = 0;
+    while (len - pos >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, in + pos, sizeof word);
+        if (word & high_bits) break;
+        pos += sizeof word;
+    }
+    while (pos < len && !(in[pos] & 0x80)) pos++;
+    return pos;
+}
+
+/// Decodes the UTF-8 sequence at the start of \c in, which holds \c len bytes and starts with a
+/// non-ASCII byte. Returns the number of bytes used and stores the character in \c wc, or returns 0
+/// for anything other than a complete, valid sequence of a character that needs no special
+/// encoding; the caller leaves those to mbrtowc().
+static size_t utf8_decode_one(const unsigned char *in, size_t len, wchar_t *wc) {
+    unsigned long cp;
+    size_t count;
+    if (in[0] < 0xC2) {
+        return 0;  // a stray continuation byte, or the start of an overlong sequence
+    } else if (in[0] < 0xE0) {
+        cp = in[0] & 0x1F;
+        count = 2;
+    } else if (in[0] < 0xF0) {
+        cp = in[0] & 0x0F;
+        count = 3;
+    } else if (in[0] < 0xF5 && sizeof(wchar_t) > 2) {  //!OCLINT(constant if expression)
+        cp = in[0] & 0x07;
+        count = 4;
+    } else {
+        return 0;
+    }
+    if (count > len) return 0;
+    for (size_t i = 1; i < count; i++) {
+        if ((in[i] & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (in[i] & 0x3F);
+    }
+
+    if ((count == 3 && cp < 0x800) || (count == 4 && (cp < 0x10000 || cp > 0x10FFFF))) {
+        return 0;  // overlong or out of range
+    } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+        return 0;  // surrogates have no encoding
+    } else if ((cp >= ENCODE_DIRECT_BASE && cp < ENCODE_DIRECT_BASE + 256) ||
+               cp == INTERNAL_SEPARATOR) {
+        return 0;
+    }
+    *wc = (wchar_t)cp;
+    return count;
+}
+
+/// Encodes \c wc as UTF-8 into \c out, which must have room for four bytes. Returns the number of
+/// bytes written, or 0 if the character has no encoding.
+static size_t utf8_encode_one(wchar_t wc, char *out) {
+    const unsigned long cp = (unsigned long)wc;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        if (cp >= 0xD800 && cp <= 0xDFFF) return 0;
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    } else if (cp < 0x110000) {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        return 4;
+    }
+    return 0;
+}
+
 /// Converts the narrow character string \c in into its wide equivalent, and return it.
 ///
 /// The string may contain embedded nulls.
@@ -223,8 +311,29 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len) {
         return result;
     }
 
+    const bool utf8 = locale_is_utf8;
     mbstate_t state = {};
     while (in_pos < in_len) {
+        if (utf8) {
+            // Copy runs of ASCII and decode valid sequences here. Only invalid or special data
+            // goes through mbrtowc() below.
+            const size_t ascii_len = ascii_prefix_length(&in[in_pos], in_len - in_pos);
+            for (size_t i = 0; i < ascii_len; i++) {
+                result.push_back((wchar_t)in[in_pos + i]);
+            }
+            in_pos += ascii_len;
+            if (in_pos == in_len) break;
+
+            wchar_t wc;
+            size_t len =
+                utf8_decode_one((const unsigned char *)&in[in_pos], in_len - in_pos, &wc);
+            if (len > 0) {
+                result.push_back(wc);
+                in_pos += len;
+                continue;
+            }
+        }
+
         bool use_encode_direct = false;
         size_t ret = 0;
         wchar_t wc = 0;
@@ -320,35 +429,50 @@ std::string wcs2string(const wcstring &input) {
 
     mbstate_t state = {};
     char converted[MB_LEN_MAX];
+    const bool utf8 = locale_is_utf8;
 
     for (size_t i = 0; i < input.size(); i++) {
         wchar_t wc = input[i];
-        if (wc == INTERNAL_SEPARATOR) {
-            ;  // do nothing
-        } else if (wc >= ENCODE_DIRECT_BASE && wc < ENCODE_DIRECT_BASE + 256) {
-            result.push_back(wc - ENCODE_DIRECT_BASE);
-        } else if (MB_CUR_MAX == 1) {  // single-byte locale (C/POSIX/ISO-8859)
-            // If `wc` contains a wide character we emit a question-mark.
-            if (wc & ~0xFF) {
-                wc = '?';
-            }
-            converted[0] = wc;
-            result.append(converted, 1);
+        if (utf8 && wc >= 0 && wc < 0x80) {
+            result.push_back((char)wc);
+            continue;
+        }
+        size_t len = wchar_to_narrow(wc, converted, &state);
+        if (len == (size_t)-1) {
+            debug(1, L"Wide character U+%4X has no narrow representation", wc);
         } else {
-            memset(converted, 0, sizeof converted);
-            size_t len = wcrtomb(converted, wc, &state);
-            if (len == (size_t)-1) {
-                debug(1, L"Wide character U+%4X has no narrow representation", wc);
-                memset(&state, 0, sizeof(state));
-            } else {
-                result.append(converted, len);
-            }
+            result.append(converted, len);
         }
     }
 
     return result;
 }
 
+size_t wchar_to_narrow(wchar_t wc, char *out, mbstate_t *state) {
+    if (wc == INTERNAL_SEPARATOR) {
+        return 0;  // do nothing
+    } else if (wc >= ENCODE_DIRECT_BASE && wc < ENCODE_DIRECT_BASE + 256) {
+        out[0] = wc - ENCODE_DIRECT_BASE;
+        return 1;
+    } else if (MB_CUR_MAX == 1) {  // single-byte locale (C/POSIX/ISO-8859)
+        // If `wc` contains a wide character we emit a question-mark.
+        if (wc & ~0xFF) {
+            wc = '?';
+        }
+        out[0] = wc;
+        return 1;
+    } else if (locale_is_utf8) {
+        size_t len = utf8_encode_one(wc, out);
+        if (len > 0) return len;
+    }
+
+    size_t len = wcrtomb(out, wc, state);
+    if (len == (size_t)-1) {
+        memset(state, 0, sizeof(*state));
+    }
+    return len;
+}
+
 /// Converts the wide character string \c in into it's narrow equivalent, stored in \c out. \c out
 /// must have enough space to fit the entire string.
 ///
@@ -361,6 +485,7 @@ static char *wcs2str_internal(const wchar_t *in, char *out) {
     size_t in_pos = 0;
     size_t out_pos = 0;
     mbstate_t state = {};
+    const bool utf8 = locale_is_utf8;
 
     while (in[in_pos]) {
         if (in[in_pos] == INTERNAL_SEPARATOR) {
@@ -376,7 +501,8 @@ static char *wcs2str_internal(const wchar_t *in, char *out) {
                 out[out_pos++] = (unsigned char)in[in_pos];
             }
         } else {
-            size_t len = wcrtomb(&out[out_pos], in[in_pos], &state);
+            size_t len = utf8 ? utf8_encode_one(in[in_pos], &out[out_pos]) : 0;
+            if (len == 0) len = wcrtomb(&out[out_pos], in[in_pos], &state);
             if (len == (size_t)-1) {
                 debug(1, L"Wide character U+%4X has no narrow representation", in[in_pos]);
                 memset(&state, 0, sizeof(state));
@@ -487,6 +613,10 @@ wchar_t *quote_end(const wchar_t *pos) {
 }
 
 void fish_setlocale() {
+    const char *codeset = nl_langinfo(CODESET);
+    locale_is_utf8 = MB_CUR_MAX > 1 && codeset != NULL &&
+                     (!strcasecmp(codeset, "UTF-8") || !strcasecmp(codeset, "utf8"));
+
     // Use various Unicode symbols if they can be encoded using the current locale, else a simple
     // ASCII char alternative. All of the can_be_encoded() invocations should return the same
     // true/false value since the code points are in the BMP but we're going to be paranoid. This
@@ -534,6 +664,25 @@ ssize_t write_loop(int fd, const char *buff, size_t count) {
     return (ssize_t)out_cum;
 }
 
+/// Convert a wide string to narrow and write it to the fd, holding at most one chunk of converted
+/// output at a time.
+ssize_t write_wide_loop(int fd, const wchar_t *str, size_t len) {
+    char buff[4096];
+    size_t used = 0;
+    mbstate_t state = {};
+    for (size_t i = 0; i < len; i++) {
+        if (used + MB_LEN_MAX > sizeof buff) {
+            if (write_loop(fd, buff, used) < 0) return -1;
+            used = 0;
+        }
+        // Characters without a narrow representation are dropped, as wcs2string does.
+        size_t amt = wchar_to_narrow(str[i], buff + used, &state);
+        if (amt != (size_t)-1) used += amt;
+    }
+    if (used > 0 && write_loop(fd, buff, used) < 0) return -1;
+    return 0;
+}
+
 ssize_t read_loop(int fd, void *buff, size_t count) {
     ssize_t result;
     do {
@@ -891,6 +1040,46 @@ static bool unescape_string_var(const wchar_t *in, wcstring *out) {
     return true;
 }
 
+/// Classes of ASCII characters that escape_string_script() and unescape_string_internal() cannot
+/// copy as they are. Any other character is copied in bulk with the run around it.
+enum {
+    /// escape_string_script() escapes or quotes it.
+    char_class_escape = 1 << 0,
+    /// unescape_string_internal() treats it specially outside of quotes.
+    char_class_unescape_unquoted = 1 << 1,
+    /// unescape_string_internal() treats it specially inside single quotes.
+    char_class_unescape_single_quoted = 1 << 2,
+    /// unescape_string_internal() treats it specially inside double quotes.
+    char_class_unescape_double_quoted = 1 << 3,
+};
+
+static const struct char_class_table_t {
+    unsigned char classes[128];
+
+    char_class_table_t() : classes() {
+        for (int c = 0; c < 32; c++) classes[c] |= char_class_escape;
+        for (const char *c = "\\'&$ #^<>()[]{}?*|;\"%~"; *c; c++) {
+            classes[(unsigned char)*c] |= char_class_escape;
+        }
+        for (const char *c = "\\~%*?${},'\""; *c; c++) {
+            classes[(unsigned char)*c] |= char_class_unescape_unquoted;
+        }
+        for (const char *c = "\\'"; *c; c++) {
+            classes[(unsigned char)*c] |= char_class_unescape_single_quoted;
+        }
+        for (const char *c = "\\\"$"; *c; c++) {
+            classes[(unsigned char)*c] |= char_class_unescape_double_quoted;
+        }
+    }
+} char_classes;
+
+/// Returns whether escape_string_script() copies \c c unchanged.
+static inline bool escape_copies_char(wchar_t c) {
+    if (c < 128) return c > 0 && !(char_classes.classes[c] & char_class_escape);
+    return !(c >= ENCODE_DIRECT_BASE && c < ENCODE_DIRECT_BASE + 256) && c != ANY_CHAR &&
+           c != ANY_STRING && c != ANY_STRING_RECURSIVE;
+}
+
 /// Escape a string in a fashion suitable for using in fish script. Store the result in out_str.
 static void escape_string_script(const wchar_t *orig_in, size_t in_len, wcstring &out,
                                  escape_flags_t flags) {
@@ -907,7 +1096,14 @@ static void escape_string_script(const wchar_t *orig_in, size_t in_len, wcstring
         return;
     }
 
-    while (*in != 0) {
+    out.reserve(out.size() + in_len);
+    for (;;) {
+        // Copy the run of characters that need no escaping all at once.
+        const wchar_t *run_start = in;
+        while (escape_copies_char(*in)) in++;
+        out.append(run_start, in - run_start);
+        if (*in == 0) break;
+
         if ((*in >= ENCODE_DIRECT_BASE) && (*in < ENCODE_DIRECT_BASE + 256)) {
             int val = *in - ENCODE_DIRECT_BASE;
             int tmp;
@@ -1279,6 +1475,24 @@ static bool unescape_string_internal(const wchar_t *const input, const size_t in
     enum { mode_unquoted, mode_single_quotes, mode_double_quotes } mode = mode_unquoted;
 
     for (size_t input_position = 0; input_position < input_len && !errored; input_position++) {
+        // Copy the run of characters that mean nothing special in this mode all at once.
+        unsigned char special = char_class_unescape_unquoted;
+        if (mode == mode_single_quotes) {
+            special = char_class_unescape_single_quoted;
+        } else if (mode == mode_double_quotes) {
+            special = char_class_unescape_double_quoted;
+        }
+        size_t run_end = input_position;
+        while (run_end < input_len && (input[run_end] < 0 || input[run_end] >= 128 ||
+                                       !(char_classes.classes[input[run_end]] & special))) {
+            run_end++;
+        }
+        if (run_end > input_position) {
+            result.append(&input[input_position], run_end - input_position);
+            input_position = run_end;
+            if (input_position == input_len) break;
+        }
+
         const wchar_t c = input[input_position];
         // Here's the character we'll append to result, or NOT_A_WCHAR to suppress it.
         wint_t to_append_or_none = c;
@@ -1873,6 +2087,67 @@ void format_size_safe(char buff[128], unsigned long long sz) {
     }
 }
 
+utf8_string_t::utf8_string_t(const wcstring &str) {
+    // Encoded here rather than by utf8.cpp, so that it takes one pass and no temporary buffer.
+    bytes.reserve(str.size());
+    for (wchar_t wc : str) {
+        const uint32_t c = (uint32_t)wc;
+        if (c < 0x80) {
+            bytes.push_back((char)c);
+        } else if (c < 0x800) {
+            bytes.push_back((char)(0xC0 | (c >> 6)));
+            bytes.push_back((char)(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000 && (c < 0xD800 || c > 0xDFFF)) {
+            bytes.push_back((char)(0xE0 | (c >> 12)));
+            bytes.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            bytes.push_back((char)(0x80 | (c & 0x3F)));
+        } else if (c >= 0x10000 && c <= 0x10FFFF) {
+            bytes.push_back((char)(0xF0 | (c >> 18)));
+            bytes.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+            bytes.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            bytes.push_back((char)(0x80 | (c & 0x3F)));
+        } else {
+            // A surrogate, or past U+10FFFF: UTF-8 can't hold it.
+            wide = true;
+            bytes.assign(reinterpret_cast<const char *>(str.data()), str.size() * sizeof(wchar_t));
+            break;
+        }
+    }
+    if (bytes.capacity() > bytes.size()) bytes.shrink_to_fit();
+}
+
+wcstring utf8_string_t::str() const {
+    wcstring result;
+    if (wide) {
+        result.resize(bytes.size() / sizeof(wchar_t));
+        if (!result.empty()) memcpy(&result[0], bytes.data(), bytes.size());
+        return result;
+    }
+    // We wrote the bytes ourselves, so they need no validating.
+    result.reserve(bytes.size());
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(bytes.data());
+    const unsigned char *const end = p + bytes.size();
+    while (p < end) {
+        const uint32_t b = *p;
+        if (b < 0x80) {
+            result.push_back((wchar_t)b);
+            p += 1;
+        } else if (b < 0xE0) {
+            result.push_back((wchar_t)(((b & 0x1F) << 6) | (p[1] & 0x3F)));
+            p += 2;
+        } else if (b < 0xF0) {
+            result.push_back(
+                (wchar_t)(((b & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F)));
+            p += 3;
+        } else {
+            result.push_back((wchar_t)(((b & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+                                       ((p[2] & 0x3F) << 6) | (p[3] & 0x3F)));
+            p += 4;
+        }
+    }
+    return result;
+}
+
 /// Return the number of seconds from the UNIX epoch, with subsecond precision. This function uses
 /// the gettimeofday function and will have the same precision as that function.
 double timef() {
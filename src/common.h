@@ -295,6 +295,11 @@ char *wcs2str(const wchar_t *in);
 char *wcs2str(const wcstring &in);
 std::string wcs2string(const wcstring &input);
 
+/// Converts a single wide character the way wcs2string does, storing the result (at most
+/// MB_LEN_MAX bytes) in \c out. Returns the number of bytes stored, or (size_t)-1 if the character
+/// has no narrow representation. This does not allocate memory, so it is safe to call after fork.
+size_t wchar_to_narrow(wchar_t wc, char *out, mbstate_t *state);
+
 /// Test if a string prefixes another. Returns true if a is a prefix of b.
 bool string_prefixes_string(const wcstring &proposed_prefix, const wcstring &value);
 bool string_prefixes_string(const wchar_t *proposed_prefix, const wcstring &value);
@@ -381,18 +386,26 @@ string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string,
 #define TESTS_PROGRAM_NAME L"(ignore)"
 bool should_suppress_stderr_for_tests();
 
+// The ASSERT_IS_ macros below are run on hot paths, so they are left out of builds without sanity
+// checks, like the checks in sanity.h.
 void assert_is_main_thread(const char *who);
-#define ASSERT_IS_MAIN_THREAD_TRAMPOLINE(x) assert_is_main_thread(x)
-#define ASSERT_IS_MAIN_THREAD() ASSERT_IS_MAIN_THREAD_TRAMPOLINE(__FUNCTION__)
-
 void assert_is_background_thread(const char *who);
-#define ASSERT_IS_BACKGROUND_THREAD_TRAMPOLINE(x) assert_is_background_thread(x)
-#define ASSERT_IS_BACKGROUND_THREAD() ASSERT_IS_BACKGROUND_THREAD_TRAMPOLINE(__FUNCTION__)
 
 /// Useful macro for asserting that a lock is locked. This doesn't check whether this thread locked
 /// it, which it would be nice if it did, but here it is anyways.
 void assert_is_locked(void *mutex, const char *who, const char *caller);
+
+#ifdef FISH_NO_SANITY_CHECKS
+#define ASSERT_IS_MAIN_THREAD() ((void)0)
+#define ASSERT_IS_BACKGROUND_THREAD() ((void)0)
+#define ASSERT_IS_LOCKED(x) ((void)0)
+#else
+#define ASSERT_IS_MAIN_THREAD_TRAMPOLINE(x) assert_is_main_thread(x)
+#define ASSERT_IS_MAIN_THREAD() ASSERT_IS_MAIN_THREAD_TRAMPOLINE(__FUNCTION__)
+#define ASSERT_IS_BACKGROUND_THREAD_TRAMPOLINE(x) assert_is_background_thread(x)
+#define ASSERT_IS_BACKGROUND_THREAD() ASSERT_IS_BACKGROUND_THREAD_TRAMPOLINE(__FUNCTION__)
 #define ASSERT_IS_LOCKED(x) assert_is_locked((void *)(&x), #x, __FUNCTION__)
+#endif
 
 /// Format the specified size (in bytes, kilobytes, etc.) into the specified stringbuffer.
 wcstring format_size(long long sz);
@@ -632,6 +645,11 @@ long read_blocked(int fd, void *buf, size_t count);
 /// error.
 ssize_t write_loop(int fd, const char *buff, size_t count);
 
+/// Write a wide string to an fd, converting it a chunk at a time through a fixed buffer rather than
+/// making a narrow copy of it. Return -1 and set errno in case of critical error, 0 otherwise.
+/// This does not allocate memory, so it may be used in a forked child.
+ssize_t write_wide_loop(int fd, const wchar_t *str, size_t len);
+
 /// Loop a read request while failure is non-critical. Return -1 and set errno in case of critical
 /// error.
 ssize_t read_loop(int fd, void *buff, size_t count);
@@ -695,6 +713,54 @@ int create_directory(const wcstring &d);
 /// Print a short message about how to file a bug report to stderr.
 void bugreport();
 
+/// Approximate memory used by one of fish's data structures, for `status memory`.
+struct memory_usage_t {
+    /// How many things (variables, functions and so on) it holds.
+    size_t count = 0;
+    /// Approximately how many bytes they take.
+    size_t bytes = 0;
+};
+
+/// Approximate bytes taken by a string, including the characters it has room for.
+inline size_t string_memory(const wcstring &str) {
+    return sizeof str + str.capacity() * sizeof(wchar_t);
+}
+
+/// Approximate bytes taken by a list of strings.
+inline size_t string_list_memory(const wcstring_list_t &list) {
+    size_t result = sizeof list + (list.capacity() - list.size()) * sizeof(wcstring);
+    for (const wcstring &str : list) result += string_memory(str);
+    return result;
+}
+
+/// A string kept as UTF-8, for text that is stored in bulk and read now and then, where a wchar_t
+/// per character would take four times the memory on most systems. It is converted from and to a
+/// wcstring when it is stored and read. The rare string that UTF-8 cannot hold, such as one with a
+/// lone surrogate, is kept as wide characters instead.
+class utf8_string_t {
+    /// The UTF-8 bytes, or the bytes of the wide characters if wide is set.
+    std::string bytes;
+    bool wide = false;
+
+   public:
+    utf8_string_t() = default;
+    explicit utf8_string_t(const wcstring &str);
+
+    /// Returns the string, converted back to wide characters.
+    wcstring str() const;
+
+    bool empty() const { return bytes.empty(); }
+
+    /// Approximate bytes taken by the string, including the characters it has room for.
+    size_t memory() const { return sizeof *this + bytes.capacity(); }
+
+    /// The conversion is deterministic, so equal strings have equal bytes.
+    bool operator==(const utf8_string_t &other) const {
+        return wide == other.wide && bytes == other.bytes;
+    }
+    bool operator!=(const utf8_string_t &other) const { return !(*this == other); }
+};
+
 /// Return the number of seconds from the UNIX epoch, with subsecond precision. This function uses
 /// the gettimeofday function and will have the same precision as that function.
 double timef();
@@ -717,8 +783,12 @@ void restore_term_foreground_process_group(void);
 /// Return whether we are the child of a fork.
 bool is_forked_child(void);
 void assert_is_not_forked_child(const char *who);
+#ifdef FISH_NO_SANITY_CHECKS
+#define ASSERT_IS_NOT_FORKED_CHILD() ((void)0)
+#else
 #define ASSERT_IS_NOT_FORKED_CHILD_TRAMPOLINE(x) assert_is_not_forked_child(x)
 #define ASSERT_IS_NOT_FORKED_CHILD() ASSERT_IS_NOT_FORKED_CHILD_TRAMPOLINE(__FUNCTION__)
+#endif
 
 extern "C" {
 __attribute__((noinline)) void debug_thread_error(void);
@@ -5,9 +5,18 @@
 ///
 #include "config.h"  // IWYU pragma: keep
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
@@ -16,6 +25,7 @@
 #include <functional>
 #include <iterator>
 #include <list>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -28,16 +38,22 @@
 #include "builtin.h"
 #include "common.h"
 #include "complete.h"
+#include "complete_db.h"
+#include "env.h"
 #include "exec.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "function.h"
+#include "input_common.h"
+#include "io.h"
 #include "iothread.h"
+#include "lru.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
 #include "parse_util.h"
 #include "parser.h"
 #include "path.h"
+#include "postfork.h"
 #include "proc.h"
 #include "util.h"
 #include "wildcard.h"
@@ -110,6 +126,9 @@ typedef struct complete_entry_opt {
     int result_mode;
     // Completion flags.
     complete_flags_t flags;
+    // Seconds for which the results of evaluating the arguments may be reused, or 0 to evaluate
+    // them every time.
+    int cache_ttl = 0;
 
     const wcstring localized_desc() const { return C_(desc); }
 
@@ -132,7 +151,91 @@ static unsigned int kCompleteOrder = 0;
 
 /// Struct describing a command completion.
 typedef std::list<complete_entry_opt_t> option_list_t;
+
+/// The options of a completion entry, indexed so that matching an argument against them takes time
+/// proportional to the options that match, rather than to all of them. It is not changed once
+/// made, so completing can go on using it while conditions add or remove options.
+class option_index_t {
+    /// Indexes into options of the switches, sorted by their lowercased text with the dashes, which
+    /// is kept in folded.
+    std::vector<size_t> by_switch;
+    std::vector<wcstring> folded;
+
+    /// Appends the indexes of switches whose folded text starts with the given folded prefix; or, if
+    /// exact, is equal to it.
+    void find_folded(const wcstring &key, bool exact, std::vector<size_t> *out) const {
+        auto iter = std::lower_bound(
+            by_switch.begin(), by_switch.end(), key,
+            [&](size_t idx, const wcstring &k) { return folded[idx].compare(k) < 0; });
+        for (; iter != by_switch.end() && string_prefixes_string(key, folded[*iter]); ++iter) {
+            if (!exact || folded[*iter].size() == key.size()) out->push_back(*iter);
+        }
+    }
+
+   public:
+    /// All options, in the order of the entry's list.
+    std::vector<complete_entry_opt_t> options;
+    /// Indexes of the options that are just arguments, and of the short options, in order.
+    std::vector<size_t> args_only;
+    std::vector<size_t> shorts;
+    /// The first short option for each character.
+    std::unordered_map<wchar_t, size_t> short_by_char;
+
+    explicit option_index_t(const option_list_t &list);
+
+    /// Returns the text of the switch of the given option with its dashes, like "--foo".
+    wcstring switch_text(size_t idx) const {
+        const complete_entry_opt_t &opt = options.at(idx);
+        return wcstring(opt.expected_dash_count(), L'-') + opt.option;
+    }
+
+    /// Appends the indexes of switches whose text (see switch_text) is equal to the given string;
+    /// or, if prefix, starts with it ignoring case.
+    void find_switches(const wcstring &text, bool prefix, std::vector<size_t> *out) const;
+};
+
+/// Lowercases a switch for the index.
+static wcstring fold_switch(const wcstring &text) {
+    wcstring result = text;
+    for (wchar_t &c : result) c = towlower(c);
+    return result;
+}
+
+option_index_t::option_index_t(const option_list_t &list) : options(list.begin(), list.end()) {
+    folded.resize(options.size());
+    for (size_t i = 0; i < options.size(); i++) {
+        const complete_entry_opt_t &opt = options[i];
+        if (opt.type == option_type_args_only) {
+            args_only.push_back(i);
+            continue;
+        }
+        if (opt.type == option_type_short) {
+            shorts.push_back(i);
+            short_by_char.emplace(opt.option.at(0), i);
+        }
+        folded[i] = fold_switch(switch_text(i));
+        by_switch.push_back(i);
+    }
+    std::stable_sort(by_switch.begin(), by_switch.end(),
+                     [&](size_t a, size_t b) { return folded[a] < folded[b]; });
+}
+
+void option_index_t::find_switches(const wcstring &text, bool prefix,
+                                   std::vector<size_t> *out) const {
+    const size_t start = out->size();
+    find_folded(fold_switch(text), !prefix, out);
+    if (!prefix) {
+        // Only exact matches, with case.
+        out->erase(std::remove_if(out->begin() + start, out->end(),
+                                  [&](size_t idx) { return switch_text(idx) != text; }),
+                   out->end());
+    }
+}
+
 class completion_entry_t {
+    /// Index of the options, made when first needed.
+    mutable std::shared_ptr<const option_index_t> index;
+
    public:
     /// List of all options.
     option_list_t options;
@@ -148,6 +251,7 @@ class completion_entry_t {
 
     /// Getters for option list.
     const option_list_t &get_options() const;
+    std::shared_ptr<const option_index_t> get_index() const;
 
     /// Adds or removes an option.
     void add_option(const complete_entry_opt_t &opt);
@@ -188,6 +292,13 @@ static std::mutex completion_lock;
 void completion_entry_t::add_option(const complete_entry_opt_t &opt) {
     ASSERT_IS_LOCKED(completion_lock);
     options.push_front(opt);
+    index.reset();
+}
+
+std::shared_ptr<const option_index_t> completion_entry_t::get_index() const {
+    ASSERT_IS_LOCKED(completion_lock);
+    if (!index) index = std::make_shared<const option_index_t>(options);
+    return index;
 }
 
 const option_list_t &completion_entry_t::get_options() const {
@@ -230,6 +341,9 @@ completion_t &completion_t::operator=(const completion_t &him) {
     return *this;
 }
 
+completion_t::completion_t(completion_t &&him) noexcept = default;
+completion_t &completion_t::operator=(completion_t &&him) noexcept = default;
+
 bool completion_t::is_naturally_less_than(const completion_t &a, const completion_t &b) {
     // For this to work, stable_sort must be used because results aren't interchangeable.
     if (a.flags & b.flags & COMPLETE_DONT_SORT) {
@@ -245,23 +359,21 @@ void completion_t::prepend_token_prefix(const wcstring &prefix) {
     }
 }
 
-static bool compare_completions_by_match_type(const completion_t &a, const completion_t &b) {
-    return a.match.type < b.match.type;
-}
-
-template <class Iterator, class HashFunction>
-static Iterator unique_unsorted(Iterator begin, Iterator end, HashFunction hash) {
-    typedef typename std::iterator_traits<Iterator>::value_type T;
-
-    std::unordered_set<size_t> temp;
-    return std::remove_if(begin, end, [&](const T &val) { return !temp.insert(hash(val)).second; });
-}
+namespace {
+/// Hashes and compares completion strings by pointer, to deduplicate without copying them.
+struct completion_string_hash_t {
+    size_t operator()(const wcstring *str) const { return std::hash<wcstring>()(*str); }
+};
+struct completion_string_equal_t {
+    bool operator()(const wcstring *a, const wcstring *b) const { return *a == *b; }
+};
+}  // anonymous namespace
 
-void completions_sort_and_prioritize(std::vector<completion_t> *comps) {
+void completions_sort_and_prioritize(std::vector<completion_t> *comps, size_t count) {
     // Find the best match type.
     fuzzy_match_type_t best_type = fuzzy_match_none;
-    for (size_t i = 0; i < comps->size(); i++) {
-        best_type = std::min(best_type, comps->at(i).match.type);
+    for (const completion_t &comp : *comps) {
+        best_type = std::min(best_type, comp.match.type);
     }
     // If the best type is an exact match, reduce it to prefix match. Otherwise a tab completion
     // will only show one match if it matches a file exactly. (see issue #959).
@@ -270,23 +382,89 @@ void completions_sort_and_prioritize(std::vector<completion_t> *comps) {
     }
 
     // Throw out completions whose match types are less suitable than the best.
-    size_t i = comps->size();
-    while (i--) {
-        if (comps->at(i).match.type > best_type) {
-            comps->erase(comps->begin() + i);
-        }
+    comps->erase(std::remove_if(comps->begin(), comps->end(),
+                                [&](const completion_t &comp) {
+                                    return comp.match.type > best_type;
+                                }),
+                 comps->end());
+
+    // Deduplicate, keeping the first of each. This works on indexes rather than the completions, so
+    // that each completion is only moved once, to its final place.
+    const std::vector<completion_t> &unsorted = *comps;
+    std::unordered_set<const wcstring *, completion_string_hash_t, completion_string_equal_t> seen;
+    seen.reserve(unsorted.size());
+    std::vector<size_t> order;
+    order.reserve(unsorted.size());
+    for (size_t i = 0; i < unsorted.size(); i++) {
+        if (seen.insert(&unsorted[i].completion).second) order.push_back(i);
+    }
+
+    // Sort by match type, then naturally, provided COMPLETION_DONT_SORT isn't set. Ties keep their
+    // order, as if both were stable sorts. If only the first few are wanted, the rest are left as
+    // they are, which saves sorting all of a huge list.
+    auto less_than = [&](size_t a, size_t b) {
+        const completion_t &ca = unsorted[a], &cb = unsorted[b];
+        if (ca.match.type != cb.match.type) return ca.match.type < cb.match.type;
+        if (completion_t::is_naturally_less_than(ca, cb)) return true;
+        if (completion_t::is_naturally_less_than(cb, ca)) return false;
+        return a < b;
+    };
+    // Note COMPLETE_DONT_SORT makes this ordering inconsistent, which std::sort may not survive.
+    if (count < order.size()) {
+        std::partial_sort(order.begin(), order.begin() + count, order.end(), less_than);
+    } else {
+        std::stable_sort(order.begin(), order.end(), less_than);
     }
 
-    // Sort, provided COMPLETION_DONT_SORT isn't set
-    stable_sort(comps->begin(), comps->end(), completion_t::is_naturally_less_than);
-    // Deduplicate both sorted and unsorted results
-    comps->erase(
-        unique_unsorted(comps->begin(), comps->end(),
-                        [](const completion_t &c) { return std::hash<wcstring>{}(c.completion); }),
-        comps->end());
+    std::vector<completion_t> result;
+    result.reserve(order.size());
+    for (size_t idx : order) result.push_back(std::move((*comps)[idx]));
+    *comps = std::move(result);
+}
+
+/// Returns whether completions for the token can be narrowed when it grows: it must be a non-empty
+/// plain word, or a long option.
+static bool token_is_narrowable(const wcstring &token) {
+    if (token.empty() || (token.at(0) == L'-' && !string_prefixes_string(L"--", token))) {
+        return false;
+    }
+    for (wchar_t c : token) {
+        if (!iswalnum(c) && !wcschr(L"-_.+", c)) return false;
+    }
+    return true;
+}
+
+bool completions_narrow(std::vector<completion_t> *comps, const wcstring &old_token,
+                        const wcstring &new_token, completion_request_flags_t flags) {
+    if (!string_prefixes_string(old_token, new_token) || !token_is_narrowable(old_token) ||
+        !token_is_narrowable(new_token)) {
+        return false;
+    }
 
-    // Sort the remainder by match type. They're already sorted alphabetically.
-    stable_sort(comps->begin(), comps->end(), compare_completions_by_match_type);
+    // A token matching any of these fuzzily also matches the old one, e.g. if it contains the new
+    // token it contains the old one too; so no candidates can be missing.
+    std::vector<completion_t> result;
+    for (const completion_t &comp : *comps) {
+        const bool replaces = comp.flags & COMPLETE_REPLACES_TOKEN;
+        const wcstring candidate = replaces ? comp.completion : old_token + comp.completion;
+        string_fuzzy_match_t match = string_fuzzy_match_string(new_token, candidate);
+        bool match_acceptable = (flags & COMPLETION_REQUEST_FUZZY_MATCH)
+                                    ? match.type != fuzzy_match_none
+                                    : match_type_shares_prefix(match.type);
+        if (!match_acceptable) continue;
+
+        completion_t narrowed = comp;
+        narrowed.match = match;
+        if (replaces || match_type_requires_full_replacement(match.type)) {
+            narrowed.completion = candidate;
+            narrowed.flags |= COMPLETE_REPLACES_TOKEN;
+        } else {
+            narrowed.completion = candidate.substr(new_token.size());
+        }
+        result.push_back(std::move(narrowed));
+    }
+    *comps = std::move(result);
+    return true;
 }
 
 /// Class representing an attempt to compute completions.
@@ -294,11 +472,13 @@ class completer_t {
     const completion_request_flags_t flags;
     const wcstring initial_cmd;
     std::vector<completion_t> completions;
-
-    /// Table of completions conditions that have already been tested and the corresponding test
-    /// results.
-    typedef std::unordered_map<wcstring, bool> condition_cache_t;
-    condition_cache_t condition_cache;
+    /// Whether we stopped early because there was input.
+    bool cancelled = false;
+    /// Where to add the time spent in each source, or NULL if we are not profiling.
+    complete_profile_t *const profile;
+    /// The source being timed, or complete_source_count if none, and when it was last charged.
+    complete_source_t profile_source = complete_source_count;
+    long long profile_charged_at = 0;
 
     enum complete_type_t { COMPLETE_DEFAULT, COMPLETE_AUTOSUGGEST };
 
@@ -318,11 +498,61 @@ class completer_t {
         return fuzzy_match_prefix_case_insensitive;
     }
 
+    /// Charges the time since the last charge to the source being timed.
+    void profile_charge(long long now) {
+        if (profile_source != complete_source_count) {
+            profile->sources[profile_source].self_usec += now - profile_charged_at;
+        }
+        profile_charged_at = now;
+    }
+
    public:
-    completer_t(const wcstring &c, completion_request_flags_t f) : flags(f), initial_cmd(c) {}
+    completer_t(const wcstring &c, completion_request_flags_t f, complete_profile_t *p)
+        : flags(f), initial_cmd(c), profile(p) {}
+
+    /// Times a source of completions for its lifetime, if we are profiling. Sources which run
+    /// inside it are charged for their own time.
+    class profile_scope_t {
+        completer_t &completer;
+        const complete_source_t source;
+        complete_source_t outer_source;
+        long long start;
+
+       public:
+        profile_scope_t(completer_t &c, complete_source_t s) : completer(c), source(s) {
+            if (!completer.profile) return;
+            start = get_time();
+            completer.profile_charge(start);
+            outer_source = completer.profile_source;
+            completer.profile_source = source;
+            completer.profile->sources[source].calls++;
+        }
+
+        ~profile_scope_t() {
+            if (!completer.profile) return;
+            long long now = get_time();
+            completer.profile_charge(now);
+            completer.profile_source = outer_source;
+            completer.profile->sources[source].total_usec += now - start;
+        }
+
+        profile_scope_t(const profile_scope_t &) = delete;
+        void operator=(const profile_scope_t &) = delete;
+    };
 
     bool empty() const { return completions.empty(); }
-    const std::vector<completion_t> &get_completions(void) { return completions; }
+    bool was_cancelled() const { return cancelled; }
+
+    /// Returns whether we should stop, because COMPLETION_REQUEST_CANCEL_ON_INPUT was given and the
+    /// user typed something. Called before running anything that may take a while.
+    bool check_cancelled() {
+        if (!cancelled && (flags & COMPLETION_REQUEST_CANCEL_ON_INPUT)) {
+            cancelled = input_common_stdin_has_input();
+        }
+        return cancelled;
+    }
+    /// Hands over the completions, leaving none.
+    std::vector<completion_t> acquire_completions() { return std::move(completions); }
 
     bool try_complete_variable(const wcstring &str);
     bool try_complete_user(const wcstring &str);
@@ -337,7 +567,7 @@ class completer_t {
                       bool use_implicit_cd);
 
     void complete_from_args(const wcstring &str, const wcstring &args, const wcstring &desc,
-                            complete_flags_t flags);
+                            complete_flags_t flags, int cache_ttl);
 
     void complete_cmd_desc(const wcstring &str);
 
@@ -347,7 +577,7 @@ class completer_t {
 
     void complete_strings(const wcstring &wc_escaped, const wchar_t *desc,
                           wcstring (*desc_func)(const wcstring &),
-                          std::vector<completion_t> &possible_comp, complete_flags_t flags);
+                          const std::vector<completion_t> &possible_comp, complete_flags_t flags);
 
     expand_flags_t expand_flags() const {
         // Never do command substitution in autosuggestions. Sadly, we also can't yet do job
@@ -368,13 +598,14 @@ static void autoloaded_completion_removed(const wcstring &cmd) {
 }
 
 // Autoloader for completions
-static autoload_t completion_autoloader(L"fish_complete_path", autoloaded_completion_removed);
+static autoload_t completion_autoloader(L"fish_complete_path", autoloaded_completion_removed,
+                                        L"fish_complete_autoload_limit", complete_db_load);
 
 /// Create a new completion entry.
-void append_completion(std::vector<completion_t> *completions, const wcstring &comp,
-                       const wcstring &desc, complete_flags_t flags, string_fuzzy_match_t match) {
+void append_completion(std::vector<completion_t> *completions, wcstring comp, wcstring desc,
+                       complete_flags_t flags, string_fuzzy_match_t match) {
     // If we just constructed the completion and used push_back, we would get two string copies. Try
-    // to avoid that by making a stubby completion in the vector first, and then copying our string
+    // to avoid that by making a stubby completion in the vector first, and then moving our strings
     // in. Note that completion_t's constructor will munge 'flags' so it's important that we pass
     // those to the constructor.
     //
@@ -385,13 +616,108 @@ void append_completion(std::vector<completion_t> *completions, const wcstring &c
     const wcstring empty;
     completions->push_back(completion_t(empty, empty, match, resolve_auto_space(comp, flags)));
     completion_t *last = &completions->back();
-    last->completion = comp;
-    last->description = desc;
+    last->completion = std::move(comp);
+    last->description = std::move(desc);
+}
+
+/// The most condition results we remember.
+#define CONDITION_CACHE_SIZE 512
+
+namespace {
+/// Results of completion conditions, keyed by the condition and the command line it saw. Conditions
+/// mostly look at the command line, but may look at variables or anything else too; so the results
+/// are only kept while no variable changes between completions, which running any command does.
+/// Only used on the main thread.
+class condition_cache_t : public lru_cache_t<condition_cache_t, bool> {
+    typedef lru_cache_t<condition_cache_t, bool> super;
+
+   public:
+    /// The variable generation when the last completion finished.
+    uint64_t env_generation = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t flushes = 0;
+
+    condition_cache_t() : super(CONDITION_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static condition_cache_t s_condition_cache;
+
+/// Forgets all condition results if variables changed since the last completion. Called when a
+/// completion starts.
+static void condition_cache_begin() {
+    ASSERT_IS_MAIN_THREAD();
+    condition_cache_t &cache = s_condition_cache;
+    if (cache.env_generation == env_get_generation()) return;
+    if (cache.size() > 0) {
+        cache.evict_all_nodes();
+        cache.flushes++;
+    }
+}
+
+/// Notes that a completion finished, so the results stay valid until a variable changes. Running
+/// the conditions changes variables itself, so this must only be done once they have all run.
+static void condition_cache_end() {
+    ASSERT_IS_MAIN_THREAD();
+    s_condition_cache.env_generation = env_get_generation();
+}
+
+complete_condition_stats_t complete_condition_stats() {
+    ASSERT_IS_MAIN_THREAD();
+    const condition_cache_t &cache = s_condition_cache;
+    complete_condition_stats_t stats;
+    stats.entries = cache.size();
+    stats.hits = cache.hits;
+    stats.misses = cache.misses;
+    stats.flushes = cache.flushes;
+    return stats;
+}
+
+/// The most results of complete -a arguments we remember.
+#define ARGS_CACHE_SIZE 64
+
+namespace {
+/// The evaluated arguments of an option declared with complete --cache-ttl.
+struct args_cache_entry_t {
+    /// When the results stop being used, as returned by get_time().
+    long long expires;
+    std::vector<completion_t> comps;
+};
+
+/// Evaluated complete -a arguments, keyed by the arguments, the working directory and the command
+/// line before the token being completed; those are what the command substitutions in them
+/// usually look at. Unlike condition results, they are kept while variables change, for as long as
+/// the option asked. Only used on the main thread.
+class args_cache_t : public lru_cache_t<args_cache_t, args_cache_entry_t> {
+    typedef lru_cache_t<args_cache_t, args_cache_entry_t> super;
+
+   public:
+    args_cache_t() : super(ARGS_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static args_cache_t s_args_cache;
+
+/// Returns the key for the results of evaluating the given arguments now.
+static wcstring args_cache_key(const wcstring &args) {
+    wcstring cmdline;
+    size_t cursor_pos;
+    builtin_commandline_get_state(&cmdline, &cursor_pos);
+    const wchar_t *tok_begin = cmdline.c_str() + cursor_pos;
+    parse_util_token_extent(cmdline.c_str(), cursor_pos, &tok_begin, NULL, NULL, NULL);
+
+    wcstring key = args;
+    key.push_back(L'\0');
+    if (auto pwd = env_get(L"PWD")) key.append(pwd->as_string());
+    key.push_back(L'\0');
+    key.append(cmdline.c_str(), tok_begin - cmdline.c_str());
+    return key;
 }
 
 /// Test if the specified script returns zero. The result is cached, so that if multiple completions
-/// use the same condition, it needs only be evaluated once. condition_cache_clear must be called
-/// after a completion run to make sure that there are no stale completions.
+/// use the same condition, or the same command line is completed again, it needs only be evaluated
+/// once.
 bool completer_t::condition_test(const wcstring &condition) {
     if (condition.empty()) {
         // fwprintf( stderr, L"No condition specified\n" );
@@ -405,16 +731,29 @@ bool completer_t::condition_test(const wcstring &condition) {
 
     ASSERT_IS_MAIN_THREAD();
 
-    bool test_res;
-    condition_cache_t::iterator cached_entry = condition_cache.find(condition);
-    if (cached_entry == condition_cache.end()) {
-        // Compute new value and reinsert it.
-        test_res = (0 == exec_subshell(condition, false /* don't apply exit status */));
-        condition_cache[condition] = test_res;
-    } else {
-        // Use the old value.
-        test_res = cached_entry->second;
-    }
+    // The condition sees the command line through the commandline builtin, which is not always
+    // the one we are completing (see the wrap chain in complete()).
+    wcstring key, cmdline;
+    size_t cursor_pos;
+    builtin_commandline_get_state(&cmdline, &cursor_pos);
+    key.reserve(condition.size() + cmdline.size() + 16);
+    key.append(condition);
+    key.push_back(L'\0');
+    key.append(to_string(static_cast<long>(cursor_pos)));
+    key.push_back(L'\0');
+    key.append(cmdline);
+
+    condition_cache_t &cache = s_condition_cache;
+    if (const bool *cached = cache.get(key)) {
+        cache.hits++;
+        return *cached;
+    }
+    // A cancelled completion is thrown away, so skip the options of anything not yet known.
+    if (this->check_cancelled()) return false;
+    cache.misses++;
+    profile_scope_t timer(*this, complete_source_conditions);
+    bool test_res = (0 == exec_subshell(condition, false /* don't apply exit status */));
+    cache.insert(std::move(key), test_res);
     return test_res;
 }
 
@@ -432,7 +771,8 @@ static completion_entry_t &complete_get_exact_entry(const wcstring &cmd, bool cm
 
 void complete_add(const wchar_t *cmd, bool cmd_is_path, const wcstring &option,
                   complete_option_type_t option_type, int result_mode, const wchar_t *condition,
-                  const wchar_t *comp, const wchar_t *desc, complete_flags_t flags) {
+                  const wchar_t *comp, const wchar_t *desc, complete_flags_t flags,
+                  int cache_ttl) {
     CHECK(cmd, );
     // option should be  empty iff the option type is arguments only.
     assert(option.empty() == (option_type == option_type_args_only));
@@ -452,6 +792,7 @@ void complete_add(const wchar_t *cmd, bool cmd_is_path, const wcstring &option,
     if (condition) opt.condition = condition;
     if (desc) opt.desc = desc;
     opt.flags = flags;
+    opt.cache_ttl = cache_ttl;
 
     c.add_option(opt);
 }
@@ -461,6 +802,7 @@ void complete_add(const wchar_t *cmd, bool cmd_is_path, const wcstring &option,
 /// Must be called while locked.
 bool completion_entry_t::remove_option(const wcstring &option, complete_option_type_t type) {
     ASSERT_IS_LOCKED(completion_lock);
+    index.reset();
     option_list_t::iterator iter = this->options.begin();
     while (iter != this->options.end()) {
         if (iter->option == option && iter->type == type) {
@@ -540,7 +882,7 @@ static void parse_cmd_string(const wcstring &str, wcstring &path, wcstring &cmd)
 ///    The flags
 void completer_t::complete_strings(const wcstring &wc_escaped, const wchar_t *desc,
                                    wcstring (*desc_func)(const wcstring &),
-                                   std::vector<completion_t> &possible_comp,
+                                   const std::vector<completion_t> &possible_comp,
                                    complete_flags_t flags) {
     wcstring tmp = wc_escaped;
     if (!expand_one(tmp, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_WILDCARDS | this->expand_flags(), NULL))
@@ -549,7 +891,7 @@ void completer_t::complete_strings(const wcstring &wc_escaped, const wchar_t *de
     const wcstring wc = parse_util_unescape_wildcards(tmp);
 
     for (size_t i = 0; i < possible_comp.size(); i++) {
-        wcstring temp = possible_comp.at(i).completion;
+        const wcstring &temp = possible_comp.at(i).completion;
         const wchar_t *next_str = temp.empty() ? NULL : temp.c_str();
 
         if (next_str) {
@@ -561,8 +903,317 @@ void completer_t::complete_strings(const wcstring &wc_escaped, const wchar_t *de
 
 /// If command to complete is short enough, substitute the description with the whatis information
 /// for the executable.
+// Descriptions of commands come from the whatis database of the manual pages, through apropos.
+// Running it for every completion is slow, so its output for all commands is kept in an index file
+// in the data directory. This is mmap'd, and regenerated in the background when the databases
+// change. The index starts with a header line, followed by "name\tdescription" lines sorted by name.
+#define COMMAND_DESC_INDEX_HEADER "# fish command descriptions 1 "
+
+/// How often we check whether the index or the databases it was made from changed, in seconds.
+#define COMMAND_DESC_CHECK_INTERVAL 60
+
+/// How old the index may get before it is made again anyway, in seconds.
+#define COMMAND_DESC_MAX_AGE (7 * 24 * 60 * 60)
+
+/// Files and directories of the common whatis database implementations, which change when the
+/// database is updated.
+static const char *const command_desc_databases[] = {
+    "/var/cache/man",          "/var/cache/man/index.db",  "/usr/share/man/index.db",
+    "/usr/share/man/mandoc.db", "/usr/share/man/whatis",   "/usr/local/share/man/whatis",
+    "/usr/local/man/whatis",   "/usr/local/share/man/mandoc.db"};
+
+/// Returns a number that changes when the whatis databases change.
+static long long command_desc_database_stamp() {
+    long long stamp = 0;
+    for (const char *path : command_desc_databases) {
+        struct stat buf;
+        if (stat(path, &buf) == 0) stamp = std::max(stamp, (long long)buf.st_mtime);
+    }
+    return stamp;
+}
+
+static wcstring command_desc_index_path() {
+    wcstring path;
+    if (!path_get_data(path)) return wcstring();
+    return path + L"/command_descriptions";
+}
+
+namespace {
+/// A mapped index of command descriptions.
+class command_desc_index_t {
+    const char *data = NULL;
+    size_t length = 0;
+    /// Offsets of the entry lines, sorted by name.
+    std::vector<size_t> entries;
+
+    /// Returns the length of the name of the entry at the given offset, which is followed by a tab.
+    size_t name_length(size_t offset) const {
+        const char *name = data + offset;
+        return (const char *)memchr(name, '\t', length - offset) - name;
+    }
+
+   public:
+    /// The database stamp the index was made for.
+    long long stamp = -1;
+    /// Modification time of the index file.
+    time_t mtime = 0;
+
+    command_desc_index_t() = default;
+    command_desc_index_t(const command_desc_index_t &) = delete;
+    void operator=(const command_desc_index_t &) = delete;
+    ~command_desc_index_t() {
+        if (data) munmap((void *)data, length);
+    }
+
+    /// Maps the index at the given path, returning NULL if it is missing or malformed.
+    static std::unique_ptr<command_desc_index_t> open(const wcstring &path) {
+        int fd = wopen_cloexec(path, O_RDONLY);
+        if (fd < 0) return NULL;
+        struct stat buf;
+        if (fstat(fd, &buf) != 0 || buf.st_size <= 0) {
+            close(fd);
+            return NULL;
+        }
+        void *map = mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return NULL;
+
+        std::unique_ptr<command_desc_index_t> result(new command_desc_index_t());
+        result->data = (const char *)map;
+        result->length = (size_t)buf.st_size;
+        result->mtime = buf.st_mtime;
+
+        // Parse the header, then note where each entry starts. Entries must have a tab and be
+        // newline terminated; the last line is dropped otherwise.
+        const size_t header_len = strlen(COMMAND_DESC_INDEX_HEADER);
+        const char *cursor = result->data, *end = result->data + result->length;
+        const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+        if (!newline || (size_t)(newline - cursor) <= header_len ||
+            memcmp(cursor, COMMAND_DESC_INDEX_HEADER, header_len) != 0) {
+            return NULL;
+        }
+        result->stamp = strtoll(cursor + header_len, NULL, 10);
+        for (cursor = newline + 1; cursor < end; cursor = newline + 1) {
+            newline = (const char *)memchr(cursor, '\n', end - cursor);
+            if (!newline) break;
+            if (memchr(cursor, '\t', newline - cursor)) {
+                result->entries.push_back(cursor - result->data);
+            }
+        }
+        return result;
+    }
+
+    /// Appends the entries for names that start with the given prefix, as "name\tdescription".
+    void lookup(const wcstring &prefix, wcstring_list_t *out) const {
+        const std::string narrow_prefix = wcs2string(prefix);
+        const char *const pfx = narrow_prefix.c_str();
+        const size_t pfx_len = narrow_prefix.size();
+        // The names compare with the tab terminating them, which sorts before any other character
+        // allowed in a name; so the prefix sorts before everything it is a prefix of.
+        auto iter = std::lower_bound(entries.begin(), entries.end(), pfx, [&](size_t offset,
+                                                                              const char *key) {
+            size_t name_len = name_length(offset);
+            int cmp = memcmp(data + offset, key, std::min(name_len, pfx_len));
+            return cmp < 0 || (cmp == 0 && name_len < pfx_len);
+        });
+        for (; iter != entries.end(); ++iter) {
+            const char *line = data + *iter;
+            if (name_length(*iter) < pfx_len || memcmp(line, pfx, pfx_len) != 0) break;
+            const char *line_end = (const char *)memchr(line, '\n', length - *iter);
+            out->push_back(str2wcstring(line, line_end - line));
+        }
+    }
+};
+
+/// State of the index, only used on the main thread.
+struct command_desc_state_t {
+    std::unique_ptr<command_desc_index_t> index;
+    time_t last_check = 0;
+    bool regenerating = false;
+};
+}  // anonymous namespace
+
+static command_desc_state_t s_command_desc;
+
+/// Turns the output of `apropos .` into sorted "name\tdescription" lines, taking commands from
+/// sections 1 and 8 like __fish_describe_command does.
+static std::string command_desc_entries_from_apropos(const std::string &output) {
+    std::map<std::string, std::string> entries;
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t line_end = output.find('\n', start);
+        if (line_end == std::string::npos) line_end = output.size();
+        const std::string line = output.substr(start, line_end - start);
+        start = line_end + 1;
+
+        // The names, separated by ", ", come before " - ", then the description.
+        size_t sep = line.find(" - ");
+        if (sep == std::string::npos) continue;
+        size_t names_end = line.find_last_not_of(' ', sep);
+        size_t desc_start = line.find_first_not_of(' ', sep + 3);
+        if (names_end == std::string::npos || desc_start == std::string::npos) continue;
+        std::string desc = line.substr(desc_start, line.find(" - ", desc_start) - desc_start);
+        desc.erase(desc.find_last_not_of(" \t") + 1);
+        if (desc.find('\t') != std::string::npos) continue;
+
+        const std::string names = line.substr(0, names_end + 1);
+        size_t name_start = 0;
+        while (name_start <= names.size()) {
+            size_t name_end = names.find(", ", name_start);
+            if (name_end == std::string::npos) name_end = names.size();
+            std::string name = names.substr(name_start, name_end - name_start);
+            name_start = name_end + 2;
+
+            size_t section = std::min(name.find("(1)"), name.find("(8)"));
+            if (section == std::string::npos) continue;
+            size_t erase_from = section;
+            while (erase_from > 0 && (name[erase_from - 1] == ' ' || name[erase_from - 1] == '\t')) {
+                erase_from--;
+            }
+            name.erase(erase_from, section + 3 - erase_from);
+            size_t bracket = name.find(" [");
+            if (bracket != std::string::npos && name.find(']', bracket) != std::string::npos) {
+                name.erase(bracket, name.rfind(']') + 1 - bracket);
+            }
+            if (name.empty() || name.find_first_of(" \t") != std::string::npos) continue;
+            entries[name] = desc;
+        }
+    }
+
+    std::string result;
+    for (const auto &entry : entries) {
+        result.append(entry.first);
+        result.push_back('\t');
+        result.append(entry.second);
+        result.push_back('\n');
+    }
+    return result;
+}
+
+/// Runs apropos with the given environment and returns its output. Background threads only.
+static bool command_desc_run_apropos(const std::string &apropos,
+                                     const std::vector<std::string> &env, std::string *output) {
+#if FISH_USE_POSIX_SPAWN
+    int pipes[2];
+    if (fish_pipe_cloexec(pipes) == -1) return false;
+
+    // Our thread has all signals blocked; the child should not.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigfillset(&sigs);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char *> argv = {const_cast<char *>(apropos.c_str()), const_cast<char *>("."),
+                                NULL};
+    std::vector<char *> envp;
+    for (const std::string &var : env) envp.push_back(const_cast<char *>(var.c_str()));
+    envp.push_back(NULL);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, apropos.c_str(), &actions, &attr, &argv[0], &envp[0]);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipes[1]);
+    if (err != 0) {
+        close(pipes[0]);
+        return false;
+    }
+
+    char buf[4096];
+    ssize_t amt;
+    while ((amt = read(pipes[0], buf, sizeof buf)) != 0) {
+        if (amt > 0) {
+            output->append(buf, amt);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    close(pipes[0]);
+    // The shell may have reaped the child already, so ignore the result.
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    return true;
+#else
+    UNUSED(apropos);
+    UNUSED(env);
+    UNUSED(output);
+    return false;
+#endif
+}
+
+/// Writes the index for the given database stamp, replacing the old one atomically. Background
+/// threads only.
+static void command_desc_write_index(const wcstring &path, const std::string &apropos,
+                                     const std::vector<std::string> &env, long long stamp) {
+    std::string output;
+    if (!command_desc_run_apropos(apropos, env, &output)) return;
+    std::string contents = COMMAND_DESC_INDEX_HEADER + std::to_string(stamp) + "\n";
+    contents.append(command_desc_entries_from_apropos(output));
+
+    std::string narrow_tmp = wcs2string(path + L".XXXXXX");
+    int fd = fish_mkstemp_cloexec(&narrow_tmp[0]);
+    if (fd < 0) return;
+    const wcstring tmp_path = str2wcstring(narrow_tmp);
+    bool ok = write_loop(fd, contents.data(), contents.size()) >= 0;
+    close(fd);
+    if (!ok || wrename(tmp_path, path) == -1) {
+        debug(2, L"Error %d when writing command descriptions", errno);
+        wunlink(tmp_path);
+    }
+}
+
+/// Returns the index of command descriptions, or NULL if there is none yet. Starts making it in
+/// the background if it is missing or out of date.
+static const command_desc_index_t *command_desc_index() {
+    ASSERT_IS_MAIN_THREAD();
+    command_desc_state_t &state = s_command_desc;
+    const time_t now = time(NULL);
+    if (now - state.last_check < COMMAND_DESC_CHECK_INTERVAL) return state.index.get();
+    state.last_check = now;
+
+    const wcstring path = command_desc_index_path();
+    if (path.empty()) return NULL;
+    struct stat buf;
+    if (wstat(path, &buf) != 0) {
+        state.index.reset();
+    } else if (!state.index || state.index->mtime != buf.st_mtime) {
+        state.index = command_desc_index_t::open(path);
+    }
+
+    const long long stamp = command_desc_database_stamp();
+    wcstring apropos;
+    if (!state.regenerating &&
+        (!state.index || state.index->stamp != stamp ||
+         now - state.index->mtime > COMMAND_DESC_MAX_AGE) &&
+        path_get_path(L"apropos", &apropos)) {
+        std::vector<std::string> env;
+        for (const char *const *var = env_export_arr(); *var; var++) env.push_back(*var);
+        const std::string narrow_apropos = wcs2string(apropos);
+        state.regenerating = true;
+        iothread_perform(
+            [=]() { command_desc_write_index(path, narrow_apropos, env, stamp); },
+            []() {
+                // Look at the new index the next time it is needed.
+                s_command_desc.regenerating = false;
+                s_command_desc.last_check = 0;
+            });
+    }
+    return state.index.get();
+}
+
 void completer_t::complete_cmd_desc(const wcstring &str) {
     ASSERT_IS_MAIN_THREAD();
+    profile_scope_t timer(*this, complete_source_descriptions);
 
     const wchar_t *cmd_start;
     int skip;
@@ -602,17 +1253,22 @@ void completer_t::complete_cmd_desc(const wcstring &str) {
 
     std::unordered_map<wcstring, wcstring> lookup;
 
-    // First locate a list of possible descriptions using a single call to apropos or a direct
-    // search if we know the location of the whatis database. This can take some time on slower
-    // systems with a large set of manuals, but it should be ok since apropos is only called once.
+    // First locate a list of possible descriptions, from the index if we have one. Otherwise use a
+    // single call to apropos or a direct search if we know the location of the whatis database.
+    // This can take some time on slower systems with a large set of manuals, but it should be ok
+    // since apropos is only called once.
     wcstring_list_t list;
-    if (exec_subshell(lookup_cmd, list, false /* don't apply exit status */) != -1) {
+    const command_desc_index_t *index = command_desc_index();
+    if (index) index->lookup(cmd_start, &list);
+    if (!index && this->check_cancelled()) return;
+    if (index || exec_subshell(lookup_cmd, list, false /* don't apply exit status */) != -1) {
         // Then discard anything that is not a possible completion and put the result into a
         // hashtable with the completion as key and the description as value.
         //
         // Should be reasonably fast, since no memory allocations are needed.
         for (size_t i = 0; i < list.size(); i++) {
             const wcstring &elstr = list.at(i);
+            if (!string_prefixes_string(cmd_start, elstr)) continue;
 
             const wcstring fullkey(elstr, wcslen(cmd_start));
 
@@ -661,6 +1317,7 @@ static wcstring complete_function_desc(const wcstring &fn) {
 void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool use_builtin,
                                bool use_command, bool use_implicit_cd) {
     if (str_cmd.empty()) return;
+    profile_scope_t timer(*this, complete_source_commands);
 
     std::vector<completion_t> possible_comp;
 
@@ -716,10 +1373,30 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
 ///    Description of the completion
 /// @param  flags
 ///    The list into which the results will be inserted
+/// @param  cache_ttl
+///    Seconds for which the evaluated arguments may be reused, or 0
 ///
 void completer_t::complete_from_args(const wcstring &str, const wcstring &args,
-                                     const wcstring &desc, complete_flags_t flags) {
+                                     const wcstring &desc, complete_flags_t flags, int cache_ttl) {
     bool is_autosuggest = (this->type() == COMPLETE_AUTOSUGGEST);
+    profile_scope_t timer(*this, complete_source_arguments);
+
+    // Autosuggestions skip command substitutions, so there is nothing worth caching for them.
+    wcstring cache_key;
+    const bool use_cache = cache_ttl > 0 && !is_autosuggest;
+    if (use_cache) {
+        ASSERT_IS_MAIN_THREAD();
+        cache_key = args_cache_key(args);
+        if (const args_cache_entry_t *cached = s_args_cache.get(cache_key)) {
+            if (cached->expires > get_time()) {
+                this->complete_strings(escape_string(str, ESCAPE_ALL), desc.c_str(), 0,
+                                       cached->comps, flags);
+                return;
+            }
+            s_args_cache.evict_node(cache_key);
+        }
+    }
+    if (this->check_cancelled()) return;
 
     // If type is COMPLETE_AUTOSUGGEST, it means we're on a background thread, so don't call
     // proc_push_interactive.
@@ -740,6 +1417,12 @@ void completer_t::complete_from_args(const wcstring &str, const wcstring &args,
     }
 
     this->complete_strings(escape_string(str, ESCAPE_ALL), desc.c_str(), 0, possible_comp, flags);
+    if (use_cache) {
+        args_cache_entry_t entry;
+        entry.expires = get_time() + cache_ttl * 1000000LL;
+        entry.comps = std::move(possible_comp);
+        s_args_cache.insert(std::move(cache_key), std::move(entry));
+    }
 }
 
 static size_t leading_dash_count(const wchar_t *str) {
@@ -793,7 +1476,7 @@ static const wchar_t *param_match2(const complete_entry_opt_t *e, const wchar_t
 /// Tests whether a short option is a viable completion. arg_str will be like '-xzv', nextopt will
 /// be a character like 'f' options will be the list of all options, used to validate the argument.
 static bool short_ok(const wcstring &arg, const complete_entry_opt_t *entry,
-                     const option_list_t &options) {
+                     const option_index_t &index) {
     // Ensure it's a short option.
     if (entry->type != option_type_short || entry->option.empty()) {
         return false;
@@ -819,14 +1502,9 @@ static bool short_ok(const wcstring &arg, const complete_entry_opt_t *entry,
     // the options list. If we get a short option that can't be combined (NO_COMMON), then we stop.
     bool result = true;
     for (size_t i = 1; i < arg.size(); i++) {
-        wchar_t arg_char = arg.at(i);
-        const complete_entry_opt_t *match = NULL;
-        for (option_list_t::const_iterator iter = options.begin(); iter != options.end(); ++iter) {
-            if (iter->type == option_type_short && iter->option.at(0) == arg_char) {
-                match = &*iter;
-                break;
-            }
-        }
+        auto iter = index.short_by_char.find(arg.at(i));
+        const complete_entry_opt_t *match =
+            iter == index.short_by_char.end() ? NULL : &index.options.at(iter->second);
         if (match == NULL || (match->result_mode & NO_COMMON)) {
             result = false;
             break;
@@ -843,6 +1521,34 @@ static void complete_load(const wcstring &name, bool reload) {
     completion_autoloader.load(name, reload);
 }
 
+autoload_stats_t complete_autoload_stats() { return completion_autoloader.stats(); }
+
+memory_usage_t complete_memory_usage() {
+    scoped_lock lock(completion_lock);
+    memory_usage_t usage;
+    for (const completion_entry_t &entry : completion_set) {
+        usage.count++;
+        usage.bytes += sizeof entry + 2 * sizeof(void *) + string_memory(entry.cmd);
+        for (const complete_entry_opt_t &opt : entry.options) {
+            // Each list node also holds two links.
+            usage.bytes += sizeof opt + 2 * sizeof(void *) + string_memory(opt.option) +
+                           string_memory(opt.comp) + string_memory(opt.desc) +
+                           string_memory(opt.condition);
+        }
+    }
+    return usage;
+}
+
+void complete_prefetch(const wcstring &cmd) {
+    function_prefetch(cmd);
+    completion_autoloader.prefetch(cmd);
+}
+
+void complete_preload(const wcstring &cmd) {
+    ASSERT_IS_MAIN_THREAD();
+    complete_load(cmd, false);
+}
+
 /// complete_param: Given a command, find completions for the argument str of command cmd_orig with
 /// previous option popt.
 ///
@@ -859,21 +1565,24 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
     const wchar_t *const str = sstr.c_str();
 
     bool use_common = 1, use_files = 1;
+    profile_scope_t timer(*this, complete_source_options);
 
     wcstring cmd, path;
     parse_cmd_string(cmd_orig, path, cmd);
 
     if (this->type() == COMPLETE_DEFAULT) {
         ASSERT_IS_MAIN_THREAD();
+        profile_scope_t load_timer(*this, complete_source_loading);
         complete_load(cmd, true);
     } else if (this->type() == COMPLETE_AUTOSUGGEST &&
                !completion_autoloader.has_tried_loading(cmd)) {
         // Load this command (on the main thread)
+        profile_scope_t load_timer(*this, complete_source_loading);
         iothread_perform_on_main([&]() { complete_load(cmd, false); });
     }
 
-    // Make a list of lists of all options that we care about.
-    std::vector<option_list_t> all_options;
+    // Make a list of the indexes of all options that we care about. They are shared, not copied.
+    std::vector<std::shared_ptr<const option_index_t>> all_options;
     {
         scoped_lock lock(completion_lock);
         for (completion_entry_set_t::const_iterator iter = completion_set.begin();
@@ -881,30 +1590,37 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
             const completion_entry_t &i = *iter;
             const wcstring &match = i.cmd_is_path ? path : cmd;
             if (wildcard_match(match, i.cmd)) {
-                // Copy all of their options into our list.
-                all_options.push_back(i.get_options());  // Oof, this is a lot of copying
+                all_options.push_back(i.get_index());
             }
         }
     }
 
     // Now release the lock and test each option that we captured above. We have to do this outside
     // the lock because callouts (like the condition) may add or remove completions. See issue 2.
-    for (std::vector<option_list_t>::const_iterator iter = all_options.begin();
-         iter != all_options.end(); ++iter) {
-        const option_list_t &options = *iter;
+    // The index gives the options that may match, which are then tested in their order in the list
+    // like every option used to be.
+    std::vector<size_t> candidates;
+    for (const auto &index_ptr : all_options) {
+        const option_index_t &index = *index_ptr;
+        const std::vector<complete_entry_opt_t> &options = index.options;
         use_common = 1;
         if (use_switches) {
             if (str[0] == L'-') {
                 // Check if we are entering a combined option and argument (like --color=auto or
-                // -I/usr/include).
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end();
-                     ++oiter) {
-                    const complete_entry_opt_t *o = &*oiter;
+                // -I/usr/include). The switch is then a prefix of the argument.
+                candidates.clear();
+                for (size_t len = 1; len <= sstr.size(); len++) {
+                    index.find_switches(sstr.substr(0, len), false, &candidates);
+                }
+                std::sort(candidates.begin(), candidates.end());
+                for (size_t idx : candidates) {
+                    const complete_entry_opt_t *o = &options[idx];
                     const wchar_t *arg = param_match2(o, str);
                     if (arg != NULL && this->condition_test(o->condition)) {
                         if (o->result_mode & NO_COMMON) use_common = false;
                         if (o->result_mode & NO_FILES) use_files = false;
-                        complete_from_args(arg, o->comp, o->localized_desc(), o->flags);
+                        complete_from_args(arg, o->comp, o->localized_desc(), o->flags,
+                                           o->cache_ttl);
                     }
                 }
             } else if (popt[0] == L'-') {
@@ -912,26 +1628,28 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                 // Here we are testing the previous argument,
                 // to see how we should complete the current argument
                 bool old_style_match = false;
+                candidates.clear();
+                index.find_switches(spopt, false, &candidates);
+                std::sort(candidates.begin(), candidates.end());
 
                 // If we are using old style long options, check for them first.
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end();
-                     ++oiter) {
-                    const complete_entry_opt_t *o = &*oiter;
+                for (size_t idx : candidates) {
+                    const complete_entry_opt_t *o = &options[idx];
                     if (o->type == option_type_single_long && param_match(o, popt) &&
                         this->condition_test(o->condition)) {
                         old_style_match = true;
                         if (o->result_mode & NO_COMMON) use_common = false;
                         if (o->result_mode & NO_FILES) use_files = false;
-                        complete_from_args(str, o->comp, o->localized_desc(), o->flags);
+                        complete_from_args(str, o->comp, o->localized_desc(), o->flags,
+                                           o->cache_ttl);
                     }
                 }
 
                 // No old style option matched, or we are not using old style options. We check if
                 // any short (or gnu style options do.
                 if (!old_style_match) {
-                    for (option_list_t::const_iterator oiter = options.begin();
-                         oiter != options.end(); ++oiter) {
-                        const complete_entry_opt_t *o = &*oiter;
+                    for (size_t idx : candidates) {
+                        const complete_entry_opt_t *o = &options[idx];
                         // Gnu-style options with _optional_ arguments must be specified as a single
                         // token, so that it can be differed from a regular argument.
                         // Here we are testing the previous argument for a GNU-style match,
@@ -942,7 +1660,8 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                         if (param_match(o, popt) && this->condition_test(o->condition)) {
                             if (o->result_mode & NO_COMMON) use_common = false;
                             if (o->result_mode & NO_FILES) use_files = false;
-                            complete_from_args(str, o->comp, o->localized_desc(), o->flags);
+                            complete_from_args(str, o->comp, o->localized_desc(), o->flags,
+                                               o->cache_ttl);
                         }
                     }
                 }
@@ -953,15 +1672,24 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
             continue;
         }
 
-        // Now we try to complete an option itself
-        for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end();
-             ++oiter) {
-            const complete_entry_opt_t *o = &*oiter;
+        // Now we try to complete an option itself. The candidates are the arguments, and the
+        // switches the string may be the start of.
+        candidates = index.args_only;
+        if (wcslen(str) > 0 && use_switches) {
+            if (leading_dash_count(str) == 1) {
+                candidates.insert(candidates.end(), index.shorts.begin(), index.shorts.end());
+            }
+            index.find_switches(sstr, true, &candidates);
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        }
+        for (size_t idx : candidates) {
+            const complete_entry_opt_t *o = &options[idx];
             // If this entry is for the base command, check if any of the arguments match.
             if (!this->condition_test(o->condition)) continue;
             if (o->option.empty()) {
                 use_files = use_files && ((o->result_mode & NO_FILES) == 0);
-                complete_from_args(str, o->comp, o->localized_desc(), o->flags);
+                complete_from_args(str, o->comp, o->localized_desc(), o->flags, o->cache_ttl);
             }
 
             if (wcslen(str) == 0 || !use_switches) {
@@ -969,7 +1697,7 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
             }
 
             // Check if the short style option matches.
-            if (short_ok(str, o, options)) {
+            if (short_ok(str, o, index)) {
                 // It's a match.
                 const wcstring desc = o->localized_desc();
                 append_completion(&this->completions, o->option, desc, 0);
@@ -1026,6 +1754,7 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
 /// Perform generic (not command-specific) expansions on the specified string.
 void completer_t::complete_param_expand(const wcstring &str, bool do_file,
                                         bool handle_as_special_cd) {
+    profile_scope_t timer(*this, complete_source_files);
     expand_flags_t flags = EXPAND_SKIP_CMDSUBST | EXPAND_FOR_COMPLETIONS | this->expand_flags();
 
     if (!do_file) flags |= EXPAND_SKIP_WILDCARDS;
@@ -1238,8 +1967,44 @@ bool completer_t::try_complete_user(const wcstring &str) {
 #endif
 }
 
-void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_comps,
+const wchar_t *complete_source_name(complete_source_t source) {
+    switch (source) {
+        case complete_source_commands: {
+            return L"commands";
+        }
+        case complete_source_descriptions: {
+            return L"descriptions";
+        }
+        case complete_source_loading: {
+            return L"loading";
+        }
+        case complete_source_options: {
+            return L"options";
+        }
+        case complete_source_conditions: {
+            return L"conditions";
+        }
+        case complete_source_arguments: {
+            return L"arguments";
+        }
+        case complete_source_files: {
+            return L"files";
+        }
+        case complete_source_count: {
+            break;
+        }
+    }
+    DIE("unknown completion source");
+}
+
+bool complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_comps,
               completion_request_flags_t flags) {
+    return complete(cmd_with_subcmds, out_comps, flags, NULL);
+}
+
+bool complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_comps,
+              completion_request_flags_t flags, complete_profile_t *profile) {
+    const long long start_time = profile ? get_time() : 0;
     // Determine the innermost subcommand.
     const wchar_t *cmdsubst_begin, *cmdsubst_end;
     parse_util_cmdsubst_extent(cmd_with_subcmds.c_str(), cmd_with_subcmds.size(), &cmdsubst_begin,
@@ -1247,8 +2012,10 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_c
     assert(cmdsubst_begin != NULL && cmdsubst_end != NULL && cmdsubst_end >= cmdsubst_begin);
     const wcstring cmd = wcstring(cmdsubst_begin, cmdsubst_end - cmdsubst_begin);
 
-    // Make our completer.
-    completer_t completer(cmd, flags);
+    // Make our completer. Conditions are only run for non-autosuggestions, on the main thread.
+    completer_t completer(cmd, flags, profile);
+    const bool use_conditions = !(flags & COMPLETION_REQUEST_AUTOSUGGESTION);
+    if (use_conditions) condition_cache_begin();
 
     wcstring current_command;
     const size_t pos = cmd.size();
@@ -1479,7 +2246,10 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_c
         }
     }
 
-    *out_comps = completer.get_completions();
+    if (use_conditions) condition_cache_end();
+    *out_comps = completer.acquire_completions();
+    if (profile) profile->total_usec += get_time() - start_time;
+    return !completer.was_cancelled();
 }
 
 /// Print the GNU longopt style switch \c opt, and the argument \c argument to the specified
@@ -1491,8 +2261,7 @@ static void append_switch(wcstring &out, const wcstring &opt, const wcstring &ar
     append_format(out, L" --%ls %ls", opt.c_str(), esc.c_str());
 }
 
-wcstring complete_print() {
-    wcstring out;
+void complete_print(output_stream_t &out) {
     scoped_lock locker(completion_lock);
 
     // Get a list of all completions in a vector, then sort it by order.
@@ -1503,43 +2272,47 @@ wcstring complete_print() {
     }
     sort(all_completions.begin(), all_completions.end(), compare_completions_by_order);
 
-    for (std::vector<const completion_entry_t *>::const_iterator iter = all_completions.begin();
-         iter != all_completions.end(); ++iter) {
-        const completion_entry_t *e = *iter;
-        const option_list_t &options = e->get_options();
-        for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end();
-             ++oiter) {
-            const complete_entry_opt_t *o = &*oiter;
+    // Each line is passed on as soon as it is made, so that the output for all completions is never
+    // held at once.
+    wcstring line;
+    for (const completion_entry_t *e : all_completions) {
+        // The command is the same for every option of the entry.
+        wcstring cmd_switch;
+        append_switch(cmd_switch, e->cmd_is_path ? L"path" : L"command",
+                      escape_string(e->cmd, ESCAPE_ALL));
+
+        for (const complete_entry_opt_t &o : e->get_options()) {
             const wchar_t *modestr[] = {L"", L" --no-files", L" --require-parameter",
                                         L" --exclusive"};
 
-            append_format(out, L"complete%ls", modestr[o->result_mode]);
-
-            append_switch(out, e->cmd_is_path ? L"path" : L"command",
-                          escape_string(e->cmd, ESCAPE_ALL));
+            line = L"complete";
+            line.append(modestr[o.result_mode]);
+            line.append(cmd_switch);
 
-            switch (o->type) {
+            switch (o.type) {
                 case option_type_args_only: {
                     break;
                 }
                 case option_type_short: {
-                    assert(!o->option.empty());  //!OCLINT(multiple unary operator)
-                    append_format(out, L" --short-option '%lc'", o->option.at(0));
+                    assert(!o.option.empty());  //!OCLINT(multiple unary operator)
+                    append_format(line, L" --short-option '%lc'", o.option.at(0));
                     break;
                 }
                 case option_type_single_long:
                 case option_type_double_long: {
                     append_switch(
-                        out, o->type == option_type_single_long ? L"old-option" : L"long-option",
-                        o->option);
+                        line, o.type == option_type_single_long ? L"old-option" : L"long-option",
+                        o.option);
                     break;
                 }
             }
 
-            append_switch(out, L"description", C_(o->desc));
-            append_switch(out, L"arguments", o->comp);
-            append_switch(out, L"condition", o->condition);
-            out.append(L"\n");
+            append_switch(line, L"description", C_(o.desc));
+            append_switch(line, L"arguments", o.comp);
+            append_switch(line, L"condition", o.condition);
+            if (o.cache_ttl > 0) append_format(line, L" --cache-ttl %d", o.cache_ttl);
+            line.push_back(L'\n');
+            out.append(line);
         }
     }
 
@@ -1550,9 +2323,8 @@ wcstring complete_print() {
     for (size_t i = 0; i < wrap_pairs.size();) {
         const wcstring &cmd = wrap_pairs.at(i++);
         const wcstring &target = wrap_pairs.at(i++);
-        append_format(out, L"complete --command %ls --wraps %ls\n", cmd.c_str(), target.c_str());
+        out.append_format(L"complete --command %ls --wraps %ls\n", cmd.c_str(), target.c_str());
     }
-    return out;
 }
 
 /// Completion "wrapper" support. The map goes from wrapping-command to wrapped-command-list.
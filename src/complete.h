@@ -75,6 +75,9 @@ class completion_t {
                           complete_flags_t flags_val = 0);
     completion_t(const completion_t &);
     completion_t &operator=(const completion_t &);
+    // Moving is what sorting and filtering completions mostly does, so make it cheap.
+    completion_t(completion_t &&) noexcept;
+    completion_t &operator=(completion_t &&) noexcept;
 
     // Compare two completions. No operating overlaoding to make this always explicit (there's
     // potentially multiple ways to compare completions).
@@ -83,27 +86,34 @@ class completion_t {
     // example, foo10 is naturally greater than foo2 (but alphabetically less than it).
     static bool is_naturally_less_than(const completion_t &a, const completion_t &b);
 
-    // Deduplicate a potentially-unsorted vector, preserving the order
-    template <class Iterator, class HashFunction>
-    static Iterator unique_unsorted(Iterator begin, Iterator end, HashFunction hash);
-
     // If this completion replaces the entire token, prepend a prefix. Otherwise do nothing.
     void prepend_token_prefix(const wcstring &prefix);
 };
 
 /// Sorts and remove any duplicate completions in the completion list, then puts them in priority
-/// order.
-void completions_sort_and_prioritize(std::vector<completion_t> *comps);
+/// order. If count is given, only the first count completions are put in order, and the others
+/// follow in no particular order; that is cheaper when only the best are needed.
+void completions_sort_and_prioritize(std::vector<completion_t> *comps,
+                                     size_t count = static_cast<size_t>(-1));
 
 enum {
     COMPLETION_REQUEST_DEFAULT = 0,
     COMPLETION_REQUEST_AUTOSUGGESTION = 1
                                         << 0,  // indicates the completion is for an autosuggestion
     COMPLETION_REQUEST_DESCRIPTIONS = 1 << 1,  // indicates that we want descriptions
-    COMPLETION_REQUEST_FUZZY_MATCH = 1 << 2    // indicates that we don't require a prefix match
+    COMPLETION_REQUEST_FUZZY_MATCH = 1 << 2,   // indicates that we don't require a prefix match
+    COMPLETION_REQUEST_CANCEL_ON_INPUT = 1 << 3  // stop early if there is input on stdin
 };
 typedef uint32_t completion_request_flags_t;
 
+/// Given the unsorted completions found for a token, narrows them to what a longer token that
+/// starts with it would get from the same candidates, matching like the wildcard code does. Returns
+/// false, leaving comps unchanged, if that can't be worked out for these tokens: only plain words
+/// and long options can be narrowed, since for others (short options, paths, variables, anything
+/// quoted or escaped) the new characters may change which candidates there are.
+bool completions_narrow(std::vector<completion_t> *comps, const wcstring &old_token,
+                        const wcstring &new_token, completion_request_flags_t flags);
+
 enum complete_option_type_t {
     option_type_args_only,    // no option
     option_type_short,        // -x
@@ -145,9 +155,12 @@ enum complete_option_type_t {
 /// \param condition a command to be run to check it this completion should be used. If \c condition
 /// is empty, the completion is always used.
 /// \param flags A set of completion flags
+/// \param cache_ttl If positive, the number of seconds for which the results of evaluating \c comp
+/// are reused, as long as the working directory and the command line before the token are the
+/// same. This is meant for command substitutions that are slow and whose output rarely changes.
 void complete_add(const wchar_t *cmd, bool cmd_is_path, const wcstring &option,
                   complete_option_type_t option_type, int result_mode, const wchar_t *condition,
-                  const wchar_t *comp, const wchar_t *desc, int flags);
+                  const wchar_t *comp, const wchar_t *desc, int flags, int cache_ttl = 0);
 
 /// Remove a previously defined completion.
 void complete_remove(const wcstring &cmd, bool cmd_is_path, const wcstring &option,
@@ -156,12 +169,78 @@ void complete_remove(const wcstring &cmd, bool cmd_is_path, const wcstring &opti
 /// Removes all completions for a given command.
 void complete_remove_all(const wcstring &cmd, bool cmd_is_path);
 
-/// Find all completions of the command cmd, insert them into out.
-void complete(const wcstring &cmd, std::vector<completion_t> *out_comps,
+/// The places completions come from, for profiling.
+enum complete_source_t {
+    complete_source_commands,      // command, function and builtin names
+    complete_source_descriptions,  // descriptions of commands
+    complete_source_loading,       // autoloading completion scripts
+    complete_source_options,       // matching the options of complete entries
+    complete_source_conditions,    // running complete -n conditions
+    complete_source_arguments,     // evaluating complete -a arguments
+    complete_source_files,         // expanding files and directories
+    complete_source_count
+};
+
+/// Returns the name of a source of completions, as shown by complete --profile.
+const wchar_t *complete_source_name(complete_source_t source);
+
+/// The time spent in each source of completions. Time is charged to the innermost source running,
+/// so self_usec adds up to no more than the time taken by the completion, while total_usec includes
+/// the sources that ran inside it (e.g. conditions inside options).
+struct complete_profile_t {
+    struct source_t {
+        uint64_t calls = 0;
+        long long self_usec = 0;
+        long long total_usec = 0;
+    };
+    source_t sources[complete_source_count];
+    /// The time taken by the whole completion.
+    long long total_usec = 0;
+};
+
+/// Find all completions of the command cmd, insert them into out. Returns false if the completion
+/// was cancelled because of COMPLETION_REQUEST_CANCEL_ON_INPUT, in which case out only has some of
+/// them.
+bool complete(const wcstring &cmd, std::vector<completion_t> *out_comps,
               completion_request_flags_t flags);
 
-/// Return a list of all current completions.
-wcstring complete_print();
+/// Like complete(), but also adds the time spent in each source to *profile.
+bool complete(const wcstring &cmd, std::vector<completion_t> *out_comps,
+              completion_request_flags_t flags, complete_profile_t *profile);
+
+/// Print all current completions, as the complete commands that would define them.
+class output_stream_t;
+void complete_print(output_stream_t &out);
+
+/// Returns the counters of the cache used for autoloading completions.
+struct autoload_stats_t;
+autoload_stats_t complete_autoload_stats();
+
+/// Returns the number of commands with completions defined, and approximately how much memory
+/// their options use.
+memory_usage_t complete_memory_usage();
+
+/// Counters describing the cache of completion condition results.
+struct complete_condition_stats_t {
+    /// The number of results in the cache.
+    size_t entries;
+    /// Conditions answered from the cache, and those that had to be run.
+    uint64_t hits;
+    uint64_t misses;
+    /// Times the cache was emptied because variables changed between completions.
+    uint64_t flushes;
+};
+
+/// Returns the counters of the cache of completion condition results.
+complete_condition_stats_t complete_condition_stats();
+
+/// Prefetches the completions for the specified command, and the function it names if any, in the
+/// background.
+void complete_prefetch(const wcstring &cmd);
+
+/// Loads the completions for the specified command, and the function it names if any, unless that
+/// was already tried. Must be called on the main thread.
+void complete_preload(const wcstring &cmd);
 
 /// Tests if the specified option is defined for the specified command.
 int complete_is_valid_option(const wcstring &str, const wcstring &opt,
@@ -176,8 +255,8 @@ bool complete_is_valid_argument(const wcstring &str, const wcstring &opt, const
 /// \param comp The completion string
 /// \param desc The description of the completion
 /// \param flags completion flags
-void append_completion(std::vector<completion_t> *completions, const wcstring &comp,
-                       const wcstring &desc = wcstring(), int flags = 0,
+void append_completion(std::vector<completion_t> *completions, wcstring comp,
+                       wcstring desc = wcstring(), int flags = 0,
                        string_fuzzy_match_t match = string_fuzzy_match_t(fuzzy_match_exact));
 
 /// Function used for testing.
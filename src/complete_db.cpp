@@ -0,0 +1,390 @@
+// A database of completion scripts that only define completions.
+//
+// Most completion scripts do nothing but call `complete` with literal arguments, yet each shell
+// parses and runs them again when it first completes their command. The database records the
+// arguments of those calls, so loading such a script is a matter of looking it up and calling the
+// complete builtin directly. Scripts that do anything else, like define functions or expand
+// variables, are recorded as such and sourced as usual; conditions given to `complete -n` are
+// recorded as text and still run when completing.
+//
+// The database is a file in the data directory, mapped read-only by every shell and rewritten
+// atomically in the background when a script is missing from it or has changed. It starts with a
+// header line, followed by a record for each script. A record is a series of NUL-terminated narrow
+// strings: the path of the script, its modification time and size when it was recorded, "1" if it
+// only calls `complete` and "0" otherwise, and the length of the body that follows. The body holds
+// the calls, each being the number of arguments followed by the arguments.
+#include "config.h"  // IWYU pragma: keep
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "builtin_complete.h"
+#include "common.h"
+#include "complete_db.h"
+#include "env.h"
+#include "expand.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "function.h"
+#include "io.h"
+#include "iothread.h"
+#include "parse_constants.h"
+#include "parse_tree.h"
+#include "parse_util.h"
+#include "parser.h"
+#include "path.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+#define COMPLETE_DB_HEADER "# fish completion database 1\n"
+
+/// Scripts bigger than this are not recorded.
+#define COMPLETE_DB_MAX_SCRIPT_SIZE (1024 * 1024)
+
+/// A recorded script, with its body as offsets into the database.
+struct complete_db_record_t {
+    long long mtime;
+    long long size;
+    bool only_completions;
+    size_t body_offset;
+    size_t body_length;
+};
+
+typedef std::unordered_map<std::string, complete_db_record_t> complete_db_records_t;
+
+/// Reads the NUL-terminated string at *cursor, which must end before end, and moves past it.
+static bool complete_db_read_field(const char **cursor, const char *end, const char **out_str,
+                                   size_t *out_len) {
+    const char *nul = (const char *)memchr(*cursor, '\0', end - *cursor);
+    if (!nul) return false;
+    *out_str = *cursor;
+    *out_len = nul - *cursor;
+    *cursor = nul + 1;
+    return true;
+}
+
+static bool complete_db_read_number(const char **cursor, const char *end, long long *out) {
+    const char *str;
+    size_t len;
+    if (!complete_db_read_field(cursor, end, &str, &len) || len == 0) return false;
+    char *num_end;
+    *out = strtoll(str, &num_end, 10);
+    return num_end == str + len;
+}
+
+/// Finds the records in the given database contents. Returns false if it is malformed.
+static bool complete_db_parse(const char *data, size_t length, complete_db_records_t *out) {
+    const size_t header_len = strlen(COMPLETE_DB_HEADER);
+    if (length < header_len || memcmp(data, COMPLETE_DB_HEADER, header_len) != 0) return false;
+    const char *cursor = data + header_len, *end = data + length;
+    while (cursor < end) {
+        const char *path;
+        size_t path_len;
+        complete_db_record_t record;
+        long long only_completions, body_length;
+        if (!complete_db_read_field(&cursor, end, &path, &path_len) ||
+            !complete_db_read_number(&cursor, end, &record.mtime) ||
+            !complete_db_read_number(&cursor, end, &record.size) ||
+            !complete_db_read_number(&cursor, end, &only_completions) ||
+            !complete_db_read_number(&cursor, end, &body_length) || body_length < 0 ||
+            body_length > end - cursor) {
+            return false;
+        }
+        record.only_completions = only_completions != 0;
+        record.body_offset = cursor - data;
+        record.body_length = (size_t)body_length;
+        (*out)[std::string(path, path_len)] = record;
+        cursor += body_length;
+    }
+    return true;
+}
+
+static wcstring complete_db_path() {
+    wcstring path;
+    if (!path_get_data(path)) return wcstring();
+    return path + L"/completion_database";
+}
+
+namespace {
+/// The mapped database.
+class complete_db_t {
+   public:
+    const char *data = NULL;
+    size_t length = 0;
+    complete_db_records_t records;
+    /// The identity of the file, to notice when it is replaced.
+    dev_t dev = 0;
+    ino_t ino = 0;
+    time_t mtime = 0;
+
+    complete_db_t() = default;
+    complete_db_t(const complete_db_t &) = delete;
+    void operator=(const complete_db_t &) = delete;
+    ~complete_db_t() {
+        if (data) munmap((void *)data, length);
+    }
+
+    /// Maps the database at the given path, returning NULL if it is missing or malformed.
+    static std::unique_ptr<complete_db_t> open(const wcstring &path) {
+        int fd = wopen_cloexec(path, O_RDONLY);
+        if (fd < 0) return NULL;
+        struct stat buf;
+        if (fstat(fd, &buf) != 0 || buf.st_size <= 0) {
+            close(fd);
+            return NULL;
+        }
+        void *map = mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return NULL;
+
+        std::unique_ptr<complete_db_t> result(new complete_db_t());
+        result->data = (const char *)map;
+        result->length = (size_t)buf.st_size;
+        result->dev = buf.st_dev;
+        result->ino = buf.st_ino;
+        result->mtime = buf.st_mtime;
+        if (!complete_db_parse(result->data, result->length, &result->records)) return NULL;
+        return result;
+    }
+};
+
+/// State of the database, only used on the main thread.
+struct complete_db_state_t {
+    std::unique_ptr<complete_db_t> db;
+    /// Scripts we asked to have recorded, with their modification times, so that we ask only once
+    /// for each version of a script.
+    std::unordered_set<wcstring> requested;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+}  // anonymous namespace
+
+static complete_db_state_t s_complete_db;
+
+/// Serializes rewriting the database within this shell.
+static std::mutex s_complete_db_write_lock;
+
+/// Returns whether the given argument is a literal: expanding it would give the argument as it is
+/// unescaped. If so, sets *out to it.
+static bool complete_db_literal_argument(const wcstring &arg, wcstring *out) {
+    wchar_t *begin = NULL, *end = NULL;
+    if (parse_util_locate_cmdsubst(arg.c_str(), &begin, &end, true) != 0) return false;
+    wcstring unescaped;
+    if (!unescape_string(arg, &unescaped, UNESCAPE_SPECIAL)) return false;
+    // Quotes leave separators behind, which expansion removes.
+    out->clear();
+    for (wchar_t c : unescaped) {
+        if (c == INTERNAL_SEPARATOR) continue;
+        if (c == L'\0' || (c >= RESERVED_CHAR_BASE && c < RESERVED_CHAR_END)) return false;
+        out->push_back(c);
+    }
+    return true;
+}
+
+/// Appends the calls to `complete` that make up the given script to body. Returns false if the
+/// script does anything else.
+static bool complete_db_compile(const wcstring &src, std::string *body) {
+    parse_node_tree_t tree;
+    if (!parse_tree_from_string(src, parse_flag_none, &tree, NULL) || tree.empty()) return false;
+
+    const parse_node_t *job_list = &tree.at(0);
+    const parse_node_t *job;
+    while ((job = tree.next_node_in_node_list(*job_list, symbol_job, &job_list))) {
+        if (tree.job_should_be_backgrounded(*job)) return false;
+        const parse_node_tree_t::parse_node_list_t statements =
+            tree.specific_statements_for_job(*job);
+        if (statements.size() != 1 || statements.at(0)->type != symbol_decorated_statement) {
+            return false;
+        }
+        const parse_node_t &plain_statement =
+            tree.find_child(*statements.at(0), symbol_plain_statement);
+        wcstring cmd;
+        if (tree.decoration_for_plain_statement(plain_statement) !=
+                parse_statement_decoration_none ||
+            !tree.command_for_plain_statement(plain_statement, src, &cmd) || cmd != L"complete" ||
+            !tree.find_nodes(plain_statement, symbol_redirection, 1).empty()) {
+            return false;
+        }
+
+        // Without arguments, complete prints the completions rather than define any.
+        const parse_node_tree_t::parse_node_list_t args =
+            tree.find_nodes(plain_statement, symbol_argument);
+        if (args.empty()) return false;
+        body->append(std::to_string(args.size() + 1));
+        body->push_back('\0');
+        body->append("complete");
+        body->push_back('\0');
+        for (const parse_node_t *arg : args) {
+            wcstring literal;
+            if (!complete_db_literal_argument(arg->get_source(src), &literal)) return false;
+            body->append(wcs2string(literal));
+            body->push_back('\0');
+        }
+    }
+    return true;
+}
+
+/// Reads the script at the given path, returning false if it is too big or cannot be read.
+static bool complete_db_read_script(const wcstring &path, const struct stat &buf,
+                                    wcstring *out_src) {
+    if (buf.st_size > COMPLETE_DB_MAX_SCRIPT_SIZE) return false;
+    int fd = wopen_cloexec(path, O_RDONLY);
+    if (fd < 0) return false;
+    std::string narrow((size_t)buf.st_size, '\0');
+    bool ok = read_loop(fd, &narrow[0], narrow.size()) == (ssize_t)narrow.size();
+    close(fd);
+    if (ok) *out_src = str2wcstring(narrow);
+    return ok;
+}
+
+/// Records the script at the given path in the database, replacing it atomically. Records of
+/// scripts that no longer exist are dropped. Background threads only.
+static void complete_db_record(const wcstring &db_path, const wcstring &path) {
+    ASSERT_IS_BACKGROUND_THREAD();
+    struct stat buf;
+    wcstring src;
+    // A script changed within the current second may change again without its time changing.
+    if (wstat(path, &buf) != 0 || buf.st_mtime >= time(NULL) ||
+        !complete_db_read_script(path, buf, &src)) {
+        return;
+    }
+    std::string body;
+    const bool only_completions = complete_db_compile(src, &body);
+    if (!only_completions) body.clear();
+
+    scoped_lock locker(s_complete_db_write_lock);
+    std::string old_contents;
+    int fd = wopen_cloexec(db_path, O_RDONLY);
+    if (fd >= 0) {
+        char chunk[4096];
+        ssize_t amt;
+        while ((amt = read_loop(fd, chunk, sizeof chunk)) > 0) old_contents.append(chunk, amt);
+        close(fd);
+    }
+    complete_db_records_t old_records;
+    if (!complete_db_parse(old_contents.data(), old_contents.size(), &old_records)) {
+        old_records.clear();
+    }
+
+    const std::string narrow_path = wcs2string(path);
+    std::string contents = COMPLETE_DB_HEADER;
+    auto append_record = [&](const std::string &record_path, long long mtime, long long size,
+                             bool only, const char *record_body, size_t body_length) {
+        contents.append(record_path);
+        contents.push_back('\0');
+        for (long long num : {mtime, size, (long long)only, (long long)body_length}) {
+            contents.append(std::to_string(num));
+            contents.push_back('\0');
+        }
+        contents.append(record_body, body_length);
+    };
+    for (const auto &entry : old_records) {
+        struct stat old_buf;
+        if (entry.first == narrow_path || stat(entry.first.c_str(), &old_buf) != 0) continue;
+        const complete_db_record_t &record = entry.second;
+        append_record(entry.first, record.mtime, record.size, record.only_completions,
+                      old_contents.data() + record.body_offset, record.body_length);
+    }
+    append_record(narrow_path, (long long)buf.st_mtime, (long long)buf.st_size, only_completions,
+                  body.data(), body.size());
+
+    std::string narrow_tmp = wcs2string(db_path + L".XXXXXX");
+    fd = fish_mkstemp_cloexec(&narrow_tmp[0]);
+    if (fd < 0) return;
+    const wcstring tmp_path = str2wcstring(narrow_tmp);
+    bool ok = write_loop(fd, contents.data(), contents.size()) >= 0;
+    close(fd);
+    if (!ok || wrename(tmp_path, db_path) == -1) {
+        debug(2, L"Error %d when writing completion database", errno);
+        wunlink(tmp_path);
+    }
+}
+
+/// Maps the database again if it was replaced since we last mapped it.
+static void complete_db_refresh(complete_db_state_t &state, const wcstring &db_path) {
+    struct stat buf;
+    if (wstat(db_path, &buf) != 0) {
+        state.db.reset();
+    } else if (!state.db || state.db->dev != buf.st_dev || state.db->ino != buf.st_ino ||
+               state.db->mtime != buf.st_mtime || state.db->length != (size_t)buf.st_size) {
+        state.db = complete_db_t::open(db_path);
+    }
+}
+
+/// Calls the complete builtin for each call in the given body.
+static void complete_db_run(const char *body, size_t length) {
+    parser_t &parser = parser_t::principal_parser();
+    const char *cursor = body, *end = body + length;
+    while (cursor < end) {
+        long long argc;
+        if (!complete_db_read_number(&cursor, end, &argc)) return;
+        wcstring_list_t args;
+        for (long long i = 0; i < argc; i++) {
+            const char *arg;
+            size_t arg_len;
+            if (!complete_db_read_field(&cursor, end, &arg, &arg_len)) return;
+            args.push_back(str2wcstring(arg, arg_len));
+        }
+        null_terminated_array_t<wchar_t> argv(args);
+        io_streams_t streams(0);
+        builtin_complete(parser, streams, const_cast<wchar_t **>(argv.get()));
+        if (!streams.out.empty()) fwprintf(stdout, L"%ls", streams.out.buffer().c_str());
+        if (!streams.err.empty()) fwprintf(stderr, L"%ls", streams.err.buffer().c_str());
+    }
+}
+
+bool complete_db_load(const wcstring &path) {
+    ASSERT_IS_MAIN_THREAD();
+    complete_db_state_t &state = s_complete_db;
+    const wcstring db_path = complete_db_path();
+    struct stat buf;
+    // A function named complete would take the place of the builtin when sourcing.
+    if (db_path.empty() || wstat(path, &buf) != 0 ||
+        function_exists_no_autoload(L"complete", env_vars_snapshot_t::current())) {
+        return false;
+    }
+
+    complete_db_refresh(state, db_path);
+    const complete_db_record_t *record = NULL;
+    if (state.db) {
+        auto where = state.db->records.find(wcs2string(path));
+        if (where != state.db->records.end() && where->second.mtime == (long long)buf.st_mtime &&
+            where->second.size == (long long)buf.st_size) {
+            record = &where->second;
+        }
+    }
+
+    if (record && record->only_completions) {
+        state.hits++;
+        complete_db_run(state.db->data + record->body_offset, record->body_length);
+        return true;
+    }
+    state.misses++;
+    if (!record && state.requested.insert(path + L"\n" + to_string((long)buf.st_mtime)).second) {
+        iothread_perform([=]() { complete_db_record(db_path, path); });
+    }
+    return false;
+}
+
+complete_db_stats_t complete_db_stats() {
+    ASSERT_IS_MAIN_THREAD();
+    const complete_db_state_t &state = s_complete_db;
+    complete_db_stats_t stats;
+    stats.entries = state.db ? state.db->records.size() : 0;
+    stats.hits = state.hits;
+    stats.misses = state.misses;
+    return stats;
+}
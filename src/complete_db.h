@@ -0,0 +1,28 @@
+// A database of completion scripts that only define completions, shared by all shells of a user.
+#ifndef FISH_COMPLETE_DB_H
+#define FISH_COMPLETE_DB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/// Load the completion script at the given path from the database, by running the `complete`
+/// commands recorded for it rather than sourcing it. Returns false if the script must be sourced,
+/// because it is not in the database, has changed since it was recorded, or does more than call
+/// `complete` with literal arguments. Scripts not in the database are then recorded in the
+/// background. Main thread only.
+bool complete_db_load(const wcstring &path);
+
+/// Counters describing how well the database is working.
+struct complete_db_stats_t {
+    /// The number of scripts recorded.
+    size_t entries;
+    /// Scripts loaded from the database, and those that had to be sourced.
+    uint64_t hits;
+    uint64_t misses;
+};
+
+complete_db_stats_t complete_db_stats();
+
+#endif
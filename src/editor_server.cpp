@@ -0,0 +1,180 @@
+// Answers completion, highlighting and indentation requests from editors over a pipe. Everything
+// fish loads while answering, like completions and autoloaded functions, stays loaded for the next
+// request, so only the first one pays for it.
+#include "config.h"  // IWYU pragma: keep
+
+#include <stddef.h>
+#include <wchar.h>
+
+#include <string>
+#include <vector>
+
+#include "builtin_complete.h"
+#include "common.h"
+#include "editor_server.h"
+#include "env.h"
+#include "fallback.h"  // IWYU pragma: keep
+#include "highlight.h"
+#include "iothread.h"
+#include "parse_util.h"
+#include "proc.h"
+#include "wutil.h"  // IWYU pragma: keep
+
+/// Undo the escaping of a request: two backslashes are one, and a backslash and 'n' a newline.
+static wcstring server_unescape(const wcstring &text) {
+    wcstring result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        wchar_t c = text.at(i);
+        if (c == L'\\' && i + 1 < text.size()) {
+            c = text.at(++i);
+            if (c == L'n') c = L'\n';
+        }
+        result.push_back(c);
+    }
+    return result;
+}
+
+/// Append a line of the response to out, escaped like requests are.
+static void server_append_line(const wcstring &line, wcstring *out) {
+    for (wchar_t c : line) {
+        if (c == L'\\') {
+            out->append(L"\\\\");
+        } else if (c == L'\n') {
+            out->append(L"\\n");
+        } else {
+            out->push_back(c);
+        }
+    }
+    out->push_back(L'\n');
+}
+
+/// Return the name of the fish_color_ variable for the given highlighting, without that prefix.
+static const wchar_t *server_role_name(highlight_spec_t spec) {
+    switch (highlight_get_primary(spec)) {
+        case highlight_spec_error: {
+            return L"error";
+        }
+        case highlight_spec_command: {
+            return L"command";
+        }
+        case highlight_spec_statement_terminator: {
+            return L"end";
+        }
+        case highlight_spec_param: {
+            return L"param";
+        }
+        case highlight_spec_comment: {
+            return L"comment";
+        }
+        case highlight_spec_match: {
+            return L"match";
+        }
+        case highlight_spec_search_match: {
+            return L"search_match";
+        }
+        case highlight_spec_operator: {
+            return L"operator";
+        }
+        case highlight_spec_escape: {
+            return L"escape";
+        }
+        case highlight_spec_quote: {
+            return L"quote";
+        }
+        case highlight_spec_redirection: {
+            return L"redirection";
+        }
+        default: { return L"normal"; }
+    }
+}
+
+static void server_highlight(const wcstring &text, wcstring *out) {
+    // Highlighting may block on the file system, so it only runs on background threads.
+    std::vector<highlight_spec_t> colors;
+    const env_vars_snapshot_t vars(env_vars_snapshot_t::highlighting_keys);
+    iothread_perform([&]() { highlight_shell(text, colors, text.size(), NULL, vars); });
+    iothread_drain_all();
+    size_t start = 0;
+    while (start < colors.size()) {
+        size_t end = start + 1;
+        while (end < colors.size() && colors.at(end) == colors.at(start)) end++;
+        wcstring line =
+            format_string(L"%lu %lu %ls", (unsigned long)start, (unsigned long)(end - start),
+                          server_role_name(colors.at(start)));
+        if (colors.at(start) & highlight_modifier_valid_path) line.append(L" valid_path");
+        server_append_line(line, out);
+        start = end;
+    }
+}
+
+static void server_indent(const wcstring &text, wcstring *out) {
+    const std::vector<int> indents = parse_util_compute_indents(text);
+    size_t line_start = 0;
+    for (;;) {
+        // A line after the last newline takes the indentation of that newline.
+        int indent = 0;
+        if (line_start < indents.size()) {
+            indent = indents.at(line_start);
+        } else if (!indents.empty()) {
+            indent = indents.back();
+        }
+        server_append_line(to_string(indent), out);
+
+        size_t newline = text.find(L'\n', line_start);
+        if (newline == wcstring::npos) break;
+        line_start = newline + 1;
+    }
+}
+
+/// Answer a request, appending the response to out.
+static void server_handle_request(const wcstring &request, wcstring *out) {
+    size_t space = request.find(L' ');
+    const wcstring verb = request.substr(0, space);
+    const wcstring text =
+        space == wcstring::npos ? wcstring() : server_unescape(request.substr(space + 1));
+
+    if (verb == L"complete") {
+        for (const wcstring &line : builtin_complete_do_complete(text)) {
+            server_append_line(line, out);
+        }
+    } else if (verb == L"highlight") {
+        server_highlight(text, out);
+    } else if (verb == L"indent") {
+        server_indent(text, out);
+    } else {
+        server_append_line(format_string(L"error: unknown request '%ls'", verb.c_str()), out);
+    }
+    out->push_back(L'\n');
+}
+
+int editor_server_run(int in_fd, int out_fd) {
+    std::string pending;
+    char buff[4096];
+    for (;;) {
+        size_t newline = pending.find('\n');
+        if (newline == std::string::npos) {
+            ssize_t amt = read_loop(in_fd, buff, sizeof buff);
+            if (amt < 0) {
+                wperror(L"read");
+                return 1;
+            }
+            if (amt == 0) break;
+            pending.append(buff, amt);
+            continue;
+        }
+
+        const wcstring request = str2wcstring(pending.substr(0, newline));
+        pending.erase(0, newline + 1);
+        wcstring response;
+        server_handle_request(request, &response);
+        job_reap(false);
+
+        const std::string narrow = wcs2string(response);
+        if (write_loop(out_fd, narrow.data(), narrow.size()) < 0) {
+            wperror(L"write");
+            return 1;
+        }
+    }
+    return 0;
+}
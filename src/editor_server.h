@@ -0,0 +1,22 @@
+// Answers completion, highlighting and indentation requests from editors over a pipe, so that they
+// need not start a fish for each request.
+#ifndef FISH_EDITOR_SERVER_H
+#define FISH_EDITOR_SERVER_H
+
+/// Read requests from in_fd and write the responses to out_fd until in_fd reaches end of file. Each
+/// request is a line holding a verb, a space, and the text to work on. Each response is any number
+/// of lines, followed by an empty line. In both, a backslash is written as two backslashes and a
+/// newline as a backslash followed by 'n'. The verbs are:
+///
+/// complete TEXT:  the completions of TEXT as a command line, as `complete --do-complete` prints
+///                 them.
+/// highlight TEXT: a line "START LENGTH ROLE" for each run of characters of TEXT highlighted the
+///                 same way, with START and LENGTH in characters. ROLE is the name of the
+///                 fish_color_ variable used to color the run, without that prefix, followed by
+///                 " valid_path" if the run is a path that exists.
+/// indent TEXT:    the indentation level of each line of TEXT, one number per line.
+///
+/// Any other request is answered with a line starting with "error: ". Returns the exit status.
+int editor_server_run(int in_fd, int out_fd);
+
+#endif
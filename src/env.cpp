@@ -10,7 +10,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -30,6 +34,9 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <map>
 #include <set>
 #include <type_traits>
 #include <unordered_map>
@@ -48,12 +55,14 @@
 #include "history.h"
 #include "input.h"
 #include "input_common.h"
+#include "kill.h"
 #include "output.h"
 #include "path.h"
 #include "proc.h"
 #include "reader.h"
 #include "sanity.h"
 #include "screen.h"
+#include "trace.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 #define DEFAULT_TERM1 "ansi"
@@ -153,12 +162,35 @@ class env_node_t {
     /// Does this node contain any variables which are exported to subshells
     /// or does it redefine any variables to not be exported?
     bool exportv = false;
+    /// The number of variables in env that are exported.
+    size_t export_count = 0;
     /// Pointer to next level.
     std::unique_ptr<env_node_t> next;
+    /// The entries of env sorted by name, for listing the names without sorting them each time.
+    /// Pointers to entries stay valid until they are erased, so this must be sorted again only
+    /// when a variable is added or removed.
+    std::vector<const var_table_t::value_type *> sorted_entries;
+    bool sorted_entries_stale = true;
 
     maybe_t<env_var_t> find_entry(const wcstring &key);
+
+    /// Return the entries of env sorted by name.
+    const std::vector<const var_table_t::value_type *> &get_sorted_entries();
 };
 
+const std::vector<const var_table_t::value_type *> &env_node_t::get_sorted_entries() {
+    if (sorted_entries_stale) {
+        sorted_entries.clear();
+        for (const auto &entry : env) sorted_entries.push_back(&entry);
+        std::sort(sorted_entries.begin(), sorted_entries.end(),
+                  [](const var_table_t::value_type *a, const var_table_t::value_type *b) {
+                      return a->first < b->first;
+                  });
+        sorted_entries_stale = false;
+    }
+    return sorted_entries;
+}
+
 class variable_entry_t {
     wcstring value; /**< Value of the variable */
 };
@@ -167,10 +199,15 @@ static std::mutex env_lock;
 
 static bool local_scope_exports(const env_node_t *n);
 
+// Incremented whenever a variable may have changed, so that we know when snapshots are stale.
+// This is only modified on the main thread, but may be read from any thread.
+static std::atomic<uint64_t> s_env_change_count{0};
+
 // A class wrapping up a variable stack
 // Currently there is only one variable stack in fish,
 // but we can imagine having separate (linked) stacks
 // if we introduce multiple threads of execution
+
 struct var_stack_t {
     // Top node on the function stack.
     std::unique_ptr<env_node_t> top = NULL;
@@ -179,12 +216,31 @@ struct var_stack_t {
     // This is an observer pointer
     env_node_t *global_env = NULL;
 
+    // Popped nodes kept for reuse, so that function calls don't allocate a node and its table.
+    std::vector<std::unique_ptr<env_node_t>> free_nodes;
+    static const size_t max_free_nodes = 32;
+
     // Exported variable array used by execv.
     null_terminated_array_t<char> export_array;
 
     /// Flag for checking if we need to regenerate the exported variable array.
     bool has_changed_exported = true;
     void mark_changed_exported() { has_changed_exported = true; }
+
+    /// Exported variables that may have changed since we last generated the array. If
+    /// has_changed_exported is set, everything is regenerated anyways.
+    std::set<wcstring> changed_exported_vars;
+    void mark_changed_exported(const wcstring &key) {
+        if (!has_changed_exported) changed_exported_vars.insert(key);
+    }
+    bool exports_changed() const { return has_changed_exported || !changed_exported_vars.empty(); }
+
+    /// The "key=value" strings of the exported array, by variable name.
+    std::map<wcstring, std::string> export_strings;
+
+    // Returns the variable that would be exported for the given key, if any.
+    maybe_t<env_var_t> get_exported_var(const wcstring &key) const;
+
     void update_export_array_if_necessary();
 
     var_stack_t() : top(new env_node_t(false)) { this->global_env = this->top.get(); }
@@ -209,16 +265,26 @@ struct var_stack_t {
 };
 
 void var_stack_t::push(bool new_scope) {
-    std::unique_ptr<env_node_t> node(new env_node_t(new_scope));
+    s_env_change_count++;
+    std::unique_ptr<env_node_t> node;
+    if (free_nodes.empty()) {
+        node.reset(new env_node_t(new_scope));
+    } else {
+        node = std::move(free_nodes.back());
+        free_nodes.pop_back();
+        node->new_scope = new_scope;
+    }
 
     // Copy local-exported variables.
     auto top_node = top.get();
     // Only if we introduce a new shadowing scope; i.e. not if it's just `begin; end` or
     // "--no-scope-shadowing".
-    if (new_scope && top_node != this->global_env) {
+    if (new_scope && top_node != this->global_env && top_node->export_count > 0) {
         for (auto &var : top_node->env) {
             if (var.second.exportv) node->env.insert(var);
         }
+        node->sorted_entries_stale = true;
+        node->export_count = top_node->export_count;
     }
 
     node->next = std::move(this->top);
@@ -230,13 +296,15 @@ void var_stack_t::push(bool new_scope) {
 
 /// Return true if one of the vars in the passed list was changed in the current var scope.
 bool var_stack_t::var_changed(const wcstring_list_t &vars) {
-    for (auto v : vars) {
+    if (top->env.empty()) return false;
+    for (const auto &v : vars) {
         if (top->env.find(v) != top->env.end()) return true;
     }
     return false;
 }
 
 void var_stack_t::pop() {
+    s_env_change_count++;
     // Don't pop the top-most, global, level.
     if (top.get() == this->global_env) {
         debug(0, _(L"Tried to pop empty environment stack."));
@@ -262,12 +330,15 @@ void var_stack_t::pop() {
     assert(this->top && old_top && !old_top->next);
     assert(this->top != NULL);
 
-    for (const auto &entry_pair : old_top->env) {
-        const env_var_t &var = entry_pair.second;
-        if (var.exportv) {
-            this->mark_changed_exported();
-            break;
-        }
+    if (old_top->export_count > 0) this->mark_changed_exported();
+
+    // Keep the node for the next push. Clearing the table keeps its buckets around.
+    if (free_nodes.size() < max_free_nodes) {
+        old_top->env.clear();
+        old_top->sorted_entries_stale = true;
+        old_top->exportv = false;
+        old_top->export_count = 0;
+        free_nodes.push_back(std::move(old_top));
     }
 
     if (locale_changed) init_locale();
@@ -322,7 +393,7 @@ static bool is_read_only(const wcstring &key) {
     return env_read_only.find(key) != env_read_only.end();
 }
 
-bool env_var_t::read_only() const { return is_read_only(name); }
+bool env_var_t::read_only() const { return is_read_only(contents->name); }
 
 /// Table of variables whose value is dynamically calculated, such as umask, status, etc.
 static const_string_set_t env_electric;
@@ -589,7 +660,7 @@ static void init_curses() {
     term_has_xn = tigetflag((char *)"xenl") == 1;  // does terminal have the eat_newline_glitch
     update_fish_color_support();
     // Invalidate the cached escape sequences since they may no longer be valid.
-    cached_esc_sequences.clear();
+    screen_forget_terminal_sequences();
     curses_initialized = true;
 }
 
@@ -600,6 +671,14 @@ static bool variable_is_colon_delimited_var(const wcstring &str) {
     return contains(colon_delimited_variable, str);
 }
 
+/// Return whether setting the given variable has a side effect in `react_to_variable_change()`.
+static bool variable_has_reaction(const wcstring &key) {
+    if (!env_initialized) return false;
+    return var_dispatch_table.find(key) != var_dispatch_table.end() ||
+           string_prefixes_string(L"_fish_abbr_", key) ||
+           string_prefixes_string(L"fish_color_", key);
+}
+
 /// React to modifying the given variable.
 static void react_to_variable_change(const wchar_t *op, const wcstring &key) {
     // Don't do any of this until `env_init()` has run. We only want to do this in response to
@@ -619,10 +698,28 @@ static void react_to_variable_change(const wchar_t *op, const wcstring &key) {
     }
 }
 
+/// Fire the event for the variable with the given name having been changed by \p op ("SET" or
+/// "ERASE"). When no handler listens for the variable the event is not built at all, and only
+/// pending signal events are dispatched, as firing it would have done.
+static void fire_variable_event(const wcstring &key, const wchar_t *op) {
+    if (!event_is_variable_observed(key)) {
+        event_fire(NULL);
+        return;
+    }
+
+    event_t ev = event_t::variable_event(key);
+    ev.arguments.reserve(3);
+    ev.arguments.push_back(L"VARIABLE");
+    ev.arguments.push_back(op);
+    ev.arguments.push_back(key);
+    event_fire(&ev);
+}
+
 /// Universal variable callback function. This function makes sure the proper events are triggered
 /// when an event occurs.
 static void universal_callback(fish_message_type_t type, const wchar_t *name) {
     const wchar_t *op;
+    s_env_change_count++;
 
     switch (type) {
         case SET:
@@ -637,13 +734,9 @@ static void universal_callback(fish_message_type_t type, const wchar_t *name) {
     }
 
     react_to_variable_change(op, name);
-    vars_stack().mark_changed_exported();
+    vars_stack().mark_changed_exported(name);
 
-    event_t ev = event_t::variable_event(name);
-    ev.arguments.push_back(L"VARIABLE");
-    ev.arguments.push_back(op);
-    ev.arguments.push_back(name);
-    event_fire(&ev);
+    fire_variable_event(name, op);
 }
 
 /// Make sure the PATH variable contains something.
@@ -691,6 +784,81 @@ void env_set_read_limit() {
     }
 }
 
+/// Allow the user to override the limit on how much memory each history uses for caching.
+void env_set_history_memory_limit() {
+    auto limit_var = env_get(L"fish_history_memory_limit");
+    if (limit_var.missing_or_empty()) {
+        history_memory_limit = HISTORY_MEMORY_LIMIT;
+    } else {
+        size_t limit = fish_wcstoull(limit_var->as_string().c_str());
+        if (errno) {
+            debug(1, "Ignoring fish_history_memory_limit since it is not valid");
+        } else {
+            history_memory_limit = limit;
+        }
+    }
+}
+
+/// Allow the user to have history files compressed when they are rewritten.
+void env_set_history_compression() {
+    auto level_var = env_get(L"fish_history_compression");
+    if (level_var.missing_or_empty()) {
+        history_compression_level = 0;
+    } else {
+        int level = fish_wcstoi(level_var->as_string().c_str());
+        if (errno || level < 0 || level > 9) {
+            debug(1, "Ignoring fish_history_compression since it is not a level from 0 to 9");
+        } else {
+            history_compression_level = level;
+        }
+    }
+}
+
+/// Allow the user to override the limit on how many arguments one argument may expand to.
+void env_set_expand_limit() {
+    auto limit_var = env_get(L"fish_expand_limit");
+    if (limit_var.missing_or_empty()) {
+        expand_argument_limit = EXPAND_ARGUMENT_LIMIT;
+    } else {
+        size_t limit = fish_wcstoull(limit_var->as_string().c_str());
+        if (errno) {
+            debug(1, "Ignoring fish_expand_limit since it is not valid");
+        } else {
+            expand_argument_limit = limit;
+        }
+    }
+}
+
+/// Allow the user to override how many entries the kill ring keeps.
+void env_set_kill_ring_limit() {
+    auto limit_var = env_get(L"fish_kill_ring_limit");
+    if (limit_var.missing_or_empty()) {
+        kill_set_capacity(KILL_RING_CAPACITY);
+    } else {
+        size_t limit = fish_wcstoull(limit_var->as_string().c_str());
+        if (errno || limit == 0) {
+            debug(1, "Ignoring fish_kill_ring_limit since it is not valid");
+        } else {
+            kill_set_capacity(limit);
+        }
+    }
+}
+
+/// Allow the user to override how often `jobs` samples the cpu time of processes.
+void env_set_jobs_cpu_interval() {
+    auto interval_var = env_get(L"fish_jobs_cpu_interval_ms");
+    if (interval_var.missing_or_empty()) {
+        jiffies_sample_interval_ms = JIFFIES_SAMPLE_INTERVAL_MS;
+    } else {
+        long interval = fish_wcstol(interval_var->as_string().c_str());
+        if (errno || interval < 0) {
+            debug(1, "Ignoring fish_jobs_cpu_interval_ms since it is not valid");
+        } else {
+            jiffies_sample_interval_ms = interval;
+        }
+    }
+}
+
 wcstring env_get_pwd_slash(void) {
     auto pwd_var = env_get(L"PWD");
     if (pwd_var.missing_or_empty()) {
@@ -760,10 +928,55 @@ static void env_universal_callbacks(callback_data_list_t &callbacks) {
     }
 }
 
+// Whether this shell changed universal variables without writing them out yet. Rather than syncing
+// after every change, we write them all out at the next barrier, at the latest before running an
+// external command or the prompt, or exiting.
+static bool s_uvars_need_sync = false;
+static env_universal_sync_stats_t s_uvar_sync_stats;
+
+static void env_universal_defer_sync() {
+    s_uvars_need_sync = true;
+    s_uvar_sync_stats.deferred_changes++;
+}
+
+// Returns true unless the notifier can vouch that no other process changed the variables file
+// since we last looked. This drains any pending notification.
+static bool universal_notifier_may_have_changed() {
+    universal_notifier_t &notifier = universal_notifier_t::default_notifier();
+    int fd = notifier.notification_fd();
+    if (fd < 0 || !notifier.notification_fd_reports_all_changes()) return true;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval tv = {0, 0};
+    int ret = select(fd + 1, &fds, NULL, NULL, &tv);
+    if (ret < 0) return true;
+    return ret > 0 && notifier.notification_fd_became_readable(fd);
+}
+
+env_universal_sync_stats_t env_universal_sync_stats() { return s_uvar_sync_stats; }
+
+void env_universal_flush() {
+    if (s_uvars_need_sync) env_universal_barrier();
+}
+
+void env_universal_barrier_if_needed() {
+    if (!uvars()) return;
+    if (!s_uvars_need_sync && !universal_notifier_may_have_changed()) {
+        s_uvar_sync_stats.skipped_barriers++;
+        return;
+    }
+    env_universal_barrier();
+}
+
 void env_universal_barrier() {
     ASSERT_IS_MAIN_THREAD();
     if (!uvars()) return;
 
+    s_uvars_need_sync = false;
+    s_uvar_sync_stats.syncs++;
+
     callback_data_list_t callbacks;
     bool changed = uvars()->sync(callbacks);
     if (changed) {
@@ -798,6 +1011,42 @@ static void handle_read_limit_change(const wcstring &op, const wcstring &var_nam
     env_set_read_limit();
 }
 
+static void handle_history_memory_limit_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    UNUSED(var_name);
+    env_set_history_memory_limit();
+}
+
+static void handle_history_compression_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    UNUSED(var_name);
+    env_set_history_compression();
+}
+
+static void handle_expand_limit_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    UNUSED(var_name);
+    env_set_expand_limit();
+}
+
+static void handle_kill_ring_limit_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    UNUSED(var_name);
+    env_set_kill_ring_limit();
+}
+
+static void handle_jobs_cpu_interval_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    UNUSED(var_name);
+    env_set_jobs_cpu_interval();
+}
+
+static void handle_coalesce_variable_events_change(const wcstring &op, const wcstring &var_name) {
+    UNUSED(op);
+    auto coalesce_var = env_get(var_name);
+    event_set_coalesce_variables(!coalesce_var.missing_or_empty());
+}
+
 static void handle_fish_history_change(const wcstring &op, const wcstring &var_name) {
     UNUSED(op);
     UNUSED(var_name);
@@ -847,7 +1096,14 @@ static void setup_var_dispatch_table() {
     var_dispatch_table.emplace(L"LINES", handle_term_size_change);
     var_dispatch_table.emplace(L"COLUMNS", handle_term_size_change);
     var_dispatch_table.emplace(L"fish_read_limit", handle_read_limit_change);
+    var_dispatch_table.emplace(L"fish_history_memory_limit", handle_history_memory_limit_change);
+    var_dispatch_table.emplace(L"fish_history_compression", handle_history_compression_change);
+    var_dispatch_table.emplace(L"fish_expand_limit", handle_expand_limit_change);
+    var_dispatch_table.emplace(L"fish_kill_ring_limit", handle_kill_ring_limit_change);
+    var_dispatch_table.emplace(L"fish_jobs_cpu_interval_ms", handle_jobs_cpu_interval_change);
     var_dispatch_table.emplace(L"fish_history", handle_fish_history_change);
+    var_dispatch_table.emplace(L"fish_coalesce_variable_events",
+                               handle_coalesce_variable_events_change);
     var_dispatch_table.emplace(L"TZ", handle_tz_change);
 }
 
@@ -910,7 +1166,9 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
 
     init_locale();
     init_curses();
-    init_input();
+    // Key bindings and terminfo key names are only needed to read from the terminal, which
+    // non-interactive shells rarely do; the input subsystem initializes itself on first use.
+    if (is_interactive_session) init_input();
     init_path_vars();
 
     // Set up the USER and PATH variables
@@ -982,6 +1240,11 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
     env_set_pwd();         // initialize the PWD variable
     env_set_termsize();    // initialize the terminal size variables
     env_set_read_limit();  // initialize the read_byte_limit
+    env_set_history_memory_limit();  // initialize the history_memory_limit
+    env_set_history_compression();   // initialize the history_compression_level
+    env_set_expand_limit();          // initialize the expand_argument_limit
+    env_set_kill_ring_limit();       // initialize the kill ring's capacity
+    env_set_jobs_cpu_interval();     // initialize the jiffies_sample_interval_ms
 
     // Set g_use_posix_spawn. Default to true.
     auto use_posix_spawn = env_get(L"fish_use_posix_spawn");
@@ -997,8 +1260,10 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
     // `react_to_variable_change()` would do for that var.
     env_initialized = true;
 
-    // Set up universal variables. The empty string means to use the default path.
+    // Set up universal variables. The empty string means to use the default path. Set up the
+    // notifier first, so that it reports any changes made after we load.
     assert(s_universal_variables == NULL);
+    universal_notifier_t::default_notifier();
     s_universal_variables = new env_universal_t(L"");
     callback_data_list_t callbacks;
     s_universal_variables->load(callbacks);
@@ -1051,7 +1316,9 @@ static int set_umask(const wcstring_list_t &list_val) {
 /// * ENV_INVALID, the variable value was invalid. This applies only to special variables.
 static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcstring_list_t val) {
     ASSERT_IS_MAIN_THREAD();
-    bool has_changed_old = vars_stack().has_changed_exported;
+    FISH_TRACE2(env_set, key.c_str(), var_mode);
+    s_env_change_count++;
+    bool has_changed_old = vars_stack().exports_changed();
     int done = 0;
 
     if (val.size() == 1 && (key == L"PWD" || key == L"HOME")) {
@@ -1093,9 +1360,9 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
         }
         if (uvars()) {
             uvars()->set(key, val, new_export);
-            env_universal_barrier();
+            env_universal_defer_sync();
             if (old_export || new_export) {
-                vars_stack().mark_changed_exported();
+                vars_stack().mark_changed_exported(key);
             }
         }
     } else {
@@ -1128,7 +1395,7 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
         } else {
             if (!get_proc_had_barrier()) {
                 set_proc_had_barrier(true);
-                env_universal_barrier();
+                env_universal_barrier_if_needed();
             }
 
             if (uvars() && uvars()->get(key)) {
@@ -1141,7 +1408,7 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
                     exportv = uvars()->get_export(key);
                 }
                 uvars()->set(key, val, exportv);
-                env_universal_barrier();
+                env_universal_defer_sync();
                 done = 1;
 
             } else {
@@ -1153,10 +1420,13 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
         if (!done) {
             // Set the entry in the node. Note that operator[] accesses the existing entry, or
             // creates a new one.
+            const size_t old_size = node->env.size();
             env_var_t &var = node->env[key];
+            if (node->env.size() != old_size) node->sorted_entries_stale = true;
             if (var.exportv) {
                 // This variable already existed, and was exported.
                 has_changed_new = true;
+                node->export_count--;
             }
 
             var.set_vals(std::move(val));
@@ -1165,6 +1435,7 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
                 // The new variable is exported.
                 var.exportv = true;
                 node->exportv = true;
+                node->export_count++;
                 has_changed_new = true;
             } else {
                 var.exportv = false;
@@ -1173,24 +1444,43 @@ static int env_set_internal(const wcstring &key, env_mode_flags_t var_mode, wcst
                 node->exportv = has_changed_old != has_changed_new;
             }
 
-            if (has_changed_old || has_changed_new) vars_stack().mark_changed_exported();
+            if (has_changed_old || has_changed_new) vars_stack().mark_changed_exported(key);
         }
     }
 
-    event_t ev = event_t::variable_event(key);
-    ev.arguments.reserve(3);
-    ev.arguments.push_back(L"VARIABLE");
-    ev.arguments.push_back(L"SET");
-    ev.arguments.push_back(key);
-
-    // debug(1, L"env_set: fire events on variable |%ls|", key);
-    event_fire(&ev);
-    // debug(1, L"env_set: return from event firing");
-
+    fire_variable_event(key, L"SET");
     react_to_variable_change(L"SET", key);
     return ENV_OK;
 }
 
+int env_set_local(const wcstring &key, const env_var_t &var, env_mode_flags_t mode) {
+    ASSERT_IS_MAIN_THREAD();
+    assert((mode & ~ENV_USER) == ENV_LOCAL);
+    if (key == L"PWD" || key == L"HOME" || key == L"umask" || is_read_only(key) ||
+        is_electric(key) || variable_has_reaction(key) || event_is_variable_observed(key)) {
+        return env_set(key, mode, var.as_list());
+    }
+    // Hiding an exported variable changes what is exported.
+    env_node_t *preexisting_node = env_get_node(key);
+    if (preexisting_node != NULL && preexisting_node->env.find(key)->second.exportv) {
+        return env_set(key, mode, var.as_list());
+    }
+
+    // This is what env_set_internal() does for a new unexported local variable.
+    FISH_TRACE2(env_set, key.c_str(), mode);
+    s_env_change_count++;
+    bool has_changed_old = vars_stack().exports_changed();
+    env_node_t *node = vars_stack().top.get();
+    const size_t old_size = node->env.size();
+    env_var_t &local = node->env[key];
+    if (node->env.size() != old_size) node->sorted_entries_stale = true;
+    local = var;
+    local.exportv = false;
+    node->exportv = has_changed_old;
+    if (has_changed_old) vars_stack().mark_changed_exported(key);
+    return ENV_OK;
+}
+
 /// Sets the variable with the specified name to the given values.
 int env_set(const wcstring &key, env_mode_flags_t mode, wcstring_list_t vals) {
     return env_set_internal(key, mode, std::move(vals));
@@ -1203,6 +1493,70 @@ int env_set_one(const wcstring &key, env_mode_flags_t mode, wcstring val) {
     return env_set_internal(key, mode, std::move(vals));
 }
 
+/// Sets the loop variable of a for loop to a single value. Loop variables are nearly always plain
+/// unexported variables that nothing listens to, so in that case the value is replaced in place,
+/// skipping the special variable checks and event dispatch of env_set_internal(). Anything else
+/// goes through env_set_one() with ENV_DEFAULT | ENV_USER.
+int env_set_loop_var(const wcstring &key, wcstring val) {
+    ASSERT_IS_MAIN_THREAD();
+    if (key == L"PWD" || key == L"HOME" || key == L"umask" || is_read_only(key) ||
+        is_electric(key) || variable_has_reaction(key) || event_is_variable_observed(key)) {
+        return env_set_one(key, ENV_DEFAULT | ENV_USER, std::move(val));
+    }
+
+    env_node_t *node = env_get_node(key);
+    if (node == NULL) return env_set_one(key, ENV_DEFAULT | ENV_USER, std::move(val));
+    auto entry = node->env.find(key);
+    assert(entry != node->env.end());
+    env_var_t &var = entry->second;
+    if (var.exportv) return env_set_one(key, ENV_DEFAULT | ENV_USER, std::move(val));
+
+    // This is what env_set_internal() does for an unexported variable that stays unexported.
+    FISH_TRACE2(env_set, key.c_str(), ENV_DEFAULT | ENV_USER);
+    s_env_change_count++;
+    bool has_changed_old = vars_stack().exports_changed();
+    wcstring_list_t vals;
+    vals.push_back(std::move(val));
+    var.set_vals(std::move(vals));
+    node->exportv = has_changed_old;
+    if (has_changed_old) vars_stack().mark_changed_exported(key);
+    return ENV_OK;
+}
+
+bool env_modify_in_place(const wcstring &key, env_mode_flags_t mode,
+                         const std::function<void(wcstring_list_t &)> &modify) {
+    ASSERT_IS_MAIN_THREAD();
+    if (mode & (ENV_UNIVERSAL | ENV_EXPORT | ENV_UNEXPORT)) return false;
+    if (key == L"PWD" || key == L"HOME" || key == L"umask" || is_read_only(key) ||
+        is_electric(key) || variable_has_reaction(key) || variable_is_colon_delimited_var(key)) {
+        return false;
+    }
+
+    // This must be the node env_set_internal() would pick.
+    env_node_t *node = env_get_node(key);
+    if (node == NULL) return false;
+    if ((mode & ENV_GLOBAL) && node != vars_stack().global_env) return false;
+    if ((mode & ENV_LOCAL) && node != vars_stack().top.get()) return false;
+    auto entry = node->env.find(key);
+    assert(entry != node->env.end());
+    env_var_t &var = entry->second;
+    // Setting an exported variable with an explicit scope unexports it.
+    if (var.exportv && (mode & (ENV_GLOBAL | ENV_LOCAL))) return false;
+
+    // This is what env_set_internal() does for a variable that keeps its export status.
+    FISH_TRACE2(env_set, key.c_str(), mode);
+    s_env_change_count++;
+    bool has_changed_old = vars_stack().exports_changed();
+    wcstring_list_t vals = var.take_vals();
+    modify(vals);
+    var.set_vals(std::move(vals));
+    node->exportv = var.exportv || has_changed_old;
+    if (node->exportv) vars_stack().mark_changed_exported(key);
+
+    fire_variable_event(key, L"SET");
+    return true;
+}
+
 /// Sets the variable with the specified name without any (i.e., zero) values.
 int env_set_empty(const wcstring &key, env_mode_flags_t mode) {
     return env_set_internal(key, mode, {});
@@ -1219,9 +1573,11 @@ static bool try_remove(env_node_t *n, const wchar_t *key, int var_mode) {
     var_table_t::iterator result = n->env.find(key);
     if (result != n->env.end()) {
         if (result->second.exportv) {
-            vars_stack().mark_changed_exported();
+            vars_stack().mark_changed_exported(key);
+            n->export_count--;
         }
         n->env.erase(result);
+        n->sorted_entries_stale = true;
         return true;
     }
 
@@ -1237,6 +1593,7 @@ static bool try_remove(env_node_t *n, const wchar_t *key, int var_mode) {
 
 int env_remove(const wcstring &key, int var_mode) {
     ASSERT_IS_MAIN_THREAD();
+    s_env_change_count++;
     env_node_t *first_node;
     int erased = 0;
 
@@ -1252,11 +1609,7 @@ int env_remove(const wcstring &key, int var_mode) {
         }
 
         if (try_remove(first_node, key.c_str(), var_mode)) {
-            event_t ev = event_t::variable_event(key);
-            ev.arguments.push_back(L"VARIABLE");
-            ev.arguments.push_back(L"ERASE");
-            ev.arguments.push_back(key);
-            event_fire(&ev);
+            fire_variable_event(key, L"ERASE");
 
             erased = 1;
         }
@@ -1266,15 +1619,11 @@ int env_remove(const wcstring &key, int var_mode) {
         bool is_exported = uvars()->get_export(key);
         erased = uvars() && uvars()->remove(key);
         if (erased) {
-            env_universal_barrier();
-            event_t ev = event_t::variable_event(key);
-            ev.arguments.push_back(L"VARIABLE");
-            ev.arguments.push_back(L"ERASE");
-            ev.arguments.push_back(key);
-            event_fire(&ev);
+            env_universal_defer_sync();
+            fire_variable_event(key, L"ERASE");
         }
 
-        if (is_exported) vars_stack().mark_changed_exported();
+        if (is_exported) vars_stack().mark_changed_exported(key);
     }
 
     react_to_variable_change(L"ERASE", key);
@@ -1282,25 +1631,99 @@ int env_remove(const wcstring &key, int var_mode) {
     return !erased;
 }
 
-const wcstring_list_t &env_var_t::as_list() const { return vals; }
+const env_var_t::contents_ref_t &env_var_t::empty_contents() {
+    static const contents_ref_t s_empty =
+        std::make_shared<contents_t>(L"", wcstring_list_t());
+    return s_empty;
+}
+
+uint64_t env_var_t::next_generation() {
+    static std::atomic<uint64_t> s_last_generation{0};
+    return ++s_last_generation;
+}
 
 /// Return a string representation of the var. At the present time this uses the legacy 2.x
 /// encoding.
-wcstring env_var_t::as_string(void) const {
-    if (this->vals.empty()) return wcstring(ENV_NULL);
+const wcstring &env_var_t::as_string(void) const {
+    static const wcstring s_null(ENV_NULL);
+    const contents_t &c = *this->contents;
+    if (c.vals.empty()) return s_null;
+    if (c.vals.size() == 1) return c.vals.front();
+
+    std::call_once(c.joined_once, [&c]() {
+        wchar_t sep = variable_is_colon_delimited_var(c.name) ? L':' : ARRAY_SEP;
+        auto it = c.vals.cbegin();
+        c.joined = *it;
+        while (++it != c.vals.end()) {
+            c.joined.push_back(sep);
+            c.joined.append(*it);
+        }
+    });
+    return c.joined;
+}
+
+void env_var_t::to_list(wcstring_list_t &out) const { out = contents->vals; }
 
-    wchar_t sep = variable_is_colon_delimited_var(this->name) ? L':' : ARRAY_SEP;
-    auto it = this->vals.cbegin();
-    wcstring result(*it);
-    while (++it != vals.end()) {
-        result.push_back(sep);
-        result.append(*it);
+/// Lists shorter than this are searched directly by env_var_t::find_value().
+static const size_t kFindValueIndexMinSize = 32;
+
+size_t env_var_t::find_value(const wcstring &val) const {
+    const contents_t &c = *contents;
+    if (c.vals.size() < kFindValueIndexMinSize) {
+        auto found = std::find(c.vals.begin(), c.vals.end(), val);
+        return found == c.vals.end() ? 0 : found - c.vals.begin() + 1;
+    }
+
+    const std::hash<wcstring> hasher;
+    std::call_once(c.index_once, [&c, &hasher]() {
+        c.index.reserve(c.vals.size());
+        for (size_t i = 0; i < c.vals.size(); i++) c.index.emplace(hasher(c.vals[i]), i);
+    });
+    size_t result = 0;
+    auto range = c.index.equal_range(hasher(val));
+    for (auto it = range.first; it != range.second; ++it) {
+        size_t pos = it->second + 1;
+        if ((result == 0 || pos < result) && c.vals[it->second] == val) result = pos;
     }
     return result;
 }
 
-void env_var_t::to_list(wcstring_list_t &out) const {
-    out = vals;
+wcstring_list_t env_var_t::take_vals() {
+    // The contents are only ever created non-const, so they may be changed once nothing else
+    // refers to them. The empty contents are always shared with empty_contents().
+    if (contents.use_count() == 1) {
+        return std::move(const_cast<contents_t *>(contents.get())->vals);
+    }
+    return contents->vals;
+}
+
+uint64_t env_get_generation() { return s_env_change_count; }
+
+uint64_t env_get_generation(const wcstring &key, env_mode_flags_t mode) {
+    const auto var = env_get(key, mode);
+    return var ? var->get_generation() : 0;
+}
+
+/// Returns the history that $history lists.
+static history_t &env_history() {
+    history_t *history = reader_get_history();
+    return history ? *history : history_t::history_with_name(history_session_id());
+}
+
+maybe_t<env_var_t> env_get_history(size_t count) {
+    // We only allow getting the history on the main thread, see env_get.
+    if (!is_main_thread()) return none();
+    wcstring_list_t result;
+    env_history().get_history(result, count);
+    return env_var_t(L"history", result);
+}
+
+size_t env_get_count(const wcstring &key) {
+    if (key == L"history") {
+        return is_main_thread() ? env_history().distinct_size() : 0;
+    }
+    const auto var = env_get(key);
+    return var ? var->as_list().size() : 0;
 }
 
 maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode) {
@@ -1323,13 +1746,7 @@ maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode) {
                 return none();
             }
 
-            history_t *history = reader_get_history();
-            if (!history) {
-                history = &history_t::history_with_name(history_session_id());
-            }
-            wcstring_list_t result;
-            if (history) history->get_history(result);
-            return env_var_t(L"history", result);
+            return env_get_history(SIZE_MAX);
         } else if (key == L"status") {
             return env_var_t(L"status", to_string(proc_get_last_status()));
         } else if (key == L"umask") {
@@ -1365,7 +1782,7 @@ maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode) {
     // values). Make sure we do this outside the env_lock because it may itself call `env_get()`.
     if (is_main_thread() && !get_proc_had_barrier()) {
         set_proc_had_barrier(true);
-        env_universal_barrier();
+        env_universal_barrier_if_needed();
     }
 
     // Okay, we couldn't find a local or global var given the requirements. If there is a matching
@@ -1397,30 +1814,46 @@ void env_push(bool new_scope) { vars_stack().push(new_scope); }
 
 void env_pop() { vars_stack().pop(); }
 
-/// Function used with to insert keys of one table into a set::set<wcstring>.
-static void add_key_to_string_set(const var_table_t &envs, std::set<wcstring> *str_set,
-                                  bool show_exported, bool show_unexported) {
-    var_table_t::const_iterator iter;
-    for (iter = envs.begin(); iter != envs.end(); ++iter) {
-        const env_var_t &var = iter->second;
+/// Append the names of the entries of the given node with the requested export status to out,
+/// sorted.
+static void add_sorted_names(env_node_t *node, bool show_exported, bool show_unexported,
+                             std::vector<const wcstring *> *out) {
+    for (const var_table_t::value_type *entry : node->get_sorted_entries()) {
+        const bool exported = entry->second.exportv;
+        if ((exported && show_exported) || (!exported && show_unexported)) {
+            out->push_back(&entry->first);
+        }
+    }
+}
 
-        if ((var.exportv && show_exported) || (!var.exportv && show_unexported)) {
-            // Insert this key.
-            str_set->insert(iter->first);
+memory_usage_t env_memory_usage() {
+    scoped_lock locker(env_lock);
+    memory_usage_t usage;
+    for (const env_node_t *node = vars_stack().top.get(); node; node = node->next.get()) {
+        usage.bytes += sizeof *node + node->env.bucket_count() * sizeof(void *);
+        for (const auto &entry : node->env) {
+            usage.count++;
+            // Each table node also holds a link and the hash. Values may be shared with copies of
+            // the variable, but are counted for each scope that has them.
+            usage.bytes += sizeof entry + 2 * sizeof(void *) + string_memory(entry.first) +
+                           string_list_memory(entry.second.as_list());
         }
     }
+    return usage;
 }
 
 wcstring_list_t env_get_names(int flags) {
     scoped_lock locker(env_lock);
 
     wcstring_list_t result;
-    std::set<wcstring> names;
+    // The sorted names of each scope. These are merged rather than inserted into a set, as
+    // completing variable names gets the names on every key press.
+    std::vector<std::vector<const wcstring *>> scope_names;
     int show_local = flags & ENV_LOCAL;
     int show_global = flags & ENV_GLOBAL;
     int show_universal = flags & ENV_UNIVERSAL;
 
-    const env_node_t *n = vars_stack().top.get();
+    env_node_t *n = vars_stack().top.get();
     const bool show_exported = (flags & ENV_EXPORT) || !(flags & ENV_UNEXPORT);
     const bool show_unexported = (flags & ENV_UNEXPORT) || !(flags & ENV_EXPORT);
 
@@ -1432,7 +1865,8 @@ wcstring_list_t env_get_names(int flags) {
         while (n) {
             if (n == vars_stack().global_env) break;
 
-            add_key_to_string_set(n->env, &names, show_exported, show_unexported);
+            scope_names.emplace_back();
+            add_sorted_names(n, show_exported, show_unexported, &scope_names.back());
             if (n->new_scope)
                 break;
             else
@@ -1441,18 +1875,32 @@ wcstring_list_t env_get_names(int flags) {
     }
 
     if (show_global) {
-        add_key_to_string_set(vars_stack().global_env->env, &names, show_exported, show_unexported);
+        scope_names.emplace_back();
+        add_sorted_names(vars_stack().global_env, show_exported, show_unexported,
+                         &scope_names.back());
         if (show_unexported) {
             result.insert(result.end(), env_electric.begin(), env_electric.end());
         }
     }
 
+    wcstring_list_t uni_list;
     if (show_universal && uvars()) {
-        const wcstring_list_t uni_list = uvars()->get_names(show_exported, show_unexported);
-        names.insert(uni_list.begin(), uni_list.end());
-    }
-
-    result.insert(result.end(), names.begin(), names.end());
+        uni_list = uvars()->get_names(show_exported, show_unexported);
+        std::sort(uni_list.begin(), uni_list.end());
+        scope_names.emplace_back();
+        for (const wcstring &name : uni_list) scope_names.back().push_back(&name);
+    }
+
+    auto name_less = [](const wcstring *a, const wcstring *b) { return *a < *b; };
+    std::vector<const wcstring *> names, merged;
+    for (const std::vector<const wcstring *> &next : scope_names) {
+        merged.clear();
+        std::set_union(names.begin(), names.end(), next.begin(), next.end(),
+                       std::back_inserter(merged), name_less);
+        names.swap(merged);
+    }
+    result.reserve(result.size() + names.size());
+    for (const wcstring *name : names) result.push_back(*name);
     return result;
 }
 
@@ -1472,8 +1920,8 @@ static void get_exported(const env_node_t *n, var_table_t &h) {
         const env_var_t var = iter->second;
 
         if (var.exportv) {
-            // Export the variable. Don't use std::map::insert here, since we need to overwrite
-            // existing values from previous scopes.
+            // Export the variable. Don't use insert here, since we need to overwrite existing
+            // values from previous scopes.
             h[key] = var;
         } else {
             // We need to erase from the map if we are not exporting, since a lower scope may have
@@ -1483,60 +1931,95 @@ static void get_exported(const env_node_t *n, var_table_t &h) {
     }
 }
 
-// Given a map from key to value, add values to out of the form key=value.
-static void export_func(const var_table_t &envs, std::vector<std::string> &out) {
-    out.reserve(out.size() + envs.size());
-    for (auto iter = envs.begin(); iter != envs.end(); ++iter) {
-        const wcstring &key = iter->first;
-        const std::string &ks = wcs2string(key);
-        std::string vs = wcs2string(iter->second.as_string());
-
-        // Arrays in the value are ASCII record separator (0x1e) delimited. But some variables
-        // should have colons. Add those.
-        if (variable_is_colon_delimited_var(key)) {
-            // Replace ARRAY_SEP with colon.
-            std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
-        }
+// Returns the string for exporting the given variable, of the form key=value.
+static std::string export_string(const wcstring &key, const env_var_t &var) {
+    const std::string &ks = wcs2string(key);
+    std::string vs = wcs2string(var.as_string());
+
+    // Arrays in the value are ASCII record separator (0x1e) delimited. But some variables
+    // should have colons. Add those.
+    if (variable_is_colon_delimited_var(key)) {
+        // Replace ARRAY_SEP with colon.
+        std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
+    }
 
-        // Put a string on the vector.
-        out.push_back(std::string());
-        std::string &str = out.back();
-        str.reserve(ks.size() + 1 + vs.size());
+    std::string str;
+    str.reserve(ks.size() + 1 + vs.size());
+    str.append(ks);
+    str.append("=");
+    str.append(vs);
+    return str;
+}
 
-        // Append our environment variable data to it.
-        str.append(ks);
-        str.append("=");
-        str.append(vs);
+maybe_t<env_var_t> var_stack_t::get_exported_var(const wcstring &key) const {
+    // The topmost scope with the variable decides whether it is exported, just like in
+    // get_exported.
+    for (const env_node_t *n = this->top.get(); n != NULL; n = next_scope_to_search(n)) {
+        auto where = n->env.find(key);
+        if (where != n->env.end()) {
+            if (where->second.exportv) return where->second;
+            break;
+        }
+    }
+
+    // Exported universal variables fill in whatever the other scopes don't export.
+    if (uvars() && uvars()->get_export(key)) {
+        auto var = uvars()->get(key);
+        if (!var.missing_or_empty()) return *var;
     }
+    return none();
 }
 
 void var_stack_t::update_export_array_if_necessary() {
-    if (!this->has_changed_exported) {
+    if (!this->exports_changed()) {
         return;
     }
 
-    debug(4, L"env_export_arr() recalc");
-    var_table_t vals;
-    get_exported(this->top.get(), vals);
+    if (this->has_changed_exported) {
+        debug(4, L"env_export_arr() recalc");
+        var_table_t vals;
+        get_exported(this->top.get(), vals);
 
-    if (uvars()) {
-        const wcstring_list_t uni = uvars()->get_names(true, false);
-        for (size_t i = 0; i < uni.size(); i++) {
-            const wcstring &key = uni.at(i);
-            auto var = uvars()->get(key);
-
-            if (!var.missing_or_empty()) {
-                // Note that std::map::insert does NOT overwrite a value already in the map,
-                // which we depend on here.
-                vals.insert(std::pair<wcstring, env_var_t>(key, *var));
+        if (uvars()) {
+            const wcstring_list_t uni = uvars()->get_names(true, false);
+            for (size_t i = 0; i < uni.size(); i++) {
+                const wcstring &key = uni.at(i);
+                auto var = uvars()->get(key);
+
+                if (!var.missing_or_empty()) {
+                    // Note that insert does NOT overwrite a value already in the table, which we
+                    // depend on here.
+                    vals.insert(std::pair<wcstring, env_var_t>(key, *var));
+                }
+            }
+        }
+
+        export_strings.clear();
+        for (const auto &entry : vals) {
+            export_strings[entry.first] = export_string(entry.first, entry.second);
+        }
+    } else {
+        // Only some variables changed, so only look at those.
+        debug(4, L"env_export_arr() update of %lu variables",
+              (unsigned long)changed_exported_vars.size());
+        for (const wcstring &key : changed_exported_vars) {
+            auto var = get_exported_var(key);
+            if (var) {
+                export_strings[key] = export_string(key, *var);
+            } else {
+                export_strings.erase(key);
             }
         }
     }
 
     std::vector<std::string> local_export_buffer;
-    export_func(vals, local_export_buffer);
+    local_export_buffer.reserve(export_strings.size());
+    for (const auto &entry : export_strings) {
+        local_export_buffer.push_back(entry.second);
+    }
     export_array.set(local_export_buffer);
     has_changed_exported = false;
+    changed_exported_vars.clear();
 }
 
 const char *const *env_export_arr() {
@@ -1547,28 +2030,44 @@ const char *const *env_export_arr() {
 }
 
 void env_set_argv(const wchar_t *const *argv) {
-    if (argv && *argv) {
-        wcstring_list_t list;
-        for (auto arg = argv; *arg; arg++) {
-            list.push_back(*arg);
-        }
-
-        env_set(L"argv", ENV_LOCAL, list);
-    } else {
-        env_set_empty(L"argv", ENV_LOCAL);
+    wcstring_list_t list;
+    for (auto arg = argv; arg && *arg; arg++) {
+        list.emplace_back(*arg);
     }
+    env_set_local(L"argv", env_var_t(L"argv", std::move(list)), ENV_LOCAL);
 }
 
+namespace {
+/// The most recent snapshot, which we hand out again until a variable changes.
+struct snapshot_cache_t {
+    const wchar_t *const *keys = NULL;
+    uint64_t change_count = 0;
+    std::shared_ptr<const env_vars_snapshot_t::var_map_t> vars;
+};
+}  // namespace
+static snapshot_cache_t s_snapshot_cache;
+
 env_vars_snapshot_t::env_vars_snapshot_t(const wchar_t *const *keys) {
     ASSERT_IS_MAIN_THREAD();
+    snapshot_cache_t &cache = s_snapshot_cache;
+    if (cache.vars && cache.keys == keys && cache.change_count == s_env_change_count) {
+        this->vars = cache.vars;
+        return;
+    }
+
+    auto new_vars = std::make_shared<var_map_t>();
     wcstring key;
     for (size_t i = 0; keys[i]; i++) {
         key.assign(keys[i]);
         const auto var = env_get(key);
         if (var) {
-            vars[key] = *var;
+            (*new_vars)[key] = *var;
         }
     }
+    this->vars = new_vars;
+    cache.keys = keys;
+    cache.change_count = s_env_change_count;
+    cache.vars = this->vars;
 }
 
 env_vars_snapshot_t::env_vars_snapshot_t() {}
@@ -1585,8 +2084,9 @@ maybe_t<env_var_t> env_vars_snapshot_t::get(const wcstring &key) const {
     if (this->is_current()) {
         return env_get(key);
     }
-    auto iter = vars.find(key);
-    if (iter == vars.end()) return none();
+    if (!vars) return none();
+    auto iter = vars->find(key);
+    if (iter == vars->end()) return none();
     return env_var_t(iter->second);
 }
 
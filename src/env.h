@@ -5,9 +5,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "common.h"
@@ -70,49 +73,89 @@ void misc_init();
 
 class env_var_t {
    private:
-    wcstring name;         // name of the var
-    wcstring_list_t vals;  // list of values assigned to the var
+    /// The name and values of a variable. This is immutable once made, and shared between all
+    /// copies of the variable. The one exception is take_vals(), which moves the values out when
+    /// nothing else shares them.
+    struct contents_t {
+        const wcstring name;
+        wcstring_list_t vals;
+
+        contents_t(wcstring n, wcstring_list_t v) : name(std::move(n)), vals(std::move(v)) {}
+
+        /// The values joined by the separator, computed on first use. Only lists with more than one
+        /// value need this; a scalar hands out its value directly.
+        mutable std::once_flag joined_once;
+        mutable wcstring joined;
+
+        /// The hashes of the values mapped to their positions, computed on first use by
+        /// find_value() for long lists.
+        mutable std::once_flag index_once;
+        mutable std::unordered_multimap<size_t, size_t> index;
+    };
+    typedef std::shared_ptr<const contents_t> contents_ref_t;
+
+    contents_ref_t contents;
+    uint64_t generation;  // changes whenever the values are replaced
+
+    static const contents_ref_t &empty_contents();
+    static uint64_t next_generation();
 
    public:
     bool exportv;  // whether the variable should be exported
 
     // Constructors.
-    env_var_t(const env_var_t &v) : name(v.name), vals(v.vals), exportv(v.exportv) {}
-    env_var_t(const wcstring &our_name, const wcstring_list_t &l)
-        : name(our_name), vals(l), exportv(false) {}
-    env_var_t(const wcstring &our_name, const wcstring &s)
-        : name(our_name),
-          vals({
-              s,
-          }),
-          exportv(false) {}
-    env_var_t(const wcstring &our_name, const wchar_t *s)
-        : name(our_name),
-          vals({
-              wcstring(s),
-          }),
+    env_var_t(const env_var_t &v)
+        : contents(v.contents), generation(v.generation), exportv(v.exportv) {}
+    env_var_t(wcstring our_name, wcstring_list_t l)
+        : contents(std::make_shared<contents_t>(std::move(our_name), std::move(l))),
+          generation(next_generation()),
           exportv(false) {}
-    env_var_t() : name(), vals(), exportv(false) {}
-
-    bool empty(void) const { return vals.empty() || (vals.size() == 1 && vals[0].empty()); };
+    env_var_t(wcstring our_name, wcstring s)
+        : env_var_t(std::move(our_name), wcstring_list_t({std::move(s)})) {}
+    env_var_t(wcstring our_name, const wchar_t *s)
+        : env_var_t(std::move(our_name), wcstring_list_t({wcstring(s)})) {}
+    env_var_t() : contents(empty_contents()), generation(0), exportv(false) {}
+
+    bool empty(void) const {
+        const wcstring_list_t &vals = contents->vals;
+        return vals.empty() || (vals.size() == 1 && vals[0].empty());
+    };
     bool read_only(void) const;
 
-    bool matches_string(const wcstring &str) {
-        if (vals.size() > 1) return false;
-        return vals[0] == str;
-    }
+    bool matches_string(const wcstring &str) const { return *this == str; }
 
-    wcstring as_string() const;
+    /// Returns the values as a single string, joined by the separator for this variable. This does
+    /// not allocate for variables with a single value.
+    const wcstring &as_string() const;
     void to_list(wcstring_list_t &out) const;
-    const wcstring_list_t &as_list() const;
+    const wcstring_list_t &as_list() const { return contents->vals; }
+
+    /// Returns the position of the first value equal to \p val, counting from 1, or 0 if there is
+    /// none. Long lists build a hash index of their values for this, which is kept until the values
+    /// are replaced.
+    size_t find_value(const wcstring &val) const;
 
-    const wcstring get_name() const { return name; }
+    const wcstring &get_name() const { return contents->name; }
 
-    void set_vals(wcstring_list_t v) { vals = std::move(v); }
+    /// Returns a number identifying the current values of this variable. Setting the values
+    /// produces a new generation, while copies of a variable keep the generation of the original.
+    /// Consumers can therefore cache anything derived from the values, and only recompute it when
+    /// the generation they saw last no longer matches.
+    uint64_t get_generation() const { return generation; }
+
+    void set_vals(wcstring_list_t v) {
+        contents = std::make_shared<contents_t>(contents->name, std::move(v));
+        generation = next_generation();
+    }
+
+    /// Returns the values, to be changed and passed back to set_vals(). They are moved out when no
+    /// other copy of this variable shares them, and copied otherwise. Until set_vals() is called
+    /// this variable must not be read.
+    wcstring_list_t take_vals();
 
     env_var_t &operator=(const env_var_t &var) {
-        this->name = var.name;
-        this->vals = var.vals;
+        this->contents = var.contents;
+        this->generation = var.generation;
         this->exportv = var.exportv;
         return *this;
     }
@@ -120,15 +163,18 @@ class env_var_t {
     /// Compare a simple string to the var. Returns true iff the var has a single
     /// value and that value matches the string being compared to.
     bool operator==(const wcstring &str) const {
-        if (vals.size() > 1) return false;
+        const wcstring_list_t &vals = contents->vals;
+        if (vals.size() != 1) return false;
         return vals[0] == str;
     }
 
-    bool operator==(const env_var_t &var) const { return vals == var.vals; }
+    bool operator==(const env_var_t &var) const {
+        return contents == var.contents || contents->vals == var.contents->vals;
+    }
 
-    bool operator==(const wcstring_list_t &values) const { return vals == values; }
+    bool operator==(const wcstring_list_t &values) const { return contents->vals == values; }
 
-    bool operator!=(const env_var_t &var) const { return vals != var.vals; }
+    bool operator!=(const env_var_t &var) const { return !(*this == var); }
 };
 
 /// This is used to convert a serialized env_var_t back into a list.
@@ -137,12 +183,50 @@ wcstring_list_t decode_serialized(const wcstring &s);
 /// Gets the variable with the specified name, or none() if it does not exist.
 maybe_t<env_var_t> env_get(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
 
+/// Gets only the count most recent items of $history, which may be very long. Returns none() off
+/// the main thread, as env_get does.
+maybe_t<env_var_t> env_get_history(size_t count);
+
+/// Returns the number of elements of the variable with the specified name, or 0 if it does not
+/// exist. Unlike env_get, this does not copy the items of $history.
+size_t env_get_count(const wcstring &key);
+
+/// Returns a number that grows whenever any variable may have changed: on every set, erase, scope
+/// push or pop and universal variable change. Caches of anything computed from variables can
+/// remember the generation they were built at, and skip recomputing while it is unchanged.
+uint64_t env_get_generation();
+
+/// Returns the generation of the variable with the specified name (see
+/// env_var_t::get_generation), or 0 if it does not exist. This only changes when that variable is
+/// set or erased, or a different variable by that name becomes visible. Computed variables like
+/// $status get a new generation on every call.
+uint64_t env_get_generation(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
+
 /// Sets the variable with the specified name to the given values.
 int env_set(const wcstring &key, env_mode_flags_t mode, wcstring_list_t vals);
 
 /// Sets the variable with the specified name to a single value.
 int env_set_one(const wcstring &key, env_mode_flags_t mode, wcstring val);
 
+/// Sets the loop variable of a for loop to a single value. This is equivalent to env_set_one() with
+/// ENV_DEFAULT | ENV_USER, but faster for plain variables.
+int env_set_loop_var(const wcstring &key, wcstring val);
+
+/// Sets a variable in the innermost scope, unexported, sharing the values of var rather than
+/// copying them. This is how a function call binds $argv, its named arguments and the variables it
+/// inherits. As with env_set_loop_var(), a variable that nothing reacts to or listens for is stored
+/// directly; anything else goes through env_set() with the given mode, which must be ENV_LOCAL,
+/// with or without ENV_USER.
+int env_set_local(const wcstring &key, const env_var_t &var, env_mode_flags_t mode);
+
+/// Changes the values of the variable with the specified name in place by calling \p modify on
+/// them, so that growing or editing a long list does not copy it. This is only done for a plain
+/// variable that already exists in the scope env_set() would use for \p mode, and that keeps its
+/// export status. Otherwise nothing is changed and false is returned; the caller should then use
+/// env_set().
+bool env_modify_in_place(const wcstring &key, env_mode_flags_t mode,
+                         const std::function<void(wcstring_list_t &)> &modify);
+
 /// Sets the variable with the specified name to no values.
 int env_set_empty(const wcstring &key, env_mode_flags_t mode);
 
@@ -165,6 +249,31 @@ void env_pop();
 /// Synchronizes all universal variable changes: writes everything out, reads stuff in.
 void env_universal_barrier();
 
+/// Like env_universal_barrier, but does nothing if this shell has nothing to write and the notifier
+/// can tell that no other process changed anything.
+void env_universal_barrier_if_needed();
+
+/// Writes out universal variable changes made by this shell, if any. Setting or erasing a universal
+/// variable does not write it out right away, so that all changes made by a command are written
+/// together. This must be called before anything that may read the variables file, like an
+/// external command.
+void env_universal_flush();
+
+/// Counters for how often universal variables were synced, and how often a sync was avoided.
+struct env_universal_sync_stats_t {
+    /// Syncs performed.
+    uint64_t syncs = 0;
+    /// Barriers skipped because there was nothing to write and the notifier reported no change.
+    uint64_t skipped_barriers = 0;
+    /// Changes that were not synced right away, but left for the next sync to write out.
+    uint64_t deferred_changes = 0;
+};
+env_universal_sync_stats_t env_universal_sync_stats();
+
+/// Returns the number of variables in the global and local scopes, and approximately how much
+/// memory they use. Universal variables are not included.
+memory_usage_t env_memory_usage();
+
 /// Returns an array containing all exported variables in a format suitable for execv
 const char *const *env_export_arr();
 
@@ -183,8 +292,30 @@ wcstring env_get_pwd_slash();
 /// Update the read_byte_limit variable.
 void env_set_read_limit();
 
+/// Update the history_memory_limit variable.
+void env_set_history_memory_limit();
+
+/// Update the history_compression_level variable.
+void env_set_history_compression();
+
+/// Update the expand_argument_limit variable.
+void env_set_expand_limit();
+
+/// Update the capacity of the kill ring.
+void env_set_kill_ring_limit();
+
+/// Update the jiffies_sample_interval_ms variable.
+void env_set_jobs_cpu_interval();
+
+/// An immutable copy of some variables, for handing to background threads. Copies of a snapshot
+/// share its variables, and taking a snapshot when no variable has changed since the last one
+/// reuses that one, so snapshots are cheap.
 class env_vars_snapshot_t {
-    std::map<wcstring, env_var_t> vars;
+   public:
+    typedef std::map<wcstring, env_var_t> var_map_t;
+
+   private:
+    std::shared_ptr<const var_map_t> vars;
     bool is_current() const;
 
    public:
@@ -209,7 +340,9 @@ class env_vars_snapshot_t {
 extern int g_fork_count;
 extern bool g_use_posix_spawn;
 
-typedef std::map<wcstring, env_var_t> var_table_t;
+/// A table of variables, by name. This is a hash table since looking up variables is far more
+/// common than listing them; code that lists them sorts the names itself where order matters.
+typedef std::unordered_map<wcstring, env_var_t> var_table_t;
 
 extern bool term_has_xn;  // does the terminal have the "eat_newline_glitch"
 
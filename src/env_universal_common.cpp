@@ -18,9 +18,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#ifdef __CYGWIN__
 #include <sys/mman.h>
-#endif
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>  // IWYU pragma: keep
 #endif
@@ -30,6 +28,7 @@
 #include <unistd.h>
 #include <wchar.h>
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <string>
@@ -50,6 +49,16 @@
 #include <notify.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#define FISH_INOTIFY_AVAILABLE 1
+#include <sys/inotify.h>
+#endif
+
+#if defined(HAVE_SYS_EVENT_H) && !__APPLE__
+#define FISH_KQUEUE_AVAILABLE 1
+#include <sys/event.h>
+#endif
+
 #ifdef __HAIKU__
 #define _BSD_SOURCE
 #include <bsd/ifaddrs.h>
@@ -67,6 +76,13 @@
 /// Non-wide version of the set_export command.
 #define SET_EXPORT_MBS "SET_EXPORT"
 
+/// How many appended records, beyond one for each variable, the file may carry before the next
+/// sync rewrites it.
+#define UVAR_FILE_RECORD_SLACK 64
+
+/// How many bytes from the end of what we read to remember, to recognize the file later.
+#define UVAR_FILE_MARKER_LENGTH 64
+
 /// Error message.
 #define PARSE_ERR L"Unable to parse universal variable message: '%ls'"
 
@@ -256,7 +272,11 @@ static bool append_file_entry(fish_message_type_t type, const wcstring &key_in,
 }
 
 env_universal_t::env_universal_t(const wcstring &path)
-    : explicit_vars_path(path), tried_renaming(false), last_read_file(kInvalidFileID) {}
+    : explicit_vars_path(path),
+      tried_renaming(false),
+      last_read_file(kInvalidFileID),
+      last_read_offset(0),
+      last_read_record_count(0) {}
 
 maybe_t<env_var_t> env_universal_t::get(const wcstring &name) const {
     var_table_t::const_iterator where = vars.find(name);
@@ -386,6 +406,64 @@ void env_universal_t::acquire_variables(var_table_t &vars_to_acquire) {
     this->vars = std::move(vars_to_acquire);
 }
 
+/// Returns the range of the key in a record like "SET key:value", or false if there is none.
+static bool find_record_key(const char *record, size_t len, size_t *out_start, size_t *out_end) {
+    const char *end = record + len;
+    const char *start = std::find(record, end, ' ');
+    while (start < end && (*start == ' ' || *start == '\t')) start++;
+    const char *colon = std::find(start, end, ':');
+    if (colon == end) return false;
+    *out_start = start - record;
+    *out_end = colon - record;
+    return true;
+}
+
+/// Remembers the record that was just appended to contents, starting at the given offset, as the
+/// one for its key.
+static void remember_raw_record(const std::string &contents, size_t start,
+                                env_universal_t::raw_record_map_t *raw_records) {
+    // Drop the newline.
+    const char *record = contents.data() + start;
+    const size_t len = contents.size() - start - 1;
+    size_t key_start, key_end;
+    if (find_record_key(record, len, &key_start, &key_end)) {
+        (*raw_records)[std::string(record + key_start, key_end - key_start)].assign(record, len);
+    }
+}
+
+void env_universal_t::note_read_position(int fd, const file_id_t &file, uint64_t offset,
+                                         size_t record_count) {
+    last_read_file = file;
+    last_read_offset = offset;
+    last_read_record_count = record_count;
+
+    size_t marker_length = (size_t)std::min<uint64_t>(offset, UVAR_FILE_MARKER_LENGTH);
+    last_read_marker.resize(marker_length);
+    if (marker_length > 0 &&
+        pread(fd, &last_read_marker[0], marker_length, offset - marker_length) !=
+            (ssize_t)marker_length) {
+        // We won't recognize this file, so the next load reads all of it.
+        last_read_marker.clear();
+        last_read_file = kInvalidFileID;
+    }
+}
+
+bool env_universal_t::file_was_appended_to(int fd, const file_id_t &file) const {
+    if (last_read_file == kInvalidFileID || file.device != last_read_file.device ||
+        file.inode != last_read_file.inode || file.size < last_read_offset) {
+        return false;
+    }
+
+    // Linux aggressively reuses inodes, so the file may have been replaced by one that only shares
+    // its inode. Make sure it still ends what we read with the same bytes.
+    std::string marker(last_read_marker.size(), '\0');
+    if (!marker.empty() && pread(fd, &marker[0], marker.size(),
+                                 last_read_offset - marker.size()) != (ssize_t)marker.size()) {
+        return false;
+    }
+    return marker == last_read_marker;
+}
+
 void env_universal_t::load_from_fd(int fd, callback_data_list_t &callbacks) {
     ASSERT_IS_LOCKED(lock);
     assert(fd >= 0);
@@ -393,16 +471,33 @@ void env_universal_t::load_from_fd(int fd, callback_data_list_t &callbacks) {
     const file_id_t current_file = file_id_for_fd(fd);
     if (current_file == last_read_file) {
         debug(5, L"universal log sync elided based on fstat()");
+    } else if (this->file_was_appended_to(fd, current_file)) {
+        // Only replay the new records, on top of the variables we have.
+        debug(5, L"universal log reading appended records");
+        var_table_t new_vars = this->vars;
+        size_t record_count = 0;
+        uint64_t amt = this->read_message_internal(fd, last_read_offset, &new_vars, &raw_records,
+                                                   &record_count);
+
+        this->generate_callbacks(new_vars, callbacks);
+        this->acquire_variables(new_vars);
+        this->note_read_position(fd, current_file, last_read_offset + amt,
+                                 last_read_record_count + record_count);
     } else {
         // Read a variables table from the file.
-        var_table_t new_vars = this->read_message_internal(fd);
+        var_table_t new_vars;
+        raw_record_map_t new_raw_records;
+        size_t record_count = 0;
+        uint64_t amt =
+            this->read_message_internal(fd, 0, &new_vars, &new_raw_records, &record_count);
+        this->raw_records = std::move(new_raw_records);
 
         // Announce changes.
         this->generate_callbacks(new_vars, callbacks);
 
         // Acquire the new variables.
         this->acquire_variables(new_vars);
-        last_read_file = current_file;
+        this->note_read_position(fd, current_file, amt, record_count);
     }
 }
 
@@ -440,22 +535,36 @@ bool env_universal_t::write_to_fd(int fd, const wcstring &path) {
     std::string storage;
 
     // Write the save message. If this fails, we don't bother complaining.
-    write_loop(fd, SAVE_MSG, strlen(SAVE_MSG));
-
-    var_table_t::const_iterator iter = vars.begin();
-    while (iter != vars.end()) {
+    uint64_t amt_written = 0;
+    if (write_loop(fd, SAVE_MSG, strlen(SAVE_MSG)) >= 0) amt_written += strlen(SAVE_MSG);
+
+    // Write the variables sorted by name, so the file doesn't change needlessly.
+    std::vector<const var_table_t::value_type *> sorted;
+    sorted.reserve(vars.size());
+    for (const var_table_t::value_type &entry : vars) sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const var_table_t::value_type *a, const var_table_t::value_type *b) {
+                  return a->first < b->first;
+              });
+
+    raw_record_map_t new_raw_records;
+    auto iter = sorted.begin();
+    while (iter != sorted.end()) {
         // Append the entry. Note that append_file_entry may fail, but that only affects one
         // variable; soldier on.
-        const wcstring &key = iter->first;
-        const env_var_t &var = iter->second;
-        append_file_entry(var.exportv ? SET_EXPORT : SET, key, var.as_string(), &contents,
-                          &storage);
+        const wcstring &key = (*iter)->first;
+        const env_var_t &var = (*iter)->second;
+        const size_t start = contents.size();
+        if (append_file_entry(var.exportv ? SET_EXPORT : SET, key, var.as_string(), &contents,
+                              &storage)) {
+            remember_raw_record(contents, start, &new_raw_records);
+        }
 
         // Go to next.
         ++iter;
 
         // Flush if this is the last iteration or we exceed a page.
-        if (iter == vars.end() || contents.size() >= 4096) {
+        if (iter == sorted.end() || contents.size() >= 4096) {
             if (write_loop(fd, contents.data(), contents.size()) < 0) {
                 const char *error = strerror(errno);
                 debug(0, _(L"Unable to write to universal variables file '%ls': %s"), path.c_str(),
@@ -463,17 +572,82 @@ bool env_universal_t::write_to_fd(int fd, const wcstring &path) {
                 success = false;
                 break;
             }
+            amt_written += contents.size();
             contents.clear();
         }
     }
 
     // Since we just wrote out this file, it matches our internal state; pretend we read from it.
-    this->last_read_file = file_id_for_fd(fd);
+    this->raw_records = std::move(new_raw_records);
+    this->note_read_position(fd, file_id_for_fd(fd), amt_written, vars.size());
 
     // We don't close the file.
     return success;
 }
 
+bool env_universal_t::should_append_to_fd(int fd) const {
+    // Only append to a file we have read entirely, which does not end in a partial line, and which
+    // isn't carrying too many records that later ones supersede.
+    file_id_t file = file_id_for_fd(fd);
+    if (last_read_offset == 0 || file.device != last_read_file.device ||
+        file.inode != last_read_file.inode || file.size != last_read_offset) {
+        return false;
+    }
+
+    // The file may be shared with older versions of fish, which only understand SET and SET_EXPORT
+    // records (the last one for a key wins). There is no record for erasing a variable, so that
+    // takes a rewrite.
+    for (const wcstring &key : modified) {
+        if (vars.find(key) == vars.end()) return false;
+    }
+    return last_read_record_count + modified.size() <= 2 * vars.size() + UVAR_FILE_RECORD_SLACK;
+}
+
+/// Appends records for our modified variables to the fd, which we must have read entirely. None of
+/// them may have been erased. path is provided only for error reporting.
+bool env_universal_t::append_to_fd(int fd, const wcstring &path) {
+    ASSERT_IS_LOCKED(lock);
+    assert(fd >= 0);
+
+    // Append in order of name, so the file doesn't depend on hashing.
+    std::vector<wcstring> keys(modified.begin(), modified.end());
+    std::sort(keys.begin(), keys.end());
+
+    std::string contents;
+    std::string storage;
+    size_t record_count = 0;
+    std::vector<size_t> record_starts;
+    for (const wcstring &key : keys) {
+        var_table_t::const_iterator where = vars.find(key);
+        assert(where != vars.end());
+        const env_var_t &var = where->second;
+        const size_t start = contents.size();
+        if (append_file_entry(var.exportv ? SET_EXPORT : SET, key, var.as_string(), &contents,
+                              &storage)) {
+            record_count++;
+            record_starts.push_back(start);
+        }
+    }
+
+    if (lseek(fd, last_read_offset, SEEK_SET) < 0 ||
+        write_loop(fd, contents.data(), contents.size()) < 0) {
+        const char *error = strerror(errno);
+        debug(0, _(L"Unable to write to universal variables file '%ls': %s"), path.c_str(),
+              error);
+        return false;
+    }
+
+    // The file now matches our internal state; pretend we read from it.
+    for (size_t i = 0; i < record_starts.size(); i++) {
+        const size_t end = i + 1 < record_starts.size() ? record_starts[i + 1] : contents.size();
+        remember_raw_record(contents.substr(record_starts[i], end - record_starts[i]), 0,
+                            &raw_records);
+    }
+    this->note_read_position(fd, file_id_for_fd(fd), last_read_offset + contents.size(),
+                             last_read_record_count + record_count);
+    return true;
+}
+
 bool env_universal_t::move_new_vars_file_into_place(const wcstring &src, const wcstring &dst) {
     int ret = wrename(src, dst);
     if (ret != 0) {
@@ -689,20 +863,28 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
         this->load_from_fd(vars_fd, callbacks);
     }
 
+    // Usually it suffices to append records for what we changed. Otherwise, or if that fails,
+    // rewrite the file.
+    bool appended = false;
+    if (success && this->should_append_to_fd(vars_fd)) {
+        appended = this->append_to_fd(vars_fd, vars_path);
+        if (!appended) debug(5, L"universal log append_to_fd() failed");
+    }
+
     // Open adjacent temporary file.
-    if (success) {
+    if (success && !appended) {
         success = this->open_temporary_file(directory, &private_file_path, &private_fd);
         if (!success) debug(5, L"universal log open_temporary_file() failed");
     }
 
     // Write to it.
-    if (success) {
+    if (success && !appended) {
         assert(private_fd >= 0);
         success = this->write_to_fd(private_fd, private_file_path);
         if (!success) debug(5, L"universal log write_to_fd() failed");
     }
 
-    if (success) {
+    if (success && !appended) {
         // Ensure we maintain ownership and permissions (#2176).
         struct stat sbuf;
         if (wstat(vars_path, &sbuf) >= 0) {
@@ -732,7 +914,7 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
         if (!success) debug(5, L"universal log move_new_vars_file_into_place() failed");
     }
 
-    if (success) {
+    if (success && !appended) {
         // Since we moved the new file into place, clear the path so we don't try to unlink it.
         private_file_path.clear();
     }
@@ -756,61 +938,80 @@ bool env_universal_t::sync(callback_data_list_t &callbacks) {
     return success;
 }
 
-var_table_t env_universal_t::read_message_internal(int fd) {
-    var_table_t result;
+uint64_t env_universal_t::read_message_internal(int fd, uint64_t offset, var_table_t *vars,
+                                               raw_record_map_t *raw_records,
+                                               size_t *record_count) const {
+    // Map the file. If we can't, read it.
+    struct stat buf = {};
+    if (fstat(fd, &buf) < 0 || buf.st_size <= 0 || (uint64_t)buf.st_size <= offset) return 0;
+    const size_t file_size = (size_t)buf.st_size;
+
+    std::string read_contents;
+    const char *contents = NULL;
+    void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+        contents = static_cast<const char *>(mapping);
+    } else {
+        read_contents.resize(file_size);
+        ssize_t amt = pread(fd, &read_contents[0], file_size, 0);
+        read_contents.resize(amt > 0 ? amt : 0);
+        contents = read_contents.data();
+    }
+    const char *const contents_end =
+        contents + (mapping != MAP_FAILED ? file_size : read_contents.size());
 
-    // Temp value used to avoid repeated allocations.
+    // Temp values used to avoid repeated allocations.
     wcstring storage;
-
-    // The line we construct (and then parse).
-    std::string line;
     wcstring wide_line;
-    for (;;) {
-        // Read into a buffer. Note this is NOT null-terminated!
-        char buffer[1024];
-        ssize_t amt = read_loop(fd, buffer, sizeof buffer);
-        if (amt <= 0) {
-            break;
-        }
-        const size_t bufflen = (size_t)amt;
-
-        // Walk over it by lines. The contents of an unterminated line will be left in 'line' for
-        // the next iteration.
-        ssize_t line_start = 0;
-        while (line_start < amt) {
-            // Run until we hit a newline.
-            size_t cursor = line_start;
-            while (cursor < bufflen && buffer[cursor] != '\n') {
-                cursor++;
-            }
-
-            // Copy over what we read.
-            line.append(buffer + line_start, cursor - line_start);
-
-            // Process it if it's a newline (which is true if we are before the end of the buffer).
-            if (cursor < bufflen && !line.empty()) {
-                if (utf8_to_wchar(line.data(), line.size(), &wide_line, 0)) {
-                    env_universal_t::parse_message_internal(wide_line, &result, &storage);
+    std::string key;
+
+    // Walk over the contents by lines, up to the last complete one. We make no effort to handle an
+    // unterminated last line, but leave it to be read again once it is complete.
+    const char *line = contents + offset;
+    const char *newline;
+    while (line < contents_end && (newline = std::find(line, contents_end, '\n')) != contents_end) {
+        const size_t len = newline - line;
+        const char *record = line;
+        line = newline + 1;
+        if (len == 0 || record[0] == '#') continue;
+        *record_count += 1;
+
+        // Most records are the same as when we last read them. Compare their bytes first, and if
+        // they match keep the variable we have rather than decoding it again.
+        size_t key_start, key_end;
+        const bool has_key = find_record_key(record, len, &key_start, &key_end);
+        if (has_key) {
+            key.assign(record + key_start, key_end - key_start);
+            auto raw = this->raw_records.find(key);
+            if (raw != this->raw_records.end() && raw->second.size() == len &&
+                !memcmp(raw->second.data(), record, len)) {
+                const wcstring wide_key = str2wcstring(key);
+                auto existing = this->vars.find(wide_key);
+                if (existing != this->vars.end() && !this->modified.count(wide_key)) {
+                    (*vars)[wide_key] = existing->second;
+                    if (raw_records != &this->raw_records) (*raw_records)[key] = raw->second;
+                    continue;
                 }
-                line.clear();
             }
+        }
 
-            // Skip over the newline (or skip past the end).
-            line_start = cursor + 1;
+        if (utf8_to_wchar(record, len, &wide_line, 0)) {
+            env_universal_t::parse_message_internal(wide_line, vars, &storage);
         }
+        if (has_key) (*raw_records)[key].assign(record, len);
     }
 
-    // We make no effort to handle an unterminated last line.
-    return result;
+    if (mapping != MAP_FAILED) munmap(mapping, file_size);
+    return line - (contents + offset);
 }
 
-/// Parse message msg/
-void env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t *vars,
+/// Parse message msg/. Returns false if the message was not understood.
+bool env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t *vars,
                                              wcstring *storage) {
     const wchar_t *msg = msgstr.c_str();
 
     // debug(3, L"parse_message( %ls );", msg);
-    if (msg[0] == L'#') return;
+    if (msg[0] == L'#') return true;
 
     bool is_set_export = match(msg, SET_EXPORT_STR);
     bool is_set = !is_set_export && match(msg, SET_STR);
@@ -832,13 +1033,16 @@ void env_universal_t::parse_message_internal(const wcstring &msgstr, var_table_t
                 env_var_t &entry = (*vars)[key];
                 entry.exportv = exportv;
                 entry.set_vals(decode_serialized(val));
+                return true;
             }
+            return false;
         } else {
             debug(1, PARSE_ERR, msg);
         }
     } else {
         debug(1, PARSE_ERR, msg);
     }
+    return false;
 }
 
 /// Maximum length of hostname. Longer hostnames are truncated.
@@ -1162,6 +1366,215 @@ class universal_notifier_notifyd_t : public universal_notifier_t {
 #endif
 };
 
+#if FISH_INOTIFY_AVAILABLE || FISH_KQUEUE_AVAILABLE
+// How often to try again to watch the directory of the variables file, if it could not be watched
+// (for example because it does not exist yet).
+#define FILE_WATCH_RETRY_DURATION_USEC (1000000)
+#endif
+
+/// An inotify-based notifier, for Linux. Every sync that changes variables either appends to the
+/// variables file or moves a new one into place, so watching the file's directory for that is all
+/// the notification we need: post_notification() has nothing to do, and no polling is required.
+class universal_notifier_inotify_t : public universal_notifier_t {
+#if FISH_INOTIFY_AVAILABLE
+    int inotify_fd;
+    int watch_descriptor;
+    const wcstring vars_path;
+    const std::string vars_name;
+
+    bool add_watch() {
+        const std::string dir = wcs2string(wdirname(vars_path));
+        watch_descriptor = inotify_add_watch(inotify_fd, dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE);
+        return watch_descriptor >= 0;
+    }
+
+    bool wants_watch() const {
+        return inotify_fd >= 0 && watch_descriptor < 0 && !vars_path.empty();
+    }
+
+   public:
+    explicit universal_notifier_inotify_t(const wchar_t *test_path)
+        : inotify_fd(-1),
+          watch_descriptor(-1),
+          vars_path(test_path ? wcstring(test_path) : default_vars_path()),
+          vars_name(wcs2string(wbasename(vars_path))) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            const char *error = strerror(errno);
+            debug(0, _(L"Unable to watch universal variables with inotify: %s"), error);
+            return;
+        }
+        if (!vars_path.empty()) add_watch();
+    }
+
+    ~universal_notifier_inotify_t() {
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+    }
+
+    int notification_fd() { return watch_descriptor >= 0 ? inotify_fd : -1; }
+
+    bool notification_fd_became_readable(int fd) {
+        assert(fd == inotify_fd);
+        // Drain all events. Only those for the variables file itself count; the directory may hold
+        // other files, including the temporary file that a sync writes before moving it in place.
+        bool changed = false;
+        alignas(struct inotify_event) char buff[4096];
+        ssize_t amt_read;
+        while ((amt_read = read(inotify_fd, buff, sizeof buff)) > 0) {
+            ssize_t offset = 0;
+            while (offset < amt_read) {
+                const struct inotify_event *event =
+                    reinterpret_cast<const struct inotify_event *>(buff + offset);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    changed = true;
+                } else if (event->mask & IN_IGNORED) {
+                    // The directory went away; poll until we can watch it again.
+                    watch_descriptor = -1;
+                } else if (event->len > 0 && vars_name == event->name) {
+                    changed = true;
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+
+    unsigned long usec_delay_between_polls() const {
+        return wants_watch() ? FILE_WATCH_RETRY_DURATION_USEC : 0;
+    }
+
+    bool notification_fd_reports_all_changes() const { return true; }
+
+    bool poll() {
+        // The file may have been written before we managed to watch it, so report a change once we
+        // do.
+        return wants_watch() && add_watch();
+    }
+#else  // this class isn't valid on this system
+   public:
+    explicit universal_notifier_inotify_t(const wchar_t *test_path) {
+        static_cast<void>(test_path);
+        DIE("universal_notifier_inotify_t cannot be used on this system");
+    }
+#endif
+};
+
+/// A kqueue-based notifier, for the BSDs. This is the same idea as the inotify notifier, but kqueue
+/// watches open files rather than names. So we watch the directory, which is written to when a new
+/// variables file is moved into place (and also when anything else in it changes, causing harmless
+/// extra syncs), and the variables file itself, which is written to when records are appended.
+class universal_notifier_kqueue_t : public universal_notifier_t {
+#if FISH_KQUEUE_AVAILABLE
+    int kqueue_fd;
+    int dir_fd;
+    int file_fd;
+    const wcstring vars_path;
+
+    bool watch(int fd) {
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME, 0, 0);
+        if (kevent(kqueue_fd, &change, 1, NULL, 0, NULL) < 0) {
+            wperror(L"kevent");
+            return false;
+        }
+        return true;
+    }
+
+    bool add_watch() {
+        dir_fd = wopen_cloexec(wdirname(vars_path), O_RDONLY);
+        if (dir_fd >= 0 && !watch(dir_fd)) close_fd(&dir_fd);
+        if (dir_fd >= 0) rewatch_file();
+        return dir_fd >= 0;
+    }
+
+    // The variables file may have been replaced, so watch whatever is there now. It need not exist,
+    // since the directory tells us when it appears.
+    void rewatch_file() {
+        close_fd(&file_fd);
+        file_fd = wopen_cloexec(vars_path, O_RDONLY);
+        if (file_fd >= 0 && !watch(file_fd)) close_fd(&file_fd);
+    }
+
+    static void close_fd(int *fd) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+
+    bool wants_watch() const { return kqueue_fd >= 0 && dir_fd < 0 && !vars_path.empty(); }
+
+   public:
+    explicit universal_notifier_kqueue_t(const wchar_t *test_path)
+        : kqueue_fd(-1),
+          dir_fd(-1),
+          file_fd(-1),
+          vars_path(test_path ? wcstring(test_path) : default_vars_path()) {
+        kqueue_fd = kqueue();
+        if (kqueue_fd < 0) {
+            const char *error = strerror(errno);
+            debug(0, _(L"Unable to watch universal variables with kqueue: %s"), error);
+            return;
+        }
+        set_cloexec(kqueue_fd);
+        if (!vars_path.empty()) add_watch();
+    }
+
+    ~universal_notifier_kqueue_t() {
+        close_fd(&file_fd);
+        close_fd(&dir_fd);
+        close_fd(&kqueue_fd);
+    }
+
+    int notification_fd() { return dir_fd >= 0 ? kqueue_fd : -1; }
+
+    bool notification_fd_became_readable(int fd) {
+        assert(fd == kqueue_fd);
+        bool changed = false;
+        bool dir_gone = false;
+        struct kevent events[8];
+        const struct timespec no_wait = {0, 0};
+        int count;
+        while ((count = kevent(kqueue_fd, NULL, 0, events, 8, &no_wait)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if ((int)events[i].ident == dir_fd &&
+                    (events[i].fflags & (NOTE_DELETE | NOTE_RENAME))) {
+                    dir_gone = true;
+                }
+            }
+            changed = true;
+            if (count < 8) break;
+        }
+
+        if (dir_gone) {
+            // Poll until we can watch the directory again.
+            close_fd(&file_fd);
+            close_fd(&dir_fd);
+        } else if (changed) {
+            rewatch_file();
+        }
+        return changed;
+    }
+
+    unsigned long usec_delay_between_polls() const {
+        return wants_watch() ? FILE_WATCH_RETRY_DURATION_USEC : 0;
+    }
+
+    bool notification_fd_reports_all_changes() const { return true; }
+
+    bool poll() { return wants_watch() && add_watch(); }
+#else  // this class isn't valid on this system
+   public:
+    explicit universal_notifier_kqueue_t(const wchar_t *test_path) {
+        static_cast<void>(test_path);
+        DIE("universal_notifier_kqueue_t cannot be used on this system");
+    }
+#endif
+};
+
 #if !defined(__APPLE__) && !defined(__CYGWIN__)
 #define NAMED_PIPE_FLASH_DURATION_USEC (1e5)
 #define SUSTAINED_READABILITY_CLEANUP_DURATION_USEC (5 * 1e6)
@@ -1338,6 +1751,10 @@ universal_notifier_t::notifier_strategy_t universal_notifier_t::resolve_default_
     return strategy_notifyd;
 #elif defined(__CYGWIN__)
     return strategy_shmem_polling;
+#elif FISH_INOTIFY_AVAILABLE
+    return strategy_inotify;
+#elif FISH_KQUEUE_AVAILABLE
+    return strategy_kqueue;
 #else
     return strategy_named_pipe;
 #endif
@@ -1361,6 +1778,12 @@ std::unique_ptr<universal_notifier_t> universal_notifier_t::new_notifier_for_str
         case strategy_named_pipe: {
             return make_unique<universal_notifier_named_pipe_t>(test_path);
         }
+        case strategy_inotify: {
+            return make_unique<universal_notifier_inotify_t>(test_path);
+        }
+        case strategy_kqueue: {
+            return make_unique<universal_notifier_kqueue_t>(test_path);
+        }
     }
     DIE("should never reach this statement");
     return NULL;
@@ -1384,6 +1807,8 @@ bool universal_notifier_t::notification_fd_became_readable(int fd) {
     return false;
 }
 
+bool universal_notifier_t::notification_fd_reports_all_changes() const { return false; }
+
 #if !defined(__APPLE__) && !defined(__CYGWIN__)
 void universal_notifier_named_pipe_t::make_pipe(const wchar_t *test_path) {
     wcstring vars_path = test_path ? wcstring(test_path) : default_named_pipe_path();
@@ -6,6 +6,8 @@
 #include <stdio.h>
 
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -30,8 +32,17 @@ typedef std::vector<struct callback_data_t> callback_data_list_t;
 
 /// Class representing universal variables.
 class env_universal_t {
+   public:
+    // Map from (UTF-8) variable name to the raw record for it in the file, without the newline.
+    typedef std::unordered_map<std::string, std::string> raw_record_map_t;
+
+   private:
     var_table_t vars;  // current values
 
+    // The records for our variables as they appear in the file, as of when we last read or wrote
+    // it. When reading the file again, records that are unchanged need not be decoded.
+    raw_record_map_t raw_records;
+
     // Keys that have been modified, and need to be written. A value here that is not present in
     // vars indicates a deleted value.
     std::unordered_set<wcstring> modified;
@@ -51,11 +62,28 @@ class env_universal_t {
     bool open_and_acquire_lock(const wcstring &path, int *out_fd);
     bool open_temporary_file(const wcstring &directory, wcstring *out_path, int *out_fd);
     bool write_to_fd(int fd, const wcstring &path);
+    bool should_append_to_fd(int fd) const;
+    bool append_to_fd(int fd, const wcstring &path);
     bool move_new_vars_file_into_place(const wcstring &src, const wcstring &dst);
 
     // File id from which we last read.
     file_id_t last_read_file;
 
+    // Syncs append records for the variables they changed to the file, and only rewrite it once it
+    // holds too many superseded records. So we remember how far we read the file (up to the end of
+    // its last complete line), how many records that was, and its last few bytes, so we can
+    // recognize it later and only read what was appended.
+    uint64_t last_read_offset;
+    size_t last_read_record_count;
+    std::string last_read_marker;
+
+    // Remember that we have read the given file up to the given offset.
+    void note_read_position(int fd, const file_id_t &file, uint64_t offset, size_t record_count);
+
+    // Returns whether the file is the one we last read, with possibly more records after what we
+    // read.
+    bool file_was_appended_to(int fd, const file_id_t &file) const;
+
     // Given a variable table, generate callbacks representing the difference between our vars and
     // the new vars.
     void generate_callbacks(const var_table_t &new_vars, callback_data_list_t &callbacks) const;
@@ -64,8 +92,11 @@ class env_universal_t {
     // vars_to_acquire.
     void acquire_variables(var_table_t &vars_to_acquire);
 
-    static void parse_message_internal(const wcstring &msg, var_table_t *vars, wcstring *storage);
-    static var_table_t read_message_internal(int fd);
+    // Reads the records after the given offset in the fd into vars, and remembers them in
+    // raw_records. Returns how many bytes were consumed; adds the number of records read to
+    // *record_count. Records that match raw_records reuse our variables rather than being decoded.
+    uint64_t read_message_internal(int fd, uint64_t offset, var_table_t *vars,
+                                   raw_record_map_t *raw_records, size_t *record_count) const;
 
    public:
     explicit env_universal_t(const wcstring &path);
@@ -91,6 +122,10 @@ class env_universal_t {
     /// Reads and writes variables at the correct path. Returns true if modified variables were
     /// written.
     bool sync(callback_data_list_t &callbacks);
+
+    /// Applies one record of the variables file, like "SET fish_color_cwd:FF0", to vars. storage
+    /// may be used for temporary storage. Returns false if the record was not understood.
+    static bool parse_message_internal(const wcstring &msg, var_table_t *vars, wcstring *storage);
 };
 
 /// The "universal notifier" is an object responsible for broadcasting and receiving universal
@@ -121,6 +156,12 @@ class universal_notifier_t {
         // Strategy that uses a named pipe. Somewhat complex, but portable and doesn't require
         // polling most of the time.
         strategy_named_pipe,
+        // Strategy that watches the variables file with inotify(7). Simple and efficient, but
+        // Linux only.
+        strategy_inotify,
+        // Strategy that watches the variables file and its directory with kqueue(2). Simple and
+        // efficient, but BSD only.
+        strategy_kqueue,
     };
 
    protected:
@@ -157,6 +198,10 @@ class universal_notifier_t {
     // The notification_fd is readable; drain it. Returns true if a notification is considered to
     // have been posted.
     virtual bool notification_fd_became_readable(int fd);
+
+    // Returns whether every change to the variables file makes notification_fd() readable (while it
+    // is valid), so that there is no need to check the file until it is.
+    virtual bool notification_fd_reports_all_changes() const;
 };
 
 // Environment variable for requesting a particular universal notifier. See
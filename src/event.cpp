@@ -6,10 +6,12 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 
 #include "common.h"
 #include "event.h"
@@ -21,35 +23,117 @@
 #include "signal.h"
 #include "wutil.h"  // IWYU pragma: keep
 
-/// Number of signals that can be queued before an overflow occurs.
-#define SIG_UNHANDLED_MAX 64
+/// Number of deliveries of each signal that have not been dispatched yet. These are written by
+/// signal handlers, so they are lock-free atomics, and a burst of one signal only grows its count
+/// rather than filling up a queue.
+static std::atomic<unsigned> s_pending_signals[NSIG];
 
-/// This struct contains a list of generated signals waiting to be dispatched.
-typedef struct {
-    /// Number of delivered signals.
-    volatile int count;
-    /// Whether signals have been skipped.
-    volatile int overflow;
-    /// Array of signal events.
-    volatile int signal[SIG_UNHANDLED_MAX];
-} signal_list_t;
-
-/// The signal event list. Actually two separate lists. One which is active, which is the one that
-/// new events is written to. The inactive one contains the events that are currently beeing
-/// performed.
-static signal_list_t sig_list[2] = {{}, {}};
-
-/// The index of sig_list that is the list of signals currently written to.
-static volatile int active_list = 0;
+/// Set when any pending count may be non-zero, so that dispatching can skip scanning the counts.
+static std::atomic<bool> s_signals_pending{false};
 
 typedef std::vector<shared_ptr<event_t>> event_list_t;
 
-/// List of event handlers.
+/// List of event handlers, in the order they were added.
 static event_list_t s_event_handlers;
 
+/// The key under which a handler is indexed: its type, plus the signal, pid or job id for the
+/// types that take one, or the variable or generic event name.
+struct event_key_t {
+    int type;
+    int param;
+    wcstring name;
+
+    bool operator==(const event_key_t &rhs) const {
+        return type == rhs.type && param == rhs.param && name == rhs.name;
+    }
+};
+
+struct event_key_hash_t {
+    size_t operator()(const event_key_t &key) const {
+        return std::hash<wcstring>()(key.name) ^ (size_t(key.type) << 24) ^ size_t(key.param);
+    }
+};
+
+/// An indexed handler, remembering when it was added so handlers from different buckets still fire
+/// in registration order.
+struct indexed_handler_t {
+    uint64_t order;
+    shared_ptr<event_t> handler;
+};
+
+/// Event handlers grouped by key, so dispatching an event only visits handlers that can match it.
+/// Handlers of type EVENT_ANY live under the key {EVENT_ANY, 0, L""}.
+static std::unordered_map<event_key_t, std::vector<indexed_handler_t>, event_key_hash_t>
+    s_handler_index;
+
+/// Counter handing out the registration order of handlers.
+static uint64_t s_handler_order = 0;
+
+/// Returns the index key for the given handler or event.
+static event_key_t event_key(const event_t &event) {
+    switch (event.type) {
+        case EVENT_SIGNAL: {
+            return {event.type, event.param1.signal, wcstring()};
+        }
+        case EVENT_EXIT: {
+            return {event.type, event.param1.pid, wcstring()};
+        }
+        case EVENT_JOB_ID: {
+            return {event.type, event.param1.job_id, wcstring()};
+        }
+        case EVENT_VARIABLE:
+        case EVENT_GENERIC: {
+            return {event.type, 0, event.str_param1};
+        }
+        default: {
+            return {event.type, 0, wcstring()};
+        }
+    }
+}
+
+/// Returns the indexed handlers stored under \p key, or NULL if there are none.
+static const std::vector<indexed_handler_t> *indexed_handlers(const event_key_t &key) {
+    auto where = s_handler_index.find(key);
+    return where == s_handler_index.end() ? NULL : &where->second;
+}
+
+/// Removes \p handler from the index.
+static void unindex_handler(const shared_ptr<event_t> &handler) {
+    auto where = s_handler_index.find(event_key(*handler));
+    if (where == s_handler_index.end()) return;
+    std::vector<indexed_handler_t> &bucket = where->second;
+    for (auto iter = bucket.begin(); iter != bucket.end(); ++iter) {
+        if (iter->handler == handler) {
+            bucket.erase(iter);
+            break;
+        }
+    }
+    if (bucket.empty()) s_handler_index.erase(where);
+}
+
+/// Returns whether \p handler is still registered.
+static bool handler_is_registered(const shared_ptr<event_t> &handler) {
+    const std::vector<indexed_handler_t> *bucket = indexed_handlers(event_key(*handler));
+    if (!bucket) return false;
+    for (const indexed_handler_t &entry : *bucket) {
+        if (entry.handler == handler) return true;
+    }
+    return false;
+}
+
 /// List of events that have been sent but have not yet been delivered because they are blocked.
 static event_list_t blocked;
 
+/// Whether variable events fired inside a job are deferred until the outermost job finishes.
+static bool s_coalesce_variables = false;
+
+/// Number of jobs currently running, as counted by event_job_scope_t.
+static int s_job_depth = 0;
+
+/// Variable events deferred while coalescing, at most one per variable, in the order the variables
+/// first changed.
+static std::vector<event_t> s_deferred_variable_events;
+
 /// Variables (one per signal) set when a signal is observed. This is inspected by a signal handler.
 static volatile bool s_observed_signals[NSIG] = {};
 static void set_signal_observed(int sig, bool val) {
@@ -256,6 +340,7 @@ void event_add_handler(const event_t &event) {
         set_signal_observed(e->param1.signal, true);
     }
 
+    s_handler_index[event_key(*e)].push_back({s_handler_order++, e});
     s_event_handlers.push_back(std::move(e));
 }
 
@@ -282,6 +367,7 @@ void event_remove(const event_t &criterion) {
                 set_signal_observed(e.param1.signal, 0);
             }
         }
+        unindex_handler(*iter);
         iter = s_event_handlers.erase(iter);
     }
 }
@@ -307,6 +393,49 @@ bool event_is_signal_observed(int sig) {
     return result;
 }
 
+bool event_is_variable_observed(const wcstring &name) {
+    if (s_handler_index.empty()) return false;
+    return indexed_handlers({EVENT_VARIABLE, 0, name}) || indexed_handlers({EVENT_ANY, 0, L""});
+}
+
+/// Collects the handlers which match \p event into \p out, in registration order. Only the index
+/// buckets that could hold a match are visited.
+static void event_get_matching(const event_t &event, event_list_t *out) {
+    if (s_handler_index.empty()) return;
+
+    // The buckets holding candidates: handlers for this exact event, wildcard handlers for its
+    // type, and handlers of any type.
+    const std::vector<indexed_handler_t> *buckets[3] = {};
+    size_t bucket_count = 0;
+    if (const auto *exact = indexed_handlers(event_key(event))) buckets[bucket_count++] = exact;
+    if (event.type == EVENT_SIGNAL && event.param1.signal != EVENT_ANY_SIGNAL) {
+        const auto *any = indexed_handlers({EVENT_SIGNAL, EVENT_ANY_SIGNAL, L""});
+        if (any) buckets[bucket_count++] = any;
+    } else if (event.type == EVENT_EXIT && event.param1.pid != EVENT_ANY_PID) {
+        const auto *any = indexed_handlers({EVENT_EXIT, EVENT_ANY_PID, L""});
+        if (any) buckets[bucket_count++] = any;
+    }
+    if (event.type != EVENT_ANY) {
+        const auto *any = indexed_handlers({EVENT_ANY, 0, L""});
+        if (any) buckets[bucket_count++] = any;
+    }
+    if (bucket_count == 0) return;
+
+    std::vector<indexed_handler_t> candidates;
+    for (size_t i = 0; i < bucket_count; i++) {
+        for (const indexed_handler_t &entry : *buckets[i]) {
+            if (event_match(*entry.handler, event)) candidates.push_back(entry);
+        }
+    }
+    if (bucket_count > 1) {
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const indexed_handler_t &a, const indexed_handler_t &b) {
+                      return a.order < b.order;
+                  });
+    }
+    for (indexed_handler_t &entry : candidates) out->push_back(std::move(entry.handler));
+}
+
 /// Perform the specified event. Since almost all event firings will not be matched by even a single
 /// event handler, we make sure to optimize the 'no matches' path. This means that nothing is
 /// allocated/initialized unless needed.
@@ -315,12 +444,7 @@ static void event_fire_internal(const event_t &event) {
     // to do this in a separate step since an event handler might call event_remove or
     // event_add_handler, which will change the contents of the \c events list.
     event_list_t fire;
-    for (shared_ptr<event_t> &criterion : s_event_handlers) {
-        // Check if this event is a match.
-        if (event_match(*criterion, event)) {
-            fire.push_back(criterion);
-        }
-    }
+    event_get_matching(event, &fire);
 
     // No matches. Time to return.
     if (fire.empty()) return;
@@ -338,10 +462,7 @@ static void event_fire_internal(const event_t &event) {
     // Iterate over our list of matching events.
     for (shared_ptr<event_t> &criterion : fire) {
         // Only fire if this event is still present
-        if (std::find(s_event_handlers.begin(), s_event_handlers.end(), criterion) ==
-            s_event_handlers.end()) {
-            continue;
-        }
+        if (!handler_is_registered(criterion)) continue;
 
         // Fire event.
         wcstring buffer = criterion->function_name;
@@ -386,48 +507,76 @@ static void event_fire_delayed() {
         }
     }
 
-    int al = active_list;
-
-    while (sig_list[al].count > 0) {
-        signal_list_t *lst;
-
-        // Switch signal lists.
-        sig_list[1 - al].count = 0;
-        sig_list[1 - al].overflow = 0;
-        al = 1 - al;
-        active_list = al;
-
-        // Set up.
-        lst = &sig_list[1 - al];
-        if (lst->overflow) {
-            debug(0, _(L"Signal list overflow. Signals have been ignored."));
+    // Handlers may run for a while, so signals delivered meanwhile are picked up by another pass.
+    // Signals that are blocked are counted separately and put back afterwards.
+    unsigned still_blocked[NSIG] = {};
+    bool any_blocked = false;
+    while (s_signals_pending.exchange(false)) {
+        for (int signal = 1; signal < NSIG; signal++) {
+            unsigned count = s_pending_signals[signal].exchange(0);
+            if (count == 0) continue;
+
+            event_t e = event_t::signal_event(signal);
+            if (event_is_blocked(e)) {
+                still_blocked[signal] += count;
+                any_blocked = true;
+                continue;
+            }
+            e.arguments.push_back(sig2wcs(signal));
+            while (count--) event_fire_internal(e);
         }
+    }
 
-        // Send all signals in our private list.
-        for (int i = 0; i < lst->count; i++) {
-            shared_ptr<event_t> e = std::make_shared<event_t>(EVENT_SIGNAL);
-            int signal = lst->signal[i];
-            e->param1.signal = signal;
-            e->arguments.push_back(sig2wcs(signal));
-            if (event_is_blocked(*e)) {
-                blocked.push_back(e);
-            } else {
-                event_fire_internal(*e);
-            }
+    if (any_blocked) {
+        for (int signal = 1; signal < NSIG; signal++) {
+            if (still_blocked[signal]) s_pending_signals[signal] += still_blocked[signal];
         }
+        s_signals_pending = true;
     }
 }
 
 void event_fire_signal(int signal) {
     // This means we are in a signal handler. We must be very careful not do do anything that could
     // cause a memory allocation or something else that might be bad when in a signal handler.
-    if (sig_list[active_list].count < SIG_UNHANDLED_MAX)
-        sig_list[active_list].signal[sig_list[active_list].count++] = signal;
-    else
-        sig_list[active_list].overflow = 1;
+    if (signal <= 0 || signal >= NSIG) return;
+    s_pending_signals[signal]++;
+    s_signals_pending = true;
+}
+
+/// Defers the variable event \p event if variable events are being coalesced. A later event for
+/// the same variable replaces the earlier one in place. Returns whether the event was deferred.
+static bool event_defer_variable(const event_t &event) {
+    if (!s_coalesce_variables || s_job_depth == 0) return false;
+    for (event_t &deferred : s_deferred_variable_events) {
+        if (deferred.str_param1 == event.str_param1) {
+            deferred.arguments = event.arguments;
+            return true;
+        }
+    }
+    s_deferred_variable_events.push_back(event);
+    return true;
+}
+
+void event_set_coalesce_variables(bool coalesce) { s_coalesce_variables = coalesce; }
+
+event_job_scope_t::event_job_scope_t() { s_job_depth++; }
+
+event_job_scope_t::~event_job_scope_t() {
+    ASSERT_IS_MAIN_THREAD();
+    if (--s_job_depth > 0) return;
+    // Handlers run jobs of their own, so they may defer further events, which are picked up by the
+    // next pass of this loop.
+    while (!s_deferred_variable_events.empty()) {
+        std::vector<event_t> deferred;
+        deferred.swap(s_deferred_variable_events);
+        for (const event_t &event : deferred) event_fire(&event);
+    }
 }
 
 void event_fire(const event_t *event) {
+    if (event && event->type == EVENT_VARIABLE && event_defer_variable(*event)) {
+        return;
+    }
     if (event && event->type == EVENT_SIGNAL) {
         event_fire_signal(event->param1.signal);
     } else {
@@ -450,7 +599,11 @@ void event_fire(const event_t *event) {
 
 void event_init() {}
 
-void event_destroy() { s_event_handlers.clear(); }
+void event_destroy() {
+    s_deferred_variable_events.clear();
+    s_event_handlers.clear();
+    s_handler_index.clear();
+}
 
 void event_fire_generic(const wchar_t *name, wcstring_list_t *args) {
     CHECK(name, );
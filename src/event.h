@@ -108,6 +108,9 @@ int event_get(const event_t &criterion, std::vector<std::shared_ptr<event_t>> *o
 /// a signal handler.
 bool event_is_signal_observed(int signal);
 
+/// Returns whether any event handler would fire when the variable with the given name is set.
+bool event_is_variable_observed(const wcstring &name);
+
 /// Fire the specified event. The function_name field of the event must be set to 0. If the event is
 /// of type EVENT_SIGNAL, no the event is queued, and will be dispatched the next time event_fire is
 /// called. If event is a null-pointer, all pending events are dispatched.
@@ -125,6 +128,20 @@ void event_fire(const event_t *event);
 /// May be called from signal handlers
 void event_fire_signal(int signal);
 
+/// Sets whether variable events are coalesced. While enabled, variable events fired inside a job
+/// are held back until the outermost job finishes, and then each changed variable fires once, with
+/// the operation of its last change. This is controlled by the fish_coalesce_variable_events
+/// variable.
+void event_set_coalesce_variables(bool coalesce);
+
+/// Marks the duration of a job for coalescing variable events. Deferred variable events are fired
+/// when the outermost of these is destroyed.
+class event_job_scope_t {
+   public:
+    event_job_scope_t();
+    ~event_job_scope_t();
+};
+
 /// Initialize the event-handling library.
 void event_init();
 
@@ -14,7 +14,10 @@
 #include <spawn.h>
 #endif
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -39,6 +42,7 @@
 #include "proc.h"
 #include "reader.h"
 #include "signal.h"
+#include "trace.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 /// File descriptor redirection error message.
@@ -53,8 +57,28 @@
 /// Base open mode to pass to calls to open.
 #define OPEN_MASK 0666
 
+/// Returns the microseconds since \p start, a value of timef(), for proc_note_spawn.
+static uint64_t usec_since(double start) {
+    double elapsed = timef() - start;
+    return elapsed > 0 ? (uint64_t)(elapsed * 1E6) : 0;
+}
+
 /// Called in a forked child.
 static void exec_write_and_exit(int fd, const char *buff, size_t count, int status) {
+#ifdef __linux__
+    // Hand our pages to the pipe instead of copying them into it. This is only safe because we
+    // exit right after, without touching the buffer again.
+    while (count > 0) {
+        struct iovec iov = {const_cast<char *>(buff), count};
+        ssize_t amt = vmsplice(fd, &iov, 1, 0);
+        if (amt < 0) {
+            if (errno == EINTR) continue;
+            break;  // not a pipe, so fall back to writing
+        }
+        buff += amt;
+        count -= amt;
+    }
+#endif
     if (write_loop(fd, buff, count) == -1) {
         debug(0, WRITE_ERROR);
         wperror(L"write");
@@ -84,22 +108,62 @@ void exec_close(int fd) {
 int exec_pipe(int fd[2]) {
     ASSERT_IS_MAIN_THREAD();
 
+    // Pipes ought to be cloexec. Pipes are dup2'd the corresponding fds; the resulting fds are not
+    // cloexec. Creating them that way saves a pair of fcntl calls per pipe.
     int res;
-    while ((res = pipe(fd))) {
+    while ((res = fish_pipe_cloexec(fd))) {
         if (errno != EINTR) {
             return res;  // caller will call wperror
         }
     }
 
     debug(4, L"Created pipe using fds %d and %d", fd[0], fd[1]);
-
-    // Pipes ought to be cloexec. Pipes are dup2'd the corresponding fds; the resulting fds are not
-    // cloexec.
-    set_cloexec(fd[0]);
-    set_cloexec(fd[1]);
     return res;
 }
 
+/// Returns true if the builtin only turns its arguments and input into output, without touching
+/// the state of the shell. Such builtins may run in a forked process as part of a pipeline.
+static bool builtin_can_run_in_child(const wchar_t *cmd) {
+    static const wchar_t *const pure_builtins[] = {L"echo", L"math", L"printf", L"string"};
+    for (const wchar_t *name : pure_builtins) {
+        if (!wcscmp(cmd, name)) return true;
+    }
+    return false;
+}
+
+/// Returns true if the builtin never runs other code, which might use the io chain, so its output
+/// may be passed on as it goes when it runs in the shell's process. Besides the builtins that can
+/// run in a child, that is history, unless it may be asked to change the history. It can't run in
+/// a child, since it reads files and starts threads. Listing all completions or the names of all
+/// functions does not load any either.
+static bool builtin_can_stream_output(const wchar_t *const *argv) {
+    if (builtin_can_run_in_child(argv[0])) return true;
+    if (!wcscmp(argv[0], L"complete")) return argv[1] == NULL;
+    if (!wcscmp(argv[0], L"functions")) {
+        static const wchar_t *const name_listings[] = {L"-a",  L"-n",    L"-an",
+                                                       L"-na", L"--all", L"--names"};
+        for (size_t i = 1; argv[i] != NULL; i++) {
+            bool lists_names = false;
+            for (const wchar_t *listing : name_listings) {
+                if (!wcscmp(argv[i], listing)) lists_names = true;
+            }
+            if (!lists_names) return false;
+        }
+        return true;
+    }
+    if (wcscmp(argv[0], L"history")) return false;
+
+    static const wchar_t *const history_changes[] = {L"clear",   L"delete",   L"merge",
+                                                     L"save",    L"--clear",  L"--delete",
+                                                     L"--merge", L"--save"};
+    for (size_t i = 1; argv[i] != NULL; i++) {
+        for (const wchar_t *change : history_changes) {
+            if (!wcscmp(argv[i], change)) return false;
+        }
+    }
+    return true;
+}
+
 /// Returns true if the redirection is a file redirection to a file other than /dev/null.
 static bool redirection_is_to_real_file(const io_data_t *io) {
     bool result = false;
@@ -115,18 +179,6 @@ static bool redirection_is_to_real_file(const io_data_t *io) {
     return result;
 }
 
-static bool chain_contains_redirection_to_real_file(const io_chain_t &io_chain) {
-    bool result = false;
-    for (size_t idx = 0; idx < io_chain.size(); idx++) {
-        const io_data_t *io = io_chain.at(idx).get();
-        if (redirection_is_to_real_file(io)) {
-            result = true;
-            break;
-        }
-    }
-    return result;
-}
-
 /// Returns the interpreter for the specified script. Returns NULL if file is not a script with a
 /// shebang.
 char *get_interpreter(const char *command, char *interpreter, size_t buff_size) {
@@ -201,6 +253,27 @@ static void safe_launch_process(process_t *p, const char *actual_cmd, const char
     exit_without_destructors(STATUS_EXEC_FAIL);
 }
 
+#if FISH_USE_VFORK
+namespace {
+/// What a vfork child needs in order to launch an external command.
+struct vfork_launch_t {
+    process_t *p;
+    const io_chain_t *io_chain;
+    const char *actual_cmd;
+    const char *const *argv;
+    const char *const *envv;
+};
+}  // namespace
+
+/// The child side of launching a process with execute_vfork.
+static int vfork_launch_process(void *arg) {
+    const vfork_launch_t *launch = static_cast<const vfork_launch_t *>(arg);
+    setup_child_process(launch->p, *launch->io_chain);
+    safe_launch_process(launch->p, launch->actual_cmd, launch->argv, launch->envv);
+    return STATUS_EXEC_FAIL;  // not reached
+}
+#endif
+
 /// This function is similar to launch_process, except it is not called after a fork (i.e. it only
 /// calls exec) and therefore it can allocate memory.
 static void launch_process_nofork(process_t *p) {
@@ -302,6 +375,82 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain,
     return success;
 }
 
+/// Returns whether opening the file of a redirection in the shell is the same as opening it in the
+/// child. That holds for regular files, which are also what a missing file becomes, and for
+/// /dev/null. Other files are left to the child: opening a fifo may block, and the likes of
+/// /dev/stdout depend on the redirections already made.
+static bool can_open_redirection_in_parent(const char *path) {
+    if (!strcmp(path, "/dev/null")) return true;
+    if (!strncmp(path, "/dev/", 5) || !strncmp(path, "/proc/", 6)) return false;
+    struct stat buf;
+    if (stat(path, &buf) == -1) return errno == ENOENT;
+    return S_ISREG(buf.st_mode);
+}
+
+/// Like io_transmogrify, but for a process we are about to posix_spawn: file redirections are
+/// opened here, close-on-exec and clear of the fds in the chain, and become fd redirections. This
+/// does not report errors. If it fails we fork instead, and the child reports them as usual.
+static bool open_redirections_for_spawn(const io_chain_t &in_chain, io_chain_t *out_chain,
+                                        std::vector<int> *out_opened_fds) {
+    assert(out_chain->empty() && out_opened_fds->empty());
+    bool success = true;
+    for (const shared_ptr<io_data_t> &in : in_chain) {
+        if (in->io_mode != IO_FILE) {
+            out_chain->push_back(in);
+            continue;
+        }
+
+        const io_file_t *in_file = static_cast<const io_file_t *>(in.get());
+        int fd = -1;
+        if (can_open_redirection_in_parent(in_file->filename_cstr)) {
+            fd = open(in_file->filename_cstr, in_file->flags, OPEN_MASK);
+        }
+        if (fd >= 0) {
+            set_cloexec(fd);
+            fd = move_fd_to_unused(fd, in_chain);
+        }
+        if (fd < 0) {
+            success = false;
+            break;
+        }
+        out_opened_fds->push_back(fd);
+        out_chain->push_back(std::make_shared<io_fd_t>(in->fd, fd, false));
+    }
+
+    if (!success) {
+        out_chain->clear();
+        io_cleanup_fds(*out_opened_fds);
+        out_opened_fds->clear();
+    }
+    return success;
+}
+
+/// Looks for where a builtin that runs in the shell's process can pass its output on as it goes,
+/// instead of collecting all of it first: the shell's own stdout, or a file redirection that is
+/// safe to open here. In the latter case the file is opened, the redirection in the chain becomes
+/// an fd redirection to it, and its fd is returned in out_opened_fd for the caller to close once
+/// the builtin's output is written. Returns the fd to stream to, or -1 to collect output as usual.
+static int open_builtin_stream_fd(io_chain_t *chain, int *out_opened_fd) {
+    *out_opened_fd = -1;
+    const shared_ptr<io_data_t> out = chain->get_io_for_fd(STDOUT_FILENO);
+    if (!out) return STDOUT_FILENO;
+    if (out->io_mode != IO_FILE) return -1;
+
+    const io_file_t *out_file = static_cast<const io_file_t *>(out.get());
+    if (!can_open_redirection_in_parent(out_file->filename_cstr)) return -1;
+    int fd = open(out_file->filename_cstr, out_file->flags, OPEN_MASK);
+    if (fd >= 0) {
+        set_cloexec(fd);
+        fd = move_fd_to_unused(fd, *chain);
+    }
+    if (fd < 0) return -1;  // a forked writer will report the error
+
+    std::replace(chain->begin(), chain->end(), out,
+                 shared_ptr<io_data_t>(std::make_shared<io_fd_t>(STDOUT_FILENO, fd, false)));
+    *out_opened_fd = fd;
+    return fd;
+}
+
 /// Morph an io redirection chain into redirections suitable for passing to eval, call eval, and
 /// clean up morphed redirections.
 ///
@@ -310,7 +459,8 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain,
 /// \param block_type the type of block to push on evaluation
 /// \param ios the io redirections to be performed on this block
 static void internal_exec_helper(parser_t &parser, const wcstring &def, node_offset_t node_offset,
-                                 enum block_type_t block_type, const io_chain_t &ios) {
+                                 enum block_type_t block_type, const io_chain_t &ios,
+                                 const parse_node_tree_t *def_tree = NULL) {
     // If we have a valid node offset, then we must not have a string to execute.
     assert(node_offset == NODE_OFFSET_INVALID || def.empty());
 
@@ -324,7 +474,13 @@ static void internal_exec_helper(parser_t &parser, const wcstring &def, node_off
         return;
     }
 
-    if (node_offset == NODE_OFFSET_INVALID) {
+    if (def_tree != NULL && !def_tree->empty()) {
+        // The definition was parsed in advance. The execution context takes ownership of its
+        // tree, so hand it a copy; that is still much cheaper than parsing again.
+        parse_node_tree_t tree;
+        tree.assign(def_tree->begin(), def_tree->end());
+        parser.eval(def, morphed_chain, block_type, std::move(tree));
+    } else if (node_offset == NODE_OFFSET_INVALID) {
         parser.eval(def, morphed_chain, block_type);
     } else {
         parser.eval_block_node(node_offset, morphed_chain, block_type);
@@ -337,30 +493,25 @@ static void internal_exec_helper(parser_t &parser, const wcstring &def, node_off
 
 // Returns whether we can use posix spawn for a given process in a given job. Per
 // https://github.com/fish-shell/fish-shell/issues/364 , error handling for file redirections is too
-// difficult with posix_spawn, so in that case we use fork/exec.
+// difficult with posix_spawn, so the caller opens those itself with open_redirections_for_spawn,
+// and uses fork/exec if that fails.
 //
 // Furthermore, to avoid the race between the caller calling tcsetpgrp() and the client checking the
-// foreground process group, we don't use posix_spawn if we're going to foreground the process. (If
-// we use fork(), we can call tcsetpgrp after the fork, before the exec, and avoid the race).
-static bool can_use_posix_spawn_for_job(const job_t *job, const process_t *process) {
+// foreground process group, we don't use posix_spawn if we're going to give the terminal to the
+// process. (If we use fork(), we can call tcsetpgrp after the fork, before the exec, and avoid the
+// race). Once the job's process group exists and owns the terminal, there is no race left, so
+// later processes of a foreground job are spawned too.
+static bool can_use_posix_spawn_for_job(const job_t *job) {
     if (job->get_flag(JOB_CONTROL)) {  //!OCLINT(collapsible if statements)
         // We are going to use job control; therefore when we launch this job it will get its own
         // process group ID. But will it be foregrounded?
         if (job->get_flag(JOB_TERMINAL) && job->get_flag(JOB_FOREGROUND)) {
-            // It will be foregrounded, so we will call tcsetpgrp(), therefore do not use
-            // posix_spawn.
-            return false;
+            // It will be foregrounded. Unless the terminal is already the job's, we will call
+            // tcsetpgrp(), therefore do not use posix_spawn.
+            if (job->pgid == -2 || tcgetpgrp(STDIN_FILENO) != job->pgid) return false;
         }
     }
-
-    // Now see if we have a redirection involving a file. The only one we allow is /dev/null, which
-    // we assume will not fail.
-    bool result = true;
-    if (chain_contains_redirection_to_real_file(job->block_io_chain()) ||
-        chain_contains_redirection_to_real_file(process->io_chain())) {
-        result = false;
-    }
-    return result;
+    return true;
 }
 
 void internal_exec(job_t *j, const io_chain_t &&all_ios) {
@@ -412,6 +563,7 @@ void exec_job(parser_t &parser, job_t *j) {
         return;
     }
 
+    FISH_TRACE2(exec_job_start, j->job_id, j->processes.size());
     debug(4, L"Exec job '%ls' with id %d", j->command_wcstr(), j->job_id);
 
     // Verify that all IO_BUFFERs are output. We used to support a (single, hacked-in) magical input
@@ -430,10 +582,26 @@ void exec_job(parser_t &parser, job_t *j) {
     }
 
     if (j->processes.front()->type == INTERNAL_EXEC) {
+        // We won't get another chance to write out our universal variables.
+        env_universal_flush();
+        for (const shared_ptr<io_data_t> &io : all_ios) {
+            if (io->io_mode != IO_BUFFER) continue;
+            static_cast<io_buffer_t *>(io.get())->ensure_pipe(all_ios);
+        }
         internal_exec(j, std::move(all_ios));
         DIE("this should be unreachable");
     }
 
+    // A command substitution's buffer may not have a pipe yet. Functions and blocks write only
+    // through the jobs they run, so only make it once a process here may need the fd.
+    bool job_may_write_to_fds = false;
+    for (const process_ptr_t &p : j->processes) {
+        if (p->type != INTERNAL_FUNCTION && p->type != INTERNAL_BLOCK_NODE) {
+            job_may_write_to_fds = true;
+            break;
+        }
+    }
+
     // We may have block IOs that conflict with fd redirections. For example, we may have a command
     // with a redireciton like <&3; we may also have chosen 3 as the fd for our pipe. Ensure we have
     // no conflicts.
@@ -441,7 +609,8 @@ void exec_job(parser_t &parser, job_t *j) {
         io_data_t *io = all_ios.at(i).get();
         if (io->io_mode == IO_BUFFER) {
             io_buffer_t *io_buffer = static_cast<io_buffer_t *>(io);
-            if (!io_buffer->avoid_conflicts_with_io_chain(all_ios)) {
+            if (!io_buffer->has_pipe() && !job_may_write_to_fds) continue;
+            if (!io_buffer->ensure_pipe(all_ios)) {
                 // We could not avoid conflicts, probably due to fd exhaustion. Mark an error.
                 exec_error = true;
                 job_mark_process_as_failed(j, j->processes.front().get());
@@ -451,20 +620,24 @@ void exec_job(parser_t &parser, job_t *j) {
     }
 
     // See if we need to create a group keepalive process. This is a process that we create to make
-    // sure that the process group doesn't die accidentally, and is often needed when a
-    // builtin/block/function is inside a pipeline, since that usually means we have to wait for one
-    // program to exit before continuing in the pipeline, causing the group leader to exit.
+    // sure that the process group doesn't die accidentally, and is often needed when a block or
+    // function is inside a pipeline, since that usually means we have to wait for one program to
+    // exit before continuing in the pipeline. Jobs run by the block or function reap children, and
+    // once the group leader has been reaped, later processes can no longer join its group. Pure
+    // builtins never wait for children, so the leader at worst lingers as a zombie, which still
+    // holds the group open; the first process to be launched becomes the leader.
     if (j->get_flag(JOB_CONTROL) && !exec_error) {
         for (const process_ptr_t &p : j->processes) {
-            if (p->type != EXTERNAL && (!p->is_last_in_job || !p->is_first_in_job)) {
-                needs_keepalive = true;
-                break;
-            }
+            if (p->type == EXTERNAL || (p->is_first_in_job && p->is_last_in_job)) continue;
+            if (p->type == INTERNAL_BUILTIN && builtin_can_run_in_child(p->argv0())) continue;
+            needs_keepalive = true;
+            break;
         }
     }
 
     if (needs_keepalive) {
         // Call fork. No need to wait for threads since our use is confined and simple.
+        const double fork_start = timef();
         keepalive.pid = execute_fork(false);
         if (keepalive.pid == 0) {
             // Child
@@ -474,6 +647,7 @@ void exec_job(parser_t &parser, job_t *j) {
             exit_without_destructors(0);
         } else {
             // Parent
+            proc_note_spawn(usec_since(fork_start));
             debug(2, L"Fork #%d, pid %d: keepalive fork for '%ls'", g_fork_count, keepalive.pid,
                   j->command_wcstr());
             set_child_group(j, keepalive.pid);
@@ -518,6 +692,10 @@ void exec_job(parser_t &parser, job_t *j) {
         bool child_forked = false;
         bool child_spawned = false;
         bool block_child = true;
+        // Set to true if a builtin was run in its own process.
+        bool builtin_forked = false;
+        // The file we opened so a builtin could stream its output to it, or -1.
+        int builtin_stream_fd = -1;
 
         // The pipes the current process write to and read from. Unfortunately these can't be just
         // allocated on the stack, since j->io wants shared_ptr.
@@ -575,10 +753,13 @@ void exec_job(parser_t &parser, job_t *j) {
         // could be safely removed, but it would result in slightly lower performance - at least on
         // uniprocessor systems.
         if (p->type == EXTERNAL) {
-            // Apply universal barrier so we have the most recent uvar changes
+            // Apply universal barrier so we have the most recent uvar changes, and the command sees
+            // ours.
             if (!get_proc_had_barrier()) {
                 set_proc_had_barrier(true);
-                env_universal_barrier();
+                env_universal_barrier_if_needed();
+            } else {
+                env_universal_flush();
             }
             env_export_arr();
         }
@@ -642,6 +823,7 @@ void exec_job(parser_t &parser, job_t *j) {
         auto do_fork = [&j, &p, &pid, &exec_error, &process_net_io_chain, &block_child,
                         &child_forked](bool drain_threads, const char *fork_type,
                                        std::function<void()> child_action) -> bool {
+            const double fork_start = timef();
             pid = execute_fork(drain_threads);
             if (pid == 0) {
                 // This is the child process. Setup redirections, print correct output to
@@ -669,6 +851,7 @@ void exec_job(parser_t &parser, job_t *j) {
                 }
                 // This is the parent process. Store away information on the child, and
                 // possibly give it control over the terminal.
+                proc_note_spawn(usec_since(fork_start));
                 debug(2, L"Fork #%d, pid %d: %s for '%ls'", g_fork_count, pid, fork_type,
                       p->argv0());
                 child_forked = true;
@@ -704,27 +887,24 @@ void exec_job(parser_t &parser, job_t *j) {
         switch (p->type) {
             case INTERNAL_FUNCTION: {
                 const wcstring func_name = p->argv0();
-                wcstring def;
-                bool function_exists = function_get_definition(func_name, &def);
+                const function_definition_ref_t def = function_get_definition_ref(func_name);
                 bool shadow_scope = function_get_shadow_scope(func_name);
-                const std::map<wcstring, env_var_t> inherit_vars =
-                    function_get_inherit_vars(func_name);
 
-                if (!function_exists) {
+                if (!def) {
                     debug(0, _(L"Unknown function '%ls'"), p->argv0());
                     break;
                 }
 
                 function_block_t *fb =
                     parser.push_block<function_block_t>(p, func_name, shadow_scope);
-                function_prepare_environment(func_name, p->get_argv() + 1, inherit_vars);
-                parser.forbid_function(func_name);
+                function_prepare_environment(*def, p->get_argv() + 1);
+                parser.forbid_function(func_name, def);
 
                 verify_buffer_output();
 
                 if (!exec_error) {
-                    internal_exec_helper(parser, def, NODE_OFFSET_INVALID, TOP,
-                                         process_net_io_chain);
+                    internal_exec_helper(parser, def->source, NODE_OFFSET_INVALID, TOP,
+                                         process_net_io_chain, &def->tree);
                 }
 
                 parser.allow_function();
@@ -744,6 +924,40 @@ void exec_job(parser_t &parser, job_t *j) {
             }
 
             case INTERNAL_BUILTIN: {
+                // A builtin that only transforms text and pipes into another process can run in a
+                // process of its own, like an external command. It then works on a snapshot of
+                // the shell and passes its output on as it goes, so the stages of a pipeline
+                // overlap instead of running one after the other.
+                if (pipes_to_next_command && builtin_can_run_in_child(p->argv0())) {
+                    bool stdin_is_directly_redirected = !p->is_first_in_job;
+                    if (!stdin_is_directly_redirected) {
+                        const shared_ptr<const io_data_t> stdin_io =
+                            io_chain_get(p->io_chain(), STDIN_FILENO);
+                        stdin_is_directly_redirected = stdin_io && stdin_io->io_mode != IO_CLOSE;
+                    }
+                    io_streams_t &streams = *builtin_io_streams;
+                    streams.stdin_fd = STDIN_FILENO;
+                    streams.out_is_redirected = true;
+                    streams.err_is_redirected = has_fd(process_net_io_chain, STDERR_FILENO);
+                    streams.stdin_is_directly_redirected = stdin_is_directly_redirected;
+                    streams.io_chain = &process_net_io_chain;
+
+                    // The child allocates memory, so wait for our threads first.
+                    fflush(stdout);
+                    fflush(stderr);
+                    do_fork(true, "concurrent builtin", [&] {
+                        streams.out.flush_to(STDOUT_FILENO);
+                        int status = builtin_run(parser, p->get_argv(), streams);
+                        const wcstring &outbuff = streams.out.buffer();
+                        const wcstring &errbuff = streams.err.buffer();
+                        do_builtin_io(outbuff.data(), outbuff.size(), errbuff.data(),
+                                      errbuff.size());
+                        exit_without_destructors(status);
+                    });
+                    builtin_forked = true;
+                    break;
+                }
+
                 int local_builtin_stdin = STDIN_FILENO;
                 bool close_stdin = false;
 
@@ -843,10 +1057,21 @@ void exec_job(parser_t &parser, job_t *j) {
                     const int fg = j->get_flag(JOB_FOREGROUND);
                     j->set_flag(JOB_FOREGROUND, false);
 
+                    // A builtin that never runs other code (which might use the chain and find our
+                    // fd redirection) need not hold all of its output when it is going to our
+                    // stdout or to a file. Memory then stays bounded by the flush size.
+                    int stream_fd = -1;
+                    if (builtin_can_stream_output(p->get_argv())) {
+                        stream_fd =
+                            open_builtin_stream_fd(&process_net_io_chain, &builtin_stream_fd);
+                        if (stream_fd >= 0) builtin_io_streams->out.flush_to(stream_fd);
+                    }
+
                     // Main loop may need to perform a blocking read from previous command's output.
                     // Make sure read source is not blocked.
                     unblock_previous();
                     p->status = builtin_run(parser, p->get_argv(), *builtin_io_streams);
+                    if (stream_fd >= 0) builtin_io_streams->out.flush();
 
                     // Restore the fg flag, which is temporarily set to false during builtin
                     // execution so as not to confuse some job-handling builtins.
@@ -924,6 +1149,7 @@ void exec_job(parser_t &parser, job_t *j) {
                 // worker process, that will write out the contents of the stdout and stderr buffers
                 // to the correct file descriptor. Since forking is expensive, fish tries to avoid
                 // it when possible.
+                if (builtin_forked) break;  // the builtin's own process writes its output
                 bool fork_was_skipped = false;
 
                 const shared_ptr<io_data_t> stdout_io =
@@ -965,18 +1191,16 @@ void exec_job(parser_t &parser, job_t *j) {
                         if (stdout_discarded) {
                             io_buffer->set_discard();
                         } else {
-                            const std::string res = wcs2string(builtin_io_streams->out.buffer());
-                            io_buffer->out_buffer_append(res.data(), res.size());
+                            io_buffer->out_buffer_append_wide(builtin_io_streams->out.buffer());
                         }
                         fork_was_skipped = true;
                     } else if (stdout_io.get() == NULL && stderr_io.get() == NULL) {
                         // We are writing to normal stdout and stderr. Just do it - no need to fork.
                         debug(3, L"Skipping fork: ordinary output for internal builtin '%ls'",
                               p->argv0());
-                        const std::string outbuff = wcs2string(stdout_buffer);
-                        const std::string errbuff = wcs2string(stderr_buffer);
-                        bool builtin_io_done = do_builtin_io(outbuff.data(), outbuff.size(),
-                                                             errbuff.data(), errbuff.size());
+                        bool builtin_io_done =
+                            do_builtin_io(stdout_buffer.data(), stdout_buffer.size(),
+                                          stderr_buffer.data(), stderr_buffer.size());
                         if (!builtin_io_done && errno != EPIPE) {
                             redirect_tty_output();  // workaround glibc bug
                             debug(0, "!builtin_io_done and errno != EPIPE");
@@ -1002,14 +1226,14 @@ void exec_job(parser_t &parser, job_t *j) {
                     // so that we don't have to allocate memory or do anything except system calls
                     // in the child.
                     //
-                    // These strings may contain embedded nulls, so don't treat them as C strings.
-                    const std::string outbuff_str = wcs2string(stdout_buffer);
-                    const char *outbuff = outbuff_str.data();
-                    size_t outbuff_len = outbuff_str.size();
-
-                    const std::string errbuff_str = wcs2string(stderr_buffer);
-                    const char *errbuff = errbuff_str.data();
-                    size_t errbuff_len = errbuff_str.size();
+                    // The child converts the output as it writes it, so the next process in the
+                    // pipeline can start reading right away and we never hold a narrow copy of
+                    // it. These strings may contain embedded nulls, so don't treat them as C
+                    // strings.
+                    const wchar_t *outbuff = stdout_buffer.data();
+                    size_t outbuff_len = stdout_buffer.size();
+                    const wchar_t *errbuff = stderr_buffer.data();
+                    size_t errbuff_len = stderr_buffer.size();
 
                     fflush(stdout);
                     fflush(stderr);
@@ -1045,21 +1269,44 @@ void exec_job(parser_t &parser, job_t *j) {
 
 #if FISH_USE_POSIX_SPAWN
                 // Prefer to use posix_spawn, since it's faster on some systems like OS X.
-                bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j, p);
+                bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j);
+#else
+                bool use_posix_spawn = false;
+#endif
+                // Without job control there is no process group or terminal to hand over, so the
+                // child need not stop before it execs. It can borrow our memory until then instead
+                // of copying our page tables.
+                bool use_vfork = FISH_USE_VFORK && !use_posix_spawn && !j->get_flag(JOB_CONTROL);
+
+                // Both open the files of redirections here, rather than in a child that can't
+                // report errors well, or would keep us suspended while an open blocks.
+                io_chain_t spawn_io_chain;
+                std::vector<int> spawn_opened_fds;
+                if ((use_posix_spawn || use_vfork) &&
+                    !open_redirections_for_spawn(process_net_io_chain, &spawn_io_chain,
+                                                 &spawn_opened_fds)) {
+                    use_posix_spawn = use_vfork = false;
+                }
+
+#if FISH_USE_POSIX_SPAWN
                 if (use_posix_spawn) {
                     g_fork_count++;  // spawn counts as a fork+exec
                     // Create posix spawn attributes and actions.
                     posix_spawnattr_t attr = posix_spawnattr_t();
                     posix_spawn_file_actions_t actions = posix_spawn_file_actions_t();
                     bool made_it = fork_actions_make_spawn_properties(&attr, &actions, j, p,
-                                                                      process_net_io_chain);
+                                                                      spawn_io_chain);
                     if (made_it) {
                         // We successfully made the attributes and actions; actually call
                         // posix_spawn.
+                        FISH_TRACE1(spawn_start, actual_cmd);
+                        const double spawn_start = timef();
                         int spawn_ret = posix_spawn(&pid, actual_cmd, &actions, &attr,
                                                     const_cast<char *const *>(argv),
                                                     const_cast<char *const *>(envv));
 
+                        FISH_TRACE2(spawn_done, spawn_ret == 0 ? pid : 0, actual_cmd);
+
                         // This usleep can be used to test for various race conditions
                         // (https://github.com/fish-shell/fish-shell/issues/360).
                         // usleep(10000);
@@ -1068,12 +1315,15 @@ void exec_job(parser_t &parser, job_t *j) {
                             safe_report_exec_error(spawn_ret, actual_cmd, argv, envv);
                             // Make sure our pid isn't set.
                             pid = 0;
+                        } else {
+                            proc_note_spawn(usec_since(spawn_start));
                         }
 
                         // Clean up our actions.
                         posix_spawn_file_actions_destroy(&actions);
                         posix_spawnattr_destroy(&attr);
                     }
+                    io_cleanup_fds(spawn_opened_fds);
 
                     // A 0 pid means we failed to posix_spawn. Since we have no pid, we'll never get
                     // told when it's exited, so we have to mark the process as failed.
@@ -1086,6 +1336,25 @@ void exec_job(parser_t &parser, job_t *j) {
                         child_spawned = true;
                     }
                 } else
+#endif
+#if FISH_USE_VFORK
+                if (use_vfork) {
+                    const vfork_launch_t launch = {p, &spawn_io_chain, actual_cmd, argv, envv};
+                    const double spawn_start = timef();
+                    pid = execute_vfork(vfork_launch_process,
+                                        const_cast<vfork_launch_t *>(&launch));
+                    io_cleanup_fds(spawn_opened_fds);
+                    debug(2, L"Fork #%d, pid %d: vfork external command '%s' from '%ls'",
+                          g_fork_count, pid, actual_cmd, file ? file : L"<no file>");
+                    if (pid < 0) {
+                        wperror(L"clone");
+                        job_mark_process_as_failed(j, p);
+                        exec_error = true;
+                        break;
+                    }
+                    proc_note_spawn(usec_since(spawn_start));
+                    child_spawned = true;
+                } else
 #endif
                 {
                     if (!do_fork(false, "external command",
@@ -1107,6 +1376,8 @@ void exec_job(parser_t &parser, job_t *j) {
             }
         }
 
+        if (builtin_stream_fd >= 0) exec_close(builtin_stream_fd);
+
         bool child_blocked = block_child && child_forked;
         if (child_blocked) {
             // We have to wait to ensure the child has set their progress group and is in SIGSTOP
@@ -1193,6 +1464,74 @@ void exec_job(parser_t &parser, job_t *j) {
         // right place, but it prevents sanity_lose from complaining.
         j->set_flag(JOB_FOREGROUND, false);
     }
+    FISH_TRACE2(exec_job_done, j->job_id, j->pgid);
+}
+
+bool exec_can_run_builtin_without_job(const io_chain_t &block_io) {
+    if (block_io.get_io_for_fd(STDIN_FILENO) || block_io.get_io_for_fd(STDERR_FILENO)) {
+        return false;
+    }
+    const shared_ptr<const io_data_t> stdout_io = block_io.get_io_for_fd(STDOUT_FILENO);
+    return !stdout_io || stdout_io->io_mode == IO_BUFFER;
+}
+
+int exec_open_builtin_output_file(const wcstring_list_t &argv, const wcstring &path, int flags) {
+    null_terminated_array_t<wchar_t> argv_array(argv);
+    if (!builtin_can_stream_output(argv_array.get())) return -1;
+    const std::string narrow_path = wcs2string(path);
+    if (!can_open_redirection_in_parent(narrow_path.c_str())) return -1;
+    int fd = open(narrow_path.c_str(), flags, OPEN_MASK);
+    if (fd >= 0) set_cloexec(fd);
+    return fd;
+}
+
+int exec_builtin_without_job(parser_t &parser, const wcstring_list_t &argv, io_chain_t &block_io,
+                             int out_fd) {
+    assert(exec_can_run_builtin_without_job(block_io));
+    const shared_ptr<io_data_t> stdout_io = block_io.get_io_for_fd(STDOUT_FILENO);
+    // A file redirection of the builtin itself takes precedence over the block's buffer.
+    io_buffer_t *io_buffer = out_fd < 0 ? static_cast<io_buffer_t *>(stdout_io.get()) : NULL;
+
+    io_streams_t streams(io_buffer ? io_buffer->get_buffer_limit() : 0);
+    streams.stdin_fd = STDIN_FILENO;
+    streams.out_is_redirected = io_buffer != NULL || out_fd >= 0;
+    streams.io_chain = &block_io;
+    // As in exec_job, a builtin that runs no other code passes output for our stdout or its file
+    // on as it goes.
+    null_terminated_array_t<wchar_t> argv_array(argv);
+    int stream_fd = out_fd;
+    if (stream_fd < 0 && !io_buffer && builtin_can_stream_output(argv_array.get())) {
+        stream_fd = STDOUT_FILENO;
+    }
+    if (stream_fd >= 0) streams.out.flush_to(stream_fd);
+    int status = builtin_run(parser, argv_array.get(), streams);
+    if (stream_fd >= 0) streams.out.flush();
+    if (out_fd >= 0) exec_close(out_fd);
+
+    // This is what exec_job does when it skips the fork for a builtin, except that stderr output
+    // next to buffered stdout is written directly, rather than from a forked process.
+    const bool stdout_discarded = streams.out.output_discarded();
+    const wcstring empty;
+    const wcstring &outbuff = io_buffer ? empty : streams.out.buffer();
+    const wcstring &errbuff = streams.err.buffer();
+    if (io_buffer) {
+        if (stdout_discarded) {
+            io_buffer->set_discard();
+        } else {
+            io_buffer->out_buffer_append_wide(streams.out.buffer());
+        }
+    }
+    if (!outbuff.empty() || !errbuff.empty()) {
+        bool builtin_io_done =
+            do_builtin_io(outbuff.data(), outbuff.size(), errbuff.data(), errbuff.size());
+        if (!builtin_io_done && errno != EPIPE) {
+            redirect_tty_output();  // workaround glibc bug
+            debug(0, "!builtin_io_done and errno != EPIPE");
+            show_stackframe(L'E');
+        }
+    }
+    if (stdout_discarded && !io_buffer) status = STATUS_READ_TOO_MUCH;
+    return status;
 }
 
 static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, bool apply_exit_status,
@@ -1213,8 +1552,11 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
     // IO buffer creation may fail (e.g. if we have too many open files to make a pipe), so this may
     // be null.
     const shared_ptr<io_buffer_t> io_buffer(
-        io_buffer_t::create(STDOUT_FILENO, io_chain_t(), is_subcmd ? read_byte_limit : 0));
+        io_buffer_t::create(STDOUT_FILENO, io_chain_t(), is_subcmd ? read_byte_limit : 0,
+                            true /* defer pipe */));
     if (io_buffer.get() != NULL) {
+        // Split the output as it arrives, rather than keeping all of it until the end.
+        if (split_output && lst != NULL) io_buffer->split_lines_into(lst);
         parser_t &parser = parser_t::principal_parser();
         if (parser.eval(cmd, io_chain_t(io_buffer), SUBST) == 0) {
             subcommand_status = proc_get_last_status();
@@ -1237,29 +1579,15 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
     const char *begin = io_buffer->out_buffer_ptr();
     const char *end = begin + io_buffer->out_buffer_size();
     if (split_output) {
-        const char *cursor = begin;
-        while (cursor < end) {
-            // Look for the next separator.
-            const char *stop = (const char *)memchr(cursor, '\n', end - cursor);
-            const bool hit_separator = (stop != NULL);
-            if (!hit_separator) {
-                // If it's not found, just use the end.
-                stop = end;
-            }
-            // Stop now points at the first character we do not want to copy.
-            const wcstring wc = str2wcstring(cursor, stop - cursor);
-            lst->push_back(wc);
-
-            // If we hit a separator, skip over it; otherwise we're at the end.
-            cursor = stop + (hit_separator ? 1 : 0);
-        }
+        // The complete lines are in the list already. What's left is a last line without a
+        // newline.
+        if (begin != end) lst->push_back(str2wcstring(begin, end - begin));
     } else {
         // We're not splitting output, but we still want to trim off a trailing newline.
         if (end != begin && end[-1] == '\n') {
             --end;
         }
-        const wcstring wc = str2wcstring(begin, end - begin);
-        lst->push_back(wc);
+        lst->push_back(str2wcstring(begin, end - begin));
     }
 
     return subcommand_status;
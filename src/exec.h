@@ -24,10 +24,28 @@
 /// normal computer/OS in regular use, but the promiscous amounts of forking that resulted was
 /// responsible for a huge slowdown when using Valgrind as well as when doing complex
 /// command-specific completions.
+class io_chain_t;
 class job_t;
 class parser_t;
 void exec_job(parser_t &parser, job_t *j);
 
+/// Returns whether a builtin run with the given block IO may go through exec_builtin_without_job.
+/// That is the case when the block IO redirects nothing but stdout, and that only to a buffer.
+bool exec_can_run_builtin_without_job(const io_chain_t &block_io);
+
+/// Open the file that a builtin to be run by exec_builtin_without_job with the given arguments has
+/// its stdout redirected to, with the given open flags. That is only done for builtins that never
+/// look at their io chain, and for regular files and /dev/null. Returns the fd, or -1 if the
+/// builtin must run as a job.
+int exec_open_builtin_output_file(const wcstring_list_t &argv, const wcstring &path, int flags);
+
+/// Run a builtin that is not piped, and write its output, without creating a job. The block IO
+/// must satisfy exec_can_run_builtin_without_job. If out_fd is not -1, it is a file from
+/// exec_open_builtin_output_file which the output goes to instead, and which is closed afterwards.
+/// Returns the status of the builtin.
+int exec_builtin_without_job(parser_t &parser, const wcstring_list_t &argv, io_chain_t &block_io,
+                             int out_fd = -1);
+
 /// Evaluate the expression cmd in a subshell, add the outputs into the list l. On return, the
 /// status flag as returned bu \c proc_gfet_last_status will not be changed.
 ///
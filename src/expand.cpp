@@ -3,6 +3,7 @@
 #include "config.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -26,6 +27,7 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>  // IWYU pragma: keep
 #include <type_traits>
@@ -44,6 +46,7 @@
 #include "parse_util.h"
 #include "path.h"
 #include "proc.h"
+#include "trace.h"
 #include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
 #ifdef KERN_PROCARGS2
@@ -142,6 +145,29 @@ static void append_cmdsub_error(parse_error_list_t *errors, size_t source_start,
     errors->push_back(error);
 }
 
+size_t expand_argument_limit = EXPAND_ARGUMENT_LIMIT;
+
+/// Error issued when an argument expands to more than expand_argument_limit arguments.
+#define EXPAND_LIMIT_ERR_MSG \
+    _(L"Expansion produced more than %lu arguments (see fish_expand_limit)")
+
+/// Returns whether the given number of arguments from expanding one argument is too many.
+static bool expand_exceeds_limit(unsigned long long count) {
+    return expand_argument_limit > 0 && count > expand_argument_limit;
+}
+
+/// Append an argument produced by the expansion of another to the list, unless there would then be
+/// too many of them. Returns false, having appended an error instead, in that case.
+static bool append_expanded(std::vector<completion_t> *out, wcstring str,
+                            parse_error_list_t *errors) {
+    if (expand_exceeds_limit(out->size() + 1)) {
+        append_syntax_error(errors, 0, EXPAND_LIMIT_ERR_MSG, (unsigned long)expand_argument_limit);
+        return false;
+    }
+    append_completion(out, std::move(str));
+    return true;
+}
+
 /// Test if the specified string does not contain character which can not be used inside a quoted
 /// string.
 static int is_quotable(const wchar_t *str) {
@@ -694,6 +720,29 @@ static size_t parse_slice(const wchar_t *in, wchar_t **end_ptr, std::vector<long
     return 0;
 }
 
+/// $history can be very long, and indexes into it usually ask for its most recent items. Given the
+/// slice following $history, returns only the items up to the largest index, which are all the
+/// slice can refer to if it has no negative indexes. Returns none() if it may refer to others.
+static maybe_t<env_var_t> history_for_slice(const wchar_t *slice) {
+    assert(slice[0] == L'[');
+    unsigned long max_idx = 0;
+    for (const wchar_t *cursor = slice + 1; *cursor != L']'; cursor++) {
+        if (*cursor >= L'0' && *cursor <= L'9') {
+            unsigned long idx = 0;
+            for (; *cursor >= L'0' && *cursor <= L'9'; cursor++) {
+                idx = idx * 10 + (*cursor - L'0');
+                if (idx > UINT_MAX) return none();
+            }
+            max_idx = std::max(max_idx, idx);
+            cursor--;
+        } else if (!iswspace(*cursor) && *cursor != INTERNAL_SEPARATOR && *cursor != L'.') {
+            // Negative indexes, or a malformed slice that parse_slice reports.
+            return none();
+        }
+    }
+    return env_get_history(max_idx);
+}
+
 /// Expand all environment variables in the string *ptr.
 ///
 /// This function is slow, fragile and complicated. There are lots of little corner cases, like
@@ -717,8 +766,7 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
     assert(last_idx >= 0 && (size_t)last_idx <= insize);
 
     if (last_idx == 0) {
-        append_completion(out, instr);
-        return true;
+        return append_expanded(out, instr, errors);
     }
 
     bool is_ok = true;
@@ -772,6 +820,9 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
         maybe_t<env_var_t> var;
         if (var_len == 1 && var_tmp[0] == VARIABLE_EXPAND_EMPTY) {
             var = none();
+        } else if (var_tmp == L"history" && stop_pos < insize && instr.at(stop_pos) == L'[') {
+            var = history_for_slice(instr.c_str() + stop_pos);
+            if (!var) var = env_get(var_tmp);
         } else {
             var = env_get(var_tmp);
         }
@@ -850,7 +901,7 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
                 for (size_t j = 0; j < var_item_list.size(); j++) {
                     const wcstring &next = var_item_list.at(j);
                     if (is_ok && i == 0 && stop_pos == insize) {
-                        append_completion(out, next);
+                        is_ok = append_expanded(out, next, errors);
                     } else {
                         if (is_ok) {
                             wcstring new_in;
@@ -911,8 +962,8 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
         }
     }
 
-    if (!empty) {
-        append_completion(out, instr);
+    if (!empty && is_ok) {
+        is_ok = append_expanded(out, instr, errors);
     }
 
     return is_ok;
@@ -986,8 +1037,7 @@ static expand_error_t expand_brackets(const wcstring &instr, expand_flags_t flag
     }
 
     if (bracket_begin == NULL) {
-        append_completion(out, instr);
-        return EXPAND_OK;
+        return append_expanded(out, instr, errors) ? EXPAND_OK : EXPAND_ERROR;
     }
 
     length_preceding_brackets = (bracket_begin - in);
@@ -1004,7 +1054,9 @@ static expand_error_t expand_brackets(const wcstring &instr, expand_flags_t flag
             whole_item.append(in, length_preceding_brackets);
             whole_item.append(item_begin, item_len);
             whole_item.append(bracket_end + 1);
-            expand_brackets(whole_item, flags, out, errors);
+            if (expand_brackets(whole_item, flags, out, errors) == EXPAND_ERROR) {
+                return EXPAND_ERROR;
+            }
 
             item_begin = pos + 1;
             if (pos == bracket_end) break;
@@ -1099,7 +1151,14 @@ static bool expand_cmdsubst(const wcstring &input, std::vector<completion_t> *ou
     // Recursively call ourselves to expand any remaining command substitutions. The result of this
     // recursive call using the tail of the string is inserted into the tail_expand array list
     std::vector<completion_t> tail_expand;
-    expand_cmdsubst(tail_begin, &tail_expand, errors);  // TODO: offset error locations
+    if (!expand_cmdsubst(tail_begin, &tail_expand, errors)) {  // TODO: offset error locations
+        return false;
+    }
+    if (expand_exceeds_limit(out_list->size() +
+                             (unsigned long long)sub_res.size() * tail_expand.size())) {
+        append_syntax_error(errors, 0, EXPAND_LIMIT_ERR_MSG, (unsigned long)expand_argument_limit);
+        return false;
+    }
 
     // Combine the result of the current command substitution with the result of the recursive tail
     // expansion.
@@ -1386,6 +1445,7 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
         // which may be CDPATH if the special flag is set.
         const wcstring working_dir = env_get_pwd_slash();
         wcstring_list_t effective_working_dirs;
+        bool searching_path = false;
         bool for_cd = static_cast<bool>(flags & EXPAND_SPECIAL_FOR_CD);
         bool for_command = static_cast<bool>(flags & EXPAND_SPECIAL_FOR_COMMAND);
         if (!for_cd && !for_command) {
@@ -1425,21 +1485,35 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
                     effective_working_dirs.push_back(
                         path_apply_working_directory(next_path, working_dir));
                 }
+                searching_path = for_command;
             }
         }
 
         result = EXPAND_WILDCARD_NO_MATCH;
         std::vector<completion_t> expanded;
-        for (size_t wd_idx = 0; wd_idx < effective_working_dirs.size(); wd_idx++) {
-            int local_wc_res = wildcard_expand_string(
-                path_to_expand, effective_working_dirs.at(wd_idx), flags, &expanded);
-            if (local_wc_res > 0) {
-                // Something matched,so overall we matched.
+        if (searching_path && !has_wildcard && !path_to_expand.empty() &&
+            (flags & EXECUTABLES_ONLY) && (flags & EXPAND_FOR_COMPLETIONS)) {
+            // Completing a command name in $PATH, which may have many directories. This reads them
+            // all at once.
+            int wc_res = wildcard_complete_command(path_to_expand, effective_working_dirs, flags,
+                                                   &expanded);
+            if (wc_res > 0) {
                 result = EXPAND_WILDCARD_MATCH;
-            } else if (local_wc_res < 0) {
-                // Cancellation
+            } else if (wc_res < 0) {
                 result = EXPAND_ERROR;
-                break;
+            }
+        } else {
+            for (size_t wd_idx = 0; wd_idx < effective_working_dirs.size(); wd_idx++) {
+                int local_wc_res = wildcard_expand_string(
+                    path_to_expand, effective_working_dirs.at(wd_idx), flags, &expanded);
+                if (local_wc_res > 0) {
+                    // Something matched,so overall we matched.
+                    result = EXPAND_WILDCARD_MATCH;
+                } else if (local_wc_res < 0) {
+                    // Cancellation
+                    result = EXPAND_ERROR;
+                    break;
+                }
             }
         }
 
@@ -1456,6 +1530,65 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
     return result;
 }
 
+/// Returns whether the string contains any of the characters fish reserves for its own use, which
+/// the expansion stages give a meaning to.
+static bool contains_reserved_char(const wcstring &str) {
+    for (wchar_t c : str) {
+        if (c >= RESERVED_CHAR_BASE && c < RESERVED_CHAR_END) return true;
+    }
+    return false;
+}
+
+/// Expand the arguments most often seen in scripts without going through the stages of
+/// expand_string, each of which copies the argument: a quoted string without escapes or variables,
+/// or a single variable, which may be in double quotes. Returns false, having added nothing, if the
+/// input is not one of these.
+static bool expand_simple_argument(const wcstring &input, expand_flags_t flags,
+                                   std::vector<completion_t> *out) {
+    const size_t len = input.size();
+    if (len < 2 || contains_reserved_char(input)) return false;
+    const wchar_t first = input.at(0);
+    const bool quoted = (first == L'"' && input.at(len - 1) == L'"');
+
+    if ((first == L'\'' && input.find_first_of(L"\\'", 1) == len - 1) ||
+        (quoted && input.find_first_of(L"\\\"$", 1) == len - 1)) {
+        append_completion(out, wcstring(input, 1, len - 2));
+        return true;
+    }
+
+    const size_t name_start = quoted ? 2 : 1;
+    const size_t name_end = quoted ? len - 1 : len;
+    if (flags & EXPAND_SKIP_VARIABLES || name_end <= name_start ||
+        input.at(name_start - 1) != L'$') {
+        return false;
+    }
+    for (size_t i = name_start; i < name_end; i++) {
+        if (!valid_var_name_char(input.at(i))) return false;
+    }
+
+    wcstring_list_t values;
+    auto var = env_get(input.substr(name_start, name_end - name_start));
+    if (var) var->to_list(values);
+    // Let the full expansion report too many values.
+    if (!quoted && expand_exceeds_limit(out->size() + values.size())) return false;
+    for (const wcstring &value : values) {
+        if (contains_reserved_char(value)) return false;
+    }
+    if (!quoted) {
+        for (wcstring &value : values) {
+            append_completion(out, std::move(value));
+        }
+    } else {
+        wcstring joined;
+        for (size_t i = 0; i < values.size(); i++) {
+            if (i > 0) joined.push_back(L' ');
+            joined.append(values.at(i));
+        }
+        append_completion(out, std::move(joined));
+    }
+    return true;
+}
+
 expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *out_completions,
                              expand_flags_t flags, parse_error_list_t *errors) {
     // Early out. If we're not completing, and there's no magic in the input, we're done.
@@ -1463,6 +1596,11 @@ expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *o
         append_completion(out_completions, input);
         return EXPAND_OK;
     }
+    if (!(flags & EXPAND_FOR_COMPLETIONS) &&
+        expand_simple_argument(input, flags, out_completions)) {
+        return EXPAND_OK;
+    }
+    FISH_TRACE2(expand_start, input.c_str(), input.size());
 
     // Our expansion stages.
     const expand_stage_t stages[] = {expand_stage_cmdsubst, expand_stage_variables,
@@ -1490,6 +1628,13 @@ expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *o
         // Output becomes our next stage's input.
         completions.swap(output_storage);
         output_storage.clear();
+
+        // Wildcards and command substitutions are not limited as they expand, so check afterwards.
+        if (total_result != EXPAND_ERROR && expand_exceeds_limit(completions.size())) {
+            append_syntax_error(errors, 0, EXPAND_LIMIT_ERR_MSG,
+                                (unsigned long)expand_argument_limit);
+            total_result = EXPAND_ERROR;
+        }
     }
 
     if (total_result != EXPAND_ERROR) {
@@ -1499,6 +1644,7 @@ expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *o
         }
         out_completions->insert(out_completions->end(), completions.begin(), completions.end());
     }
+    FISH_TRACE3(expand_done, input.size(), completions.size(), total_result);
     return total_result;
 }
 
@@ -1565,39 +1711,145 @@ bool fish_xdm_login_hack_hack_hack_hack(std::vector<std::string> *cmds, int argc
     return result;
 }
 
-std::unordered_map<const wcstring, const wcstring> abbreviations;
+/// A trie of the abbreviation names, flattened into an array of nodes with the root first. It is
+/// built from the table of abbreviations when first needed after a change, and never modified
+/// afterwards, so lookups can walk it without holding a lock.
+class abbreviation_trie_t {
+    struct node_t {
+        /// The children of this node and their characters, sorted by character.
+        std::vector<std::pair<wchar_t, uint32_t>> children;
+        /// The index of the expansion of the abbreviation ending here, or -1.
+        int expansion = -1;
+    };
+    std::vector<node_t> nodes;
+    wcstring_list_t expansions;
+
+    /// Returns the child of \p node for character \p c, or 0 if there is none. The root is never
+    /// a child, so 0 is free to mean none.
+    uint32_t child(uint32_t node, wchar_t c) const {
+        const auto &children = nodes[node].children;
+        auto where = std::lower_bound(
+            children.begin(), children.end(), c,
+            [](const std::pair<wchar_t, uint32_t> &child, wchar_t c) { return child.first < c; });
+        return where != children.end() && where->first == c ? where->second : 0;
+    }
+
+   public:
+    explicit abbreviation_trie_t(const std::unordered_map<wcstring, wcstring> &abbrs)
+        : nodes(1) {
+        for (const auto &abbr : abbrs) {
+            uint32_t node = 0;
+            for (wchar_t c : abbr.first) {
+                uint32_t next = child(node, c);
+                if (next == 0) {
+                    next = (uint32_t)nodes.size();
+                    auto &children = nodes[node].children;
+                    auto where = std::lower_bound(children.begin(), children.end(),
+                                                  std::make_pair(c, uint32_t(0)));
+                    children.insert(where, std::make_pair(c, next));
+                    nodes.emplace_back();
+                }
+                node = next;
+            }
+            nodes[node].expansion = (int)expansions.size();
+            expansions.push_back(abbr.second);
+        }
+    }
+
+    /// Returns the expansion of the abbreviation named by the \p len characters at \p str, or NULL
+    /// if there is none.
+    const wcstring *find(const wchar_t *str, size_t len) const {
+        uint32_t node = 0;
+        for (size_t i = 0; i < len; i++) {
+            node = child(node, str[i]);
+            if (node == 0) return NULL;
+        }
+        int expansion = nodes[node].expansion;
+        return expansion < 0 ? NULL : &expansions[expansion];
+    }
+
+    /// Returns whether an abbreviation is named by characters of \p text starting at \p begin,
+    /// ending no later than \p end and no earlier than \p pos.
+    bool has_name_at(const wcstring &text, size_t begin, size_t end, size_t pos) const {
+        uint32_t node = 0;
+        for (size_t i = begin; i < end; i++) {
+            node = child(node, text[i]);
+            if (node == 0) return false;
+            if (i + 1 >= pos && nodes[node].expansion >= 0) return true;
+        }
+        return false;
+    }
+
+    size_t size() const { return expansions.size(); }
+};
+
+/// The abbreviations, kept up to date from the _fish_abbr_ variables on the main thread, and the
+/// trie built from them. Highlighting looks them up in the background.
+struct abbreviation_table_t {
+    std::unordered_map<wcstring, wcstring> expansions;
+    /// The trie of the current expansions, or null if it needs to be rebuilt.
+    std::shared_ptr<const abbreviation_trie_t> trie;
+};
+static owning_lock<abbreviation_table_t> s_abbreviations;
+
+/// Lookups of abbreviations, which are made by highlighting in the background as well as when
+/// expanding them.
+static std::atomic<uint64_t> s_abbreviation_hits{0};
+static std::atomic<uint64_t> s_abbreviation_misses{0};
+
 void update_abbr_cache(const wchar_t *op, const wcstring &varname) {
     wcstring abbr;
     if (!unescape_string(varname.substr(wcslen(L"_fish_abbr_")), &abbr, 0, STRING_STYLE_VAR)) {
         debug(1, L"Abbreviation var '%ls' is not correctly encoded, ignoring it.", varname.c_str());
         return;
     }
-    abbreviations.erase(abbr);
-    if (wcscmp(op, L"ERASE") != 0) {
-        const auto expansion = env_get(varname);
-        if (!expansion.missing_or_empty()) {
-            abbreviations.emplace(std::make_pair(abbr, expansion->as_string()));
-        }
+    maybe_t<env_var_t> expansion;
+    if (wcscmp(op, L"ERASE") != 0) expansion = env_get(varname);
+
+    auto &&table = s_abbreviations.acquire();
+    table.value.expansions.erase(abbr);
+    if (!expansion.missing_or_empty()) {
+        table.value.expansions.emplace(std::move(abbr), expansion->as_string());
     }
+    table.value.trie.reset();
+}
+
+/// Returns the trie of the current abbreviations, building it if they changed.
+static std::shared_ptr<const abbreviation_trie_t> abbreviation_trie() {
+    auto &&table = s_abbreviations.acquire();
+    if (!table.value.trie) {
+        table.value.trie = std::make_shared<const abbreviation_trie_t>(table.value.expansions);
+    }
+    return table.value.trie;
 }
 
 bool expand_abbreviation(const wcstring &src, wcstring *output) {
     if (src.empty()) return false;
 
-    auto abbr = abbreviations.find(src);
-    if (abbr == abbreviations.end()) return false;
-    if (output != NULL) output->assign(abbr->second);
+    const wcstring *expansion = abbreviation_trie()->find(src.c_str(), src.size());
+    if (expansion == NULL) {
+        s_abbreviation_misses++;
+        return false;
+    }
+    s_abbreviation_hits++;
+    if (output != NULL) output->assign(*expansion);
     return true;
+}
 
-#if 0
-    for (auto abbr : abbreviations) {
-        if (src == abbr.first) {
-            // We found a matching abbreviation. Set output to the expansion.
-            if (output != NULL) output->assign(abbr.second);
-            return true;
-        }
+bool abbreviation_in_word(const wcstring &text, size_t begin, size_t end, size_t pos) {
+    assert(begin <= pos && pos <= end && end <= text.size());
+    const auto trie = abbreviation_trie();
+    if (trie->size() == 0) return false;
+    for (size_t start = begin; start <= pos && start < end; start++) {
+        if (trie->has_name_at(text, start, end, pos)) return true;
     }
-
     return false;
-#endif
+}
+
+abbreviation_stats_t abbreviation_stats() {
+    abbreviation_stats_t stats;
+    stats.entries = abbreviation_trie()->size();
+    stats.hits = s_abbreviation_hits;
+    stats.misses = s_abbreviation_misses;
+    return stats;
 }
@@ -8,6 +8,7 @@
 #include "config.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <string>
 #include <vector>
@@ -52,6 +53,14 @@ enum {
 };
 typedef int expand_flags_t;
 
+/// The default of the most arguments that one argument may expand to. Products like {a,b}{c,d} and
+/// $list1$list2 grow quickly, and this stops them before they use up all memory.
+#define EXPAND_ARGUMENT_LIMIT (4 * 1024 * 1024)
+
+/// The most arguments that one argument may expand to, or 0 for no limit. This can be overridden
+/// by the fish_expand_limit variable.
+extern size_t expand_argument_limit;
+
 class completion_t;
 
 enum {
@@ -138,6 +147,23 @@ wcstring replace_home_directory_with_tilde(const wcstring &str);
 void update_abbr_cache(const wchar_t *op, const wcstring &varname);
 bool expand_abbreviation(const wcstring &src, wcstring *output);
 
+/// Returns whether the name of some abbreviation is found in \p text within [begin, end), at a
+/// range that contains or ends at \p pos. This lets callers rule out expanding the word around a
+/// cursor without parsing the text.
+bool abbreviation_in_word(const wcstring &text, size_t begin, size_t end, size_t pos);
+
+/// Counters describing the table of abbreviations.
+struct abbreviation_stats_t {
+    /// The number of abbreviations defined.
+    size_t entries;
+    /// Words found to be abbreviations, and those that were not.
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/// Returns the counters of the table of abbreviations.
+abbreviation_stats_t abbreviation_stats();
+
 // Terrible hacks
 bool fish_xdm_login_hack_hack_hack_hack(std::vector<std::string> *cmds, int argc,
                                         const char *const *argv);
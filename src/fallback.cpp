@@ -41,6 +41,7 @@
 #include "common.h"    // IWYU pragma: keep
 #include "fallback.h"  // IWYU pragma: keep
 #include "util.h"      // IWYU pragma: keep
+#include "wcwidth_table.h"
 
 #ifdef TPARM_SOLARIS_KLUDGE
 #undef tparm
@@ -69,6 +70,19 @@ int fish_mkstemp_cloexec(char *name_template) {
     return result_fd;
 }
 
+int fish_pipe_cloexec(int fds[2]) {
+#if HAVE_PIPE2
+    return pipe2(fds, O_CLOEXEC);
+#else
+    int result = pipe(fds);
+    if (result != -1) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+    return result;
+#endif
+}
+
 /// Fallback implementations of wcsdup and wcscasecmp. On systems where these are not needed (e.g.
 /// building on Linux) these should end up just being stripped, as they are static functions that
 /// are not referenced in this file.
@@ -274,9 +288,36 @@ int fish_wcwidth(wchar_t wc) { return wcwidth(wc); }
 int fish_wcswidth(const wchar_t *str, size_t n) { return wcswidth(str, n); }
 #else
 static int mk_wcwidth(wchar_t wc);
-static int mk_wcswidth(const wchar_t *pwcs, size_t n);
-int fish_wcwidth(wchar_t wc) { return mk_wcwidth(wc); }
-int fish_wcswidth(const wchar_t *str, size_t n) { return mk_wcswidth(str, n); }
+
+/// Look up the width of a character in the table generated from mk_wcwidth() by
+/// build_tools/build_wcwidth_table.sh. Values outside of Unicode are left to mk_wcwidth().
+static inline int table_wcwidth(wchar_t wc) {
+    unsigned long ucs = (unsigned long)wc;
+    if (ucs >= WCWIDTH_TABLE_LIMIT) return mk_wcwidth(wc);
+    unsigned char block = wcwidth_block_index[ucs >> WCWIDTH_BLOCK_BITS];
+    return wcwidth_blocks[block][ucs & ((1u << WCWIDTH_BLOCK_BITS) - 1)];
+}
+
+int fish_wcwidth(wchar_t wc) { return table_wcwidth(wc); }
+
+int fish_wcswidth(const wchar_t *str, size_t n) {
+    int width = 0;
+    size_t i = 0;
+    while (i < n) {
+        // Printable ASCII is one column per character, so runs of it are counted without lookups.
+        size_t run_end = i;
+        while (run_end < n && str[run_end] >= L' ' && str[run_end] < 0x7f) run_end++;
+        width += (int)(run_end - i);
+        i = run_end;
+        if (i == n || str[i] == L'\0') break;
+
+        int w = table_wcwidth(str[i]);
+        if (w < 0) return -1;
+        width += w;
+        i++;
+    }
+    return width;
+}
 
 /*
  * This is an implementation of wcwidth() and wcswidth() (defined in
@@ -452,20 +493,6 @@ static int mk_wcwidth(wchar_t ucs) {
                  (ucs >= 0x30000 && ucs <= 0x3fffd)));
 }
 
-static int mk_wcswidth(const wchar_t *pwcs, size_t n) {
-    int width = 0;
-    for (size_t i = 0; i < n; i++) {
-        if (pwcs[i] == L'\0') break;
-
-        int w = mk_wcwidth(pwcs[i]);
-        if (w < 0) {
-            width = -1;
-            break;
-        }
-        width += w;
-    }
-    return width;
-}
 #endif  // HAVE_BROKEN_WCWIDTH
 
 #ifndef HAVE_FLOCK
@@ -29,6 +29,11 @@ int fish_wcswidth(const wchar_t *str, size_t n);
 // otherwise it uses mkstemp followed by fcntl
 int fish_mkstemp_cloexec(char *);
 
+// Replacement for pipe2(fds, O_CLOEXEC)
+// This uses pipe2 if available,
+// otherwise it uses pipe followed by fcntl on both ends
+int fish_pipe_cloexec(int fds[2]);
+
 #ifndef WCHAR_MAX
 /// This _should_ be defined by wchar.h, but e.g. OpenBSD doesn't.
 #define WCHAR_MAX INT_MAX
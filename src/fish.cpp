@@ -38,6 +38,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 #include "builtin.h"
 #include "common.h"
+#include "editor_server.h"
 #include "env.h"
 #include "event.h"
 #include "expand.h"
@@ -65,11 +66,32 @@ class fish_cmd_opts_t {
     std::vector<std::string> batch_cmds;
     // Commands to execute after the shell's config has been read.
     std::vector<std::string> postconfig_cmds;
+    // Whether to answer editor requests on stdin instead of running commands.
+    bool editor_server = false;
 };
 
 /// If we are doing profiling, the filename to output to.
 static const char *s_profiling_output_filename = NULL;
 
+/// If we are doing profiling, how to write it out.
+static profile_format_t s_profiling_format = profile_format_raw;
+
+/// Whether to report how long each phase of startup takes.
+static bool s_startup_trace = false;
+
+/// When startup, and the current phase of it, began.
+static double s_startup_start = 0;
+static double s_startup_phase_start = 0;
+
+/// If startup tracing is on, report to stderr how long the phase of startup that just finished
+/// took, as a tab-separated line of "startup", the phase and msec.
+static void startup_phase_done(const wcstring &phase) {
+    if (!s_startup_trace) return;
+    double now = timef();
+    fwprintf(stderr, L"startup\t%ls\t%.3f\n", phase.c_str(), (now - s_startup_phase_start) * 1000);
+    s_startup_phase_start = now;
+}
+
 static bool has_suffix(const std::string &path, const char *suffix, bool ignore_case) {
     size_t pathlen = path.size(), suffixlen = strlen(suffix);
     return pathlen >= suffixlen &&
@@ -206,6 +228,7 @@ static void source_config_in_directory(const wcstring &dir) {
     parser.set_is_within_fish_initialization(true);
     parser.eval(cmd, io_chain_t(), TOP);
     parser.set_is_within_fish_initialization(false);
+    startup_phase_done(escaped_pathname);
 }
 
 /// Parse init files. exec_path is the path of fish executable as determined by argv[0].
@@ -247,6 +270,9 @@ static int fish_parse_opt(int argc, char **argv, fish_cmd_opts_t *opts) {
                                               {"login", no_argument, NULL, 'l'},
                                               {"no-execute", no_argument, NULL, 'n'},
                                               {"profile", required_argument, NULL, 'p'},
+                                              {"profile-format", required_argument, NULL, 1},
+                                              {"startup-trace", no_argument, NULL, 2},
+                                              {"editor-server", no_argument, NULL, 3},
                                               {"help", no_argument, NULL, 'h'},
                                               {"version", no_argument, NULL, 'v'},
                                               {NULL, 0, NULL, 0}};
@@ -298,6 +324,27 @@ static int fish_parse_opt(int argc, char **argv, fish_cmd_opts_t *opts) {
                 g_profiling_active = true;
                 break;
             }
+            case 1: {
+                if (!strcmp(optarg, "raw")) {
+                    s_profiling_format = profile_format_raw;
+                } else if (!strcmp(optarg, "aggregate")) {
+                    s_profiling_format = profile_format_aggregate;
+                } else if (!strcmp(optarg, "collapsed")) {
+                    s_profiling_format = profile_format_collapsed;
+                } else {
+                    fwprintf(stderr, _(L"Invalid value '%s' for profile-format flag\n"), optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case 2: {
+                s_startup_trace = true;
+                break;
+            }
+            case 3: {
+                opts->editor_server = true;
+                break;
+            }
             case 'v': {
                 fwprintf(stdout, _(L"%s, version %s\n"), PACKAGE_NAME, get_fish_version());
                 exit(0);
@@ -332,7 +379,8 @@ static int fish_parse_opt(int argc, char **argv, fish_cmd_opts_t *opts) {
     // We are an interactive session if we have not been given an explicit
     // command or file to execute and stdin is a tty. Note that the -i or
     // --interactive options also force interactive mode.
-    if (opts->batch_cmds.size() == 0 && optind == argc && isatty(STDIN_FILENO)) {
+    if (opts->batch_cmds.size() == 0 && optind == argc && !opts->editor_server &&
+        isatty(STDIN_FILENO)) {
         is_interactive_session = 1;
     }
 
@@ -343,6 +391,7 @@ int main(int argc, char **argv) {
     int res = 1;
     int my_optind = 0;
 
+    s_startup_start = s_startup_phase_start = timef();
     program_name = L"fish";
     set_main_thread();
     setup_fork_guards();
@@ -374,13 +423,16 @@ int main(int argc, char **argv) {
     }
 
     const struct config_paths_t paths = determine_config_directory_paths(argv[0]);
+    startup_phase_done(L"arguments");
     env_init(&paths);
+    startup_phase_done(L"env_init");
     proc_init();
     event_init();
     builtin_init();
     misc_init();
     reader_init();
     history_init();
+    startup_phase_done(L"other_init");
 
     parser_t &parser = parser_t::principal_parser();
 
@@ -392,9 +444,14 @@ int main(int argc, char **argv) {
         // Run post-config commands specified as arguments, if any.
         if (!opts.postconfig_cmds.empty()) {
             res = run_command_list(&opts.postconfig_cmds, empty_ios);
+            startup_phase_done(L"init-command");
         }
+        s_startup_phase_start = s_startup_start;
+        startup_phase_done(L"total");
 
-        if (!opts.batch_cmds.empty()) {
+        if (opts.editor_server) {
+            res = editor_server_run(STDIN_FILENO, STDOUT_FILENO);
+        } else if (!opts.batch_cmds.empty()) {
             // Run the commands specified as arguments, if any.
             if (is_login) {
                 // Do something nasty to support OpenSUSE assuming we're bash. This may modify cmds.
@@ -445,9 +502,10 @@ int main(int argc, char **argv) {
     restore_term_foreground_process_group();
 
     if (g_profiling_active) {
-        parser.emit_profiling(s_profiling_output_filename);
+        parser.emit_profiling(s_profiling_output_filename, s_profiling_format);
     }
 
+    env_universal_flush();
     history_destroy();
     proc_destroy();
     builtin_destroy();
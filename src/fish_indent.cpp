@@ -27,8 +27,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <wchar.h>
 #include <wctype.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "color.h"
@@ -36,6 +38,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "env.h"
 #include "fish_version.h"
 #include "highlight.h"
+#include "iothread.h"
 #include "output.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
@@ -338,6 +341,66 @@ static std::string html_colorize(const wcstring &text,
 
 static std::string no_colorize(const wcstring &text) { return wcs2string(text); }
 
+/// The outcome of formatting one file in place.
+struct format_result_t {
+    /// Whether the file was rewritten because its formatting changed.
+    bool changed = false;
+    /// The message to report if the file could not be read or written, or empty.
+    wcstring error;
+};
+
+/// Formats the file at the given path, and writes it back if that changed it. This may be called
+/// from any thread.
+static format_result_t format_file_in_place(const char *path, bool do_indent) {
+    format_result_t result;
+    FILE *fh = fopen(path, "r");
+    if (!fh) {
+        result.error = format_string(_(L"Opening \"%s\" failed: %s\n"), path, strerror(errno));
+        return result;
+    }
+    const wcstring src = read_file(fh);
+    fclose(fh);
+
+    const wcstring output_wtext = prettify(src, do_indent);
+    if (output_wtext == src) return result;
+
+    fh = fopen(path, "w");
+    if (!fh) {
+        result.error = format_string(_(L"Opening \"%s\" failed: %s\n"), path, strerror(errno));
+        return result;
+    }
+    fputws(output_wtext.c_str(), fh);
+    fclose(fh);
+    result.changed = true;
+    return result;
+}
+
+/// Formats the given files in place, on up to the given number of threads. With more than one file
+/// this reports how many were changed and how long it took. Returns the exit status.
+static int format_files_in_place(int count, char **paths, bool do_indent, size_t threads) {
+    double start = timef();
+    std::vector<format_result_t> results(count);
+    iothread_perform_parallel(count, threads - 1, [&](size_t i) {
+        results[i] = format_file_in_place(paths[i], do_indent);
+    });
+
+    int status = 0;
+    size_t changed = 0;
+    for (const format_result_t &result : results) {
+        if (!result.error.empty()) {
+            fwprintf(stderr, L"%ls", result.error.c_str());
+            status = 1;
+        }
+        if (result.changed) changed++;
+    }
+    if (count > 1) {
+        fwprintf(stderr, _(L"%ls: formatted %d files, changed %lu, in %.0f ms on %lu threads\n"),
+                 program_name, count, (unsigned long)changed, (timef() - start) * 1000,
+                 (unsigned long)std::min(threads, (size_t)count));
+    }
+    return status;
+}
+
 int main(int argc, char *argv[]) {
     program_name = L"fish_indent";
     set_main_thread();
@@ -358,10 +421,10 @@ int main(int argc, char *argv[]) {
         output_type_ansi,
         output_type_html
     } output_type = output_type_plain_text;
-    const char *output_location = "";
     bool do_indent = true;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
 
-    const char *short_opts = "+d:hvwiD:";
+    const char *short_opts = "+d:hvwiD:j:";
     const struct option long_opts[] = {{"debug-level", required_argument, NULL, 'd'},
                                        {"debug-stack-frames", required_argument, NULL, 'D'},
                                        {"dump-parse-tree", no_argument, NULL, 'P'},
@@ -369,6 +432,7 @@ int main(int argc, char *argv[]) {
                                        {"help", no_argument, NULL, 'h'},
                                        {"version", no_argument, NULL, 'v'},
                                        {"write", no_argument, NULL, 'w'},
+                                       {"jobs", required_argument, NULL, 'j'},
                                        {"html", no_argument, NULL, 1},
                                        {"ansi", no_argument, NULL, 2},
                                        {NULL, 0, NULL, 0}};
@@ -398,6 +462,21 @@ int main(int argc, char *argv[]) {
                 do_indent = false;
                 break;
             }
+            case 'j': {
+                char *end;
+                long tmp;
+
+                errno = 0;
+                tmp = strtol(optarg, &end, 10);
+
+                if (tmp > 0 && tmp <= 1024 && !*end && !errno) {
+                    threads = (size_t)tmp;
+                } else {
+                    fwprintf(stderr, _(L"Invalid value '%s' for jobs flag"), optarg);
+                    exit(1);
+                }
+                break;
+            }
             case 1: {
                 output_type = output_type_html;
                 break;
@@ -455,12 +534,13 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
         src = read_file(stdin);
+    } else if (output_type == output_type_file) {
+        return format_files_in_place(argc, argv, do_indent, threads);
     } else if (argc == 1) {
         FILE *fh = fopen(*argv, "r");
         if (fh) {
             src = read_file(fh);
             fclose(fh);
-            output_location = *argv;
         } else {
             fwprintf(stderr, _(L"Opening \"%s\" failed: %s\n"), *argv, strerror(errno));
             exit(1);
@@ -486,16 +566,7 @@ int main(int argc, char *argv[]) {
             break;
         }
         case output_type_file: {
-            FILE *fh = fopen(output_location, "w");
-            if (fh) {
-                fputws(output_wtext.c_str(), fh);
-                fclose(fh);
-                exit(0);
-            } else {
-                fwprintf(stderr, _(L"Opening \"%s\" failed: %s\n"), output_location,
-                         strerror(errno));
-                exit(1);
-            }
+            DIE("files are written by format_files_in_place");
             break;
         }
         case output_type_ansi: {
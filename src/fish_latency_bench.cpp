@@ -0,0 +1,238 @@
+// Measures how quickly interactive fish responds to keystrokes. This runs fish on a pseudo-terminal
+// and types scripted keystrokes into it, as a user would. Each keystroke is timed from when it is
+// written until fish's output goes quiet. At that point the command line has been repainted,
+// including any highlighting, autosuggestion and completions computed in the background. The
+// program prints latency percentiles for each kind of keystroke:
+//
+// highlight:   typing a command line no history entry suggests. Every key press highlights the
+//              line and looks for an autosuggestion, but none is shown.
+// autosuggest: typing the start of a command that is in the history, so its suggestion is shown.
+// complete:    pressing tab, both for a unique completion and for one that opens the pager.
+// repaint:     repainting an unchanged command line.
+//
+// Usage: fish_latency_bench [-r ROUNDS] [-q QUIET_MSEC] [PATH_TO_FISH]
+#include "config.h"  // IWYU pragma: keep
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+/// How long fish's output must stay quiet before a keystroke counts as handled.
+static int quiet_msec = 100;
+
+/// How long to wait for fish to start up and show its first prompt.
+#define STARTUP_QUIET_MSEC 1000
+
+/// Give up on a keystroke that keeps fish writing for longer than this.
+#define MAX_KEYSTROKE_MSEC 10000
+
+/// The history entries typed in the autosuggest rounds. Each round types a prefix that only one
+/// entry starts with.
+#define SUGGESTION_PREFIX "true latency-benchmark-"
+
+/// The master side of fish's terminal, and fish's pid.
+static int master_fd = -1;
+static pid_t fish_pid = -1;
+
+/// Start fish as an interactive shell on a new pseudo-terminal. Returns false on failure.
+static bool spawn_fish(const char *fish_path) {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+        perror("posix_openpt");
+        return false;
+    }
+    const char *slave_name = ptsname(master_fd);
+    if (!slave_name) {
+        perror("ptsname");
+        return false;
+    }
+
+    fish_pid = fork();
+    if (fish_pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (fish_pid == 0) {
+        // Make the pseudo-terminal our controlling terminal, as a terminal emulator would.
+        setsid();
+        int slave_fd = open(slave_name, O_RDWR);
+        if (slave_fd < 0) _exit(127);
+#ifdef TIOCSCTTY
+        ioctl(slave_fd, TIOCSCTTY, 0);
+#endif
+        struct winsize size = {};
+        size.ws_row = 24;
+        size.ws_col = 80;
+        ioctl(slave_fd, TIOCSWINSZ, &size);
+        dup2(slave_fd, STDIN_FILENO);
+        dup2(slave_fd, STDOUT_FILENO);
+        dup2(slave_fd, STDERR_FILENO);
+        if (slave_fd > STDERR_FILENO) close(slave_fd);
+        close(master_fd);
+
+        setenv("TERM", "xterm", 1);
+        execl(fish_path, fish_path, "-i", (char *)NULL);
+        _exit(127);
+    }
+    return true;
+}
+
+/// Read fish's output until it has been quiet for quiet_ms, discarding it. Returns the time the
+/// last output arrived, or since if there was none. Returns since as well if fish is still writing
+/// after MAX_KEYSTROKE_MSEC, which is reported.
+static bench_clock_t::time_point drain_until_quiet(bench_clock_t::time_point since, int quiet_ms) {
+    bench_clock_t::time_point last_output = since;
+    for (;;) {
+        struct pollfd pfd = {master_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, quiet_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+
+        char buff[4096];
+        ssize_t amt = read(master_fd, buff, sizeof buff);
+        if (amt < 0 && errno == EINTR) continue;
+        if (amt <= 0) break;  // fish exited
+        last_output = bench_clock_t::now();
+        if (last_output - since > std::chrono::milliseconds(MAX_KEYSTROKE_MSEC)) {
+            fwprintf(stderr, L"fish_latency_bench: fish did not go quiet after a keystroke\n");
+            return since;
+        }
+    }
+    return last_output;
+}
+
+/// Type text into fish without timing it.
+static void type_untimed(const std::string &text) {
+    for (char c : text) {
+        if (write(master_fd, &c, 1) != 1) return;
+        drain_until_quiet(bench_clock_t::now(), quiet_msec);
+    }
+}
+
+/// Type one key, and return how long fish took to respond to it, in msec.
+static double type_timed(const std::string &key) {
+    bench_clock_t::time_point start = bench_clock_t::now();
+    if (write(master_fd, key.data(), key.size()) != (ssize_t)key.size()) return 0;
+    bench_clock_t::time_point end = drain_until_quiet(start, quiet_msec);
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/// Type each character of text, adding the latency of each to samples.
+static void type_each_timed(const std::string &text, std::vector<double> *samples) {
+    for (char c : text) {
+        samples->push_back(type_timed(std::string(1, c)));
+    }
+}
+
+/// Clear the command line.
+static void clear_line() { type_untimed("\x15"); }  // ctrl-U: backward-kill-line
+
+/// Print the nearest-rank percentiles of samples, in msec.
+static void report_latency(const char *name, std::vector<double> samples) {
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double q) {
+        size_t rank = (size_t)(q * samples.size() + 0.999999);
+        return samples.at(std::max(rank, (size_t)1) - 1);
+    };
+    fwprintf(stdout, L"latency\t%s\t%lu\t%.3f\t%.3f\t%.3f\t%.3f\n", name,
+             (unsigned long)samples.size(), percentile(0.5), percentile(0.9), percentile(0.99),
+             samples.back());
+    fflush(stdout);
+}
+
+static void print_usage(const char *argv0) {
+    fwprintf(stderr, L"Usage: %s [-r ROUNDS] [-q QUIET_MSEC] [PATH_TO_FISH]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 5;
+    const struct option long_options[] = {{"rounds", required_argument, NULL, 'r'},
+                                          {"quiet", required_argument, NULL, 'q'},
+                                          {"help", no_argument, NULL, 'h'},
+                                          {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:q:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r': {
+                rounds = atoi(optarg);
+                break;
+            }
+            case 'q': {
+                quiet_msec = atoi(optarg);
+                break;
+            }
+            case 'h': {
+                print_usage(argv[0]);
+                return 0;
+            }
+            default: {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (rounds < 1 || quiet_msec < 1 || argc - optind > 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *fish_path = optind < argc ? argv[optind] : "test/root/bin/fish";
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!spawn_fish(fish_path)) return 1;
+    drain_until_quiet(bench_clock_t::now(), STARTUP_QUIET_MSEC);
+
+    // Keep the benchmark's commands out of the user's history, bind a key to repaint, and add the
+    // history entries the autosuggest rounds type.
+    type_untimed("set fish_history fish_latency_bench; bind \\cg repaint\r");
+    for (int i = 0; i < rounds; i++) {
+        type_untimed(SUGGESTION_PREFIX + std::to_string(i) + "\r");
+    }
+
+    std::vector<double> highlight, autosuggest, complete, repaint;
+    for (int i = 0; i < rounds; i++) {
+        type_each_timed("echo $PATH (count $argv) 'some quoted text' >/dev/null", &highlight);
+        repaint.push_back(type_timed("\x07"));  // ctrl-G, bound to repaint above
+        clear_line();
+
+        type_each_timed(SUGGESTION_PREFIX + std::to_string(i), &autosuggest);
+        clear_line();
+
+        type_untimed("ech");
+        complete.push_back(type_timed("\t"));
+        clear_line();
+        type_untimed("string ");
+        complete.push_back(type_timed("\t"));
+        clear_line();
+    }
+
+    fwprintf(stdout, L"latency\tkeystroke\tcount\tp50\tp90\tp99\tmax\n");
+    report_latency("highlight", highlight);
+    report_latency("autosuggest", autosuggest);
+    report_latency("complete", complete);
+    report_latency("repaint", repaint);
+
+    type_untimed("exit\r");
+    close(master_fd);
+    kill(fish_pid, SIGHUP);
+    waitpid(fish_pid, NULL, 0);
+    return 0;
+}
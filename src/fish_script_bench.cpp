@@ -0,0 +1,242 @@
+// Measures how fast fish runs scripts, to track interpreter throughput across changes. Each script
+// in the benchmark directory (tests/benchmarks by default) exercises one part of the language. It
+// is run as `fish SCRIPT SCALE SCRATCH_DIR` and prints the number of operations it did as its last
+// line of output. SCRATCH_DIR persists across the runs of a script, so the first, untimed, run can
+// prepare files for the others.
+//
+// Each script is run several times with each fish given, and the fastest run counts. The time
+// fish takes to start up and exit is subtracted before computing operations per second. Counting
+// allocations would need an instrumented allocator, so memory use is reported instead, as each
+// run's peak resident set size and its minor page faults. The first fish given is the reference
+// the others are compared with.
+//
+// Usage: fish_script_bench [-s SCALE] [-r RUNS] [-d DIR] FISH [FISH...]
+#include "config.h"  // IWYU pragma: keep
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace {
+/// The outcome of running a script once.
+struct bench_run_t {
+    bool ok = false;
+    // The number of operations the script reports.
+    long ops = 0;
+    // Wall clock time.
+    double msec = 0;
+    // Peak resident set size, in the units of ru_maxrss: KB on Linux, bytes on macOS.
+    long maxrss = 0;
+    long minflt = 0;
+};
+}  // anonymous namespace
+
+/// Run fish with the given arguments, and return how long it took and what it printed last.
+static bench_run_t run_fish(const char *fish_path, const std::vector<std::string> &args) {
+    bench_run_t result;
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("pipe");
+        return result;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return result;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(fish_path));
+        for (const std::string &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(NULL);
+        execv(fish_path, &argv.at(0));
+        _exit(127);
+    }
+
+    close(pipe_fds[1]);
+    std::string output;
+    char buff[4096];
+    for (;;) {
+        ssize_t amt = read(pipe_fds[0], buff, sizeof buff);
+        if (amt < 0 && errno == EINTR) continue;
+        if (amt <= 0) break;
+        output.append(buff, amt);
+    }
+    close(pipe_fds[0]);
+
+    int status = 0;
+    struct rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+    }
+    result.msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                      .count();
+    result.maxrss = usage.ru_maxrss;
+    result.minflt = usage.ru_minflt;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    // The operation count is the last line of output.
+    while (!output.empty() && output.back() == '\n') output.pop_back();
+    size_t line_start = output.rfind('\n');
+    result.ops = strtol(output.c_str() + (line_start == std::string::npos ? 0 : line_start + 1),
+                        NULL, 10);
+    return result;
+}
+
+/// Run fish with the given arguments runs times, and return the fastest run. Fails if any run does.
+static bench_run_t fastest_run(const char *fish_path, const std::vector<std::string> &args,
+                               int runs) {
+    bench_run_t best;
+    for (int i = 0; i < runs; i++) {
+        bench_run_t run = run_fish(fish_path, args);
+        if (!run.ok) return run;
+        if (i == 0 || run.msec < best.msec) best = run;
+    }
+    return best;
+}
+
+/// Return the paths of the .fish scripts in dir, sorted.
+static std::vector<std::string> list_scripts(const std::string &dir) {
+    std::vector<std::string> result;
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        perror(dir.c_str());
+        return result;
+    }
+    while (const struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".fish") == 0) {
+            result.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void print_usage(const char *argv0) {
+    fwprintf(stderr, L"Usage: %s [-s SCALE] [-r RUNS] [-d DIR] FISH [FISH...]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    std::string scale = "1", dir = "tests/benchmarks";
+    int runs = 3;
+    const struct option long_options[] = {{"scale", required_argument, NULL, 's'},
+                                          {"runs", required_argument, NULL, 'r'},
+                                          {"dir", required_argument, NULL, 'd'},
+                                          {"help", no_argument, NULL, 'h'},
+                                          {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:r:d:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's': {
+                scale = optarg;
+                break;
+            }
+            case 'r': {
+                runs = atoi(optarg);
+                break;
+            }
+            case 'd': {
+                dir = optarg;
+                break;
+            }
+            case 'h': {
+                print_usage(argv[0]);
+                return 0;
+            }
+            default: {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (runs < 1 || optind == argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const std::vector<const char *> builds(argv + optind, argv + argc);
+
+    const std::vector<std::string> scripts = list_scripts(dir);
+    if (scripts.empty()) {
+        fwprintf(stderr, L"%s: no benchmark scripts in %s\n", argv[0], dir.c_str());
+        return 1;
+    }
+    char scratch_template[] = "/tmp/fish_script_bench.XXXXXX";
+    const char *scratch = mkdtemp(scratch_template);
+    if (!scratch) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // Time starting and exiting each fish, by running an empty script.
+    std::vector<double> startup_msec;
+    for (size_t b = 0; b < builds.size(); b++) {
+        bench_run_t run = fastest_run(builds.at(b), {"/dev/null"}, runs);
+        startup_msec.push_back(run.msec);
+        fwprintf(stdout, L"# build %lu: %s, starts up in %.3f msec\n", (unsigned long)(b + 1),
+                 builds.at(b), run.msec);
+    }
+    fwprintf(stdout, L"script\tbuild\tops\tmsec\tops/sec\trelative\tmaxrss\tminflt\n");
+
+    int status = 0;
+    for (const std::string &script : scripts) {
+        std::string name = script.substr(script.rfind('/') + 1);
+        name.resize(name.size() - 5);
+        const std::vector<std::string> args = {script, scale, scratch};
+
+        double reference_ops_per_sec = 0;
+        for (size_t b = 0; b < builds.size(); b++) {
+            // Warm up, and let the script prepare its scratch files.
+            bench_run_t run = run_fish(builds.at(b), args);
+            if (run.ok) run = fastest_run(builds.at(b), args, runs);
+            if (!run.ok || run.ops <= 0) {
+                fwprintf(stderr, L"%s: %s failed with %s\n", argv[0], name.c_str(), builds.at(b));
+                status = 1;
+                continue;
+            }
+
+            double msec = std::max(run.msec - startup_msec.at(b), 0.001);
+            double ops_per_sec = run.ops / msec * 1000;
+            if (b == 0) reference_ops_per_sec = ops_per_sec;
+            double relative = reference_ops_per_sec > 0 ? ops_per_sec / reference_ops_per_sec : 0;
+            fwprintf(stdout, L"%s\t%lu\t%ld\t%.3f\t%.0f\t%.3f\t%ld\t%ld\n", name.c_str(),
+                     (unsigned long)(b + 1), run.ops, msec, ops_per_sec, relative, run.maxrss,
+                     run.minflt);
+            fflush(stdout);
+        }
+    }
+
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <libgen.h>
 #include <limits.h>
+#include <locale.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -35,13 +36,16 @@
 #include <utility>
 #include <vector>
 
+#include "autoload.h"
 #include "builtin.h"
 #include "color.h"
 #include "common.h"
 #include "complete.h"
+#include "complete_db.h"
 #include "env.h"
 #include "env_universal_common.h"
 #include "event.h"
+#include "exec.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "function.h"
@@ -49,8 +53,10 @@
 #include "history.h"
 #include "input.h"
 #include "input_common.h"
+#include "intern.h"
 #include "io.h"
 #include "iothread.h"
+#include "kill.h"
 #include "lru.h"
 #include "maybe.h"
 #include "pager.h"
@@ -58,7 +64,9 @@
 #include "parse_tree.h"
 #include "parse_util.h"
 #include "parser.h"
+#include "parser_keywords.h"
 #include "path.h"
+#include "perfect_hash.h"
 #include "proc.h"
 #include "reader.h"
 #include "screen.h"
@@ -93,6 +101,25 @@ static bool should_test_function(const char *func_name) {
     return result;
 }
 
+/// The number of allocations made through operator new, for benchmarks.
+static std::atomic<size_t> s_allocation_count{0};
+
+void *operator new(size_t size) {
+    s_allocation_count++;
+    void *result = malloc(size ? size : 1);
+    if (!result) throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+// Indicate if we should run the given benchmark. Benchmarks are slow, so unlike tests they only
+// run when named (or prefixed) by an argument.
+static bool should_benchmark_function(const char *func_name) {
+    if (!s_arguments || !s_arguments[0]) return false;
+    return should_test_function(func_name);
+}
+
 /// The number of tests to run.
 #define ESCAPE_TEST_COUNT 100000
 /// The average length of strings to unescape.
@@ -291,7 +318,8 @@ static void test_unescape_sane() {
         {L"abcd", L"abcd"},           {L"'abcd'", L"abcd"},
         {L"'abcd\\n'", L"abcd\\n"},   {L"\"abcd\\n\"", L"abcd\\n"},
         {L"\"abcd\\n\"", L"abcd\\n"}, {L"\\143", L"c"},
-        {L"'\\143'", L"\\143"},       {L"\\n", L"\n"}  // \n normally becomes newline
+        {L"'\\143'", L"\\143"},       {L"\\n", L"\n"},  // \n normally becomes newline
+        {L"plain\"dq\\$x\\\"y\"'sq\\'z'tail", L"plaindq$x\"ysq'ztail"},
     };
     wcstring output;
     for (size_t i = 0; i < sizeof tests / sizeof *tests; i++) {
@@ -440,6 +468,9 @@ static void test_convert() {
             free(o2);
             free(n2);
         }
+        if (wcs2string(w) != n) {
+            err(L"Line %d - %d: wcs2string and wcs2str disagree", __LINE__, i);
+        }
         free((void *)n);
     }
 }
@@ -471,6 +502,64 @@ static void test_convert_nulls(void) {
     }
 }
 
+/// Verify that conversions under a UTF-8 locale, which skip mbrtowc() and wcrtomb() for valid text,
+/// decode what they should and still round-trip invalid sequences.
+static void test_convert_utf8(void) {
+    say(L"Testing wide/narrow string conversion in a UTF-8 locale");
+    const std::string saved_locale = setlocale(LC_ALL, NULL);
+    if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8")) {
+        say(L"No UTF-8 locale available, skipping");
+        return;
+    }
+    fish_setlocale();
+
+    const struct {
+        const char *narrow;
+        const wchar_t *wide;
+    } tests[] = {
+        {"plain ascii text", L"plain ascii text"},
+        {"caf\xC3\xA9 \xE2\x80\xA6 \xF0\x9F\x90\x9F", L"caf\u00E9 \u2026 \U0001F41F"},
+        {"\xC3", L"\xF6C3"},                          // truncated sequence
+        {"\xC0\x80", L"\xF6C0\xF680"},                // overlong encoding of nul
+        {"\xED\xA0\x80", L"\xF6ED\xF6A0\xF680"},      // surrogate
+        {"\xEF\x98\x80", L"\xF6EF\xF698\xF680"},      // U+F600, which is ENCODE_DIRECT_BASE
+        {"abcdefgh\x80ijklmnop", L"abcdefgh\xF680ijklmnop"},
+    };
+    for (size_t i = 0; i < sizeof tests / sizeof *tests; i++) {
+        const wcstring wide = str2wcstring(tests[i].narrow);
+        if (wide != tests[i].wide) {
+            err(L"Converting test %lu to wide produced '%ls'", (unsigned long)i, wide.c_str());
+        }
+        if (wcs2string(wide) != tests[i].narrow) {
+            err(L"Converting test %lu back to narrow did not round-trip", (unsigned long)i);
+        }
+        char *narrow = wcs2str(wide);
+        if (strcmp(narrow, tests[i].narrow)) {
+            err(L"wcs2str of test %lu did not round-trip", (unsigned long)i);
+        }
+        free(narrow);
+    }
+
+    // Mix valid characters of every length with random bytes.
+    const char *pieces[] = {"a", "\xC3\xA9", "\xE2\x80\xA6", "\xF0\x9F\x90\x9F", "\x80", "\xFF"};
+    for (int i = 0; i < ESCAPE_TEST_COUNT / 10; i++) {
+        std::string in;
+        while (rand() % ESCAPE_TEST_LENGTH) {
+            if (rand() % 4) {
+                in.append(pieces[rand() % (sizeof pieces / sizeof *pieces)]);
+            } else {
+                in.push_back((char)(rand() % 255 + 1));
+            }
+        }
+        if (wcs2string(str2wcstring(in)) != in) {
+            err(L"Line %d - %d: UTF-8 conversion cycle produced a different string", __LINE__, i);
+        }
+    }
+
+    setlocale(LC_ALL, saved_locale.c_str());
+    fish_setlocale();
+}
+
 /// Test the tokenizer.
 static void test_tokenizer() {
     say(L"Testing tokenizer");
@@ -507,6 +596,38 @@ static void test_tokenizer() {
         }
     }
 
+    say(L"Test tokenizing by range");
+    {
+        tokenizer_t t(str, 0), range_t(str, 0);
+        tok_t range_token;
+        const wcstring source = str;
+        while (t.next(&token)) {
+            do_test(range_t.next_range(&range_token));
+            do_test(range_token.type == token.type);
+            do_test(range_token.offset == token.offset);
+            do_test(range_token.length == token.length);
+            if (token.type == TOK_STRING) {
+                do_test(range_token.text.empty());
+                do_test(source.substr(token.offset, token.length) == token.text);
+            } else {
+                do_test(range_token.text == token.text);
+            }
+        }
+        do_test(!range_t.next_range(&range_token));
+        do_test(tok_first(L"  echo 'hi'") == L"echo");
+        do_test(tok_first(L"| cat").empty());
+    }
+
+    // A caret after other characters is part of the string, however many were skipped.
+    {
+        tokenizer_t t(L"x/y.z-0^ $a[1]^b ^out", 0);
+        do_test(t.next(&token) && token.type == TOK_STRING && token.text == L"x/y.z-0^");
+        do_test(t.next(&token) && token.type == TOK_STRING && token.text == L"$a[1]^b");
+        do_test(t.next(&token) && token.type == TOK_REDIRECT_OUT);
+        do_test(t.next(&token) && token.type == TOK_STRING && token.text == L"out");
+        do_test(!t.next(&token));
+    }
+
     // Test some errors.
     {
         tokenizer_t t(L"abc\\", 0);
@@ -592,6 +713,22 @@ static void test_iothread(void) {
 
     say(L"    (%.02f msec, with max of %d threads)", (end - start) * 1000.0,
         max_achieved_thread_count);
+
+    // A background thread may queue several functions for the main thread before waiting.
+    std::atomic<int> performed{0};
+    std::atomic<int> seen_after_wait{0};
+    iothread_perform([&]() {
+        std::vector<std::future<void>> futures;
+        for (int i = 0; i < 10; i++) {
+            futures.push_back(iothread_enqueue_on_main([&]() { performed++; }));
+        }
+        for (std::future<void> &future : futures) future.wait();
+        seen_after_wait = performed.load();
+    });
+    iothread_drain_all();
+    if (seen_after_wait != 10) {
+        err(L"Expected 10 main thread calls to be done, but saw %d", seen_after_wait.load());
+    }
 }
 
 static parser_test_error_bits_t detect_argument_errors(const wcstring &src) {
@@ -757,7 +894,90 @@ static void test_parser() {
     do_test(comps.at(0).completion == L"alpha");
     do_test(comps.at(1).completion == L"beta gamma");
     do_test(comps.at(2).completion == L"delta");
+
+    say(L"Testing evaluating the same source again");
+    const wcstring src = L"set -g fish_test_eval_again $fish_test_eval_again x";
+    for (int i = 0; i < 3; i++) {
+        parser_t::principal_parser().eval(src, io_chain_t(), TOP);
+    }
+    auto again = env_get(L"fish_test_eval_again");
+    do_test(again && again->as_list() == wcstring_list_t({L"x", L"x", L"x"}));
+    env_remove(L"fish_test_eval_again", ENV_GLOBAL);
+}
+
+static void test_io_buffer_lines() {
+    say(L"Testing splitting buffered output into lines");
+    wcstring_list_t split;
+    shared_ptr<io_buffer_t> buff(io_buffer_t::create(STDOUT_FILENO, io_chain_t(), 16));
+    buff->split_lines_into(&split);
+    buff->out_buffer_append("ab", 2);
+    do_test(split.empty() && buff->out_buffer_size() == 2);
+    buff->out_buffer_append("c\nd", 3);
+    buff->out_buffer_append("\n\ne", 3);
+    do_test(split == wcstring_list_t({L"abc", L"d", L""}));
+    do_test(buff->out_buffer_size() == 1 && buff->out_buffer_ptr()[0] == 'e');
+
+    // The limit applies to all the output, not just what is left in the buffer.
+    buff->out_buffer_append("fghijklmn", 9);
+    do_test(buff->output_discarded() && split.empty() && buff->out_buffer_size() == 0);
+
+    // Output read from a pipe is split as it arrives, too.
+    split.clear();
+    shared_ptr<io_buffer_t> piped(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
+    piped->split_lines_into(&split);
+    int fds[2];
+    do_test(pipe(fds) == 0);
+    do_test(write(fds[1], "x\ny\nz", 5) == 5);
+    close(fds[1]);
+    do_test(piped->append_from_fd(fds[0]) == 5);
+    do_test(piped->append_from_fd(fds[0]) == 0);
+    close(fds[0]);
+    do_test(split == wcstring_list_t({L"x", L"y"}));
+    do_test(piped->out_buffer_size() == 1 && piped->out_buffer_ptr()[0] == 'z');
+
+    // Command substitutions split their output the same way.
+    auto saved_ifs = env_get(L"IFS");
+    env_set_one(L"IFS", ENV_GLOBAL, L"\n");
+    wcstring_list_t outputs;
+    exec_subshell(L"printf 'one\\n\\ntwo\\nthree'", outputs, false, true);
+    do_test(outputs == wcstring_list_t({L"one", L"", L"two", L"three"}));
+    if (saved_ifs) {
+        env_set(L"IFS", ENV_GLOBAL, saved_ifs->as_list());
+    } else {
+        env_remove(L"IFS", ENV_GLOBAL);
+    }
+}
+
+static void test_io_buffer_deferred_pipe() {
+    say(L"Testing buffers that defer making their pipe");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function fish_test_deferred; echo -n b; string upper c; end", io_chain_t(), TOP);
+
+    // Builtins and functions append to the buffer directly, so no pipe is needed.
+    shared_ptr<io_buffer_t> buff(io_buffer_t::create(STDOUT_FILENO, io_chain_t(), 0, true));
+    parser.eval(L"echo -n a; fish_test_deferred; if true; echo d; end", io_chain_t(buff), TOP);
+    do_test(!buff->has_pipe());
+    buff->read();
+    do_test(std::string(buff->out_buffer_ptr(), buff->out_buffer_size()) == "abC\nd\n");
+
+    function_remove(L"fish_test_deferred");
+}
+
+#ifdef HAVE__PROC_SELF_STAT
+static void test_jiffies() {
+    say(L"Testing reading cpu time from /proc");
+    do_test(proc_get_jiffies(0) == 0);
+
+    // Spin until our own cpu time moves, which proves the fields are found.
+    unsigned long before = proc_get_jiffies(getpid());
+    double start = timef();
+    volatile unsigned long spin = 0;
+    while (proc_get_jiffies(getpid()) == before && timef() - start < 5) {
+        for (int i = 0; i < 1000000; i++) spin += i;
+    }
+    do_test(proc_get_jiffies(getpid()) > before);
 }
+#endif
 
 static void test_1_cancellation(const wchar_t *src) {
     shared_ptr<io_buffer_t> out_buff(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
@@ -820,6 +1040,46 @@ static void test_cancellation() {
     reader_reset_interrupted();
 }
 
+static void test_signal_events() {
+    say(L"Testing signal events");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"set -g __fish_test_signals; function __fish_test_on_usr2 --on-signal USR2; "
+                L"set -g __fish_test_signals $__fish_test_signals $argv; end",
+                io_chain_t(), TOP);
+
+    // A burst of signals is not cut short, and each one fires the handler once.
+    const size_t burst = 200;
+    for (size_t i = 0; i < burst; i++) event_fire_signal(SIGUSR2);
+    event_fire(NULL);
+    auto signals = env_get(L"__fish_test_signals");
+    size_t count = signals ? signals->as_list().size() : 0;
+    if (count != burst) {
+        err(L"Expected %lu signal events, got %lu", (unsigned long)burst, (unsigned long)count);
+    } else if (signals->as_list().at(0) != L"SIGUSR2") {
+        err(L"Unexpected signal handler argument '%ls'", signals->as_list().at(0).c_str());
+    }
+
+    // Signals that arrive while events are blocked are kept until they are unblocked.
+    parser.eval(L"set -g __fish_test_signals; block -g", io_chain_t(), TOP);
+    event_fire_signal(SIGUSR2);
+    event_fire_signal(SIGUSR2);
+    event_fire(NULL);
+    signals = env_get(L"__fish_test_signals");
+    if (signals && !signals->as_list().empty()) {
+        err(L"Signal handler ran while events were blocked");
+    }
+    parser.eval(L"block -e", io_chain_t(), TOP);
+    event_fire(NULL);
+    signals = env_get(L"__fish_test_signals");
+    count = signals ? signals->as_list().size() : 0;
+    if (count != 2) {
+        err(L"Expected 2 signal events after unblocking, got %lu", (unsigned long)count);
+    }
+
+    parser.eval(L"functions -e __fish_test_on_usr2; set -e __fish_test_signals", io_chain_t(),
+                TOP);
+}
+
 static void test_indents() {
     say(L"Testing indents");
 
@@ -942,6 +1202,35 @@ static void test_parse_util_cmdsubst_extent() {
     }
 }
 
+static void test_parse_util_extents() {
+    // Ask about each buffer twice and about an edited copy in between, as the reader does, so the
+    // answers are checked both when the tokens are cached and when they are not.
+    const wcstring src = L"echo a | cat foo; ls (pwd) &";
+    wcstring edited = src;
+    edited.replace(wcslen(L"echo a | cat "), 3, L"bar");
+    const wchar_t *begin = NULL, *end = NULL, *prev_begin = NULL, *prev_end = NULL;
+    for (int i = 0; i < 2; i++) {
+        for (const wcstring &buff : {src, edited, src}) {
+            const wchar_t *a = buff.c_str();
+            parse_util_job_extent(a, wcslen(L"echo a | c"), &begin, &end);
+            do_test(wcstring(begin, end) == L"echo a | cat " + buff.substr(13, 3));
+            parse_util_process_extent(a, wcslen(L"echo a | c"), &begin, &end);
+            do_test(wcstring(begin, end) == L" cat " + buff.substr(13, 3));
+            parse_util_process_extent(a, 2, &begin, &end);
+            do_test(wcstring(begin, end) == L"echo a ");
+            parse_util_job_extent(a, wcslen(L"echo a | cat foo; l"), &begin, &end);
+            do_test(wcstring(begin, end) == L" ls (pwd) ");
+            parse_util_token_extent(a, wcslen(L"echo a | cat f"), &begin, &end, &prev_begin,
+                                    &prev_end);
+            do_test(wcstring(begin, end) == buff.substr(13, 3));
+            do_test(wcstring(prev_begin, prev_end) == L"cat");
+            parse_util_token_extent(a, wcslen(L"echo a | cat foo; ls (p"), &begin, &end, NULL,
+                                    NULL);
+            do_test(wcstring(begin, end) == L"pwd");
+        }
+    }
+}
+
 static struct wcsfilecmp_test {
     const wchar_t *str1;
     const wchar_t *str2;
@@ -997,10 +1286,50 @@ static void test_wcsfilecmp() {
     }
 }
 
+/// Verify fish_wcwidth() and fish_wcswidth() against known widths.
+static void test_fish_wcwidth() {
+    const struct {
+        wchar_t wc;
+        int width;
+    } widths[] = {{L'\0', 0},    {L'\x01', -1},  {L'a', 1},      {0x7f, -1},     {0x9f, -1},
+                  {0xa0, 1},     {0x0301, 0},    {0x1160, 0},    {0x200b, 0},    {0x1100, 2},
+                  {0x3000, 2},   {0x303f, 1},    {0x4e00, 2},    {0xac00, 2},    {0xd7a4, 1},
+                  {0xff01, 2},   {0x1d167, 0},   {0x20000, 2},   {0xe0001, 0},   {0xe01ef, 0},
+                  {0x10ffff, 1}, {(wchar_t)0x110000, 1}};
+    for (size_t i = 0; i < sizeof widths / sizeof *widths; i++) {
+        int width = fish_wcwidth(widths[i].wc);
+        if (width != widths[i].width) {
+            err(L"fish_wcwidth(0x%lx) returned %d, expected %d", (unsigned long)widths[i].wc,
+                width, widths[i].width);
+        }
+    }
+
+    do_test(fish_wcswidth(L"") == 0);
+    do_test(fish_wcswidth(L"hello world") == 11);
+    do_test(fish_wcswidth(L"abc\x4e00\x0301" L"def") == 8);
+    do_test(fish_wcswidth(L"abc\ndef") == -1);
+    do_test(fish_wcswidth(L"abcdef", 3) == 3);
+    do_test(fish_wcswidth(wcstring(L"ab\0cd", 5)) == 2);
+}
+
+/// Verify that intern() returns one copy per distinct string.
+static void test_intern() {
+    const wchar_t *literal = intern_static(L"intern_test_literal");
+    do_test(intern(wcstring(L"intern_test_literal").c_str()) == literal);
+    const wchar_t *copy = intern(wcstring(L"intern_test_copy").c_str());
+    do_test(!wcscmp(copy, L"intern_test_copy"));
+    do_test(intern(L"intern_test_copy") == copy);
+    do_test(intern(L"intern_test_cop") != copy);
+    do_test(intern(NULL) == NULL);
+}
+
 static void test_utility_functions() {
     say(L"Testing utility functions");
     test_wcsfilecmp();
+    test_fish_wcwidth();
+    test_intern();
     test_parse_util_cmdsubst_extent();
+    test_parse_util_extents();
 }
 
 // UTF8 tests taken from Alexey Vatchenko's utf8 library. See http://www.bsdua.org/libbsdua.html.
@@ -1207,6 +1536,29 @@ static void test_utf8() {
 #endif
 }
 
+static void test_utf8_string() {
+    say(L"Testing utf8_string_t");
+    const wcstring strs[] = {L"",
+                             L"plain ascii",
+                             L"\x0422\x0435\x0441\x0442 \x3042",
+                             wcstring(L"embedded\0nul", 12),
+                             wcstring(1, ENCODE_DIRECT_BASE + 0xff) + L"raw byte",
+                             wcstring(1, (wchar_t)0x1f600) + L"astral",
+                             wcstring(1, (wchar_t)0xd800) + L"lone surrogate",
+                             wcstring(1, (wchar_t)0x7fffffff) + L"out of range"};
+    for (const wcstring &str : strs) {
+        const utf8_string_t stored(str);
+        if (stored.str() != str) err(L"utf8_string_t did not keep '%ls'", str.c_str());
+        do_test(stored == utf8_string_t(str));
+        do_test(stored.empty() == str.empty());
+    }
+    do_test(utf8_string_t(L"one") != utf8_string_t(L"two"));
+
+    // ASCII takes a byte a character.
+    const wcstring ascii(1000, L'x');
+    do_test(utf8_string_t(ascii).memory() < sizeof(utf8_string_t) + 2 * ascii.size());
+}
+
 static void test_escape_sequences(void) {
     say(L"Testing escape_sequences");
     if (escape_code_length(L"") != 0) err(L"test_escape_sequences failed on line %d\n", __LINE__);
@@ -1313,6 +1665,108 @@ static void test_lru(void) {
     do_test(cache.evicted.size() == size_t(total_nodes));
 }
 
+static void test_sharded_lru(void) {
+    say(L"Testing sharded LRU cache");
+
+    // Keys that are never looked up again are evicted once their shard is full.
+    sharded_lru_cache_t<int, int> cache(64);
+    for (int i = 0; i < 1000; i++) cache.insert(i, i * 2);
+    lru_cache_stats_t stats = cache.stats();
+    do_test(stats.entries > 0 && stats.entries <= 64);
+    do_test(stats.evictions == 1000 - stats.entries);
+    int value = -1;
+    do_test(cache.get(999, &value) && value == 1998);
+    do_test(!cache.get(0, &value));
+    cache.insert(999, 5);
+    do_test(cache.get(999, &value) && value == 5);
+    stats = cache.stats();
+    do_test(stats.hits == 2 && stats.misses == 1);
+    do_test(cache.evict(999) && !cache.evict(999));
+    cache.evict_all();
+    do_test(cache.stats().entries == 0);
+
+    // The byte limit applies as well as the count.
+    sharded_lru_cache_t<wcstring, wcstring> sized(1024, 800);
+    for (int i = 0; i < 100; i++) sized.insert(to_string(i), L"x", 50);
+    stats = sized.stats();
+    do_test(stats.bytes == stats.entries * 50 && stats.bytes <= 800);
+    do_test(stats.evictions == 100 - stats.entries);
+
+    // Entries are not returned once they are too old.
+    sharded_lru_cache_t<wcstring, bool> aging(16, 0, 0.05);
+    aging.insert(L"old", true);
+    do_test(aging.get(L"old", NULL));
+    usleep(100000);
+    do_test(!aging.get(L"old", NULL));
+    do_test(aging.stats().expirations == 1 && aging.stats().entries == 0);
+
+    // Threads share the cache.
+    sharded_lru_cache_t<int, int> shared(4096);
+    for (int t = 0; t < 4; t++) {
+        iothread_perform([&shared, t]() {
+            for (int i = 0; i < 1000; i++) {
+                int found;
+                if (!shared.get(i, &found)) {
+                    shared.insert(i, i);
+                } else if (found != i) {
+                    err(L"Thread %d found %d for key %d", t, found, i);
+                }
+            }
+        });
+    }
+    iothread_drain_all();
+    stats = shared.stats();
+    do_test(stats.entries == 1000 && stats.hits + stats.misses == 4000);
+}
+
+/// Return the entries of the kill ring, most recent first, by rotating it all the way around.
+static wcstring_list_t kill_ring_entries() {
+    wcstring_list_t result;
+    for (size_t i = kill_memory_usage().count; i > 0; i--) {
+        result.push_back(kill_yank());
+        kill_yank_rotate();
+    }
+    return result;
+}
+
+static void test_kill_ring() {
+    say(L"Testing kill ring");
+    kill_set_capacity(1);
+    kill_add(L"a");
+    do_test(kill_ring_entries() == wcstring_list_t({L"a"}));
+
+    kill_set_capacity(3);
+    kill_add(L"b");
+    kill_add(L"c");
+    do_test(kill_ring_entries() == wcstring_list_t({L"c", L"b", L"a"}));
+    do_test(kill_yank_rotate() == wcstring(L"b"));
+    do_test(kill_yank() == wcstring(L"b"));
+    do_test(kill_ring_entries() == wcstring_list_t({L"b", L"a", L"c"}));
+
+    // Adding an entry again moves it to the top, and adding one to a full ring drops the oldest.
+    kill_add(L"a");
+    do_test(kill_ring_entries() == wcstring_list_t({L"a", L"b", L"c"}));
+    kill_add(L"d");
+    do_test(kill_ring_entries() == wcstring_list_t({L"d", L"a", L"b"}));
+    kill_replace(L"d", L"de");
+    do_test(kill_ring_entries() == wcstring_list_t({L"de", L"a", L"b"}));
+    kill_replace(L"b", L"bc");
+    do_test(kill_ring_entries() == wcstring_list_t({L"bc", L"de", L"a"}));
+    kill_add(L"");
+    do_test(kill_memory_usage().count == 3);
+
+    // A ring with free slots rotates the same way.
+    kill_set_capacity(5);
+    do_test(kill_ring_entries() == wcstring_list_t({L"bc", L"de", L"a"}));
+    kill_yank_rotate();
+    kill_add(L"f");
+    do_test(kill_ring_entries() == wcstring_list_t({L"f", L"de", L"a", L"bc"}));
+    kill_set_capacity(2);
+    do_test(kill_ring_entries() == wcstring_list_t({L"f", L"de"}));
+    kill_sanity_check();
+    kill_set_capacity(KILL_RING_CAPACITY);
+}
+
 /// Perform parameter expansion and test if the output equals the zero-terminated parameter list
 /// supplied.
 ///
@@ -1402,6 +1856,41 @@ static void test_expand() {
     expand_test(L"foo\\$bar", EXPAND_SKIP_VARIABLES, L"foo$bar", 0,
                 L"Failed to handle dollar sign in variable-skipping expansion");
 
+    // Quoted strings and single variables skip most of the expansion stages.
+    env_set(L"fish_expand_test_var", ENV_GLOBAL, {L"a", L"b c", L"*"});
+    expand_test(L"'x $y'", 0, L"x $y", 0, L"Single quoted string expanded wrongly");
+    expand_test(L"\"x*{y}\"", 0, L"x*{y}", 0, L"Double quoted string expanded wrongly");
+    expand_test(L"$fish_expand_test_var", 0, L"a", L"b c", L"*", 0,
+                L"Variable expanded wrongly");
+    expand_test(L"\"$fish_expand_test_var\"", 0, L"a b c *", 0,
+                L"Quoted variable expanded wrongly");
+    expand_test(L"$fish_expand_test_var", EXPAND_SKIP_VARIABLES, L"$fish_expand_test_var", 0,
+                L"Cannot skip variable expansion");
+    env_remove(L"fish_expand_test_var", ENV_GLOBAL);
+    expand_test(L"$fish_expand_test_var", 0, 0, L"Missing variable expanded wrongly");
+    expand_test(L"\"$fish_expand_test_var\"", 0, L"", 0,
+                L"Missing quoted variable expanded wrongly");
+
+    // Products with too many arguments are an error.
+    const size_t saved_limit = expand_argument_limit;
+    expand_argument_limit = 8;
+    expand_test(L"{a,b}{c,d}{e,f}", 0, L"ace", L"acf", L"ade", L"adf", L"bce", L"bcf", L"bde",
+                L"bdf", 0, L"Bracket expansion within the limit is broken");
+    env_set(L"fish_expand_test_var", ENV_GLOBAL, {L"1", L"2", L"3"});
+    const wchar_t *const too_many[] = {L"{a,b}{c,d}{e,f}{g,h}",
+                                       L"$fish_expand_test_var$fish_expand_test_var",
+                                       L"$fish_expand_test_var{a,b,c}"};
+    for (const wchar_t *in : too_many) {
+        std::vector<completion_t> output;
+        parse_error_list_t errors;
+        if (expand_string(in, &output, 0, &errors) != EXPAND_ERROR || errors.empty() ||
+            !output.empty()) {
+            err(L"Expanding '%ls' did not fail for too many arguments", in);
+        }
+    }
+    env_remove(L"fish_expand_test_var", ENV_GLOBAL);
+    expand_argument_limit = saved_limit;
+
     // bb
     //    x
     // bar
@@ -1417,6 +1906,10 @@ static void test_expand() {
     // aaa
     // aaa2
     //    x
+    // cdef
+    //    z
+    // xcde
+    //    z
     if (system("mkdir -p test/fish_expand_test/")) err(L"mkdir failed");
     if (system("mkdir -p test/fish_expand_test/bb/")) err(L"mkdir failed");
     if (system("mkdir -p test/fish_expand_test/baz/")) err(L"mkdir failed");
@@ -1432,6 +1925,12 @@ static void test_expand() {
     if (system("touch test/fish_expand_test/baz/yyy")) err(L"touch failed");
     if (system("touch test/fish_expand_test/lol/nub/q")) err(L"touch failed");
     if (system("touch test/fish_expand_test/aaa2/x")) err(L"touch failed");
+    if (system("mkdir -p test/fish_expand_test/cdef/ test/fish_expand_test/xcde/")) {
+        err(L"mkdir failed");
+    }
+    if (system("touch test/fish_expand_test/cdef/z test/fish_expand_test/xcde/z")) {
+        err(L"touch failed");
+    }
 
     // This is checking that .* does NOT match . and ..
     // (https://github.com/fish-shell/fish-shell/issues/270). But it does have to match literal
@@ -1505,6 +2004,10 @@ static void test_expand() {
     expand_test(L"test/fish_expand_test/aaa/x", EXPAND_FOR_COMPLETIONS | EXPAND_FUZZY_MATCH, wnull,
                 L"Wrong fuzzy matching 6 - shouldn't remove valid directory names (#3211)");
 
+    // Directories matching only a substring are not searched once a prefix match found something.
+    expand_test(L"test/fish_expand_test/cd/z", EXPAND_FOR_COMPLETIONS | EXPAND_FUZZY_MATCH,
+                L"test/fish_expand_test/cdef/z", wnull, L"Wrong fuzzy matching 7");
+
     if (!expand_test(L"test/fish_expand_test/.*", 0, L"test/fish_expand_test/.foo", 0)) {
         err(L"Expansion not correctly handling dotfiles");
     }
@@ -1524,6 +2027,160 @@ static void test_expand() {
     popd();
 }
 
+static void test_expand_recursive() {
+    say(L"Testing recursive wildcard expansion");
+    if (system("mkdir -p test/fish_rec_test/a/b/c test/fish_rec_test/a/x test/fish_rec_test/d/e "
+               "test/fish_rec_test/f")) {
+        err(L"mkdir failed");
+    }
+    if (system("cd test/fish_rec_test && touch t.c a/t.c a/b/t.c a/b/c/t.c a/x/t.h d/e/t.c && "
+               "ln -s .. a/b/loop && ln -s ../b a/x/bsib && ln -s ../../d d/e/up")) {
+        err(L"making files failed");
+    }
+
+    // Links back to a directory being expanded are not followed, but links elsewhere are.
+    const wchar_t *const wnull = NULL;
+    expand_test(L"test/fish_rec_test/**.c", 0, L"test/fish_rec_test/t.c",
+                L"test/fish_rec_test/a/t.c", L"test/fish_rec_test/a/b/t.c", L"test/fish_rec_test/a/b/c/t.c",
+                L"test/fish_rec_test/a/x/bsib/t.c", L"test/fish_rec_test/a/x/bsib/c/t.c",
+                L"test/fish_rec_test/d/e/t.c", wnull, L"Wrong recursive expansion");
+    expand_test(L"test/fish_rec_test/**/c", 0, L"test/fish_rec_test/a/b/c",
+                L"test/fish_rec_test/a/x/bsib/c", wnull, L"Wrong recursive directory expansion");
+
+    // The directories are walked in parallel, but the order of the results is always the same.
+    std::vector<completion_t> first;
+    do_test(wildcard_expand_string(L"test/fish_rec_test/" + wcstring(1, ANY_STRING_RECURSIVE),
+                                   L"", 0, &first) == 1);
+    do_test(first.size() == 20);
+    for (int i = 0; i < 5; i++) {
+        std::vector<completion_t> again;
+        wildcard_expand_string(L"test/fish_rec_test/" + wcstring(1, ANY_STRING_RECURSIVE), L"", 0,
+                               &again);
+        if (again.size() != first.size() ||
+            !std::equal(first.begin(), first.end(), again.begin(),
+                        [](const completion_t &a, const completion_t &b) {
+                            return a.completion == b.completion;
+                        })) {
+            err(L"Recursive expansion gave results in a different order");
+        }
+    }
+
+    if (system("rm -Rf test/fish_rec_test")) err(L"rm failed");
+}
+
+static void test_expand_cache() {
+    say(L"Testing the wildcard expansion cache");
+    if (system("mkdir -p test/fish_cache_test/sub && touch test/fish_cache_test/sub/one.c && "
+               "touch -d '2001-01-01' test/fish_cache_test test/fish_cache_test/sub")) {
+        err(L"making files failed");
+    }
+    const wcstring wc = L"test/fish_cache_test/" + wcstring(1, ANY_STRING) + L"/" +
+                        wcstring(1, ANY_STRING) + L".c";
+
+    // The second expansion is answered from the cache.
+    wildcard_cache_stats_t before = wildcard_cache_stats();
+    std::vector<completion_t> first, second;
+    do_test(wildcard_expand_string(wc, L"", 0, &first) == 1);
+    do_test(wildcard_expand_string(wc, L"", 0, &second) == 1);
+    wildcard_cache_stats_t after = wildcard_cache_stats();
+    do_test(after.misses == before.misses + 1 && after.hits == before.hits + 1);
+    do_test(second.size() == 1 && second.at(0).completion == L"test/fish_cache_test/sub/one.c");
+
+    // Results already in the output are not added again.
+    do_test(wildcard_expand_string(wc, L"", 0, &second) == 0);
+    do_test(second.size() == 1);
+
+    // Adding a file changes the directory, so the wildcard is expanded again.
+    if (system("touch test/fish_cache_test/sub/two.c")) err(L"touch failed");
+    before = wildcard_cache_stats();
+    std::vector<completion_t> third;
+    do_test(wildcard_expand_string(wc, L"", 0, &third) == 1);
+    after = wildcard_cache_stats();
+    do_test(after.misses == before.misses + 1 && after.hits == before.hits);
+    do_test(third.size() == 2);
+
+    if (system("rm -Rf test/fish_cache_test")) err(L"rm failed");
+}
+
+static void time_barrier(void);
+
+static void test_expand_file_types() {
+    say(L"Testing file types in wildcard completion");
+    if (system("mkdir -p test/fish_types_test/dir")) err(L"mkdir failed");
+    if (system("touch test/fish_types_test/plain test/fish_types_test/prog")) err(L"touch failed");
+    if (system("chmod +x test/fish_types_test/prog")) err(L"chmod failed");
+    if (system("cd test/fish_types_test && ln -s dir dirlink && ln -s prog proglink && "
+               "ln -s nowhere broken && mkfifo pipe")) {
+        err(L"making links failed");
+    }
+
+    auto names = [](expand_flags_t flags) {
+        std::vector<completion_t> comps;
+        do_test(expand_string(L"test/fish_types_test/", &comps, EXPAND_FOR_COMPLETIONS | flags,
+                              NULL) != EXPAND_ERROR);
+        std::set<wcstring> result;
+        for (const completion_t &c : comps) result.insert(c.completion);
+        return result;
+    };
+
+    // Without descriptions, the types from readdir are used instead of stat, with the same results.
+    const struct {
+        expand_flags_t flags;
+        std::set<wcstring> expected;
+    } tests[] = {
+        {0, {L"dir/", L"dirlink/", L"plain", L"prog", L"proglink", L"broken", L"pipe"}},
+        {DIRECTORIES_ONLY, {L"dir/", L"dirlink/"}},
+        {EXECUTABLES_ONLY, {L"prog", L"proglink"}},
+    };
+    for (const auto &test : tests) {
+        do_test(names(test.flags | EXPAND_NO_DESCRIPTIONS) == test.expected);
+        do_test(names(test.flags) == test.expected);
+    }
+
+    // Once the files are older than a second, whether they are executable is only found out once.
+    time_barrier();
+    do_test(names(EXECUTABLES_ONLY) == tests[2].expected);
+    wildcard_cache_stats_t before = file_desc_cache_stats();
+    do_test(names(0) == tests[0].expected);
+    wildcard_cache_stats_t after = file_desc_cache_stats();
+    do_test(after.hits > before.hits && after.misses == before.misses);
+
+    // Changing the mode of a file is noticed.
+    if (system("chmod -x test/fish_types_test/prog")) err(L"chmod failed");
+    do_test(names(EXECUTABLES_ONLY).empty());
+
+    if (system("rm -Rf test/fish_types_test")) err(L"rm failed");
+}
+
+static void test_wildcard_pattern() {
+    say(L"Testing prepared wildcards");
+    // Prepared wildcards must give the same results as wildcard_match, including for dots.
+    const wchar_t wc_chars[] = {L'a', L'b', L'.', ANY_CHAR, ANY_STRING, ANY_STRING_RECURSIVE};
+    const wchar_t str_chars[] = {L'a', L'b', L'.'};
+    for (int i = 0; i < 20000; i++) {
+        wcstring wc, str;
+        for (int len = rand() % 7; len > 0; len--) wc.push_back(wc_chars[rand() % 6]);
+        for (int len = rand() % 7; len > 0; len--) str.push_back(str_chars[rand() % 3]);
+        for (bool dots : {false, true}) {
+            if (wildcard_pattern_t(wc, dots).matches(str) != wildcard_match(str, wc, dots)) {
+                err(L"Prepared wildcard '%ls' does not match '%ls' like wildcard_match",
+                    escape_string(wc, ESCAPE_ALL).c_str(), str.c_str());
+            }
+        }
+    }
+
+    const wcstring star(1, ANY_STRING), any(1, ANY_CHAR);
+    do_test(wildcard_pattern_t(L"foo" + star + L"bar").matches(L"foo-bar-bar"));
+    do_test(wildcard_pattern_t(L"foo" + star + L"bar").matches(L"foobar"));
+    do_test(!wildcard_pattern_t(L"foo" + star + L"bar").matches(L"fobar"));
+    do_test(wildcard_pattern_t(star + L"a" + any + L"c" + star).matches(L"xxabxabcx"));
+    do_test(!wildcard_pattern_t(star + L"a" + any + L"c" + star).matches(L"xxabxab"));
+    do_test(!wildcard_pattern_t(star, true).matches(L".hidden"));
+    do_test(wildcard_pattern_t(L"." + star, true).matches(L".hidden"));
+    do_test(!wildcard_pattern_t(L"." + star, true).matches(L".."));
+    do_test(wildcard_pattern_t(L"..", true).matches(L".."));
+}
+
 static void test_fuzzy_match(void) {
     say(L"Testing fuzzy string matching");
 
@@ -1612,6 +2269,20 @@ static void test_abbreviations(void) {
     expanded = reader_expand_abbreviation_in_command(L"command gc", wcslen(L"command gc"), &result);
     if (expanded) err(L"gc incorrectly expanded on line %ld", (long)__LINE__);
 
+    // Words are checked for abbreviation names before the command line is parsed.
+    if (!abbreviation_in_word(L"echo;gc", 0, 7, 7)) err(L"Missed gc on line %ld", (long)__LINE__);
+    if (abbreviation_in_word(L"echo;gc", 0, 7, 4)) err(L"Found gc on line %ld", (long)__LINE__);
+    if (abbreviation_in_word(L"gcx", 0, 3, 3)) err(L"Found gc on line %ld", (long)__LINE__);
+    if (!abbreviation_in_word(L"gcx", 0, 3, 1)) err(L"Missed gc on line %ld", (long)__LINE__);
+    expanded = reader_expand_abbreviation_in_command(L"echo;gc ", wcslen(L"echo;gc"), &result);
+    if (!expanded) err(L"gc not expanded on line %ld", (long)__LINE__);
+    if (result != L"echo;git checkout ")
+        err(L"gc incorrectly expanded on line %ld to '%ls'", (long)__LINE__, result.c_str());
+    expanded = reader_expand_abbreviation_in_command(L"gcx ", wcslen(L"gcx"), &result);
+    if (expanded) err(L"gcx incorrectly expanded on line %ld", (long)__LINE__);
+    expanded = reader_expand_abbreviation_in_command(L"'gc' ", wcslen(L"'gc'"), &result);
+    if (expanded) err(L"'gc' incorrectly expanded on line %ld", (long)__LINE__);
+
     env_pop();
 }
 
@@ -1641,6 +2312,182 @@ static void test_path() {
         err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
 }
 
+/// Returns how often the given command was found according to the path cache, or 0.
+static unsigned long path_cache_hits(const wcstring &cmd) {
+    for (const path_cache_item_t &item : path_cache_items()) {
+        if (item.command == cmd) return item.hits;
+    }
+    return 0;
+}
+
+static void test_path_cache() {
+    say(L"Testing PATH lookup cache");
+    if (system("rm -Rf test/path_cache_test")) err(L"rm failed");
+    if (system("mkdir -p test/path_cache_test/first test/path_cache_test/second")) {
+        err(L"mkdir failed");
+    }
+    if (system("touch test/path_cache_test/second/fish_cached && "
+               "chmod +x test/path_cache_test/second/fish_cached")) {
+        err(L"touch failed");
+    }
+    const wcstring first = wgetcwd() + L"/test/path_cache_test/first",
+                   second = wgetcwd() + L"/test/path_cache_test/second";
+    const auto saved_path = env_get(L"PATH");
+    env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT, {first, second});
+
+    // Commands in directories changed during the current second are not cached, because further
+    // changes in the same second would go unnoticed.
+    wcstring found;
+    do_test(path_get_path(L"fish_cached", &found) && found == second + L"/fish_cached");
+    do_test(path_cache_hits(L"fish_cached") == 0);
+    sleep(1);
+
+    do_test(path_get_path(L"fish_cached", &found) && found == second + L"/fish_cached");
+    do_test(path_cache_hits(L"fish_cached") == 1);
+    do_test(path_get_path(L"fish_cached", &found) && found == second + L"/fish_cached");
+    do_test(path_cache_hits(L"fish_cached") == 2);
+    do_test(!path_get_path(L"fish_not_cached", NULL));
+    do_test(path_cache_hits(L"fish_not_cached") == 0);
+
+    // Once the second is over, a command added to an earlier directory is found, and so is the
+    // original again when that one is removed.
+    if (system("cp test/path_cache_test/second/fish_cached test/path_cache_test/first")) {
+        err(L"cp failed");
+    }
+    sleep(1);
+    do_test(path_get_path(L"fish_cached", &found) && found == first + L"/fish_cached");
+    if (system("rm test/path_cache_test/first/fish_cached")) err(L"rm failed");
+    sleep(1);
+    do_test(path_get_path(L"fish_cached", &found) && found == second + L"/fish_cached");
+
+    // Changing $PATH, forgetting and resetting all drop cached commands.
+    do_test(path_cache_hits(L"fish_cached") > 0);
+    env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT, {second});
+    do_test(path_get_path(L"fish_cached", &found) && found == second + L"/fish_cached");
+    do_test(path_cache_hits(L"fish_cached") == 1);
+    do_test(path_cache_forget(L"fish_cached"));
+    do_test(!path_cache_forget(L"fish_cached"));
+    do_test(path_get_path(L"fish_cached", NULL));
+    path_cache_reset();
+    do_test(path_cache_items().empty());
+
+    if (saved_path) {
+        env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT, saved_path->as_list());
+    } else {
+        env_remove(L"PATH", ENV_GLOBAL);
+    }
+    if (system("rm -Rf test/path_cache_test")) err(L"rm failed");
+}
+
+static void test_cdpath_cache() {
+    say(L"Testing CDPATH lookup cache");
+    if (system("rm -Rf test/cdpath_cache_test && mkdir -p test/cdpath_cache_test/first")) {
+        err(L"mkdir failed");
+    }
+    const wcstring base = wgetcwd() + L"/test/cdpath_cache_test/";
+    const wchar_t *wd = L"/";
+    const auto saved_cdpath = env_get(L"CDPATH");
+    env_set(L"CDPATH", ENV_GLOBAL, {base + L"first", base + L"second"});
+    const env_var_t dir(L"n/a", L"sub");
+
+    // Highlighting may see a result from earlier in the same second, but cd never does.
+    wcstring found;
+    do_test(!path_get_cdpath(dir, &found, wd, env_vars_snapshot_t::current(), true));
+    do_test(errno == ENOENT);
+    if (system("mkdir -p test/cdpath_cache_test/second/sub")) err(L"mkdir failed");
+    do_test(path_get_cdpath(dir, &found, wd) && found == base + L"second/sub");
+    sleep(1);
+    do_test(path_get_cdpath(dir, &found, wd, env_vars_snapshot_t::current(), true) &&
+            found == base + L"second/sub");
+
+    // A different $CDPATH or working directory is a different lookup.
+    if (system("mkdir test/cdpath_cache_test/first/sub")) err(L"mkdir failed");
+    env_set(L"CDPATH", ENV_GLOBAL, {base + L"first", base + L"second", L"."});
+    do_test(path_get_cdpath(dir, &found, wd, env_vars_snapshot_t::current(), true) &&
+            found == base + L"first/sub");
+    do_test(path_can_be_implicit_cd(base + L"first/sub/", &found, wd,
+                                    env_vars_snapshot_t::current(), true));
+
+    if (saved_cdpath) {
+        env_set(L"CDPATH", ENV_GLOBAL, saved_cdpath->as_list());
+    } else {
+        env_remove(L"CDPATH", ENV_GLOBAL);
+    }
+    if (system("rm -Rf test/cdpath_cache_test")) err(L"rm failed");
+}
+
+/// Returns what complete_print prints.
+static wcstring complete_print_to_string() {
+    output_stream_t out(0);
+    complete_print(out);
+    return out.buffer();
+}
+
+static void test_complete_db() {
+    say(L"Testing the completion database");
+    if (system("rm -Rf test/complete_db_test && mkdir -p test/complete_db_test && "
+               "printf '%s\\n' '# Comment' \"complete -c fish_db_static -s x -l ex -d 'X ray'\" "
+               "> test/complete_db_test/static.fish && "
+               "printf '%s\\n' 'set -l arg y' 'complete -c fish_db_dynamic -a $arg' "
+               "> test/complete_db_test/dynamic.fish && "
+               "touch -t 200001010000 test/complete_db_test/static.fish "
+               "test/complete_db_test/dynamic.fish")) {
+        err(L"creating completion scripts failed");
+    }
+    const wcstring base = wgetcwd() + L"/test/complete_db_test/";
+
+    // Scripts are recorded the first time they are seen, and then loaded from the database unless
+    // they do more than call complete.
+    do_test(!complete_db_load(base + L"static.fish"));
+    do_test(!complete_db_load(base + L"dynamic.fish"));
+    iothread_drain_all();
+    do_test(complete_db_load(base + L"static.fish"));
+    do_test(complete_print_to_string().find(
+                L"fish_db_static --long-option ex --description 'X ray'") != wcstring::npos);
+    do_test(!complete_db_load(base + L"dynamic.fish"));
+
+    // A changed script is sourced until it is recorded again.
+    if (system("echo 'complete -c fish_db_static -s y' >> test/complete_db_test/static.fish && "
+               "touch -t 200001020000 test/complete_db_test/static.fish")) {
+        err(L"changing completion script failed");
+    }
+    do_test(!complete_db_load(base + L"static.fish"));
+    iothread_drain_all();
+    do_test(complete_db_load(base + L"static.fish"));
+    do_test(complete_print_to_string().find(L"fish_db_static --short-option 'y'") !=
+            wcstring::npos);
+
+    complete_remove_all(L"fish_db_static", false);
+    if (system("rm -Rf test/complete_db_test")) err(L"rm failed");
+}
+
+static void test_wrealpath() {
+    say(L"Testing wrealpath");
+    if (system("rm -Rf test/realpath_test && mkdir -p test/realpath_test/first/sub "
+               "test/realpath_test/second/sub && ln -s first test/realpath_test/link")) {
+        err(L"mkdir failed");
+    }
+    const wcstring base = *wrealpath(wgetcwd()) + L"/test/realpath_test/";
+
+    // Resolving again gives the same answer, including below a remembered directory.
+    for (int i = 0; i < 2; i++) {
+        do_test(wrealpath(base + L"link/sub") == base + L"first/sub");
+        do_test(wrealpath(base + L"link/sub/") == base + L"first/sub");
+        do_test(wrealpath(base + L"link/sub/missing") == base + L"first/sub/missing");
+        do_test(wrealpath(base + L"link/sub/../sub/.") == base + L"first/sub");
+    }
+    do_test(!wrealpath(base + L"link/missing/file"));
+
+    // Pointing the symlink elsewhere, or renaming a directory, is noticed straight away.
+    if (system("ln -sfn second test/realpath_test/link")) err(L"ln failed");
+    do_test(wrealpath(base + L"link/sub") == base + L"second/sub");
+    if (system("mv test/realpath_test/second test/realpath_test/third")) err(L"mv failed");
+    do_test(wrealpath(base + L"third/sub") == base + L"third/sub");
+    do_test(!wrealpath(base + L"link/sub/file"));
+
+    if (system("rm -Rf test/realpath_test")) err(L"rm failed");
+}
+
 static void test_pager_navigation() {
     say(L"Testing pager navigation");
 
@@ -1736,6 +2583,40 @@ static void test_pager_navigation() {
     }
 }
 
+/// Verify that the pager search narrows and widens its list as the search text is edited.
+static void test_pager_filter() {
+    say(L"Testing pager filtering");
+    completion_list_t completions;
+    append_completion(&completions, L"abc");
+    append_completion(&completions, L"ABD");
+    append_completion(&completions, L"xyz", L"about");
+
+    pager_t pager;
+    pager.set_completions(completions);
+    pager.set_term_size(80, 24);
+    pager.set_search_field_shown(true);
+    const struct {
+        const wchar_t *search;
+        const wchar_t *last_match;
+    } steps[] = {{L"a", L"xyz"}, {L"ab", L"xyz"}, {L"abc", L"abc"},
+                 {L"ab", L"xyz"}, {L"abd", L"ABD"}, {L"", L"xyz"}};
+    for (const auto &step : steps) {
+        pager.search_field_line.clear();
+        pager.search_field_line.insert_string(step.search);
+        pager.refilter_completions();
+        page_rendering_t rendering = pager.render();
+
+        // Selecting backwards from nothing selects the last completion that passed the filter.
+        pager.select_next_completion_in_direction(direction_deselect, rendering);
+        pager.select_next_completion_in_direction(direction_prev, rendering);
+        const completion_t *last = pager.selected_completion(rendering);
+        if (!last || last->completion != step.last_match) {
+            err(L"Searching for '%ls', expected last match '%ls' but found '%ls'", step.search,
+                step.last_match, last ? last->completion.c_str() : L"(none)");
+        }
+    }
+}
+
 struct pager_layout_testcase_t {
     size_t width;
     const wchar_t *expected;
@@ -1900,6 +2781,46 @@ static void test_word_motion() {
                        L"^echo /^foo/^bar{^aaa,^bbb,^ccc}^bak/");
 }
 
+/// Test undoing and redoing edits of a command line.
+static void test_undo() {
+    say(L"Testing undo");
+    editable_line_t line;
+    for (wchar_t c : wcstring(L"echo hello")) line.insert_string(wcstring(1, c));
+    do_test(line.text == L"echo hello" && line.undo_count() == 2);
+
+    // Deleting characters one at a time is undone at once, putting the cursor back.
+    line.position = 4;
+    for (size_t i = 0; i < 3; i++) {
+        line.erase_substring(line.position - 1, 1);
+        line.position--;
+    }
+    do_test(line.text == L"e hello" && line.undo_count() == 3);
+    line.set_text(L"e world");
+    do_test(line.undo_count() == 4);
+    do_test(line.undo() && line.text == L"e hello");
+    do_test(line.undo() && line.text == L"echo hello" && line.position == 4);
+    do_test(line.undo() && line.text == L"echo " && line.position == 5);
+    do_test(line.redo() && line.text == L"echo hello" && line.position == 10);
+
+    // A new edit makes the undone ones unredoable.
+    line.position = 0;
+    line.insert_string(L"sudo ");
+    do_test(!line.redo());
+    do_test(line.undo() && line.text == L"echo hello" && line.position == 0);
+    do_test(line.undo() && line.undo() && line.text.empty());
+    do_test(!line.undo());
+    do_test(line.redo() && line.redo() && line.text == L"echo hello");
+
+    // Only the oldest edits are forgotten once the history is too large.
+    const wcstring big(UNDO_MEMORY_LIMIT / sizeof(wchar_t) / 8, L'x');
+    for (int i = 0; i < 8; i++) line.replace_substring(0, line.size(), big + wcstring(1, L'a' + i));
+    do_test(line.undo_count() > 1 && line.undo_count() < 8);
+    do_test(line.undo() && line.text == big + L"g");
+
+    line.clear();
+    do_test(line.text.empty() && !line.undo() && !line.redo());
+}
+
 /// Test is_potential_path.
 static void test_is_potential_path() {
     say(L"Testing is_potential_path");
@@ -1933,6 +2854,14 @@ static void test_is_potential_path() {
     do_test(!is_potential_path(L"test/is_potential_path_test/ar", wds, 0));
 
     do_test(is_potential_path(L"/usr", wds, PATH_REQUIRE_DIR));
+
+    // Probes are remembered until forgotten, so a new file is only seen afterwards.
+    if (system("rm -f test/is_potential_path_test/delta")) err(L"rm failed");
+    do_test(!is_potential_path(L"delta", wds, 0));
+    if (system("touch test/is_potential_path_test/delta")) err(L"touch failed");
+    do_test(!is_potential_path(L"delta", wds, 0));
+    highlight_forget_path_probes();
+    do_test(is_potential_path(L"delta", wds, 0));
 }
 
 /// Test the 'test' builtin.
@@ -2067,6 +2996,21 @@ static void test_test() {
     // https://github.com/fish-shell/fish-shell/issues/601
     do_test(run_test_test(0, L"-S = -S"));
     do_test(run_test_test(1, L"! ! ! A"));
+
+    // The two and three argument forms are evaluated without building an expression tree. Make
+    // sure they agree with the parser on operators appearing as operands.
+    do_test(run_test_test(0, L"-n -n"));
+    do_test(run_test_test(1, L"-z -n"));
+    do_test(run_test_test(0, L"-z ''"));
+    do_test(run_test_test(1, L"! foo"));
+    do_test(run_test_test(0, L"! ''"));
+    do_test(run_test_test(1, L"! -n"));
+    do_test(run_test_test(0, L"= = ="));
+    do_test(run_test_test(0, L"! != x"));
+    do_test(run_test_test(0, L"! -e /bin/ls_not_a_path"));
+    do_test(run_test_test(1, L"! -d /bin"));
+    do_test(run_test_test(1, L"! -eq 5"));
+    do_test(run_test_test(1, L"x -eq 5"));
 }
 
 /// Testing colors.
@@ -2083,61 +3027,528 @@ static void test_colors() {
     do_test(rgb_color_t(L"magenta").is_named());
     do_test(rgb_color_t(L"MaGeNTa").is_named());
     do_test(rgb_color_t(L"mooganta").is_none());
+
+    // Highlight colors are remembered, but follow the variables they come from.
+    env_push(true);
+    env_set_one(L"fish_color_command", ENV_LOCAL, L"red");
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"red"));
+    env_set_one(L"fish_color_command", ENV_LOCAL, L"blue");
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"blue"));
+    do_test(highlight_get_color(highlight_spec_command | highlight_modifier_force_underline,
+                                false)
+                .is_underline());
+    env_pop();
+    do_test(highlight_get_color(highlight_spec_command, false) != rgb_color_t(L"blue"));
 }
 
-static void test_complete(void) {
-    say(L"Testing complete");
+static void test_perfect_hash() {
+    say(L"Testing perfect hash tables");
+    const wcstring_list_t names = builtin_get_names();
+    std::vector<perfect_hash_t<size_t>::entry_t> entries;
+    for (size_t i = 0; i < names.size(); i++) entries.emplace_back(names.at(i).c_str(), i);
+    const perfect_hash_t<size_t> table(entries, SIZE_MAX);
+    for (size_t i = 0; i < names.size(); i++) {
+        const wcstring &name = names.at(i);
+        do_test(table.get(name) == i);
+        do_test(builtin_exists(name));
+        // Names that differ a little are not found, unless they are builtins too.
+        const wcstring near[] = {name + L"x", name.substr(0, name.size() - 1), L"_" + name};
+        for (const wcstring &other : near) {
+            bool is_builtin = contains(names, other);
+            do_test(builtin_exists(other) == is_builtin);
+            do_test((table.get(other) != SIZE_MAX) == is_builtin);
+        }
+    }
+    do_test(table.get(L"") == SIZE_MAX);
+    do_test(!builtin_exists(L"ls"));
+
+    do_test(parser_keywords_is_reserved(L"end"));
+    do_test(parser_keywords_is_reserved(L"command"));
+    do_test(!parser_keywords_is_reserved(L"en"));
+    do_test(!parser_keywords_is_reserved(L"echo"));
+    do_test(parser_keywords_is_block(L"begin"));
+    do_test(!parser_keywords_is_block(L"end"));
+    do_test(parser_keywords_is_subcommand(L"not"));
+    do_test(!parser_keywords_is_subcommand(L"for"));
+    do_test(parser_keywords_skip_arguments(L"else"));
+    do_test(!parser_keywords_skip_arguments(L"if"));
+}
 
-    const wchar_t *name_strs[] = {L"Foo1", L"Foo2", L"Foo3", L"Bar1", L"Bar2", L"Bar3"};
-    size_t count = sizeof name_strs / sizeof *name_strs;
-    const wcstring_list_t names(name_strs, name_strs + count);
-    std::vector<completion_t> completions;
-    complete_set_variable_names(&names);
+static void test_complete_commands_in_path() {
+    say(L"Testing completing commands in $PATH");
+    if (system("rm -Rf test/complete_path_test")) err(L"rm failed");
+    if (system("mkdir -p test/complete_path_test/first test/complete_path_test/second "
+               "test/complete_path_test/third")) {
+        err(L"mkdir failed");
+    }
+    if (system("cd test/complete_path_test && touch first/fish_cmpl_one first/fish_cmpl_plain "
+               "third/fish_cmpl_three && chmod +x first/fish_cmpl_one third/fish_cmpl_three")) {
+        err(L"touch failed");
+    }
+    const wcstring base = wgetcwd() + L"/test/complete_path_test/";
+    const auto saved_path = env_get(L"PATH");
+    env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT,
+            {base + L"first", base + L"missing", base + L"second", base + L"third"});
+
+    auto complete_names = [](const wchar_t *cmd) {
+        std::vector<completion_t> completions;
+        complete(cmd, &completions, COMPLETION_REQUEST_DEFAULT);
+        completions_sort_and_prioritize(&completions);
+        wcstring_list_t names;
+        for (const completion_t &c : completions) names.push_back(c.completion);
+        return names;
+    };
 
-    complete(L"$", &completions, COMPLETION_REQUEST_DEFAULT);
-    completions_sort_and_prioritize(&completions);
-    do_test(completions.size() == 6);
-    do_test(completions.at(0).completion == L"Bar1");
-    do_test(completions.at(1).completion == L"Bar2");
-    do_test(completions.at(2).completion == L"Bar3");
-    do_test(completions.at(3).completion == L"Foo1");
-    do_test(completions.at(4).completion == L"Foo2");
-    do_test(completions.at(5).completion == L"Foo3");
+    // Only executables are offered, from every directory.
+    do_test(complete_names(L"fish_cmpl_") == wcstring_list_t({L"one", L"three"}));
+    do_test(complete_names(L"fish_cmpl_t") == wcstring_list_t({L"hree"}));
 
-    completions.clear();
-    complete(L"$F", &completions, COMPLETION_REQUEST_DEFAULT);
-    completions_sort_and_prioritize(&completions);
-    do_test(completions.size() == 3);
-    do_test(completions.at(0).completion == L"oo1");
-    do_test(completions.at(1).completion == L"oo2");
-    do_test(completions.at(2).completion == L"oo3");
+    // Listings are read again when their directory changes.
+    if (system("cd test/complete_path_test && touch second/fish_cmpl_two && "
+               "chmod +x second/fish_cmpl_two && rm first/fish_cmpl_one")) {
+        err(L"touch failed");
+    }
+    do_test(complete_names(L"fish_cmpl_") == wcstring_list_t({L"three", L"two"}));
 
-    completions.clear();
-    complete(L"$1", &completions, COMPLETION_REQUEST_DEFAULT);
-    completions_sort_and_prioritize(&completions);
-    do_test(completions.empty());
+    // Listings read ahead of time, as the idle prompt does, are the same ones.
+    if (system("cd test/complete_path_test && touch first/fish_cmpl_four && "
+               "chmod +x first/fish_cmpl_four")) {
+        err(L"touch failed");
+    }
+    wildcard_warm_command_dirs({base + L"first", base + L"missing", base + L"second"});
+    do_test(complete_names(L"fish_cmpl_") == wcstring_list_t({L"four", L"three", L"two"}));
 
-    completions.clear();
-    complete(L"$1", &completions, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_FUZZY_MATCH);
-    completions_sort_and_prioritize(&completions);
-    do_test(completions.size() == 2);
-    do_test(completions.at(0).completion == L"$Bar1");
-    do_test(completions.at(1).completion == L"$Foo1");
+    if (saved_path) {
+        env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT, saved_path->as_list());
+    } else {
+        env_remove(L"PATH", ENV_GLOBAL);
+    }
+    if (system("rm -Rf test/complete_path_test")) err(L"rm failed");
+}
 
-    if (system("mkdir -p 'test/complete_test'")) err(L"mkdir failed");
-    if (system("touch 'test/complete_test/has space'")) err(L"touch failed");
-    if (system("touch 'test/complete_test/testfile'")) err(L"touch failed");
-    if (system("chmod 700 'test/complete_test/testfile'")) err(L"chmod failed");
+static void test_complete_command_descriptions() {
+    say(L"Testing command descriptions");
+    wcstring index_path;
+    path_get_data(index_path);
+    index_path.append(L"/command_descriptions");
+    wunlink(index_path);
+    if (system("rm -Rf test/complete_desc_test")) err(L"rm failed");
+    if (system("mkdir -p test/complete_desc_test && cd test/complete_desc_test && "
+               "touch fish_desc_one fish_desc_two fish_desc_alias fish_desc_lib && chmod +x *")) {
+        err(L"mkdir failed");
+    }
+    auto write_apropos = [](const char *output) {
+        FILE *f = fopen("test/complete_desc_test/apropos", "w");
+        if (!f) return err(L"fopen failed");
+        fprintf(f, "#!/bin/sh\nprintf '%s'\n", output);
+        fclose(f);
+        if (system("chmod +x test/complete_desc_test/apropos")) err(L"chmod failed");
+    };
+    write_apropos(
+        "fish_desc_one (1)      - first thing\\n"
+        "fish_desc_two (8), fish_desc_alias (1) - second thing - extra\\n"
+        "fish_desc_lib (3)      - a library call\\n");
+    const auto saved_path = env_get(L"PATH");
+    env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT,
+            {wgetcwd() + L"/test/complete_desc_test", L"/bin", L"/usr/bin"});
+
+    auto descriptions = []() {
+        std::map<wcstring, wcstring> result;
+        std::vector<completion_t> completions;
+        complete(L"fish_desc_", &completions,
+                 COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS);
+        for (const completion_t &c : completions) result[c.completion] = c.description;
+        return result;
+    };
 
-    completions.clear();
-    complete(L"echo (test/complete_test/testfil", &completions, COMPLETION_REQUEST_DEFAULT);
-    do_test(completions.size() == 1);
-    do_test(completions.at(0).completion == L"e");
+    // The first completion starts making the index, which later ones use instead of apropos.
+    descriptions();
+    iothread_drain_all();
+    do_test(waccess(index_path, R_OK) == 0);
+    write_apropos("fish_desc_one (1) - changed\\n");
+    std::map<wcstring, wcstring> descs = descriptions();
+    do_test(descs[L"one"] == L"First thing");
+    do_test(descs[L"two"] == L"Second thing");
+    do_test(descs[L"alias"] == L"Second thing");
+    do_test(descs[L"lib"].find(L"thing") == wcstring::npos);
+
+    if (saved_path) {
+        env_set(L"PATH", ENV_GLOBAL | ENV_EXPORT, saved_path->as_list());
+    } else {
+        env_remove(L"PATH", ENV_GLOBAL);
+    }
+    wunlink(index_path);
+    if (system("rm -Rf test/complete_desc_test")) err(L"rm failed");
+}
 
-    completions.clear();
-    complete(L"echo (ls test/complete_test/testfil", &completions, COMPLETION_REQUEST_DEFAULT);
-    do_test(completions.size() == 1);
-    do_test(completions.at(0).completion == L"e");
+static void test_complete_conditions() {
+    say(L"Testing completion conditions");
+    // Both arguments use the same condition, which counts how often it runs.
+    const wchar_t *condition = L"set -g fish_cond_runs $fish_cond_runs x; true";
+    complete_add(L"fish_cond_test", false, wcstring(), option_type_args_only, NO_FILES, condition,
+                 L"alpha", NULL, 0);
+    complete_add(L"fish_cond_test", false, wcstring(), option_type_args_only, NO_FILES, condition,
+                 L"beta", NULL, 0);
+    env_remove(L"fish_cond_runs", ENV_GLOBAL);
+
+    auto complete_count = [](const wcstring &cmdline) {
+        // Like complete -C, so that the condition sees the command line.
+        builtin_commandline_scoped_transient_t transient(cmdline);
+        std::vector<completion_t> completions;
+        complete(cmdline, &completions, COMPLETION_REQUEST_DEFAULT);
+        return completions.size();
+    };
+    auto runs = []() {
+        auto var = env_get(L"fish_cond_runs");
+        return var ? var->as_list().size() : 0;
+    };
+
+    const complete_condition_stats_t before = complete_condition_stats();
+    do_test(complete_count(L"fish_cond_test ") == 2);
+    do_test(runs() == 1);
+    // The same command line again uses the results from before.
+    do_test(complete_count(L"fish_cond_test ") == 2);
+    do_test(runs() == 1);
+    // A different command line runs the condition again.
+    do_test(complete_count(L"fish_cond_test a") == 1);
+    do_test(runs() == 2);
+    const complete_condition_stats_t after = complete_condition_stats();
+    do_test(after.misses - before.misses == 2);
+    // Each completion ran the condition once, and used the result for the other argument.
+    do_test(after.hits - before.hits == 4);
+
+    // Changing a variable forgets the results.
+    env_set_one(L"fish_cond_other", ENV_GLOBAL, L"1");
+    do_test(complete_count(L"fish_cond_test ") == 2);
+    do_test(runs() == 3);
+    do_test(complete_condition_stats().flushes == after.flushes + 1);
+
+    // Autosuggestions never run conditions.
+    std::vector<completion_t> completions;
+    complete(L"fish_cond_test ", &completions, COMPLETION_REQUEST_AUTOSUGGESTION);
+    do_test(completions.empty());
+    do_test(runs() == 3);
+
+    // Input waiting on stdin cancels before conditions that are not known yet are run.
+    int pipes[2];
+    do_test(pipe(pipes) == 0);
+    const int saved_stdin = dup(STDIN_FILENO);
+    dup2(pipes[0], STDIN_FILENO);
+    do_test(write(pipes[1], "x", 1) == 1);
+    completions.clear();
+    do_test(!complete(L"fish_cond_test b", &completions, COMPLETION_REQUEST_CANCEL_ON_INPUT));
+    do_test(runs() == 3);
+    // Once the input is read, nothing is cancelled.
+    char c;
+    do_test(read(STDIN_FILENO, &c, 1) == 1);
+    do_test(complete(L"fish_cond_test b", &completions, COMPLETION_REQUEST_CANCEL_ON_INPUT));
+    do_test(runs() == 4);
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
+    close(pipes[0]);
+    close(pipes[1]);
+
+    complete_remove_all(L"fish_cond_test", false);
+    env_remove(L"fish_cond_runs", ENV_GLOBAL);
+    env_remove(L"fish_cond_other", ENV_GLOBAL);
+}
+
+static void test_complete_options() {
+    say(L"Testing completing options");
+    const wchar_t *cmd = L"fish_opt_test";
+    auto add = [&](const wchar_t *option, complete_option_type_t type, int result_mode,
+                   const wchar_t *condition, const wchar_t *args) {
+        complete_add(cmd, false, option, type, NO_FILES | result_mode, condition, args, NULL, 0);
+    };
+    add(L"a", option_type_short, 0, NULL, NULL);
+    add(L"b", option_type_short, NO_COMMON, NULL, L"one two");
+    add(L"I", option_type_short, NO_COMMON, NULL, L"inc");
+    add(L"foo", option_type_double_long, 0, NULL, NULL);
+    add(L"Foobar", option_type_double_long, 0, NULL, NULL);
+    add(L"color", option_type_double_long, 0, NULL, L"auto never");
+    add(L"size", option_type_double_long, NO_COMMON, NULL, L"big");
+    add(L"old", option_type_single_long, NO_COMMON, NULL, L"olda");
+    add(L"hidden", option_type_double_long, 0, L"false", NULL);
+    add(L"", option_type_args_only, 0, NULL, L"plain");
+
+    const struct {
+        const wchar_t *cmdline;
+        const wchar_t *expected;
+    } tests[] = {
+        {L"", L"plain"},
+        {L"-", L"-color -color= -foo -Foobar -size a b I old"},
+        {L"-a", L"b I"},
+        {L"-b", L"one two"},
+        {L"--fo", L"--Foobar o"},
+        {L"--FO", L"--foo --Foobar"},
+        {L"--color=", L"auto never"},
+        {L"--hid", L""},
+        {L"-Iin", L"c"},
+        {L"-b ", L"one two"},
+        {L"--size ", L"big"},
+        {L"--color ", L"plain"},
+        {L"-old ", L"olda"},
+        {L"p", L"lain"},
+    };
+    for (const auto &test : tests) {
+        std::vector<completion_t> comps;
+        complete(wcstring(cmd) + L" " + test.cmdline, &comps, COMPLETION_REQUEST_DEFAULT);
+        completions_sort_and_prioritize(&comps);
+        wcstring got;
+        for (const completion_t &c : comps) {
+            if (!got.empty()) got.push_back(L' ');
+            got.append(c.completion);
+        }
+        if (got != test.expected) {
+            err(L"Completing '%ls' gave '%ls', expected '%ls'", test.cmdline, got.c_str(),
+                test.expected);
+        }
+    }
+    complete_remove_all(cmd, false);
+}
+
+static void test_completions_sort() {
+    say(L"Testing sorting completions");
+    std::vector<completion_t> comps;
+    const string_fuzzy_match_t prefix(fuzzy_match_prefix), substring(fuzzy_match_substring);
+    append_completion(&comps, L"file10", L"first", 0, prefix);
+    append_completion(&comps, L"file2", L"", 0, substring);
+    append_completion(&comps, L"file10", L"second", 0, prefix);
+    append_completion(&comps, L"file1", L"", 0, prefix);
+    append_completion(&comps, L"file3", L"", 0, substring);
+
+    // Substring matches are dropped when there are prefix matches, duplicates keep the first.
+    completions_sort_and_prioritize(&comps);
+    do_test(comps.size() == 2);
+    if (comps.size() == 2) {
+        do_test(comps.at(0).completion == L"file1");
+        do_test(comps.at(1).completion == L"file10");
+        do_test(comps.at(1).description == L"first");
+    }
+
+    // Completions sort naturally.
+    comps.clear();
+    append_completion(&comps, L"b10", L"", 0, substring);
+    append_completion(&comps, L"b9", L"", 0, substring);
+    append_completion(&comps, L"b9", L"", 0, substring);
+    completions_sort_and_prioritize(&comps);
+    do_test(comps.size() == 2 && comps.at(0).completion == L"b9" &&
+            comps.at(1).completion == L"b10");
+
+    // Asking for the best few puts those first, like the full sort does.
+    comps.clear();
+    for (int i = 200; i > 0; i--) {
+        fuzzy_match_type_t type = i % 3 ? fuzzy_match_prefix : fuzzy_match_exact;
+        append_completion(&comps, format_string(L"c%d", i % 150), L"", 0,
+                          string_fuzzy_match_t(type));
+    }
+    std::vector<completion_t> all = comps;
+    completions_sort_and_prioritize(&all);
+    completions_sort_and_prioritize(&comps, 5);
+    do_test(comps.size() == all.size());
+    for (size_t i = 0; i < 5 && i < comps.size(); i++) {
+        do_test(comps.at(i).completion == all.at(i).completion);
+    }
+}
+
+static void test_complete_narrow() {
+    say(L"Testing narrowing completions");
+    complete_add(L"fish_narrow_test", false, wcstring(), option_type_args_only, NO_FILES, NULL,
+                 L"alpha alphabet Alpine beta malpha", NULL, 0);
+    complete_add(L"fish_narrow_test", false, L"alpaca", option_type_double_long, NO_FILES, NULL,
+                 NULL, NULL, 0);
+    complete_add(L"fish_narrow_test", false, L"alps", option_type_double_long, NO_FILES, NULL,
+                 NULL, NULL, 0);
+    const completion_request_flags_t flags = COMPLETION_REQUEST_FUZZY_MATCH;
+    auto sorted = [](std::vector<completion_t> comps) {
+        completions_sort_and_prioritize(&comps);
+        wcstring_list_t result;
+        for (const completion_t &c : comps) {
+            result.push_back(c.completion + (c.flags & COMPLETE_REPLACES_TOKEN ? L"!" : L""));
+        }
+        return result;
+    };
+
+    // Narrowing gives what completing the longer token gives.
+    const struct {
+        const wchar_t *old_token;
+        const wchar_t *new_token;
+    } tests[] = {{L"a", L"al"},    {L"a", L"alph"},   {L"al", L"alpi"}, {L"al", L"alpha"},
+                 {L"a", L"lph"},   {L"al", L"alx"},   {L"--a", L"--alp"}, {L"--al", L"--alpa"}};
+    for (const auto &test : tests) {
+        std::vector<completion_t> old_comps, new_comps;
+        complete(wcstring(L"fish_narrow_test ") + test.old_token, &old_comps, flags);
+        complete(wcstring(L"fish_narrow_test ") + test.new_token, &new_comps, flags);
+        bool narrowed = completions_narrow(&old_comps, test.old_token, test.new_token, flags);
+        if (!string_prefixes_string(test.old_token, test.new_token)) {
+            do_test(!narrowed);
+        } else if (!narrowed || sorted(old_comps) != sorted(new_comps)) {
+            err(L"Narrowing completions for '%ls' to '%ls' does not match", test.old_token,
+                test.new_token);
+        }
+    }
+
+    // Tokens whose growth may bring in other candidates are not narrowed.
+    std::vector<completion_t> comps;
+    complete(L"fish_narrow_test a", &comps, flags);
+    do_test(!completions_narrow(&comps, L"a", L"a/", flags));
+    do_test(!completions_narrow(&comps, L"-", L"-a", flags));
+    do_test(!completions_narrow(&comps, L"", L"a", flags));
+    do_test(!completions_narrow(&comps, L"a", L"a$", flags));
+
+    complete_remove_all(L"fish_narrow_test", false);
+}
+
+static void test_complete_profile() {
+    say(L"Testing completion profiling");
+    // A unique condition, so that it is not already known from an earlier completion.
+    const wcstring condition = L"test " + to_string(getpid()) + L" -gt 0";
+    complete_add(L"fish_profile_test", false, wcstring(), option_type_args_only, NO_FILES,
+                 condition.c_str(), L"alpha beta", NULL, 0);
+
+    auto profile = [](const wcstring &cmdline) {
+        builtin_commandline_scoped_transient_t transient(cmdline);
+        std::vector<completion_t> completions;
+        complete_profile_t result;
+        complete(cmdline, &completions, COMPLETION_REQUEST_DEFAULT, &result);
+        do_test(completions.size() == (cmdline.back() == L' ' ? 2 : 0));
+        return result;
+    };
+    auto calls = [](const complete_profile_t &p, complete_source_t source) {
+        return p.sources[source].calls;
+    };
+
+    complete_profile_t first = profile(L"fish_profile_test ");
+    do_test(calls(first, complete_source_options) == 1);
+    do_test(calls(first, complete_source_loading) == 1);
+    do_test(calls(first, complete_source_conditions) == 1);
+    do_test(calls(first, complete_source_arguments) == 1);
+    do_test(calls(first, complete_source_files) == 1);
+    do_test(calls(first, complete_source_commands) == 0);
+    long long self_sum = 0;
+    for (const auto &source : first.sources) {
+        do_test(source.self_usec >= 0 && source.self_usec <= source.total_usec);
+        self_sum += source.self_usec;
+    }
+    // Sources are charged only for their own time, which the whole completion includes.
+    do_test(self_sum <= first.total_usec);
+    const complete_profile_t::source_t &options = first.sources[complete_source_options];
+    do_test(options.total_usec >=
+            options.self_usec + first.sources[complete_source_conditions].total_usec);
+
+    // The condition result is remembered, so the second completion does not run it.
+    complete_profile_t second = profile(L"fish_profile_test ");
+    do_test(calls(second, complete_source_conditions) == 0);
+    do_test(second.sources[complete_source_conditions].total_usec == 0);
+
+    complete_profile_t commands = profile(L"fish_profile_tes");
+    do_test(calls(commands, complete_source_commands) == 1);
+    do_test(calls(commands, complete_source_options) == 0);
+
+    for (size_t i = 0; i < complete_source_count; i++) {
+        do_test(wcslen(complete_source_name(static_cast<complete_source_t>(i))) > 0);
+    }
+    complete_remove_all(L"fish_profile_test", false);
+}
+
+static void test_complete_args_cache() {
+    say(L"Testing caching of completion arguments");
+    // Each evaluation of the arguments is counted.
+    const wchar_t *args = L"(set -g fish_args_runs $fish_args_runs x; echo alpha) beta";
+    complete_add(L"fish_args_ttl", false, wcstring(), option_type_args_only, NO_FILES, NULL,
+                 args, NULL, 0, 1);
+    complete_add(L"fish_args_nottl", false, wcstring(), option_type_args_only, NO_FILES, NULL,
+                 args, NULL, 0);
+    env_remove(L"fish_args_runs", ENV_GLOBAL);
+
+    auto complete_count = [](const wcstring &cmdline) {
+        builtin_commandline_scoped_transient_t transient(cmdline);
+        std::vector<completion_t> completions;
+        complete(cmdline, &completions, COMPLETION_REQUEST_DEFAULT);
+        return completions.size();
+    };
+    auto runs = []() {
+        auto var = env_get(L"fish_args_runs");
+        return var ? var->as_list().size() : 0;
+    };
+
+    do_test(complete_count(L"fish_args_ttl ") == 2);
+    do_test(runs() == 1);
+    // The token being completed does not matter, only what comes before it.
+    do_test(complete_count(L"fish_args_ttl ") == 2);
+    do_test(complete_count(L"fish_args_ttl al") == 1);
+    do_test(runs() == 1);
+    do_test(complete_count(L"fish_args_ttl alpha ") == 2);
+    do_test(runs() == 2);
+
+    // Without a time to live the arguments are evaluated every time.
+    do_test(complete_count(L"fish_args_nottl ") == 2);
+    do_test(complete_count(L"fish_args_nottl ") == 2);
+    do_test(runs() == 4);
+
+    // Once the time is up they are evaluated again.
+    usleep(1100000);
+    do_test(complete_count(L"fish_args_ttl al") == 1);
+    do_test(runs() == 5);
+
+    complete_remove_all(L"fish_args_ttl", false);
+    complete_remove_all(L"fish_args_nottl", false);
+    env_remove(L"fish_args_runs", ENV_GLOBAL);
+}
+
+static void test_complete(void) {
+    say(L"Testing complete");
+
+    const wchar_t *name_strs[] = {L"Foo1", L"Foo2", L"Foo3", L"Bar1", L"Bar2", L"Bar3"};
+    size_t count = sizeof name_strs / sizeof *name_strs;
+    const wcstring_list_t names(name_strs, name_strs + count);
+    std::vector<completion_t> completions;
+    complete_set_variable_names(&names);
+
+    complete(L"$", &completions, COMPLETION_REQUEST_DEFAULT);
+    completions_sort_and_prioritize(&completions);
+    do_test(completions.size() == 6);
+    do_test(completions.at(0).completion == L"Bar1");
+    do_test(completions.at(1).completion == L"Bar2");
+    do_test(completions.at(2).completion == L"Bar3");
+    do_test(completions.at(3).completion == L"Foo1");
+    do_test(completions.at(4).completion == L"Foo2");
+    do_test(completions.at(5).completion == L"Foo3");
+
+    completions.clear();
+    complete(L"$F", &completions, COMPLETION_REQUEST_DEFAULT);
+    completions_sort_and_prioritize(&completions);
+    do_test(completions.size() == 3);
+    do_test(completions.at(0).completion == L"oo1");
+    do_test(completions.at(1).completion == L"oo2");
+    do_test(completions.at(2).completion == L"oo3");
+
+    completions.clear();
+    complete(L"$1", &completions, COMPLETION_REQUEST_DEFAULT);
+    completions_sort_and_prioritize(&completions);
+    do_test(completions.empty());
+
+    completions.clear();
+    complete(L"$1", &completions, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_FUZZY_MATCH);
+    completions_sort_and_prioritize(&completions);
+    do_test(completions.size() == 2);
+    do_test(completions.at(0).completion == L"$Bar1");
+    do_test(completions.at(1).completion == L"$Foo1");
+
+    if (system("mkdir -p 'test/complete_test'")) err(L"mkdir failed");
+    if (system("touch 'test/complete_test/has space'")) err(L"touch failed");
+    if (system("touch 'test/complete_test/testfile'")) err(L"touch failed");
+    if (system("chmod 700 'test/complete_test/testfile'")) err(L"chmod failed");
+
+    completions.clear();
+    complete(L"echo (test/complete_test/testfil", &completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"e");
+
+    completions.clear();
+    complete(L"echo (ls test/complete_test/testfil", &completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"e");
 
     completions.clear();
     complete(L"echo (command ls test/complete_test/testfil", &completions,
@@ -2533,10 +3944,28 @@ static void test_input() {
     if (c != R_DOWN_LINE) {
         err(L"Expected to read char R_DOWN_LINE, but instead got %ls\n", describe_char(c).c_str());
     }
+
+    // If input stops partway through the longer binding, the shorter one applies and the rest is
+    // read again. Bindings of other modes are ignored.
+    input_mapping_add((prefix_binding + L'b').c_str(), L"forward-char", L"other-mode");
+    input_mapping_add(L"b", L"backward-char");
+    for (wchar_t wc : prefix_binding + L'b') {
+        input_queue_ch(wc);
+    }
+    c = input_readch();
+    if (c != R_UP_LINE) {
+        err(L"Expected to read char R_UP_LINE, but instead got %ls\n", describe_char(c).c_str());
+    }
+    c = input_readch();
+    if (c != R_BACKWARD_CHAR) {
+        err(L"Expected to read char R_BACKWARD_CHAR, but instead got %ls\n",
+            describe_char(c).c_str());
+    }
 }
 
 #define UVARS_PER_THREAD 8
-#define UVARS_TEST_PATH L"test/fish_uvars_test/varsfile.txt"
+#define UVARS_TEST_PATH_MBS "test/fish_uvars_test/varsfile.txt"
+#define UVARS_TEST_PATH L"" UVARS_TEST_PATH_MBS
 
 static int test_universal_helper(int x) {
     callback_data_list_t callbacks;
@@ -2653,6 +4082,140 @@ static void test_universal_callbacks() {
     system("rm -Rf test/fish_uvars_test/");
 }
 
+static size_t count_lines_in_file(const char *path) {
+    size_t result = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) return result;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '\n') result++;
+    }
+    fclose(f);
+    return result;
+}
+
+/// Applies each record in the variables file at path to vars, the way any version of fish reads
+/// it. Returns false if a record is not understood.
+static bool parse_file_records(const char *path, var_table_t *vars) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    bool result = true;
+    std::string line;
+    wcstring storage;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c != '\n') {
+            line.push_back(static_cast<char>(c));
+            continue;
+        }
+        if (!line.empty() && !env_universal_t::parse_message_internal(str2wcstring(line), vars,
+                                                                       &storage)) {
+            err(L"Could not parse universal variable record '%s'", line.c_str());
+            result = false;
+        }
+        line.clear();
+    }
+    fclose(f);
+    return result;
+}
+
+static void test_universal_journal() {
+    say(L"Testing appending to the universal variables file");
+    if (system("mkdir -p test/fish_uvars_test/")) err(L"mkdir failed");
+    callback_data_list_t callbacks;
+    env_universal_t uvars1(UVARS_TEST_PATH);
+    env_universal_t uvars2(UVARS_TEST_PATH);
+
+    uvars1.set(L"alpha", {L"1"}, false);
+    uvars1.set(L"beta", {L"1"}, false);
+    uvars1.sync(callbacks);
+    uvars2.sync(callbacks);
+    const size_t initial_lines = count_lines_in_file(UVARS_TEST_PATH_MBS);
+
+    // Changing a variable appends a record for it, which any reader understands.
+    uvars1.set(L"alpha", {L"2", L"3"}, true);
+    do_test(uvars1.sync(callbacks));
+    do_test(count_lines_in_file(UVARS_TEST_PATH_MBS) == initial_lines + 1);
+    var_table_t parsed;
+    do_test(parse_file_records(UVARS_TEST_PATH_MBS, &parsed));
+    do_test(parsed.count(L"alpha") &&
+            parsed.at(L"alpha").as_list() == wcstring_list_t({L"2", L"3"}));
+
+    // Older readers have no way to erase a variable by appending, so erasing one rewrites the file.
+    uvars1.remove(L"beta");
+    do_test(uvars1.sync(callbacks));
+    do_test(count_lines_in_file(UVARS_TEST_PATH_MBS) == initial_lines - 1);
+
+    // Both a reader that had read the file before and a new one see the result.
+    callbacks.clear();
+    uvars2.sync(callbacks);
+    std::sort(callbacks.begin(), callbacks.end(), callback_data_less_than);
+    do_test(callbacks.size() == 2);
+    do_test(callbacks.at(0).type == SET_EXPORT && callbacks.at(0).key == L"alpha");
+    do_test(callbacks.at(1).type == ERASE && callbacks.at(1).key == L"beta");
+    env_universal_t uvars3(UVARS_TEST_PATH);
+    uvars3.load(callbacks);
+    for (env_universal_t *uvars : {&uvars2, &uvars3}) {
+        auto alpha = uvars->get(L"alpha");
+        do_test(alpha && alpha->as_list() == wcstring_list_t({L"2", L"3"}) && alpha->exportv);
+        do_test(!uvars->get(L"beta"));
+    }
+
+    // Once the file holds too many superseded records, it is rewritten with one per variable.
+    // Readers keep the variables whose records are unchanged rather than decoding them again.
+    const uint64_t alpha_generation = uvars1.get(L"alpha")->get_generation();
+    for (int i = 0; i < 200; i++) {
+        uvars2.set(L"gamma", {to_string(static_cast<long>(i))}, false);
+        uvars2.sync(callbacks);
+    }
+    do_test(count_lines_in_file(UVARS_TEST_PATH_MBS) < initial_lines + 100);
+    callbacks.clear();
+    uvars1.sync(callbacks);
+    do_test(callbacks.size() == 1);
+    do_test(uvars1.get(L"gamma") && uvars1.get(L"gamma")->as_string() == L"199");
+    do_test(uvars1.get(L"alpha")->get_generation() == alpha_generation);
+    parsed.clear();
+    do_test(parse_file_records(UVARS_TEST_PATH_MBS, &parsed));
+    do_test(parsed.size() == 2 && !parsed.count(L"beta"));
+    system("rm -Rf test/fish_uvars_test/");
+}
+
+static void test_universal_coalescing() {
+    say(L"Testing coalescing universal variable syncs");
+    const env_universal_sync_stats_t before = env_universal_sync_stats();
+
+    // Changes are only written out when flushed, and then all at once.
+    env_set_one(L"test_coalesce_a", ENV_UNIVERSAL, L"1");
+    env_set_one(L"test_coalesce_b", ENV_UNIVERSAL, L"2");
+    env_remove(L"test_coalesce_b", ENV_UNIVERSAL);
+    do_test(env_get(L"test_coalesce_a", ENV_UNIVERSAL)->as_string() == L"1");
+    do_test(env_universal_sync_stats().syncs == before.syncs);
+    do_test(env_universal_sync_stats().deferred_changes == before.deferred_changes + 3);
+    env_universal_flush();
+    env_universal_flush();
+    do_test(env_universal_sync_stats().syncs == before.syncs + 1);
+
+    callback_data_list_t callbacks;
+    env_universal_t other(L"");
+    other.load(callbacks);
+    do_test(other.get(L"test_coalesce_a") && other.get(L"test_coalesce_a")->as_string() == L"1");
+    do_test(!other.get(L"test_coalesce_b"));
+
+    env_remove(L"test_coalesce_a", ENV_UNIVERSAL);
+    env_universal_flush();
+
+    // With a notifier that reports every change, a barrier with nothing to do is skipped. The
+    // first one sees our own write.
+    universal_notifier_t &notifier = universal_notifier_t::default_notifier();
+    if (notifier.notification_fd_reports_all_changes() && notifier.notification_fd() >= 0) {
+        env_universal_barrier_if_needed();
+        const env_universal_sync_stats_t quiet = env_universal_sync_stats();
+        env_universal_barrier_if_needed();
+        do_test(env_universal_sync_stats().syncs == quiet.syncs);
+        do_test(env_universal_sync_stats().skipped_barriers == quiet.skipped_barriers + 1);
+    }
+}
+
 bool poll_notifier(const std::unique_ptr<universal_notifier_t> &note) {
     bool result = false;
     if (note->usec_delay_between_polls() > 0) {
@@ -2686,6 +4249,15 @@ static void trigger_or_wait_for_notification(universal_notifier_t::notifier_stra
         case universal_notifier_t::strategy_named_pipe: {
             break;  // nothing required
         }
+        case universal_notifier_t::strategy_inotify:
+        case universal_notifier_t::strategy_kqueue: {
+            // These watch the variables file, so replace it the way a sync does.
+            if (system("touch " UVARS_TEST_PATH_MBS ".tmp && mv " UVARS_TEST_PATH_MBS
+                       ".tmp " UVARS_TEST_PATH_MBS)) {
+                err(L"Unable to replace the universal variables test file");
+            }
+            break;
+        }
     }
 }
 
@@ -2757,6 +4329,12 @@ static void test_universal_notifiers() {
 
     auto strategy = universal_notifier_t::resolve_default_strategy();
     test_notifiers_with_strategy(strategy);
+#if !defined(__APPLE__) && !defined(__CYGWIN__)
+    // The named pipe works everywhere else, even where it isn't the default.
+    if (strategy != universal_notifier_t::strategy_named_pipe) {
+        test_notifiers_with_strategy(universal_notifier_t::strategy_named_pipe);
+    }
+#endif
 }
 
 class history_tests_t {
@@ -2764,6 +4342,17 @@ class history_tests_t {
     static void test_history(void);
     static void test_history_merge(void);
     static void test_history_formats(void);
+    static void test_history_index(void);
+    static void test_history_parallel_scan(void);
+    static void test_history_parallel_search(void);
+    static void test_history_background_vacuum(void);
+    static void test_history_memory_limit(void);
+    static void test_history_tail_follow(void);
+    static void test_history_shared_index(void);
+#ifdef HAVE_ZLIB
+    static void test_history_compression(void);
+#endif
+    static void benchmark_history(void);
     // static void test_history_speed(void);
     static void test_history_races(void);
     static void test_history_races_pound_on_history(size_t item_count);
@@ -2839,6 +4428,17 @@ void history_tests_t::test_history(void) {
     searcher = history_search_t(history, L"Alpha");
     test_history_matches(searcher, 0, __LINE__);
 
+    // $history lists each command once, most recent first, and can be read just in part.
+    history.add(L"Gamma");
+    wcstring_list_t items;
+    history.get_history(items, 2);
+    do_test(items == wcstring_list_t({L"Gamma", L"ZZZ"}));
+    items.clear();
+    history.get_history(items);
+    do_test(items.size() == 9);
+    do_test(history.distinct_size() == items.size());
+    do_test(std::count(items.begin(), items.end(), L"Gamma") == 1);
+
     // Test history escaping and unescaping, yaml, etc.
     history_item_list_t before, after;
     history.clear();
@@ -2966,7 +4566,7 @@ void history_tests_t::test_history_races(void) {
 
         bool found = false;
         for (wcstring_list_t &list : expected_lines) {
-            auto iter = std::find(list.begin(), list.end(), item.contents);
+            auto iter = std::find(list.begin(), list.end(), item.str());
             if (iter != list.end()) {
                 found = true;
 
@@ -3100,7 +4700,580 @@ void history_tests_t::test_history_merge(void) {
             do_test(history_contains(reader, more_texts[j]));
         }
     }
-    everything->clear();
+    everything->clear();
+}
+
+void history_tests_t::test_history_index(void) {
+    say(L"Testing history index");
+    const wcstring name = L"index_test";
+    const size_t count = 5000;
+    history_t(name).clear();
+    time_barrier();
+    {
+        history_t writer(name);
+        writer.disable_automatic_saving();
+        for (size_t i = 0; i < count; i++) {
+            writer.add(format_string(L"index item %lu", (unsigned long)i));
+        }
+        writer.enable_automatic_saving();
+    }
+    wcstring index_path;
+    path_get_data(index_path);
+    index_path.append(L"/index_test_history.idx");
+
+    // The first load scans the file and writes the index; the second one reads it.
+    time_barrier();
+    for (int pass = 0; pass < 2; pass++) {
+        history_t reader(name);
+        do_test(reader.size() == count);
+        do_test(waccess(index_path, F_OK) == 0);
+        for (size_t i = 0; i < count; i++) {
+            wcstring expected = format_string(L"index item %lu", (unsigned long)(count - i - 1));
+            if (reader.item_at_index(i + 1).str() != expected) {
+                err(L"History index pass %d: wrong item at index %lu", pass, (unsigned long)i);
+                break;
+            }
+        }
+    }
+
+    // Searches narrowed by the trigram index must find the same items as a linear scan.
+    const wchar_t *const terms[] = {L"item 12",      L"ITEM 4",        L"m 3",
+                                    L"index item 7", L"Index Item 42", L"nothing"};
+    const history_search_type_t types[] = {HISTORY_SEARCH_TYPE_CONTAINS, HISTORY_SEARCH_TYPE_PREFIX,
+                                           HISTORY_SEARCH_TYPE_EXACT};
+    history_t searched(name);
+    for (const wchar_t *term : terms) {
+        for (history_search_type_t type : types) {
+            for (bool case_sensitive : {true, false}) {
+                wcstring match_term = term;
+                if (!case_sensitive) {
+                    std::transform(match_term.begin(), match_term.end(), match_term.begin(),
+                                   towlower);
+                }
+                size_t expected = 0;
+                for (size_t i = 0; i < count; i++) {
+                    history_item_t item(format_string(L"index item %lu", (unsigned long)i));
+                    if (item.matches_search(match_term, type, case_sensitive)) expected++;
+                }
+                history_search_t searcher(searched, term, type, case_sensitive);
+                size_t found = 0;
+                while (searcher.go_backwards()) found++;
+                if (found != expected) {
+                    err(L"Searching for '%ls' found %lu items, expected %lu", term,
+                        (unsigned long)found, (unsigned long)expected);
+                }
+            }
+        }
+    }
+
+    // Items appended after the index was written must be found too.
+    history_t(name).add(L"index item appended");
+    time_barrier();
+    do_test(history_t(name).item_at_index(1).str() == L"index item appended");
+    do_test(history_t(name).size() == count + 1);
+
+    history_t(name).clear();
+    do_test(waccess(index_path, F_OK) != 0);
+}
+
+void history_tests_t::test_history_parallel_scan(void) {
+    say(L"Testing parallel scanning of a large history file");
+    const wcstring name = L"parallel_scan_test";
+    const size_t count = 60000;
+    history_t(name).clear();
+
+    // Write the file directly, since saving this many items would be slow. The items have interior
+    // lines of various lengths, so chunks don't all start at the same kind of item.
+    std::string contents;
+    for (size_t i = 0; i < count; i++) {
+        contents.append("- cmd: echo scanned item " + std::to_string(i) + "\\nsecond line\n");
+        contents.append("  when: " + std::to_string(1000000 + i) + "\n");
+        if (i % 3 == 0) {
+            contents.append("  paths:\n");
+            for (size_t j = 0; j < i % 7; j++) contents.append("    - /some/path/to/a/file\n");
+        }
+    }
+    do_test(contents.size() > 4 * 1024 * 1024);
+    wcstring path;
+    path_get_data(path);
+    const std::string narrow_path = wcs2string(path + L"/" + name + L"_history");
+    FILE *f = fopen(narrow_path.c_str(), "w");
+    do_test(f != NULL);
+    if (!f) return;
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+
+    history_t reader(name);
+    do_test(reader.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        const history_item_t item = reader.item_at_index(count - i);
+        const wcstring expected =
+            format_string(L"echo scanned item %lu\nsecond line", (unsigned long)i);
+        if (item.str() != expected || item.timestamp() != (time_t)(1000000 + i) ||
+            item.get_required_paths().size() != (i % 3 == 0 ? i % 7 : 0)) {
+            err(L"Parallel scan: wrong item at index %lu", (unsigned long)(count - i));
+            break;
+        }
+    }
+    reader.clear();
+}
+
+void history_tests_t::test_history_parallel_search(void) {
+    say(L"Testing parallel history search");
+    const wcstring name = L"parallel_search_test";
+    const size_t count = 20000;
+    history_t(name).clear();
+    time_barrier();
+    {
+        history_t writer(name);
+        writer.disable_automatic_saving();
+        for (size_t i = 0; i < count; i++) {
+            writer.add(format_string(L"parallel item %lu", (unsigned long)i));
+        }
+        writer.enable_automatic_saving();
+    }
+    time_barrier();
+
+    history_t hist(name);
+    const wcstring term = L"item 1*7";
+    for (size_t max_items : {(size_t)5, (size_t)-1}) {
+        for (bool reverse : {false, true}) {
+            // Compute what a linear search would output.
+            wcstring_list_t lines;
+            for (size_t i = count; i-- > 0 && lines.size() < max_items;) {
+                history_item_t item(format_string(L"parallel item %lu", (unsigned long)i));
+                if (item.matches_search(term, HISTORY_SEARCH_TYPE_CONTAINS_GLOB, true)) {
+                    lines.push_back(item.str() + L"\n");
+                }
+            }
+            if (reverse) std::reverse(lines.begin(), lines.end());
+            wcstring expected;
+            for (const wcstring &line : lines) expected.append(line);
+
+            io_streams_t streams(0);
+            hist.search(HISTORY_SEARCH_TYPE_CONTAINS_GLOB, wcstring_list_t{term}, NULL, max_items,
+                        true, false, reverse, streams);
+            if (streams.out.buffer() != expected) {
+                err(L"Parallel history search for '%ls' (max %ld, reverse %d) gave wrong output",
+                    term.c_str(), (long)max_items, (int)reverse);
+            }
+        }
+    }
+
+    // Searching must neither wait for the thread pool to free up, nor keep background tasks that
+    // need the history from running. Fill the pool with such tasks while we search.
+    std::atomic<size_t> sizes_read{0};
+    for (int i = 0; i < 64; i++) {
+        iothread_perform([&]() {
+            usleep(50 * 1000);
+            if (hist.size() > 0) sizes_read++;
+        });
+    }
+    io_streams_t streams(0);
+    hist.search(HISTORY_SEARCH_TYPE_CONTAINS_GLOB, wcstring_list_t{term}, NULL, (size_t)-1, true,
+                false, false, streams);
+    iothread_drain_all();
+    do_test(sizes_read == 64);
+    hist.clear();
+}
+
+void history_tests_t::test_history_background_vacuum(void) {
+    say(L"Testing background history vacuum");
+    const wcstring name = L"vacuum_test";
+    history_t(name).clear();
+    time_barrier();
+
+    // Two instances appending the same item leave a duplicate in the file.
+    history_t(name).add(L"vacuum duplicate");
+    history_t(name).add(L"vacuum duplicate");
+
+    // Enough items to trigger a vacuum, which must remove the duplicate.
+    const size_t count = 32;
+    {
+        history_t hist(name);
+        for (size_t i = 0; i < count; i++) {
+            hist.add(format_string(L"vacuum item %lu", (unsigned long)i));
+        }
+        hist.wait_for_background_vacuum();
+    }
+
+    wcstring path;
+    path_get_data(path);
+    path.append(L"/vacuum_test_history");
+    std::string contents;
+    FILE *f = wfopen(path, "r");
+    if (!f) {
+        err(L"Couldn't open history file %ls", path.c_str());
+    } else {
+        char buff[4096];
+        size_t amt;
+        while ((amt = fread(buff, 1, sizeof buff, f)) > 0) contents.append(buff, amt);
+        fclose(f);
+    }
+    size_t duplicates = 0;
+    const std::string duplicate_line = "- cmd: vacuum duplicate\n";
+    for (size_t pos = contents.find(duplicate_line); pos != std::string::npos;
+         pos = contents.find(duplicate_line, pos + 1)) {
+        duplicates++;
+    }
+    do_test(duplicates == 1);
+
+    time_barrier();
+    history_t reader(name);
+    do_test(reader.size() == count + 1);
+    do_test(history_contains(&reader, L"vacuum duplicate"));
+    for (size_t i = 0; i < count; i++) {
+        do_test(history_contains(&reader, format_string(L"vacuum item %lu", (unsigned long)i)));
+    }
+    reader.clear();
+}
+
+void history_tests_t::test_history_memory_limit(void) {
+    say(L"Testing history memory limit");
+    const wcstring name = L"memory_limit_test";
+    history_t(name).clear();
+    time_barrier();
+
+    // Enough items for the trigram index to be built.
+    const size_t count = 5000;
+    {
+        history_t writer(name);
+        writer.disable_automatic_saving();
+        for (size_t i = 0; i < count; i++) {
+            writer.add(format_string(L"memory limit item %lu", (unsigned long)i));
+        }
+        writer.enable_automatic_saving();
+        writer.save();
+    }
+    time_barrier();
+
+    const size_t saved_limit = history_memory_limit;
+    history_memory_limit = 16 * 1024;
+    {
+        history_t hist(name);
+        do_test(hist.size() == count);
+        // Old items still come back in full after being evicted from the cache.
+        for (size_t pass = 0; pass < 2; pass++) {
+            for (size_t i = 1; i <= count; i++) {
+                const history_item_t item = hist.item_at_index(i);
+                if (item.str() != format_string(L"memory limit item %lu",
+                                                (unsigned long)(count - i))) {
+                    err(L"Wrong history item at index %lu: %ls", (unsigned long)i,
+                        item.str().c_str());
+                    break;
+                }
+            }
+        }
+        history_memory_stats_t stats = hist.memory_stats();
+        do_test(stats.old_item_count == count);
+        do_test(stats.decoded_item_count > 0 && stats.decoded_item_count < count);
+        do_test(stats.decoded_item_bytes <= history_memory_limit);
+        // The cached items keep their text as UTF-8.
+        do_test(stats.item_text_bytes > 0 && stats.item_text_bytes < stats.item_text_wide_bytes);
+
+        // The trigram index doesn't fit, so searches must go without it.
+        history_search_t search(hist, L"item 123", HISTORY_SEARCH_TYPE_CONTAINS);
+        do_test(search.go_backwards());
+        do_test(search.current_string() == L"memory limit item 1239");
+        do_test(!hist.trigram_index && hist.trigram_index_too_large);
+        stats = hist.memory_stats();
+        do_test(stats.trigram_index_bytes == 0);
+        do_test(stats.decoded_item_bytes <= history_memory_limit);
+    }
+
+    // With the default limit the index is built, and searches find the same items.
+    history_memory_limit = saved_limit;
+    {
+        history_t hist(name);
+        history_search_t search(hist, L"item 123", HISTORY_SEARCH_TYPE_CONTAINS);
+        do_test(search.go_backwards());
+        do_test(search.current_string() == L"memory limit item 1239");
+        do_test(hist.trigram_index != NULL);
+        history_memory_stats_t stats = hist.memory_stats();
+        do_test(stats.trigram_index_bytes > 0);
+        do_test(stats.trigram_index_bytes + stats.decoded_item_bytes <= stats.limit);
+        hist.clear();
+    }
+}
+
+void history_tests_t::test_history_tail_follow(void) {
+    say(L"Testing following appended history items");
+    const wcstring name = L"tail_follow_test";
+    history_t(name).clear();
+    time_barrier();
+
+    // Saving occasionally vacuums, which rewrites the file; keep that from happening here.
+    history_t writer(name);
+    writer.countdown_to_vacuum = 1000;
+    writer.add(L"tail first");
+    writer.save();
+    time_barrier();
+
+    history_t follower(name);
+    follower.countdown_to_vacuum = 1000;
+    do_test(follower.size() == 1);
+    follower.add(L"tail own");
+
+    // Another shell appends items, which the follower picks up without remapping from scratch.
+    writer.add(L"tail second");
+    writer.add(L"tail third");
+    writer.save();
+    time_barrier();
+    follower.incorporate_external_changes();
+    do_test(follower.loaded_old);
+    do_test(follower.size() == 4);
+    do_test(follower.item_at_index(1).str() == L"tail third");
+    do_test(follower.item_at_index(2).str() == L"tail second");
+    do_test(follower.item_at_index(3).str() == L"tail own");
+    do_test(follower.item_at_index(4).str() == L"tail first");
+
+    // Following is idempotent.
+    time_barrier();
+    follower.incorporate_external_changes();
+    do_test(follower.loaded_old && follower.size() == 4);
+
+    // A vacuumed file is a different file, so the follower starts over.
+    writer.disable_automatic_saving();
+    writer.add(L"tail fourth");
+    {
+        scoped_lock locker(writer.lock);
+        writer.save_internal(true);
+    }
+    writer.enable_automatic_saving();
+    time_barrier();
+    follower.incorporate_external_changes();
+    do_test(!follower.loaded_old);
+    do_test(follower.size() == 5);
+    do_test(follower.item_at_index(1).str() == L"tail fourth");
+    do_test(follower.item_at_index(5).str() == L"tail first");
+    follower.clear();
+
+    // Items followed into an indexed history are found by a term that was searched before.
+    const wcstring indexed_name = L"tail_follow_index_test";
+    history_t(indexed_name).clear();
+    time_barrier();
+    history_t indexed_writer(indexed_name);
+    indexed_writer.countdown_to_vacuum = 1000;
+    indexed_writer.disable_automatic_saving();
+    for (size_t i = 0; i < 5000; i++) {
+        indexed_writer.add(format_string(L"tail indexed item %lu", (unsigned long)i));
+    }
+    indexed_writer.enable_automatic_saving();
+    indexed_writer.save();
+    time_barrier();
+
+    history_t indexed_follower(indexed_name);
+    indexed_follower.countdown_to_vacuum = 1000;
+    do_test(!history_search_t(indexed_follower, L"appended later", HISTORY_SEARCH_TYPE_CONTAINS)
+                 .go_backwards());
+    do_test(indexed_follower.trigram_index != NULL);
+    indexed_writer.add(L"tail indexed item appended later");
+    indexed_writer.save();
+    time_barrier();
+    indexed_follower.incorporate_external_changes();
+    do_test(indexed_follower.loaded_old && indexed_follower.trigram_index != NULL);
+    history_search_t after(indexed_follower, L"appended later", HISTORY_SEARCH_TYPE_CONTAINS);
+    if (after.go_backwards()) {
+        do_test(after.current_string() == L"tail indexed item appended later");
+    } else {
+        err(L"Followed item not found by a term searched before");
+    }
+    indexed_follower.clear();
+}
+
+#ifdef HAVE_ZLIB
+/// Returns the first bytes of the history file with the given name.
+static std::string history_file_head(const wcstring &name, size_t len) {
+    wcstring path;
+    path_get_data(path);
+    std::string result(len, '\0');
+    FILE *f = fopen(wcs2string(path + L"/" + name + L"_history").c_str(), "r");
+    if (!f) return std::string();
+    result.resize(fread(&result.at(0), 1, len, f));
+    fclose(f);
+    return result;
+}
+
+void history_tests_t::test_history_compression(void) {
+    say(L"Testing compressed history files");
+    const wcstring name = L"compression_test";
+    history_t(name).clear();
+    time_barrier();
+    const int saved_level = history_compression_level;
+    history_compression_level = 9;
+
+    // A new file is compressed right away, and items appended to it go into blocks of their own.
+    history_t writer(name);
+    writer.countdown_to_vacuum = 1000;
+    writer.add(L"compressed first");
+    writer.save();
+    do_test(history_file_head(name, 7) == "fishhz1");
+    time_barrier();
+
+    history_t follower(name);
+    follower.countdown_to_vacuum = 1000;
+    do_test(follower.size() == 1);
+    do_test(follower.item_at_index(1).str() == L"compressed first");
+
+    // The follower decompresses the appended blocks.
+    writer.add(L"compressed second");
+    writer.save();
+    writer.add(L"compressed third");
+    writer.save();
+    time_barrier();
+    follower.incorporate_external_changes();
+    do_test(follower.loaded_old && follower.mmap_compressed_length > 0);
+    do_test(follower.size() == 3);
+    do_test(follower.item_at_index(1).str() == L"compressed third");
+    do_test(follower.item_at_index(3).str() == L"compressed first");
+
+    // A block that is cut off, as if its writer were interrupted, is ignored, but not the blocks
+    // after it.
+    wcstring path;
+    path_get_data(path);
+    const std::string narrow_path = wcs2string(path + L"/" + name + L"_history");
+    FILE *f = fopen(narrow_path.c_str(), "a");
+    do_test(f != NULL);
+    if (f) {
+        fwrite("fishhz1\0\x40\0\0\0\x10\0\0\0", 1, 16, f);
+        fclose(f);
+    }
+    do_test(history_t(name).size() == 3);
+    writer.add(L"compressed after damage");
+    writer.save();
+    time_barrier();
+    do_test(history_t(name).size() == 4);
+    do_test(history_t(name).item_at_index(1).str() == L"compressed after damage");
+
+    // Rewriting the file with compression turned off makes it plain text again.
+    history_compression_level = 0;
+    writer.disable_automatic_saving();
+    writer.add(L"plain fourth");
+    {
+        scoped_lock locker(writer.lock);
+        writer.save_internal(true);
+    }
+    writer.enable_automatic_saving();
+    do_test(history_file_head(name, 6) == "- cmd:");
+    time_barrier();
+    history_t reader(name);
+    do_test(reader.size() == 5);
+    do_test(reader.item_at_index(1).str() == L"plain fourth");
+    do_test(reader.item_at_index(5).str() == L"compressed first");
+
+    // And turning it on compresses the whole file when it is rewritten.
+    history_compression_level = 1;
+    {
+        scoped_lock locker(writer.lock);
+        writer.deleted_items.insert(L"compressed second");
+        writer.save_internal(true);
+    }
+    do_test(history_file_head(name, 7) == "fishhz1");
+    time_barrier();
+    history_t rewritten(name);
+    do_test(rewritten.size() == 4);
+    do_test(rewritten.item_at_index(1).str() == L"plain fourth");
+    do_test(rewritten.item_at_index(2).str() == L"compressed after damage");
+    do_test(rewritten.item_at_index(3).str() == L"compressed third");
+
+    history_compression_level = saved_level;
+    rewritten.clear();
+}
+#endif
+
+void history_tests_t::test_history_shared_index(void) {
+    say(L"Testing shared history trigram index");
+    const wcstring name = L"shared_index_test";
+    history_t(name).clear();
+    time_barrier();
+    size_t count = 5000;
+    {
+        history_t writer(name);
+        writer.disable_automatic_saving();
+        for (size_t i = 0; i < count; i++) {
+            writer.add(format_string(L"shared item %lu", (unsigned long)i));
+        }
+        writer.enable_automatic_saving();
+    }
+    wcstring shared_path;
+    path_get_data(shared_path);
+    shared_path.append(L"/shared_index_test_history.tri");
+    time_barrier();
+
+    // Return how many items a search for term finds, or report that it isn't what's expected.
+    auto count_matches = [](history_t &hist, const wchar_t *term, size_t expected) {
+        history_search_t search(hist, term, HISTORY_SEARCH_TYPE_CONTAINS);
+        size_t found = 0;
+        while (search.go_backwards()) found++;
+        if (found != expected) {
+            err(L"Searching for '%ls' found %lu items, expected %lu", term, (unsigned long)found,
+                (unsigned long)expected);
+        }
+    };
+
+    // The first search writes the shared index, and switches to it. Only the last item, which may
+    // have been incomplete, is left for each shell to index itself.
+    {
+        history_t hist(name);
+        count_matches(hist, L"item 123", 11);
+        do_test(waccess(shared_path, F_OK) == 0);
+        do_test(hist.memory_stats().shared_index_item_count == count - 1);
+        do_test(hist.memory_stats().shared_index_bytes > 0);
+    }
+
+    // Another shell finds the same items using the shared index, including the last one.
+    {
+        history_t hist(name);
+        count_matches(hist, L"item 4999", 1);
+        count_matches(hist, L"item 12", 111);
+        count_matches(hist, L"nothing", 0);
+        do_test(hist.memory_stats().shared_index_item_count == count - 1);
+        history_memory_stats_t stats = hist.memory_stats();
+        do_test(stats.shared_index_bytes > stats.trigram_index_bytes);
+    }
+
+    // A few appended items are indexed privately; many cause the shared index to be rewritten.
+    for (size_t appended : {10, 2000}) {
+        const wcstring history_path = shared_path.substr(0, shared_path.size() - 4);
+        const ino_t old_inode = file_id_for_path(history_path).inode;
+        {
+            history_t writer(name);
+            writer.disable_automatic_saving();
+            for (size_t i = count; i < count + appended; i++) {
+                writer.add(format_string(L"shared item %lu", (unsigned long)i));
+            }
+            writer.enable_automatic_saving();
+        }
+        const size_t previous_count = count;
+        count += appended;
+        time_barrier();
+
+        history_t hist(name);
+        count_matches(hist, L"item 500", 11);
+        count_matches(hist, L"item 5005", 1);
+        // Saving may randomly vacuum the file instead of appending to it, which leaves the shared
+        // index stale, so it is rewritten however few items were appended.
+        const bool vacuumed = file_id_for_path(history_path).inode != old_inode;
+        size_t expected_shared = appended < 1024 && !vacuumed ? previous_count - 1 : count - 1;
+        do_test(hist.memory_stats().shared_index_item_count == expected_shared);
+    }
+
+    // A damaged shared index is ignored and replaced.
+    {
+        FILE *f = wfopen(shared_path, "r+");
+        do_test(f != NULL);
+        if (f) {
+            fseek(f, 100, SEEK_SET);
+            fputs("garbage", f);
+            fclose(f);
+        }
+        history_t hist(name);
+        count_matches(hist, L"item 123", 11);
+        do_test(hist.memory_stats().shared_index_item_count == count - 1);
+    }
+
+    history_t(name).clear();
+    do_test(waccess(shared_path, F_OK) != 0);
 }
 
 static bool install_sample_history(const wchar_t *name) {
@@ -3182,6 +5355,34 @@ void history_tests_t::test_history_formats(void) {
         if (!history_equals(test_history, expected)) {
             err(L"test_history_formats failed for %ls\n", name);
         }
+
+        // Exporting passes the records from the file on unchanged, whether it decodes them into
+        // the buffer or writes them straight to an fd.
+        std::string contents;
+        FILE *f = fopen("tests/history_sample_fish_2_0", "r");
+        if (f) {
+            char buff[1024];
+            size_t amt;
+            while ((amt = fread(buff, 1, sizeof buff, f)) > 0) contents.append(buff, amt);
+            fclose(f);
+        }
+        output_stream_t buffered(0);
+        test_history.export_records(buffered);
+        do_test(!contents.empty() && buffered.buffer() == str2wcstring(contents));
+
+        int pipe_fds[2];
+        do_test(pipe(pipe_fds) == 0);
+        output_stream_t streamed(0);
+        streamed.flush_to(pipe_fds[1]);
+        test_history.export_records(streamed);
+        streamed.flush();
+        close(pipe_fds[1]);
+        std::string exported;
+        char buff[1024];
+        ssize_t amt;
+        while ((amt = read(pipe_fds[0], buff, sizeof buff)) > 0) exported.append(buff, amt);
+        close(pipe_fds[0]);
+        do_test(exported == contents);
         test_history.clear();
     }
 
@@ -3253,6 +5454,424 @@ void history_tests_t::test_history_speed(void)
 }
 #endif
 
+/// Write a synthetic fish 2.0 history file with the given number of items. The items are generated
+/// from a fixed seed, so every run sees the same history.
+static bool write_benchmark_history(const wcstring &name, size_t item_count, time_t when) {
+    wcstring path;
+    if (!path_get_data(path)) {
+        err(L"Failed to get data directory");
+        return false;
+    }
+    path.append(L"/" + name + L"_history");
+    FILE *f = wfopen(path, "w");
+    if (!f) {
+        err(L"Couldn't create history file %ls", path.c_str());
+        return false;
+    }
+    const char *const commands[] = {"git checkout", "git commit -m", "cd", "make -j", "ls -l",
+                                    "vim", "ssh host", "grep -r pattern", "cargo build --bin",
+                                    "echo"};
+    const size_t command_count = sizeof commands / sizeof *commands;
+    unsigned long seed = 1;
+    for (size_t i = 0; i < item_count; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        const char *command = commands[(seed >> 33) % command_count];
+        unsigned long arg = (seed >> 17) % 10000;
+        fprintf(f, "- cmd: %s item%lu_%lu\n  when: %ld\n", command, arg, (unsigned long)i,
+                (long)when);
+        if (i % 4 == 0) fprintf(f, "  paths:\n    - item%lu_%lu\n", arg, (unsigned long)i);
+    }
+    fclose(f);
+    return true;
+}
+
+/// Print one benchmark result as a tab-separated line of benchmark name, history size or iteration
+/// count, and time in milliseconds.
+static void report_benchmark(const wchar_t *name, size_t item_count, double start) {
+    fwprintf(stdout, L"benchmark\t%ls\t%lu\t%.3f\n", name, (unsigned long)item_count,
+             (timef() - start) * 1000);
+}
+
+/// Time typical history operations on histories of increasing size.
+void history_tests_t::benchmark_history(void) {
+    say(L"Benchmarking history");
+    const wcstring name = L"benchmark";
+    const size_t sizes[] = {10 * 1000, 100 * 1000, 1000 * 1000};
+    for (size_t item_count : sizes) {
+        history_t(name).clear();
+        if (!write_benchmark_history(name, item_count, time(NULL) - 60)) return;
+        double start;
+
+        // The first load has no index to go by; the second one has.
+        start = timef();
+        do_test(history_t(name).size() == item_count);
+        report_benchmark(L"load", item_count, start);
+        start = timef();
+        history_t hist(name);
+        do_test(hist.size() == item_count);
+        report_benchmark(L"load_indexed", item_count, start);
+
+        const struct {
+            const wchar_t *name;
+            const wchar_t *term;
+            history_search_type_t type;
+        } searches[] = {
+            {L"prefix_search", L"git ch", HISTORY_SEARCH_TYPE_PREFIX},
+            {L"contains_search", L"item4", HISTORY_SEARCH_TYPE_CONTAINS},
+            {L"contains_search_rare", L"item9999_", HISTORY_SEARCH_TYPE_CONTAINS},
+        };
+        for (const auto &search : searches) {
+            start = timef();
+            history_search_t searcher(hist, search.term, search.type);
+            // Step through the first matches, as repeatedly searching in the reader does.
+            for (size_t i = 0; i < 100 && searcher.go_backwards(); i++) {
+            }
+            report_benchmark(search.name, item_count, start);
+        }
+
+        // What the reader does for an autosuggestion: find the most recent items with a prefix,
+        // and validate them against the file system.
+        start = timef();
+        const env_vars_snapshot_t &vars = env_vars_snapshot_t::current();
+        const wcstring working_directory = env_get_pwd_slash();
+        const wchar_t *const prefixes[] = {L"cd it", L"vim item1", L"ls -l item77", L"echo item"};
+        for (const wchar_t *prefix : prefixes) {
+            history_search_t searcher(hist, prefix, HISTORY_SEARCH_TYPE_PREFIX);
+            for (size_t tries = 0; tries < 16 && searcher.go_backwards(); tries++) {
+                const history_item_t item = searcher.current_item();
+                if (autosuggest_validate_from_history(item, working_directory, vars)) break;
+            }
+        }
+        report_benchmark(L"autosuggest", item_count, start);
+
+        start = timef();
+        hist.disable_automatic_saving();
+        for (size_t i = 0; i < 100; i++) {
+            hist.add(format_string(L"benchmark new item %lu", (unsigned long)i));
+        }
+        hist.enable_automatic_saving();
+        hist.save();
+        report_benchmark(L"append", item_count, start);
+
+        start = timef();
+        {
+            scoped_lock locker(hist.lock);
+            hist.save_internal_via_rewrite();
+        }
+        report_benchmark(L"vacuum", item_count, start);
+        hist.clear();
+    }
+}
+
+/// Time for loops over literal and variable lists, reporting the iteration rate as well.
+static void benchmark_for_loop() {
+    say(L"Benchmarking for loops");
+    parser_t &parser = parser_t::principal_parser();
+    const size_t iterations = 200 * 1000;
+    wcstring_list_t vals;
+    for (size_t i = 0; i < iterations; i++) vals.push_back(to_string(i));
+    env_set(L"fish_benchmark_list", ENV_GLOBAL, std::move(vals));
+    const struct {
+        const wchar_t *name;
+        const wchar_t *src;
+    } loops[] = {
+        {L"for_variable", L"for i in $fish_benchmark_list; end"},
+        {L"for_variable_local",
+         L"function fish_benchmark_loop; for i in $fish_benchmark_list; end; end; "
+         L"fish_benchmark_loop"},
+    };
+    for (const auto &loop : loops) {
+        double start = timef();
+        parser.eval(loop.src, io_chain_t(), TOP);
+        double elapsed = timef() - start;
+        report_benchmark(loop.name, iterations, start);
+        say(L"%ls: %.0f iterations/sec", loop.name, iterations / elapsed);
+    }
+    env_remove(L"fish_benchmark_list", ENV_GLOBAL);
+}
+
+/// Time evaluating short command lines, and count the allocations each makes.
+static void benchmark_execution() {
+    say(L"Benchmarking execution");
+    parser_t &parser = parser_t::principal_parser();
+    const size_t iterations = 20 * 1000;
+    const struct {
+        const wchar_t *name;
+        const wchar_t *src;
+    } commands[] = {
+        {L"exec_builtin", L"contains some arguments here"},
+        {L"exec_variables", L"set -l fish_benchmark_var a b c; contains b $fish_benchmark_var[2]"},
+        {L"exec_block", L"if true; contains one; else; contains two; end"},
+        {L"exec_loop", L"for i in 1 2 3 4 5 6 7 8 9 10; contains $i a b c; end"},
+        {L"exec_function", L"fish_benchmark_function x y"},
+    };
+    parser.eval(L"function fish_benchmark_function; contains x $argv; end", io_chain_t(), TOP);
+    for (const auto &command : commands) {
+        size_t allocations = s_allocation_count;
+        double start = timef();
+        for (size_t i = 0; i < iterations; i++) {
+            parser.eval(command.src, io_chain_t(), TOP);
+        }
+        report_benchmark(command.name, iterations, start);
+        say(L"%ls: %.1f allocations per evaluation", command.name,
+            (double)(s_allocation_count - allocations) / iterations);
+    }
+    parser.eval(L"functions -e fish_benchmark_function", io_chain_t(), TOP);
+}
+
+/// Time sourcing a large library of functions, as autoloading and config snippets do.
+static void benchmark_source() {
+    say(L"Benchmarking source");
+    parser_t &parser = parser_t::principal_parser();
+    const size_t function_count = 2000;
+    std::string library;
+    for (size_t i = 0; i < function_count; i++) {
+        std::string name = "fish_benchmark_library_" + std::to_string(i);
+        library += "function " + name + " --description 'A function \u00e9 " + name + "'\n";
+        library += "    set -l result (string replace -r '^x' y -- $argv)\n";
+        library += "    if test (count $result) -gt 1\n        echo $result[2..-1]\n    end\n";
+        library += "end\n";
+    }
+    const char *path = "test/benchmark_source.fish";
+    FILE *f = fopen(path, "w");
+    if (!f) return err(L"fopen failed");
+    fwrite(library.data(), 1, library.size(), f);
+    fclose(f);
+
+    const size_t iterations = 20;
+    double start = timef();
+    for (size_t i = 0; i < iterations; i++) {
+        parser.eval(L"source test/benchmark_source.fish", io_chain_t(), TOP);
+    }
+    report_benchmark(L"source_library", iterations, start);
+
+    for (size_t i = 0; i < function_count; i++) {
+        function_remove(format_string(L"fish_benchmark_library_%lu", (unsigned long)i));
+    }
+    unlink(path);
+}
+
+/// Time the test builtin on its most common forms, calling it directly so that only its own work is
+/// measured.
+static void benchmark_test_builtin() {
+    say(L"Benchmarking test builtin");
+    parser_t parser;
+    const size_t iterations = 500 * 1000;
+    const struct {
+        const wchar_t *name;
+        const wchar_t *argv[6];
+    } forms[] = {
+        {L"test_string_n", {L"test", L"-n", L"some value", NULL}},
+        {L"test_string_equal", {L"test", L"some value", L"=", L"some other value", NULL}},
+        {L"test_number_lesser", {L"test", L"12345", L"-lt", L"67890", NULL}},
+        {L"test_combine_and", {L"test", L"-n", L"value", L"-a", L"value", NULL}},
+    };
+    for (const auto &form : forms) {
+        double start = timef();
+        for (size_t i = 0; i < iterations; i++) {
+            io_streams_t streams(0);
+            builtin_test(parser, streams, (wchar_t **)form.argv);
+        }
+        double elapsed = timef() - start;
+        report_benchmark(form.name, iterations, start);
+        say(L"%ls: %.0f calls/sec", form.name, iterations / elapsed);
+    }
+}
+
+/// Time looking up builtins and keywords, which is done for each command run or highlighted.
+static void benchmark_dispatch() {
+    say(L"Benchmarking command dispatch");
+    wcstring_list_t names = builtin_get_names();
+    for (const wchar_t *name : {L"ls", L"git", L"fish_prompt", L"else", L"end", L"grep"}) {
+        names.push_back(name);
+    }
+    const size_t iterations = 200 * 1000;
+    size_t found = 0;
+    double start = timef();
+    for (size_t i = 0; i < iterations; i++) {
+        for (const wcstring &name : names) found += builtin_exists(name);
+    }
+    double elapsed = timef() - start;
+    report_benchmark(L"dispatch_builtin", iterations * names.size(), start);
+    say(L"dispatch_builtin: %.0f lookups/sec", iterations * names.size() / elapsed);
+
+    start = timef();
+    for (size_t i = 0; i < iterations; i++) {
+        for (const wcstring &name : names) found += parser_keywords_is_reserved(name);
+    }
+    elapsed = timef() - start;
+    report_benchmark(L"dispatch_keyword", iterations * names.size(), start);
+    say(L"dispatch_keyword: %.0f lookups/sec", iterations * names.size() / elapsed);
+    if (found == 0) err(L"no names found");
+}
+
+/// Time the pager on a large completion list: loading it, the first rendering, moving the
+/// selection through it and searching it.
+static void benchmark_pager() {
+    say(L"Benchmarking pager");
+    const size_t count = 50 * 1000;
+    completion_list_t completions;
+    for (size_t i = 0; i < count; i++) {
+        completions.push_back(completion_t(format_string(L"completion%lu", (unsigned long)i),
+                                           format_string(L"description %lu", (unsigned long)i)));
+    }
+
+    pager_t pager;
+    pager.set_term_size(80, 24);
+    double start = timef();
+    pager.set_completions(completions);
+    report_benchmark(L"pager_set_completions", count, start);
+
+    start = timef();
+    page_rendering_t rendering = pager.render();
+    report_benchmark(L"pager_render", count, start);
+
+    const size_t moves = 1000;
+    start = timef();
+    for (size_t i = 0; i < moves; i++) {
+        pager.select_next_completion_in_direction(direction_south, rendering);
+        pager.update_rendering(&rendering);
+    }
+    report_benchmark(L"pager_scroll", moves, start);
+
+    // Type a search one character at a time, as the reader does.
+    start = timef();
+    pager.set_search_field_shown(true);
+    for (const wchar_t *c = L"123"; *c; c++) {
+        pager.search_field_line.insert_string(wcstring(1, *c));
+        pager.refilter_completions();
+        pager.update_rendering(&rendering);
+    }
+    report_benchmark(L"pager_filter", count, start);
+}
+
+/// Time reading keys in a bind mode with many bindings, half of the keys being plain characters
+/// and half escape sequences bound to input functions.
+static void benchmark_input() {
+    say(L"Benchmarking input");
+    const wcstring mode = L"benchmark";
+    const size_t binding_count = 500;
+    input_mapping_add(L"", L"self-insert", mode.c_str());
+    for (size_t i = 0; i < binding_count; i++) {
+        wcstring seq = format_string(L"\x1b[%lu~", (unsigned long)i);
+        input_mapping_add(seq.c_str(), i % 2 ? L"forward-char" : L"backward-char", mode.c_str());
+    }
+    const wcstring previous_mode = input_get_bind_mode();
+    input_set_bind_mode(mode);
+
+    const size_t keys = 100 * 1000;
+    for (size_t i = 0; i < keys; i++) {
+        wcstring key = i % 2 ? wcstring(1, L'a' + i % 26) : format_string(L"\x1b[%lu~", i % 500);
+        for (wchar_t wc : key) input_queue_ch(wc);
+    }
+    double start = timef();
+    for (size_t i = 0; i < keys; i++) input_readch();
+    report_benchmark(L"input_readch", keys, start);
+    input_set_bind_mode(previous_mode);
+}
+
+/// Service iothread completions until done is set.
+static void iothread_service_until(const bool &done) {
+    while (!done) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(iothread_port(), &fds);
+        if (select(iothread_port() + 1, &fds, NULL, NULL, NULL) > 0) {
+            iothread_service_completion();
+        }
+    }
+}
+
+/// Time background requests made one after another, each waiting for its completion, as typing
+/// does with highlighting, and then a burst of requests made all at once.
+static void benchmark_iothread() {
+    say(L"Benchmarking iothreads");
+    const size_t count = 1000;
+    double start = timef();
+    for (size_t i = 0; i < count; i++) {
+        bool done = false;
+        iothread_perform([]() {}, [&]() { done = true; });
+        iothread_service_until(done);
+    }
+    report_benchmark(L"iothread_round_trip", count, start);
+
+    start = timef();
+    size_t completed = 0;
+    bool done = false;
+    for (size_t i = 0; i < count; i++) {
+        iothread_perform([]() {}, [&]() { done = ++completed == count; });
+    }
+    iothread_service_until(done);
+    report_benchmark(L"iothread_burst", count, start);
+    iothread_drain_all();
+}
+
+/// Time converting text to wide strings and back in a UTF-8 locale, for mostly ASCII text like
+/// command output and for text with many multibyte characters.
+static void benchmark_convert() {
+    say(L"Benchmarking string conversion");
+    const std::string saved_locale = setlocale(LC_ALL, NULL);
+    if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8")) {
+        say(L"No UTF-8 locale available, skipping");
+        return;
+    }
+    fish_setlocale();
+
+    const struct {
+        const wchar_t *name;
+        const char *line;
+    } texts[] = {
+        {L"convert_ascii", "drwxr-xr-x  2 user group  4096 Jan  1 00:00 some_directory_name\n"},
+        {L"convert_utf8",
+         "r\xC3\xA9sum\xC3\xA9 \xE2\x80\x94 \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E na\xC3\xAFve\n"},
+    };
+    const size_t count = 20000;
+    for (const auto &text : texts) {
+        std::string narrow;
+        for (size_t i = 0; i < 16; i++) narrow.append(text.line);
+        double start = timef();
+        for (size_t i = 0; i < count; i++) {
+            if (wcs2string(str2wcstring(narrow)).size() != narrow.size()) {
+                err(L"Conversion of %ls text did not round-trip", text.name);
+                break;
+            }
+        }
+        report_benchmark(text.name, count, start);
+    }
+
+    setlocale(LC_ALL, saved_locale.c_str());
+    fish_setlocale();
+}
+
+/// Time escaping and unescaping typical paths and arguments, as completion and history do.
+static void benchmark_escape() {
+    say(L"Benchmarking escaping");
+    const wchar_t *const strings[] = {
+        L"/usr/share/fish/functions/fish_prompt.fish",
+        L"some file name with spaces (1).txt",
+        L"--option=value",
+        L"it's a \"quoted\" $thing",
+    };
+    const size_t count = 100000;
+    std::vector<wcstring> escaped(sizeof strings / sizeof *strings);
+    double start = timef();
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < escaped.size(); j++) {
+            escaped[j] = escape_string(strings[j], ESCAPE_ALL);
+        }
+    }
+    report_benchmark(L"escape_script", count, start);
+
+    start = timef();
+    wcstring output;
+    for (size_t i = 0; i < count; i++) {
+        for (const wcstring &str : escaped) {
+            unescape_string(str, &output, UNESCAPE_SPECIAL);
+        }
+    }
+    report_benchmark(L"unescape_script", count, start);
+}
+
 static void test_new_parser_correctness(void) {
     say(L"Testing new parser!");
     const struct parser_test_t {
@@ -3474,6 +6093,145 @@ static void test_new_parser_ad_hoc() {
     }
 }
 
+static bool parse_trees_equal(const parse_node_tree_t &a, const parse_node_tree_t &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        const parse_node_t &x = a.at(i), &y = b.at(i);
+        if (x.source_start != y.source_start || x.source_length != y.source_length ||
+            x.parent != y.parent || x.child_start != y.child_start ||
+            x.child_count != y.child_count || x.type != y.type || x.keyword != y.keyword ||
+            x.flags != y.flags || x.tag != y.tag) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_parse_tree_reusing() {
+    say(L"Testing reparsing edited sources");
+    const wchar_t *const srcs[] = {
+        L"echo one; echo two\n# comment\nfor i in a b\n  echo $i\nend\n\n"
+        L"if true | cat &\n  echo (echo sub)\nelse\n  false\nend; and echo 3\necho 'quoted\n",
+        L"echo one; end\necho two; echo three\n"};
+    const wchar_t *const insertions[] = {L"x", L";", L"\n", L"end", L"'", L"#"};
+    const parse_tree_flags_t flags = parse_flag_continue_after_error | parse_flag_include_comments;
+    for (const wcstring src : srcs) {
+        parse_node_tree_t prev_tree;
+        parse_tree_from_string(src, flags, &prev_tree, NULL);
+
+        // Reparsing after any single edit must give the same tree as a parse from scratch.
+        for (size_t pos = 0; pos <= src.size(); pos++) {
+            std::vector<wcstring> edited;
+            for (const wchar_t *text : insertions) {
+                edited.push_back(wcstring(src).insert(pos, text));
+            }
+            if (pos < src.size()) edited.push_back(wcstring(src).erase(pos, 1));
+            for (const wcstring &str : edited) {
+                parse_node_tree_t expected, reused;
+                parse_tree_from_string(str, flags, &expected, NULL);
+                parse_tree_from_string_reusing(str, flags, &reused, src, prev_tree);
+                if (!parse_trees_equal(expected, reused)) {
+                    err(L"Reparsing gave a different tree for '%ls'", str.c_str());
+                }
+            }
+        }
+    }
+}
+
+static void test_parse_tree_cache() {
+    say(L"Testing parse tree caching");
+    const wcstring src =
+        L"function cached --description 'test'\n  # comment\n  echo $argv | cat &\nend\n"
+        L"if not true; command ls; else if false; end\nswitch x; case '*'; end\n";
+    parse_node_tree_t tree;
+    do_test(!parse_util_detect_errors(src, NULL, false, &tree));
+
+    // Round trip the tree, and reject mangled forms of it.
+    std::string data;
+    parse_tree_serialize(tree, &data);
+    parse_node_tree_t copy;
+    do_test(parse_tree_deserialize(data.data(), data.size(), src.size(), &copy));
+    do_test(parse_trees_equal(tree, copy));
+    parse_node_tree_t bad;
+    do_test(!parse_tree_deserialize(data.data(), data.size() - 1, src.size(), &bad));
+    do_test(!parse_tree_deserialize(data.data(), data.size(), src.size() / 2, &bad));
+    std::string mangled = data;
+    mangled[20 + 8] ^= 0x7F;  // the parent of the second node
+    do_test(!parse_tree_deserialize(mangled.data(), mangled.size(), src.size(), &bad));
+    do_test(bad.empty());
+
+    // The first read of a file parses and caches it; the second finds the cached tree.
+    const wcstring path = L"/fish_tests/parse_tree_cache_test.fish";
+    wcstring cache_dir;
+    path_get_data(cache_dir);
+    cache_dir.append(L"/parse_cache");
+    if (system("rm -Rf test/data/fish/parse_cache")) err(L"rm failed");
+    parse_error_list_t errors;
+    do_test(!parse_util_detect_errors_in_file(path, src, &errors, &copy));
+    do_test(parse_trees_equal(tree, copy));
+    DIR *dir = wopendir(cache_dir);
+    do_test(dir != NULL);
+    size_t cache_files = 0;
+    wcstring name;
+    while (dir && wreaddir(dir, name)) {
+        if (name != L"." && name != L"..") cache_files++;
+    }
+    if (dir) closedir(dir);
+    do_test(cache_files == 1);
+    copy.clear();
+    do_test(!parse_util_detect_errors_in_file(path, src, &errors, &copy));
+    do_test(parse_trees_equal(tree, copy));
+
+    // Changed contents are parsed afresh, and errors are still reported, and not cached.
+    const wcstring changed = L"echo changed\n" + src;
+    do_test(!parse_util_detect_errors(changed, NULL, false, &tree));
+    do_test(!parse_util_detect_errors_in_file(path, changed, &errors, &copy));
+    do_test(parse_trees_equal(tree, copy));
+    do_test(parse_util_detect_errors_in_file(path, L"if true\n", &errors, &copy));
+    do_test(!errors.empty());
+    do_test(!parse_util_detect_errors_in_file(path, changed, &errors, &copy));
+    do_test(parse_trees_equal(tree, copy));
+
+    // A prefetched tree is used once, and only for the contents it was parsed from.
+    const wcstring script = L"test/parse_tree_prefetch_test.fish";
+    if (system("echo 'echo prefetched' > test/parse_tree_prefetch_test.fish")) err(L"echo failed");
+    parse_util_prefetch_file(script);
+    if (system("rm -Rf test/data/fish/parse_cache")) err(L"rm failed");
+    do_test(!parse_util_detect_errors_in_file(script, L"echo prefetched\n", &errors, &copy));
+    do_test(access("test/data/fish/parse_cache", F_OK) != 0);
+    do_test(!parse_util_detect_errors_in_file(script, L"echo prefetched\n", &errors, &copy));
+    do_test(access("test/data/fish/parse_cache", F_OK) == 0);
+    parse_util_prefetch_file(script);
+    do_test(!parse_util_detect_errors_in_file(script, L"echo other\n", &errors, &copy));
+    do_test(!parse_util_detect_errors(L"echo other\n", NULL, false, &tree));
+    do_test(parse_trees_equal(tree, copy));
+
+    // Scripts prefetched in the background are used once their prefetch is done, and are read
+    // correctly when they are taken while it is queued or under way.
+    wcstring_list_t scripts;
+    for (int i = 0; i < 8; i++) {
+        scripts.push_back(format_string(L"test/parse_tree_prefetch_test_%d.fish", i));
+        std::string cmd = "echo 'echo prefetched " + std::to_string(i) + "' > " +
+                          wcs2string(scripts.back());
+        if (system(cmd.c_str())) err(L"echo failed");
+    }
+    parse_util_prefetch_files(scripts);
+    for (size_t i = 0; i < scripts.size(); i++) {
+        const wcstring contents = format_string(L"echo prefetched %lu\n", (unsigned long)i);
+        do_test(!parse_util_detect_errors_in_file(scripts.at(i), contents, &errors, &copy));
+        do_test(!parse_util_detect_errors(contents, NULL, false, &tree));
+        do_test(parse_trees_equal(tree, copy));
+    }
+    iothread_drain_all();
+    parse_util_prefetch_files(scripts);
+    iothread_drain_all();
+    if (system("rm -Rf test/data/fish/parse_cache")) err(L"rm failed");
+    do_test(!parse_util_detect_errors_in_file(scripts.at(0), L"echo prefetched 0\n", &errors,
+                                              &copy));
+    do_test(access("test/data/fish/parse_cache", F_OK) != 0);
+    if (system("rm -f test/parse_tree_prefetch_test*.fish")) err(L"rm failed");
+}
+
 static void test_new_parser_errors(void) {
     say(L"Testing new parser error reporting");
     const struct {
@@ -3626,6 +6384,331 @@ static void test_error_messages() {
     }
 }
 
+static void autoload_test_removed(const wcstring &cmd) { UNUSED(cmd); }
+
+static void test_autoload() {
+    say(L"Testing autoloading");
+    if (system("rm -Rf test/fish_autoload_test")) err(L"rm failed");
+    if (system("mkdir -p test/fish_autoload_test/first test/fish_autoload_test/second")) {
+        err(L"mkdir failed");
+    }
+    env_set(L"fish_test_autoload_path", ENV_GLOBAL,
+            {L"test/fish_autoload_test/first", L"test/fish_autoload_test/missing",
+             L"test/fish_autoload_test/second"});
+    const env_vars_snapshot_t &vars = env_vars_snapshot_t::current();
+
+    autoload_t loader(L"fish_test_autoload_path", autoload_test_removed);
+    do_test(!loader.can_load(L"alpha", vars));
+
+    // Files added after the directories were listed are found, in any directory of the path.
+    if (system("touch test/fish_autoload_test/second/beta.fish")) err(L"touch failed");
+    do_test(loader.load(L"beta", false));
+    do_test(loader.can_load(L"beta", vars));
+    do_test(!loader.can_load(L"gamma", vars));
+
+    // Only .fish files count.
+    if (system("touch test/fish_autoload_test/first/delta")) err(L"touch failed");
+    do_test(!loader.load(L"delta", false));
+
+    // Removed files are noticed when loading.
+    if (system("touch test/fish_autoload_test/first/epsilon.fish")) err(L"touch failed");
+    do_test(loader.can_load(L"epsilon", vars));
+    if (system("rm test/fish_autoload_test/first/epsilon.fish")) err(L"rm failed");
+    do_test(!loader.load(L"epsilon", true));
+
+    // Prefetching parses the file in the background, so that loading it finds the tree in memory
+    // rather than parsing it and writing it to the parse tree cache.
+    if (system("echo 'function zeta; end' > test/fish_autoload_test/second/zeta.fish")) {
+        err(L"echo failed");
+    }
+    loader.prefetch(L"zeta");
+    iothread_drain_all();
+    if (system("rm -Rf test/data/fish/parse_cache")) err(L"rm failed");
+    do_test(loader.load(L"zeta", false));
+    do_test(access("test/data/fish/parse_cache", F_OK) != 0);
+
+    // An explicit limit is kept to, evicting the least recently used commands.
+    env_set_one(L"fish_test_autoload_limit", ENV_GLOBAL, L"2");
+    autoload_t limited(L"fish_test_autoload_path", autoload_test_removed,
+                       L"fish_test_autoload_limit");
+    const wchar_t *const names[] = {L"eta", L"theta", L"iota", L"kappa"};
+    for (const wchar_t *name : names) {
+        const std::string narrow = wcs2string(name);
+        if (system(("touch test/fish_autoload_test/first/" + narrow + ".fish").c_str())) {
+            err(L"touch failed");
+        }
+        do_test(limited.load(name, false));
+    }
+    autoload_stats_t stats = limited.stats();
+    do_test(stats.limit == 2 && stats.entries == 2);
+    do_test(stats.misses == 4 && stats.evictions == 2 && stats.reloads == 0);
+    do_test(limited.load(L"kappa", false));
+    do_test(limited.stats().hits == 1);
+    do_test(limited.load(L"eta", false));
+    stats = limited.stats();
+    do_test(stats.reloads == 1 && stats.limit == 2);
+
+    // Without an explicit limit, commands that keep being needed again grow the cache. Invalid
+    // limits are ignored.
+    env_remove(L"fish_test_autoload_limit", ENV_GLOBAL);
+    do_test(limited.load(L"theta", false));
+    stats = limited.stats();
+    do_test(stats.reloads == 2 && stats.limit > 1024);
+    env_set_one(L"fish_test_autoload_limit", ENV_GLOBAL, L"bogus");
+    do_test(limited.load(L"theta", false));
+    do_test(limited.stats().limit == 1024);
+
+    env_remove(L"fish_test_autoload_limit", ENV_GLOBAL);
+    env_remove(L"fish_test_autoload_path", ENV_GLOBAL);
+    if (system("rm -Rf test/fish_autoload_test")) err(L"rm failed");
+}
+
+/// Return the lines of the given file, without their newlines.
+static wcstring_list_t read_lines_in_file(const char *path) {
+    wcstring_list_t result;
+    FILE *f = fopen(path, "r");
+    if (!f) return result;
+    wchar_t buf[512];
+    while (fgetws(buf, sizeof buf / sizeof *buf, f)) {
+        wcstring line = buf;
+        if (!line.empty() && line.back() == L'\n') line.pop_back();
+        result.push_back(line);
+    }
+    fclose(f);
+    return result;
+}
+
+static void test_profiling() {
+    say(L"Testing profile formats");
+    parser_t &parser = parser_t::principal_parser();
+    g_profiling_active = true;
+    parser.eval(
+        L"function fish_test_profiled\n for i in 1 2 3\n  true\n end\nend\n"
+        L"fish_test_profiled; fish_test_profiled",
+        io_chain_t(), TOP);
+    g_profiling_active = false;
+
+    // The aggregate report has one line per function and source line.
+    const char *path = "test/profile_test";
+    parser.emit_profiling(path, profile_format_aggregate);
+    wcstring_list_t rows = read_lines_in_file(path);
+    do_test(!rows.empty() && string_prefixes_string(L"Self\tTotal\tCount\t", rows.at(0)));
+    size_t true_rows = 0;
+    for (const wcstring &row : rows) {
+        wcstring_list_t fields(1);
+        for (wchar_t c : row) {
+            if (c == L'\t') {
+                fields.push_back(wcstring());
+            } else {
+                fields.back().push_back(c);
+            }
+        }
+        if (fields.size() == 6 && fields.at(5) == L"true") {
+            true_rows++;
+            do_test(fields.at(2) == L"6");
+            do_test(fields.at(3) == L"-:3");
+            do_test(fields.at(4) == L"fish_test_profiled");
+        }
+    }
+    do_test(true_rows == 1);
+
+    // The collapsed stacks nest the loop in the function call.
+    parser.emit_profiling(path, profile_format_collapsed);
+    rows = read_lines_in_file(path);
+    bool found_stack = false;
+    for (const wcstring &row : rows) {
+        if (string_prefixes_string(L"fish_test_profiled (-:6);for (-:2);true (-:3) ", row)) {
+            found_stack = true;
+        }
+    }
+    do_test(found_stack);
+    if (system("rm -f test/profile_test")) err(L"rm failed");
+}
+
+static void test_sampling() {
+    say(L"Testing the sampling profiler");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(
+        L"function fish_test_sampled\n for i in 1 2 3 4 5 6 7 8\n  for j in 1 2 3 4 5 6 7 8\n"
+        L"   set -l k $i$j\n  end\n end\nend",
+        io_chain_t(), TOP);
+    // How often the timer goes off depends on the kernel's tick, so deliver a tick by hand and let
+    // the timer itself wait longer than the test runs. The tick is charged to the first command
+    // that finishes, which is inside the function.
+    do_test(parser.start_sampling(10 * 1000 * 1000));
+    raise(SIGPROF);
+    parser.eval(L"fish_test_sampled", io_chain_t(), TOP);
+    const wcstring samples = parser.stop_sampling();
+    if (samples.find(L"fish_test_sampled;") == wcstring::npos) {
+        err(L"Unexpected samples '%ls'", samples.c_str());
+    }
+    do_test(parser.stop_sampling().empty());
+}
+
+static void test_for_loop_variable() {
+    say(L"Testing for loop variables");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"set -g fish_test_loop; for fish_test_loop in a b c; end", io_chain_t(), TOP);
+    auto var = env_get(L"fish_test_loop");
+    do_test(var && var->as_string() == L"c");
+
+    // Loops still fire variable events, and keep their variable exported if it was.
+    parser.eval(L"function fish_test_loop_handler --on-variable fish_test_loop; "
+                L"set -g fish_test_loop_seen $fish_test_loop_seen $fish_test_loop; end; "
+                L"for fish_test_loop in x y; end; functions -e fish_test_loop_handler",
+                io_chain_t(), TOP);
+    auto seen = env_get(L"fish_test_loop_seen");
+    do_test(seen && seen->as_list() == wcstring_list_t({L"x", L"y"}));
+    parser.eval(L"set -gx fish_test_loop; for fish_test_loop in exported; end", io_chain_t(),
+                TOP);
+    var = env_get(L"fish_test_loop", ENV_EXPORT);
+    do_test(var && var->as_string() == L"exported");
+    env_remove(L"fish_test_loop", ENV_GLOBAL);
+    env_remove(L"fish_test_loop_seen", ENV_GLOBAL);
+}
+
+static void test_builtin_without_job() {
+    say(L"Testing builtins run without a job");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"false", io_chain_t(), TOP);
+    do_test(proc_get_last_status() == STATUS_CMD_ERROR);
+    parser.eval(L"begin; set -l IFS \\n; set -g fish_test_out (echo a; builtin echo b; false); end",
+                io_chain_t(), TOP);
+    auto var = env_get(L"fish_test_out");
+    do_test(var && var->as_list() == wcstring_list_t({L"a", L"b"}));
+    do_test(proc_get_last_status() == STATUS_CMD_ERROR);
+
+    // A builtin shadowed by a function runs the function.
+    parser.eval(L"function true; set -g fish_test_out shadowed; end; true; functions -e true",
+                io_chain_t(), TOP);
+    var = env_get(L"fish_test_out");
+    do_test(var && var->as_string() == L"shadowed");
+    env_remove(L"fish_test_out", ENV_GLOBAL);
+}
+
+static void test_switch_statement() {
+    say(L"Testing switch statements");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function fish_test_switch; switch $argv[1]; case 'a*'; set -g fish_test_case 1; "
+                L"case abc foo; set -g fish_test_case 2; case $fish_test_dyn; "
+                L"set -g fish_test_case 3; case bar 'q\\*'; set -g fish_test_case 4; "
+                L"case '?'; set -g fish_test_case 5; end; end",
+                io_chain_t(), TOP);
+    const struct {
+        const wchar_t *value;
+        const wchar_t *dyn;
+        const wchar_t *expected;
+    } tests[] = {
+        {L"abc", L"", L"1"},
+        {L"foo", L"", L"2"},
+        {L"bar", L"", L"4"},
+        // A case with an expansion is expanded each time, and still goes before later literals.
+        {L"bar", L"bar", L"3"},
+        {L"foo", L"foo", L"2"},
+        {L"q*", L"", L"4"},
+        {L"qx", L"", L"none"},
+        {L"x", L"", L"5"},
+        {L"x", L"x", L"3"},
+    };
+    for (const auto &test : tests) {
+        env_set_one(L"fish_test_dyn", ENV_GLOBAL, test.dyn);
+        env_set_one(L"fish_test_case", ENV_GLOBAL, L"none");
+        parser.eval(L"fish_test_switch " + escape_string(test.value, ESCAPE_ALL), io_chain_t(),
+                    TOP);
+        auto var = env_get(L"fish_test_case");
+        if (!var || var->as_string() != test.expected) {
+            err(L"switch on '%ls' with dynamic case '%ls' ran case '%ls', expected '%ls'",
+                test.value, test.dyn, var ? var->as_string().c_str() : L"", test.expected);
+        }
+    }
+    parser.eval(L"functions -e fish_test_switch", io_chain_t(), TOP);
+    env_remove(L"fish_test_dyn", ENV_GLOBAL);
+    env_remove(L"fish_test_case", ENV_GLOBAL);
+}
+
+static void test_function_definitions() {
+    say(L"Testing shared function definitions");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function fish_test_defined --argument word; set -g fish_test_ran $word; end",
+                io_chain_t(), TOP);
+    function_definition_ref_t def = function_get_definition_ref(L"fish_test_defined");
+    do_test(def && !def->tree.empty());
+    do_test(def && def->named_arguments == wcstring_list_t{L"word"});
+    do_test(!function_get_definition_ref(L"fish_test_undefined"));
+
+    // Copies share the definition rather than duplicating it, and still run.
+    do_test(function_copy(L"fish_test_defined", L"fish_test_copied"));
+    function_definition_ref_t copied = function_get_definition_ref(L"fish_test_copied");
+    do_test(copied && copied == def);
+    parser.eval(L"fish_test_copied gongoozle", io_chain_t(), TOP);
+    auto ran = env_get(L"fish_test_ran");
+    do_test(ran && ran->as_string() == L"gongoozle");
+
+    // Redefining a function does not change the definition held by its copy.
+    parser.eval(L"function fish_test_defined; set -g fish_test_ran redefined; end", io_chain_t(),
+                TOP);
+    do_test(function_get_definition_ref(L"fish_test_defined") != def);
+    do_test(function_get_definition_ref(L"fish_test_copied") == def);
+
+    // Other threads see the functions as of the last change, without going through the main
+    // thread.
+    const env_vars_snapshot_t &vars = env_vars_snapshot_t::current();
+    bool bg_found = false, bg_removed_found = true;
+    wcstring bg_source;
+    iothread_perform([&]() {
+        bg_found = function_exists_no_autoload(L"fish_test_copied", vars);
+        function_definition_ref_t bg_def = function_get_definition_ref(L"fish_test_defined");
+        if (bg_def) bg_source = bg_def->source;
+    });
+    iothread_drain_all();
+    do_test(bg_found);
+    do_test(bg_source.find(L"redefined") != wcstring::npos);
+
+    function_remove(L"fish_test_defined");
+    function_remove(L"fish_test_copied");
+    iothread_perform([&]() {
+        bg_removed_found = function_exists_no_autoload(L"fish_test_copied", vars) ||
+                           function_get_definition_ref(L"fish_test_defined") != NULL;
+    });
+    iothread_drain_all();
+    do_test(!bg_removed_found);
+    env_remove(L"fish_test_ran", ENV_GLOBAL);
+}
+
+static void test_function_names() {
+    say(L"Testing listing function names");
+    if (system("mkdir -p test/function_names_test && touch test/function_names_test/fish_a.fish "
+               "test/function_names_test/_fish_hidden.fish test/function_names_test/fish_a.txt")) {
+        err(L"creating function files failed");
+    }
+    const auto saved_path = env_get(L"fish_function_path");
+    env_set_one(L"fish_function_path", ENV_GLOBAL, wgetcwd() + L"/test/function_names_test");
+
+    auto listed = [](const wcstring &name, bool get_hidden) {
+        return contains(function_get_names(get_hidden), name);
+    };
+    do_test(listed(L"fish_a", false));
+    do_test(!listed(L"fish_a.txt", false));
+    do_test(!listed(L"_fish_hidden", false));
+    do_test(listed(L"_fish_hidden", true));
+    const wcstring_list_t names = function_get_names(true);
+    do_test(std::is_sorted(names.begin(), names.end()));
+
+    // The cached listing of a directory is not used once it changes.
+    if (system("touch test/function_names_test/fish_b.fish")) err(L"touch failed");
+    do_test(listed(L"fish_b", false));
+    if (system("rm test/function_names_test/fish_a.fish")) err(L"rm failed");
+    do_test(!listed(L"fish_a", false));
+    do_test(listed(L"fish_b", false));
+
+    if (saved_path) {
+        env_set(L"fish_function_path", ENV_GLOBAL, saved_path->as_list());
+    } else {
+        env_remove(L"fish_function_path", ENV_GLOBAL);
+    }
+    if (system("rm -Rf test/function_names_test")) err(L"rm failed");
+}
+
 static void test_highlighting(void) {
     say(L"Testing syntax highlighting");
     if (system("mkdir -p test/fish_highlight_test/")) err(L"mkdir failed");
@@ -3849,6 +6932,36 @@ static void test_wcstring_tok(void) {
     }
 }
 
+static void test_wcs_find(void) {
+    say(L"Testing wcs_find");
+    const wchar_t *haystacks[] = {L"", L"a", L"abc", L"aaab", L"abababc", L"xyzzy xyzzy", L"ab"};
+    const wchar_t *needles[] = {L"a", L"b", L"ab", L"aab", L"abc", L"zzy", L"xyzzy ", L"abcd"};
+    for (const wchar_t *haystack : haystacks) {
+        for (const wchar_t *needle : needles) {
+            const wchar_t *haystack_end = haystack + wcslen(haystack);
+            size_t needle_len = wcslen(needle);
+            const wchar_t *expected =
+                std::search(haystack, haystack_end, needle, needle + needle_len);
+            const wchar_t *found = wcs_find(haystack, haystack_end, needle, needle_len);
+            if (found != expected) {
+                err(L"wcs_find found '%ls' in '%ls' at %ld, expected %ld", needle, haystack,
+                    (long)(found - haystack), (long)(expected - haystack));
+            }
+        }
+    }
+
+    // The range is not NUL terminated, and may contain NULs.
+    wcstring with_nul(L"ab\0cab", 6);
+    const wchar_t *start = with_nul.c_str();
+    if (wcs_find(start, start + 6, L"ab", 2) != start) err(L"wcs_find missed a leading match");
+    if (wcs_find(start + 1, start + 6, L"ab", 2) != start + 4) {
+        err(L"wcs_find missed a match after a NUL");
+    }
+    if (wcs_find(start + 1, start + 5, L"ab", 2) != start + 5) {
+        err(L"wcs_find matched past the end of its range");
+    }
+}
+
 int builtin_string(parser_t &parser, io_streams_t &streams, wchar_t **argv);
 static void run_one_string_test(const wchar_t **argv, int expected_rc,
                                 const wchar_t *expected_out) {
@@ -4204,9 +7317,165 @@ static void test_timezone_env_vars(void) {
     }
 }
 
+/// Return the value of the given variable in the array exported to commands, or NULL.
+static const char *exported_value(const char *name) {
+    const size_t name_len = strlen(name);
+    for (const char *const *entry = env_export_arr(); *entry != NULL; entry++) {
+        if (!strncmp(*entry, name, name_len) && (*entry)[name_len] == '=') {
+            return *entry + name_len + 1;
+        }
+    }
+    return NULL;
+}
+
+static void test_export_array(void) {
+    // Changing one variable patches the exported array; scopes are accounted for.
+    env_set_one(L"test_export_var", ENV_GLOBAL | ENV_EXPORT, L"one");
+    const char *value = exported_value("test_export_var");
+    do_test(value != NULL && !strcmp(value, "one"));
+
+    env_set_one(L"test_export_var", ENV_GLOBAL | ENV_EXPORT, L"two");
+    value = exported_value("test_export_var");
+    do_test(value != NULL && !strcmp(value, "two"));
+
+    env_push(true);
+    env_set_one(L"test_export_var", ENV_LOCAL | ENV_EXPORT, L"three");
+    env_set(L"test_export_path", ENV_LOCAL | ENV_EXPORT, {L"/a", L"/b"});
+    value = exported_value("test_export_var");
+    do_test(value != NULL && !strcmp(value, "three"));
+    value = exported_value("test_export_path");
+    do_test(value != NULL && !strcmp(value, "/a\x1e/b"));
+    env_pop();
+    value = exported_value("test_export_var");
+    do_test(value != NULL && !strcmp(value, "two"));
+    do_test(exported_value("test_export_path") == NULL);
+
+    // Reused scopes start out empty, and nested scopes see the exports of the one they shadow.
+    env_push(true);
+    do_test(!env_get(L"test_export_path", ENV_LOCAL));
+    env_set_one(L"test_export_path", ENV_LOCAL | ENV_EXPORT, L"/c");
+    env_push(true);
+    value = exported_value("test_export_path");
+    do_test(value != NULL && !strcmp(value, "/c"));
+    env_remove(L"test_export_path", ENV_LOCAL);
+    do_test(exported_value("test_export_path") == NULL);
+    env_pop();
+    value = exported_value("test_export_path");
+    do_test(value != NULL && !strcmp(value, "/c"));
+    env_pop();
+    do_test(exported_value("test_export_path") == NULL);
+
+    env_set_one(L"test_export_var", ENV_GLOBAL | ENV_UNEXPORT, L"four");
+    do_test(exported_value("test_export_var") == NULL);
+    env_set_one(L"test_export_var", ENV_GLOBAL | ENV_EXPORT, L"five");
+    env_remove(L"test_export_var", ENV_GLOBAL);
+    do_test(exported_value("test_export_var") == NULL);
+}
+
+static void test_env_snapshot(void) {
+    const wchar_t *const keys[] = {L"test_snapshot_var", NULL};
+    env_push(true);
+    env_set_one(L"test_snapshot_var", ENV_LOCAL, L"before");
+    const env_vars_snapshot_t before(keys);
+    const env_vars_snapshot_t before_again(keys);
+    const env_vars_snapshot_t copy = before;
+    env_set_one(L"test_snapshot_var", ENV_LOCAL, L"after");
+    const env_vars_snapshot_t after(keys);
+
+    // Snapshots don't see changes made after they were taken, but new ones do.
+    do_test(before.get(L"test_snapshot_var")->as_string() == L"before");
+    do_test(before_again.get(L"test_snapshot_var")->as_string() == L"before");
+    do_test(copy.get(L"test_snapshot_var")->as_string() == L"before");
+    do_test(after.get(L"test_snapshot_var")->as_string() == L"after");
+    do_test(!after.get(L"PATH"));
+
+    env_pop();
+    const env_vars_snapshot_t popped(keys);
+    do_test(!popped.get(L"test_snapshot_var"));
+    do_test(after.get(L"test_snapshot_var")->as_string() == L"after");
+}
+
+static void test_env_var_generation(void) {
+    env_push(true);
+    env_set_one(L"test_generation_var", ENV_LOCAL, L"PATH:values");
+    auto first = env_get(L"test_generation_var");
+    auto again = env_get(L"test_generation_var");
+
+    // Reading a variable twice, or copying it, sees the same generation.
+    do_test(first && again);
+    do_test(first->get_generation() == again->get_generation());
+    env_var_t copy = *first;
+    do_test(copy.get_generation() == first->get_generation());
+    do_test(&copy.as_list() == &first->as_list());
+
+    // Setting it, even to the same values, makes a new one; old copies are unaffected.
+    env_set_one(L"test_generation_var", ENV_LOCAL, L"PATH:values");
+    auto reset = env_get(L"test_generation_var");
+    do_test(reset->get_generation() != first->get_generation());
+    do_test(*reset == *first);
+    copy.set_vals({L"other"});
+    do_test(copy.get_generation() != first->get_generation());
+    do_test(first->as_string() == L"PATH:values");
+    do_test(&first->as_string() == &first->as_list().front());
+
+    // Lists are joined once, and the joined form is shared along with the values.
+    const env_var_t list(L"test_generation_list", wcstring_list_t({L"a", L"b"}));
+    const env_var_t list_copy = list;
+    do_test(list.as_string() == L"a" ARRAY_SEP_STR L"b");
+    do_test(&list.as_string() == &list_copy.as_string());
+
+    // The global and per-name generations move with sets and erases, and only then.
+    uint64_t global_gen = env_get_generation();
+    uint64_t var_gen = env_get_generation(L"test_generation_var");
+    do_test(var_gen == reset->get_generation());
+    do_test(env_get_generation() == global_gen);
+    env_set_one(L"test_generation_other", ENV_LOCAL, L"x");
+    do_test(env_get_generation() > global_gen);
+    do_test(env_get_generation(L"test_generation_var") == var_gen);
+    env_remove(L"test_generation_var", ENV_LOCAL);
+    do_test(env_get_generation(L"test_generation_var") == 0);
+    env_pop();
+}
+
+static void test_env_names(void) {
+    env_push(true);
+    env_set_one(L"test_names_b", ENV_LOCAL, L"x");
+    env_set_one(L"test_names_a", ENV_LOCAL | ENV_EXPORT, L"x");
+    env_set_one(L"test_names_b", ENV_GLOBAL, L"x");
+    auto test_names = [](int flags) {
+        wcstring_list_t result;
+        for (const wcstring &name : env_get_names(flags)) {
+            if (string_prefixes_string(L"test_names_", name)) result.push_back(name);
+        }
+        return result;
+    };
+
+    // Names are sorted and appear once, however many scopes have them.
+    const wcstring_list_t names = env_get_names(0);
+    do_test(std::is_sorted(std::find(names.begin(), names.end(), L"test_names_a"), names.end()));
+    do_test(test_names(0) == wcstring_list_t({L"test_names_a", L"test_names_b"}));
+    do_test(test_names(ENV_LOCAL | ENV_EXPORT) == wcstring_list_t({L"test_names_a"}));
+    do_test(test_names(ENV_GLOBAL) == wcstring_list_t({L"test_names_b"}));
+
+    // Adding, removing and unexporting variables is seen by the next listing.
+    env_set_one(L"test_names_c", ENV_LOCAL, L"x");
+    env_remove(L"test_names_b", ENV_LOCAL);
+    env_set_one(L"test_names_a", ENV_LOCAL | ENV_UNEXPORT, L"x");
+    do_test(test_names(ENV_LOCAL) == wcstring_list_t({L"test_names_a", L"test_names_c"}));
+    do_test(test_names(ENV_LOCAL | ENV_EXPORT).empty());
+    env_pop();
+    do_test(test_names(0) == wcstring_list_t({L"test_names_b"}));
+    env_remove(L"test_names_b", ENV_GLOBAL);
+    do_test(test_names(0).empty());
+}
+
 /// Verify that setting special env vars have the expected effect on the current shell process.
 static void test_env_vars(void) {
     test_timezone_env_vars();
+    test_export_array();
+    test_env_snapshot();
+    test_env_var_generation();
+    test_env_names();
     // TODO: Add tests for the locale and ncurses vars.
 }
 
@@ -4351,8 +7620,15 @@ int main(int argc, char **argv) {
 
     if (should_test_function("utility_functions")) test_utility_functions();
     if (should_test_function("wcstring_tok")) test_wcstring_tok();
+    if (should_test_function("wcs_find")) test_wcs_find();
     if (should_test_function("env_vars")) test_env_vars();
     if (should_test_function("str_to_num")) test_str_to_num();
+    if (should_test_function("autoload")) test_autoload();
+    if (should_test_function("function_definitions")) test_function_definitions();
+    if (should_test_function("function_names")) test_function_names();
+    if (should_test_function("for_loop_variable")) test_for_loop_variable();
+    if (should_test_function("switch_statement")) test_switch_statement();
+    if (should_test_function("builtin_without_job")) test_builtin_without_job();
     if (should_test_function("highlighting")) test_highlighting();
     if (should_test_function("new_parser_ll2")) test_new_parser_ll2();
     if (should_test_function("new_parser_fuzzing"))
@@ -4360,34 +7636,71 @@ int main(int argc, char **argv) {
     if (should_test_function("new_parser_correctness")) test_new_parser_correctness();
     if (should_test_function("new_parser_ad_hoc")) test_new_parser_ad_hoc();
     if (should_test_function("new_parser_errors")) test_new_parser_errors();
+    if (should_test_function("parse_tree_reusing")) test_parse_tree_reusing();
+    if (should_test_function("parse_tree_cache")) test_parse_tree_cache();
     if (should_test_function("error_messages")) test_error_messages();
     if (should_test_function("escape")) test_unescape_sane();
     if (should_test_function("escape")) test_escape_crazy();
     if (should_test_function("format")) test_format();
     if (should_test_function("convert")) test_convert();
     if (should_test_function("convert_nulls")) test_convert_nulls();
+    if (should_test_function("convert_utf8")) test_convert_utf8();
     if (should_test_function("tok")) test_tokenizer();
     if (should_test_function("iothread")) test_iothread();
     if (should_test_function("parser")) test_parser();
+    if (should_test_function("profiling")) test_profiling();
+    if (should_test_function("sampling")) test_sampling();
+    if (should_test_function("io_buffer_lines")) test_io_buffer_lines();
+    if (should_test_function("io_buffer_deferred_pipe")) test_io_buffer_deferred_pipe();
     if (should_test_function("cancellation")) test_cancellation();
+    if (should_test_function("signal_events")) test_signal_events();
+#ifdef HAVE__PROC_SELF_STAT
+    if (should_test_function("jiffies")) test_jiffies();
+#endif
     if (should_test_function("indents")) test_indents();
     if (should_test_function("utf8")) test_utf8();
+    if (should_test_function("utf8_string")) test_utf8_string();
     if (should_test_function("escape_sequences")) test_escape_sequences();
     if (should_test_function("lru")) test_lru();
+    if (should_test_function("sharded_lru")) test_sharded_lru();
+    if (should_test_function("kill_ring")) test_kill_ring();
     if (should_test_function("expand")) test_expand();
+    if (should_test_function("expand_recursive")) test_expand_recursive();
+    if (should_test_function("expand_cache")) test_expand_cache();
+    if (should_test_function("wildcard_pattern")) test_wildcard_pattern();
+    if (should_test_function("expand_file_types")) test_expand_file_types();
     if (should_test_function("fuzzy_match")) test_fuzzy_match();
     if (should_test_function("abbreviations")) test_abbreviations();
     if (should_test_function("test")) test_test();
     if (should_test_function("path")) test_path();
+    if (should_test_function("path_cache")) test_path_cache();
+    if (should_test_function("cdpath_cache")) test_cdpath_cache();
+    if (should_test_function("wrealpath")) test_wrealpath();
+    if (should_test_function("complete_db")) test_complete_db();
     if (should_test_function("pager_navigation")) test_pager_navigation();
     if (should_test_function("pager_layout")) test_pager_layout();
+    if (should_test_function("pager_filter")) test_pager_filter();
     if (should_test_function("word_motion")) test_word_motion();
+    if (should_test_function("undo")) test_undo();
     if (should_test_function("is_potential_path")) test_is_potential_path();
     if (should_test_function("colors")) test_colors();
+    if (should_test_function("perfect_hash")) test_perfect_hash();
     if (should_test_function("complete")) test_complete();
+    if (should_test_function("complete_commands_in_path")) test_complete_commands_in_path();
+    if (should_test_function("complete_command_descriptions")) {
+        test_complete_command_descriptions();
+    }
+    if (should_test_function("complete_conditions")) test_complete_conditions();
+    if (should_test_function("complete_narrow")) test_complete_narrow();
+    if (should_test_function("complete_profile")) test_complete_profile();
+    if (should_test_function("complete_args_cache")) test_complete_args_cache();
+    if (should_test_function("completions_sort")) test_completions_sort();
+    if (should_test_function("complete_options")) test_complete_options();
     if (should_test_function("input")) test_input();
     if (should_test_function("universal")) test_universal();
     if (should_test_function("universal")) test_universal_callbacks();
+    if (should_test_function("universal")) test_universal_journal();
+    if (should_test_function("universal")) test_universal_coalescing();
     if (should_test_function("notifiers")) test_universal_notifiers();
     if (should_test_function("completion_insertions")) test_completion_insertions();
     if (should_test_function("autosuggestion_ignores")) test_autosuggestion_ignores();
@@ -4397,10 +7710,46 @@ int main(int argc, char **argv) {
     if (should_test_function("history_merge")) history_tests_t::test_history_merge();
     if (should_test_function("history_races")) history_tests_t::test_history_races();
     if (should_test_function("history_formats")) history_tests_t::test_history_formats();
+    if (should_test_function("history_index")) history_tests_t::test_history_index();
+    if (should_test_function("history_parallel_scan")) {
+        history_tests_t::test_history_parallel_scan();
+    }
+    if (should_test_function("history_parallel_search")) {
+        history_tests_t::test_history_parallel_search();
+    }
+    if (should_test_function("history_background_vacuum")) {
+        history_tests_t::test_history_background_vacuum();
+    }
+    if (should_test_function("history_memory_limit")) {
+        history_tests_t::test_history_memory_limit();
+    }
+    if (should_test_function("history_tail_follow")) {
+        history_tests_t::test_history_tail_follow();
+    }
+    if (should_test_function("history_shared_index")) {
+        history_tests_t::test_history_shared_index();
+    }
+#ifdef HAVE_ZLIB
+    if (should_test_function("history_compression")) {
+        history_tests_t::test_history_compression();
+    }
+#endif
     if (should_test_function("string")) test_string();
     if (should_test_function("illegal_command_exit_code")) test_illegal_command_exit_code();
     if (should_test_function("maybe")) test_maybe();
     if (should_test_function("cached_esc_sequences")) test_cached_esc_sequences();
+
+    if (should_benchmark_function("benchmark_history")) history_tests_t::benchmark_history();
+    if (should_benchmark_function("benchmark_for_loop")) benchmark_for_loop();
+    if (should_benchmark_function("benchmark_execution")) benchmark_execution();
+    if (should_benchmark_function("benchmark_test_builtin")) benchmark_test_builtin();
+    if (should_benchmark_function("benchmark_dispatch")) benchmark_dispatch();
+    if (should_benchmark_function("benchmark_pager")) benchmark_pager();
+    if (should_benchmark_function("benchmark_input")) benchmark_input();
+    if (should_benchmark_function("benchmark_iothread")) benchmark_iothread();
+    if (should_benchmark_function("benchmark_convert")) benchmark_convert();
+    if (should_benchmark_function("benchmark_escape")) benchmark_escape();
+    if (should_benchmark_function("benchmark_source")) benchmark_source();
     // history_tests_t::test_history_speed();
 
     say(L"Encountered %d errors in low-level tests", err_count);
@@ -5,11 +5,11 @@
 #include "config.h"  // IWYU pragma: keep
 
 // IWYU pragma: no_include <type_traits>
-#include <dirent.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <wchar.h>
 
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <unordered_set>
@@ -21,6 +21,7 @@
 #include "common.h"
 #include "env.h"
 #include "event.h"
+#include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "function.h"
 #include "intern.h"
@@ -28,15 +29,63 @@
 #include "reader.h"
 #include "wutil.h"  // IWYU pragma: keep
 
-/// Table containing all functions.
+/// Table containing all functions. Only the main thread modifies it, and it does so while holding
+/// functions_lock, so the main thread may read it without locking. Other threads read snapshots of
+/// it instead, see function_table_view_t.
 typedef std::unordered_map<wcstring, function_info_t> function_map_t;
 static function_map_t loaded_functions;
 
-/// Functions that shouldn't be autoloaded (anymore).
+/// Functions that shouldn't be autoloaded (anymore). Only used on the main thread.
 static std::unordered_set<wcstring> function_tombstones;
 
-/// Lock for functions.
-static std::recursive_mutex functions_lock;
+/// Lock taken by the main thread while it modifies loaded_functions, and by other threads while
+/// they snapshot it.
+static std::mutex functions_lock;
+
+/// Immutable copy of loaded_functions for other threads, or empty if the table has changed since
+/// the last copy was made. This is only accessed through std::atomic_load and std::atomic_store,
+/// so readers do not need functions_lock unless they have to make a new copy.
+static std::shared_ptr<const function_map_t> s_functions_snapshot;
+
+/// A read-only view of the function table. On the main thread this is the table itself. Other
+/// threads get a snapshot, which stays valid for as long as the view exists, so looking up
+/// functions while highlighting or autosuggesting does not wait for the main thread.
+class function_table_view_t {
+    std::shared_ptr<const function_map_t> snapshot;
+    const function_map_t *map;
+
+   public:
+    function_table_view_t() : map(&loaded_functions) {
+        if (is_main_thread()) return;
+        snapshot = std::atomic_load(&s_functions_snapshot);
+        if (!snapshot) {
+            scoped_lock locker(functions_lock);
+            snapshot = std::atomic_load(&s_functions_snapshot);
+            if (!snapshot) {
+                snapshot = std::make_shared<const function_map_t>(loaded_functions);
+                std::atomic_store(&s_functions_snapshot, snapshot);
+            }
+        }
+        map = snapshot.get();
+    }
+
+    /// Returns the function with the given name, or NULL.
+    const function_info_t *get(const wcstring &name) const {
+        auto iter = map->find(name);
+        return iter == map->end() ? NULL : &iter->second;
+    }
+
+    const function_map_t &functions() const { return *map; }
+};
+
+/// Changes whenever loaded_functions does. Only used on the main thread.
+static uint64_t s_function_generation = 0;
+
+/// Called by the main thread, with functions_lock held, after changing loaded_functions.
+static void functions_changed() {
+    s_function_generation++;
+    std::atomic_store(&s_functions_snapshot, std::shared_ptr<const function_map_t>());
+}
 
 static bool function_remove_ignore_autoload(const wcstring &name, bool tombstone = true);
 
@@ -46,7 +95,8 @@ void autoloaded_function_removed(const wcstring &cmd) {
 }
 
 // Function autoloader
-static autoload_t function_autoloader(L"fish_function_path", autoloaded_function_removed);
+static autoload_t function_autoloader(L"fish_function_path", autoloaded_function_removed,
+                                      L"fish_function_autoload_limit");
 
 /// Kludgy flag set by the load function in order to tell function_add that the function being
 /// defined is autoloaded. There should be a better way to do this...
@@ -56,7 +106,6 @@ static bool is_autoload = false;
 /// loaded.
 static int load(const wcstring &name) {
     ASSERT_IS_MAIN_THREAD();
-    scoped_rlock locker(functions_lock);
     bool was_autoload = is_autoload;
     int res;
 
@@ -75,35 +124,24 @@ static int load(const wcstring &name) {
     return res;
 }
 
-/// Insert a list of all dynamically loaded functions into the specified list.
-static void autoload_names(std::unordered_set<wcstring> &names, int get_hidden) {
-    size_t i;
-
+/// Add the names of all functions that can be autoloaded to the specified list.
+static void autoload_names(wcstring_list_t &names, int get_hidden) {
     const auto path_var = env_get(L"fish_function_path");
     if (path_var.missing_or_empty()) return;
 
     wcstring_list_t path_list;
     path_var->to_list(path_list);
 
-    for (i = 0; i < path_list.size(); i++) {
-        const wcstring &ndir_str = path_list.at(i);
-        const wchar_t *ndir = (wchar_t *)ndir_str.c_str();
-        DIR *dir = wopendir(ndir);
-        if (!dir) continue;
-
-        wcstring name;
-        while (wreaddir(dir, name)) {
-            const wchar_t *fn = name.c_str();
-            const wchar_t *suffix;
-            if (!get_hidden && fn[0] == L'_') continue;
-
-            suffix = wcsrchr(fn, L'.');
-            if (suffix && (wcscmp(suffix, L".fish") == 0)) {
-                wcstring name(fn, suffix - fn);
-                names.insert(name);
-            }
+    for (const wcstring &dir_path : path_list) {
+        const size_t first = names.size();
+        autoload_list_dir(dir_path, &names);
+        if (!get_hidden) {
+            names.erase(std::remove_if(names.begin() + first, names.end(),
+                                       [](const wcstring &name) {
+                                           return name.empty() || name.at(0) == L'_';
+                                       }),
+                        names.end());
         }
-        closedir(dir);
     }
 }
 
@@ -116,14 +154,61 @@ static std::map<wcstring, env_var_t> snapshot_vars(const wcstring_list_t &vars)
     return result;
 }
 
+/// Parse a function body, returning an empty tree if it has errors. Those errors are reported when
+/// the function is run.
+static parse_node_tree_t parse_definition(const wcstring &source) {
+    parse_node_tree_t tree;
+    if (!parse_tree_from_string(source, parse_flag_none, &tree, NULL)) {
+        tree.clear();
+    }
+    return tree;
+}
+
+/// Return the offsets and expanded commands of the undecorated statements in the first job of a
+/// parsed function body. Statements decorated with 'builtin' or 'command' are left out, as they
+/// never call the function itself; that is what enables wrapper functions.
+static std::vector<std::pair<node_offset_t, wcstring>> first_job_commands_of(
+    const parse_node_tree_t &tree, const wcstring &source) {
+    std::vector<std::pair<node_offset_t, wcstring>> result;
+    if (tree.empty()) return result;
+    const parse_node_t *first_job = tree.next_node_in_node_list(tree.at(0), symbol_job, NULL);
+    if (first_job == NULL) return result;
+
+    const parse_node_tree_t::parse_node_list_t statements =
+        tree.specific_statements_for_job(*first_job);
+    for (const parse_node_t *statement : statements) {
+        if (statement->type != symbol_decorated_statement) continue;
+        const parse_node_t &plain_statement = tree.find_child(*statement, symbol_plain_statement);
+        if (tree.decoration_for_plain_statement(plain_statement) !=
+            parse_statement_decoration_none) {
+            continue;
+        }
+
+        wcstring cmd;
+        tree.command_for_plain_statement(plain_statement, source, &cmd);
+        if (expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES, NULL)) {
+            result.push_back(std::make_pair(static_cast<node_offset_t>(statement - &tree.at(0)),
+                                            std::move(cmd)));
+        }
+    }
+    return result;
+}
+
+function_definition_t::function_definition_t(wcstring src, wcstring_list_t named,
+                                             std::map<wcstring, env_var_t> inherited)
+    : source(std::move(src)),
+      tree(parse_definition(source)),
+      named_arguments(std::move(named)),
+      inherit_vars(std::move(inherited)),
+      first_job_commands(first_job_commands_of(tree, source)) {}
+
 function_info_t::function_info_t(const function_data_t &data, const wchar_t *filename,
                                  int def_offset, bool autoload)
-    : definition(data.definition),
+    : definition(std::make_shared<function_definition_t>(
+          data.definition, data.named_arguments, snapshot_vars(data.inherit_vars))),
       description(data.description),
       definition_file(intern(filename)),
       definition_offset(def_offset),
-      named_arguments(data.named_arguments),
-      inherit_vars(snapshot_vars(data.inherit_vars)),
       is_autoload(autoload),
       shadow_scope(data.shadow_scope) {}
 
@@ -133,8 +218,6 @@ function_info_t::function_info_t(const function_info_t &data, const wchar_t *fil
       description(data.description),
       definition_file(intern(filename)),
       definition_offset(def_offset),
-      named_arguments(data.named_arguments),
-      inherit_vars(data.inherit_vars),
       is_autoload(autoload),
       shadow_scope(data.shadow_scope) {}
 
@@ -144,7 +227,6 @@ void function_add(const function_data_t &data, const parser_t &parser, int defin
 
     CHECK(!data.name.empty(), );  //!OCLINT(multiple unary operator)
     CHECK(data.definition, );
-    scoped_rlock locker(functions_lock);
 
     // Remove the old function.
     function_remove(data.name);
@@ -154,7 +236,11 @@ void function_add(const function_data_t &data, const parser_t &parser, int defin
 
     const function_map_t::value_type new_pair(
         data.name, function_info_t(data, filename, definition_line_offset, is_autoload));
-    loaded_functions.insert(new_pair);
+    {
+        scoped_lock locker(functions_lock);
+        loaded_functions.insert(new_pair);
+        functions_changed();
+    }
 
     // Add event handlers.
     for (std::vector<event_t>::const_iterator iter = data.events.begin(); iter != data.events.end();
@@ -165,29 +251,56 @@ void function_add(const function_data_t &data, const parser_t &parser, int defin
 
 int function_exists(const wcstring &cmd) {
     if (parser_keywords_is_reserved(cmd)) return 0;
-    scoped_rlock locker(functions_lock);
     load(cmd);
     return loaded_functions.find(cmd) != loaded_functions.end();
 }
 
 void function_load(const wcstring &cmd) {
     if (!parser_keywords_is_reserved(cmd)) {
-        scoped_rlock locker(functions_lock);
         load(cmd);
     }
 }
 
+autoload_stats_t function_autoload_stats() { return function_autoloader.stats(); }
+
+memory_usage_t function_memory_usage() {
+    ASSERT_IS_MAIN_THREAD();
+    memory_usage_t usage;
+    // Copies of a function share their definition, so count each definition once.
+    std::unordered_set<const function_definition_t *> definitions;
+    for (const auto &func : loaded_functions) {
+        usage.count++;
+        usage.bytes += sizeof func + 2 * sizeof(void *) + string_memory(func.first) +
+                       string_memory(func.second.description);
+        const function_definition_t *def = func.second.definition.get();
+        if (!def || !definitions.insert(def).second) continue;
+        usage.bytes += sizeof *def + string_memory(def->source) +
+                       def->tree.capacity() * sizeof(parse_node_t) +
+                       string_list_memory(def->named_arguments);
+        for (const auto &var : def->inherit_vars) {
+            // Each map node also holds three links and its color.
+            usage.bytes += sizeof var + 4 * sizeof(void *) + string_memory(var.first) +
+                           string_list_memory(var.second.as_list());
+        }
+    }
+    return usage;
+}
+
+void function_prefetch(const wcstring &name) {
+    ASSERT_IS_MAIN_THREAD();
+    if (parser_keywords_is_reserved(name)) return;
+    if (function_tombstones.count(name) > 0 || loaded_functions.count(name) > 0) return;
+    function_autoloader.prefetch(name);
+}
+
 int function_exists_no_autoload(const wcstring &cmd, const env_vars_snapshot_t &vars) {
     if (parser_keywords_is_reserved(cmd)) return 0;
-    scoped_rlock locker(functions_lock);
-    return loaded_functions.find(cmd) != loaded_functions.end() ||
-           function_autoloader.can_load(cmd, vars);
+    function_table_view_t table;
+    return table.get(cmd) != NULL || function_autoloader.can_load(cmd, vars);
 }
 
 static bool function_remove_ignore_autoload(const wcstring &name, bool tombstone) {
-    // Note: the lock may be held at this point, but is recursive.
-    scoped_rlock locker(functions_lock);
-
+    ASSERT_IS_MAIN_THREAD();
     function_map_t::iterator iter = loaded_functions.find(name);
 
     // Not found.  Not erasing.
@@ -196,7 +309,11 @@ static bool function_remove_ignore_autoload(const wcstring &name, bool tombstone
     // Removing an auto-loaded function.  Prevent it from being auto-reloaded.
     if (iter->second.is_autoload && tombstone) function_tombstones.insert(name);
 
-    loaded_functions.erase(iter);
+    {
+        scoped_lock locker(functions_lock);
+        loaded_functions.erase(iter);
+        functions_changed();
+    }
     event_t ev(EVENT_ANY);
     ev.function_name = name;
     event_remove(ev);
@@ -207,49 +324,44 @@ void function_remove(const wcstring &name) {
     if (function_remove_ignore_autoload(name)) function_autoloader.unload(name);
 }
 
-static const function_info_t *function_get(const wcstring &name) {
-    // The caller must lock the functions_lock before calling this; however our mutex is currently
-    // recursive, so trylock will never fail. We need a way to correctly check if a lock is locked
-    // (or better yet, make our lock non-recursive).
-    // ASSERT_IS_LOCKED(functions_lock);
-    function_map_t::iterator iter = loaded_functions.find(name);
-    if (iter == loaded_functions.end()) {
-        return NULL;
-    }
-    return &iter->second;
-}
 
 bool function_get_definition(const wcstring &name, wcstring *out_definition) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     if (func && out_definition) {
-        out_definition->assign(func->definition);
+        out_definition->assign(func->definition->source);
     }
     return func != NULL;
 }
 
+function_definition_ref_t function_get_definition_ref(const wcstring &name) {
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
+    return func ? func->definition : function_definition_ref_t();
+}
+
 wcstring_list_t function_get_named_arguments(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
-    return func ? func->named_arguments : wcstring_list_t();
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
+    return func ? func->definition->named_arguments : wcstring_list_t();
 }
 
 std::map<wcstring, env_var_t> function_get_inherit_vars(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
-    return func ? func->inherit_vars : std::map<wcstring, env_var_t>();
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
+    return func ? func->definition->inherit_vars : std::map<wcstring, env_var_t>();
 }
 
 bool function_get_shadow_scope(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     return func ? func->shadow_scope : false;
 }
 
 bool function_get_desc(const wcstring &name, wcstring *out_desc) {
     // Empty length string goes to NULL.
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     if (out_desc && func && !func->description.empty()) {
         out_desc->assign(_(func->description.c_str()));
         return true;
@@ -258,62 +370,73 @@ bool function_get_desc(const wcstring &name, wcstring *out_desc) {
     return false;
 }
 
+uint64_t function_get_generation() {
+    ASSERT_IS_MAIN_THREAD();
+    return s_function_generation;
+}
+
 void function_set_desc(const wcstring &name, const wcstring &desc) {
+    ASSERT_IS_MAIN_THREAD();
     load(name);
-    scoped_rlock locker(functions_lock);
     function_map_t::iterator iter = loaded_functions.find(name);
     if (iter != loaded_functions.end()) {
+        scoped_lock locker(functions_lock);
         iter->second.description = desc;
+        functions_changed();
     }
 }
 
 bool function_copy(const wcstring &name, const wcstring &new_name) {
+    ASSERT_IS_MAIN_THREAD();
     bool result = false;
-    scoped_rlock locker(functions_lock);
     function_map_t::const_iterator iter = loaded_functions.find(name);
     if (iter != loaded_functions.end()) {
         // This new instance of the function shouldn't be tied to the definition file of the
         // original, so pass NULL filename, etc.
         const function_map_t::value_type new_pair(new_name,
                                                   function_info_t(iter->second, NULL, 0, false));
+        scoped_lock locker(functions_lock);
         loaded_functions.insert(new_pair);
+        functions_changed();
         result = true;
     }
     return result;
 }
 
 wcstring_list_t function_get_names(int get_hidden) {
-    std::unordered_set<wcstring> names;
-    scoped_rlock locker(functions_lock);
+    wcstring_list_t names;
     autoload_names(names, get_hidden);
 
-    for (const auto &func : loaded_functions) {
+    function_table_view_t table;
+    for (const auto &func : table.functions()) {
         const wcstring &name = func.first;
 
         // Maybe skip hidden.
         if (!get_hidden && (name.empty() || name.at(0) == L'_')) {
             continue;
         }
-        names.insert(name);
+        names.push_back(name);
     }
-    return wcstring_list_t(names.begin(), names.end());
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
 }
 
 const wchar_t *function_get_definition_file(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     return func ? func->definition_file : NULL;
 }
 
 bool function_is_autoloaded(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     return func->is_autoload;
 }
 
 int function_get_definition_offset(const wcstring &name) {
-    scoped_rlock locker(functions_lock);
-    const function_info_t *func = function_get(name);
+    function_table_view_t table;
+    const function_info_t *func = table.get(name);
     return func ? func->definition_offset : -1;
 }
 
@@ -321,24 +444,21 @@ int function_get_definition_offset(const wcstring &name) {
 // 1. argv
 // 2. named arguments
 // 3. inherited variables
-void function_prepare_environment(const wcstring &name, const wchar_t *const *argv,
-                                  const std::map<wcstring, env_var_t> &inherited_vars) {
+void function_prepare_environment(const function_definition_t &def, const wchar_t *const *argv) {
     env_set_argv(argv);
 
-    const wcstring_list_t named_arguments = function_get_named_arguments(name);
-    if (!named_arguments.empty()) {
-        const wchar_t *const *arg = argv;
-        for (size_t i = 0; i < named_arguments.size(); i++) {
-            if (*arg) {
-                env_set_one(named_arguments.at(i), ENV_LOCAL | ENV_USER, *arg);
-                arg++;
-            } else {
-                env_set_empty(named_arguments.at(i), ENV_LOCAL | ENV_USER);
-            }
+    const wchar_t *const *arg = argv;
+    for (const wcstring &name : def.named_arguments) {
+        if (arg && *arg) {
+            env_set_local(name, env_var_t(name, *arg), ENV_LOCAL | ENV_USER);
+            arg++;
+        } else {
+            env_set_local(name, env_var_t(name, wcstring_list_t()), ENV_LOCAL | ENV_USER);
         }
     }
 
-    for (auto it = inherited_vars.begin(), end = inherited_vars.end(); it != end; ++it) {
-        env_set(it->first, ENV_LOCAL | ENV_USER, it->second.as_list());
+    // The inherited values are shared with the definition, not copied.
+    for (const auto &inherited : def.inherit_vars) {
+        env_set_local(inherited.first, inherited.second, ENV_LOCAL | ENV_USER);
     }
 }
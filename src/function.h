@@ -5,11 +5,14 @@
 #define FISH_FUNCTION_H
 
 #include <map>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "common.h"
 #include "env.h"
 #include "event.h"
+#include "parse_tree.h"
 
 class parser_t;
 
@@ -34,21 +37,40 @@ struct function_data_t {
     bool shadow_scope;
 };
 
+/// The immutable parts of a function. These are shared by copies of the function and handed out
+/// to callers by reference, so that large function bodies are stored only once.
+struct function_definition_t {
+    /// Function definition.
+    const wcstring source;
+    /// Parse tree of the definition. This is empty if the definition failed to parse.
+    const parse_node_tree_t tree;
+    /// List of all named arguments for this function.
+    const wcstring_list_t named_arguments;
+    /// Mapping of all variables that were inherited from the function definition scope to their
+    /// values.
+    const std::map<wcstring, env_var_t> inherit_vars;
+    /// The undecorated statements of the first job in the definition, each with its command
+    /// expanded as far as it can be without variables or command substitutions. A function whose
+    /// body starts by calling itself recurses forever; this lets a call find that out without
+    /// expanding the commands again.
+    const std::vector<std::pair<node_offset_t, wcstring>> first_job_commands;
+
+    function_definition_t(wcstring source, wcstring_list_t named_arguments,
+                          std::map<wcstring, env_var_t> inherit_vars);
+};
+
+typedef std::shared_ptr<const function_definition_t> function_definition_ref_t;
+
 class function_info_t {
    public:
-    /// Function definition.
-    const wcstring definition;
+    /// Function definition, shared with copies of this function.
+    const function_definition_ref_t definition;
     /// Function description. Only the description may be changed after the function is created.
     wcstring description;
     /// File where this function was defined (intern'd string).
     const wchar_t *const definition_file;
     /// Line where definition started.
     const int definition_offset;
-    /// List of all named arguments for this function.
-    const wcstring_list_t named_arguments;
-    /// Mapping of all variables that were inherited from the function definition scope to their
-    /// values.
-    const std::map<wcstring, env_var_t> inherit_vars;
     /// Flag for specifying that this function was automatically loaded.
     const bool is_autoload;
     /// Set to true if invoking this function shadows the variables of the underlying function.
@@ -78,6 +100,11 @@ void function_remove(const wcstring &name);
 /// successful, false if no function with the given name exists.
 bool function_get_definition(const wcstring &name, wcstring *out_definition);
 
+/// Returns the shared definition of the function with the name \c name, or an empty reference if
+/// no function with the given name exists. Unlike function_get_definition, this does not copy the
+/// function body.
+function_definition_ref_t function_get_definition_ref(const wcstring &name);
+
 /// Returns by reference the description of the function with the name \c name. Returns true if the
 /// function exists and has a nonempty description, false if it does not.
 bool function_get_desc(const wcstring &name, wcstring *out_desc);
@@ -85,16 +112,33 @@ bool function_get_desc(const wcstring &name, wcstring *out_desc);
 /// Sets the description of the function with the name \c name.
 void function_set_desc(const wcstring &name, const wcstring &desc);
 
+/// Returns a number that changes whenever a function is defined, copied or removed, including by
+/// autoloading. What a command name refers to can only have changed if this has.
+uint64_t function_get_generation();
+
 /// Returns true if the function with the name name exists.
 int function_exists(const wcstring &name);
 
 /// Attempts to load a function if not yet loaded. This is used by the completion machinery.
 void function_load(const wcstring &name);
 
+/// Returns the counters of the cache used for autoloading functions.
+struct autoload_stats_t;
+autoload_stats_t function_autoload_stats();
+
+/// Returns the number of functions loaded, and approximately how much memory they use with their
+/// definitions and parse trees.
+memory_usage_t function_memory_usage();
+
+/// Prefetches the file defining the function in the background, if it is not yet loaded, so that
+/// loading it later is quicker.
+void function_prefetch(const wcstring &name);
+
 /// Returns true if the function with the name name exists, without triggering autoload.
 int function_exists_no_autoload(const wcstring &name, const env_vars_snapshot_t &vars);
 
-/// Returns all function names.
+/// Returns all function names, sorted. The names of the functions that can be autoloaded are
+/// cached for each directory in $fish_function_path until the directory changes.
 ///
 /// \param get_hidden whether to include hidden functions, i.e. ones starting with an underscore.
 wcstring_list_t function_get_names(int get_hidden);
@@ -124,15 +168,15 @@ wcstring_list_t function_get_named_arguments(const wcstring &name);
 /// of the function definition to their values.
 std::map<wcstring, env_var_t> function_get_inherit_vars(const wcstring &name);
 
-/// Creates a new function using the same definition as the specified function. Returns true if copy
-/// is successful.
+/// Creates a new function using the same definition as the specified function. The definition is
+/// shared, not duplicated. Returns true if copy is successful.
 bool function_copy(const wcstring &name, const wcstring &new_name);
 
 /// Returns whether this function shadows variables of the underlying function.
 bool function_get_shadow_scope(const wcstring &name);
 
-/// Prepares the environment for executing a function.
-void function_prepare_environment(const wcstring &name, const wchar_t *const *argv,
-                                  const std::map<wcstring, env_var_t> &inherited_vars);
+/// Prepares the environment for executing a function: sets $argv, the named arguments and the
+/// inherited variables in the function's scope.
+void function_prepare_environment(const function_definition_t &def, const wchar_t *const *argv);
 
 #endif
@@ -25,11 +25,13 @@
 #include "function.h"
 #include "highlight.h"
 #include "history.h"
+#include "lru.h"
 #include "output.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
 #include "parse_util.h"
 #include "path.h"
+#include "reader.h"
 #include "tokenizer.h"
 #include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
@@ -61,34 +63,53 @@ static const wchar_t *const highlight_var[] = {L"fish_color_normal",
                                                L"fish_pager_color_progress",
                                                L"fish_pager_color_secondary"};
 
+/// How long, in seconds, a path probe result is reused by later highlighting passes. Running a
+/// command forgets them all (it may have changed directory or touched the files), so this only
+/// bounds how long changes made by other processes go unnoticed.
+#define PATH_PROBE_CACHE_TTL 2.0
+
+/// The most path probe results we remember.
+#define PATH_PROBE_CACHE_SIZE 1024
+
+/// Results of is_potential_path, keyed by the flags, the path fragment and the directories it was
+/// looked up in. The directories are absolute, so the working directory is part of the key. Path
+/// probes are made from background threads, and shared between highlighting passes.
+static sharded_lru_cache_t<wcstring, bool> s_path_probes(PATH_PROBE_CACHE_SIZE, 0,
+                                                         PATH_PROBE_CACHE_TTL);
+
+/// Whether the filesystem holding a directory is case insensitive, keyed by the directory path.
+/// This does not change while the directory exists, so entries never expire.
+static owning_lock<std::unordered_map<wcstring, bool>> s_case_insensitive_dirs;
+
+void highlight_forget_path_probes() { s_path_probes.evict_all(); }
+
+lru_cache_stats_t highlight_path_probe_stats() { return s_path_probes.stats(); }
+
 /// Determine if the filesystem containing the given fd is case insensitive for lookups regardless
 /// of whether it preserves the case when saving a pathname.
 ///
 /// Returns:
 ///     false: the filesystem is not case insensitive
 ///     true: the file system is case insensitive
-typedef std::unordered_map<wcstring, bool> case_sensitivity_cache_t;
-bool fs_is_case_insensitive(const wcstring &path, int fd,
-                            case_sensitivity_cache_t &case_sensitivity_cache) {
+static bool fs_is_case_insensitive(const wcstring &path, int fd) {
     bool result = false;
 #ifdef _PC_CASE_SENSITIVE
     // Try the cache first.
-    case_sensitivity_cache_t::iterator cache = case_sensitivity_cache.find(path);
-    if (cache != case_sensitivity_cache.end()) {
-        /* Use the cached value */
-        result = cache->second;
-    } else {
-        // Ask the system. A -1 value means error (so assume case sensitive), a 1 value means case
-        // sensitive, and a 0 value means case insensitive.
-        long ret = fpathconf(fd, _PC_CASE_SENSITIVE);
-        result = (ret == 0);
-        case_sensitivity_cache[path] = result;
+    {
+        auto &&dirs = s_case_insensitive_dirs.acquire();
+        auto cache = dirs.value.find(path);
+        if (cache != dirs.value.end()) return cache->second;
     }
+    // Ask the system. A -1 value means error (so assume case sensitive), a 1 value means case
+    // sensitive, and a 0 value means case insensitive.
+    long ret = fpathconf(fd, _PC_CASE_SENSITIVE);
+    result = (ret == 0);
+    auto &&dirs = s_case_insensitive_dirs.acquire();
+    dirs.value[path] = result;
 #else
     // Silence lint tools about the unused parameters.
     UNUSED(path);
     UNUSED(fd);
-    UNUSED(case_sensitivity_cache);
 #endif
     return result;
 }
@@ -144,13 +165,20 @@ bool is_potential_path(const wcstring &potential_path_fragment, const wcstring_l
         return result;
     }
 
+    // Reuse a recent probe of the same fragment in the same directories.
+    wcstring cache_key = format_string(L"%u", flags);
+    cache_key.push_back(L'\0');
+    cache_key.append(clean_potential_path_fragment);
+    for (const wcstring &wd : directories) {
+        cache_key.push_back(L'\0');
+        cache_key.append(wd);
+    }
+    if (s_path_probes.get(cache_key, &result)) return result;
+
     // Don't test the same path multiple times, which can happen if the path is absolute and the
     // CDPATH contains multiple entries.
     std::unordered_set<wcstring> checked_paths;
 
-    // Keep a cache of which paths / filesystems are case sensitive.
-    case_sensitivity_cache_t case_sensitivity_cache;
-
     for (size_t wd_idx = 0; wd_idx < directories.size() && !result; wd_idx++) {
         const wcstring &wd = directories.at(wd_idx);
 
@@ -178,7 +206,7 @@ bool is_potential_path(const wcstring &potential_path_fragment, const wcstring_l
             } else if ((dir = wopendir(dir_name))) {
                 // Check if we're case insensitive.
                 const bool do_case_insensitive =
-                    fs_is_case_insensitive(dir_name, dirfd(dir), case_sensitivity_cache);
+                    fs_is_case_insensitive(dir_name, dirfd(dir));
 
                 wcstring matched_file;
 
@@ -207,6 +235,7 @@ bool is_potential_path(const wcstring &potential_path_fragment, const wcstring_l
         }
     }
 
+    s_path_probes.insert(std::move(cache_key), result);
     return result;
 }
 
@@ -225,9 +254,7 @@ static bool is_potential_cd_path(const wcstring &path, const wcstring &working_d
         if (cdpath.missing_or_empty()) cdpath = env_var_t(L"CDPATH", L".");
 
         // Tokenize it into directories.
-        std::vector<wcstring> pathsv;
-        cdpath->to_list(pathsv);
-        for (auto next_path : pathsv) {
+        for (auto next_path : cdpath->as_list()) {
             if (next_path.empty()) next_path = L".";
             // Ensure that we use the working directory for relative cdpaths like ".".
             directories.push_back(path_apply_working_directory(next_path, working_directory));
@@ -255,7 +282,38 @@ bool plain_statement_get_expanded_command(const wcstring &src, const parse_node_
     return false;
 }
 
+/// Colors returned by highlight_get_color, keyed by the highlight spec and whether it is for the
+/// background. Repainting asks for the same few specs for every character, so they are only looked
+/// up and parsed again once a variable has changed, or the terminal's color support has.
+struct resolved_color_cache_t {
+    uint64_t env_generation = 0;
+    color_support_t color_support = 0;
+    std::unordered_map<uint64_t, rgb_color_t> colors;
+};
+static resolved_color_cache_t s_resolved_colors;
+
+static rgb_color_t resolve_highlight_color(highlight_spec_t highlight, bool is_background);
+
 rgb_color_t highlight_get_color(highlight_spec_t highlight, bool is_background) {
+    ASSERT_IS_MAIN_THREAD();
+    resolved_color_cache_t &cache = s_resolved_colors;
+    const uint64_t env_generation = env_get_generation();
+    const color_support_t color_support = output_get_color_support();
+    if (cache.env_generation != env_generation || cache.color_support != color_support) {
+        cache.colors.clear();
+        cache.env_generation = env_generation;
+        cache.color_support = color_support;
+    }
+
+    const uint64_t key = (static_cast<uint64_t>(highlight) << 1) | is_background;
+    auto iter = cache.colors.find(key);
+    if (iter != cache.colors.end()) return iter->second;
+    rgb_color_t result = resolve_highlight_color(highlight, is_background);
+    cache.colors.emplace(key, result);
+    return result;
+}
+
+static rgb_color_t resolve_highlight_color(highlight_spec_t highlight, bool is_background) {
     rgb_color_t result = rgb_color_t::normal();
 
     // If sloppy_background is set, then we look at the foreground color even if is_background is
@@ -338,56 +396,59 @@ static bool autosuggest_parse_command(const wcstring &buff, wcstring *out_expand
     return false;
 }
 
-bool autosuggest_validate_from_history(const history_item_t &item,
-                                       const wcstring &working_directory,
-                                       const env_vars_snapshot_t &vars) {
-    ASSERT_IS_BACKGROUND_THREAD();
-
-    bool handled = false, suggestionOK = false;
+autosuggest_hint_t autosuggest_hint_from_history(const history_item_t &item) {
+    autosuggest_hint_t hint;
 
     // Parse the string.
-    wcstring parsed_command;
     parse_node_t last_arg_node(token_type_invalid);
-    if (!autosuggest_parse_command(item.str(), &parsed_command, &last_arg_node)) return false;
+    if (!autosuggest_parse_command(item.str(), &hint.command, &last_arg_node)) return hint;
+    hint.has_command = true;
 
-    if (parsed_command == L"cd" && last_arg_node.type == symbol_argument &&
+    if (hint.command == L"cd" && last_arg_node.type == symbol_argument &&
         last_arg_node.has_source()) {
         // We can possibly handle this specially.
         wcstring dir = last_arg_node.get_source(item.str());
         if (expand_one(dir, EXPAND_SKIP_CMDSUBST)) {
-            handled = true;
-            bool is_help =
-                string_prefixes_string(dir, L"--help") || string_prefixes_string(dir, L"-h");
-            if (!is_help) {
-                wcstring path;
-                env_var_t dir_var(L"n/a", dir);
-                bool can_cd = path_get_cdpath(dir_var, &path, working_directory.c_str(), vars);
-                if (can_cd && !paths_are_same_file(working_directory, path)) {
-                    suggestionOK = true;
-                }
-            }
+            hint.is_cd = true;
+            hint.cd_dir = std::move(dir);
+            return hint;
         }
     }
 
-    if (handled) {
-        return suggestionOK;
+    hint.required_paths = item.get_required_paths();
+    return hint;
+}
+
+bool autosuggest_validate_hint(const autosuggest_hint_t &hint, const wcstring &working_directory,
+                               const env_vars_snapshot_t &vars) {
+    ASSERT_IS_BACKGROUND_THREAD();
+    if (!hint.has_command) return false;
+
+    if (hint.is_cd) {
+        const wcstring &dir = hint.cd_dir;
+        bool is_help = string_prefixes_string(dir, L"--help") || string_prefixes_string(dir, L"-h");
+        if (is_help) return false;
+        wcstring path;
+        env_var_t dir_var(L"n/a", dir);
+        bool can_cd = path_get_cdpath(dir_var, &path, working_directory.c_str(), vars, true);
+        return can_cd && !paths_are_same_file(working_directory, path);
     }
 
-    // Not handled specially so handle it here.
     bool cmd_ok = false;
-    if (path_get_path(parsed_command, NULL)) {
+    if (path_get_path(hint.command, NULL)) {
         cmd_ok = true;
-    } else if (builtin_exists(parsed_command) ||
-               function_exists_no_autoload(parsed_command, vars)) {
+    } else if (builtin_exists(hint.command) || function_exists_no_autoload(hint.command, vars)) {
         cmd_ok = true;
     }
 
-    if (cmd_ok) {
-        const path_list_t &paths = item.get_required_paths();
-        suggestionOK = all_paths_are_valid(paths, working_directory);
-    }
+    return cmd_ok && all_paths_are_valid(hint.required_paths, working_directory);
+}
 
-    return suggestionOK;
+bool autosuggest_validate_from_history(const history_item_t &item,
+                                       const wcstring &working_directory,
+                                       const env_vars_snapshot_t &vars) {
+    ASSERT_IS_BACKGROUND_THREAD();
+    return autosuggest_validate_hint(autosuggest_hint_from_history(item), working_directory, vars);
 }
 
 // Highlights the variable starting with 'in', setting colors within the 'colors' array. Returns the
@@ -656,6 +717,35 @@ static void color_argument_internal(const wcstring &buffstr,
     }
 }
 
+/// The last command line we highlighted and its parse tree.
+struct highlight_parse_t {
+    wcstring src;
+    std::shared_ptr<const parse_node_tree_t> tree;
+};
+static owning_lock<highlight_parse_t> s_last_highlight_parse;
+
+/// Parse src for highlighting. As the user types, most of a long command line is unchanged from
+/// the last time it was highlighted, so we only reparse it from the first changed job onwards.
+static void parse_for_highlighting(const wcstring &src, parse_node_tree_t *tree) {
+    const parse_tree_flags_t flags = parse_flag_continue_after_error | parse_flag_include_comments;
+    highlight_parse_t prev;
+    {
+        auto &&last = s_last_highlight_parse.acquire();
+        prev = last.value;
+    }
+    if (prev.tree) {
+        parse_tree_from_string_reusing(src, flags, tree, prev.src, *prev.tree);
+    } else {
+        parse_tree_from_string(src, flags, tree, NULL);
+    }
+
+    auto saved = std::make_shared<parse_node_tree_t>();
+    saved->assign(tree->begin(), tree->end());
+    auto &&last = s_last_highlight_parse.acquire();
+    last.value.src = src;
+    last.value.tree = std::move(saved);
+}
+
 /// Syntax highlighter helper.
 class highlighter_t {
     // The string we're highlighting. Note this is a reference memmber variable (to avoid copying)!
@@ -687,6 +777,10 @@ class highlighter_t {
                         highlight_spec_t color);
     // Colors the source range of a node with a given color.
     void color_node(const parse_node_t &node, highlight_spec_t color);
+    // Whether the reader no longer wants these colors, because the text changed while they were
+    // being computed in the background. The I/O is what makes highlighting slow, so only
+    // highlighting with I/O checks this.
+    bool is_stale() const { return io_ok && !is_main_thread() && reader_thread_job_is_stale(); }
 
    public:
     // Constructor
@@ -699,8 +793,7 @@ class highlighter_t {
           working_directory(wd),
           color_array(str.size()) {
         // Parse the tree.
-        parse_tree_from_string(buff, parse_flag_continue_after_error | parse_flag_include_comments,
-                               &this->parse_tree, NULL);
+        parse_for_highlighting(buff, &this->parse_tree);
     }
 
     // Perform highlighting, returning an array of colors.
@@ -818,7 +911,7 @@ void highlighter_t::color_arguments(const parse_node_t &list_node) {
     const parse_node_tree_t::parse_node_list_t nodes =
         this->parse_tree.find_nodes(list_node, symbol_argument);
 
-    for (size_t i = 0; i < nodes.size(); i++) {
+    for (size_t i = 0; i < nodes.size() && !this->is_stale(); i++) {
         const parse_node_t *child = nodes.at(i);
         assert(child != NULL && child->type == symbol_argument);
         this->color_argument(*child);
@@ -1016,7 +1109,7 @@ static bool command_is_valid(const wcstring &cmd, enum parse_statement_decoratio
 
     // Implicit cd
     if (!is_valid && implicit_cd_ok) {
-        is_valid = path_can_be_implicit_cd(cmd, NULL, working_directory.c_str(), vars);
+        is_valid = path_can_be_implicit_cd(cmd, NULL, working_directory.c_str(), vars, true);
     }
 
     // Return what we got.
@@ -1046,6 +1139,7 @@ const highlighter_t::color_array_t &highlighter_t::highlight() {
     for (parse_node_tree_t::const_iterator iter = parse_tree.begin(); iter != parse_tree.end();
          ++iter) {
         const parse_node_t &node = *iter;
+        if (this->is_stale()) return color_array;
 
         switch (node.type) {
             // Color direct string descendants, e.g. 'for' and 'in'.
@@ -1149,7 +1243,7 @@ const highlighter_t::color_array_t &highlighter_t::highlight() {
         }
     }
 
-    if (!this->io_ok || this->cursor_pos > this->buff.size()) {
+    if (!this->io_ok || this->cursor_pos > this->buff.size() || this->is_stale()) {
         return color_array;
     }
 
@@ -111,6 +111,28 @@ bool autosuggest_validate_from_history(const history_item_t &item,
                                        const wcstring &working_directory,
                                        const env_vars_snapshot_t &vars);
 
+/// What autosuggest_validate_from_history needs to know about a history item, worked out without
+/// touching the filesystem so it can be kept and used again.
+struct autosuggest_hint_t {
+    /// Whether the item has a command at all. Items without one are never suggested.
+    bool has_command = false;
+    /// The expanded command.
+    wcstring command;
+    /// Whether the item is a cd, which is validated by whether it could change to cd_dir.
+    bool is_cd = false;
+    /// The expanded argument of a cd.
+    wcstring cd_dir;
+    /// The paths the item needs to exist.
+    wcstring_list_t required_paths;
+};
+
+/// Work out the hint for a history item.
+autosuggest_hint_t autosuggest_hint_from_history(const history_item_t &item);
+
+/// Whether an item with the given hint ought to be suggested. This does I/O!
+bool autosuggest_validate_hint(const autosuggest_hint_t &hint, const wcstring &working_directory,
+                               const env_vars_snapshot_t &vars);
+
 // Tests whether the specified string cpath is the prefix of anything we could cd to. directories is
 // a list of possible parent directories (typically either the working directory, or the cdpath).
 // This does I/O!
@@ -126,4 +148,12 @@ typedef unsigned int path_flags_t;
 bool is_potential_path(const wcstring &const_path, const wcstring_list_t &directories,
                        path_flags_t flags);
 
+/// Forget the results of earlier path probes. Called after running a command, which may have
+/// changed the working directory or the files the probes looked at.
+void highlight_forget_path_probes();
+
+/// Returns the counters of the cache of path probes.
+struct lru_cache_stats_t;
+lru_cache_stats_t highlight_path_probe_stats();
+
 #endif
@@ -17,6 +17,9 @@
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <algorithm>
 #include <atomic>
@@ -25,6 +28,7 @@
 #include <iterator>
 #include <map>
 #include <numeric>
+#include <thread>
 #include <type_traits>
 #include <unordered_set>
 
@@ -40,6 +44,7 @@
 #include "parse_util.h"
 #include "path.h"
 #include "reader.h"
+#include "trace.h"
 #include "wildcard.h"  // IWYU pragma: keep
 #include "wutil.h"  // IWYU pragma: keep
 
@@ -53,6 +58,29 @@
 //
 //   Newlines are replaced by \n. Backslashes are replaced by \\.
 
+// A history file may also be compressed, if fish_history_compression is set when it is rewritten.
+// It is then a sequence of blocks, each holding whole items in the format above, compressed with
+// zlib. Each block starts with a header of HISTORY_BLOCK_HEADER_SIZE bytes: HISTORY_BLOCK_MAGIC,
+// then the compressed and the uncompressed length of the block as 32-bit little-endian integers.
+// Rewriting the file puts about HISTORY_OUTPUT_BUFFER_SIZE bytes of items in each block, while
+// appending adds a block with just the new items. A compressed file is decompressed when it is
+// mapped, so item offsets, including those in the index files, are offsets into the plain text.
+#define HISTORY_BLOCK_MAGIC "fishhz1"
+#define HISTORY_BLOCK_HEADER_SIZE 16
+
+// A block claiming to be larger than this when uncompressed is taken to be damaged.
+#define HISTORY_BLOCK_MAX_LENGTH (64 * 1024 * 1024)
+
+// The compression level for items appended to a compressed file when fish_history_compression
+// is not set.
+#define HISTORY_DEFAULT_COMPRESSION_LEVEL 6
+
+#ifdef HAVE_ZLIB
+static constexpr bool history_compression_available = true;
+#else
+static constexpr bool history_compression_available = false;
+#endif
+
 // This is the history session ID we use by default if the user has not set env var fish_history.
 #define DFLT_FISH_HISTORY_SESSION_ID L"fish"
 
@@ -70,6 +98,149 @@ static constexpr int history_file_mode = 0644;
 // the file and taking the lock
 static constexpr int max_save_tries = 1024;
 
+// How many times a background vacuum retries when the file changes underneath it. Giving up is
+// harmless; the next vacuum will try again.
+static constexpr int max_background_vacuum_tries = 8;
+
+static void put_little_endian_32(char *where, uint32_t value) {
+    for (int i = 0; i < 4; i++) where[i] = (char)(value >> (8 * i));
+}
+
+static uint32_t get_little_endian_32(const char *where) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)(unsigned char)where[i] << (8 * i);
+    return value;
+}
+
+/// Returns whether the given data is the start of a compressed history file.
+static bool history_data_is_compressed(const char *data, size_t len) {
+    return len >= HISTORY_BLOCK_HEADER_SIZE &&
+           !memcmp(data, HISTORY_BLOCK_MAGIC, sizeof HISTORY_BLOCK_MAGIC);
+}
+
+/// Returns whether the history file open at fd is compressed.
+static bool history_fd_is_compressed(int fd) {
+    char header[HISTORY_BLOCK_HEADER_SIZE];
+    return pread(fd, header, sizeof header, 0) == (ssize_t)sizeof header &&
+           history_data_is_compressed(header, sizeof header);
+}
+
+/// Compress the given items into a block appended to out. Returns false on failure.
+static bool compress_history_block(const char *data, size_t len, int level, std::vector<char> *out) {
+#ifdef HAVE_ZLIB
+    uLongf compressed_len = compressBound(len);
+    const size_t header_pos = out->size();
+    out->resize(header_pos + HISTORY_BLOCK_HEADER_SIZE + compressed_len);
+    char *header = &out->at(header_pos);
+    if (len > HISTORY_BLOCK_MAX_LENGTH ||
+        compress2((Bytef *)header + HISTORY_BLOCK_HEADER_SIZE, &compressed_len, (const Bytef *)data,
+                  len, level) != Z_OK) {
+        out->resize(header_pos);
+        return false;
+    }
+    memcpy(header, HISTORY_BLOCK_MAGIC, sizeof HISTORY_BLOCK_MAGIC);
+    put_little_endian_32(header + 8, (uint32_t)compressed_len);
+    put_little_endian_32(header + 12, (uint32_t)len);
+    out->resize(header_pos + HISTORY_BLOCK_HEADER_SIZE + compressed_len);
+    return true;
+#else
+    UNUSED(data);
+    UNUSED(len);
+    UNUSED(level);
+    UNUSED(out);
+    return false;
+#endif
+}
+
+/// Returns the position of the first block header at or after pos, or len if there is none.
+static size_t find_history_block(const char *data, size_t len, size_t pos) {
+    while (pos < len) {
+        const char *found = (const char *)memchr(data + pos, HISTORY_BLOCK_MAGIC[0], len - pos);
+        if (found == NULL) break;
+        pos = found - data;
+        if (history_data_is_compressed(found, len - pos)) return pos;
+        pos++;
+    }
+    return len;
+}
+
+/// Decompress the blocks of compressed history data into new anonymous memory, after a copy of the
+/// given prefix, which is what was decompressed from the start of the same file before. Damaged
+/// data, such as a block whose writer was interrupted, is skipped up to the next block. Like an
+/// item without a newline in a plain file, an incomplete last block is ignored, since it may still
+/// be being written. Returns the memory and its length, and the number of bytes of data up to the
+/// end of the last block used. Returns false if the result would be empty.
+static bool decompress_history_blocks(const char *prefix, size_t prefix_len, const char *data,
+                                      size_t data_len, const char **out_start, size_t *out_len,
+                                      size_t *out_data_used) {
+#ifdef HAVE_ZLIB
+    // Find the complete blocks, to know how much memory we need.
+    std::vector<size_t> blocks;
+    size_t total = prefix_len;
+    size_t pos = 0;
+    while ((pos = find_history_block(data, data_len, pos)) < data_len) {
+        // Blocks follow each other directly, so a block that doesn't end where the data or the
+        // next block starts has been cut off.
+        const size_t compressed_len = get_little_endian_32(data + pos + 8);
+        const size_t plain_len = get_little_endian_32(data + pos + 12);
+        const size_t end = pos + HISTORY_BLOCK_HEADER_SIZE + compressed_len;
+        if (plain_len > HISTORY_BLOCK_MAX_LENGTH ||
+            compressed_len > data_len - pos - HISTORY_BLOCK_HEADER_SIZE ||
+            (end < data_len && !history_data_is_compressed(data + end, data_len - end))) {
+            pos++;
+            continue;
+        }
+        blocks.push_back(pos);
+        total += plain_len;
+        pos += HISTORY_BLOCK_HEADER_SIZE + compressed_len;
+    }
+    if (total == 0) return false;
+
+    char *start = (char *)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (start == MAP_FAILED) return false;
+    if (prefix_len > 0) memcpy(start, prefix, prefix_len);
+    size_t length = prefix_len;
+    size_t used = 0;
+    for (size_t block : blocks) {
+        const uLong compressed_len = get_little_endian_32(data + block + 8);
+        uLongf plain_len = get_little_endian_32(data + block + 12);
+        const uLongf expected_len = plain_len;
+        if (uncompress((Bytef *)start + length, &plain_len,
+                       (const Bytef *)data + block + HISTORY_BLOCK_HEADER_SIZE,
+                       compressed_len) != Z_OK ||
+            plain_len != expected_len) {
+            debug(2, L"Ignoring damaged block in compressed history file");
+            continue;
+        }
+        length += plain_len;
+        used = block + HISTORY_BLOCK_HEADER_SIZE + compressed_len;
+    }
+
+    // Give back the pages we did not fill.
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t kept = length == 0 ? 0 : (length + page_size - 1) / page_size * page_size;
+    const size_t mapped = (total + page_size - 1) / page_size * page_size;
+    if (kept < mapped) munmap(start + kept, mapped - kept);
+    if (length == 0) return false;
+    mprotect(start, length, PROT_READ);
+
+    *out_start = start;
+    *out_len = length;
+    *out_data_used = used;
+    return true;
+#else
+    UNUSED(prefix);
+    UNUSED(prefix_len);
+    UNUSED(data);
+    UNUSED(data_len);
+    UNUSED(out_start);
+    UNUSED(out_len);
+    UNUSED(out_data_used);
+    debug(1, L"The history file is compressed, but fish was built without zlib");
+    return false;
+#endif
+}
+
 namespace {
 
 /// Helper class for certain output. This is basically a string that allows us to ensure we only
@@ -78,6 +249,8 @@ namespace {
 static size_t safe_strlen(const char *s) { return s ? strlen(s) : 0; }
 class history_output_buffer_t {
     std::vector<char> buffer;
+    // The level to compress each flush into a block with, or -1 to write plain text.
+    int compression_level = -1;
 
    public:
     /// Add a bit more to HISTORY_OUTPUT_BUFFER_SIZE because we flush once we've exceeded that size.
@@ -103,16 +276,33 @@ class history_output_buffer_t {
         }
     }
 
+    /// Compress each flush to an fd into a block of a compressed history file.
+    void compress_blocks(int level) { compression_level = level; }
+
     /// Output to a given fd, resetting our buffer. Returns true on success, false on error.
     bool flush_to_fd(int fd) {
         if (buffer.empty()) {
             return true;
         }
-        bool result = write_loop(fd, &buffer.at(0), buffer.size()) >= 0;
+        bool result;
+        if (compression_level >= 0) {
+            std::vector<char> block;
+            result = compress_history_block(&buffer.at(0), buffer.size(), compression_level,
+                                            &block) &&
+                     write_loop(fd, &block.at(0), block.size()) >= 0;
+        } else {
+            result = write_loop(fd, &buffer.at(0), buffer.size()) >= 0;
+        }
         buffer.clear();
         return result;
     }
 
+    /// Output to a given stream, resetting our buffer.
+    void flush_to_stream(output_stream_t &out) {
+        if (!buffer.empty()) out.append_narrow(&buffer.at(0), buffer.size());
+        buffer.clear();
+    }
+
     /// Return how much data we've accumulated.
     size_t output_size() const { return buffer.size(); }
 };
@@ -192,6 +382,16 @@ class history_lru_cache_t : public lru_cache_t<history_lru_cache_t, history_lru_
     }
 };
 
+/// LRU cache of the candidate positions found by the trigram index for recent search terms, so
+/// that stepping through the matches of a search doesn't intersect posting lists every time.
+class history_candidate_cache_t
+    : public lru_cache_t<history_candidate_cache_t, std::vector<uint32_t>> {
+    typedef lru_cache_t<history_candidate_cache_t, std::vector<uint32_t>> super;
+
+   public:
+    using super::super;
+};
+
 // The set of histories
 // Note that histories are currently immortal
 class history_collection_t {
@@ -204,6 +404,62 @@ class history_collection_t {
 
 }  // anonymous namespace
 
+size_t history_memory_limit = HISTORY_MEMORY_LIMIT;
+
+int history_compression_level = 0;
+
+/// Approximate number of bytes of memory used by a history item.
+static size_t history_item_memory(const history_item_t &item) {
+    size_t result = sizeof item - sizeof(utf8_string_t) + item.str_memory();
+    for (const wcstring &path : item.get_required_paths()) {
+        result += sizeof path + path.size() * sizeof(wchar_t);
+    }
+    return result;
+}
+
+/// LRU cache of decoded old items, keyed by their offset in the history file. This keeps the
+/// items we are looking at (while stepping through a search, say) from being decoded over and over,
+/// while letting the least recently used ones go once they take up more than our memory limit;
+/// they can always be decoded again from the mmap'd file.
+class history_decoded_item_cache_t
+    : public lru_cache_t<history_decoded_item_cache_t, history_item_t> {
+    typedef lru_cache_t<history_decoded_item_cache_t, history_item_t> super;
+
+    // Approximate bytes used by the cached items.
+    size_t bytes = 0;
+
+    static size_t entry_memory(const wcstring &key, const history_item_t &item) {
+        return key.size() * sizeof(wchar_t) + history_item_memory(item);
+    }
+
+   public:
+    // The count limit is only a backstop; the memory limit is what normally evicts items.
+    history_decoded_item_cache_t() : super(64 * 1024) {}
+
+    // CRTP override
+    void entry_was_evicted(wcstring key, history_item_t item) {
+        bytes -= entry_memory(key, item);
+    }
+
+    size_t memory() const { return bytes; }
+
+    /// Add an item decoded from the given offset, then evict items until we are under the limit.
+    void add(size_t offset, const history_item_t &item, size_t limit) {
+        wcstring key = to_string(static_cast<long>(offset));
+        size_t item_bytes = entry_memory(key, item);
+        if (this->insert(std::move(key), item)) bytes += item_bytes;
+        trim(limit);
+    }
+
+    /// Evict the least recently used items until we use no more than the given number of bytes.
+    void trim(size_t limit) {
+        while (bytes > limit && this->size() > 0) {
+            wcstring key = (*this->begin()).first;
+            this->evict_node(key);
+        }
+    }
+};
+
 static history_collection_t histories;
 
 static wcstring history_filename(const wcstring &name, const wcstring &suffix);
@@ -416,6 +672,62 @@ done:
     return result;
 }
 
+/// Locate the escaped command of a fish 2.0 item without decoding it. The command points into the
+/// given data, which is that of the history file starting at the item. Returns false if the item
+/// is malformed.
+static bool raw_command_of_item_fish_2_0(const char *base, size_t len, const char **out_cmd,
+                                         size_t *out_cmd_len) {
+    const char *end = base + len;
+    const char *cursor = base;
+    while (cursor < end && *cursor == ' ') cursor++;
+
+    const char *const cmd_key = "- cmd:";
+    const size_t cmd_key_len = strlen(cmd_key);
+    if ((size_t)(end - cursor) < cmd_key_len || memcmp(cursor, cmd_key, cmd_key_len)) return false;
+    cursor += cmd_key_len;
+    // Skip a space after the : if necessary.
+    if (cursor < end && *cursor == ' ') cursor++;
+
+    const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+    *out_cmd = cursor;
+    *out_cmd_len = (newline ? newline : end) - cursor;
+    return true;
+}
+
+/// Returns false if an escaped command definitely does not match the escaped, narrow search term.
+/// Since escaping maps each character independently, a command that matches the term contains it
+/// in escaped form; the converse does not hold, so a true return only means the item is worth
+/// decoding. A case insensitive search must pass a lowercased term; those are judged only if both
+/// the term and the command are ASCII.
+static bool raw_command_may_match(const char *cmd, size_t cmd_len, const std::string &raw_term,
+                                  history_search_type_t type, bool case_sensitive) {
+    if (raw_term.empty()) return true;
+    auto is_ascii = [](char c) { return (unsigned char)c < 0x80; };
+    auto same_char = [case_sensitive](char a, char b) {
+        return a == b || (!case_sensitive && tolower((unsigned char)a) == b);
+    };
+    if (!case_sensitive && (!std::all_of(raw_term.begin(), raw_term.end(), is_ascii) ||
+                            !std::all_of(cmd, cmd + cmd_len, is_ascii))) {
+        return true;
+    }
+
+    switch (type) {
+        case HISTORY_SEARCH_TYPE_EXACT: {
+            return cmd_len == raw_term.size() &&
+                   std::equal(cmd, cmd + cmd_len, raw_term.begin(), same_char);
+        }
+        case HISTORY_SEARCH_TYPE_PREFIX: {
+            return cmd_len >= raw_term.size() &&
+                   std::equal(raw_term.begin(), raw_term.end(), cmd, same_char);
+        }
+        case HISTORY_SEARCH_TYPE_CONTAINS: {
+            return std::search(cmd, cmd + cmd_len, raw_term.begin(), raw_term.end(), same_char) !=
+                   cmd + cmd_len;
+        }
+        default: { return true; }
+    }
+}
+
 static history_item_t decode_item(const char *base, size_t len, history_file_type_t type) {
     if (type == history_type_fish_2_0) return decode_item_fish_2_0(base, len);
     if (type == history_type_fish_1_x) return decode_item_fish_1_x(base, len);
@@ -439,26 +751,24 @@ bool history_item_t::merge(const history_item_t &item) {
     return result;
 }
 
-#if 0
-history_item_t::history_item_t(const wcstring &str)
-    : contents(str), contents_lower(L""), creation_timestamp(time(NULL)), identifier(0) {
-        for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-                contents_lower.push_back(towlower(*it));
-        }
-    }
-#endif
-
 history_item_t::history_item_t(const wcstring &str, time_t when, history_identifier_t ident)
-    : contents(str), contents_lower(L""), creation_timestamp(when), identifier(ident) {
-    for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-        contents_lower.push_back(towlower(*it));
-    }
+    : contents(str), creation_timestamp(when), identifier(ident) {}
+
+wcstring history_item_t::str_lower() const {
+    wcstring result = contents.str();
+    for (wchar_t &c : result) c = towlower(c);
+    return result;
 }
 
-bool history_item_t::matches_search(const wcstring &term, enum history_search_type_t type,
-                                    bool case_sensitive) const {
+bool history_item_t::contents_match_search(const wcstring &contents, const wcstring &term,
+                                           enum history_search_type_t type, bool case_sensitive) {
     // Note that this->term has already been lowercased when constructing the
     // search object if we're doing a case insensitive search.
+    wcstring contents_lower;
+    if (!case_sensitive) {
+        contents_lower = contents;
+        for (wchar_t &c : contents_lower) c = towlower(c);
+    }
     const wcstring &content_to_match = case_sensitive ? contents : contents_lower;
 
     switch (type) {
@@ -573,9 +883,11 @@ static const char *next_line(const char *start, size_t length) {
 /// Pass the address and length of a mapped region.
 /// Pass a pointer to a cursor size_t, initially 0.
 /// If custoff_timestamp is nonzero, skip items created at or after that timestamp.
+/// If out_timestamp is not NULL, it receives the timestamp of the returned item, or 0 if it has none.
 /// Returns (size_t)-1 when done.
 static size_t offset_of_next_item_fish_2_0(const char *begin, size_t mmap_length,
-                                           size_t *inout_cursor, time_t cutoff_timestamp) {
+                                           size_t *inout_cursor, time_t cutoff_timestamp,
+                                           time_t *out_timestamp = NULL) {
     size_t cursor = *inout_cursor;
     size_t result = (size_t)-1;
     while (cursor < mmap_length) {
@@ -620,8 +932,8 @@ static size_t offset_of_next_item_fish_2_0(const char *begin, size_t mmap_length
 
         // At this point, we know line_start is at the beginning of an item. But maybe we want to
         // skip this item because of timestamps. A 0 cutoff means we don't care; if we do care, then
-        // try parsing out a timestamp.
-        if (cutoff_timestamp != 0) {
+        // try parsing out a timestamp. We also parse it if the caller wants to know it.
+        if (cutoff_timestamp != 0 || out_timestamp != NULL) {
             // Hackish fast way to skip items created after our timestamp. This is the mechanism by
             // which we avoid "seeing" commands from other sessions that started after we started.
             // We try hard to ensure that our items are sorted by their timestamps, so in theory we
@@ -650,9 +962,10 @@ static size_t offset_of_next_item_fish_2_0(const char *begin, size_t mmap_length
             }
 
             // Skip this item if the timestamp is past our cutoff.
-            if (has_timestamp && timestamp > cutoff_timestamp) {
+            if (cutoff_timestamp != 0 && has_timestamp && timestamp > cutoff_timestamp) {
                 continue;
             }
+            if (out_timestamp != NULL) *out_timestamp = has_timestamp ? timestamp : 0;
         }
 
         // We made it through the gauntlet.
@@ -711,6 +1024,474 @@ static size_t offset_of_next_item(const char *begin, size_t mmap_length,
     return result;
 }
 
+// The history index is a sidecar file next to a fish 2.0 history file, which records the offsets
+// and timestamps of the items in some prefix of the history file. Reading it lets us skip scanning
+// the YAML of that prefix when we populate old_item_offsets. Since history files are only ever
+// appended to (or replaced wholesale when vacuumed), an index remains valid for a file with the
+// same device and inode, as long as the covered prefix is unchanged; we check the latter by
+// hashing the bytes just before the end of the prefix. A stale or missing index just means we
+// scan the file like we always did.
+//
+// The index is a cache private to this machine, so it is written in native byte order.
+#define HISTORY_INDEX_MAGIC "fishidx"
+#define HISTORY_INDEX_VERSION 1
+
+// Don't bother writing an index for histories with fewer items than this.
+#define HISTORY_INDEX_MIN_ITEMS 1024
+
+// Rewrite an existing index once this many items have been appended past its end.
+#define HISTORY_INDEX_REWRITE_THRESHOLD 256
+
+// How many bytes before the end of the covered prefix we hash to detect a changed file.
+#define HISTORY_INDEX_HASH_LENGTH 256
+
+namespace {
+struct history_index_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t device;
+    uint64_t inode;
+    // The length of the prefix of the history file that the index covers. This is always the
+    // offset of an item.
+    uint64_t covered_length;
+    // Hash of the HISTORY_INDEX_HASH_LENGTH bytes preceding covered_length.
+    uint64_t covered_hash;
+    uint64_t entry_count;
+};
+
+struct history_index_entry_t {
+    uint64_t offset;
+    int64_t timestamp;  // 0 if the item has no timestamp
+};
+}  // anonymous namespace
+
+static int create_temporary_file(const wcstring &name_template, wcstring *out_path);
+
+/// FNV-1a hash of the bytes of the history file just before the end of the covered prefix.
+static uint64_t history_index_hash(const char *base, size_t covered_length) {
+    size_t start = covered_length > HISTORY_INDEX_HASH_LENGTH
+                       ? covered_length - HISTORY_INDEX_HASH_LENGTH
+                       : 0;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = start; i < covered_length; i++) {
+        hash ^= (unsigned char)base[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// Read the index at the given path into entries, validating it against the mapped history file
+/// with the given file ID. Returns the length of the prefix of the history file covered by the
+/// index, or 0 if the index is missing or stale, in which case entries is left empty.
+static size_t read_history_index(const wcstring &path, const char *base, size_t length,
+                                 const file_id_t &file_id,
+                                 std::vector<history_index_entry_t> *entries) {
+    int fd = wopen_cloexec(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    size_t result = 0;
+    history_index_header_t header;
+    if (read_loop(fd, &header, sizeof header) == (ssize_t)sizeof header &&
+        !memcmp(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic) &&
+        header.version == HISTORY_INDEX_VERSION &&
+        header.entry_size == sizeof(history_index_entry_t) &&
+        header.device == (uint64_t)file_id.device && header.inode == (uint64_t)file_id.inode &&
+        header.covered_length > 0 && header.covered_length <= length &&
+        header.entry_count <= header.covered_length &&
+        header.covered_hash == history_index_hash(base, header.covered_length)) {
+        entries->resize(header.entry_count);
+        size_t entries_size = entries->size() * sizeof(history_index_entry_t);
+        if (entries_size > 0 &&
+            read_loop(fd, &entries->at(0), entries_size) == (ssize_t)entries_size &&
+            entries->back().offset < header.covered_length) {
+            result = header.covered_length;
+        } else {
+            entries->clear();
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/// Write an index covering the given entries to the given path. The entries must be the complete
+/// list of items in the file before end_offset, which is the offset of the item following them.
+static void write_history_index(const wcstring &path, const char *base,
+                                const file_id_t &file_id,
+                                const std::vector<history_index_entry_t> &entries,
+                                size_t end_offset) {
+    wcstring tmp_path;
+    int fd = create_temporary_file(path + L".XXXXXX", &tmp_path);
+    if (fd < 0) return;
+
+    history_index_header_t header = {};
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic);
+    header.version = HISTORY_INDEX_VERSION;
+    header.entry_size = sizeof(history_index_entry_t);
+    header.device = (uint64_t)file_id.device;
+    header.inode = (uint64_t)file_id.inode;
+    header.covered_length = end_offset;
+    header.covered_hash = history_index_hash(base, end_offset);
+    header.entry_count = entries.size();
+
+    bool ok = write_loop(fd, (const char *)&header, sizeof header) >= 0 &&
+              write_loop(fd, (const char *)entries.data(),
+                         entries.size() * sizeof(history_index_entry_t)) >= 0;
+    close(fd);
+    if (!ok || wrename(tmp_path, path) == -1) {
+        debug(2, L"Error %d when writing history index", errno);
+        wunlink(tmp_path);
+    }
+}
+
+// Searching history with more items than this is spread across threads.
+#define HISTORY_PARALLEL_SEARCH_MIN_ITEMS (16 * 1024)
+
+// The number of old items each thread claims at a time when searching in parallel.
+#define HISTORY_SEARCH_CHUNK_SIZE 4096
+
+// The maximum number of threads searching history in parallel, including the main thread.
+#define HISTORY_SEARCH_MAX_WORKERS 8
+
+// Startup scans a history file with at least this many bytes past its index on several threads.
+#define HISTORY_PARALLEL_SCAN_MIN_BYTES (4 * 1024 * 1024)
+
+// The number of bytes of the history file each thread claims at a time when scanning in parallel.
+#define HISTORY_SCAN_CHUNK_BYTES (1024 * 1024)
+
+/// Returns how many background threads to scan a large history file with. This is none with a
+/// single processor, where they only add overhead.
+static size_t history_parallel_threads() {
+    static const size_t threads =
+        std::min((size_t)HISTORY_SEARCH_MAX_WORKERS - 1,
+                 (size_t)std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return threads;
+}
+
+// Don't bother building a trigram index for histories with fewer old items than this; scanning
+// them linearly is fast enough.
+#define HISTORY_TRIGRAM_MIN_ITEMS 4096
+
+// How many search terms we remember candidates for.
+#define HISTORY_TRIGRAM_CACHE_SIZE 8
+
+// Rewrite the shared trigram index once this many old items past its end are indexed privately.
+#define HISTORY_TRIGRAM_REWRITE_THRESHOLD 1024
+
+// The shared trigram index is a sidecar file like the history index, holding the trigram index of
+// a prefix of the old items. Shells map it read-only instead of each decoding every item to build
+// the same index, so its pages are shared through the page cache however many shells are running.
+// It is validated like the history index, and also records the offsets of the items it covers:
+// positions in it only mean the same thing to us for the prefix of those that matches our own old
+// items. Later positions are indexed privately, as is everything if the file is missing or stale.
+#define HISTORY_TRIGRAM_FILE_MAGIC "fishtri"
+#define HISTORY_TRIGRAM_FILE_VERSION 1
+
+namespace {
+struct history_trigram_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t covered_length;
+    uint64_t covered_hash;
+    // The header is followed by the offsets of the items covered, the sorted trigrams, the start of
+    // the posting list of each trigram plus the end of the last one, and the posting lists.
+    uint64_t item_count;
+    uint64_t trigram_count;
+    uint64_t position_count;
+};
+}  // anonymous namespace
+
+/// An index from the trigrams of the lowercased contents of old items to the positions of those
+/// items in old_item_offsets. This is used to narrow down the old items which need to be decoded
+/// and compared when searching for a substring. It is built the first time it is needed, and
+/// thrown away whenever old_item_offsets is. A prefix of the positions may be found in a mapped
+/// shared index file, with only the remainder held in memory.
+class history_trigram_index_t {
+    typedef std::vector<uint32_t> position_list_t;
+    typedef std::pair<const uint32_t *, const uint32_t *> position_span_t;
+
+    // Sorted positions of the items containing each trigram, for items not in the shared index.
+    std::unordered_map<uint64_t, position_list_t> postings;
+
+    // Candidates for recent search terms.
+    history_candidate_cache_t candidate_cache;
+
+    // The number of positions in all posting lists, for estimating our memory use.
+    size_t position_count = 0;
+
+    // The mapped shared index file, and the number of positions at the start of old_item_offsets
+    // which it covers.
+    const char *shared_map = NULL;
+    size_t shared_length = 0;
+    size_t shared_count = 0;
+    const uint64_t *shared_trigrams = NULL;
+    const uint64_t *shared_starts = NULL;
+    const uint32_t *shared_positions = NULL;
+    size_t shared_trigram_count = 0;
+
+    static uint64_t trigram_at(const wcstring &str, size_t idx) {
+        const uint64_t mask = 0x1FFFFF;  // 21 bits covers all of Unicode
+        return ((str[idx] & mask) << 42) | ((str[idx + 1] & mask) << 21) | (str[idx + 2] & mask);
+    }
+
+    /// Return the positions below shared_count of the items containing the given trigram in the
+    /// shared index, or an empty span.
+    position_span_t shared_span(uint64_t trigram) const {
+        const uint64_t *end = shared_trigrams + shared_trigram_count;
+        const uint64_t *where = std::lower_bound(shared_trigrams, end, trigram);
+        if (where == end || *where != trigram) return position_span_t(NULL, NULL);
+        size_t idx = where - shared_trigrams;
+        const uint32_t *first = shared_positions + shared_starts[idx];
+        const uint32_t *last = shared_positions + shared_starts[idx + 1];
+        return position_span_t(first, std::lower_bound(first, last, (uint32_t)shared_count));
+    }
+
+    /// Append the intersection of the given sorted spans to result, or nothing if there are none.
+    static void append_intersection(std::vector<position_span_t> spans, position_list_t *result) {
+        if (spans.empty()) return;
+        std::sort(spans.begin(), spans.end(),
+                  [](const position_span_t &a, const position_span_t &b) {
+                      return a.second - a.first < b.second - b.first;
+                  });
+        position_list_t found(spans.front().first, spans.front().second);
+        for (size_t i = 1; i < spans.size() && !found.empty(); i++) {
+            position_list_t intersection;
+            std::set_intersection(found.begin(), found.end(), spans[i].first, spans[i].second,
+                                  std::back_inserter(intersection));
+            found = std::move(intersection);
+        }
+        result->insert(result->end(), found.begin(), found.end());
+    }
+
+   public:
+    history_trigram_index_t() : candidate_cache(HISTORY_TRIGRAM_CACHE_SIZE) {}
+
+    ~history_trigram_index_t() {
+        if (shared_map != NULL) munmap((void *)shared_map, shared_length);
+    }
+
+    /// Whether the index can narrow down a search with the given term and type.
+    static bool can_narrow(const wcstring &term, history_search_type_t type) {
+        if (term.size() < 3) return false;
+        switch (type) {
+            case HISTORY_SEARCH_TYPE_EXACT:
+            case HISTORY_SEARCH_TYPE_CONTAINS:
+            case HISTORY_SEARCH_TYPE_PREFIX: {
+                return true;
+            }
+            default: { return false; }
+        }
+    }
+
+    /// Map the shared index at the given path, validating it against the mapped history file with
+    /// the given file ID and our old items. This must be done before any items are added. Returns
+    /// the number of old items it covers for us, which is 0 if it is missing, stale or useless.
+    size_t map_shared(const wcstring &path, const char *base, size_t length,
+                      const file_id_t &file_id, const std::deque<size_t> &offsets) {
+        assert(shared_map == NULL && postings.empty());
+        int fd = wopen_cloexec(path, O_RDONLY);
+        if (fd < 0) return 0;
+        struct stat buf;
+        const char *map = NULL;
+        size_t map_length = 0;
+        if (fstat(fd, &buf) == 0 && (size_t)buf.st_size >= sizeof(history_trigram_file_header_t)) {
+            map_length = (size_t)buf.st_size;
+            map = (const char *)mmap(0, map_length, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) map = NULL;
+        }
+        close(fd);
+        if (map == NULL) return 0;
+
+        // The header has to describe exactly the rest of the file.
+        history_trigram_file_header_t header;
+        memcpy(&header, map, sizeof header);
+        const uint64_t limit = map_length;
+        bool ok = !memcmp(header.magic, HISTORY_TRIGRAM_FILE_MAGIC, sizeof header.magic) &&
+                  header.version == HISTORY_TRIGRAM_FILE_VERSION &&
+                  header.device == (uint64_t)file_id.device &&
+                  header.inode == (uint64_t)file_id.inode && header.covered_length > 0 &&
+                  header.covered_length <= length && header.item_count <= UINT32_MAX &&
+                  header.trigram_count < limit && header.position_count < limit &&
+                  map_length == sizeof header + sizeof(uint64_t) * header.item_count +
+                                    sizeof(uint64_t) * (2 * header.trigram_count + 1) +
+                                    sizeof(uint32_t) * header.position_count &&
+                  header.covered_hash == history_index_hash(base, header.covered_length);
+        const uint64_t *item_offsets = (const uint64_t *)(map + sizeof header);
+        const uint64_t *trigrams = item_offsets + (ok ? header.item_count : 0);
+        const uint64_t *starts = trigrams + (ok ? header.trigram_count : 0);
+        const uint32_t *positions =
+            (const uint32_t *)(starts + (ok ? header.trigram_count + 1 : 0));
+
+        // Check the posting lists are sorted and in bounds, so we can trust them from here on.
+        ok = ok && starts[0] == 0 && starts[header.trigram_count] == header.position_count;
+        for (uint64_t i = 0; ok && i < header.trigram_count; i++) {
+            ok = (i == 0 || trigrams[i - 1] < trigrams[i]) && starts[i] < starts[i + 1] &&
+                 starts[i + 1] <= header.position_count;
+            for (uint64_t j = starts[i]; ok && j < starts[i + 1]; j++) {
+                ok = positions[j] < header.item_count &&
+                     (j == starts[i] || positions[j - 1] < positions[j]);
+            }
+        }
+
+        // Only the prefix of the items that agrees with our old items is any use to us.
+        size_t count = 0;
+        if (ok) {
+            size_t max_count = std::min((size_t)header.item_count, offsets.size());
+            while (count < max_count && item_offsets[count] == offsets.at(count) &&
+                   item_offsets[count] < header.covered_length) {
+                count++;
+            }
+        }
+        if (count == 0) {
+            munmap((void *)map, map_length);
+            return 0;
+        }
+        shared_map = map;
+        shared_length = map_length;
+        shared_count = count;
+        shared_trigrams = trigrams;
+        shared_starts = starts;
+        shared_positions = positions;
+        shared_trigram_count = header.trigram_count;
+        return count;
+    }
+
+    /// Write a shared index of the items at the first count positions, whose offsets are given, to
+    /// the given path. covered_length is the offset of the item following them in the history file
+    /// with the given file ID and contents. Those items must all have been indexed.
+    bool write_shared(const wcstring &path, const char *base, const file_id_t &file_id,
+                      const std::deque<size_t> &offsets, size_t count,
+                      size_t covered_length) const {
+        assert(count <= offsets.size() && count <= UINT32_MAX);
+        std::vector<uint64_t> trigrams;
+        trigrams.reserve(shared_trigram_count + postings.size());
+        trigrams.insert(trigrams.end(), shared_trigrams, shared_trigrams + shared_trigram_count);
+        for (const auto &kv : postings) trigrams.push_back(kv.first);
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+        // Merge the shared and private posting lists of each trigram, which are for disjoint
+        // ranges of positions, leaving out the positions past count.
+        std::vector<uint64_t> kept_trigrams, starts(1, 0);
+        position_list_t positions;
+        for (uint64_t trigram : trigrams) {
+            position_span_t shared = shared_span(trigram);
+            for (const uint32_t *pos = shared.first; pos != shared.second && *pos < count; pos++) {
+                positions.push_back(*pos);
+            }
+            auto where = postings.find(trigram);
+            if (where != postings.end()) {
+                for (uint32_t pos : where->second) {
+                    if (pos >= count) break;
+                    positions.push_back(pos);
+                }
+            }
+            if (positions.size() > starts.back()) {
+                kept_trigrams.push_back(trigram);
+                starts.push_back(positions.size());
+            }
+        }
+        std::vector<uint64_t> item_offsets(offsets.begin(), offsets.begin() + count);
+
+        wcstring tmp_path;
+        int fd = create_temporary_file(path + L".XXXXXX", &tmp_path);
+        if (fd < 0) return false;
+
+        history_trigram_file_header_t header = {};
+        memcpy(header.magic, HISTORY_TRIGRAM_FILE_MAGIC, sizeof header.magic);
+        header.version = HISTORY_TRIGRAM_FILE_VERSION;
+        header.device = (uint64_t)file_id.device;
+        header.inode = (uint64_t)file_id.inode;
+        header.covered_length = covered_length;
+        header.covered_hash = history_index_hash(base, covered_length);
+        header.item_count = item_offsets.size();
+        header.trigram_count = kept_trigrams.size();
+        header.position_count = positions.size();
+
+        bool ok = write_loop(fd, (const char *)&header, sizeof header) >= 0 &&
+                  write_loop(fd, (const char *)item_offsets.data(),
+                             item_offsets.size() * sizeof(uint64_t)) >= 0 &&
+                  write_loop(fd, (const char *)kept_trigrams.data(),
+                             kept_trigrams.size() * sizeof(uint64_t)) >= 0 &&
+                  write_loop(fd, (const char *)starts.data(), starts.size() * sizeof(uint64_t)) >=
+                      0 &&
+                  write_loop(fd, (const char *)positions.data(),
+                             positions.size() * sizeof(uint32_t)) >= 0;
+        close(fd);
+        if (!ok || wrename(tmp_path, path) == -1) {
+            debug(2, L"Error %d when writing shared history trigram index", errno);
+            wunlink(tmp_path);
+            return false;
+        }
+        return true;
+    }
+
+    /// The number of positions at the start of old_item_offsets found in the shared index.
+    size_t shared_item_count() const { return shared_count; }
+
+    /// Add the item at the given position. Positions must be added in increasing order, after those
+    /// in the shared index.
+    void add_item(uint32_t position, const wcstring &str_lower) {
+        assert(position >= shared_count);
+        // The new item may match terms whose candidates we remembered without it.
+        if (candidate_cache.size() > 0) candidate_cache.evict_all_nodes();
+        for (size_t i = 0; i + 2 < str_lower.size(); i++) {
+            position_list_t &positions = postings[trigram_at(str_lower, i)];
+            if (positions.empty() || positions.back() != position) {
+                positions.push_back(position);
+                position_count++;
+            }
+        }
+    }
+
+    /// Approximate number of bytes of memory used by the index, besides the shared index.
+    size_t memory() const {
+        // Each posting list costs a hash table node besides its positions.
+        const size_t per_list = sizeof(uint64_t) + sizeof(position_list_t) + 2 * sizeof(void *);
+        return postings.size() * per_list + position_count * sizeof(uint32_t);
+    }
+
+    /// The size of the mapped shared index, which is shared with other shells.
+    size_t shared_memory() const { return shared_length; }
+
+    /// Return the sorted positions of the items whose lowercased contents may contain the given
+    /// lowercased term. The term must be at least three characters long.
+    const position_list_t &candidates(const wcstring &term_lower) {
+        const position_list_t *cached = candidate_cache.get(term_lower);
+        if (cached != NULL) return *cached;
+
+        // Collect the posting lists for the term in the shared index and in our own, and intersect
+        // each set; an item is found in only one of them.
+        std::vector<position_span_t> shared_spans, private_spans;
+        bool shared_missing = shared_count == 0, private_missing = false;
+        for (size_t i = 0; i + 2 < term_lower.size(); i++) {
+            const uint64_t trigram = trigram_at(term_lower, i);
+            if (!shared_missing) {
+                position_span_t span = shared_span(trigram);
+                shared_missing = span.first == span.second;
+                shared_spans.push_back(span);
+            }
+            if (!private_missing) {
+                auto where = postings.find(trigram);
+                private_missing = where == postings.end();
+                if (!private_missing) {
+                    const position_list_t &list = where->second;
+                    private_spans.push_back(
+                        position_span_t(list.data(), list.data() + list.size()));
+                }
+            }
+        }
+        position_list_t result;
+        if (!shared_missing) append_intersection(std::move(shared_spans), &result);
+        if (!private_missing) append_intersection(std::move(private_spans), &result);
+        candidate_cache.insert(term_lower, std::move(result));
+        return *candidate_cache.get(term_lower);
+    }
+};
+
 history_t &history_collection_t::get_creating(const wcstring &name) {
     // Return a history for the given name, creating it if necessary
     // Note that histories are currently never deleted, so we can return a reference to them without
@@ -734,13 +1515,21 @@ history_t::history_t(const wcstring &pname)
       disable_automatic_save_counter(0),
       mmap_start(NULL),
       mmap_length(0),
+      mmap_compressed_length(0),
       mmap_type(history_file_type_t(-1)),
       mmap_file_id(kInvalidFileID),
+      mmap_pin_count(0),
       boundary_timestamp(time(NULL)),
       countdown_to_vacuum(-1),
+      last_item_offset((size_t)-1),
+      last_item_timestamp(0),
       loaded_old(false),
+      trigram_index_too_large(false),
+      vacuum_in_progress(false),
       chaos_mode(false) {}
 
+history_t::~history_t() { wait_for_background_vacuum(); }
+
 void history_t::add(const history_item_t &item, bool pending) {
     scoped_lock locker(lock);
 
@@ -784,7 +1573,17 @@ void history_t::save_internal_unless_disabled() {
         vacuum = true;
     }
 
-    // This might be a good candidate for moving to a background thread.
+    // Vacuuming rewrites the entire file, so we would rather do it on a background thread and only
+    // append here. We can't use background threads in a forked child, and don't need to start a
+    // second vacuum while one is running.
+    if (vacuum && is_main_thread() && !is_forked_child()) {
+        vacuum = false;
+        if (!vacuum_in_progress) {
+            vacuum_in_progress = true;
+            iothread_perform([this]() { this->vacuum_in_background(); });
+        }
+    }
+
     time_profiler_t profiler(vacuum ? "save_internal vacuum"       //!OCLINT(unused var)
                                     : "save_internal no vacuum");  //!OCLINT(side-effect)
     this->save_internal(vacuum);
@@ -848,14 +1647,14 @@ void history_t::set_valid_file_paths(const wcstring_list_t &valid_file_paths,
     }
 }
 
-void history_t::get_history(wcstring_list_t &result) {
-    scoped_lock locker(lock);
+void history_t::visit_distinct_items(const std::function<bool(const wcstring &)> &func) {
+    ASSERT_IS_LOCKED(lock);
 
     // If we have a pending item, we skip the first encountered (i.e. last) new item.
     bool next_is_pending = this->has_pending_item;
     std::unordered_set<wcstring> seen;
 
-    // Append new items. Note that in principle we could use const_reverse_iterator, but we do not
+    // Visit new items. Note that in principle we could use const_reverse_iterator, but we do not
     // because reverse_iterator is not convertible to const_reverse_iterator. See
     // https://github.com/fish-shell/fish-shell/issues/431.
     for (history_item_list_t::reverse_iterator iter = new_items.rbegin(); iter < new_items.rend();
@@ -866,10 +1665,10 @@ void history_t::get_history(wcstring_list_t &result) {
             continue;
         }
 
-        if (seen.insert(iter->str()).second) result.push_back(iter->str());
+        if (seen.insert(iter->str()).second && !func(iter->str())) return;
     }
 
-    // Append old items.
+    // Visit old items.
     load_old_if_needed();
     for (std::deque<size_t>::reverse_iterator iter = old_item_offsets.rbegin();
          iter != old_item_offsets.rend(); ++iter) {
@@ -877,10 +1676,30 @@ void history_t::get_history(wcstring_list_t &result) {
         const history_item_t item =
             decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
 
-        if (seen.insert(item.str()).second) result.push_back(item.str());
+        if (seen.insert(item.str()).second && !func(item.str())) return;
     }
 }
 
+void history_t::get_history(wcstring_list_t &result, size_t max_count) {
+    scoped_lock locker(lock);
+    if (max_count == 0) return;
+    visit_distinct_items([&](const wcstring &str) {
+        result.push_back(str);
+        return result.size() < max_count;
+    });
+}
+
+size_t history_t::distinct_size() {
+    scoped_lock locker(lock);
+    size_t count = 0;
+    visit_distinct_items([&](const wcstring &str) {
+        UNUSED(str);
+        count++;
+        return true;
+    });
+    return count;
+}
+
 size_t history_t::size() {
     scoped_lock locker(lock);
     size_t new_item_count = new_items.size();
@@ -916,15 +1735,232 @@ history_item_t history_t::item_at_index(size_t idx) {
     if (idx < old_item_count) {
         // idx == 0 corresponds to last item in old_item_offsets.
         size_t offset = old_item_offsets.at(old_item_count - idx - 1);
-        return decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        return decode_old_item(offset);
     }
 
     // Index past the valid range, so return an empty history item.
     return history_item_t(wcstring(), 0);
 }
 
+history_item_t history_t::decode_old_item(size_t offset) {
+    ASSERT_IS_LOCKED(lock);
+    if (!decoded_items) decoded_items = make_unique<history_decoded_item_cache_t>();
+    const history_item_t *cached = decoded_items->get(to_string(static_cast<long>(offset)));
+    if (cached != NULL) return *cached;
+
+    history_item_t item = decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+    // The trigram index gets the first claim on our memory, since it's the costlier to rebuild.
+    size_t index_bytes = trigram_index ? trigram_index->memory() : 0;
+    size_t limit = history_memory_limit > index_bytes ? history_memory_limit - index_bytes : 0;
+    decoded_items->add(offset, item, limit);
+    return item;
+}
+
+history_memory_stats_t history_t::memory_stats() {
+    scoped_lock locker(lock);
+    load_old_if_needed();
+    history_memory_stats_t stats = {};
+    auto add_text = [&](const history_item_t &item) {
+        stats.item_text_bytes += item.str_memory();
+        stats.item_text_wide_bytes += string_memory(item.str());
+    };
+    stats.new_item_count = new_items.size();
+    for (const history_item_t &item : new_items) {
+        stats.new_item_bytes += history_item_memory(item);
+        add_text(item);
+    }
+    stats.old_item_count = old_item_offsets.size();
+    stats.old_item_offset_bytes = old_item_offsets.size() * sizeof(size_t);
+    if (decoded_items) {
+        stats.decoded_item_count = decoded_items->size();
+        stats.decoded_item_bytes = decoded_items->memory();
+        for (const auto &entry : *decoded_items) add_text(entry.second);
+    }
+    stats.trigram_index_bytes = trigram_index ? trigram_index->memory() : 0;
+    if (trigram_index) {
+        stats.shared_index_item_count = trigram_index->shared_item_count();
+        stats.shared_index_bytes = trigram_index->shared_memory();
+    }
+    stats.limit = history_memory_limit;
+    stats.mmap_bytes = mmap_start != NULL && mmap_start != MAP_FAILED ? mmap_length : 0;
+    return stats;
+}
+
+bool history_t::index_old_items(history_trigram_index_t *index, size_t first) {
+    ASSERT_IS_LOCKED(lock);
+    const size_t old_item_count = old_item_offsets.size();
+    for (size_t i = first; i < old_item_count; i++) {
+        size_t offset = old_item_offsets.at(i);
+        const history_item_t item =
+            decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        index->add_item((uint32_t)i, item.str_lower());
+        if ((i % 1024 == 0 || i + 1 == old_item_count) && index->memory() > history_memory_limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool history_t::build_trigram_index() {
+    ASSERT_IS_LOCKED(lock);
+    time_profiler_t profiler("build trigram index");  //!OCLINT(side-effect)
+    // Only share an index of fish 2.0 files, leaving out the last item, which may be incomplete.
+    const bool can_share = mmap_type == history_type_fish_2_0 && last_item_offset != (size_t)-1;
+    const wcstring shared_path = can_share ? history_filename(name, L".tri") : wcstring();
+
+    // Start from the shared index if there's a valid one, and index the items it lacks ourselves.
+    auto index = make_unique<history_trigram_index_t>();
+    size_t shared_count = 0;
+    if (!shared_path.empty()) {
+        shared_count = index->map_shared(shared_path, mmap_start, mmap_length, mmap_file_id,
+                                         old_item_offsets);
+    }
+    // Give up on the index if it doesn't fit in our memory limit; searches still work without
+    // it, just more slowly.
+    if (!index_old_items(index.get(), shared_count)) {
+        debug(2, L"History trigram index exceeds the memory limit, not building it");
+        trigram_index_too_large = true;
+        return false;
+    }
+
+    // Share what we indexed ourselves if it's worth it, then switch to the shared copy.
+    const size_t share_count =
+        std::lower_bound(old_item_offsets.begin(), old_item_offsets.end(), last_item_offset) -
+        old_item_offsets.begin();
+    if (!shared_path.empty() && share_count >= HISTORY_TRIGRAM_MIN_ITEMS &&
+        share_count > shared_count + (shared_count > 0 ? HISTORY_TRIGRAM_REWRITE_THRESHOLD : 0) &&
+        index->write_shared(shared_path, mmap_start, mmap_file_id, old_item_offsets, share_count,
+                            last_item_offset)) {
+        auto shared_index = make_unique<history_trigram_index_t>();
+        size_t count = shared_index->map_shared(shared_path, mmap_start, mmap_length,
+                                                mmap_file_id, old_item_offsets);
+        if (count > 0 && index_old_items(shared_index.get(), count)) {
+            index = std::move(shared_index);
+        }
+    }
+    trigram_index = std::move(index);
+    if (decoded_items) decoded_items->trim(history_memory_limit - trigram_index->memory());
+    return true;
+}
+
+size_t history_t::next_search_candidate(size_t idx, const wcstring &term,
+                                        history_search_type_t type) {
+    assert(idx > 0);
+    if (!history_trigram_index_t::can_narrow(term, type)) return idx;
+
+    scoped_lock locker(lock);
+    size_t resolved_new_item_count = new_items.size();
+    if (this->has_pending_item && resolved_new_item_count > 0) {
+        resolved_new_item_count -= 1;
+    }
+    // New items are not indexed.
+    if (idx - 1 < resolved_new_item_count) return idx;
+
+    load_old_if_needed();
+    const size_t old_item_count = old_item_offsets.size();
+    const size_t old_idx = idx - 1 - resolved_new_item_count;
+    if (old_item_count < HISTORY_TRIGRAM_MIN_ITEMS || old_idx >= old_item_count) return idx;
+    if (trigram_index_too_large) return idx;
+
+    if (!trigram_index && !this->build_trigram_index()) return idx;
+
+    wcstring term_lower;
+    term_lower.reserve(term.size());
+    for (wchar_t c : term) term_lower.push_back(towlower(c));
+    const std::vector<uint32_t> &candidates = trigram_index->candidates(term_lower);
+
+    // Old indexes run backwards through old_item_offsets, so find the last candidate at or before
+    // the position of our index.
+    const size_t position = old_item_count - old_idx - 1;
+    auto after = std::upper_bound(candidates.begin(), candidates.end(), position);
+    if (after == candidates.begin()) {
+        // No candidates left, so return an index past the end.
+        return resolved_new_item_count + old_item_count + 1;
+    }
+    size_t candidate = *(after - 1);
+    return resolved_new_item_count + (old_item_count - candidate - 1) + 1;
+}
+
+bool history_t::item_at_index_may_match(size_t idx, const std::string &raw_term,
+                                        history_search_type_t type, bool case_sensitive) {
+    scoped_lock locker(lock);
+    assert(idx > 0);
+    idx--;
+
+    size_t resolved_new_item_count = new_items.size();
+    if (this->has_pending_item && resolved_new_item_count > 0) {
+        resolved_new_item_count -= 1;
+    }
+    // New items are already decoded.
+    if (idx < resolved_new_item_count) return true;
+
+    idx -= resolved_new_item_count;
+    load_old_if_needed();
+    size_t old_item_count = old_item_offsets.size();
+    if (idx >= old_item_count || mmap_type != history_type_fish_2_0) return true;
+
+    size_t offset = old_item_offsets.at(old_item_count - idx - 1);
+    const char *cmd;
+    size_t cmd_len;
+    if (!raw_command_of_item_fish_2_0(mmap_start + offset, mmap_length - offset, &cmd,
+                                      &cmd_len)) {
+        return true;
+    }
+    return raw_command_may_match(cmd, cmd_len, raw_term, type, case_sensitive);
+}
+
+/// Append the offsets and timestamps of the items of a fish 2.0 history file starting at cursor to
+/// entries. A large file is split into chunks at lines which start an item, since those never
+/// start with a space, and the chunks are scanned in parallel.
+static void scan_items_fish_2_0(const char *begin, size_t length, size_t cursor,
+                                std::vector<history_index_entry_t> *entries) {
+    std::vector<size_t> chunk_starts = {cursor};
+    if (length - cursor >= HISTORY_PARALLEL_SCAN_MIN_BYTES) {
+        static const char item_line[] = "\n- cmd:";
+        const size_t item_line_len = strlen(item_line);
+        size_t pos = cursor + HISTORY_SCAN_CHUNK_BYTES;
+        while (pos + item_line_len <= length) {
+            const char *newline = (const char *)memchr(begin + pos, '\n', length - pos);
+            if (newline == NULL || (size_t)(begin + length - newline) < item_line_len) break;
+            pos = newline - begin + 1;
+            if (memcmp(newline, item_line, item_line_len) != 0) continue;
+            chunk_starts.push_back(pos);
+            pos += HISTORY_SCAN_CHUNK_BYTES;
+        }
+    }
+
+    // Each chunk ends where the next one starts, right after a newline, so its last item is
+    // complete. The chunk's items are then exactly those a single scan would find there.
+    std::vector<std::vector<history_index_entry_t>> chunk_entries(chunk_starts.size());
+    auto scan_chunk = [&](size_t idx) {
+        size_t chunk_cursor = chunk_starts.at(idx);
+        const size_t chunk_end = idx + 1 < chunk_starts.size() ? chunk_starts.at(idx + 1) : length;
+        for (;;) {
+            time_t when = 0;
+            size_t offset =
+                offset_of_next_item_fish_2_0(begin, chunk_end, &chunk_cursor, 0, &when);
+            // If we get back -1, we're done.
+            if (offset == (size_t)-1) break;
+            chunk_entries.at(idx).push_back({offset, (int64_t)when});
+        }
+    };
+    if (chunk_starts.size() == 1) {
+        scan_chunk(0);
+    } else {
+        iothread_perform_parallel(chunk_starts.size(), history_parallel_threads(), scan_chunk);
+    }
+    for (const std::vector<history_index_entry_t> &chunk : chunk_entries) {
+        entries->insert(entries->end(), chunk.begin(), chunk.end());
+    }
+}
+
 void history_t::populate_from_mmap(void) {
     mmap_type = infer_file_type(mmap_start, mmap_length);
+    if (mmap_type == history_type_fish_2_0) {
+        this->populate_from_mmap_with_index();
+        return;
+    }
+
     size_t cursor = 0;
     for (;;) {
         size_t offset =
@@ -937,7 +1973,48 @@ void history_t::populate_from_mmap(void) {
     }
 }
 
-bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len) const {
+void history_t::populate_from_mmap_with_index() {
+    assert(mmap_type == history_type_fish_2_0);
+    const wcstring index_path = history_filename(name, L".idx");
+
+    // Pick up what we can from the index, then scan whatever follows it.
+    std::vector<history_index_entry_t> entries;
+    size_t cursor = 0;
+    if (!index_path.empty()) {
+        cursor = read_history_index(index_path, mmap_start, mmap_length, mmap_file_id, &entries);
+    }
+    const size_t indexed_count = entries.size();
+    scan_items_fish_2_0(mmap_start, mmap_length, cursor, &entries);
+
+    // Only remember items from before our boundary timestamp as old items. Keep track of the rest
+    // in case the boundary moves.
+    for (const history_index_entry_t &entry : entries) {
+        if (entry.timestamp <= (int64_t)boundary_timestamp) {
+            old_item_offsets.push_back((size_t)entry.offset);
+        } else {
+            items_after_boundary.push_back({(size_t)entry.offset, (time_t)entry.timestamp});
+        }
+    }
+    if (!entries.empty()) {
+        last_item_offset = (size_t)entries.back().offset;
+        last_item_timestamp = (time_t)entries.back().timestamp;
+    }
+
+    // Update the index if it's worth it. The last item is left out, since it may still be
+    // incomplete; it is rescanned next time.
+    const size_t scanned_count = entries.size() - indexed_count;
+    if (!index_path.empty() && entries.size() > HISTORY_INDEX_MIN_ITEMS &&
+        (indexed_count == 0 || scanned_count > HISTORY_INDEX_REWRITE_THRESHOLD)) {
+        size_t end_offset = (size_t)entries.back().offset;
+        entries.pop_back();
+        write_history_index(index_path, mmap_start, mmap_file_id, entries, end_offset);
+    }
+}
+
+/// Map the history file open at fd as it is, compressed or not. Unless take_lock is false, which
+/// simulates failing to take it, a read lock is held while mapping.
+static bool map_history_fd(int fd, bool take_lock, const char **out_map_start,
+                           size_t *out_map_len) {
     if (fd < 0) {
         return false;
     }
@@ -949,11 +2026,10 @@ bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len)
     //
     // We may fail to lock (e.g. on lockless NFS - see issue #685. In that case, we proceed as
     // if it did not fail. The risk is that we may get an incomplete history item; this is
-    // unlikely because we only treat an item as valid if it has a terminating newline.
-    //
-    // Simulate a failing lock in chaos_mode.
+    // unlikely because we only treat an item as valid if it has a terminating newline, and a
+    // compressed block as valid if it is complete.
     bool result = false;
-    if (!chaos_mode) history_file_lock(fd, LOCK_SH);
+    if (take_lock) history_file_lock(fd, LOCK_SH);
     off_t len = lseek(fd, 0, SEEK_END);
     if (len != (off_t)-1) {
         size_t mmap_length = (size_t)len;
@@ -967,14 +2043,51 @@ bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len)
             }
         }
     }
-    if (!chaos_mode) history_file_lock(fd, LOCK_UN);
+    if (take_lock) history_file_lock(fd, LOCK_UN);
+    return result;
+}
+
+bool history_t::map_fd(int fd, const char **out_map_start, size_t *out_map_len,
+                       size_t *out_compressed_length) const {
+    const char *file_start;
+    size_t file_length;
+    // Simulate a failing lock in chaos_mode.
+    if (!map_history_fd(fd, !chaos_mode, &file_start, &file_length)) return false;
+    size_t compressed_length = 0;
+    bool result = true;
+    if (history_data_is_compressed(file_start, file_length)) {
+        result = decompress_history_blocks(NULL, 0, file_start, file_length, out_map_start,
+                                           out_map_len, &compressed_length);
+        munmap((void *)file_start, file_length);
+    } else {
+        *out_map_start = file_start;
+        *out_map_len = file_length;
+    }
+    if (out_compressed_length != NULL) *out_compressed_length = compressed_length;
+    return result;
+}
+
+bool history_t::map_appended_blocks(int fd, const char **out_map_start, size_t *out_map_len,
+                                    size_t *out_compressed_length) const {
+    assert(mmap_compressed_length > 0);
+    const char *file_start;
+    size_t file_length;
+    if (!map_history_fd(fd, !chaos_mode, &file_start, &file_length)) return false;
+    size_t appended_used = 0;
+    bool result = file_length >= mmap_compressed_length &&
+                  decompress_history_blocks(mmap_start, mmap_length,
+                                            file_start + mmap_compressed_length,
+                                            file_length - mmap_compressed_length, out_map_start,
+                                            out_map_len, &appended_used);
+    munmap((void *)file_start, file_length);
+    *out_compressed_length = mmap_compressed_length + appended_used;
     return result;
 }
 
 /// Do a private, read-only map of the entirety of a history file with the given name. Returns true
 /// if successful. Returns the mapped memory region by reference.
 bool history_t::map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
-                         file_id_t *file_id) const {
+                         file_id_t *file_id, size_t *out_compressed_length) const {
     wcstring filename = history_filename(name, L"");
     if (filename.empty()) {
         return false;
@@ -987,17 +2100,118 @@ bool history_t::map_file(const wcstring &name, const char **out_map_start, size_
 
     // Get the file ID if requested.
     if (file_id != NULL) *file_id = file_id_for_fd(fd);
-    bool result = this->map_fd(fd, out_map_start, out_map_len);
+    bool result = this->map_fd(fd, out_map_start, out_map_len, out_compressed_length);
     close(fd);
     return result;
 }
 
+bool history_t::file_was_only_appended(const file_id_t &file_id) const {
+    return mmap_start != NULL && mmap_start != MAP_FAILED && file_id != kInvalidFileID &&
+           file_id.device == mmap_file_id.device && file_id.inode == mmap_file_id.inode &&
+           file_id.size >= (mmap_compressed_length > 0 ? mmap_compressed_length : mmap_length);
+}
+
+bool history_t::follow_appended_items() {
+    ASSERT_IS_LOCKED(lock);
+    if (!loaded_old || mmap_type != history_type_fish_2_0 || last_item_offset == (size_t)-1) {
+        return false;
+    }
+
+    wcstring filename = history_filename(name, L"");
+    if (filename.empty()) return false;
+    int fd = wopen_cloexec(filename, O_RDONLY);
+    if (fd < 0) return false;
+    const file_id_t file_id = file_id_for_fd(fd);
+    const char *new_start = NULL;
+    size_t new_length = 0;
+    size_t new_compressed_length = 0;
+    bool mapped = false;
+    if (file_was_only_appended(file_id)) {
+        // A compressed file stays compressed, so only its new blocks need decompressing.
+        mapped = mmap_compressed_length > 0
+                     ? map_appended_blocks(fd, &new_start, &new_length, &new_compressed_length)
+                     : map_fd(fd, &new_start, &new_length);
+    }
+    close(fd);
+    if (!mapped) return false;
+
+    // Cheaply make sure the data we already know about is still there. We rescan the last item,
+    // since it may have been incomplete.
+    const size_t head_length = std::min(mmap_length, (size_t)HISTORY_INDEX_HASH_LENGTH);
+    if (new_length < mmap_length || memcmp(new_start, mmap_start, head_length) != 0 ||
+        memcmp(new_start + last_item_offset, mmap_start + last_item_offset,
+               mmap_length - last_item_offset) != 0) {
+        munmap((void *)new_start, new_length);
+        return false;
+    }
+    release_mmap(mmap_start, mmap_length);
+    mmap_start = new_start;
+    mmap_length = new_length;
+    mmap_compressed_length = new_compressed_length;
+    mmap_file_id = file_id;
+
+    std::vector<std::pair<size_t, time_t>> appended;
+    size_t cursor = last_item_offset;
+    for (;;) {
+        time_t when = 0;
+        size_t offset = offset_of_next_item_fish_2_0(mmap_start, mmap_length, &cursor, 0, &when);
+        if (offset == (size_t)-1) break;
+        if (offset == last_item_offset) {
+            // If the last item changed, it was incomplete and we filed it wrongly.
+            if (when != last_item_timestamp) return false;
+            continue;
+        }
+        appended.push_back({offset, when});
+    }
+    // The last item may have been cached before it was complete.
+    if (decoded_items) decoded_items->evict_node(to_string(static_cast<long>(last_item_offset)));
+    if (!appended.empty()) {
+        last_item_offset = appended.back().first;
+        last_item_timestamp = appended.back().second;
+    }
+
+    // Split the items we knew to be after the boundary, followed by the appended ones, into those
+    // that are now old and those that are still after it. Both stay in file order.
+    std::vector<std::pair<size_t, time_t>> still_after_boundary;
+    const size_t first_new_position = old_item_offsets.size();
+    bool in_file_order = true;
+    for (const auto *items : {&items_after_boundary, &appended}) {
+        for (const std::pair<size_t, time_t> &item : *items) {
+            if (item.second > boundary_timestamp) {
+                still_after_boundary.push_back(item);
+            } else {
+                if (!old_item_offsets.empty() && old_item_offsets.back() > item.first) {
+                    in_file_order = false;
+                }
+                old_item_offsets.push_back(item.first);
+            }
+        }
+    }
+    items_after_boundary = std::move(still_after_boundary);
+
+    if (!in_file_order) {
+        // Items that were after the boundary are interleaved with old items.
+        std::inplace_merge(old_item_offsets.begin(), old_item_offsets.begin() + first_new_position,
+                           old_item_offsets.end());
+        trigram_index.reset();
+    } else if (trigram_index) {
+        for (size_t i = first_new_position; i < old_item_offsets.size(); i++) {
+            size_t offset = old_item_offsets.at(i);
+            const history_item_t item =
+                decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+            trigram_index->add_item((uint32_t)i, item.str_lower());
+        }
+        if (trigram_index->memory() > history_memory_limit) trigram_index.reset();
+    }
+    return true;
+}
+
 bool history_t::load_old_if_needed(void) {
     if (loaded_old) return true;
     loaded_old = true;
 
     bool ok = false;
-    if (map_file(name, &mmap_start, &mmap_length, &mmap_file_id)) {
+    if (map_file(name, &mmap_start, &mmap_length, &mmap_file_id, &mmap_compressed_length)) {
         // Here we've mapped the file.
         ok = true;
         time_profiler_t profiler("populate_from_mmap");  //!OCLINT(side-effect)
@@ -1036,21 +2250,33 @@ bool history_search_t::go_backwards() {
 
     const bool main_thread = is_main_thread();
 
+    // The term as it appears in the history file, so we can rule out items without decoding them.
+    std::string raw_term = wcs2string(term);
+    escape_yaml(&raw_term);
+
     while (++idx < max_idx) {
         if (main_thread ? reader_interrupted() : reader_thread_job_is_stale()) {
             return false;
         }
 
+        // Skip over items that cannot match.
+        idx = history->next_search_candidate(idx, term, search_type);
+        if (idx >= max_idx) return false;
+        if (!history->item_at_index_may_match(idx, raw_term, search_type, case_sensitive)) {
+            continue;
+        }
+
         const history_item_t item = history->item_at_index(idx);
         // We're done if it's empty or we cancelled.
         if (item.empty()) {
             return false;
         }
 
-        // Look for a term that matches and that we haven't seen before.
-        const wcstring &str = item.str();
-        if (item.matches_search(term, search_type, case_sensitive) && !match_already_made(str) &&
-            !should_skip_match(str)) {
+        // Look for a term that matches and that we haven't seen before. The item is decoded just
+        // once for all of these.
+        const wcstring str = item.str();
+        if (history_item_t::contents_match_search(str, term, search_type, case_sensitive) &&
+            !match_already_made(item) && !should_skip_match(str)) {
             prev_matches.push_back(prev_match_t(idx, item));
             return true;
         }
@@ -1082,10 +2308,10 @@ wcstring history_search_t::current_string() const {
     return item.str();
 }
 
-bool history_search_t::match_already_made(const wcstring &match) const {
+bool history_search_t::match_already_made(const history_item_t &match) const {
     for (std::vector<prev_match_t>::const_iterator iter = prev_matches.begin();
          iter != prev_matches.end(); ++iter) {
-        if (iter->second.str() == match) return true;
+        if (iter->second.same_contents(match)) return true;
     }
     return false;
 }
@@ -1149,16 +2375,46 @@ static wcstring history_filename(const wcstring &session_id, const wcstring &suf
     return result;
 }
 
+void history_t::release_mmap(const char *start, size_t length) {
+    ASSERT_IS_LOCKED(lock);
+    if (mmap_pin_count > 0) {
+        retired_mmaps.push_back(std::make_pair(start, length));
+    } else {
+        munmap((void *)start, length);
+    }
+}
+
+void history_t::pin_mmap() {
+    ASSERT_IS_LOCKED(lock);
+    mmap_pin_count++;
+}
+
+void history_t::unpin_mmap() {
+    ASSERT_IS_LOCKED(lock);
+    assert(mmap_pin_count > 0);
+    if (--mmap_pin_count == 0) {
+        for (const auto &region : retired_mmaps) munmap((void *)region.first, region.second);
+        retired_mmaps.clear();
+    }
+}
+
 void history_t::clear_file_state() {
     ASSERT_IS_LOCKED(lock);
     // Erase everything we know about our file.
     if (mmap_start != NULL && mmap_start != MAP_FAILED) {
-        munmap((void *)mmap_start, mmap_length);
+        release_mmap(mmap_start, mmap_length);
     }
     mmap_start = NULL;
     mmap_length = 0;
+    mmap_compressed_length = 0;
     loaded_old = false;
     old_item_offsets.clear();
+    items_after_boundary.clear();
+    last_item_offset = (size_t)-1;
+    last_item_timestamp = 0;
+    trigram_index.reset();
+    trigram_index_too_large = false;
+    decoded_items.reset();
 }
 
 void history_t::compact_new_items() {
@@ -1168,7 +2424,7 @@ void history_t::compact_new_items() {
     size_t idx = new_items.size();
     while (idx--) {
         const history_item_t &item = new_items[idx];
-        if (!seen.insert(item.contents).second) {
+        if (!seen.insert(item.str()).second) {
             // This item was not inserted because it was already in the set, so delete the item at
             // this index.
             new_items.erase(new_items.begin() + idx);
@@ -1185,10 +2441,9 @@ void history_t::compact_new_items() {
 // Given the fd of an existing history file, or -1 if none, write
 // a new history file to temp_fd. Returns true on success, false
 // on error
-bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
-    // This must be called while locked.
-    ASSERT_IS_LOCKED(lock);
-
+bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd,
+                                          const history_item_list_t &unwritten,
+                                          const std::unordered_set<wcstring> &deleted) const {
     // We are reading FROM existing_fd and writing TO dst_fd
     // dst_fd must be valid; existing_fd does not need to be
     assert(dst_fd >= 0);
@@ -1196,6 +2451,13 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
     // Make an LRU cache to save only the last N elements.
     history_lru_cache_t lru(HISTORY_SAVE_MAX);
 
+    // Rewriting a compressed file we can't read would lose its items.
+    if (!history_compression_available && existing_fd >= 0 && history_fd_is_compressed(existing_fd)) {
+        debug(1, L"Not rewriting the history file, since it is compressed and fish was built "
+                 L"without zlib");
+        return false;
+    }
+
     // Map in existing items (which may have changed out from underneath us, so don't trust our
     // old mmap'd data).
     const char *local_mmap_start = NULL;
@@ -1214,7 +2476,7 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
             const history_item_t old_item =
                 decode_item(local_mmap_start + offset, local_mmap_size - offset, local_mmap_type);
 
-            if (old_item.empty() || deleted_items.count(old_item.str()) > 0) {
+            if (old_item.empty() || deleted.count(old_item.str()) > 0) {
                 // debug(0, L"Item is deleted : %s\n", old_item.str().c_str());
                 continue;
             }
@@ -1225,9 +2487,8 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
     }
 
     // Insert any unwritten new items
-    for (auto iter = new_items.cbegin() + this->first_unwritten_new_item_index;
-         iter != new_items.cend(); ++iter) {
-        lru.add_item(*iter);
+    for (const history_item_t &item : unwritten) {
+        lru.add_item(item);
     }
 
     // Stable-sort our items by timestamp
@@ -1240,6 +2501,9 @@ bool history_t::rewrite_to_temporary_file(int existing_fd, int dst_fd) const {
     // Write them out.
     bool ok = true;
     history_output_buffer_t buffer(HISTORY_OUTPUT_BUFFER_SIZE);
+    if (history_compression_available && history_compression_level > 0) {
+        buffer.compress_blocks(history_compression_level);
+    }
     for (const auto &key_item : lru) {
         const history_lru_item_t &item = key_item.second;
         append_yaml_to_buffer(item.text, item.timestamp, item.required_paths, &buffer);
@@ -1275,6 +2539,58 @@ static int create_temporary_file(const wcstring &name_template, wcstring *out_pa
     return out_fd;
 }
 
+/// Move the rewritten history file at tmp_name into place at target_name, provided the file there
+/// is still the one identified by orig_file_id (or there is no file there, if allow_missing is
+/// set). Returns true if we replaced the file.
+static bool replace_history_file_if_unchanged(const wcstring &tmp_name, int tmp_fd,
+                                              const wcstring &target_name,
+                                              const file_id_t &orig_file_id, bool allow_missing) {
+    // The crux! We rewrote the history file; see if the history file changed while we
+    // were rewriting it. Make an effort to take the lock before checking, to avoid racing.
+    // If the open fails, then proceed; this may be because there is no current history
+    file_id_t new_file_id = kInvalidFileID;
+    int target_fd_after = wopen_cloexec(target_name, O_RDONLY);
+    if (target_fd_after >= 0) {
+        // critical to take the lock before checking file IDs,
+        // and hold it until after we are done replacing
+        // Also critical to check the file at the path, NOT based on our fd
+        // It's only OK to replace the file while holding the lock
+        history_file_lock(target_fd_after, LOCK_EX);
+        new_file_id = file_id_for_path(target_name);
+    }
+    bool can_replace_file =
+        (new_file_id == orig_file_id || (allow_missing && new_file_id == kInvalidFileID));
+    if (can_replace_file) {
+        // The file is unchanged, or the new file doesn't exist or we can't read it
+        // We also attempted to take the lock, so we feel confident in replacing it
+
+        // Ensure we maintain the ownership and permissions of the original (#2355). If the
+        // stat fails, we assume (hope) our default permissions are correct. This
+        // corresponds to e.g. someone running sudo -E as the very first command. If they
+        // did, it would be tricky to set the permissions correctly. (bash doesn't get this
+        // case right either).
+        struct stat sbuf;
+        if (target_fd_after >= 0 && fstat(target_fd_after, &sbuf) >= 0) {
+            if (fchown(tmp_fd, sbuf.st_uid, sbuf.st_gid) == -1) {
+                debug(2, L"Error %d when changing ownership of history file", errno);
+            }
+            if (fchmod(tmp_fd, sbuf.st_mode) == -1) {
+                debug(2, L"Error %d when changing mode of history file", errno);
+            }
+        }
+
+        // Slide it into place
+        if (wrename(tmp_name, target_name) == -1) {
+            debug(2, L"Error %d when renaming history file", errno);
+        }
+    }
+
+    if (target_fd_after >= 0) {
+        close(target_fd_after);
+    }
+    return can_replace_file;
+}
+
 bool history_t::save_internal_via_rewrite() {
     // This must be called while locked.
     ASSERT_IS_LOCKED(lock);
@@ -1297,12 +2613,15 @@ bool history_t::save_internal_via_rewrite() {
         return false;
     }
 
+    const history_item_list_t unwritten(new_items.begin() + first_unwritten_new_item_index,
+                                        new_items.end());
     bool done = false;
     for (int i = 0; i < max_save_tries && !done; i++) {
         // Open any target file, but do not lock it right away
         int target_fd_before = wopen_cloexec(target_name, O_RDONLY | O_CREAT, history_file_mode);
         file_id_t orig_file_id = file_id_for_fd(target_fd_before);  // possibly invalid
-        bool wrote = this->rewrite_to_temporary_file(target_fd_before, tmp_fd);
+        bool wrote =
+            this->rewrite_to_temporary_file(target_fd_before, tmp_fd, unwritten, deleted_items);
         if (target_fd_before >= 0) {
             close(target_fd_before);
         }
@@ -1311,56 +2630,14 @@ bool history_t::save_internal_via_rewrite() {
             break;
         }
 
-        // The crux! We rewrote the history file; see if the history file changed while we
-        // were rewriting it. Make an effort to take the lock before checking, to avoid racing.
-        // If the open fails, then proceed; this may be because there is no current history
-        file_id_t new_file_id = kInvalidFileID;
-        int target_fd_after = wopen_cloexec(target_name, O_RDONLY);
-        if (target_fd_after >= 0) {
-            // critical to take the lock before checking file IDs,
-            // and hold it until after we are done replacing
-            // Also critical to check the file at the path, NOT based on our fd
-            // It's only OK to replace the file while holding the lock
-            history_file_lock(target_fd_after, LOCK_EX);
-            new_file_id = file_id_for_path(target_name);
-        }
-        bool can_replace_file = (new_file_id == orig_file_id || new_file_id == kInvalidFileID);
-        if (!can_replace_file) {
+        done = replace_history_file_if_unchanged(tmp_name, tmp_fd, target_name, orig_file_id,
+                                                 true /* allow_missing */);
+        if (!done) {
             // The file has changed, so we're going to re-read it
             // Truncate our tmp_fd so we can reuse it
             if (ftruncate(tmp_fd, 0) == -1 || lseek(tmp_fd, 0, SEEK_SET) == -1) {
                 debug(2, L"Error %d when truncating temporary history file", errno);
             }
-        } else {
-            // The file is unchanged, or the new file doesn't exist or we can't read it
-            // We also attempted to take the lock, so we feel confident in replacing it
-
-            // Ensure we maintain the ownership and permissions of the original (#2355). If the
-            // stat fails, we assume (hope) our default permissions are correct. This
-            // corresponds to e.g. someone running sudo -E as the very first command. If they
-            // did, it would be tricky to set the permissions correctly. (bash doesn't get this
-            // case right either).
-            struct stat sbuf;
-            if (target_fd_after >= 0 && fstat(target_fd_after, &sbuf) >= 0) {
-                if (fchown(tmp_fd, sbuf.st_uid, sbuf.st_gid) == -1) {
-                    debug(2, L"Error %d when changing ownership of history file", errno);
-                }
-                if (fchmod(tmp_fd, sbuf.st_mode) == -1) {
-                    debug(2, L"Error %d when changing mode of history file", errno);
-                }
-            }
-
-            // Slide it into place
-            if (wrename(tmp_name, target_name) == -1) {
-                debug(2, L"Error %d when renaming history file", errno);
-            }
-
-            // We did it
-            done = true;
-        }
-
-        if (target_fd_after >= 0) {
-            close(target_fd_after);
         }
     }
 
@@ -1383,6 +2660,64 @@ bool history_t::save_internal_via_rewrite() {
     return ok;
 }
 
+void history_t::vacuum_in_background() {
+    ASSERT_IS_BACKGROUND_THREAD();
+    const wcstring target_name = history_filename(name, wcstring());
+    const wcstring tmp_name_template = history_filename(name, L".XXXXXX");
+    wcstring tmp_name;
+    int tmp_fd = -1;
+    if (!target_name.empty() && !tmp_name_template.empty()) {
+        tmp_fd = create_temporary_file(tmp_name_template, &tmp_name);
+    }
+
+    // Unlike save_internal_via_rewrite, we only hold our lock while swapping the new file in, so
+    // the main thread can keep appending while we work. Unwritten items are left for it to append
+    // later; if it appends before we're done, the file changes underneath us and we start over.
+    std::unordered_set<wcstring> deleted;
+    {
+        scoped_lock locker(lock);
+        deleted = deleted_items;
+    }
+    const history_item_list_t unwritten;
+    bool done = false;
+    for (int i = 0; i < max_background_vacuum_tries && tmp_fd >= 0 && !done; i++) {
+        int target_fd_before = wopen_cloexec(target_name, O_RDONLY);
+        if (target_fd_before < 0) {
+            // Nothing to vacuum.
+            break;
+        }
+        file_id_t orig_file_id = file_id_for_fd(target_fd_before);
+        bool wrote = this->rewrite_to_temporary_file(target_fd_before, tmp_fd, unwritten, deleted);
+        close(target_fd_before);
+        if (!wrote) break;
+
+        scoped_lock locker(lock);
+        done = replace_history_file_if_unchanged(tmp_name, tmp_fd, target_name, orig_file_id,
+                                                 false /* allow_missing */);
+        if (done) {
+            // Our mmap'd data is for the old file.
+            this->clear_file_state();
+        } else if (ftruncate(tmp_fd, 0) == -1 || lseek(tmp_fd, 0, SEEK_SET) == -1) {
+            debug(2, L"Error %d when truncating temporary history file", errno);
+            break;
+        }
+    }
+
+    if (tmp_fd >= 0) {
+        wunlink(tmp_name);
+        close(tmp_fd);
+    }
+
+    scoped_lock locker(lock);
+    vacuum_in_progress = false;
+    vacuum_finished.notify_all();
+}
+
+void history_t::wait_for_background_vacuum() {
+    std::unique_lock<std::mutex> locker(lock);
+    vacuum_finished.wait(locker, [this] { return !vacuum_in_progress; });
+}
+
 // Function called to save our unwritten history file by appending to the existing history file
 // Returns true on success, false on failure.
 bool history_t::save_internal_via_appending() {
@@ -1410,7 +2745,7 @@ bool history_t::save_internal_via_appending() {
     // Limit our max tries so we don't do this forever
     int history_fd = -1;
     for (int i = 0; i < max_save_tries; i++) {
-        int fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
+        int fd = wopen_cloexec(history_path, O_RDWR | O_APPEND);
         if (fd < 0) {
             // can't open, we're hosed
             break;
@@ -1430,7 +2765,7 @@ bool history_t::save_internal_via_appending() {
         } else {
             // File IDs match, so the file we opened is still at that path
             // We're going to use this fd
-            if (file_id != this->mmap_file_id) {
+            if (file_id != this->mmap_file_id && !this->file_was_only_appended(file_id)) {
                 file_changed = true;
             }
             history_fd = fd;
@@ -1463,7 +2798,23 @@ bool history_t::save_internal_via_appending() {
         bool errored = false;
         // Use a small buffer size for appending, we usually only have 1 item
         history_output_buffer_t buffer(64);
-        while (first_unwritten_new_item_index < new_items.size()) {
+
+        // A compressed file must stay compressed. An empty one may become compressed right away.
+        const bool compressed =
+            history_fd_is_compressed(history_fd) ||
+            (history_compression_available && history_compression_level > 0 &&
+             file_id_for_fd(history_fd).size == 0);
+        if (compressed) {
+            buffer.compress_blocks(history_compression_level > 0
+                                       ? history_compression_level
+                                       : HISTORY_DEFAULT_COMPRESSION_LEVEL);
+            if (!history_compression_available) {
+                debug(1, L"Not saving history, since the history file is compressed and fish was "
+                         L"built without zlib");
+                errored = true;
+            }
+        }
+        while (!errored && first_unwritten_new_item_index < new_items.size()) {
             const history_item_t &item = new_items.at(first_unwritten_new_item_index);
             append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
             if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE) {
@@ -1512,6 +2863,7 @@ void history_t::save_internal(bool vacuum) {
         this->clear_file_state();
     }
 
+    FISH_TRACE1(history_save_start, new_items.size() - first_unwritten_new_item_index);
     // Compact our new items so we don't have duplicates.
     this->compact_new_items();
 
@@ -1524,8 +2876,9 @@ void history_t::save_internal(bool vacuum) {
     }
     if (!ok) {
         // We did not or could not append; rewrite the file ("vacuum" it).
-        this->save_internal_via_rewrite();
+        ok = this->save_internal_via_rewrite();
     }
+    FISH_TRACE1(history_save_done, ok);
 }
 
 void history_t::save(void) {
@@ -1560,6 +2913,84 @@ static void format_history_record(const history_item_t &item, const wchar_t *sho
     }
 }
 
+history_item_list_t history_t::find_matches_in_parallel(const wcstring &search_string,
+                                                        history_search_type_t search_type,
+                                                        bool case_sensitive) {
+    ASSERT_IS_MAIN_THREAD();
+    wcstring term = search_string;
+    if (!case_sensitive) {
+        std::transform(term.begin(), term.end(), term.begin(), towlower);
+    }
+
+    std::unique_lock<std::mutex> locker(lock);
+    history_item_list_t result;
+
+    // New items are few, so just check them here, most recent first.
+    size_t resolved_new_item_count = new_items.size();
+    if (this->has_pending_item && resolved_new_item_count > 0) {
+        resolved_new_item_count -= 1;
+    }
+    for (size_t i = resolved_new_item_count; i-- > 0;) {
+        const history_item_t &item = new_items.at(i);
+        if (item.matches_search(term, search_type, case_sensitive)) result.push_back(item);
+    }
+
+    // Split the old items into chunks, most recent first, and search them without holding the lock,
+    // so background tasks which need it (like vacuuming) aren't held up. We work on a copy of the
+    // offsets, and pin our mmap'd data so it stays mapped even if the file state changes meanwhile.
+    load_old_if_needed();
+    const std::vector<size_t> offsets(old_item_offsets.begin(), old_item_offsets.end());
+    const char *const start = mmap_start;
+    const size_t length = mmap_length;
+    const history_file_type_t type = mmap_type;
+    pin_mmap();
+    locker.unlock();
+
+    const size_t old_item_count = offsets.size();
+    const size_t chunk_count = (old_item_count + HISTORY_SEARCH_CHUNK_SIZE - 1) /
+                               HISTORY_SEARCH_CHUNK_SIZE;
+    std::vector<history_item_list_t> chunk_matches(chunk_count);
+    std::atomic<bool> cancelled{false};
+
+    // Only the main thread checks for interrupts.
+    iothread_perform_parallel(chunk_count, history_parallel_threads(), [&](size_t chunk) {
+        if (cancelled) return;
+        if (is_main_thread() && reader_interrupted()) {
+            cancelled = true;
+            return;
+        }
+        // Chunk 0 holds the most recent items, at the end of the offsets.
+        size_t end = old_item_count - chunk * HISTORY_SEARCH_CHUNK_SIZE;
+        size_t first = end > HISTORY_SEARCH_CHUNK_SIZE ? end - HISTORY_SEARCH_CHUNK_SIZE : 0;
+        for (size_t i = end; i-- > first;) {
+            size_t offset = offsets.at(i);
+            history_item_t item = decode_item(start + offset, length - offset, type);
+            if (item.matches_search(term, search_type, case_sensitive)) {
+                chunk_matches.at(chunk).push_back(std::move(item));
+            }
+        }
+    });
+
+    locker.lock();
+    unpin_mmap();
+    locker.unlock();
+
+    if (!cancelled) {
+        for (history_item_list_t &matches : chunk_matches) {
+            std::move(matches.begin(), matches.end(), std::back_inserter(result));
+        }
+    }
+
+    // Only keep the most recent item with any given contents.
+    std::unordered_set<wcstring> seen;
+    result.erase(std::remove_if(result.begin(), result.end(),
+                                [&](const history_item_t &item) {
+                                    return !seen.insert(item.str()).second;
+                                }),
+                 result.end());
+    return result;
+}
+
 /// This handles the slightly unusual case of someone searching history for
 /// specific terms/patterns.
 bool history_t::search_with_args(history_search_type_t search_type, wcstring_list_t search_args,
@@ -1570,25 +3001,41 @@ bool history_t::search_with_args(history_search_type_t search_type, wcstring_lis
     size_t hist_size = this->size();
     if (max_items > hist_size) max_items = hist_size;
 
-    for (wcstring_list_t::const_iterator iter = search_args.begin(); iter != search_args.end();
-         ++iter) {
+    // Output one matching item, returning false once we've output as many as we're allowed.
+    auto output_item = [&](const history_item_t &item) {
+        wcstring result;
+        format_history_record(item, show_time_format, null_terminate, result);
+        if (reverse) {
+            results.push_back(result);
+        } else {
+            streams.out.append(result);
+        }
+        return --max_items > 0;
+    };
+
+    for (wcstring_list_t::const_iterator iter = search_args.begin();
+         iter != search_args.end() && max_items > 0; ++iter) {
         const wcstring &search_string = *iter;
         if (search_string.empty()) {
             streams.err.append_format(L"Searching for the empty string isn't allowed");
             return false;
         }
+
+        // Searches the trigram index can't help with have to look at every item, so spread them
+        // across threads when there are a lot of items.
+        if (hist_size >= HISTORY_PARALLEL_SEARCH_MIN_ITEMS && is_main_thread() &&
+            !history_trigram_index_t::can_narrow(search_string, search_type)) {
+            for (const history_item_t &item :
+                 find_matches_in_parallel(search_string, search_type, case_sensitive)) {
+                if (!output_item(item)) break;
+            }
+            continue;
+        }
+
         history_search_t searcher =
             history_search_t(*this, search_string, search_type, case_sensitive);
         while (searcher.go_backwards()) {
-            wcstring result;
-            auto cur_item = searcher.current_item();
-            format_history_record(cur_item, show_time_format, null_terminate, result);
-            if (reverse) {
-                results.push_back(result);
-            } else {
-                streams.out.append(result);
-            }
-            if (--max_items == 0) break;
+            if (!output_item(searcher.current_item())) break;
         }
     }
 
@@ -1635,6 +3082,74 @@ bool history_t::search(history_search_type_t search_type, wcstring_list_t search
     return true;
 }
 
+void history_t::export_records(output_stream_t &out) {
+    scoped_lock locker(lock);
+    load_old_if_needed();
+
+    // Items deleted in this session are left out, which only takes their escaped commands.
+    std::unordered_set<std::string> deleted_commands;
+    for (const wcstring &deleted : deleted_items) {
+        std::string cmd = wcs2string(deleted);
+        escape_yaml(&cmd);
+        deleted_commands.insert(std::move(cmd));
+    }
+
+    history_output_buffer_t buffer;
+    if (mmap_type == history_type_fish_2_0) {
+        // Old items are passed on as they are in the file. Each record runs until the next one,
+        // which may be an item after our boundary, which is left out. Adjacent records are passed
+        // on together.
+        size_t run_start = 0, run_end = 0, after_idx = 0;
+        for (size_t i = 0; i < old_item_offsets.size(); i++) {
+            const size_t offset = old_item_offsets.at(i);
+            size_t end = i + 1 < old_item_offsets.size() ? old_item_offsets.at(i + 1) : mmap_length;
+            while (after_idx < items_after_boundary.size() &&
+                   items_after_boundary.at(after_idx).first <= offset) {
+                after_idx++;
+            }
+            if (after_idx < items_after_boundary.size()) {
+                end = std::min(end, items_after_boundary.at(after_idx).first);
+            }
+
+            const char *cmd;
+            size_t cmd_len;
+            if (!deleted_commands.empty() &&
+                raw_command_of_item_fish_2_0(mmap_start + offset, end - offset, &cmd, &cmd_len) &&
+                deleted_commands.count(std::string(cmd, cmd_len))) {
+                continue;
+            }
+            if (offset != run_end || run_end - run_start >= HISTORY_OUTPUT_BUFFER_SIZE) {
+                if (run_end > run_start) out.append_narrow(mmap_start + run_start, run_end - run_start);
+                run_start = offset;
+            }
+            run_end = end;
+        }
+        if (run_end > run_start) {
+            out.append_narrow(mmap_start + run_start, run_end - run_start);
+            // The last item may lack its newline if it was being written.
+            if (mmap_start[run_end - 1] != '\n') out.append_narrow("\n", 1);
+        }
+    } else {
+        // Other formats have to be decoded and written in ours.
+        for (size_t offset : old_item_offsets) {
+            const history_item_t item = decode_old_item(offset);
+            if (deleted_items.count(item.str())) continue;
+            append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
+            if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE) buffer.flush_to_stream(out);
+        }
+    }
+
+    // Then the items of this session, leaving out a pending one as searches do.
+    size_t new_item_count = new_items.size();
+    if (has_pending_item && new_item_count > 0) new_item_count--;
+    for (size_t i = 0; i < new_item_count; i++) {
+        const history_item_t &item = new_items.at(i);
+        append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
+        if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE) buffer.flush_to_stream(out);
+    }
+    buffer.flush_to_stream(out);
+}
+
 void history_t::disable_automatic_saving() {
     scoped_lock locker(lock);
     disable_automatic_save_counter++;
@@ -1656,6 +3171,10 @@ void history_t::clear(void) {
     old_item_offsets.clear();
     wcstring filename = history_filename(name, L"");
     if (!filename.empty()) wunlink(filename);
+    for (const wchar_t *suffix : {L".idx", L".tri"}) {
+        wcstring index_filename = history_filename(name, suffix);
+        if (!index_filename.empty()) wunlink(index_filename);
+    }
     this->clear_file_state();
 }
 
@@ -1795,23 +3314,23 @@ void history_t::populate_from_bash(FILE *stream) {
 
 void history_t::incorporate_external_changes() {
     // To incorporate new items, we simply update our timestamp to now, so that items from previous
-    // instances get added. We then clear the file state so that we remap the file. Note that this
-    // is somehwhat expensive because we will be going back over old items. An optimization would be
-    // to preserve old_item_offsets so that they don't have to be recomputed. (However, then items
-    // *deleted* in other instances would not show up here).
+    // instances get added. If the file has only been appended to since we mapped it, we only need
+    // to look at the appended items. Otherwise (for example, if another instance vacuumed it to
+    // delete items) we clear the file state so that we remap the file and go back over all of it.
     time_t new_timestamp = time(NULL);
     scoped_lock locker(lock);
 
     // If for some reason the clock went backwards, we don't want to start dropping items; therefore
     // we only do work if time has progressed. This also makes multiple calls cheap.
     if (new_timestamp > this->boundary_timestamp) {
-        this->boundary_timestamp = new_timestamp;
-        this->clear_file_state();
-
         // We also need to erase new_items, since we go through those first, and that means we
         // will not properly interleave them with items from other instances.
-        // We'll pick them up from the file (#2312)
+        // We'll pick them up from the file (#2312), so write them out first.
         this->save_internal(false);
+        this->boundary_timestamp = new_timestamp;
+        if (!this->follow_appended_items()) {
+            this->clear_file_state();
+        }
         this->new_items.clear();
         this->first_unwritten_new_item_index = 0;
     }
@@ -1820,10 +3339,11 @@ void history_t::incorporate_external_changes() {
 void history_init() {}
 
 void history_collection_t::save() {
-    // Save all histories
+    // Save all histories, and don't leave a vacuum half done.
     auto &&h = histories.acquire();
     for (auto &p : h.value) {
         p.second->save();
+        p.second->wait_for_background_vacuum();
     }
 }
 
@@ -1877,6 +3397,120 @@ bool all_paths_are_valid(const path_list_t &paths, const wcstring &working_direc
     return true;
 }
 
+// How long we trust a cached result of checking whether a path is valid, in seconds.
+#define HISTORY_PATH_CACHE_TTL 30.0
+
+// How many path validity results we cache.
+#define HISTORY_PATH_CACHE_SIZE 1024
+
+namespace {
+/// A request to find out which of the potential paths of a pending history item are valid.
+struct file_detection_request_t {
+    history_t *history;
+    history_identifier_t identifier;
+    path_list_t potential_paths;
+    wcstring working_directory;
+};
+
+/// The valid paths found for a file detection request.
+struct file_detection_result_t {
+    history_t *history;
+    history_identifier_t identifier;
+    path_list_t valid_paths;
+};
+
+/// File detection requests waiting to be handled. They are handled in batches by one background
+/// job at a time, so that adding many items at once (e.g. by pasting a bunch of commands) doesn't
+/// flood the thread pool.
+struct file_detection_queue_t {
+    std::vector<file_detection_request_t> requests;
+    // Whether a batch job is scheduled or running.
+    bool job_scheduled = false;
+};
+
+/// The result of checking if a path is valid, and when we checked.
+struct path_validity_t {
+    bool valid;
+    double when;
+};
+
+/// Cache of path validity results, keyed by the path joined to its working directory. This is
+/// only used by the file detection batch job, of which there is only one at a time.
+class path_validity_cache_t : public lru_cache_t<path_validity_cache_t, path_validity_t> {
+    typedef lru_cache_t<path_validity_cache_t, path_validity_t> super;
+
+   public:
+    using super::super;
+};
+}  // anonymous namespace
+
+static owning_lock<file_detection_queue_t> s_file_detection_queue;
+static path_validity_cache_t s_path_validity_cache(HISTORY_PATH_CACHE_SIZE);
+
+/// Handle a batch of file detection requests. This does disk I/O, on a background thread.
+static std::vector<file_detection_result_t> perform_file_detection_batch() {
+    ASSERT_IS_BACKGROUND_THREAD();
+    std::vector<file_detection_request_t> batch;
+    batch.swap(s_file_detection_queue.acquire().value.requests);
+
+    const double now = timef();
+    std::vector<file_detection_result_t> results;
+    results.reserve(batch.size());
+    for (const file_detection_request_t &req : batch) {
+        file_detection_result_t result = {req.history, req.identifier, {}};
+        for (const wcstring &path : req.potential_paths) {
+            const wcstring key = path.at(0) == L'/' ? path : req.working_directory + path;
+            path_validity_t *cached = s_path_validity_cache.get(key);
+            if (cached == NULL || now - cached->when > HISTORY_PATH_CACHE_TTL) {
+                bool valid = path_is_valid(path, req.working_directory);
+                s_path_validity_cache.evict_node(key);
+                s_path_validity_cache.insert(key, {valid, now});
+                cached = s_path_validity_cache.get(key);
+            }
+            if (cached->valid) result.valid_paths.push_back(path);
+        }
+        results.push_back(std::move(result));
+    }
+    return results;
+}
+
+/// Apply the results of a batch of file detection requests, and start the next batch if more
+/// requests came in meanwhile. Main thread only.
+static void complete_file_detection_batch(std::vector<file_detection_result_t> results) {
+    ASSERT_IS_MAIN_THREAD();
+    for (const file_detection_result_t &result : results) {
+        result.history->set_valid_file_paths(result.valid_paths, result.identifier);
+        result.history->enable_automatic_saving();
+    }
+
+    bool more = false;
+    {
+        auto &&queue = s_file_detection_queue.acquire();
+        more = !queue.value.requests.empty();
+        queue.value.job_scheduled = more;
+    }
+    if (more) {
+        iothread_perform(perform_file_detection_batch, complete_file_detection_batch,
+                         iothread_priority_background);
+    }
+}
+
+/// Queue a file detection request, starting a batch job if there is none. Main thread only.
+static void enqueue_file_detection(file_detection_request_t req) {
+    ASSERT_IS_MAIN_THREAD();
+    bool schedule = false;
+    {
+        auto &&queue = s_file_detection_queue.acquire();
+        queue.value.requests.push_back(std::move(req));
+        schedule = !queue.value.job_scheduled;
+        queue.value.job_scheduled = true;
+    }
+    if (schedule) {
+        iothread_perform(perform_file_detection_batch, complete_file_detection_batch,
+                         iothread_priority_background);
+    }
+}
+
 static bool string_could_be_path(const wcstring &potential_path) {
     // Assume that things with leading dashes aren't paths.
     if (potential_path.empty() || potential_path.at(0) == L'-') {
@@ -1936,12 +3570,7 @@ void history_t::add_pending_with_file_detection(const wcstring &str) {
 
         // Check for which paths are valid on a background thread,
         // then on the main thread update our history item
-        const wcstring wd = env_get_pwd_slash();
-        iothread_perform([=]() { return valid_paths(potential_paths, wd); },
-                         [=](path_list_t validated_paths) {
-                             this->set_valid_file_paths(validated_paths, identifier);
-                             this->enable_automatic_saving();
-                         });
+        enqueue_file_detection({this, identifier, std::move(potential_paths), env_get_pwd_slash()});
     }
 
     // Actually add the item to the history.
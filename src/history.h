@@ -10,7 +10,9 @@
 #include <time.h>
 #include <wctype.h>
 
+#include <condition_variable>
 #include <deque>
+#include <functional>
 #include <memory>
 #include <unordered_set>
 #include <string>
@@ -21,6 +23,7 @@
 #include "wutil.h"  // IWYU pragma: keep
 
 struct io_streams_t;
+class output_stream_t;
 
 // Fish supports multiple shells writing to history at once. Here is its strategy:
 //
@@ -37,7 +40,16 @@ struct io_streams_t;
 //
 // 4. History is appended to under a fcntl write lock.
 //
-// 5. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can
+// 5. A fish 2.0 history file may have a sidecar index file (e.g. fish_history.idx) which records
+// the offsets and timestamps of its items, so that loading the history does not have to scan the
+// whole file. The index is only a cache: it is ignored if it does not match the history file.
+//
+// 6. Since files are append-only, a file with the same inode that has only grown still has the
+// items we already know about at the same offsets. Merging the history of other shells therefore
+// only parses the records appended since we last looked ("tail following"). If the file was
+// replaced, we start over.
+//
+// 7. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can
 // trigger race conditions. This is useful for testing.
 
 typedef std::vector<wcstring> path_list_t;
@@ -69,9 +81,9 @@ class history_item_t {
     // Attempts to merge two compatible history items together.
     bool merge(const history_item_t &item);
 
-    // The actual contents of the entry.
-    wcstring contents;        // value as entered by the user
-    wcstring contents_lower;  // value normalized to all lowercase for case insensitive comparisons
+    // The actual contents of the entry, as entered by the user. Kept as UTF-8, since a history may
+    // hold many items; it is converted back whenever the item is read.
+    utf8_string_t contents;
 
     // Original creation time for the entry.
     time_t creation_timestamp;
@@ -85,14 +97,29 @@ class history_item_t {
    public:
     explicit history_item_t(const wcstring &str, time_t when = 0, history_identifier_t ident = 0);
 
-    const wcstring &str() const { return contents; }
-    const wcstring &str_lower() const { return contents_lower; }
+    wcstring str() const { return contents.str(); }
+
+    // The contents normalized to all lowercase, for case insensitive comparisons.
+    wcstring str_lower() const;
+
+    // Approximate bytes taken by the contents.
+    size_t str_memory() const { return contents.memory(); }
 
     bool empty() const { return contents.empty(); }
 
     // Whether our contents matches a search term.
     bool matches_search(const wcstring &term, enum history_search_type_t type,
-                        bool case_sensitive) const;
+                        bool case_sensitive) const {
+        return contents_match_search(str(), term, type, case_sensitive);
+    }
+
+    // Whether the given contents of an item match a search term, for callers that have already
+    // decoded them with str().
+    static bool contents_match_search(const wcstring &contents, const wcstring &term,
+                                      enum history_search_type_t type, bool case_sensitive);
+
+    // Whether the contents of two items are the same, without decoding them.
+    bool same_contents(const history_item_t &other) const { return contents == other.contents; }
 
     time_t timestamp() const { return creation_timestamp; }
 
@@ -107,6 +134,31 @@ class history_item_t {
 
 typedef std::deque<history_item_t> history_item_list_t;
 
+class history_trigram_index_t;
+class history_decoded_item_cache_t;
+
+/// The approximate memory used by a history, in bytes, along with item counts, for reporting.
+struct history_memory_stats_t {
+    size_t new_item_count;
+    size_t new_item_bytes;
+    size_t old_item_count;
+    size_t old_item_offset_bytes;
+    size_t decoded_item_count;
+    size_t decoded_item_bytes;
+    size_t trigram_index_bytes;
+    size_t limit;
+    /// The old items found in the trigram index shared with other shells, and its size, which isn't
+    /// counted against limit.
+    size_t shared_index_item_count;
+    size_t shared_index_bytes;
+    /// The size of the history file mapped into memory, which the kernel pages in as needed.
+    size_t mmap_bytes;
+    /// The bytes taken by the text of the new and decoded items, which is kept as UTF-8, and the
+    /// bytes the same text would take as wide characters.
+    size_t item_text_bytes;
+    size_t item_text_wide_bytes;
+};
+
 // The type of file that we mmap'd.
 enum history_file_type_t { history_type_unknown, history_type_fish_2_0, history_type_fish_1_x };
 
@@ -155,12 +207,29 @@ class history_t {
     // The size of the mmap'd region.
     size_t mmap_length;
 
+    // If the history file is compressed, the mmap'd region holds its decompressed items, and this
+    // is how many bytes of the file they come from. It is 0 if the file is not compressed.
+    size_t mmap_compressed_length;
+
     // The type of file we mmap'd.
     history_file_type_t mmap_type;
 
     // The file ID of the file we mmap'd.
     file_id_t mmap_file_id;
 
+    // How many searches are reading our mmap'd data without holding the lock. While there are any,
+    // regions we are done with are kept in retired_mmaps rather than unmapped.
+    size_t mmap_pin_count;
+    std::vector<std::pair<const char *, size_t>> retired_mmaps;
+
+    // Unmaps a region of ours, or retires it if a search may still be reading it.
+    void release_mmap(const char *start, size_t length);
+
+    // Counts a search reading our mmap'd data. Unpinning unmaps the retired regions once no search
+    // is left.
+    void pin_mmap();
+    void unpin_mmap();
+
     // The boundary timestamp distinguishes old items from new items. Items whose timestamps are <=
     // the boundary are considered "old". Items whose timestemps are > the boundary are new, and are
     // ignored by this instance (unless they came from this instance). The timestamp may be adjusted
@@ -173,12 +242,58 @@ class history_t {
     // Figure out the offsets of our mmap data.
     void populate_from_mmap(void);
 
+    // Figure out the offsets of our fish 2.0 mmap data, consulting and updating the history index.
+    void populate_from_mmap_with_index();
+
     // List of old items, as offsets into out mmap data.
     std::deque<size_t> old_item_offsets;
 
+    // Items in our mmap data that are newer than the boundary timestamp, as offsets and timestamps
+    // in file order. These become old items when incorporate_external_changes() moves the boundary
+    // past them.
+    std::vector<std::pair<size_t, time_t>> items_after_boundary;
+
+    // The offset and timestamp of the last item in our mmap data, or -1 if there are no items. This
+    // is where we resume scanning when following items appended to the file.
+    size_t last_item_offset;
+    time_t last_item_timestamp;
+
+    // Whether the file with the given ID is our mmap'd file, with nothing but appended data.
+    bool file_was_only_appended(const file_id_t &file_id) const;
+
+    // Maps the items other shells have appended to our file since we mapped it, and makes those
+    // from before the boundary timestamp old items. Returns false if this is not possible, e.g.
+    // because the file was replaced, in which case the caller must clear the file state.
+    bool follow_appended_items();
+
     // Whether we've loaded old items.
     bool loaded_old;
 
+    // Index of the trigrams in old items, used to speed up substring searches. Built on demand.
+    std::unique_ptr<history_trigram_index_t> trigram_index;
+
+    // Whether the trigram index would not fit in our memory limit, so we shouldn't build it again.
+    bool trigram_index_too_large;
+
+    // Builds trigram_index, starting from the index shared with other shells if there is a valid
+    // one, and updating that if it's missing or out of date. Returns false if it's too large.
+    bool build_trigram_index();
+
+    // Adds the old items from the given position on to the given index. Returns false if the index
+    // exceeds our memory limit.
+    bool index_old_items(history_trigram_index_t *index, size_t first);
+
+    // Recently decoded old items. Together with the trigram index, this is kept within
+    // history_memory_limit; evicted items are decoded again from the mmap'd file when needed.
+    std::unique_ptr<history_decoded_item_cache_t> decoded_items;
+
+    // Returns the old item at the given offset in our mmap'd file, decoding it if it's not cached.
+    history_item_t decode_old_item(size_t offset);
+
+    // Calls func with the text of each item, most recent first, skipping items with the same text
+    // as a more recent one, until func returns false. This is what $history lists.
+    void visit_distinct_items(const std::function<bool(const wcstring &)> &func);
+
     // Loads old if necessary.
     bool load_old_if_needed(void);
 
@@ -188,13 +303,24 @@ class history_t {
     // Deletes duplicates in new_items.
     void compact_new_items();
 
-    // Attempts to rewrite the existing file to a target temporary file
+    // Attempts to rewrite the existing file to a target temporary file, adding the given unwritten
+    // items and leaving out the given deleted ones.
     // Returns false on error, true on success
-    bool rewrite_to_temporary_file(int existing_fd, int dst_fd) const;
+    bool rewrite_to_temporary_file(int existing_fd, int dst_fd,
+                                   const history_item_list_t &unwritten,
+                                   const std::unordered_set<wcstring> &deleted) const;
 
     // Saves history by rewriting the file.
     bool save_internal_via_rewrite();
 
+    // Whether a vacuum is running on a background thread, and a condition signalled when it is
+    // done. Protected by our lock.
+    bool vacuum_in_progress;
+    std::condition_variable vacuum_finished;
+
+    // Rewrites the history file on a background thread, without holding our lock while doing so.
+    void vacuum_in_background();
+
     // Saves history by appending to the file.
     bool save_internal_via_appending();
 
@@ -205,18 +331,33 @@ class history_t {
     void save_internal_unless_disabled();
 
     // Do a private, read-only map of the entirety of a history file with the given name. Returns
-    // true if successful. Returns the mapped memory region by reference.
+    // true if successful. Returns the mapped memory region by reference. A compressed file is
+    // decompressed into anonymous memory instead, and the number of bytes of the file that were
+    // decompressed is returned too (0 if it is not compressed).
     bool map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
-                  file_id_t *file_id) const;
+                  file_id_t *file_id, size_t *out_compressed_length = NULL) const;
 
     // Like map_file but takes a file descriptor
-    bool map_fd(int fd, const char **out_map_start, size_t *out_map_len) const;
+    bool map_fd(int fd, const char **out_map_start, size_t *out_map_len,
+                size_t *out_compressed_length = NULL) const;
+
+    // Like map_fd for our compressed file, with blocks appended to it since we mapped it. Only the
+    // new blocks are decompressed, after a copy of our mmap'd data.
+    bool map_appended_blocks(int fd, const char **out_map_start, size_t *out_map_len,
+                             size_t *out_compressed_length) const;
+
+    // Returns the items matching a search, most recent first and without duplicates, searching the
+    // old items on several threads. Main thread only.
+    history_item_list_t find_matches_in_parallel(const wcstring &search_string,
+                                                 history_search_type_t search_type,
+                                                 bool case_sensitive);
 
     // Whether we're in maximum chaos mode, useful for testing.
     bool chaos_mode;
 
    public:
     explicit history_t(const wcstring &);  // constructor
+    ~history_t();
 
     // Returns history with the given name, creating it if necessary.
     static history_t &history_with_name(const wcstring &name);
@@ -244,6 +385,9 @@ class history_t {
     // Saves history.
     void save();
 
+    // Waits until any vacuum running on a background thread has finished.
+    void wait_for_background_vacuum();
+
     // Searches history.
     bool search(history_search_type_t search_type, wcstring_list_t search_args,
                 const wchar_t *show_time_format, size_t max_items, bool case_sensitive,
@@ -252,6 +396,10 @@ class history_t {
                           const wchar_t *show_time_format, size_t max_items, bool case_sensitive,
                           bool null_terminate, bool reverse, io_streams_t &streams);
 
+    // Write all items, oldest first, in the format of the history file. Old items are passed on
+    // from the file as they are, without being decoded.
+    void export_records(output_stream_t &out);
+
     // Enable / disable automatic saving. Main thread only!
     void disable_automatic_saving();
     void enable_automatic_saving();
@@ -269,8 +417,11 @@ class history_t {
     void incorporate_external_changes();
 
     // Gets all the history into a list. This is intended for the $history environment variable.
-    // This may be long!
-    void get_history(wcstring_list_t &result);
+    // This may be long! If max_count is given, gets only that many of the most recent items.
+    void get_history(wcstring_list_t &result, size_t max_count = SIZE_MAX);
+
+    // Return the number of items get_history would get, without copying them.
+    size_t distinct_size();
 
     // Sets the valid file paths for the history item with the given identifier.
     void set_valid_file_paths(const wcstring_list_t &valid_file_paths, history_identifier_t ident);
@@ -281,6 +432,20 @@ class history_t {
 
     // Return the number of history entries.
     size_t size();
+
+    // Returns the approximate memory used by this history.
+    history_memory_stats_t memory_stats();
+
+    // Returns false if the item at the given index definitely does not match a search, judging by
+    // its raw data in the history file without decoding it. raw_term is the search term as it
+    // would be encoded in the history file, and must be lowercased for a case insensitive search.
+    bool item_at_index_may_match(size_t idx, const std::string &raw_term,
+                                 history_search_type_t type, bool case_sensitive);
+
+    // Given an index as for item_at_index, return the first index at or after it whose item might
+    // match the given search term and type, skipping over items that cannot possibly match. This
+    // may return an index past the end of the history if no item can match.
+    size_t next_search_candidate(size_t idx, const wcstring &term, history_search_type_t type);
 };
 
 class history_search_t {
@@ -300,7 +465,7 @@ class history_search_t {
     std::vector<prev_match_t> prev_matches;
 
     // Returns yes if a given term is in prev_matches.
-    bool match_already_made(const wcstring &match) const;
+    bool match_already_made(const history_item_t &match) const;
 
     // Additional strings to skip (sorted).
     wcstring_list_t external_skips;
@@ -363,6 +528,17 @@ void history_destroy();
 /// Perform sanity checks.
 void history_sanity_check();
 
+// Limit the decoded items and indexes of each history to 32 MiB by default. This can be
+// overridden by the fish_history_memory_limit variable.
+#define HISTORY_MEMORY_LIMIT (32 * 1024 * 1024)
+
+/// The approximate number of bytes each history may use for caching decoded items and indexes.
+extern size_t history_memory_limit;
+
+/// The zlib compression level history files are written with when they are rewritten, from 1 to 9,
+/// or 0 to write them uncompressed. This is set by the fish_history_compression variable.
+extern int history_compression_level;
+
 /// Return the prefix for the files to be used for command and read history.
 wcstring history_session_id();
 
@@ -12,8 +12,11 @@
 #endif
 
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "common.h"
@@ -37,6 +40,12 @@ struct input_mapping_t {
     wcstring seq;
     /// Commands that should be evaluated by this mapping.
     wcstring_list_t commands;
+    /// The input function code of each command, or INPUT_CODE_NONE for shell commands. These are
+    /// looked up when the commands are set, so that key presses don't have to.
+    std::vector<wchar_t> codes;
+    /// Whether some of the commands are input functions, and whether some are shell commands.
+    bool has_functions;
+    bool has_commands;
     /// We wish to preserve the user-specified order. This is just an incrementing value.
     unsigned int specification_order;
     /// Mode in which this command should be evaluated.
@@ -46,9 +55,25 @@ struct input_mapping_t {
 
     input_mapping_t(const wcstring &s, const std::vector<wcstring> &c, const wcstring &m,
                     const wcstring &sm)
-        : seq(s), commands(c), mode(m), sets_mode(sm) {
+        : seq(s), mode(m), sets_mode(sm) {
         static unsigned int s_last_input_map_spec_order = 0;
         specification_order = ++s_last_input_map_spec_order;
+        set_commands(c);
+    }
+
+    void set_commands(const wcstring_list_t &c) {
+        commands = c;
+        codes.clear();
+        has_functions = has_commands = false;
+        for (const wcstring &command : commands) {
+            wchar_t code = input_function_get_code(command);
+            codes.push_back(code);
+            if (code != INPUT_CODE_NONE) {
+                has_functions = true;
+            } else {
+                has_commands = true;
+            }
+        }
     }
 };
 
@@ -110,8 +135,11 @@ static const wchar_t *const name_arr[] = {L"beginning-of-line",
                                           L"kill-selection",
                                           L"forward-jump",
                                           L"backward-jump",
+                                          L"begin-bracketed-paste",
                                           L"and",
-                                          L"cancel"};
+                                          L"cancel",
+                                          L"undo",
+                                          L"redo"};
 
 wcstring describe_char(wint_t c) {
     wint_t initial_cmd_char = R_BEGINNING_OF_LINE;
@@ -174,12 +202,76 @@ static const wchar_t code_arr[] = {R_BEGINNING_OF_LINE,
                                    R_KILL_SELECTION,
                                    R_FORWARD_JUMP,
                                    R_BACKWARD_JUMP,
+                                   R_BEGIN_BRACKETED_PASTE,
                                    R_AND,
-                                   R_CANCEL};
+                                   R_CANCEL,
+                                   R_UNDO,
+                                   R_REDO};
 
 /// Mappings for the current input mode.
 static std::vector<input_mapping_t> mapping_list;
 
+/// Marks a trie node that no mapping ends at.
+#define MAPPING_NONE ((size_t)(-1))
+
+/// The mappings of one bind mode, arranged as a trie over their sequences. This lets the longest
+/// mapping that matches the input be found by reading the input once, instead of trying every
+/// mapping in turn.
+struct input_mapping_trie_t {
+    struct node_t {
+        /// The children of the node, sorted by character, as pairs of character and node index.
+        std::vector<std::pair<wchar_t, size_t>> children;
+        /// The index in mapping_list of the mapping whose sequence ends here, or MAPPING_NONE.
+        size_t mapping_idx = MAPPING_NONE;
+    };
+    /// All nodes. The root is the first one, and its mapping is the generic one.
+    std::vector<node_t> nodes;
+
+    static bool child_before(const std::pair<wchar_t, size_t> &child, wchar_t c) {
+        return child.first < c;
+    }
+
+    explicit input_mapping_trie_t(const wcstring &mode) : nodes(1) {
+        for (size_t i = 0; i < mapping_list.size(); i++) {
+            const input_mapping_t &m = mapping_list.at(i);
+            if (m.mode != mode) continue;
+            size_t node = 0;
+            for (wchar_t c : m.seq) {
+                std::vector<std::pair<wchar_t, size_t>> &children = nodes.at(node).children;
+                auto where = std::lower_bound(children.begin(), children.end(), c, child_before);
+                if (where != children.end() && where->first == c) {
+                    node = where->second;
+                } else {
+                    children.insert(where, std::make_pair(c, nodes.size()));
+                    node = nodes.size();
+                    nodes.push_back(node_t());
+                }
+            }
+            nodes.at(node).mapping_idx = i;
+        }
+    }
+
+    /// Return the child of node for the character c, or 0 (the root) if there is none.
+    size_t child(size_t node, wchar_t c) const {
+        const std::vector<std::pair<wchar_t, size_t>> &children = nodes.at(node).children;
+        auto where = std::lower_bound(children.begin(), children.end(), c, child_before);
+        return where != children.end() && where->first == c ? where->second : 0;
+    }
+};
+
+/// Tries of the bind modes used so far, built on demand. Since they refer to mappings by index,
+/// they are dropped whenever mappings are added to or removed from mapping_list.
+static std::map<wcstring, input_mapping_trie_t> mapping_tries;
+
+/// Return the trie of the mappings of the given bind mode.
+static const input_mapping_trie_t &input_mapping_trie(const wcstring &mode) {
+    auto where = mapping_tries.find(mode);
+    if (where == mapping_tries.end()) {
+        where = mapping_tries.insert(std::make_pair(mode, input_mapping_trie_t(mode))).first;
+    }
+    return where->second;
+}
+
 /// Terminfo map list.
 static std::vector<terminfo_mapping_t> terminfo_mappings;
 
@@ -195,6 +287,11 @@ bool input_initialized = false;
 /// Initialize terminfo.
 static void init_input_terminfo();
 
+/// Non-interactive shells don't initialize the input subsystem at startup; do it on first use.
+static void input_init_if_needed() {
+    if (!input_initialized) init_input();
+}
+
 static wchar_t input_function_args[MAX_INPUT_FUNCTION_ARGS];
 static bool input_function_status;
 static int input_function_args_index = 0;
@@ -223,23 +320,10 @@ static int input_function_arity(int function) {
 /// Sets the return status of the most recently executed input function.
 void input_function_set_status(bool status) { input_function_status = status; }
 
-/// Helper function to compare the lengths of sequences.
-static bool length_is_greater_than(const input_mapping_t &m1, const input_mapping_t &m2) {
-    return m1.seq.size() > m2.seq.size();
-}
-
 static bool specification_order_is_less_than(const input_mapping_t &m1, const input_mapping_t &m2) {
     return m1.specification_order < m2.specification_order;
 }
 
-/// Inserts an input mapping at the correct position. We sort them in descending order by length, so
-/// that we test longer sequences first.
-static void input_mapping_insert_sorted(const input_mapping_t &new_mapping) {
-    std::vector<input_mapping_t>::iterator loc = std::lower_bound(
-        mapping_list.begin(), mapping_list.end(), new_mapping, length_is_greater_than);
-    mapping_list.insert(loc, new_mapping);
-}
-
 /// Adds an input mapping.
 void input_mapping_add(const wchar_t *sequence, const wchar_t *const *commands, size_t commands_len,
                        const wchar_t *mode, const wchar_t *sets_mode) {
@@ -247,6 +331,7 @@ void input_mapping_add(const wchar_t *sequence, const wchar_t *const *commands,
     CHECK(commands, );
     CHECK(mode, );
     CHECK(sets_mode, );
+    input_init_if_needed();
 
     // debug( 0, L"Add mapping from %ls to %ls in mode %ls", escape_string(sequence,
     // ESCAPE_ALL).c_str(),
@@ -258,15 +343,15 @@ void input_mapping_add(const wchar_t *sequence, const wchar_t *const *commands,
     for (size_t i = 0; i < mapping_list.size(); i++) {
         input_mapping_t &m = mapping_list.at(i);
         if (m.seq == sequence && m.mode == mode) {
-            m.commands = commands_vector;
+            m.set_commands(commands_vector);
             m.sets_mode = sets_mode;
             return;
         }
     }
 
     // Add a new mapping, using the next order.
-    const input_mapping_t new_mapping = input_mapping_t(sequence, commands_vector, mode, sets_mode);
-    input_mapping_insert_sorted(new_mapping);
+    mapping_list.push_back(input_mapping_t(sequence, commands_vector, mode, sets_mode));
+    mapping_tries.clear();
 }
 
 void input_mapping_add(const wchar_t *sequence, const wchar_t *command, const wchar_t *mode,
@@ -292,6 +377,8 @@ static int interrupt_handler() {
 /// Set up arrays used by readch to detect escape sequences for special keys and perform related
 /// initializations for our input subsystem.
 void init_input() {
+    // Set this first, as adding the default bindings below would otherwise initialize us again.
+    input_initialized = true;
     input_common_init(&interrupt_handler);
     init_input_terminfo();
 
@@ -305,8 +392,6 @@ void init_input() {
         input_mapping_add(L"\x4", L"exit");
         input_mapping_add(L"\x5", L"bind");
     }
-
-    input_initialized = true;
 }
 
 void input_destroy() {
@@ -348,15 +433,7 @@ void input_function_push_args(int code) {
 static void input_mapping_execute(const input_mapping_t &m, bool allow_commands) {
     // has_functions: there are functions that need to be put on the input queue
     // has_commands: there are shell commands that need to be evaluated
-    bool has_commands = false, has_functions = false;
-
-    for (wcstring_list_t::const_iterator it = m.commands.begin(), end = m.commands.end(); it != end;
-         ++it) {
-        if (input_function_get_code(*it) != INPUT_CODE_NONE)
-            has_functions = true;
-        else
-            has_commands = true;
-    }
+    const bool has_commands = m.has_commands, has_functions = m.has_functions;
 
     // !has_functions && !has_commands: only set bind mode
     if (!has_commands && !has_functions) {
@@ -374,10 +451,10 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
         return;  // skip the input_set_bind_mode
     } else if (has_functions && !has_commands) {
         // Functions are added at the head of the input queue.
-        for (wcstring_list_t::const_reverse_iterator it = m.commands.rbegin(),
-                                                     end = m.commands.rend();
+        for (std::vector<wchar_t>::const_reverse_iterator it = m.codes.rbegin(),
+                                                          end = m.codes.rend();
              it != end; ++it) {
-            wchar_t code = input_function_get_code(*it);
+            wchar_t code = *it;
             input_function_push_args(code);
             input_common_next_ch(code);
         }
@@ -403,70 +480,43 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
     if (!m.sets_mode.empty()) input_set_bind_mode(m.sets_mode);
 }
 
-/// Try reading the specified function mapping.
-static bool input_mapping_is_match(const input_mapping_t &m) {
-    wchar_t c = 0;
-    int j;
-
-    debug(4, L"trying to match mapping %ls", escape_string(m.seq.c_str(), ESCAPE_ALL).c_str());
-    const wchar_t *str = m.seq.c_str();
-    for (j = 0; str[j] != L'\0'; j++) {
-        bool timed = (j > 0 && iswcntrl(str[0]));
-
-        c = input_common_readch(timed);
-        if (str[j] != c) {
-            break;
-        }
-    }
-
-    if (str[j] == L'\0') {
-        // debug(0, L"matched mapping %ls (%ls)\n", escape_string(m.seq.c_str(),
-        // ESCAPE_ALL).c_str(),
-        // m.command.c_str());
-        // We matched the entire sequence.
-        return true;
-    }
-
-    // Reinsert the chars we read to be read again since we didn't match the bind sequence (i.e.,
-    // the input mapping).
-    input_common_next_ch(c);
-    for (int k = j - 1; k >= 0; k--) {
-        input_common_next_ch(m.seq[k]);
-    }
-
-    return false;
-}
-
 void input_queue_ch(wint_t ch) { input_common_queue_ch(ch); }
 
 static void input_mapping_execute_matching_or_generic(bool allow_commands) {
-    const input_mapping_t *generic = NULL;
-
-    const wcstring bind_mode = input_get_bind_mode();
+    const input_mapping_trie_t &trie = input_mapping_trie(input_get_bind_mode());
 
-    for (size_t i = 0; i < mapping_list.size(); i++) {
-        const input_mapping_t &m = mapping_list.at(i);
-
-        // debug(0, L"trying mapping (%ls,%ls,%ls)\n", escape_string(m.seq.c_str(),
-        // ESCAPE_ALL).c_str(),
-        //           m.mode.c_str(), m.sets_mode.c_str());
-
-        if (m.mode != bind_mode) {
-            // debug(0, L"skipping mapping because mode %ls != %ls\n", m.mode.c_str(),
-            // input_get_bind_mode().c_str());
-            continue;
+    // Read characters for as long as some mapping continues with them, remembering the longest
+    // mapping seen on the way. Sequences starting with a control character are typically escape
+    // sequences, whose later characters arrive quickly if at all, so those are read with a timeout.
+    wcstring seq;
+    size_t node = 0;
+    size_t matched_idx = MAPPING_NONE, matched_len = 0;
+    while (!trie.nodes.at(node).children.empty()) {
+        bool timed = !seq.empty() && iswcntrl(seq.at(0));
+        wchar_t c = input_common_readch(timed);
+        size_t next = trie.child(node, c);
+        if (next == 0) {
+            input_common_next_ch(c);
+            break;
         }
-
-        if (m.seq.length() == 0) {
-            generic = &m;
-        } else if (input_mapping_is_match(m)) {
-            input_mapping_execute(m, allow_commands);
-            return;
+        seq.push_back(c);
+        node = next;
+        if (trie.nodes.at(node).mapping_idx != MAPPING_NONE) {
+            matched_idx = trie.nodes.at(node).mapping_idx;
+            matched_len = seq.size();
         }
     }
 
-    if (generic) {
-        input_mapping_execute(*generic, allow_commands);
+    // Put back the characters read past the end of the matched sequence.
+    for (size_t i = seq.size(); i > matched_len; i--) {
+        input_common_next_ch(seq.at(i - 1));
+    }
+
+    if (matched_idx == MAPPING_NONE) matched_idx = trie.nodes.at(0).mapping_idx;
+    if (matched_idx != MAPPING_NONE) {
+        // Executing the mapping may run commands that change mapping_list, so use a copy.
+        const input_mapping_t mapping = mapping_list.at(matched_idx);
+        input_mapping_execute(mapping, allow_commands);
     } else {
         debug(2, L"no generic found, ignoring char...");
         wchar_t c = input_common_readch(0);
@@ -500,8 +550,28 @@ static wchar_t input_read_characters_only() {
     return char_to_return;
 }
 
+wcstring input_read_bracketed_paste() {
+    static const wchar_t *const end_sequence = L"\x1B[201~";
+    static const size_t end_sequence_len = wcslen(end_sequence);
+    wcstring result;
+    for (;;) {
+        wchar_t c = input_common_readch(0);
+        if (c == R_EOF) break;
+        // Skip readline functions that were queued, and the R_NULL returned for interrupts.
+        if (c >= R_MIN && c <= R_SENTINAL) continue;
+        result.push_back(c);
+        if (c == end_sequence[end_sequence_len - 1] &&
+            string_suffixes_string(end_sequence, result)) {
+            result.resize(result.size() - end_sequence_len);
+            break;
+        }
+    }
+    return result;
+}
+
 wint_t input_readch(bool allow_commands) {
     CHECK_BLOCK(R_NULL);
+    input_init_if_needed();
 
     // Clear the interrupted flag.
     reader_reset_interrupted();
@@ -544,6 +614,7 @@ wint_t input_readch(bool allow_commands) {
 }
 
 std::vector<input_mapping_name_t> input_mapping_get_names() {
+    input_init_if_needed();
     // Sort the mappings by the user specification order, so we can return them in the same order
     // that the user specified them in.
     std::vector<input_mapping_t> local_list = mapping_list;
@@ -560,12 +631,14 @@ std::vector<input_mapping_name_t> input_mapping_get_names() {
 
 bool input_mapping_erase(const wcstring &sequence, const wcstring &mode) {
     ASSERT_IS_MAIN_THREAD();
+    input_init_if_needed();
     bool result = false;
 
     for (std::vector<input_mapping_t>::iterator it = mapping_list.begin(), end = mapping_list.end();
          it != end; ++it) {
         if (sequence == it->seq && mode == it->mode) {
             mapping_list.erase(it);
+            mapping_tries.clear();
             result = true;
             break;
         }
@@ -575,6 +648,7 @@ bool input_mapping_erase(const wcstring &sequence, const wcstring &mode) {
 
 bool input_mapping_get(const wcstring &sequence, const wcstring &mode, wcstring_list_t *out_cmds,
                        wcstring *out_sets_mode) {
+    input_init_if_needed();
     bool result = false;
     for (std::vector<input_mapping_t>::const_iterator it = mapping_list.begin(),
                                                       end = mapping_list.end();
@@ -756,7 +830,7 @@ static void init_input_terminfo() {
 
 bool input_terminfo_get_sequence(const wchar_t *name, wcstring *out_seq) {
     ASSERT_IS_MAIN_THREAD();
-    assert(input_initialized);
+    input_init_if_needed();
     CHECK(name, 0);
 
     const char *res = 0;
@@ -781,7 +855,7 @@ bool input_terminfo_get_sequence(const wchar_t *name, wcstring *out_seq) {
 }
 
 bool input_terminfo_get_name(const wcstring &seq, wcstring *out_name) {
-    assert(input_initialized);
+    input_init_if_needed();
 
     for (size_t i = 0; i < terminfo_mappings.size(); i++) {
         terminfo_mapping_t &m = terminfo_mappings.at(i);
@@ -801,7 +875,7 @@ bool input_terminfo_get_name(const wcstring &seq, wcstring *out_name) {
 }
 
 wcstring_list_t input_terminfo_get_names(bool skip_null) {
-    assert(input_initialized);
+    input_init_if_needed();
     wcstring_list_t result;
     result.reserve(terminfo_mappings.size());
 
@@ -822,10 +896,14 @@ wcstring_list_t input_function_get_names(void) {
 }
 
 wchar_t input_function_get_code(const wcstring &name) {
-    for (size_t i = 0; i < sizeof code_arr / sizeof *code_arr; i++) {
-        if (name == name_arr[i]) {
-            return code_arr[i];
+    // Index the names on first use; this is consulted for every command bound to a key.
+    static const std::unordered_map<wcstring, wchar_t> codes_by_name = [] {
+        std::unordered_map<wcstring, wchar_t> result;
+        for (size_t i = 0; i < sizeof code_arr / sizeof *code_arr; i++) {
+            result.insert(std::make_pair(wcstring(name_arr[i]), code_arr[i]));
         }
-    }
-    return INPUT_CODE_NONE;
+        return result;
+    }();
+    auto where = codes_by_name.find(name);
+    return where == codes_by_name.end() ? INPUT_CODE_NONE : where->second;
 }
@@ -38,6 +38,11 @@ void input_destroy();
 /// returned.
 wint_t input_readch(bool allow_commands = true);
 
+/// Read the text of a bracketed paste, after the sequence that starts it has been read, up to and
+/// excluding the sequence that ends it. No bindings apply to the text, so it is read as a whole
+/// rather than a character at a time.
+wcstring input_read_bracketed_paste();
+
 /// Enqueue a character or a readline function to the queue of unread characters that input_readch
 /// will return before actually reading from fd 0.
 void input_queue_ch(wint_t ch);
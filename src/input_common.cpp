@@ -33,6 +33,10 @@
 #define WAIT_ON_ESCAPE_DEFAULT 300
 static int wait_on_escape_ms = WAIT_ON_ESCAPE_DEFAULT;
 
+/// Set when a timed wait has just seen stdin become readable, so that the next byte can be read
+/// without waiting for it again.
+static bool stdin_known_readable = false;
+
 /// Characters that have been read and returned by the sequence matching code.
 static std::deque<wchar_t> lookahead_list;
 
@@ -41,6 +45,10 @@ typedef std::list<std::function<void(void)>> callback_queue_t;
 static callback_queue_t callback_queue;
 static void input_flush_callbacks(void);
 
+/// Invoked once while waiting for a byte, when none has arrived for idle_delay_ms milliseconds.
+static std::function<void(void)> idle_handler;
+static long idle_delay_ms = -1;
+
 static bool has_lookahead(void) { return !lookahead_list.empty(); }
 
 static wint_t lookahead_pop(void) {
@@ -70,10 +78,32 @@ static wint_t readb() {
     unsigned char arr[1];
     bool do_loop;
 
+    if (stdin_known_readable) {
+        stdin_known_readable = false;
+        if (read_blocked(0, arr, 1) != 1) return R_EOF;
+        return arr[0];
+    }
+
+    const double wait_start = timef();
+    bool idle_pending = idle_handler && idle_delay_ms >= 0;
     do {
         // Flush callbacks.
         input_flush_callbacks();
 
+        // Run the idle handler once the wait has gone on long enough. Until then, wake up in time
+        // for it.
+        unsigned long usecs_until_idle = 0;
+        if (idle_pending) {
+            const double waited_ms = (timef() - wait_start) * 1000;
+            if (waited_ms >= idle_delay_ms) {
+                idle_pending = false;
+                idle_handler();
+                if (has_lookahead()) return lookahead_pop();
+            } else {
+                usecs_until_idle = (unsigned long)((idle_delay_ms - waited_ms) * 1000) + 1;
+            }
+        }
+
         fd_set fdset;
         int fd_max = 0;
         int ioport = iothread_port();
@@ -98,7 +128,10 @@ static wint_t readb() {
 
         // Get its suggested delay (possibly none).
         struct timeval tv = {};
-        const unsigned long usecs_delay = notifier.usec_delay_between_polls();
+        unsigned long usecs_delay = notifier.usec_delay_between_polls();
+        if (usecs_until_idle > 0 && (usecs_delay == 0 || usecs_until_idle < usecs_delay)) {
+            usecs_delay = usecs_until_idle;
+        }
         if (usecs_delay > 0) {
             unsigned long usecs_per_sec = 1000000;
             tv.tv_sec = (int)(usecs_delay / usecs_per_sec);
@@ -175,6 +208,14 @@ void update_wait_on_escape_ms() {
     }
 }
 
+bool input_common_stdin_has_input() {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    struct timeval tm = {0, 0};
+    return select(1, &fds, 0, 0, &tm) > 0;
+}
+
 wchar_t input_common_readch(int timed) {
     if (!has_lookahead()) {
         if (timed) {
@@ -186,6 +227,7 @@ wchar_t input_common_readch(int timed) {
             if (count <= 0) {
                 return R_TIMEOUT;
             }
+            stdin_known_readable = true;
         }
 
         wchar_t res;
@@ -238,6 +280,12 @@ void input_common_add_callback(std::function<void(void)> callback) {
     callback_queue.push_back(std::move(callback));
 }
 
+void input_common_set_idle_handler(long delay_ms, std::function<void(void)> handler) {
+    ASSERT_IS_MAIN_THREAD();
+    idle_delay_ms = delay_ms;
+    idle_handler = delay_ms < 0 ? nullptr : std::move(handler);
+}
+
 static void input_flush_callbacks(void) {
     // We move the queue into a local variable, so that events queued up during a callback don't get
     // fired until next round.
@@ -70,10 +70,13 @@ enum {
     R_KILL_SELECTION,
     R_FORWARD_JUMP,
     R_BACKWARD_JUMP,
+    R_BEGIN_BRACKETED_PASTE,
     R_AND,
     R_CANCEL,
+    R_UNDO,
+    R_REDO,
     R_TIMEOUT,  // we didn't get interactive input within wait_on_escape_ms
-    R_MAX = R_CANCEL,
+    R_MAX = R_REDO,
     // This is a special psuedo-char that is not used other than to mark the end of the the special
     // characters so we can sanity check the enum range.
     R_SENTINAL
@@ -95,6 +98,10 @@ void update_wait_on_escape_ms();
 /// reading before returning with the value R_EOF.
 wchar_t input_common_readch(int timed);
 
+/// Returns whether there is input waiting to be read from stdin, without blocking. Characters that
+/// were unread or queued are not counted.
+bool input_common_stdin_has_input();
+
 /// Enqueue a character or a readline function to the queue of unread characters that input_readch
 /// will return before actually reading from fd 0.
 void input_common_queue_ch(wint_t ch);
@@ -108,4 +115,9 @@ void input_common_next_ch(wint_t ch);
 /// be invoked and passed arg.
 void input_common_add_callback(std::function<void(void)>);
 
+/// Sets a handler to be invoked, once per wait, when waiting for input has taken delay_ms
+/// milliseconds. A negative delay removes the handler. The handler should return quickly once
+/// input_common_stdin_has_input() says the user has typed something.
+void input_common_set_idle_handler(long delay_ms, std::function<void(void)> handler);
+
 #endif
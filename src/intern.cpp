@@ -4,35 +4,45 @@
 #include <stddef.h>
 #include <wchar.h>
 
-#include <algorithm>
-#include <memory>
-#include <vector>
+#include <unordered_set>
 
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "intern.h"
 
-bool string_less_than_string(const wchar_t *a, const wchar_t *b) { return wcscmp(a, b) < 0; }
+namespace {
+/// Hashes the characters of a string, rather than its address.
+struct string_hash_t {
+    size_t operator()(const wchar_t *str) const {
+        // FNV-1a.
+        size_t hash = 2166136261u;
+        for (; *str; str++) {
+            hash = (hash ^ (size_t)*str) * 16777619u;
+        }
+        return hash;
+    }
+};
+
+struct string_equal_t {
+    bool operator()(const wchar_t *a, const wchar_t *b) const { return wcscmp(a, b) == 0; }
+};
+}  // namespace
 
 /// The table of intern'd strings.
-owning_lock<std::vector<const wchar_t *>> string_table;
+static owning_lock<std::unordered_set<const wchar_t *, string_hash_t, string_equal_t>> string_table;
 
 static const wchar_t *intern_with_dup(const wchar_t *in, bool dup) {
     if (!in) return NULL;
 
     debug(5, L"intern %ls", in);
     auto &&lock_string_table = string_table.acquire();
-    std::vector<const wchar_t *> &string_table = lock_string_table.value;
-
-    const wchar_t *result;
-    auto iter =
-        std::lower_bound(string_table.begin(), string_table.end(), in, string_less_than_string);
-    if (iter != string_table.end() && wcscmp(*iter, in) == 0) {
-        result = *iter;
-    } else {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(iter, result);
-    }
+    auto &string_table = lock_string_table.value;
+
+    auto iter = string_table.find(in);
+    if (iter != string_table.end()) return *iter;
+
+    const wchar_t *result = dup ? wcsdup(in) : in;
+    string_table.insert(result);
     return result;
 }
 
@@ -2,11 +2,16 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "common.h"
 #include "exec.h"
 #include "fallback.h"  // IWYU pragma: keep
@@ -32,6 +37,9 @@ void io_buffer_t::print() const {
 }
 
 void io_buffer_t::read() {
+    // Without a pipe, everything was appended to the buffer directly.
+    if (!has_pipe()) return;
+
     exec_close(pipe_fd[1]);
 
     if (io_mode == IO_BUFFER) {
@@ -43,9 +51,7 @@ void io_buffer_t::read() {
 #endif
         debug(4, L"io_buffer_t::read: blocking read on fd %d", pipe_fd[0]);
         while (1) {
-            char b[4096];
-            long l;
-            l = read_blocked(pipe_fd[0], b, 4096);
+            long l = append_from_fd(pipe_fd[0]);
             if (l == 0) {
                 break;
             } else if (l < 0) {
@@ -60,13 +66,81 @@ void io_buffer_t::read() {
                 }
 
                 break;
-            } else {
-                out_buffer_append(b, l);
             }
         }
     }
 }
 
+void io_buffer_t::out_buffer_append_wide(const wcstring &str) {
+    char buff[4096];
+    size_t used = 0;
+    mbstate_t state = {};
+    for (size_t i = 0; i < str.size() && !discard; i++) {
+        if (used + MB_LEN_MAX > sizeof buff) {
+            out_buffer_append(buff, used);
+            used = 0;
+        }
+        // Characters without a narrow representation are dropped, as wcs2string does.
+        size_t amt = wchar_to_narrow(str[i], buff + used, &state);
+        if (amt != (size_t)-1) used += amt;
+    }
+    if (used > 0) out_buffer_append(buff, used);
+}
+
+long io_buffer_t::append_from_fd(int fd) {
+    // Read in chunks the size of the default pipe capacity, so a full pipe takes a single read.
+    const size_t chunk = 64 * 1024;
+    if (discard) {
+        // The output is thrown away, but the pipe is still drained so the writer can finish.
+        char b[4096];
+        return read_blocked(fd, b, sizeof b);
+    }
+
+    // Read no more than one byte past the limit, so hitting it costs no bigger a buffer.
+    const size_t amt = buffer_limit ? std::min(chunk, buffer_limit - received_size + 1) : chunk;
+    const size_t old_size = out_buffer.size();
+    out_buffer.resize(old_size + amt);
+    long l = read_blocked(fd, &out_buffer.at(old_size), amt);
+    out_buffer.resize(old_size + (l > 0 ? l : 0));
+    if (l > 0) {
+        if (buffer_limit && received_size + l > buffer_limit) {
+            set_discard();
+        } else {
+            received_size += l;
+            if (split_lines) take_complete_lines(old_size);
+        }
+    }
+    return l;
+}
+
+void io_buffer_t::set_discard() {
+    discard = true;
+    std::vector<char>().swap(out_buffer);
+    if (split_lines) split_lines->resize(split_lines_start);
+
+    // Close the read end of the pipe by putting /dev/null in its place, which keeps the fd valid
+    // for the processes still to be started and reads as end of file.
+    if (has_pipe()) {
+        int null_fd = wopen_cloexec(L"/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            if (dup2(null_fd, pipe_fd[0]) != -1) set_cloexec(pipe_fd[0]);
+            close(null_fd);
+        }
+    }
+}
+
+void io_buffer_t::take_complete_lines(size_t new_data_start) {
+    const char *const begin = out_buffer.data();
+    const char *const end = begin + out_buffer.size();
+    const char *line_start = begin;
+    const char *cursor = begin + new_data_start;
+    while (const char *stop = (const char *)memchr(cursor, '\n', end - cursor)) {
+        split_lines->push_back(str2wcstring(line_start, stop - line_start));
+        line_start = cursor = stop + 1;
+    }
+    out_buffer.erase(out_buffer.begin(), out_buffer.begin() + (line_start - begin));
+}
+
 bool io_buffer_t::avoid_conflicts_with_io_chain(const io_chain_t &ios) {
     bool result = pipe_avoid_conflicts_with_io_chain(this->pipe_fd, ios);
     if (!result) {
@@ -75,26 +149,56 @@ bool io_buffer_t::avoid_conflicts_with_io_chain(const io_chain_t &ios) {
     return result;
 }
 
-shared_ptr<io_buffer_t> io_buffer_t::create(int fd, const io_chain_t &conflicts,
-                                            size_t buffer_limit) {
-    bool success = true;
-    assert(fd >= 0);
-    shared_ptr<io_buffer_t> buffer_redirect(new io_buffer_t(fd, buffer_limit));
+void output_stream_t::flush_to_fd() {
+    ssize_t ret = write_wide_loop(flush_fd, buffer_.data(), buffer_.size());
+    buffer_.clear();
+    if (ret < 0) {
+        // Nobody is reading any more, so stop collecting output.
+        discard = true;
+    }
+}
 
-    if (exec_pipe(buffer_redirect->pipe_fd) == -1) {
+void output_stream_t::append_narrow(const char *s, size_t len) {
+    if (discard) return;
+    if (flush_fd < 0) {
+        buffer_.append(str2wcstring(s, len));
+        check_for_overflow();
+        return;
+    }
+    // Keep the output in order.
+    if (!buffer_.empty()) flush_to_fd();
+    if (!discard && write_loop(flush_fd, s, len) < 0) discard = true;
+}
+
+bool io_buffer_t::ensure_pipe(const io_chain_t &ios) {
+    if (has_pipe()) {
+        return avoid_conflicts_with_io_chain(ios);
+    }
+
+    if (exec_pipe(pipe_fd) == -1) {
         debug(1, PIPE_ERROR);
         wperror(L"pipe");
-        success = false;
-    } else if (!buffer_redirect->avoid_conflicts_with_io_chain(conflicts)) {
+        return false;
+    } else if (!avoid_conflicts_with_io_chain(ios)) {
         // The above call closes the fds on error.
-        success = false;
-    } else if (make_fd_nonblocking(buffer_redirect->pipe_fd[0]) != 0) {
+        return false;
+    } else if (make_fd_nonblocking(pipe_fd[0]) != 0) {
         debug(1, PIPE_ERROR);
         wperror(L"fcntl");
-        success = false;
+        exec_close(pipe_fd[0]);
+        exec_close(pipe_fd[1]);
+        pipe_fd[0] = pipe_fd[1] = -1;
+        return false;
     }
+    return true;
+}
 
-    if (!success) {
+shared_ptr<io_buffer_t> io_buffer_t::create(int fd, const io_chain_t &conflicts,
+                                            size_t buffer_limit, bool defer_pipe) {
+    assert(fd >= 0);
+    shared_ptr<io_buffer_t> buffer_redirect(new io_buffer_t(fd, buffer_limit));
+
+    if (!defer_pipe && !buffer_redirect->ensure_pipe(conflicts)) {
         buffer_redirect.reset();
     }
     return buffer_redirect;
@@ -161,11 +265,7 @@ void io_print(const io_chain_t &chain)
 }
 #endif
 
-/// If the given fd is used by the io chain, duplicates it repeatedly until an fd not used in the io
-/// chain is found, or we run out. If we return a new fd or an error, closes the old one. Any fd
-/// created is marked close-on-exec. Returns -1 on failure (in which case the given fd is still
-/// closed).
-static int move_fd_to_unused(int fd, const io_chain_t &io_chain) {
+int move_fd_to_unused(int fd, const io_chain_t &io_chain) {
     if (fd < 0 || io_chain.get_io_for_fd(fd).get() == NULL) {
         return fd;
     }
@@ -175,7 +275,12 @@ static int move_fd_to_unused(int fd, const io_chain_t &io_chain) {
     int new_fd = fd;
     int tmp_fd;
     do {
+#ifdef F_DUPFD_CLOEXEC
+        tmp_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
         tmp_fd = dup(fd);
+        if (tmp_fd >= 0) set_cloexec(tmp_fd);
+#endif
     } while (tmp_fd < 0 && errno == EINTR);
 
     assert(tmp_fd != fd);
@@ -186,7 +291,6 @@ static int move_fd_to_unused(int fd, const io_chain_t &io_chain) {
         // Ok, we have a new candidate fd. Recurse. If we get a valid fd, either it's the same as
         // what we gave it, or it's a new fd and what we gave it has been closed. If we get a
         // negative value, the fd also has been closed.
-        set_cloexec(tmp_fd);
         new_fd = move_fd_to_unused(tmp_fd, io_chain);
     }
 
@@ -22,6 +22,9 @@ using std::tr1::shared_ptr;
 #include "common.h"
 #include "env.h"
 
+/// How much output a builtin running in its own process collects before passing it on.
+#define OUTPUT_STREAM_FLUSH_SIZE 65536
+
 /// Describes what type of IO operation an io_data_t represents.
 enum io_mode_t { IO_FILE, IO_PIPE, IO_FD, IO_BUFFER, IO_CLOSE };
 
@@ -106,12 +109,25 @@ class io_buffer_t : public io_pipe_t {
     size_t buffer_limit;
     /// Buffer to save output in.
     std::vector<char> out_buffer;
+    /// How much output we received, including any lines moved out of out_buffer.
+    size_t received_size;
+    /// If set, complete lines are moved out of out_buffer into this list as they arrive.
+    wcstring_list_t *split_lines;
+    /// The size of split_lines before we added to it.
+    size_t split_lines_start;
 
     explicit io_buffer_t(int f, size_t limit)
         : io_pipe_t(IO_BUFFER, f, false /* not input */),
           discard(false),
           buffer_limit(limit),
-          out_buffer() {}
+          out_buffer(),
+          received_size(0),
+          split_lines(NULL),
+          split_lines_start(0) {}
+
+    /// Move the complete lines at the start of out_buffer to split_lines. Only the data from
+    /// new_data_start on is new, and the data before it contains no newline.
+    void take_complete_lines(size_t new_data_start);
 
    public:
     virtual void print() const;
@@ -121,12 +137,30 @@ class io_buffer_t : public io_pipe_t {
     /// Function to append to the buffer.
     void out_buffer_append(const char *ptr, size_t count) {
         if (discard) return;
-        if (buffer_limit && out_buffer.size() + count > buffer_limit) {
-            discard = true;
-            out_buffer.clear();
+        if (buffer_limit && received_size + count > buffer_limit) {
+            set_discard();
             return;
         }
+        received_size += count;
         out_buffer.insert(out_buffer.end(), ptr, ptr + count);
+        if (split_lines) take_complete_lines(out_buffer.size() - count);
+    }
+
+    /// Append a wide string, converting it a chunk at a time instead of making a narrow copy of it
+    /// first.
+    void out_buffer_append_wide(const wcstring &str);
+
+    /// Read once from fd straight into the end of the buffer, as much as a pipe can hold. Returns
+    /// the result of read(): the number of bytes read, 0 at end of file, or -1 on error.
+    long append_from_fd(int fd);
+
+    /// Split the output into lines as it arrives, appending each to the given list without its
+    /// newline. The buffer then only holds the last line, if it is not finished yet. This must be
+    /// called before there is any output.
+    void split_lines_into(wcstring_list_t *list) {
+        assert(received_size == 0);
+        split_lines = list;
+        split_lines_start = list->size();
     }
 
     /// Function to get a pointer to the buffer.
@@ -138,14 +172,13 @@ class io_buffer_t : public io_pipe_t {
     size_t out_buffer_size(void) const { return out_buffer.size(); }
 
     /// Function that returns true if we discarded the input because there was too much data.
-    bool output_discarded(void) { return discard; }
+    bool output_discarded(void) const { return discard; }
 
     /// Function to explicitly put the object in discard mode. Meant to be used when moving
-    /// the results from an output_stream_t to an io_buffer_t.
-    void set_discard(void) {
-        discard = true;
-        out_buffer.clear();
-    }
+    /// the results from an output_stream_t to an io_buffer_t. If there is a pipe, nothing reads
+    /// from it any more, so that processes still writing to it get SIGPIPE instead of running
+    /// forever.
+    void set_discard(void);
 
     /// This is used to transfer the buffer limit for this object to a output_stream_t object.
     size_t get_buffer_limit(void) { return buffer_limit; }
@@ -153,6 +186,14 @@ class io_buffer_t : public io_pipe_t {
     /// Ensures that the pipes do not conflict with any fd redirections in the chain.
     bool avoid_conflicts_with_io_chain(const io_chain_t &ios);
 
+    /// Whether the pipe has been made. A buffer whose pipe was deferred only gets one once a
+    /// process needs a real fd to write to; builtins append to the buffer directly.
+    bool has_pipe() const { return pipe_fd[0] >= 0; }
+
+    /// Makes the pipe if there is none yet, and ensures that it does not conflict with any fd
+    /// redirections in the chain. Returns false if the pipe could not be made.
+    bool ensure_pipe(const io_chain_t &ios);
+
     /// Close output pipe, and read from input pipe until eof.
     void read();
 
@@ -162,8 +203,9 @@ class io_buffer_t : public io_pipe_t {
     /// \param fd the fd that will be mapped in the child process, typically STDOUT_FILENO
     /// \param conflicts A set of IO redirections. The function ensures that any pipe it makes does
     /// not conflict with an fd redirection in this list.
+    /// \param defer_pipe if set, the pipe is not made until ensure_pipe() is called
     static shared_ptr<io_buffer_t> create(int fd, const io_chain_t &conflicts,
-                                          size_t buffer_limit = 0);
+                                          size_t buffer_limit = 0, bool defer_pipe = false);
 };
 
 class io_chain_t : public std::vector<shared_ptr<io_data_t> > {
@@ -190,6 +232,12 @@ shared_ptr<io_data_t> io_chain_get(io_chain_t &src, int fd);
 /// set to -1).
 bool pipe_avoid_conflicts_with_io_chain(int fds[2], const io_chain_t &ios);
 
+/// If the given fd is used by the io chain, duplicates it repeatedly until an fd not used in the io
+/// chain is found, or we run out. If we return a new fd or an error, closes the old one. Any fd
+/// created is marked close-on-exec. Returns -1 on failure (in which case the given fd is still
+/// closed).
+int move_fd_to_unused(int fd, const io_chain_t &io_chain);
+
 /// Class representing the output that a builtin can generate.
 class output_stream_t {
    private:
@@ -202,16 +250,36 @@ class output_stream_t {
     void operator=(const output_stream_t &s);
 
     wcstring buffer_;
+    /// If nonnegative, the buffer is written to this fd whenever it grows large, instead of being
+    /// kept until the builtin is done.
+    int flush_fd;
+
+    /// Write out the buffer to flush_fd and clear it.
+    void flush_to_fd();
 
     void check_for_overflow() {
-        if (buffer_limit && buffer_.size() > buffer_limit) {
+        if (flush_fd >= 0) {
+            // Output that is passed on never piles up, so the limit does not apply.
+            if (buffer_.size() >= OUTPUT_STREAM_FLUSH_SIZE) flush_to_fd();
+        } else if (buffer_limit && buffer_.size() > buffer_limit) {
             discard = true;
             buffer_.clear();
         }
     }
 
    public:
-    output_stream_t(size_t buffer_limit_) : buffer_limit(buffer_limit_), discard(false) {}
+    output_stream_t(size_t buffer_limit_)
+        : buffer_limit(buffer_limit_), discard(false), flush_fd(-1) {}
+
+    /// Pass output on to the given fd as it accumulates. This is for builtins that run in their
+    /// own process, where the fd is the pipe to the next process; whatever is still buffered when
+    /// the builtin finishes has to be written by the caller.
+    void flush_to(int fd) { flush_fd = fd; }
+
+    /// Write out whatever is still buffered to the fd given to flush_to().
+    void flush() {
+        if (flush_fd >= 0 && !buffer_.empty() && !discard) flush_to_fd();
+    }
 
 #if 0
     void set_buffer_limit(size_t buffer_limit_) { buffer_limit = buffer_limit_; }
@@ -247,6 +315,10 @@ class output_stream_t {
         check_for_overflow();
     }
 
+    /// Append text which is already narrow, such as the contents of a file. When output is passed
+    /// on to an fd, it is written as it is instead of being converted to wide text and back.
+    void append_narrow(const char *s, size_t len);
+
     void append_format(const wchar_t *format, ...) {
         if (discard) return;
         va_list va;
@@ -264,8 +336,9 @@ class output_stream_t {
 
     const wcstring &buffer() const { return buffer_; }
 
-    /// Function that returns true if we discarded the input because there was too much data.
-    bool output_discarded(void) { return discard; }
+    /// Function that returns true if we discarded the input because there was too much data. Output
+    /// that is passed on is only discarded once writing it failed, which is not reported here.
+    bool output_discarded(void) { return discard && flush_fd < 0; }
 
     bool empty() const { return buffer_.empty(); }
 };
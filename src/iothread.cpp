@@ -9,7 +9,12 @@
 #include <unistd.h>
 #include <atomic>
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <queue>
 
 #include "common.h"
@@ -26,6 +31,9 @@
 #define IO_MAX_THREADS 64
 #endif
 
+// How long an idle thread waits for another request before exiting.
+#define IO_WAIT_FOR_WORK_DURATION_MS 500
+
 // Values for the wakeup bytes sent to the ioport.
 #define IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE 99
 #define IO_SERVICE_RESULT_QUEUE 100
@@ -51,40 +59,45 @@ struct spawn_request_t {
 };
 
 struct main_thread_request_t {
-    std::atomic<bool> done{false};
     void_function_t func;
+    // Ready once func has run.
+    std::promise<void> done;
 
-    main_thread_request_t(void_function_t &&f) : func(f) {}
-
-    // No moving OR copying
-    // main_thread_requests are always stack allocated, and we deal in pointers to them
-    void operator=(const main_thread_request_t &) = delete;
-    main_thread_request_t(const main_thread_request_t &) = delete;
-    main_thread_request_t(main_thread_request_t &&) = delete;
+    explicit main_thread_request_t(void_function_t &&f) : func(std::move(f)) {}
 };
 
-// Spawn support. Requests are allocated and come in on request_queue and go out on result_queue
+// Spawn support. Requests are allocated and come in on request_queues and go out on result_queue.
+// Each priority has its own queue; requests start in order of priority, then in the order they
+// were made.
 struct thread_data_t {
-    std::queue<spawn_request_t> request_queue;
+    std::queue<spawn_request_t> request_queues[iothread_priority_count];
+    size_t queued_count = 0;
     int thread_count = 0;
+    // Threads that finished their work and wait for more before exiting.
+    int idle_thread_count = 0;
+};
+static std::mutex s_spawn_requests_lock;
+static std::condition_variable s_spawn_requests_cond;
+static thread_data_t s_spawn_requests;
+
+// Finished requests waiting for their completion to run on the main thread. Workers push onto this
+// list without locking, and the main thread takes the whole list at once.
+struct result_node_t {
+    spawn_request_t req;
+    result_node_t *next;
 };
-static owning_lock<thread_data_t> s_spawn_requests;
-static owning_lock<std::queue<spawn_request_t>> s_result_queue;
+static std::atomic<result_node_t *> s_result_list{nullptr};
 
 // "Do on main thread" support.
-static std::mutex s_main_thread_performer_lock;               // protects the main thread requests
-static std::condition_variable s_main_thread_performer_cond;  // protects the main thread requests
-static std::mutex s_main_thread_request_q_lock;               // protects the queue
-static std::queue<main_thread_request_t *> s_main_thread_request_queue;
+static owning_lock<std::queue<std::unique_ptr<main_thread_request_t>>> s_main_thread_requests;
 
 // Notifying pipes.
 static int s_read_pipe, s_write_pipe;
 
 static void iothread_init(void) {
-    static bool inited = false;
-    if (!inited) {
-        inited = true;
-
+    // This may be called from background threads, see iothread_perform_parallel.
+    static std::once_flag inited;
+    std::call_once(inited, []() {
         // Initialize the completion pipes.
         int pipes[2] = {0, 0};
         assert_with_errno(pipe(pipes) != -1);
@@ -93,22 +106,50 @@ static void iothread_init(void) {
 
         set_cloexec(s_read_pipe);
         set_cloexec(s_write_pipe);
-    }
+    });
 }
 
+/// Take the highest priority request, waiting a while for one if there is none. Returns false if
+/// the thread should exit, having already removed it from the thread count.
 static bool dequeue_spawn_request(spawn_request_t *result) {
-    auto &&locker = s_spawn_requests.acquire();
-    thread_data_t &td = locker.value;
-    if (!td.request_queue.empty()) {
-        *result = std::move(td.request_queue.front());
-        td.request_queue.pop();
-        return true;
+    std::unique_lock<std::mutex> locker(s_spawn_requests_lock);
+    thread_data_t &td = s_spawn_requests;
+    if (td.queued_count == 0) {
+        // Linger, so that a burst of requests (such as one per keypress) doesn't spawn a thread for
+        // each. Any wakeup that finds the queue empty makes the thread exit; iothread_drain_all
+        // relies on this.
+        td.idle_thread_count++;
+        s_spawn_requests_cond.wait_for(locker,
+                                       std::chrono::milliseconds(IO_WAIT_FOR_WORK_DURATION_MS));
+        td.idle_thread_count--;
     }
+    for (int prio = iothread_priority_count - 1; prio >= 0; prio--) {
+        std::queue<spawn_request_t> &queue = td.request_queues[prio];
+        if (!queue.empty()) {
+            *result = std::move(queue.front());
+            queue.pop();
+            td.queued_count--;
+            return true;
+        }
+    }
+
+    // Decrement the count under the same lock that found the queue empty. Otherwise a request made
+    // in between could see this thread as available, and nobody would handle it.
+    td.thread_count--;
+    assert(td.thread_count >= 0);
     return false;
 }
 
-static void enqueue_thread_result(spawn_request_t req) {
-    s_result_queue.acquire().value.push(std::move(req));
+/// Add a finished request to the result list. Returns true if the list was empty, in which case the
+/// main thread needs to be told; otherwise a wakeup is already on its way.
+static bool enqueue_thread_result(spawn_request_t req) {
+    result_node_t *node = new result_node_t{std::move(req), nullptr};
+    result_node_t *head = s_result_list.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!s_result_list.compare_exchange_weak(head, node, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+    return head == nullptr;
 }
 
 static void *this_thread() { return (void *)(intptr_t)pthread_self(); }
@@ -126,23 +167,16 @@ static void *iothread_worker(void *unused) {
         // If there's a completion handler, we have to enqueue it on the result queue.
         // Note we're using std::function's weirdo operator== here
         if (req.completion != nullptr) {
-            // Enqueue the result, and tell the main thread about it.
-            enqueue_thread_result(std::move(req));
-            const char wakeup_byte = IO_SERVICE_RESULT_QUEUE;
-            assert_with_errno(write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte) != -1);
+            // Enqueue the result, and tell the main thread about it unless a burst of results
+            // already did.
+            if (enqueue_thread_result(std::move(req))) {
+                const char wakeup_byte = IO_SERVICE_RESULT_QUEUE;
+                assert_with_errno(write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte) !=
+                                  -1);
+            }
         }
     }
 
-    // We believe we have exhausted the thread request queue. We want to decrement
-    // thread_count and exit. But it's possible that a request just came in. Furthermore,
-    // it's possible that the main thread saw that thread_count is full, and decided to not
-    // spawn a new thread, trusting in one of the existing threads to handle it. But we've already
-    // committed to not handling anything else. Therefore, we have to decrement
-    // the thread count under the lock, which we still hold. Likewise, the main thread must
-    // check the value under the lock.
-    int new_thread_count = --s_spawn_requests.acquire().value.thread_count;
-    assert(new_thread_count >= 0);
-
     debug(5, "pthread %p exiting", this_thread());
     // We're done.
     return NULL;
@@ -170,9 +204,12 @@ static void iothread_spawn() {
     DIE_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &saved_set, NULL));
 }
 
-int iothread_perform_impl(void_function_t &&func, void_function_t &&completion) {
-    ASSERT_IS_MAIN_THREAD();
+int iothread_perform_impl(void_function_t &&func, void_function_t &&completion,
+                          iothread_priority_t priority) {
+    // Completions run on the main thread, so only it may ask for them.
+    if (completion != nullptr) ASSERT_IS_MAIN_THREAD();
     ASSERT_IS_NOT_FORKED_CHILD();
+    assert(priority >= 0 && priority < iothread_priority_count);
     iothread_init();
 
     struct spawn_request_t req(std::move(func), std::move(completion));
@@ -180,12 +217,16 @@ int iothread_perform_impl(void_function_t &&func, void_function_t &&completion)
     bool spawn_new_thread = false;
     {
         // Lock around a local region.
-        auto &&locker = s_spawn_requests.acquire();
-        thread_data_t &td = locker.value;
-        td.request_queue.push(std::move(req));
-        if (td.thread_count < IO_MAX_THREADS) {
+        scoped_lock locker(s_spawn_requests_lock);
+        thread_data_t &td = s_spawn_requests;
+        td.request_queues[priority].push(std::move(req));
+        td.queued_count++;
+        // Hand the request to an idle thread if there are enough of them for everything queued.
+        if (td.queued_count > (size_t)td.idle_thread_count && td.thread_count < IO_MAX_THREADS) {
             td.thread_count++;
             spawn_new_thread = true;
+        } else if (td.idle_thread_count > 0) {
+            s_spawn_requests_cond.notify_one();
         }
         local_thread_count = td.thread_count;
     }
@@ -216,6 +257,11 @@ void iothread_service_completion(void) {
     }
 }
 
+static int iothread_thread_count() {
+    scoped_lock locker(s_spawn_requests_lock);
+    return s_spawn_requests.thread_count;
+}
+
 static bool iothread_wait_for_pending_completions(long timeout_usec) {
     const long usec_per_sec = 1000000;
     struct timeval tv;
@@ -244,16 +290,21 @@ void iothread_drain_all(void) {
 
 #define TIME_DRAIN 0
 #if TIME_DRAIN
-    int thread_count = s_spawn_requests.acquire().value.thread_count;
+    int thread_count = iothread_thread_count();
     double now = timef();
 #endif
 
-    // Nasty polling via select().
-    while (s_spawn_requests.acquire().value.thread_count > 0) {
+    // Nasty polling via select(). Idle threads exit once woken.
+    while (iothread_thread_count() > 0) {
+        s_spawn_requests_cond.notify_all();
         if (iothread_wait_for_pending_completions(1000)) {
             iothread_service_completion();
         }
     }
+    // The last thread may have posted its completion just before exiting; run it too.
+    while (iothread_wait_for_pending_completions(0)) {
+        iothread_service_completion();
+    }
 #if TIME_DRAIN
     double after = timef();
     fwprintf(stdout, L"(Waited %.02f msec for %d thread(s) to drain)\n", 1000 * (after - now),
@@ -265,82 +316,109 @@ void iothread_drain_all(void) {
 static void iothread_service_main_thread_requests(void) {
     ASSERT_IS_MAIN_THREAD();
 
-    // Move the queue to a local variable.
-    std::queue<main_thread_request_t *> request_queue;
-    {
-        scoped_lock queue_lock(s_main_thread_request_q_lock);
-        request_queue.swap(s_main_thread_request_queue);
-    }
-
-    if (!request_queue.empty()) {
-        // Perform each of the functions. Note we are NOT responsible for deleting these. They are
-        // stack allocated in their respective threads!
-        while (!request_queue.empty()) {
-            main_thread_request_t *req = request_queue.front();
-            request_queue.pop();
-            req->func();
-            req->done = true;
-        }
+    // Move the queue to a local variable. Requests made while we run these get a new wakeup.
+    std::queue<std::unique_ptr<main_thread_request_t>> request_queue;
+    s_main_thread_requests.acquire().value.swap(request_queue);
 
-        // Ok, we've handled everybody. Announce the good news, and allow ourselves to be unlocked.
-        // Note we must do this while holding the lock. Otherwise we race with the waiting threads:
-        //
-        // 1. waiting thread checks for done, sees false
-        // 2. main thread performs request, sets done to true, posts to condition
-        // 3. waiting thread unlocks lock, waits on condition (forever)
-        //
-        // Because the waiting thread performs step 1 under the lock, if we take the lock, we avoid
-        // posting before the waiting thread is waiting.
-        scoped_lock broadcast_lock(s_main_thread_performer_lock);
-        s_main_thread_performer_cond.notify_all();
+    // Perform each of the functions, and tell each waiting thread that it's done.
+    while (!request_queue.empty()) {
+        std::unique_ptr<main_thread_request_t> req = std::move(request_queue.front());
+        request_queue.pop();
+        req->func();
+        req->done.set_value();
     }
 }
 
 // Service the queue of results
 static void iothread_service_result_queue() {
-    // Move the queue to a local variable.
-    std::queue<spawn_request_t> result_queue;
-    s_result_queue.acquire().value.swap(result_queue);
+    // Take the whole list. It is newest first, so reverse it to run completions in order.
+    result_node_t *node = s_result_list.exchange(nullptr, std::memory_order_acquire);
+    result_node_t *oldest = NULL;
+    while (node) {
+        result_node_t *next = node->next;
+        node->next = oldest;
+        oldest = node;
+        node = next;
+    }
 
     // Perform each completion in order
-    while (!result_queue.empty()) {
-        spawn_request_t req(std::move(result_queue.front()));
-        result_queue.pop();
+    while (oldest) {
+        std::unique_ptr<result_node_t> done(oldest);
+        oldest = oldest->next;
         // ensure we don't invoke empty functions, that raises an exception
-        if (req.completion != nullptr) {
-            req.completion();
+        if (done->req.completion != nullptr) {
+            done->req.completion();
         }
     }
 }
 
+std::future<void> iothread_enqueue_on_main(void_function_t &&func) {
+    ASSERT_IS_NOT_FORKED_CHILD();
+    iothread_init();
+    std::unique_ptr<main_thread_request_t> req = make_unique<main_thread_request_t>(std::move(func));
+    std::future<void> result = req->done.get_future();
+
+    // Only the request that makes the queue non-empty wakes the main thread, which then performs
+    // all requests queued by that time.
+    bool was_empty;
+    {
+        auto &&queue = s_main_thread_requests.acquire();
+        was_empty = queue.value.empty();
+        queue.value.push(std::move(req));
+    }
+    if (was_empty) {
+        const char wakeup_byte = IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE;
+        assert_with_errno(write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte) != -1);
+    }
+    return result;
+}
+
 void iothread_perform_on_main(void_function_t &&func) {
     if (is_main_thread()) {
         func();
         return;
     }
+    iothread_enqueue_on_main(std::move(func)).wait();
+}
 
-    // Make a new request. Note we are synchronous, so this can be stack allocated!
-    main_thread_request_t req(std::move(func));
-
-    // Append it. Do not delete the nested scope as it is crucial to the proper functioning of this
-    // code by virtue of the lock management.
-    {
-        scoped_lock queue_lock(s_main_thread_request_q_lock);
-        s_main_thread_request_queue.push(&req);
+namespace {
+/// The calls made by one iothread_perform_parallel. Background threads may only get to it after
+/// all calls are done, so it is shared with them.
+struct parallel_batch_t {
+    std::function<void(size_t)> func;
+    size_t count;
+    std::atomic<size_t> next{0};
+
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t done = 0;
+
+    parallel_batch_t(const std::function<void(size_t)> &f, size_t c) : func(f), count(c) {}
+
+    /// Make calls until none are left to start.
+    void run() {
+        size_t idx;
+        while ((idx = next++) < count) {
+            func(idx);
+            scoped_lock locker(lock);
+            if (++done == count) cond.notify_all();
+        }
     }
-
-    // Tell the pipe.
-    const char wakeup_byte = IO_SERVICE_MAIN_THREAD_REQUEST_QUEUE;
-    assert_with_errno(write_loop(s_write_pipe, &wakeup_byte, sizeof wakeup_byte) != -1);
-
-    // Wait on the condition, until we're done.
-    std::unique_lock<std::mutex> perform_lock(s_main_thread_performer_lock);
-    while (!req.done) {
-        // It would be nice to support checking for cancellation here, but the clients need a
-        // deterministic way to clean up to avoid leaks
-        s_main_thread_performer_cond.wait(perform_lock);
+};
+}  // anonymous namespace
+
+void iothread_perform_parallel(size_t count, size_t max_threads,
+                               const std::function<void(size_t)> &func) {
+    if (count == 0) return;
+    auto batch = std::make_shared<parallel_batch_t>(func, count);
+    size_t helpers = std::min(max_threads, count - 1);
+    for (size_t i = 0; i < helpers; i++) {
+        iothread_perform_impl([=]() { batch->run(); }, void_function_t());
     }
+    batch->run();
 
-    // Ok, the request must now be done.
-    assert(req.done);
+    std::unique_lock<std::mutex> locker(batch->lock);
+    while (batch->done < batch->count) {
+        batch->cond.wait(locker);
+    }
 }
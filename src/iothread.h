@@ -2,9 +2,22 @@
 #ifndef FISH_IOTHREAD_H
 #define FISH_IOTHREAD_H
 
+#include <stddef.h>
+
 #include <functional>
+#include <future>
 #include <type_traits>
 
+/// The order in which queued requests start, lowest first. Requests only queue when the maximum
+/// number of threads are busy.
+enum iothread_priority_t {
+    iothread_priority_background,  // work nobody waits on, like history file detection
+    iothread_priority_default,
+    iothread_priority_autosuggest,
+    iothread_priority_highlight,
+    iothread_priority_count
+};
+
 /// Runs a command on a thread.
 ///
 /// \param handler The function to execute on a background thread. Accepts an arbitrary context
@@ -28,7 +41,8 @@ void iothread_service_completion(void);
 void iothread_drain_all(void);
 
 // Internal implementation
-int iothread_perform_impl(std::function<void(void)> &&func, std::function<void(void)> &&completion);
+int iothread_perform_impl(std::function<void(void)> &&func, std::function<void(void)> &&completion,
+                          iothread_priority_t priority = iothread_priority_default);
 
 // Template helpers
 // This is the glue part of the handler-completion handoff
@@ -39,13 +53,15 @@ int iothread_perform_impl(std::function<void(void)> &&func, std::function<void(v
 template <typename T>
 struct _iothread_trampoline {
     template <typename HANDLER, typename COMPLETION>
-    static int perform(const HANDLER &handler, const COMPLETION &completion) {
+    static int perform(const HANDLER &handler, const COMPLETION &completion,
+                       iothread_priority_t priority) {
         T *result = new T();  // TODO: placement new?
         return iothread_perform_impl([=]() { *result = handler(); },
                                      [=]() {
                                          completion(std::move(*result));
                                          delete result;
-                                     });
+                                     },
+                                     priority);
     }
 };
 
@@ -53,8 +69,9 @@ struct _iothread_trampoline {
 template <>
 struct _iothread_trampoline<void> {
     template <typename HANDLER, typename COMPLETION>
-    static int perform(const HANDLER &handler, const COMPLETION &completion) {
-        return iothread_perform_impl(handler, completion);
+    static int perform(const HANDLER &handler, const COMPLETION &completion,
+                       iothread_priority_t priority) {
+        return iothread_perform_impl(handler, completion, priority);
     }
 };
 
@@ -63,16 +80,31 @@ struct _iothread_trampoline<void> {
 // In other words, this is like COMPLETION(HANDLER()) except the handler part is invoked
 // on a background thread.
 template <typename HANDLER, typename COMPLETION>
-int iothread_perform(const HANDLER &handler, const COMPLETION &completion) {
-    return _iothread_trampoline<decltype(handler())>::perform(handler, completion);
+int iothread_perform(const HANDLER &handler, const COMPLETION &completion,
+                     iothread_priority_t priority = iothread_priority_default) {
+    return _iothread_trampoline<decltype(handler())>::perform(handler, completion, priority);
 }
 
 // variant of iothread_perform without a completion handler
-inline int iothread_perform(std::function<void(void)> &&func) {
-    return iothread_perform_impl(std::move(func), std::function<void(void)>());
+inline int iothread_perform(std::function<void(void)> &&func,
+                            iothread_priority_t priority = iothread_priority_default) {
+    return iothread_perform_impl(std::move(func), std::function<void(void)>(), priority);
 }
 
 /// Performs a function on the main thread, blocking until it completes.
 void iothread_perform_on_main(std::function<void(void)> &&func);
 
+/// Queues a function to be performed on the main thread, and returns without waiting for it. The
+/// future becomes ready once the function has run. A background thread may queue several functions
+/// before waiting on any of them; the main thread performs everything queued in one go. The main
+/// thread must not wait on the future, as it would wait for itself.
+std::future<void> iothread_enqueue_on_main(std::function<void(void)> &&func);
+
+/// Calls func(i) for every i below count, on up to max_threads background threads as well as the
+/// calling thread, and returns once all calls have finished. Unlike iothread_perform, this may be
+/// called from any thread. Calls that no background thread has started yet are made by the calling
+/// thread, so this never waits for the thread pool to free up.
+void iothread_perform_parallel(size_t count, size_t max_threads,
+                               const std::function<void(size_t)> &func);
+
 #endif
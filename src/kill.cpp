@@ -5,29 +5,97 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <stddef.h>
-#include <algorithm>
-#include <list>
-#include <memory>
+#include <functional>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "kill.h"
+#include "sanity.h"
 
-/** Kill ring */
-typedef std::list<wcstring> kill_list_t;
-static kill_list_t kill_list;
+/// The entries of the kill ring, most recent first, in a circular buffer of kill_capacity slots
+/// starting at kill_head. Once the buffer is full, adding an entry drops the oldest one.
+static std::vector<wcstring> kill_slots;
+static size_t kill_head = 0;
+static size_t kill_count = 0;
+static size_t kill_capacity = KILL_RING_CAPACITY;
 
-void kill_add(const wcstring &str) {
-    ASSERT_IS_MAIN_THREAD();
-    if (str.empty()) return;
-    kill_list.push_front(str);
+/// The hash of the entry in each slot, and the slots holding each hash, so an entry can be found
+/// without comparing it against every other one.
+static std::vector<size_t> kill_hashes;
+typedef std::unordered_multimap<size_t, size_t> kill_index_t;
+static kill_index_t kill_index;
+
+/// Return the slot of the entry at the given position, 0 being the most recent.
+static size_t kill_slot_at(size_t pos) { return (kill_head + pos) % kill_capacity; }
+
+/// Return the index entry pointing at the given slot.
+static kill_index_t::iterator kill_index_entry(size_t slot) {
+    auto range = kill_index.equal_range(kill_hashes.at(slot));
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == slot) return iter;
+    }
+    DIE("kill ring slot missing from its index");
+}
+
+/// Move the entry in slot from to the empty slot to.
+static void kill_move_slot(size_t from, size_t to) {
+    kill_index_entry(from)->second = to;
+    kill_slots.at(to) = std::move(kill_slots.at(from));
+    kill_slots.at(from).clear();
+    kill_hashes.at(to) = kill_hashes.at(from);
 }
 
-/// Remove first match for specified string from circular list.
+/// Empty the given slot, which must hold an entry.
+static void kill_clear_slot(size_t slot) {
+    kill_index.erase(kill_index_entry(slot));
+    wcstring().swap(kill_slots.at(slot));
+}
+
+/// Remove the entry matching the specified string, if any.
 static void kill_remove(const wcstring &s) {
     ASSERT_IS_MAIN_THREAD();
-    kill_list_t::iterator iter = std::find(kill_list.begin(), kill_list.end(), s);
-    if (iter != kill_list.end()) kill_list.erase(iter);
+    size_t slot = kill_capacity;
+    auto range = kill_index.equal_range(std::hash<wcstring>()(s));
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (kill_slots.at(iter->second) == s) {
+            slot = iter->second;
+            break;
+        }
+    }
+    if (slot == kill_capacity) return;
+
+    // Close the gap by moving the more recent entries down one, since the entry removed is most
+    // often the most recent one, when a kill is extended.
+    kill_clear_slot(slot);
+    for (size_t pos = (slot + kill_capacity - kill_head) % kill_capacity; pos > 0; pos--) {
+        kill_move_slot(kill_slot_at(pos - 1), kill_slot_at(pos));
+    }
+    kill_head = (kill_head + 1) % kill_capacity;
+    kill_count--;
+}
+
+void kill_add(const wcstring &str) {
+    ASSERT_IS_MAIN_THREAD();
+    if (str.empty()) return;
+    kill_remove(str);
+    if (kill_slots.empty()) {
+        kill_slots.resize(kill_capacity);
+        kill_hashes.resize(kill_capacity);
+    }
+    if (kill_count == kill_capacity) {
+        kill_clear_slot(kill_slot_at(kill_count - 1));
+        kill_count--;
+    }
+
+    kill_head = (kill_head + kill_capacity - 1) % kill_capacity;
+    kill_count++;
+    kill_slots.at(kill_head) = str;
+    kill_hashes.at(kill_head) = std::hash<wcstring>()(str);
+    kill_index.emplace(kill_hashes.at(kill_head), kill_head);
 }
 
 void kill_replace(const wcstring &old, const wcstring &newv) {
@@ -38,21 +106,60 @@ void kill_replace(const wcstring &old, const wcstring &newv) {
 const wchar_t *kill_yank_rotate() {
     ASSERT_IS_MAIN_THREAD();
     // Move the first element to the end.
-    if (kill_list.empty()) {
+    if (kill_count == 0) {
         return NULL;
     }
-    kill_list.splice(kill_list.end(), kill_list, kill_list.begin());
-    return kill_list.front().c_str();
+    if (kill_count < kill_capacity) kill_move_slot(kill_head, kill_slot_at(kill_count));
+    kill_head = (kill_head + 1) % kill_capacity;
+    return kill_slots.at(kill_head).c_str();
 }
 
 const wchar_t *kill_yank() {
-    if (kill_list.empty()) {
+    if (kill_count == 0) {
         return L"";
     }
-    return kill_list.front().c_str();
+    return kill_slots.at(kill_head).c_str();
+}
+
+void kill_set_capacity(size_t capacity) {
+    ASSERT_IS_MAIN_THREAD();
+    assert(capacity > 0 && "kill ring capacity must be positive");
+    if (capacity == kill_capacity) return;
+
+    // Keep the most recent entries that fit.
+    std::vector<wcstring> entries;
+    for (size_t pos = 0; pos < kill_count && pos < capacity; pos++) {
+        entries.push_back(std::move(kill_slots.at(kill_slot_at(pos))));
+    }
+    kill_slots.clear();
+    kill_slots.shrink_to_fit();
+    kill_hashes.clear();
+    kill_hashes.shrink_to_fit();
+    kill_index.clear();
+    kill_head = 0;
+    kill_count = 0;
+    kill_capacity = capacity;
+    for (auto iter = entries.rbegin(); iter != entries.rend(); ++iter) kill_add(*iter);
+}
+
+memory_usage_t kill_memory_usage() {
+    ASSERT_IS_MAIN_THREAD();
+    memory_usage_t usage;
+    usage.count = kill_count;
+    usage.bytes = kill_slots.capacity() * (sizeof(wcstring) + sizeof(size_t));
+    for (size_t pos = 0; pos < kill_count; pos++) {
+        const wcstring &str = kill_slots.at(kill_slot_at(pos));
+        // Each index entry is a hash table node holding a link, the hash and the slot.
+        usage.bytes += str.capacity() * sizeof(wchar_t) + 3 * sizeof(void *);
+    }
+    return usage;
 }
 
-void kill_sanity_check() {}
+void kill_sanity_check() {
+    if (kill_count > kill_capacity || kill_index.size() != kill_count) {
+        sanity_lose();
+    }
+}
 
 void kill_init() {}
 
@@ -5,12 +5,18 @@
 #ifndef FISH_KILL_H
 #define FISH_KILL_H
 
+#include <stddef.h>
+
 #include "common.h"
 
+/// The most entries the killring keeps by default. Adding another one drops the oldest. This can be
+/// overridden by the fish_kill_ring_limit variable.
+#define KILL_RING_CAPACITY 256
+
 /// Replace the specified string in the killring.
 void kill_replace(const wcstring &old, const wcstring &newv);
 
-/// Add a string to the top of the killring.
+/// Add a string to the top of the killring, removing any other copy of it.
 void kill_add(const wcstring &str);
 
 /// Rotate the killring.
@@ -19,6 +25,13 @@ const wchar_t *kill_yank_rotate();
 /// Paste from the killring.
 const wchar_t *kill_yank();
 
+/// Change the most entries the killring keeps, which must be positive, dropping the oldest ones
+/// that no longer fit.
+void kill_set_capacity(size_t capacity);
+
+/// Returns the number of strings in the killring, and approximately how much memory they use.
+memory_usage_t kill_memory_usage();
+
 /// Sanity check.
 void kill_sanity_check();
 
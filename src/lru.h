@@ -4,13 +4,16 @@
 
 #include <wchar.h>
 
+#include <array>
+#include <functional>
 #include <unordered_map>
 
 #include "common.h"
 
 // Least-recently-used cache class.
 //
-// This a map from wcstring to CONTENTS, that will evict entries when the count exceeds the maximum.
+// This a map from KEY (a wcstring unless given) to CONTENTS, that will evict entries when the count
+// exceeds the maximum.
 // It uses CRTP to inform clients when entries are evicted. This uses the classic LRU cache
 // structure: a dictionary mapping keys to nodes, where the nodes also form a linked list. Our
 // linked list is circular and has a sentinel node (the "mouth" - picture a snake swallowing its
@@ -19,7 +22,7 @@
 // having a "back pointer": they store an iterator to the entry in the map containing the node. This
 // allows us, given a node, to immediately locate the node and its key in the dictionary. This
 // allows us to avoid duplicating the key in the node.
-template <class DERIVED, class CONTENTS>
+template <class DERIVED, class CONTENTS, class KEY = wcstring, class HASH = std::hash<KEY>>
 class lru_cache_t {
     struct lru_node_t;
     struct lru_link_t {
@@ -37,7 +40,7 @@ class lru_cache_t {
         lru_node_t(lru_node_t &&) = default;
 
         // Our key in the map. This is owned by the map itself.
-        const wcstring *key = NULL;
+        const KEY *key = NULL;
 
         // The value from the client
         CONTENTS value;
@@ -45,16 +48,16 @@ class lru_cache_t {
         explicit lru_node_t(const CONTENTS &v) : value(std::move(v)) {}
     };
 
-    typedef typename std::unordered_map<wcstring, lru_node_t>::iterator node_iter_t;
+    typedef typename std::unordered_map<KEY, lru_node_t, HASH>::iterator node_iter_t;
 
     // Max node count. This may be (transiently) exceeded by add_node_without_eviction, which is
     // used from background threads.
-    const size_t max_node_count;
+    size_t max_node_count;
 
     // All of our nodes
     // Note that our linked list contains pointers to these nodes in the map
     // We are dependent on the iterator-noninvalidation guarantees of std::map
-    std::unordered_map<wcstring, lru_node_t> node_map;
+    std::unordered_map<KEY, lru_node_t, HASH> node_map;
 
     // Head of the linked list
     // The list is circular!
@@ -90,7 +93,7 @@ class lru_cache_t {
 
         // Pull out our key and value
         // Note we copy the key in case the map needs it to erase the node
-        wcstring key = *node->key;
+        KEY key = *node->key;
         CONTENTS value(std::move(node->value));
 
         // Remove us from the map. This deallocates node!
@@ -101,15 +104,9 @@ class lru_cache_t {
         dthis->entry_was_evicted(std::move(key), std::move(value));
     }
 
-    // Evicts the last node
-    void evict_last_node() {
-        assert(mouth.prev != &mouth);
-        evict_node(static_cast<lru_node_t *>(mouth.prev));
-    }
-
     // CRTP callback for when a node is evicted.
     // Clients can implement this
-    void entry_was_evicted(wcstring key, CONTENTS value) {
+    void entry_was_evicted(KEY key, CONTENTS value) {
         UNUSED(key);
         UNUSED(value);
     }
@@ -185,7 +182,7 @@ class lru_cache_t {
 
     // Returns the value for a given key, or NULL.
     // This counts as a "use" and so promotes the node
-    CONTENTS *get(const wcstring &key) {
+    CONTENTS *get(const KEY &key) {
         auto where = this->node_map.find(key);
         if (where == this->node_map.end()) {
             // not found
@@ -196,7 +193,7 @@ class lru_cache_t {
     }
 
     // Evicts the node for a given key, returning true if a node was evicted.
-    bool evict_node(const wcstring &key) {
+    bool evict_node(const KEY &key) {
         auto where = this->node_map.find(key);
         if (where == this->node_map.end()) return false;
         evict_node(&where->second);
@@ -205,7 +202,7 @@ class lru_cache_t {
 
     // Adds a node under the given key. Returns true if the node was added, false if the node was
     // not because a node with that key is already in the set.
-    bool insert(wcstring key, CONTENTS value) {
+    bool insert(KEY key, CONTENTS value) {
         if (!this->insert_no_eviction(std::move(key), std::move(value))) {
             return false;
         }
@@ -218,7 +215,7 @@ class lru_cache_t {
 
     // Adds a node under the given key without triggering eviction. Returns true if the node was
     // added, false if the node was not because a node with that key is already in the set.
-    bool insert_no_eviction(wcstring key, CONTENTS value) {
+    bool insert_no_eviction(KEY key, CONTENTS value) {
         // Try inserting; return false if it was already in the set.
         auto iter_inserted = this->node_map.emplace(std::move(key), lru_node_t(std::move(value)));
         if (!iter_inserted.second) {
@@ -242,6 +239,18 @@ class lru_cache_t {
     // Number of entries
     size_t size() const { return this->node_map.size(); }
 
+    // The maximum number of entries.
+    size_t max_size() const { return this->max_node_count; }
+
+    // Change the maximum number of entries, evicting the least recently used ones if there are now
+    // too many.
+    void set_max_size(size_t max_size) {
+        this->max_node_count = max_size;
+        while (this->node_map.size() > max_node_count) {
+            evict_last_node();
+        }
+    }
+
     // Given a binary function F implementing less-than on the contents, place the nodes in sorted
     // order.
     template <typename F>
@@ -268,6 +277,12 @@ class lru_cache_t {
         mouth.prev = prev;
     }
 
+    // Evicts the least recently used node. The cache must not be empty.
+    void evict_last_node() {
+        assert(mouth.prev != &mouth);
+        evict_node(static_cast<lru_node_t *>(mouth.prev));
+    }
+
     void evict_all_nodes(void) {
         while (this->size() > 0) {
             evict_last_node();
@@ -279,7 +294,7 @@ class lru_cache_t {
         const lru_link_t *node;
 
        public:
-        typedef std::pair<const wcstring &, const CONTENTS &> value_type;
+        typedef std::pair<const KEY &, const CONTENTS &> value_type;
 
         explicit iterator(const lru_link_t *val) : node(val) {}
         void operator++() { node = node->prev; }
@@ -331,4 +346,133 @@ class lru_cache_t {
     }
 };
 
+/// Counts describing a sharded_lru_cache_t, summed over its shards.
+struct lru_cache_stats_t {
+    /// Entries currently held, and the bytes they were reported to take.
+    size_t entries = 0;
+    size_t bytes = 0;
+    /// Lookups that found an entry, and those that did not.
+    size_t hits = 0;
+    size_t misses = 0;
+    /// Entries dropped to make room, and those dropped because they were too old.
+    size_t evictions = 0;
+    size_t expirations = 0;
+};
+
+// Least-recently-used cache that may be used from several threads at once.
+//
+// The keys are spread over a fixed number of shards, each an lru_cache_t behind its own lock, so
+// threads working on different keys rarely wait for each other. The limits on the entry count and
+// the bytes used apply to each shard in proportion; eviction is least-recently-used within a shard.
+// Entries may also be given a maximum age, after which lookups no longer return them. Since other
+// threads may evict an entry at any time, lookups return a copy of the contents: use a
+// std::shared_ptr for contents that are expensive to copy.
+template <class KEY, class CONTENTS, class HASH = std::hash<KEY>>
+class sharded_lru_cache_t {
+    enum { shard_count = 8 };
+
+    struct entry_t {
+        CONTENTS value;
+        // The size the entry was inserted with.
+        size_t bytes;
+        // When the entry was inserted, from timef().
+        double when;
+    };
+
+    class shard_t : public lru_cache_t<shard_t, entry_t, KEY, HASH> {
+       public:
+        size_t max_bytes = 0;
+        lru_cache_stats_t stats;
+
+        void entry_was_evicted(KEY key, entry_t entry) {
+            UNUSED(key);
+            stats.bytes -= entry.bytes;
+        }
+    };
+
+    std::array<owning_lock<shard_t>, shard_count> shards;
+
+    // How long, in seconds, entries are returned after they were inserted. 0 means forever.
+    const double max_age;
+
+    owning_lock<shard_t> &shard_for(const KEY &key) { return shards[HASH()(key) % shard_count]; }
+
+   public:
+    // Constructor. A \p max_bytes of 0 means only the entry count is limited.
+    explicit sharded_lru_cache_t(size_t max_size = 1024, size_t max_bytes = 0,
+                                 double max_entry_age = 0)
+        : max_age(max_entry_age) {
+        for (auto &shard : shards) {
+            auto &&locker = shard.acquire();
+            locker.value.set_max_size((max_size + shard_count - 1) / shard_count);
+            locker.value.max_bytes = (max_bytes + shard_count - 1) / shard_count;
+        }
+    }
+
+    // Looks up the entry for the given key, storing a copy of its contents in \p out if it is
+    // not NULL. Returns whether an entry was found. This counts as a "use" of the entry.
+    bool get(const KEY &key, CONTENTS *out) {
+        auto &&locker = shard_for(key).acquire();
+        shard_t &shard = locker.value;
+        const entry_t *entry = shard.get(key);
+        if (entry && max_age > 0 && timef() - entry->when >= max_age) {
+            shard.evict_node(key);
+            shard.stats.expirations++;
+            entry = NULL;
+        }
+        if (!entry) {
+            shard.stats.misses++;
+            return false;
+        }
+        shard.stats.hits++;
+        if (out) *out = entry->value;
+        return true;
+    }
+
+    // Stores the contents under the given key, replacing any entry already there. \p bytes is the
+    // size the entry counts for against the byte limit.
+    void insert(KEY key, CONTENTS value, size_t bytes = 0) {
+        auto &&locker = shard_for(key).acquire();
+        shard_t &shard = locker.value;
+        shard.evict_node(key);
+        shard.insert_no_eviction(std::move(key), entry_t{std::move(value), bytes, timef()});
+        shard.stats.bytes += bytes;
+        while (shard.size() > shard.max_size() ||
+               (shard.max_bytes > 0 && shard.stats.bytes > shard.max_bytes)) {
+            shard.evict_last_node();
+            shard.stats.evictions++;
+        }
+    }
+
+    // Removes the entry for the given key, returning true if there was one.
+    bool evict(const KEY &key) {
+        auto &&locker = shard_for(key).acquire();
+        return locker.value.evict_node(key);
+    }
+
+    // Removes all entries.
+    void evict_all() {
+        for (auto &shard : shards) {
+            auto &&locker = shard.acquire();
+            locker.value.evict_all_nodes();
+        }
+    }
+
+    // Returns the counts for all shards together.
+    lru_cache_stats_t stats() {
+        lru_cache_stats_t result;
+        for (auto &shard : shards) {
+            auto &&locker = shard.acquire();
+            const lru_cache_stats_t &stats = locker.value.stats;
+            result.entries += locker.value.size();
+            result.bytes += stats.bytes;
+            result.hits += stats.hits;
+            result.misses += stats.misses;
+            result.evictions += stats.evictions;
+            result.expirations += stats.expirations;
+        }
+        return result;
+    }
+};
+
 #endif
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #if HAVE_NCURSES_H
 #include <ncurses.h>
 #elif HAVE_NCURSES_CURSES_H
@@ -16,6 +18,7 @@
 #elif HAVE_NCURSES_TERM_H
 #include <ncurses/term.h>
 #endif
+#include <langinfo.h>
 #include <limits.h>
 #include <wchar.h>
 
@@ -38,6 +41,30 @@ static int (*out)(char c) = writeb_internal;  //!OCLINT(unused param)
 /// Whether term256 and term24bit are supported.
 static color_support_t color_support = 0;
 
+/// The bytes written with the default writer since the outermost frame was opened.
+static std::string s_frame_buffer;
+
+/// The number of open frames.
+static unsigned int s_frame_depth = 0;
+
+void output_begin_frame() { s_frame_depth++; }
+
+void output_end_frame() {
+    assert(s_frame_depth > 0);
+    if (--s_frame_depth == 0 && !s_frame_buffer.empty()) {
+        write_loop(STDOUT_FILENO, s_frame_buffer.data(), s_frame_buffer.size());
+        s_frame_buffer.clear();
+    }
+}
+
+void output_write_bytes(const char *bytes, size_t len) {
+    if (s_frame_depth > 0) {
+        s_frame_buffer.append(bytes, len);
+    } else {
+        write_loop(STDOUT_FILENO, bytes, len);
+    }
+}
+
 /// Set the function used for writing in move_cursor, writespace and set_color and all other output
 /// functions in this library. By default, the write call is used to give completely unbuffered
 /// output to stdout.
@@ -49,12 +76,30 @@ void output_set_writer(int (*writer)(char)) {
 /// Return the current output writer.
 int (*output_get_writer())(char) { return out; }
 
+/// The escape sequence setting an indexed color, and whether it came from terminfo and so must be
+/// written with tputs.
+struct color_escape_t {
+    std::string bytes;
+    bool from_terminfo = false;
+    bool valid = false;
+};
+
+/// The escapes for each color index, as foreground and background, so that changing colors does
+/// not run tparm each time. They depend on the terminal, so they are forgotten when the color
+/// support is set, which init_curses does after loading the terminfo entry.
+static color_escape_t s_color_escapes[2][256];
+
 /// Returns true if we think tparm can handle outputting a color index
 static bool term_supports_color_natively(unsigned int c) { return (unsigned)max_colors >= c + 1; }
 
 color_support_t output_get_color_support(void) { return color_support; }
 
-void output_set_color_support(color_support_t val) { color_support = val; }
+void output_set_color_support(color_support_t val) {
+    color_support = val;
+    for (auto &escapes : s_color_escapes) {
+        for (color_escape_t &escape : escapes) escape = color_escape_t();
+    }
+}
 
 unsigned char index_for_color(rgb_color_t c) {
     if (c.is_named() || !(output_get_color_support() & color_support_term256)) {
@@ -63,11 +108,15 @@ unsigned char index_for_color(rgb_color_t c) {
     return c.to_term256_index();
 }
 
-static bool write_color_escape(char *todo, unsigned char idx, bool is_fg) {
+/// Compute the escape sequence setting the given color index, using the terminfo capability todo.
+static void make_color_escape(char *todo, unsigned char idx, bool is_fg, color_escape_t *escape) {
+    escape->valid = true;
     if (term_supports_color_natively(idx)) {
         // Use tparm to emit color escape.
-        writembs(tparm(todo, idx));
-        return true;
+        const char *bytes = tparm(todo, idx);
+        escape->bytes = bytes ? bytes : "";
+        escape->from_terminfo = true;
+        return;
     }
 
     // We are attempting to bypass the term here. Generate the ANSI escape sequence ourself.
@@ -84,12 +133,21 @@ static bool write_color_escape(char *todo, unsigned char idx, bool is_fg) {
     } else {
         snprintf(buff, sizeof buff, "\e[%d;5;%dm", is_fg ? 38 : 48, idx);
     }
+    escape->bytes = buff;
+    escape->from_terminfo = false;
+}
+
+static bool write_color_escape(char *todo, unsigned char idx, bool is_fg) {
+    color_escape_t &escape = s_color_escapes[is_fg][idx];
+    if (!escape.valid) make_color_escape(todo, idx, is_fg, &escape);
 
+    if (escape.from_terminfo) {
+        writembs(escape.bytes.empty() ? NULL : &escape.bytes[0]);
+        return true;
+    }
     int (*writer)(char) = output_get_writer();
     if (writer) {
-        for (size_t i = 0; buff[i]; i++) {
-            writer(buff[i]);
-        }
+        for (char c : escape.bytes) writer(c);
     }
 
     return true;
@@ -172,6 +230,7 @@ void set_color(rgb_color_t c, rgb_color_t c2) {
 #endif
     ASSERT_IS_MAIN_THREAD();
     if (!cur_term) return;
+    scoped_output_frame_t frame;
 
     const rgb_color_t normal = rgb_color_t::normal();
     static rgb_color_t last_color = rgb_color_t::normal();
@@ -374,7 +433,7 @@ void set_color(rgb_color_t c, rgb_color_t c2) {
 
 /// Default output method, simply calls write() on stdout.
 static int writeb_internal(char c) {  // cppcheck
-    write_loop(1, &c, 1);
+    output_write_bytes(&c, 1);
     return 0;
 }
 
@@ -386,34 +445,80 @@ int writeb(tputs_arg_t b) {
     return 0;
 }
 
+/// Returns whether the current locale encodes characters as UTF-8.
+static bool locale_is_utf8() {
+    const char *codeset = nl_langinfo(CODESET);
+    return codeset != NULL && (!strcasecmp(codeset, "UTF-8") || !strcasecmp(codeset, "utf8"));
+}
+
+/// Append the narrow encoding of \p len wide characters to \p out, all at once. Characters with no
+/// representation in the locale are left out. Characters specially encoded with ENCODE_DIRECT_BASE
+/// stand for the bytes they encode.
+static void narrow_append(const wchar_t *str, size_t len, std::string *out) {
+    out->reserve(out->size() + len);
+    const bool single_byte = MB_CUR_MAX == 1;
+    const bool utf8 = !single_byte && locale_is_utf8();
+    mbstate_t state = {};
+    char buff[MB_LEN_MAX + 1];
+    for (size_t i = 0; i < len; i++) {
+        const wchar_t wc = str[i];
+        if (wc >= ENCODE_DIRECT_BASE && wc < ENCODE_DIRECT_BASE + 256) {
+            out->push_back(wc - ENCODE_DIRECT_BASE);
+        } else if (wc >= 0 && wc < 0x80) {
+            out->push_back((char)wc);
+        } else if (single_byte) {
+            // Single-byte locale (C/POSIX/ISO-8859). If `wc` contains a wide character we emit a
+            // question-mark.
+            out->push_back(wc & ~0xFF ? '?' : (char)wc);
+        } else if (utf8) {
+            // Encode it ourselves, rather than asking wcrtomb() for every character.
+            const unsigned long cp = (unsigned long)wc;
+            if (cp < 0x800) {
+                out->push_back((char)(0xC0 | (cp >> 6)));
+                out->push_back((char)(0x80 | (cp & 0x3F)));
+            } else if (cp < 0x10000) {
+                if (cp >= 0xD800 && cp <= 0xDFFF) continue;  // surrogates have no encoding
+                out->push_back((char)(0xE0 | (cp >> 12)));
+                out->push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                out->push_back((char)(0x80 | (cp & 0x3F)));
+            } else if (cp < 0x110000) {
+                out->push_back((char)(0xF0 | (cp >> 18)));
+                out->push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+                out->push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                out->push_back((char)(0x80 | (cp & 0x3F)));
+            }
+        } else {
+            size_t converted = wcrtomb(buff, wc, &state);
+            if (converted == (size_t)-1) {
+                state = mbstate_t();
+            } else {
+                out->append(buff, converted);
+            }
+        }
+    }
+}
+
+/// Write narrow bytes using the output method specified using output_set_writer(). The default one
+/// gets them all at once.
+static void write_narrow(const std::string &narrow) {
+    if (out == writeb_internal) {
+        output_write_bytes(narrow.data(), narrow.size());
+    } else {
+        for (char c : narrow) out(c);
+    }
+}
+
 /// Write a wide character using the output method specified using output_set_writer(). This should
 /// only be used when writing characters from user supplied strings. This is needed due to our use
 /// of the ENCODE_DIRECT_BASE mechanism to allow the user to specify arbitrary byte values to be
 /// output. Such as in a `printf` invocation that includes literal byte values such as `\x1B`.
 /// This should not be used for writing non-user supplied characters.
 int writech(wint_t ch) {
-    char buff[MB_LEN_MAX + 1];
-    size_t len;
-
-    if (ch >= ENCODE_DIRECT_BASE && ch < ENCODE_DIRECT_BASE + 256) {
-        buff[0] = ch - ENCODE_DIRECT_BASE;
-        len = 1;
-    } else if (MB_CUR_MAX == 1) {
-        // single-byte locale (C/POSIX/ISO-8859)
-        // If `wc` contains a wide character we emit a question-mark.
-        buff[0] = ch & ~0xFF ? '?' : ch;
-        len = 1;
-    } else {
-        mbstate_t state = {};
-        len = wcrtomb(buff, ch, &state);
-        if (len == (size_t)-1) {
-            return 1;
-        }
-    }
-
-    for (size_t i = 0; i < len; i++) {
-        out(buff[i]);
-    }
+    const wchar_t wc = (wchar_t)ch;
+    std::string narrow;
+    narrow_append(&wc, 1, &narrow);
+    if (narrow.empty()) return 1;
+    write_narrow(narrow);
     return 0;
 }
 
@@ -423,35 +528,9 @@ int writech(wint_t ch) {
 /// is needed because those strings may contain chars specially encoded using ENCODE_DIRECT_BASE.
 void writestr(const wchar_t *str) {
     CHECK(str, );
-
-    if (MB_CUR_MAX == 1) {
-        // Single-byte locale (C/POSIX/ISO-8859).
-        while (*str) writech(*str++);
-        return;
-    }
-
-    size_t len = wcstombs(0, str, 0);  // figure amount of space needed
-    if (len == (size_t)-1) {
-        debug(1, L"Tried to print invalid wide character string");
-        return;
-    }
-
-    // Convert the string.
-    len++;
-    char *buffer, static_buffer[256];
-    if (len <= sizeof static_buffer) {
-        buffer = static_buffer;
-    } else {
-        buffer = new char[len];
-    }
-    wcstombs(buffer, str, len);
-
-    // Write the string.
-    for (char *pos = buffer; *pos; pos++) {
-        out(*pos);
-    }
-
-    if (buffer != static_buffer) delete[] buffer;
+    std::string narrow;
+    narrow_append(str, wcslen(str), &narrow);
+    write_narrow(narrow);
 }
 
 /// Given a list of rgb_color_t, pick the "best" one, as determined by the color support. Returns
@@ -552,6 +631,7 @@ rgb_color_t parse_color(const env_var_t &var, bool is_background) {
 /// Write specified multibyte string.
 void writembs_check(char *mbs, const char *mbs_name, const char *file, long line) {
     if (mbs != NULL) {
+        scoped_output_frame_t frame;
         tputs(mbs, 1, &writeb);
     } else {
         auto term = env_get(L"TERM");
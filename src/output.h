@@ -41,6 +41,25 @@ rgb_color_t parse_color(const env_var_t &val, bool is_background);
 
 int writeb(tputs_arg_t b);
 
+/// Output written to stdout with the default writer while a frame is open is collected, and written
+/// with a single write() when the outermost frame is closed. This keeps the terminal from showing a
+/// repaint half done, and saves a system call per byte. Frames nest, and must not be held open
+/// while anything else may write to the terminal, such as a running command.
+void output_begin_frame();
+void output_end_frame();
+
+/// Opens a frame for the lifetime of the object.
+class scoped_output_frame_t {
+   public:
+    scoped_output_frame_t() { output_begin_frame(); }
+    ~scoped_output_frame_t() { output_end_frame(); }
+    scoped_output_frame_t(const scoped_output_frame_t &) = delete;
+    void operator=(const scoped_output_frame_t &) = delete;
+};
+
+/// Write bytes to stdout, or add them to the open frame.
+void output_write_bytes(const char *bytes, size_t len);
+
 void output_set_writer(int (*writer)(char));
 
 int (*output_get_writer())(char);
@@ -365,13 +365,29 @@ bool pager_t::completion_info_passes_filter(const comp_t &info) const {
 
 // Update completion_infos from unfiltered_completion_infos, to reflect the filter.
 void pager_t::refilter_completions() {
-    this->completion_infos.clear();
-    for (size_t i = 0; i < this->unfiltered_completion_infos.size(); i++) {
-        const comp_t &info = this->unfiltered_completion_infos.at(i);
-        if (this->completion_info_passes_filter(info)) {
-            this->completion_infos.push_back(info);
+    const wcstring needle = search_field_shown ? this->search_field_line.text : wcstring();
+    this->column_widths_cache.clear();
+
+    if (string_prefixes_string(this->completion_infos_needle, needle)) {
+        // Whatever matches the longer needle also matched the shorter one, either as a substring
+        // or as a case insensitive prefix. So just drop what no longer matches.
+        auto no_longer_passes = [this](const comp_t &info) {
+            return !this->completion_info_passes_filter(info);
+        };
+        this->completion_infos.erase(std::remove_if(this->completion_infos.begin(),
+                                                    this->completion_infos.end(),
+                                                    no_longer_passes),
+                                     this->completion_infos.end());
+    } else {
+        this->completion_infos.clear();
+        for (size_t i = 0; i < this->unfiltered_completion_infos.size(); i++) {
+            const comp_t &info = this->unfiltered_completion_infos.at(i);
+            if (this->completion_info_passes_filter(info)) {
+                this->completion_infos.push_back(info);
+            }
         }
     }
+    this->completion_infos_needle = needle;
 }
 
 void pager_t::set_completions(const completion_list_t &raw_completions) {
@@ -384,7 +400,9 @@ void pager_t::set_completions(const completion_list_t &raw_completions) {
     // Compute their various widths.
     measure_completion_infos(&unfiltered_completion_infos, prefix);
 
-    // Refilter them.
+    // Refilter them, starting from the whole list.
+    this->completion_infos = this->unfiltered_completion_infos;
+    this->completion_infos_needle.clear();
     this->refilter_completions();
 }
 
@@ -395,6 +413,23 @@ void pager_t::set_term_size(size_t w, size_t h) {
     available_term_height = h;
 }
 
+/// Return the preferred width of each column when completion_infos is laid out in cols columns,
+/// computing it if it is not cached.
+const std::vector<size_t> &pager_t::column_widths(size_t cols) const {
+    assert(cols > 0 && cols <= PAGER_MAX_COLS);
+    if (column_widths_cache.size() <= cols) column_widths_cache.resize(cols + 1);
+    std::vector<size_t> &widths = column_widths_cache.at(cols);
+    if (widths.empty()) {
+        widths.resize(cols, 0);
+        const size_t row_count = divide_round_up(completion_infos.size(), cols);
+        for (size_t comp_idx = 0; comp_idx < completion_infos.size(); comp_idx++) {
+            size_t col = comp_idx / row_count;
+            widths[col] = std::max(widths[col], completion_infos[comp_idx].preferred_width());
+        }
+    }
+    return widths;
+}
+
 /// Try to print the list of completions lst with the prefix prefix using cols as the number of
 /// columns. Return true if the completion list was printed, false if the terminal is too narrow for
 /// the specified number of columns. Always succeeds if cols is 1.
@@ -436,14 +471,9 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
     }
 
     // Calculate how wide the list would be.
-    for (size_t col = 0; col < cols; col++) {
-        for (size_t row = 0; row < row_count; row++) {
-            const size_t comp_idx = col * row_count + row;
-            if (comp_idx >= lst.size()) continue;
-            const comp_t &c = lst.at(comp_idx);
-            width_by_column[col] = std::max(width_by_column[col], c.preferred_width());
-        }
-    }
+    assert(&lst == &this->completion_infos);
+    const std::vector<size_t> &preferred_widths = this->column_widths(cols);
+    std::copy(preferred_widths.begin(), preferred_widths.end(), width_by_column);
 
     bool print;
     // Force fit if one column.
@@ -824,6 +854,8 @@ size_t pager_t::get_selected_column(const page_rendering_t &rendering) const {
 void pager_t::clear() {
     unfiltered_completion_infos.clear();
     completion_infos.clear();
+    completion_infos_needle.clear();
+    column_widths_cache.clear();
     prefix.clear();
     selected_completion_idx = PAGER_SELECTION_NONE;
     fully_disclosed = false;
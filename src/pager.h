@@ -104,8 +104,18 @@ class pager_t {
     // The unfiltered list. Note there's a lot of duplication here.
     comp_info_list_t unfiltered_completion_infos;
 
+    // The search text that completion_infos was filtered with, empty if it is unfiltered.
+    wcstring completion_infos_needle;
+
     wcstring prefix;
 
+    // The preferred width of each column of completion_infos, indexed by the number of columns.
+    // These only change with the filtered list, so they are computed on demand and kept while the
+    // selection moves and the list scrolls. Emptied by refilter_completions().
+    mutable std::vector<std::vector<size_t>> column_widths_cache;
+
+    const std::vector<size_t> &column_widths(size_t cols) const;
+
     bool completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst,
                               page_rendering_t *rendering, size_t suggested_start_row) const;
 
@@ -158,7 +168,8 @@ class pager_t {
     // Clears all completions and the prefix.
     void clear();
 
-    // Updates the completions list per the filter.
+    // Updates the completions list per the filter. If the search text only grew at the end since the
+    // last call, the previous list is narrowed instead of filtering everything again.
     void refilter_completions();
 
     // Sets whether the search field is shown.
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
@@ -21,6 +22,7 @@
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "builtin.h"
@@ -33,6 +35,7 @@
 #include "expand.h"
 #include "function.h"
 #include "io.h"
+#include "lru.h"
 #include "maybe.h"
 #include "parse_constants.h"
 #include "parse_execution.h"
@@ -78,12 +81,14 @@ static wcstring profiling_cmd_name_for_redirectable_block(const parse_node_t &no
 }
 
 parse_execution_context_t::parse_execution_context_t(parse_node_tree_t t, const wcstring &s,
-                                                     parser_t *p, int initial_eval_level)
+                                                     parser_t *p, int initial_eval_level,
+                                                     int first_line)
     : tree(std::move(t)),
       src(s),
       parser(p),
       eval_level(initial_eval_level),
       executing_node_idx(NODE_OFFSET_INVALID),
+      first_line_offset(first_line),
       cached_lineno_offset(0),
       cached_lineno_count(0) {}
 
@@ -129,44 +134,19 @@ const parse_node_t *parse_execution_context_t::infinite_recursive_statement_in_j
     }
     const wcstring &forbidden_function_name = parser->forbidden_function.back();
 
-    // Get the first job in the job list.
-    const parse_node_t *first_job = tree.next_node_in_node_list(job_list, symbol_job, NULL);
-    if (first_job == NULL) {
+    // The definition found the commands the body starts with when it was created. The body runs
+    // from a copy of the definition's tree, so the offsets are valid here.
+    const function_definition_ref_t &definition = parser->forbidden_definitions.back();
+    if (!definition) {
         return NULL;
     }
 
     // Here's the statement node we find that's infinite recursive.
     const parse_node_t *infinite_recursive_statement = NULL;
-
-    // Get the list of statements.
-    const parse_node_tree_t::parse_node_list_t statements =
-        tree.specific_statements_for_job(*first_job);
-
-    // Find all the decorated statements. We are interested in statements with no decoration (i.e.
-    // not command, not builtin) whose command expands to the forbidden function.
-    for (size_t i = 0; i < statements.size(); i++) {
-        // We only care about decorated statements, not while statements, etc.
-        const parse_node_t &statement = *statements.at(i);
-        if (statement.type != symbol_decorated_statement) {
-            continue;
-        }
-
-        const parse_node_t &plain_statement = tree.find_child(statement, symbol_plain_statement);
-        if (tree.decoration_for_plain_statement(plain_statement) !=
-            parse_statement_decoration_none) {
-            // This statement has a decoration like 'builtin' or 'command', and therefore is not
-            // infinite recursion. In particular this is what enables 'wrapper functions'.
-            continue;
-        }
-
-        // Ok, this is an undecorated plain statement. Get and expand its command.
-        wcstring cmd;
-        tree.command_for_plain_statement(plain_statement, src, &cmd);
-
-        if (expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES, NULL) &&
-            cmd == forbidden_function_name) {
-            // This is it.
-            infinite_recursive_statement = &statement;
+    for (const auto &command : definition->first_job_commands) {
+        if (command.second == forbidden_function_name && command.first < tree.size() &&
+            tree.at(command.first).type == symbol_decorated_statement) {
+            infinite_recursive_statement = &tree.at(command.first);
             if (out_func_name != NULL) {
                 *out_func_name = forbidden_function_name;
             }
@@ -198,16 +178,53 @@ enum process_type_t parse_execution_context_t::process_type_for_command(
     } else if (decoration == parse_statement_decoration_builtin) {
         // What happens if this builtin is not valid?
         process_type = INTERNAL_BUILTIN;
+    } else if (const resolved_command_t *resolved = get_resolved_command(plain_statement, cmd)) {
+        process_type = resolved->type;
     } else if (function_exists(cmd)) {
         process_type = INTERNAL_FUNCTION;
+        set_resolved_command(plain_statement, cmd, process_type, wcstring());
     } else if (builtin_exists(cmd)) {
         process_type = INTERNAL_BUILTIN;
+        set_resolved_command(plain_statement, cmd, process_type, wcstring());
     } else {
+        // populate_plain_process remembers external commands once it has found them in $PATH.
         process_type = EXTERNAL;
     }
     return process_type;
 }
 
+const parse_execution_context_t::resolved_command_t *
+parse_execution_context_t::get_resolved_command(const parse_node_t &plain_statement,
+                                                const wcstring &cmd) const {
+    auto iter = resolved_commands.find(get_offset(plain_statement));
+    if (iter == resolved_commands.end()) return NULL;
+    const resolved_command_t &resolved = iter->second;
+    // Defining or removing a function, or changing $PATH or $fish_function_path, can change what a
+    // name refers to. So can adding files to those directories, so like the $PATH cache, an entry
+    // is only trusted within the second it was made.
+    if (resolved.cmd != cmd || resolved.resolved != time(NULL) ||
+        resolved.function_generation != function_get_generation() ||
+        resolved.path_generation != env_get_generation(L"PATH") ||
+        resolved.function_path_generation != env_get_generation(L"fish_function_path")) {
+        return NULL;
+    }
+    return &resolved;
+}
+
+void parse_execution_context_t::set_resolved_command(const parse_node_t &plain_statement,
+                                                     const wcstring &cmd,
+                                                     enum process_type_t type,
+                                                     const wcstring &path) const {
+    resolved_command_t &resolved = resolved_commands[get_offset(plain_statement)];
+    resolved.cmd = cmd;
+    resolved.type = type;
+    resolved.path = path;
+    resolved.function_generation = function_get_generation();
+    resolved.path_generation = env_get_generation(L"PATH");
+    resolved.function_path_generation = env_get_generation(L"fish_function_path");
+    resolved.resolved = time(NULL);
+}
+
 bool parse_execution_context_t::should_cancel_execution(const block_t *block) const {
     return cancellation_reason(block) != execution_cancellation_none;
 }
@@ -261,6 +278,179 @@ bool parse_execution_context_t::job_is_simple_block(const parse_node_t &job_node
     return true;
 }
 
+namespace {
+/// Borrows one of the execution context's scratch lists for the lifetime of this object. The list
+/// is empty when borrowed, and its storage goes back to the context afterwards, so that the next
+/// command reuses it. A nested borrow of the same list, say from a block running inside an
+/// argument expansion, gets a fresh list.
+template <typename T>
+class scratch_list_t {
+    std::vector<T> &owner;
+
+   public:
+    std::vector<T> list;
+
+    explicit scratch_list_t(std::vector<T> &o) : owner(o) { list.swap(owner); }
+    ~scratch_list_t() {
+        list.clear();
+        list.swap(owner);
+    }
+
+    scratch_list_t(const scratch_list_t &) = delete;
+    void operator=(const scratch_list_t &) = delete;
+};
+}  // namespace
+
+/// Builtins that look at or change the job list, which expect to find the job they are part of.
+static bool builtin_needs_job(const wcstring &cmd) {
+    return cmd == L"bg" || cmd == L"disown" || cmd == L"fg" || cmd == L"jobs" || cmd == L"wait";
+}
+
+const parse_node_t *parse_execution_context_t::simple_builtin_statement(
+    const parse_node_t &job_node, wcstring *out_cmd) const {
+    assert(job_node.type == symbol_job);
+
+    // Must be one undecorated or builtin-decorated statement, with no pipes, in the foreground.
+    const parse_node_t &statement = *get_child(job_node, 0, symbol_statement);
+    const parse_node_t &specific_statement = *get_child(statement, 0);
+    if (specific_statement.type != symbol_decorated_statement) return NULL;
+    if (get_child(job_node, 1, symbol_job_continuation)->child_count > 0) return NULL;
+    if (tree.job_should_be_backgrounded(job_node)) return NULL;
+    if (!exec_can_run_builtin_without_job(block_io)) return NULL;
+    const parse_node_t &plain_statement =
+        tree.find_child(specific_statement, symbol_plain_statement);
+    enum parse_statement_decoration_t decoration =
+        tree.decoration_for_plain_statement(plain_statement);
+    if (decoration != parse_statement_decoration_none &&
+        decoration != parse_statement_decoration_builtin) {
+        return NULL;
+    }
+
+    // No command substitutions: those may look for the job they are called from, like psub does
+    // to clean up after it. At most one redirection, of stdout to a file, which run_simple_builtin
+    // opens itself.
+    const parse_node_t &args_and_redirections =
+        tree.find_child(plain_statement, symbol_arguments_or_redirections_list);
+    scratch_list_t<const parse_node_t *> nodes(scratch_nodes);
+    tree.find_nodes(args_and_redirections, symbol_redirection, &nodes.list, 2);
+    if (nodes.list.size() > 1) return NULL;
+    if (!nodes.list.empty()) {
+        const parse_node_t &redirection = *nodes.list.front();
+        int source_fd = -1;
+        wcstring target;
+        enum token_type type = tree.type_for_redirection(redirection, src, &source_fd, &target);
+        if (source_fd != STDOUT_FILENO ||
+            (type != TOK_REDIRECT_OUT && type != TOK_REDIRECT_APPEND &&
+             type != TOK_REDIRECT_NOCLOB) ||
+            wmemchr(src.c_str() + redirection.source_start, L'(', redirection.source_length)) {
+            return NULL;
+        }
+    }
+    tree.find_nodes(args_and_redirections, symbol_argument, &nodes.list);
+    for (const parse_node_t *arg : nodes.list) {
+        if (wmemchr(src.c_str() + arg->source_start, L'(', arg->source_length)) return NULL;
+    }
+
+    // The command must be a builtin. Leave commands that fail to expand to the general path, which
+    // reports the error.
+    wcstring cmd;
+    bool got_cmd = tree.command_for_plain_statement(plain_statement, src, &cmd);
+    assert(got_cmd);
+    if (!expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES, NULL)) return NULL;
+    if (process_type_for_command(plain_statement, cmd) != INTERNAL_BUILTIN ||
+        !builtin_exists(cmd) || builtin_needs_job(cmd)) {
+        return NULL;
+    }
+    out_cmd->swap(cmd);
+    return &plain_statement;
+}
+
+bool parse_execution_context_t::run_simple_builtin(const parse_node_t &job_node,
+                                                   const parse_node_t &statement,
+                                                   const wcstring &cmd,
+                                                   const block_t *associated_block,
+                                                   profile_item_t *profile_item,
+                                                   long long start_time,
+                                                   parse_execution_result_t *out_result) {
+    // Unlike populate_plain_process, this does not check again whether the command is a builtin
+    // after expanding the arguments; a command substitution defining a function by that name only
+    // takes effect for the next job.
+    const globspec_t glob_behavior = (cmd == L"set" || cmd == L"count") ? nullglob : failglob;
+    scratch_list_t<wcstring> arguments(scratch_arguments);
+    wcstring_list_t &argument_list = arguments.list;
+    argument_list.push_back(cmd);
+    // `count $var` only needs the number of elements, which for $history is much cheaper than
+    // copying them all into the argument list.
+    wcstring counted_var;
+    const bool counts_var = cmd == L"count" && this->is_plain_variable_argument(statement,
+                                                                               &counted_var);
+    bool expanded = (counts_var || this->determine_arguments(statement, &argument_list,
+                                                             glob_behavior) ==
+                                       parse_execution_success) &&
+                    !this->should_cancel_execution(associated_block);
+
+    // Open the file that stdout is redirected to, if any. When that is not possible here, say
+    // because it is a fifo or the open fails, the builtin runs as a job, which reports any error.
+    int out_fd = -1;
+    scratch_list_t<const parse_node_t *> redirections(scratch_nodes);
+    tree.find_nodes(tree.find_child(statement, symbol_arguments_or_redirections_list),
+                    symbol_redirection, &redirections.list, 1);
+    if (!redirections.list.empty() && expanded && !no_exec) {
+        const parse_node_t *redirection = redirections.list.front();
+        int source_fd = -1;
+        wcstring target;
+        enum token_type type = tree.type_for_redirection(*redirection, src, &source_fd, &target);
+        if (expand_one(target, 0, NULL) && !target.empty()) {
+            out_fd = exec_open_builtin_output_file(argument_list, target,
+                                                   oflags_for_redirection_type(type));
+        }
+        if (out_fd < 0) return false;
+    }
+
+    long long parse_time = 0;
+    if (profile_item != NULL) parse_time = get_time();
+
+    if (expanded && !no_exec && counts_var) {
+        // What count prints is what echo would, but count fails when there is nothing to count.
+        const size_t count = env_get_count(counted_var);
+        const wcstring_list_t echo_argv = {L"echo", to_string(static_cast<long>(count))};
+        int status = exec_builtin_without_job(*parser, echo_argv, block_io, out_fd);
+        proc_set_last_status(count == 0 && status == STATUS_CMD_OK ? STATUS_CMD_ERROR : status);
+    } else if (expanded && !no_exec) {
+        proc_set_last_status(exec_builtin_without_job(*parser, argument_list, block_io, out_fd));
+    }
+
+    if (profile_item != NULL) {
+        long long exec_time = get_time();
+        profile_item->level = eval_level;
+        profile_item->parse = (int)(parse_time - start_time);
+        profile_item->exec = (int)(exec_time - parse_time);
+        profile_item->cmd = get_source(job_node);
+        profile_item->skipped = !expanded;
+    }
+    if (g_sample_ticks) parser->take_sample(get_source(job_node));
+
+    // There is no job of our own to clean up, but background jobs may have finished.
+    if (!parser->job_list().empty()) job_reap(0);
+    *out_result = parse_execution_success;
+    return true;
+}
+
+bool parse_execution_context_t::is_plain_variable_argument(const parse_node_t &statement,
+                                                           wcstring *out_name) const {
+    scratch_list_t<const parse_node_t *> nodes(scratch_nodes);
+    tree.find_nodes(statement, symbol_argument, &nodes.list);
+    if (nodes.list.size() != 1) return false;
+    const parse_node_t &arg = *nodes.list.front();
+    const wchar_t *arg_src = src.c_str() + arg.source_start;
+    if (arg.source_length < 2 || arg_src[0] != L'$') return false;
+    for (size_t i = 1; i < arg.source_length; i++) {
+        if (!valid_var_name_char(arg_src[i])) return false;
+    }
+    out_name->assign(arg_src + 1, arg.source_length - 1);
+    return true;
+}
+
 parse_execution_result_t parse_execution_context_t::run_if_statement(
     const parse_node_t &statement) {
     assert(statement.type == symbol_if_statement);
@@ -494,7 +684,7 @@ parse_execution_result_t parse_execution_context_t::run_for_statement(
         }
 
         const wcstring &val = argument_sequence.at(i);
-        int retval = env_set_one(for_var_name, ENV_DEFAULT | ENV_USER, val);
+        int retval = env_set_loop_var(for_var_name, val);
 
         fb->loop_status = LOOP_NORMAL;
         this->run_job_list(block_contents, fb);
@@ -515,6 +705,129 @@ parse_execution_result_t parse_execution_context_t::run_for_statement(
     return ret;
 }
 
+/// Maximum number of switch statements whose case tables are kept.
+#define SWITCH_CASE_TABLE_CACHE_SIZE 128
+
+/// The case items of a switch statement, precompiled for matching. Case arguments that do not
+/// depend on any state - no variables, command substitutions, globs, braces or home and process
+/// expansion - are expanded once. Those without wildcards go into a hash table, the others are
+/// kept as patterns. Items with any other argument are expanded each time, as before.
+struct switch_case_table_t {
+    struct item_t {
+        /// Index of the case item in its switch statement.
+        size_t idx;
+        /// Whether the item has to be expanded every time.
+        bool is_dynamic;
+        /// The wildcard patterns of the item, if it is not dynamic.
+        std::vector<wildcard_pattern_t> patterns;
+    };
+
+    /// Maps literal case arguments to the index of the first item they appear in.
+    std::unordered_map<wcstring, size_t> literals;
+    /// The items with wildcards or expansions, in order.
+    std::vector<item_t> others;
+};
+
+namespace {
+/// Case tables keyed by the source of their switch statement, since functions get a new copy of
+/// their parse tree each time they run.
+class switch_case_table_cache_t
+    : public lru_cache_t<switch_case_table_cache_t, std::shared_ptr<const switch_case_table_t>> {
+    typedef lru_cache_t<switch_case_table_cache_t, std::shared_ptr<const switch_case_table_t>>
+        super;
+
+   public:
+    switch_case_table_cache_t() : super(SWITCH_CASE_TABLE_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+/// Main thread only.
+static switch_case_table_cache_t s_switch_case_table_cache;
+
+/// Return whether the given case argument expands to the same string no matter the state of the
+/// shell. Quoted and escaped characters are fine; anything that is expanded is not.
+static bool case_argument_is_constant(const wcstring &arg) {
+    wchar_t quote = L'\0';
+    for (size_t i = 0; i < arg.size(); i++) {
+        wchar_t c = arg.at(i);
+        if (quote == L'\'') {
+            if (c == L'\\') {
+                i++;
+            } else if (c == L'\'') {
+                quote = L'\0';
+            }
+        } else if (c == L'\\') {
+            i++;
+        } else if (c == L'\'' && quote == L'\0') {
+            quote = L'\'';
+        } else if (c == L'"') {
+            quote = quote == L'"' ? L'\0' : L'"';
+        } else if (wcschr(L"$(){}*?~%", c) != NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<const switch_case_table_t> parse_execution_context_t::switch_case_table_for(
+    const wcstring &statement_src, const std::vector<const parse_node_t *> &case_items) {
+    ASSERT_IS_MAIN_THREAD();
+    if (const auto *cached = s_switch_case_table_cache.get(statement_src)) return *cached;
+
+    auto table = std::make_shared<switch_case_table_t>();
+    std::vector<completion_t> expanded;
+    for (size_t idx = 0; idx < case_items.size(); idx++) {
+        const parse_node_t &arg_list = *get_child(*case_items.at(idx), 1, symbol_argument_list);
+        switch_case_table_t::item_t item = {idx, false, {}};
+        wcstring_list_t literals;
+        for (const parse_node_t *arg_node : tree.find_nodes(arg_list, symbol_argument)) {
+            const wcstring arg_src = get_source(*arg_node);
+            expanded.clear();
+            if (!case_argument_is_constant(arg_src) ||
+                expand_string(arg_src, &expanded, EXPAND_NO_DESCRIPTIONS, NULL) != EXPAND_OK ||
+                expanded.size() != 1) {
+                item.is_dynamic = true;
+                break;
+            }
+            // Unescape wildcards so they can be expanded again.
+            wcstring pattern = parse_util_unescape_wildcards(expanded.front().completion);
+            if (wildcard_has(pattern, true)) {
+                item.patterns.emplace_back(pattern);
+            } else {
+                literals.push_back(std::move(pattern));
+            }
+        }
+        if (item.is_dynamic) {
+            // Its literals only match after the rest of the item has been expanded.
+            item.patterns.clear();
+        } else {
+            for (wcstring &literal : literals) table->literals.emplace(std::move(literal), idx);
+        }
+        if (item.is_dynamic || !item.patterns.empty()) table->others.push_back(std::move(item));
+    }
+    s_switch_case_table_cache.insert(statement_src, table);
+    return table;
+}
+
+bool parse_execution_context_t::case_item_matches(const parse_node_t &case_item,
+                                                  const wcstring &value) {
+    // Pull out the argument list.
+    const parse_node_t &arg_list = *get_child(case_item, 1, symbol_argument_list);
+
+    // Expand arguments. A case item list may have a wildcard that fails to expand to anything. We
+    // also report case errors, but don't stop execution; i.e. a case item that contains an
+    // unexpandable process will report and then fail to match.
+    wcstring_list_t case_args;
+    if (this->determine_arguments(arg_list, &case_args, failglob) != parse_execution_success) {
+        return false;
+    }
+    for (const wcstring &arg : case_args) {
+        // Unescape wildcards so they can be expanded again.
+        if (wildcard_match(value, parse_util_unescape_wildcards(arg))) return true;
+    }
+    return false;
+}
+
 parse_execution_result_t parse_execution_context_t::run_switch_statement(
     const parse_node_t &statement) {
     assert(statement.type == symbol_switch_statement);
@@ -565,50 +878,48 @@ parse_execution_result_t parse_execution_context_t::run_switch_statement(
 
     switch_block_t *sb = parser->push_block<switch_block_t>();
 
-    // Expand case statements.
+    // Collect the case items.
+    std::vector<const parse_node_t *> case_items;
     const parse_node_t *case_item_list = get_child(statement, 3, symbol_case_item_list);
+    while (const parse_node_t *case_item =
+               tree.next_node_in_node_list(*case_item_list, symbol_case_item, &case_item_list)) {
+        case_items.push_back(case_item);
+    }
 
-    // Loop while we don't have a match but do have more of the list.
-    const parse_node_t *matching_case_item = NULL;
-    while (matching_case_item == NULL && case_item_list != NULL) {
-        if (should_cancel_execution(sb)) {
-            result = parse_execution_cancelled;
-            break;
-        }
-
-        // Get the next item and the remainder of the list.
-        const parse_node_t *case_item =
-            tree.next_node_in_node_list(*case_item_list, symbol_case_item, &case_item_list);
-        if (case_item == NULL) {
-            // No more items.
-            break;
-        }
-
-        // Pull out the argument list.
-        const parse_node_t &arg_list = *get_child(*case_item, 1, symbol_argument_list);
-
-        // Expand arguments. A case item list may have a wildcard that fails to expand to
-        // anything. We also report case errors, but don't stop execution; i.e. a case item that
-        // contains an unexpandable process will report and then fail to match.
-        wcstring_list_t case_args;
-        parse_execution_result_t case_result =
-            this->determine_arguments(arg_list, &case_args, failglob);
-        if (case_result == parse_execution_success) {
-            for (size_t i = 0; i < case_args.size(); i++) {
-                const wcstring &arg = case_args.at(i);
-
-                // Unescape wildcards so they can be expanded again.
-                wcstring unescaped_arg = parse_util_unescape_wildcards(arg);
-                bool match = wildcard_match(switch_value_expanded, unescaped_arg);
+    // The first matching case item wins. Only items before the first matching literal need to be
+    // looked at one by one, and of those only the ones with wildcards or expansions.
+    std::shared_ptr<const switch_case_table_t> table =
+        switch_case_table_for(get_source(statement), case_items);
+    auto literal = table->literals.find(switch_value_expanded);
+    size_t first_literal = literal == table->literals.end() ? case_items.size() : literal->second;
 
-                // If this matched, we're done.
-                if (match) {
-                    matching_case_item = case_item;
+    const parse_node_t *matching_case_item = NULL;
+    for (const switch_case_table_t::item_t &item : table->others) {
+        if (item.idx >= first_literal) break;
+        if (item.is_dynamic) {
+            // Expansions can run commands, so check for cancellation like before any other job.
+            if (should_cancel_execution(sb)) {
+                result = parse_execution_cancelled;
+                break;
+            }
+            if (this->case_item_matches(*case_items.at(item.idx), switch_value_expanded)) {
+                matching_case_item = case_items.at(item.idx);
+                break;
+            }
+        } else {
+            for (const wildcard_pattern_t &pattern : item.patterns) {
+                if (pattern.matches(switch_value_expanded)) {
+                    matching_case_item = case_items.at(item.idx);
                     break;
                 }
             }
+            if (matching_case_item != NULL) break;
         }
     }
+    if (result == parse_execution_success && matching_case_item == NULL &&
+        first_literal < case_items.size()) {
+        matching_case_item = case_items.at(first_literal);
+    }
 
     if (result == parse_execution_success && matching_case_item != NULL) {
         // Success, evaluate the job list.
@@ -858,11 +1169,21 @@ parse_execution_result_t parse_execution_context_t::populate_plain_process(
     wcstring path_to_external_command;
     if (process_type == EXTERNAL || process_type == INTERNAL_EXEC) {
         // Determine the actual command. This may be an implicit cd.
-        bool has_command = path_get_path(cmd, &path_to_external_command);
-
-        // If there was no command, then we care about the value of errno after checking for it, to
-        // distinguish between e.g. no file vs permissions problem.
-        const int no_cmd_err_code = errno;
+        bool has_command = false;
+        int no_cmd_err_code = 0;
+        const resolved_command_t *resolved = get_resolved_command(statement, cmd);
+        if (resolved && resolved->type == process_type && !resolved->path.empty()) {
+            has_command = true;
+            path_to_external_command = resolved->path;
+        } else {
+            has_command = path_get_path(cmd, &path_to_external_command);
+            // If there was no command, then we care about the value of errno after checking for
+            // it, to distinguish between e.g. no file vs permissions problem.
+            no_cmd_err_code = errno;
+            if (has_command) {
+                set_resolved_command(statement, cmd, process_type, path_to_external_command);
+            }
+        }
 
         // If the specified command does not exist, and is undecorated, try using an implicit cd.
         if (!has_command &&
@@ -928,10 +1249,12 @@ parse_execution_result_t parse_execution_context_t::determine_arguments(
     const parse_node_t &parent, wcstring_list_t *out_arguments, globspec_t glob_behavior) {
     // Get all argument nodes underneath the statement. We guess we'll have that many arguments (but
     // may have more or fewer, if there are wildcards involved).
-    const parse_node_tree_t::parse_node_list_t argument_nodes =
-        tree.find_nodes(parent, symbol_argument);
+    scratch_list_t<const parse_node_t *> nodes(scratch_nodes);
+    const parse_node_tree_t::parse_node_list_t &argument_nodes = nodes.list;
+    tree.find_nodes(parent, symbol_argument, &nodes.list);
     out_arguments->reserve(out_arguments->size() + argument_nodes.size());
-    std::vector<completion_t> arg_expanded;
+    scratch_list_t<completion_t> expansions(scratch_expansions);
+    std::vector<completion_t> &arg_expanded = expansions.list;
     for (size_t i = 0; i < argument_nodes.size(); i++) {
         const parse_node_t &arg_node = *argument_nodes.at(i);
 
@@ -1225,6 +1548,9 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
     // Increment the eval_level for the duration of this command.
     scoped_push<int> saved_eval_level(&eval_level, eval_level + 1);
 
+    // Variable events may be held back until the outermost job is done.
+    event_job_scope_t event_job_scope;
+
     // Save the node index.
     scoped_push<node_offset_t> saved_node_offset(&executing_node_idx, this->get_offset(job_node));
 
@@ -1277,10 +1603,26 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
                                                                           this->tree, this->src);
             profile_item->skipped = false;
         }
+        if (g_sample_ticks) {
+            parser->take_sample(profiling_cmd_name_for_redirectable_block(specific_statement,
+                                                                          this->tree, this->src));
+        }
 
         return result;
     }
 
+    // Likewise a builtin that is not piped, and at most has its stdout redirected to a file, can
+    // run without a job. That saves acquiring a job ID, building the io chains and going through
+    // exec_job and job_continue.
+    wcstring builtin_cmd;
+    if (const parse_node_t *statement = simple_builtin_statement(job_node, &builtin_cmd)) {
+        parse_execution_result_t result;
+        if (this->run_simple_builtin(job_node, *statement, builtin_cmd, associated_block,
+                                     profile_item, start_time, &result)) {
+            return result;
+        }
+    }
+
     shared_ptr<job_t> job = std::make_shared<job_t>(acquire_job_id(), block_io);
     job->tmodes = tmodes;
     job->set_flag(JOB_CONTROL,
@@ -1345,6 +1687,7 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
         profile_item->cmd = job ? job->command() : wcstring();
         profile_item->skipped = !populated_job;
     }
+    if (g_sample_ticks) parser->take_sample(job->command());
 
     job_reap(0);  // clean up jobs
     return parse_execution_success;
@@ -1452,7 +1795,7 @@ int parse_execution_context_t::line_offset_of_character_at_offset(size_t offset)
 
     // Easy hack to handle 0.
     if (offset == 0) {
-        return 0;
+        return first_line_offset;
     }
 
     // We want to return (one plus) the number of newlines at offsets less than the given offset.
@@ -1477,7 +1820,7 @@ int parse_execution_context_t::line_offset_of_character_at_offset(size_t offset)
         }
         cached_lineno_offset = offset;
     }
-    return cached_lineno_count;
+    return first_line_offset + cached_lineno_count;
 }
 
 int parse_execution_context_t::get_current_line_number() {
@@ -3,8 +3,15 @@
 #define FISH_PARSE_EXECUTION_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
+#include "complete.h"
 #include "io.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
@@ -12,6 +19,8 @@
 
 class parser_t;
 struct block_t;
+struct profile_item_t;
+struct switch_case_table_t;
 
 enum parse_execution_result_t {
     /// The job was successfully executed (though it have failed on its own).
@@ -36,9 +45,34 @@ class parse_execution_context_t {
     int eval_level;
     // The currently executing node index, used to indicate the line number.
     node_offset_t executing_node_idx;
+    // The number of lines in the script before src, when src is only part of it.
+    int first_line_offset;
     // Cached line number information.
     size_t cached_lineno_offset;
     int cached_lineno_count;
+    // Storage lent to each simple command in turn, so that running one does not allocate these
+    // lists anew. See scratch_list_t.
+    mutable parse_node_tree_t::parse_node_list_t scratch_nodes;
+    std::vector<completion_t> scratch_expansions;
+    wcstring_list_t scratch_arguments;
+    // What the command of a plain statement resolved to, so that running the statement again, as
+    // in a loop body, does not look up functions and search $PATH again. See
+    // get_resolved_command.
+    struct resolved_command_t {
+        // The command name, after expansion.
+        wcstring cmd;
+        enum process_type_t type;
+        // The path of an external command, or empty.
+        wcstring path;
+        // The generations of the functions, $PATH and $fish_function_path it was resolved with.
+        uint64_t function_generation;
+        uint64_t path_generation;
+        uint64_t function_path_generation;
+        // When it was resolved.
+        time_t resolved;
+    };
+    // Resolved commands, keyed by the offset of their plain statement.
+    mutable std::unordered_map<node_offset_t, resolved_command_t> resolved_commands;
     // No copying allowed.
     parse_execution_context_t(const parse_execution_context_t &);
     parse_execution_context_t &operator=(const parse_execution_context_t &);
@@ -81,8 +115,31 @@ class parse_execution_context_t {
     /// Indicates whether a job is a simple block (one block, no redirections).
     bool job_is_simple_block(const parse_node_t &node) const;
 
+    /// Returns the plain statement of a job that can run as a builtin without a job_t (one
+    /// statement naming a builtin, no pipes, no redirections except one of stdout to a file, not
+    /// in the background), or NULL. On success the expanded command is returned in out_cmd.
+    const parse_node_t *simple_builtin_statement(const parse_node_t &job_node,
+                                                 wcstring *out_cmd) const;
+    /// Runs such a statement. Returns false if it must run as a job after all, because the file
+    /// its stdout is redirected to can not be opened here.
+    bool run_simple_builtin(const parse_node_t &job_node, const parse_node_t &statement,
+                            const wcstring &cmd, const block_t *associated_block,
+                            profile_item_t *profile_item, long long start_time,
+                            parse_execution_result_t *out_result);
+
+    /// Returns whether the only argument of the given statement is a variable like $foo, with no
+    /// index or anything else, and if so returns its name.
+    bool is_plain_variable_argument(const parse_node_t &statement, wcstring *out_name) const;
+
     enum process_type_t process_type_for_command(const parse_node_t &plain_statement,
                                                  const wcstring &cmd) const;
+    /// Returns what the command cmd of the given plain statement resolved to the last time it ran,
+    /// or NULL if that may no longer hold.
+    const resolved_command_t *get_resolved_command(const parse_node_t &plain_statement,
+                                                   const wcstring &cmd) const;
+    /// Remembers what the command of the given plain statement resolved to.
+    void set_resolved_command(const parse_node_t &plain_statement, const wcstring &cmd,
+                              enum process_type_t type, const wcstring &path) const;
 
     // These create process_t structures from statements.
     parse_execution_result_t populate_job_process(job_t *job, process_t *proc,
@@ -100,6 +157,9 @@ class parse_execution_context_t {
                                                const parse_node_t &contents);
     parse_execution_result_t run_if_statement(const parse_node_t &statement);
     parse_execution_result_t run_switch_statement(const parse_node_t &statement);
+    std::shared_ptr<const switch_case_table_t> switch_case_table_for(
+        const wcstring &statement_src, const std::vector<const parse_node_t *> &case_items);
+    bool case_item_matches(const parse_node_t &case_item, const wcstring &value);
     parse_execution_result_t run_while_statement(const parse_node_t &header,
                                                  const parse_node_t &contents);
     parse_execution_result_t run_function_statement(const parse_node_t &header,
@@ -129,7 +189,7 @@ class parse_execution_context_t {
 
    public:
     parse_execution_context_t(parse_node_tree_t t, const wcstring &s, parser_t *p,
-                              int initial_eval_level);
+                              int initial_eval_level, int first_line = 0);
 
     /// Returns the current eval level.
     int current_eval_level() const { return eval_level; }
@@ -16,8 +16,10 @@
 #include "parse_constants.h"
 #include "parse_productions.h"
 #include "parse_tree.h"
+#include "perfect_hash.h"
 #include "proc.h"
 #include "tokenizer.h"
+#include "trace.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 using namespace parse_productions;
@@ -996,8 +998,16 @@ void parse_ll_t::accept_tokens(parse_token_t token1, parse_token_t token2) {
 }
 
 // Given an expanded string, returns any keyword it matches.
-static inline parse_keyword_t keyword_with_name(const wchar_t *name) {
-    return str_to_enum(name, keyword_enum_map, keyword_enum_map_len);
+static parse_keyword_t keyword_with_name(const wchar_t *name, size_t len) {
+    // Every token is looked up here, so use a perfect hash of the keywords.
+    static const perfect_hash_t<parse_keyword_t> keyword_table = [] {
+        std::vector<perfect_hash_t<parse_keyword_t>::entry_t> entries;
+        for (const auto &keyword : keyword_enum_map) {
+            if (keyword.str) entries.emplace_back(keyword.str, keyword.val);
+        }
+        return perfect_hash_t<parse_keyword_t>(entries, parse_keyword_none);
+    }();
+    return keyword_table.get(name, len);
 }
 
 static bool is_keyword_char(wchar_t c) {
@@ -1005,8 +1015,8 @@ static bool is_keyword_char(wchar_t c) {
            c == L'\'' || c == L'"' || c == L'\\' || c == '\n';
 }
 
-/// Given a token, returns the keyword it matches, or parse_keyword_none.
-static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token) {
+/// Given a token and its text, returns the keyword it matches, or parse_keyword_none.
+static parse_keyword_t keyword_for_token(token_type tok, const wchar_t *tok_txt, size_t tok_len) {
     /* Only strings can be keywords */
     if (tok != TOK_STRING) {
         return parse_keyword_none;
@@ -1019,8 +1029,7 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
     // that this lowercase set could be shrunk to be just the characters that are in keywords.
     parse_keyword_t result = parse_keyword_none;
     bool needs_expand = false, all_chars_valid = true;
-    const wchar_t *tok_txt = token.c_str();
-    for (size_t i = 0; tok_txt[i] != L'\0'; i++) {
+    for (size_t i = 0; i < tok_len; i++) {
         wchar_t c = tok_txt[i];
         if (!is_keyword_char(c)) {
             all_chars_valid = false;
@@ -1033,11 +1042,11 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
     if (all_chars_valid) {
         // Expand if necessary.
         if (!needs_expand) {
-            result = keyword_with_name(tok_txt);
+            result = keyword_with_name(tok_txt, tok_len);
         } else {
             wcstring storage;
-            if (unescape_string(tok_txt, &storage, 0)) {
-                result = keyword_with_name(storage.c_str());
+            if (unescape_string(wcstring(tok_txt, tok_len), &storage, 0)) {
+                result = keyword_with_name(storage.c_str(), storage.size());
             }
         }
     }
@@ -1052,13 +1061,14 @@ static const parse_token_t kInvalidToken = {
 static const parse_token_t kTerminalToken = {
     parse_token_type_terminate, parse_keyword_none, false, false, SOURCE_OFFSET_INVALID, 0};
 
-static inline bool is_help_argument(const wcstring &txt) {
-    return txt == L"-h" || txt == L"--help";
+static inline bool is_help_argument(const wchar_t *txt, size_t len) {
+    return (len == 2 && !wcsncmp(txt, L"-h", 2)) || (len == 6 && !wcsncmp(txt, L"--help", 6));
 }
 
-/// Return a new parse token, advancing the tokenizer.
-static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
-    if (!tok->next(token)) {
+/// Return a new parse token, advancing the tokenizer. The text of string tokens is read from src
+/// rather than copied out of the tokenizer.
+static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token, const wchar_t *src) {
+    if (!tok->next_range(token)) {
         return kTerminalToken;
     }
 
@@ -1070,9 +1080,11 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
     // this writing (10/12/13) nobody seems to have noticed this. Squint at it really hard and it
     // even starts to look like a feature.
     result.type = parse_token_type_from_tokenizer_token(token->type);
-    result.keyword = keyword_for_token(token->type, token->text);
-    result.has_dash_prefix = !token->text.empty() && token->text.at(0) == L'-';
-    result.is_help_argument = result.has_dash_prefix && is_help_argument(token->text);
+    const wchar_t *txt = token->type == TOK_STRING ? src + token->offset : token->text.c_str();
+    const size_t txt_len = token->type == TOK_STRING ? token->length : token->text.size();
+    result.keyword = keyword_for_token(token->type, txt, txt_len);
+    result.has_dash_prefix = txt_len > 0 && txt[0] == L'-';
+    result.is_help_argument = result.has_dash_prefix && is_help_argument(txt, txt_len);
 
     // These assertions are totally bogus. Basically our tokenizer works in size_t but we work in
     // uint32_t to save some space. If we have a source file larger than 4 GB, we'll probably just
@@ -1089,6 +1101,7 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
 bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
                             parse_node_tree_t *output, parse_error_list_t *errors,
                             parse_token_type_t goal) {
+    FISH_TRACE2(parse_start, str.c_str(), str.size());
     parse_ll_t parser(goal);
     parser.set_should_generate_error_messages(errors != NULL);
 
@@ -1113,7 +1126,7 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
     for (size_t token_count = 0; queue[0].type != parse_token_type_terminate; token_count++) {
         // Push a new token onto the queue.
         queue[0] = queue[1];
-        queue[1] = next_parse_token(&tok, &tokenizer_token);
+        queue[1] = next_parse_token(&tok, &tokenizer_token, str.c_str());
 
         // If we are leaving things unterminated, then don't pass parse_token_type_terminate.
         if (queue[0].type == parse_token_type_terminate &&
@@ -1176,9 +1189,93 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
 #endif
 
     // Indicate if we had a fatal error.
+    FISH_TRACE3(parse_done, str.size(), output->size(), !parser.has_fatal_error());
     return !parser.has_fatal_error();
 }
 
+/// Return the index of the top-level job list in tree that starts with a statement terminator
+/// preceding the offset limit, and comes after every other such job list, or NODE_OFFSET_INVALID.
+/// Such a job list is parsed the same no matter what precedes it, so it can be reparsed on its own.
+static node_offset_t last_top_level_job_list_before(const parse_node_tree_t &tree, size_t limit) {
+    node_offset_t result = NODE_OFFSET_INVALID;
+    node_offset_t idx = 0;
+    while (idx < tree.size() && tree[idx].type == symbol_job_list && tree[idx].child_count == 2) {
+        const parse_node_t &first = tree[tree[idx].child_start];
+        if (first.source_start == SOURCE_OFFSET_INVALID || first.source_start >= limit) break;
+        if (first.type == parse_token_type_end) result = idx;
+        idx = tree[idx].child_start + 1;
+    }
+    if (result == NODE_OFFSET_INVALID) return result;
+
+    // The nodes parsed before this job list must be free of errors, since the parser starts over
+    // after an error.
+    const node_offset_t subtree_start = tree[result].child_start;
+    for (node_offset_t i = 0; i < subtree_start; i++) {
+        if (tree[i].type == parse_special_type_parse_error ||
+            tree[i].type == parse_special_type_tokenizer_error) {
+            return NODE_OFFSET_INVALID;
+        }
+    }
+    return result;
+}
+
+bool parse_tree_from_string_reusing(const wcstring &str, parse_tree_flags_t flags,
+                                    parse_node_tree_t *output, const wcstring &prev_src,
+                                    const parse_node_tree_t &prev_tree) {
+    assert(output != NULL);
+    // The character at the start of the reused job list must be unchanged as well, since it
+    // determines the terminator token.
+    const size_t max_common = std::min(str.size(), prev_src.size());
+    size_t common = 0;
+    while (common < max_common && str[common] == prev_src[common]) common++;
+    const node_offset_t list_idx = last_top_level_job_list_before(prev_tree, common);
+    if (list_idx == NODE_OFFSET_INVALID) {
+        return parse_tree_from_string(str, flags, output, NULL);
+    }
+
+    // Everything from the first node belonging to the job list onwards is replaced. Comments
+    // attached to the job list come right before its children, and are reparsed too.
+    const parse_node_t &prev_list = prev_tree[list_idx];
+    node_offset_t cut = prev_list.child_start;
+    while (cut > list_idx + 1 && prev_tree[cut - 1].parent == list_idx) cut--;
+    const source_offset_t tail_start = prev_tree[cut].source_start;
+    parse_node_tree_t tail;
+    bool result = parse_tree_from_string(str.substr(tail_start), flags, &tail, NULL);
+    output->assign(prev_tree.begin(), prev_tree.begin() + cut);
+
+    // Append the tail, with its root taking the place of the job list. The tail's node i (for i >
+    // 0) goes at cut + i - 1.
+    const node_offset_t shift = cut - 1;
+    for (node_offset_t i = 0; i < tail.size(); i++) {
+        parse_node_t node = tail[i];
+        if (node.parent == 0) {
+            node.parent = list_idx;
+        } else if (node.parent != NODE_OFFSET_INVALID) {
+            node.parent += shift;
+        }
+        // Unexpanded nodes have a child_start of 0; expanded ones point past the root.
+        if (node.child_start > 0) node.child_start += shift;
+        if (node.source_start != SOURCE_OFFSET_INVALID) node.source_start += tail_start;
+        if (i == 0) {
+            node.parent = prev_list.parent;
+            output->at(list_idx) = node;
+        } else {
+            output->push_back(node);
+        }
+    }
+
+    // The job lists enclosing the replaced one now end where the source does.
+    for (node_offset_t idx = output->at(list_idx).parent; idx != NODE_OFFSET_INVALID;
+         idx = output->at(idx).parent) {
+        parse_node_t &list = output->at(idx);
+        const parse_node_t &last = output->at(list.child_start + list.child_count - 1);
+        if (last.has_source()) {
+            list.source_length = last.source_start + last.source_length - list.source_start;
+        }
+    }
+    return result;
+}
+
 const parse_node_t *parse_node_tree_t::get_child(const parse_node_t &parent, node_offset_t which,
                                                  parse_token_type_t expected_type) const {
     const parse_node_t *result = NULL;
@@ -1245,6 +1342,12 @@ parse_node_tree_t::parse_node_list_t parse_node_tree_t::find_nodes(const parse_n
     return result;
 }
 
+void parse_node_tree_t::find_nodes(const parse_node_t &parent, parse_token_type_t type,
+                                   parse_node_list_t *out, size_t max_count) const {
+    out->clear();
+    find_nodes_recursive(*this, parent, type, out, max_count);
+}
+
 /// Return true if the given node has the proposed ancestor as an ancestor (or is itself that
 /// ancestor).
 static bool node_has_ancestor(const parse_node_tree_t &tree, const parse_node_t &node,
@@ -1488,3 +1591,80 @@ const parse_node_t *parse_node_tree_t::next_node_in_node_list(
     if (out_list_tail != NULL) *out_list_tail = list_cursor;
     return list_entry;
 }
+
+/// Size of a serialized parse node: four 32-bit offsets, then the child count, type and keyword,
+/// and the flags and tag sharing a byte.
+#define PARSE_NODE_SERIALIZED_SIZE 20
+
+static void append_u32(std::string *out, uint32_t val) {
+    for (int shift = 0; shift < 32; shift += 8) out->push_back((char)((val >> shift) & 0xFF));
+}
+
+static uint32_t read_u32(const unsigned char *cursor) {
+    return (uint32_t)cursor[0] | (uint32_t)cursor[1] << 8 | (uint32_t)cursor[2] << 16 |
+           (uint32_t)cursor[3] << 24;
+}
+
+void parse_tree_serialize(const parse_node_tree_t &tree, std::string *out) {
+    out->reserve(out->size() + tree.size() * PARSE_NODE_SERIALIZED_SIZE);
+    for (const parse_node_t &node : tree) {
+        append_u32(out, node.source_start);
+        append_u32(out, node.source_length);
+        append_u32(out, node.parent);
+        append_u32(out, node.child_start);
+        out->push_back((char)node.child_count);
+        out->push_back((char)node.type);
+        out->push_back((char)node.keyword);
+        out->push_back((char)(node.flags << 4 | node.tag));
+    }
+}
+
+bool parse_tree_deserialize(const char *data, size_t length, size_t source_length,
+                            parse_node_tree_t *output) {
+    if (length % PARSE_NODE_SERIALIZED_SIZE != 0) return false;
+    const size_t count = length / PARSE_NODE_SERIALIZED_SIZE;
+    if (count >= NODE_OFFSET_INVALID) return false;
+
+    parse_node_tree_t tree;
+    tree.reserve(count);
+    const unsigned char *cursor = reinterpret_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < count; i++, cursor += PARSE_NODE_SERIALIZED_SIZE) {
+        unsigned int type = cursor[17], keyword = cursor[18];
+        if (type < token_type_invalid || type > LAST_TOKEN_TYPE) return false;
+        if (keyword > parse_keyword_while) return false;
+
+        parse_node_t node(static_cast<parse_token_type_t>(type));
+        node.source_start = read_u32(cursor);
+        node.source_length = read_u32(cursor + 4);
+        node.parent = read_u32(cursor + 8);
+        node.child_start = read_u32(cursor + 12);
+        node.child_count = cursor[16];
+        node.keyword = static_cast<parse_keyword_t>(keyword);
+        node.flags = cursor[19] >> 4;
+        node.tag = cursor[19] & 0xF;
+
+        // Reject anything the parser could not have produced, since the executor trusts the tree.
+        if (node.source_start == SOURCE_OFFSET_INVALID) {
+            if (node.source_length != 0) return false;
+        } else if (node.source_start > source_length ||
+                   node.source_length > source_length - node.source_start) {
+            return false;
+        }
+        if (i == 0 ? node.parent != NODE_OFFSET_INVALID : node.parent >= i) return false;
+        if (node.child_count > 0 &&
+            (node.child_start <= i || node.child_start > count - node.child_count)) {
+            return false;
+        }
+        tree.push_back(node);
+    }
+
+    // Children must point back at their parents.
+    for (size_t i = 0; i < count; i++) {
+        const parse_node_t &node = tree.at(i);
+        for (node_offset_t which = 0; which < node.child_count; which++) {
+            if (tree.at(node.child_offset(which)).parent != i) return false;
+        }
+    }
+    *output = std::move(tree);
+    return true;
+}
@@ -70,14 +70,15 @@ typedef uint8_t parse_node_flags_t;
 typedef uint8_t parse_node_tag_t;
 
 /// Class for nodes of a parse tree. Since there's a lot of these, the size and order of the fields
-/// is important.
+/// is important: this is 20 bytes.
 class parse_node_t {
    public:
     // Start in the source code.
     source_offset_t source_start;
     // Length of our range in the source code.
     source_offset_t source_length;
-    // Parent
+    // Parent. Children don't come in the order of their parents, so finding the parent without
+    // this would mean searching the tree, and get_parent() is used a lot.
     node_offset_t parent;
     // Children
     node_offset_t child_start;
@@ -165,6 +166,9 @@ class parse_node_tree_t : public std::vector<parse_node_t> {
     typedef std::vector<const parse_node_t *> parse_node_list_t;
     parse_node_list_t find_nodes(const parse_node_t &parent, parse_token_type_t type,
                                  size_t max_count = (size_t)(-1)) const;
+    // Like find_nodes, but replaces the contents of out, so that its storage can be reused.
+    void find_nodes(const parse_node_t &parent, parse_token_type_t type, parse_node_list_t *out,
+                    size_t max_count = (size_t)(-1)) const;
 
     // Finds the last node of a given type underneath a given node, or NULL if it could not be
     // found. If parent is NULL, this finds the last node in the tree of that type.
@@ -232,6 +236,22 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t flags,
                             parse_node_tree_t *output, parse_error_list_t *errors,
                             parse_token_type_t goal = symbol_job_list);
 
+/// Like parse_tree_from_string for a job list without error reporting, but given prev_tree parsed
+/// from prev_src with the same flags, reuse its top-level jobs that end before the first character
+/// in which str differs from prev_src, and only parse the rest of str.
+bool parse_tree_from_string_reusing(const wcstring &str, parse_tree_flags_t flags,
+                                    parse_node_tree_t *output, const wcstring &prev_src,
+                                    const parse_node_tree_t &prev_tree);
+
+/// Append a binary form of the tree to the given string, which parse_tree_deserialize() turns back
+/// into the same tree. The form records offsets into the source but not the source itself.
+void parse_tree_serialize(const parse_node_tree_t &tree, std::string *out);
+
+/// Read a tree serialized by parse_tree_serialize() for a source of length source_length. Returns
+/// false, leaving the output untouched, if the data does not describe a well formed tree.
+bool parse_tree_deserialize(const char *data, size_t length, size_t source_length,
+                            parse_node_tree_t *output);
+
 // Fish grammar:
 //
 // # A job_list is a list of jobs, separated by semicolons or newlines
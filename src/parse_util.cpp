@@ -4,21 +4,33 @@
 // that are somehow related to parsing the code.
 #include "config.h"  // IWYU pragma: keep
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <wchar.h>
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include "builtin.h"
 #include "common.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "fish_version.h"
+#include "iothread.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
 #include "parse_util.h"
+#include "path.h"
 #include "tokenizer.h"
 #include "util.h"
 #include "wildcard.h"
@@ -277,12 +289,55 @@ void parse_util_cmdsubst_extent(const wchar_t *buff, size_t cursor_pos, const wc
     if (b != NULL) *b = bp;
 }
 
+namespace {
+/// A token of the text an extent is looked for in. Only its type and range are needed.
+struct extent_token_t {
+    enum token_type type;
+    size_t offset;
+    size_t length;
+};
+
+/// The tokens of the text the extent functions were last asked about. The reader asks for the
+/// job, process and token around the cursor several times on each key press, always in the same
+/// command line, so this saves tokenizing it again for each question.
+struct extent_token_cache_t {
+    wcstring text;
+    std::vector<extent_token_t> tokens;
+};
+}  // anonymous namespace
+
+/// Main thread only.
+static extent_token_cache_t s_extent_token_cache;
+
+/// Return the tokens of the text [begin, end), accepting unfinished ones. On the main thread they
+/// come from the cache when the text is unchanged; elsewhere they are tokenized into *storage.
+static const std::vector<extent_token_t> &extent_tokens(const wchar_t *begin, const wchar_t *end,
+                                                        std::vector<extent_token_t> *storage) {
+    const size_t len = end - begin;
+    std::vector<extent_token_t> *tokens = storage;
+    if (is_main_thread()) {
+        extent_token_cache_t &cache = s_extent_token_cache;
+        if (cache.text.size() == len && cache.text.compare(0, len, begin, len) == 0) {
+            return cache.tokens;
+        }
+        cache.text.assign(begin, len);
+        tokens = &cache.tokens;
+    }
+
+    tokens->clear();
+    const wcstring text(begin, len);
+    tokenizer_t tok(text.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS);
+    tok_t token;
+    while (tok.next_range(&token)) {
+        tokens->push_back({token.type, token.offset, token.length});
+    }
+    return *tokens;
+}
+
 /// Get the beginning and end of the job or process definition under the cursor.
 static void job_or_process_extent(const wchar_t *buff, size_t cursor_pos, const wchar_t **a,
                                   const wchar_t **b, int process) {
     const wchar_t *begin, *end;
-    wchar_t *buffcpy;
-    int finished = 0;
 
     CHECK(buff, );
 
@@ -298,12 +353,9 @@ static void job_or_process_extent(const wchar_t *buff, size_t cursor_pos, const
 
     if (a) *a = begin;
     if (b) *b = end;
-    buffcpy = wcsndup(begin, end - begin);
-    assert(buffcpy != NULL);
 
-    tokenizer_t tok(buffcpy, TOK_ACCEPT_UNFINISHED);
-    tok_t token;
-    while (tok.next(&token) && !finished) {
+    std::vector<extent_token_t> storage;
+    for (const extent_token_t &token : extent_tokens(begin, end, &storage)) {
         size_t tok_begin = token.offset;
 
         switch (token.type) {
@@ -316,18 +368,15 @@ static void job_or_process_extent(const wchar_t *buff, size_t cursor_pos, const
             case TOK_END:
             case TOK_BACKGROUND: {
                 if (tok_begin >= pos) {
-                    finished = 1;
-                    if (b) *b = (wchar_t *)begin + tok_begin;
-                } else {
-                    if (a) *a = (wchar_t *)begin + tok_begin + 1;
+                    if (b) *b = begin + tok_begin;
+                    return;
                 }
+                if (a) *a = begin + tok_begin + 1;
                 break;
             }
             default: { break; }
         }
     }
-
-    free(buffcpy);
 }
 
 void parse_util_process_extent(const wchar_t *buff, size_t pos, const wchar_t **a,
@@ -366,17 +415,14 @@ void parse_util_token_extent(const wchar_t *buff, size_t cursor_pos, const wchar
     assert(cmdsubst_end >= cmdsubst_begin);
     assert(cmdsubst_end <= (buff + wcslen(buff)));
 
-    const wcstring buffcpy = wcstring(cmdsubst_begin, cmdsubst_end - cmdsubst_begin);
-
-    tokenizer_t tok(buffcpy.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS);
-    tok_t token;
-    while (tok.next(&token)) {
+    std::vector<extent_token_t> storage;
+    for (const extent_token_t &token : extent_tokens(cmdsubst_begin, cmdsubst_end, &storage)) {
         size_t tok_begin = token.offset;
         size_t tok_end = tok_begin;
 
         // Calculate end of token.
         if (token.type == TOK_STRING) {
-            tok_end += token.text.size();
+            tok_end += token.length;
         }
 
         // Cursor was before beginning of this token, means that the cursor is between two tokens,
@@ -390,14 +436,14 @@ void parse_util_token_extent(const wchar_t *buff, size_t cursor_pos, const wchar
         // and break.
         if (token.type == TOK_STRING && tok_end >= offset_within_cmdsubst) {
             a = cmdsubst_begin + token.offset;
-            b = a + token.text.size();
+            b = a + token.length;
             break;
         }
 
         // Remember previous string token.
         if (token.type == TOK_STRING) {
             pa = cmdsubst_begin + token.offset;
-            pb = pa + token.text.size();
+            pb = pa + token.length;
         }
     }
 
@@ -1297,3 +1343,254 @@ parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src,
 
     return res;
 }
+
+/// Identifies a parse tree cache file. Bump the digit when changing the layout.
+#define PARSE_TREE_CACHE_MAGIC "fishptc1"
+
+/// The header of a parse tree cache file, which is followed by the serialized tree.
+struct parse_tree_cache_header_t {
+    char magic[8];
+    // Hash of the version of fish that wrote the file, since the grammar may change between them.
+    uint64_t version_hash;
+    uint64_t source_length;
+    uint64_t source_hash;
+    uint64_t tree_length;
+};
+
+/// FNV-1a hash of the given characters.
+static uint64_t parse_tree_cache_hash(const wchar_t *chars, size_t count) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < count; i++) {
+        hash ^= (uint32_t)chars[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t parse_tree_cache_version_hash() {
+    static const wcstring version = str2wcstring(get_fish_version());
+    return parse_tree_cache_hash(version.c_str(), version.size());
+}
+
+/// Return the directory holding parse tree cache files, or an empty string if there is none. This
+/// is computed once, so that files may be prefetched from background threads.
+static const wcstring &parse_tree_cache_dir() {
+    static const wcstring dir = [] {
+        wcstring result;
+        if (path_get_data(result)) result.append(L"/parse_cache");
+        return result;
+    }();
+    return dir;
+}
+
+/// Return the path of the cache file for the script at the given path, or an empty string if there
+/// is nowhere to cache it.
+static wcstring parse_tree_cache_path(const wcstring &path) {
+    const wcstring &dir = parse_tree_cache_dir();
+    if (dir.empty()) return wcstring();
+    wcstring result = dir;
+    append_format(result, L"/%016llx",
+                  (unsigned long long)parse_tree_cache_hash(path.c_str(), path.size()));
+    return result;
+}
+
+/// Read the cached tree for the given source from the cache file at cache_path.
+static bool read_cached_tree(const wcstring &cache_path, const wcstring &src,
+                             parse_node_tree_t *out_tree) {
+    int fd = wopen_cloexec(cache_path, O_RDONLY);
+    if (fd < 0) return false;
+
+    bool result = false;
+    parse_tree_cache_header_t header;
+    if (read_loop(fd, &header, sizeof header) == (ssize_t)sizeof header &&
+        !memcmp(header.magic, PARSE_TREE_CACHE_MAGIC, sizeof header.magic) &&
+        header.version_hash == parse_tree_cache_version_hash() &&
+        header.source_length == src.size() &&
+        header.source_hash == parse_tree_cache_hash(src.c_str(), src.size()) &&
+        header.tree_length <= src.size() * 1024 + 1024) {
+        std::string data(header.tree_length, '\0');
+        result = read_loop(fd, &data[0], data.size()) == (ssize_t)data.size() &&
+                 parse_tree_deserialize(data.data(), data.size(), src.size(), out_tree);
+    }
+    close(fd);
+    return result;
+}
+
+/// Write the tree for the given source to the cache file at cache_path, replacing it atomically.
+static void write_cached_tree(const wcstring &cache_path, const wcstring &src,
+                              const parse_node_tree_t &tree) {
+    std::string data;
+    parse_tree_serialize(tree, &data);
+
+    parse_tree_cache_header_t header = {};
+    memcpy(header.magic, PARSE_TREE_CACHE_MAGIC, sizeof header.magic);
+    header.version_hash = parse_tree_cache_version_hash();
+    header.source_length = src.size();
+    header.source_hash = parse_tree_cache_hash(src.c_str(), src.size());
+    header.tree_length = data.size();
+
+    if (wmkdir(parse_tree_cache_dir(), 0700) == -1 && errno != EEXIST) return;
+    std::string narrow_tmp = wcs2string(cache_path + L".XXXXXX");
+    int fd = fish_mkstemp_cloexec(&narrow_tmp[0]);
+    if (fd < 0) return;
+    const wcstring tmp_path = str2wcstring(narrow_tmp);
+    bool ok = write_loop(fd, (const char *)&header, sizeof header) >= 0 &&
+              write_loop(fd, data.data(), data.size()) >= 0;
+    close(fd);
+    if (!ok || wrename(tmp_path, cache_path) == -1) {
+        debug(2, L"Error %d when writing parse tree cache", errno);
+        wunlink(tmp_path);
+    }
+}
+
+/// Like parse_util_detect_errors_in_file, but only looking in the cache on disk.
+static parser_test_error_bits_t detect_errors_in_file_using_disk_cache(
+    const wcstring &path, const wcstring &src, parse_error_list_t *out_errors,
+    parse_node_tree_t *out_tree) {
+    const wcstring cache_path = parse_tree_cache_path(path);
+    if (!cache_path.empty() && read_cached_tree(cache_path, src, out_tree)) {
+        if (out_errors) out_errors->clear();
+        return 0;
+    }
+
+    parse_node_tree_t tree;
+    parser_test_error_bits_t res =
+        parse_util_detect_errors(src, out_errors, false /* do not accept incomplete */, &tree);
+    if (res == 0 && !cache_path.empty()) write_cached_tree(cache_path, src, tree);
+    *out_tree = std::move(tree);
+    return res;
+}
+
+/// The most prefetched trees we hold on to that have not yet been used.
+#define PARSE_UTIL_MAX_PREFETCHED_TREES 64
+
+/// A tree parsed ahead of time for the script at some path, along with the contents it is for.
+struct prefetched_tree_t {
+    enum state_t {
+        /// Waiting for a background thread to pick it up.
+        queued,
+        /// Being read and parsed by a background thread.
+        running,
+        /// The tree and source are filled in.
+        done
+    };
+    state_t state = done;
+    wcstring src;
+    parse_node_tree_t tree;
+};
+
+/// Prefetched trees keyed by script path, and the condition signalled when a prefetch finishes.
+static std::mutex s_prefetch_lock;
+static std::unordered_map<wcstring, prefetched_tree_t> s_prefetched_trees;
+static std::condition_variable s_prefetch_finished;
+
+/// Remove and return the prefetched tree for the given script, provided it is for the given
+/// contents. If a background thread is parsing the script this waits for it, rather than parsing
+/// it a second time. A prefetch that has not started yet is called off.
+static bool take_prefetched_tree(const wcstring &path, const wcstring &src,
+                                 parse_node_tree_t *out_tree) {
+    std::unique_lock<std::mutex> locker(s_prefetch_lock);
+    auto where = s_prefetched_trees.find(path);
+    while (where != s_prefetched_trees.end() && where->second.state == prefetched_tree_t::running) {
+        s_prefetch_finished.wait(locker);
+        where = s_prefetched_trees.find(path);
+    }
+    if (where == s_prefetched_trees.end()) return false;
+    bool result = where->second.state == prefetched_tree_t::done && where->second.src == src;
+    if (result) *out_tree = std::move(where->second.tree);
+    s_prefetched_trees.erase(where);
+    return result;
+}
+
+/// Read and check the script at the given path and store its tree in the entry for it, unless
+/// the entry was taken in the meantime. The entry must be marked as running.
+static void prefetch_file(const wcstring &path) {
+    bool ok = false;
+    wcstring src;
+    parse_node_tree_t tree;
+    int fd = wopen_cloexec(path, O_RDONLY);
+    if (fd >= 0) {
+        std::string bytes;
+        char buff[4096];
+        ssize_t amt;
+        while ((amt = read_loop(fd, buff, sizeof buff)) > 0) bytes.append(buff, amt);
+        close(fd);
+
+        // Decode the file as read_ni does, so that the contents compare equal.
+        src = str2wcstring(bytes);
+        if (!src.empty() && src.at(0) == UTF8_BOM_WCHAR) src.erase(0, 1);
+        ok = amt == 0 && !detect_errors_in_file_using_disk_cache(path, src, NULL, &tree);
+    }
+
+    std::lock_guard<std::mutex> locker(s_prefetch_lock);
+    auto where = s_prefetched_trees.find(path);
+    if (where != s_prefetched_trees.end()) {
+        if (ok) {
+            where->second.state = prefetched_tree_t::done;
+            where->second.src = std::move(src);
+            where->second.tree = std::move(tree);
+        } else {
+            s_prefetched_trees.erase(where);
+        }
+    }
+    s_prefetch_finished.notify_all();
+}
+
+/// Add an entry for the given path in the given state, unless there is one already. The lock must
+/// be held. Returns whether an entry was added.
+static bool add_prefetch_entry(const wcstring &path, prefetched_tree_t::state_t state) {
+    if (s_prefetched_trees.count(path)) return false;
+    if (s_prefetched_trees.size() >= PARSE_UTIL_MAX_PREFETCHED_TREES) {
+        // Drop trees nobody took, but keep those that are still to come.
+        for (auto iter = s_prefetched_trees.begin(); iter != s_prefetched_trees.end();) {
+            if (iter->second.state == prefetched_tree_t::done) {
+                iter = s_prefetched_trees.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+    s_prefetched_trees[path].state = state;
+    return true;
+}
+
+void parse_util_prefetch_file(const wcstring &path) {
+    {
+        std::lock_guard<std::mutex> locker(s_prefetch_lock);
+        if (!add_prefetch_entry(path, prefetched_tree_t::running)) return;
+    }
+    prefetch_file(path);
+}
+
+void parse_util_prefetch_files(const wcstring_list_t &paths) {
+    ASSERT_IS_MAIN_THREAD();
+    for (const wcstring &path : paths) {
+        {
+            std::lock_guard<std::mutex> locker(s_prefetch_lock);
+            if (!add_prefetch_entry(path, prefetched_tree_t::queued)) continue;
+        }
+        iothread_perform([=]() {
+            {
+                std::lock_guard<std::mutex> locker(s_prefetch_lock);
+                auto where = s_prefetched_trees.find(path);
+                if (where == s_prefetched_trees.end() ||
+                    where->second.state != prefetched_tree_t::queued) {
+                    return;
+                }
+                where->second.state = prefetched_tree_t::running;
+            }
+            prefetch_file(path);
+        });
+    }
+}
+
+parser_test_error_bits_t parse_util_detect_errors_in_file(const wcstring &path,
+                                                          const wcstring &src,
+                                                          parse_error_list_t *out_errors,
+                                                          parse_node_tree_t *out_tree) {
+    if (take_prefetched_tree(path, src, out_tree)) {
+        if (out_errors) out_errors->clear();
+        return 0;
+    }
+    return detect_errors_in_file_using_disk_cache(path, src, out_errors, out_tree);
+}
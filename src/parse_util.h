@@ -131,6 +131,24 @@ parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src,
                                                   bool allow_incomplete = true,
                                                   parse_node_tree_t *out_tree = NULL);
 
+/// Like parse_util_detect_errors with allow_incomplete unset, for the contents src of the script at
+/// the given path. The tree of an error-free script is cached on disk, keyed by its path, so that
+/// later calls with the same contents, from this or another fish process, skip parsing.
+parser_test_error_bits_t parse_util_detect_errors_in_file(const wcstring &path,
+                                                          const wcstring &src,
+                                                          parse_error_list_t *out_errors,
+                                                          parse_node_tree_t *out_tree);
+
+/// Read and check the script at the given path, so that a later call to
+/// parse_util_detect_errors_in_file for the same contents finds its tree in memory. This may be
+/// called from any thread.
+void parse_util_prefetch_file(const wcstring &path);
+
+/// Queue reading and checking the scripts at the given paths on background threads, each like
+/// parse_util_prefetch_file. Sourcing one of them afterwards waits for its prefetch if that is
+/// under way, and reads it itself if the prefetch has not started. Only call on the main thread.
+void parse_util_prefetch_files(const wcstring_list_t &paths);
+
 /// Test if this argument contains any errors. Detected errors include syntax errors in command
 /// substitutions, improperly escaped characters and improper use of the variable expansion
 /// operator. This does NOT currently detect unterminated quotes.
@@ -2,10 +2,14 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <stdio.h>
+#include <sys/time.h>
 #include <wchar.h>
 
 #include <algorithm>
+#include <cstddef>
+#include <map>
 #include <memory>
+#include <unordered_map>
 
 #include "common.h"
 #include "env.h"
@@ -14,6 +18,7 @@
 #include "fallback.h"  // IWYU pragma: keep
 #include "function.h"
 #include "intern.h"
+#include "lru.h"
 #include "parse_constants.h"
 #include "parse_execution.h"
 #include "parse_tree.h"
@@ -22,6 +27,7 @@
 #include "proc.h"
 #include "reader.h"
 #include "sanity.h"
+#include "tokenizer.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 class io_chain_t;
@@ -127,10 +133,8 @@ void parser_t::push_block_int(block_t *new_current) {
     const enum block_type_t type = new_current->type();
     new_current->src_lineno = parser_t::get_lineno();
 
-    const wchar_t *filename = parser_t::current_filename();
-    if (filename != NULL) {
-        new_current->src_filename = intern(filename);
-    }
+    // current_filename() is already interned.
+    new_current->src_filename = parser_t::current_filename();
 
     // New blocks should be skipped if the outer block is skipped, except TOP and SUBST block, which
     // open up new environments.
@@ -243,9 +247,16 @@ block_t *parser_t::block_at_index(size_t idx) {
 
 block_t *parser_t::current_block() { return block_stack.empty() ? NULL : block_stack.back().get(); }
 
-void parser_t::forbid_function(const wcstring &function) { forbidden_function.push_back(function); }
+void parser_t::forbid_function(const wcstring &function,
+                               function_definition_ref_t definition) {
+    forbidden_function.push_back(function);
+    forbidden_definitions.push_back(std::move(definition));
+}
 
-void parser_t::allow_function() { forbidden_function.pop_back(); }
+void parser_t::allow_function() {
+    forbidden_function.pop_back();
+    forbidden_definitions.pop_back();
+}
 
 /// Print profiling information to the specified stream.
 static void print_profile(const std::vector<std::unique_ptr<profile_item_t>> &items, FILE *out) {
@@ -298,17 +309,232 @@ static void print_profile(const std::vector<std::unique_ptr<profile_item_t>> &it
     }
 }
 
-void parser_t::emit_profiling(const char *path) const {
+/// Return the index of the item that ran each profile item, or items.size() for top level items.
+/// Skipped items are ignored: they are run by nothing and run nothing.
+static std::vector<size_t> profile_parents(
+    const std::vector<std::unique_ptr<profile_item_t>> &items) {
+    std::vector<size_t> parents(items.size(), items.size());
+    std::vector<size_t> stack;
+    for (size_t pos = 0; pos < items.size(); pos++) {
+        const profile_item_t &item = *items.at(pos);
+        if (item.skipped) continue;
+        while (!stack.empty() && items.at(stack.back())->level >= item.level) stack.pop_back();
+        if (!stack.empty()) parents.at(pos) = stack.back();
+        stack.push_back(pos);
+    }
+    return parents;
+}
+
+/// Return the time spent in each profile item itself, rather than in the items it ran.
+static std::vector<long long> profile_self_times(
+    const std::vector<std::unique_ptr<profile_item_t>> &items, const std::vector<size_t> &parents) {
+    std::vector<long long> self(items.size());
+    for (size_t pos = 0; pos < items.size(); pos++) {
+        const profile_item_t &item = *items.at(pos);
+        if (item.skipped) continue;
+        self.at(pos) += item.parse + item.exec;
+        if (parents.at(pos) < items.size()) self.at(parents.at(pos)) -= item.parse + item.exec;
+    }
+    return self;
+}
+
+/// Describe where a profile item came from.
+static wcstring profile_location(const profile_item_t &item) {
+    wcstring result = item.file ? item.file : L"-";
+    if (item.line >= 0) append_format(result, L":%d", item.line);
+    return result;
+}
+
+/// Print one line per function and source line, with the self time, total time and number of
+/// commands run there, most expensive first. A line that runs itself recursively only adds to its
+/// total time once.
+static void print_profile_aggregate(const std::vector<std::unique_ptr<profile_item_t>> &items,
+                                    FILE *out) {
+    struct row_t {
+        const profile_item_t *first;
+        size_t count;
+        long long self;
+        long long total;
+    };
+    std::vector<row_t> rows;
+    std::unordered_map<wcstring, size_t> row_for_key;
+    std::vector<size_t> row_of_item(items.size());
+
+    const std::vector<size_t> parents = profile_parents(items);
+    const std::vector<long long> self = profile_self_times(items, parents);
+    for (size_t pos = 0; pos < items.size(); pos++) {
+        const profile_item_t &item = *items.at(pos);
+        if (item.skipped || item.cmd.empty()) continue;
+        wcstring key = item.function;
+        key.push_back(L'\0');
+        key.append(profile_location(item));
+        auto where = row_for_key.find(key);
+        if (where == row_for_key.end()) {
+            where = row_for_key.emplace(std::move(key), rows.size()).first;
+            rows.push_back({&item, 0, 0, 0});
+        }
+        row_t &row = rows.at(where->second);
+        row_of_item.at(pos) = where->second;
+        row.count++;
+        row.self += self.at(pos);
+
+        bool recursive = false;
+        for (size_t up = parents.at(pos); up < items.size() && !recursive; up = parents.at(up)) {
+            recursive = !items.at(up)->cmd.empty() && row_of_item.at(up) == where->second;
+        }
+        if (!recursive) row.total += item.parse + item.exec;
+    }
+
+    std::stable_sort(rows.begin(), rows.end(),
+                     [](const row_t &a, const row_t &b) { return a.self > b.self; });
+    wcstring text;
+    for (const row_t &row : rows) {
+        const profile_item_t &item = *row.first;
+        append_format(text, L"%lld\t%lld\t%lu\t%ls\t%ls\t%ls\n", row.self, row.total,
+                      (unsigned long)row.count, profile_location(item).c_str(),
+                      item.function.empty() ? L"-" : item.function.c_str(), item.cmd.c_str());
+    }
+    if (fwprintf(out, L"%ls", text.c_str()) < 0) wperror(L"fwprintf");
+}
+
+/// Print the self time of each stack of commands, in the "collapsed" format that flamegraph tools
+/// read: the frames separated by semicolons, a space and the time in microseconds.
+static void print_profile_collapsed(const std::vector<std::unique_ptr<profile_item_t>> &items,
+                                    FILE *out) {
+    const std::vector<size_t> parents = profile_parents(items);
+    const std::vector<long long> self = profile_self_times(items, parents);
+    std::vector<wcstring> stacks(items.size());
+    std::map<wcstring, long long> self_for_stack;
+    for (size_t pos = 0; pos < items.size(); pos++) {
+        const profile_item_t &item = *items.at(pos);
+        if (item.skipped) continue;
+        wcstring frame = tok_first(item.cmd);
+        if (frame.empty()) frame = L"-";
+        append_format(frame, L" (%ls)", profile_location(item).c_str());
+        std::replace(frame.begin(), frame.end(), L';', L':');
+        std::replace(frame.begin(), frame.end(), L'\n', L' ');
+
+        const size_t parent = parents.at(pos);
+        if (parent < items.size()) {
+            stacks.at(pos) = stacks.at(parent);
+            stacks.at(pos).push_back(L';');
+        }
+        stacks.at(pos).append(frame);
+        if (self.at(pos) > 0) self_for_stack[stacks.at(pos)] += self.at(pos);
+    }
+
+    wcstring text;
+    for (const auto &stack : self_for_stack) {
+        append_format(text, L"%ls %lld\n", stack.first.c_str(), stack.second);
+    }
+    if (fwprintf(out, L"%ls", text.c_str()) < 0) wperror(L"fwprintf");
+}
+
+volatile sig_atomic_t g_sample_ticks = 0;
+
+/// The signal disposition of SIGPROF from before we started sampling.
+static struct sigaction s_saved_sigprof_action;
+
+static void handle_sample_tick(int sig) {
+    UNUSED(sig);
+    g_sample_ticks = g_sample_ticks + 1;
+}
+
+bool parser_t::start_sampling(long interval_usec) {
+    ASSERT_IS_MAIN_THREAD();
+    struct sigaction act;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    act.sa_handler = handle_sample_tick;
+    struct sigaction old_act;
+    if (sigaction(SIGPROF, &act, &old_act) == -1) return false;
+    // Only remember the original disposition, if sampling is restarted.
+    if (old_act.sa_handler != handle_sample_tick) s_saved_sigprof_action = old_act;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_usec / 1000000;
+    timer.it_interval.tv_usec = interval_usec % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+        sigaction(SIGPROF, &s_saved_sigprof_action, NULL);
+        return false;
+    }
+    return true;
+}
+
+wcstring parser_t::stop_sampling() {
+    ASSERT_IS_MAIN_THREAD();
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    struct sigaction old_act;
+    if (sigaction(SIGPROF, NULL, &old_act) == 0 && old_act.sa_handler == handle_sample_tick) {
+        sigaction(SIGPROF, &s_saved_sigprof_action, NULL);
+    }
+    g_sample_ticks = 0;
+
+    wcstring result;
+    for (const auto &sample : samples) {
+        append_format(result, L"%ls %lu\n", sample.first.c_str(), sample.second);
+    }
+    samples.clear();
+    return result;
+}
+
+void parser_t::take_sample(const wcstring &cmd) {
+    const unsigned long ticks = g_sample_ticks;
+    g_sample_ticks = 0;
+    if (ticks == 0) return;
+
+    // The stack is the function calls and sourced files the command ran in, outermost first.
+    wcstring stack;
+    for (size_t i = this->block_count(); i-- > 0;) {
+        const block_t *b = this->block_at_index(i);
+        if (b->type() == FUNCTION_CALL || b->type() == FUNCTION_CALL_NO_SHADOW) {
+            stack.append(static_cast<const function_block_t *>(b)->name);
+            stack.push_back(L';');
+        } else if (b->type() == SOURCE) {
+            const source_block_t *sb = static_cast<const source_block_t *>(b);
+            append_format(stack, L"source %ls;", sb->source_file);
+        }
+    }
+    wcstring frame = tok_first(cmd);
+    if (frame.empty()) frame = L"-";
+    const wchar_t *file = this->current_filename();
+    append_format(frame, L" (%ls:%d)", file ? file : L"-", this->get_lineno());
+    std::replace(frame.begin(), frame.end(), L';', L':');
+    std::replace(frame.begin(), frame.end(), L'\n', L' ');
+    stack.append(frame);
+    samples[stack] += ticks;
+}
+
+void parser_t::emit_profiling(const char *path, profile_format_t format) const {
     // Save profiling information. OK to not use CLO_EXEC here because this is called while fish is
     // dying (and hence will not fork).
     FILE *f = fopen(path, "w");
     if (!f) {
         debug(1, _(L"Could not write profiling information to file '%s'"), path);
     } else {
-        if (fwprintf(f, _(L"Time\tSum\tCommand\n"), profile_items.size()) < 0) {
-            wperror(L"fwprintf");
-        } else {
-            print_profile(profile_items, f);
+        switch (format) {
+            case profile_format_raw: {
+                if (fwprintf(f, _(L"Time\tSum\tCommand\n"), profile_items.size()) < 0) {
+                    wperror(L"fwprintf");
+                } else {
+                    print_profile(profile_items, f);
+                }
+                break;
+            }
+            case profile_format_aggregate: {
+                if (fwprintf(f, _(L"Self\tTotal\tCount\tLocation\tFunction\tCommand\n")) < 0) {
+                    wperror(L"fwprintf");
+                } else {
+                    print_profile_aggregate(profile_items, f);
+                }
+                break;
+            }
+            case profile_format_collapsed: {
+                print_profile_collapsed(profile_items, f);
+                break;
+            }
         }
 
         if (fclose(f)) {
@@ -637,11 +863,47 @@ profile_item_t *parser_t::create_profile_item() {
     if (g_profiling_active) {
         profile_items.push_back(make_unique<profile_item_t>());
         result = profile_items.back().get();
+        const wchar_t *function = this->is_function();
+        if (function) result->function = function;
+        result->file = this->current_filename();
+        result->line = this->get_lineno();
     }
     return result;
 }
 
+/// Maximum number of sources whose parse trees parser_t::eval keeps.
+#define EVAL_TREE_CACHE_SIZE 64
+
+/// Sources longer than this are not kept. The long ones are sourced files, which are rarely
+/// evaluated twice, and their trees are big.
+#define EVAL_TREE_CACHE_MAX_SOURCE 4096
+
+namespace {
+/// Parse trees of the sources given to parser_t::eval, keyed by source. Event handlers, key
+/// bindings and eval in loops evaluate the same strings over and over.
+class eval_tree_cache_t
+    : public lru_cache_t<eval_tree_cache_t, std::shared_ptr<const parse_node_tree_t>> {
+    typedef lru_cache_t<eval_tree_cache_t, std::shared_ptr<const parse_node_tree_t>> super;
+
+   public:
+    eval_tree_cache_t() : super(EVAL_TREE_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+/// Main thread only.
+static eval_tree_cache_t s_eval_tree_cache;
+
 int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type) {
+    const bool use_cache = cmd.size() <= EVAL_TREE_CACHE_MAX_SOURCE && is_main_thread();
+    if (use_cache) {
+        if (const auto *cached = s_eval_tree_cache.get(cmd)) {
+            // The execution context takes ownership of its tree, so hand it a copy.
+            parse_node_tree_t tree;
+            tree.assign((*cached)->begin(), (*cached)->end());
+            return this->eval(cmd, io, block_type, std::move(tree));
+        }
+    }
+
     // Parse the source into a tree, if we can.
     parse_node_tree_t tree;
     parse_error_list_t error_list;
@@ -654,11 +916,16 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
         fwprintf(stderr, L"%ls\n", backtrace_and_desc.c_str());
         return 1;
     }
+    if (use_cache) {
+        auto cached = std::make_shared<parse_node_tree_t>();
+        cached->assign(tree.begin(), tree.end());
+        s_eval_tree_cache.insert(cmd, std::move(cached));
+    }
     return this->eval(cmd, io, block_type, std::move(tree));
 }
 
 int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type,
-                   parse_node_tree_t tree) {
+                   parse_node_tree_t tree, int first_line) {
     CHECK_BLOCK(1);
     assert(block_type == TOP || block_type == SUBST);
 
@@ -675,7 +942,8 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
 
     // Append to the execution context stack.
     execution_contexts.push_back(
-        make_unique<parse_execution_context_t>(std::move(tree), cmd, this, exec_eval_level));
+        make_unique<parse_execution_context_t>(std::move(tree), cmd, this, exec_eval_level,
+                                               first_line));
     const parse_execution_context_t *ctx = execution_contexts.back().get();
 
     // Execute the first node.
@@ -770,7 +1038,7 @@ bool parser_t::detect_errors_in_argument_list(const wcstring &arg_list_src, wcst
 }
 
 void parser_t::get_backtrace(const wcstring &src, const parse_error_list_t &errors,
-                             wcstring &output) const {
+                             wcstring &output, int first_line) const {
     if (!errors.empty()) {
         const parse_error_t &err = errors.at(0);
 
@@ -783,7 +1051,8 @@ void parser_t::get_backtrace(const wcstring &src, const parse_error_list_t &erro
         bool skip_caret = true;
         if (err.source_start != SOURCE_LOCATION_UNKNOWN && err.source_start <= src.size()) {
             // Determine which line we're on.
-            which_line = 1 + std::count(src.begin(), src.begin() + err.source_start, L'\n');
+            which_line =
+                1 + first_line + std::count(src.begin(), src.begin() + err.source_start, L'\n');
 
             // Don't include the caret if we're interactive, this is the first line of text, and our
             // source is at its beginning, because then it's obvious.
@@ -827,6 +1096,33 @@ block_t::block_t(block_type_t t)
 
 block_t::~block_t() {}
 
+/// Freed blocks, by size in units of the alignment. A handful of each size covers the deepest
+/// nesting of blocks that is commonly pushed and popped over and over.
+static const size_t kBlockPoolUnit = alignof(std::max_align_t);
+static const size_t kBlockPoolSizes = 512 / kBlockPoolUnit;
+static const size_t kBlockPoolDepth = 32;
+static std::vector<void *> s_block_pool[kBlockPoolSizes];
+
+void *block_t::operator new(size_t size) {
+    const size_t bucket = (size + kBlockPoolUnit - 1) / kBlockPoolUnit;
+    if (bucket < kBlockPoolSizes && is_main_thread() && !s_block_pool[bucket].empty()) {
+        void *result = s_block_pool[bucket].back();
+        s_block_pool[bucket].pop_back();
+        return result;
+    }
+    return ::operator new(bucket * kBlockPoolUnit);
+}
+
+void block_t::operator delete(void *p, size_t size) {
+    const size_t bucket = (size + kBlockPoolUnit - 1) / kBlockPoolUnit;
+    if (bucket < kBlockPoolSizes && is_main_thread() &&
+        s_block_pool[bucket].size() < kBlockPoolDepth) {
+        s_block_pool[bucket].push_back(p);
+        return;
+    }
+    ::operator delete(p);
+}
+
 wcstring block_t::description() const {
     wcstring result;
     switch (this->type()) {
@@ -7,6 +7,7 @@
 
 #include <csignal>
 #include <list>
+#include <map>
 #include <memory>
 #include <type_traits>
 #include <vector>
@@ -14,6 +15,7 @@
 #include "common.h"
 #include "event.h"
 #include "expand.h"
+#include "function.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
 #include "proc.h"
@@ -102,6 +104,11 @@ struct block_t {
 
     /// Destructor
     virtual ~block_t();
+
+    /// Blocks are pushed and popped all the time, e.g. for each function call or if statement in a
+    /// loop, so the main thread recycles their memory rather than returning it to the heap.
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
 };
 
 struct if_block_t : public block_t {
@@ -173,8 +180,27 @@ struct profile_item_t {
     bool skipped;
     /// The command string.
     wcstring cmd;
+    /// The function the command ran in, or empty at the top level.
+    wcstring function;
+    /// The (interned) file and the line the command came from. The file may be NULL.
+    const wchar_t *file;
+    int line;
+};
+
+/// Ways of writing out profiling information.
+enum profile_format_t {
+    /// Every command in the order it ran, indented by block level.
+    profile_format_raw,
+    /// One entry per function and source line, with self and total times.
+    profile_format_aggregate,
+    /// Stacks of commands and their self times, in the "collapsed" format of flamegraph tools.
+    profile_format_collapsed
 };
 
+/// How often the sampling profiler's timer went off since the parser last took a sample. This is
+/// set from a signal handler; the parser takes a sample when it next finishes a job.
+extern volatile sig_atomic_t g_sample_ticks;
+
 class parse_execution_context_t;
 class completion_t;
 
@@ -190,6 +216,8 @@ class parser_t {
     std::vector<std::unique_ptr<parse_execution_context_t>> execution_contexts;
     /// List of called functions, used to help prevent infinite recursion.
     wcstring_list_t forbidden_function;
+    /// The definitions of the called functions, in the same order.
+    std::vector<function_definition_ref_t> forbidden_definitions;
     /// The jobs associated with this parser.
     job_list_t my_job_list;
     /// The list of blocks
@@ -207,6 +235,9 @@ class parser_t {
     /// to profile_items)
     std::vector<std::unique_ptr<profile_item_t>> profile_items;
 
+    /// The number of samples the sampling profiler took of each stack of commands.
+    std::map<wcstring, unsigned long> samples;
+
     // No copying allowed.
     parser_t(const parser_t &);
     parser_t &operator=(const parser_t &);
@@ -233,6 +264,9 @@ class parser_t {
     /// from signal handlers!
     static void skip_all_blocks();
 
+    /// Returns whether execution of all blocks was asked to stop and has not finished stopping.
+    bool is_cancelling() const { return cancellation_requested; }
+
     /// Create a parser.
     parser_t();
 
@@ -249,8 +283,10 @@ class parser_t {
     int eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type);
 
     /// Evaluate the expressions contained in cmd, which has been parsed into the given parse tree.
+    /// If cmd is only part of a script, first_line is the number of lines before it, so that line
+    /// numbers are reported relative to the whole script.
     int eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type,
-             parse_node_tree_t t);
+             parse_node_tree_t t, int first_line = 0);
 
     /// Evaluates a block node at the given node offset in the topmost execution context.
     int eval_block_node(node_offset_t node_idx, const io_chain_t &io, enum block_type_t block_type);
@@ -326,8 +362,10 @@ class parser_t {
     /// parser_t will clean it up.
     profile_item_t *create_profile_item();
 
-    void get_backtrace(const wcstring &src, const parse_error_list_t &errors,
-                       wcstring &output) const;
+    /// Append to output a description of the first of the errors found in src. first_line is as
+    /// for eval().
+    void get_backtrace(const wcstring &src, const parse_error_list_t &errors, wcstring &output,
+                       int first_line = 0) const;
 
     /// Detect errors in the specified string when parsed as an argument list. Returns true if an
     /// error occurred.
@@ -336,13 +374,25 @@ class parser_t {
 
     /// Tell the parser that the specified function may not be run if not inside of a conditional
     /// block. This is to remove some possibilities of infinite recursion.
-    void forbid_function(const wcstring &function);
+    void forbid_function(const wcstring &function, function_definition_ref_t definition);
 
     /// Undo last call to parser_forbid_function().
     void allow_function();
 
     /// Output profiling data to the given filename.
-    void emit_profiling(const char *path) const;
+    void emit_profiling(const char *path, profile_format_t format = profile_format_raw) const;
+
+    /// Start sampling what the parser runs every interval_usec microseconds of CPU time. Unlike
+    /// profiling, this costs nothing between samples. Returns false if the timer could not be set.
+    bool start_sampling(long interval_usec);
+
+    /// Stop sampling, and return the samples taken as lines of stacks of commands and the number
+    /// of samples of each, in the "collapsed" format of flamegraph tools.
+    wcstring stop_sampling();
+
+    /// Record the samples due (g_sample_ticks) as having been spent in the given command, which the
+    /// parser has just run.
+    void take_sample(const wcstring &cmd);
 
     /// Returns the file currently evaluated by the parser. This can be different than
     /// reader_current_filename, e.g. if we are evaulating a function defined in a different file
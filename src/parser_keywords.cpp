@@ -6,24 +6,54 @@
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "parser_keywords.h"
+#include "perfect_hash.h"
+
+/// What a keyword is. Every keyword is reserved.
+enum {
+    keyword_skips_arguments = 1 << 0,
+    keyword_is_subcommand = 1 << 1,
+    keyword_is_block = 1 << 2,
+};
+
+/// Returns the flags of the given keyword, or -1 if it is not one.
+static int keyword_flags(const wcstring &word) {
+    // These are asked about for every command highlighted or run, so use a perfect hash.
+    static const perfect_hash_t<int> keyword_table(
+        {{L"else", keyword_skips_arguments | keyword_is_subcommand},
+         {L"begin", keyword_skips_arguments | keyword_is_subcommand | keyword_is_block},
+         {L"command", keyword_is_subcommand},
+         {L"builtin", keyword_is_subcommand},
+         {L"exec", keyword_is_subcommand},
+         {L"and", keyword_is_subcommand},
+         {L"or", keyword_is_subcommand},
+         {L"not", keyword_is_subcommand},
+         {L"while", keyword_is_subcommand | keyword_is_block},
+         {L"if", keyword_is_subcommand | keyword_is_block},
+         {L"for", keyword_is_block},
+         {L"function", keyword_is_block},
+         {L"switch", keyword_is_block},
+         {L"end", 0},
+         {L"case", 0},
+         {L"return", 0},
+         {L"continue", 0},
+         {L"break", 0}},
+        -1);
+    return keyword_table.get(word);
+}
 
 bool parser_keywords_skip_arguments(const wcstring &cmd) {
-    return cmd == L"else" || cmd == L"begin";
+    int flags = keyword_flags(cmd);
+    return flags >= 0 && (flags & keyword_skips_arguments);
 }
 
-static const wcstring_list_t subcommand_keywords({L"command", L"builtin", L"while", L"exec", L"if",
-                                                  L"and", L"or", L"not"});
 bool parser_keywords_is_subcommand(const wcstring &cmd) {
-    return parser_keywords_skip_arguments(cmd) || contains(subcommand_keywords, cmd);
+    int flags = keyword_flags(cmd);
+    return flags >= 0 && (flags & keyword_is_subcommand);
 }
 
-static const wcstring_list_t block_keywords({L"for", L"while", L"if", L"function", L"switch",
-                                             L"begin"});
-bool parser_keywords_is_block(const wcstring &word) { return contains(block_keywords, word); }
-
-static const wcstring_list_t reserved_keywords({L"end", L"case", L"else", L"return", L"continue",
-                                                L"break"});
-bool parser_keywords_is_reserved(const wcstring &word) {
-    return parser_keywords_is_block(word) || parser_keywords_is_subcommand(word) ||
-           contains(reserved_keywords, word);
+bool parser_keywords_is_block(const wcstring &word) {
+    int flags = keyword_flags(word);
+    return flags >= 0 && (flags & keyword_is_block);
 }
+
+bool parser_keywords_is_reserved(const wcstring &word) { return keyword_flags(word) >= 0; }
@@ -6,9 +6,11 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <type_traits>
@@ -18,6 +20,7 @@
 #include "env.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "lru.h"
 #include "path.h"
 #include "wutil.h"  // IWYU pragma: keep
 
@@ -31,6 +34,148 @@
 // we've already tested.
 const wcstring_list_t dflt_pathsv({L"/bin", L"/usr/bin", PREFIX L"/bin"});
 
+/// The number of commands whose location in $PATH we remember.
+#define PATH_CACHE_SIZE 1024
+
+namespace {
+/// Where a command was found in $PATH. The modification times of the directories up to and
+/// including the one containing the command tell us whether searching again could give a different
+/// answer: adding the command to an earlier directory, or removing it, changes them.
+struct path_cache_entry_t {
+    /// The full path of the command.
+    wcstring path;
+    /// Modification times of the directories searched, or -1 for those that could not be stat'd.
+    std::vector<time_t> dir_mtimes;
+    /// When the directories were last found unchanged.
+    time_t checked;
+    /// How often the entry was used.
+    unsigned long hits;
+};
+
+/// Cache of command locations, keyed by command name. This is only valid for the list of
+/// directories it was filled from, which is cleared whenever $PATH changes.
+class path_cache_t : public lru_cache_t<path_cache_t, path_cache_entry_t> {
+    typedef lru_cache_t<path_cache_t, path_cache_entry_t> super;
+
+   public:
+    path_cache_t() : super(PATH_CACHE_SIZE) {}
+    wcstring_list_t dirs;
+};
+}  // anonymous namespace
+
+static owning_lock<path_cache_t> s_path_cache;
+
+/// The number of directories whose resolution through $CDPATH we remember.
+#define CDPATH_CACHE_SIZE 64
+
+namespace {
+/// How a directory resolved, and when its candidates were stat'd.
+struct cdpath_cache_entry_t {
+    /// The directory found, or empty if there was none.
+    wcstring path;
+    /// The errno to set if there was none.
+    int err;
+    time_t checked;
+};
+
+/// Cache of resolved directories, keyed by the candidate paths, separated by NULs. The candidates
+/// are built from $CDPATH, the working directory and the directory given, so any change to those
+/// misses the cache.
+class cdpath_cache_t : public lru_cache_t<cdpath_cache_t, cdpath_cache_entry_t> {
+    typedef lru_cache_t<cdpath_cache_t, cdpath_cache_entry_t> super;
+
+   public:
+    cdpath_cache_t() : super(CDPATH_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static owning_lock<cdpath_cache_t> s_cdpath_cache;
+
+static time_t path_dir_mtime(const wcstring &dir) {
+    struct stat buff;
+    if (wstat(dir, &buff) != 0) return -1;
+    return buff.st_mtime;
+}
+
+/// Look up the command in the cache, filled from the directories \p dirs. Entries are checked
+/// against the directories at most once a second, so that scripts running the same command in a
+/// loop do not search $PATH each time. Returns false if the command must be searched for.
+static bool path_cache_get(const wcstring &cmd, const wcstring_list_t &dirs, wcstring *out_path) {
+    const time_t now = time(NULL);
+    path_cache_entry_t entry;
+    {
+        auto &&locker = s_path_cache.acquire();
+        path_cache_t &cache = locker.value;
+        if (cache.dirs != dirs) {
+            cache.evict_all_nodes();
+            cache.dirs = dirs;
+            return false;
+        }
+        path_cache_entry_t *cached = cache.get(cmd);
+        if (!cached) return false;
+
+        if (cached->checked == now) {
+            cached->hits++;
+            if (out_path) *out_path = cached->path;
+            return true;
+        }
+        entry = *cached;
+    }
+
+    // Check the entry without holding the lock.
+    bool valid = waccess(entry.path, X_OK) == 0;
+    for (size_t i = 0; valid && i < entry.dir_mtimes.size(); i++) {
+        valid = path_dir_mtime(dirs.at(i)) == entry.dir_mtimes.at(i);
+    }
+
+    auto &&locker = s_path_cache.acquire();
+    path_cache_t &cache = locker.value;
+    if (!valid) {
+        cache.evict_node(cmd);
+        return false;
+    }
+    path_cache_entry_t *cached = cache.get(cmd);
+    if (cached && cached->path == entry.path) {
+        cached->checked = now;
+        cached->hits++;
+    }
+    if (out_path) *out_path = std::move(entry.path);
+    return true;
+}
+
+/// Remember that the command was found at \p path, in the directory at index \p dir_idx of
+/// \p dirs.
+static void path_cache_put(const wcstring &cmd, const wcstring_list_t &dirs, size_t dir_idx,
+                           const wcstring &path) {
+    // What relative directories contain depends on the working directory, not just their mtimes.
+    for (size_t i = 0; i <= dir_idx; i++) {
+        if (!dirs.at(i).empty() && dirs.at(i).at(0) != L'/') return;
+    }
+
+    const time_t now = time(NULL);
+    path_cache_entry_t entry = {path, {}, now, 1};
+    for (size_t i = 0; i <= dir_idx; i++) {
+        time_t mtime = path_dir_mtime(dirs.at(i));
+        // Further changes in this second would not change the mtime, so it can't be relied on.
+        if (mtime >= now) return;
+        entry.dir_mtimes.push_back(mtime);
+    }
+    // The earlier directories may have gained the command after we searched them but before we
+    // took their mtimes. Then the mtimes would already contain the change, so don't cache.
+    for (size_t i = 0; i < dir_idx; i++) {
+        if (dirs.at(i).empty()) continue;
+        wcstring candidate = dirs.at(i);
+        append_path_component(candidate, cmd);
+        if (waccess(candidate, X_OK) == 0) return;
+    }
+
+    auto &&locker = s_path_cache.acquire();
+    path_cache_t &cache = locker.value;
+    if (cache.dirs != dirs) return;
+    cache.evict_node(cmd);
+    cache.insert(cmd, std::move(entry));
+}
+
 static bool path_get_path_core(const wcstring &cmd, wcstring *out_path,
                                const maybe_t<env_var_t> &bin_path_var) {
     debug(3, L"path_get_path( '%ls' )", cmd.c_str());
@@ -61,8 +206,11 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path,
         pathsv = &dflt_pathsv;
     }
 
+    if (path_cache_get(cmd, *pathsv, out_path)) return true;
+
     int err = ENOENT;
-    for (auto next_path : *pathsv) {
+    for (size_t i = 0; i < pathsv->size(); i++) {
+        wcstring next_path = pathsv->at(i);
         if (next_path.empty()) continue;
         append_path_component(next_path, cmd);
         if (waccess(next_path, X_OK) == 0) {
@@ -74,6 +222,7 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path,
                 continue;
             }
             if (S_ISREG(buff.st_mode)) {
+                path_cache_put(cmd, *pathsv, i, next_path);
                 if (out_path) *out_path = std::move(next_path);
                 return true;
             }
@@ -114,6 +263,23 @@ bool path_get_path(const wcstring &cmd, wcstring *out_path) {
     return path_get_path_core(cmd, out_path, env_get(L"PATH"));
 }
 
+std::vector<path_cache_item_t> path_cache_items() {
+    std::vector<path_cache_item_t> result;
+    auto &&locker = s_path_cache.acquire();
+    for (const auto &kv : locker.value) {
+        result.push_back({kv.first, kv.second.path, kv.second.hits});
+    }
+    std::sort(result.begin(), result.end(),
+              [](const path_cache_item_t &a, const path_cache_item_t &b) {
+                  return a.command < b.command;
+              });
+    return result;
+}
+
+bool path_cache_forget(const wcstring &cmd) { return s_path_cache.acquire().value.evict_node(cmd); }
+
+void path_cache_reset() { s_path_cache.acquire().value.evict_all_nodes(); }
+
 wcstring_list_t path_get_paths(const wcstring &cmd) {
     debug(3, L"path_get_paths('%ls')", cmd.c_str());
     wcstring_list_t paths;
@@ -130,9 +296,8 @@ wcstring_list_t path_get_paths(const wcstring &cmd) {
     }
 
     auto path_var = env_get(L"PATH");
-    std::vector<wcstring> pathsv;
-    if (path_var) path_var->to_list(pathsv);
-    for (auto path : pathsv) {
+    if (!path_var) return paths;
+    for (auto path : path_var->as_list()) {
         if (path.empty()) continue;
         append_path_component(path, cmd);
         if (waccess(path, X_OK) == 0) {
@@ -149,7 +314,7 @@ wcstring_list_t path_get_paths(const wcstring &cmd) {
 }
 
 bool path_get_cdpath(const env_var_t &dir_var, wcstring *out, const wchar_t *wd,
-                     const env_vars_snapshot_t &env_vars) {
+                     const env_vars_snapshot_t &env_vars, bool allow_stale) {
     int err = ENOENT;
     if (dir_var.empty()) return false;
     wcstring dir = dir_var.as_string();
@@ -175,9 +340,7 @@ bool path_get_cdpath(const env_var_t &dir_var, wcstring *out, const wchar_t *wd,
         auto cdpaths = env_vars.get(L"CDPATH");
         if (cdpaths.missing_or_empty()) cdpaths = env_var_t(L"CDPATH", L".");
 
-        std::vector<wcstring> cdpathsv;
-        cdpaths->to_list(cdpathsv);
-        for (auto next_path : cdpathsv) {
+        for (auto next_path : cdpaths->as_list()) {
             if (next_path.empty()) next_path = L".";
             if (next_path == L"." && wd != NULL) {
                 // next_path is just '.', and we have a working directory, so use the wd instead.
@@ -193,14 +356,34 @@ bool path_get_cdpath(const env_var_t &dir_var, wcstring *out, const wchar_t *wd,
         }
     }
 
+    const time_t now = time(NULL);
+    wcstring cache_key;
+    if (allow_stale) {
+        for (const wcstring &path : paths) {
+            cache_key.append(path);
+            cache_key.push_back(L'\0');
+        }
+        auto &&locker = s_cdpath_cache.acquire();
+        const cdpath_cache_entry_t *cached = locker.value.get(cache_key);
+        if (cached && cached->checked == now) {
+            if (cached->path.empty()) {
+                errno = cached->err;
+                return false;
+            }
+            if (out) out->assign(cached->path);
+            return true;
+        }
+    }
+
     bool success = false;
+    wcstring found;
     for (wcstring_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
         struct stat buf;
         const wcstring &dir = *iter;
         if (wstat(dir, &buf) == 0) {
             if (S_ISDIR(buf.st_mode)) {
                 success = true;
-                if (out) out->assign(dir);
+                found = dir;
                 break;
             } else {
                 err = ENOTDIR;
@@ -208,12 +391,18 @@ bool path_get_cdpath(const env_var_t &dir_var, wcstring *out, const wchar_t *wd,
         }
     }
 
+    if (allow_stale) {
+        auto &&locker = s_cdpath_cache.acquire();
+        locker.value.evict_node(cache_key);
+        locker.value.insert(std::move(cache_key), cdpath_cache_entry_t{found, err, now});
+    }
     if (!success) errno = err;
+    if (success && out) *out = std::move(found);
     return success;
 }
 
 bool path_can_be_implicit_cd(const wcstring &path, wcstring *out_path, const wchar_t *wd,
-                             const env_vars_snapshot_t &vars) {
+                             const env_vars_snapshot_t &vars, bool allow_stale) {
     wcstring exp_path = path;
     expand_tilde(exp_path);
 
@@ -224,7 +413,7 @@ bool path_can_be_implicit_cd(const wcstring &path, wcstring *out_path, const wch
         // These paths can be implicit cd, so see if you cd to the path. Note that a single period
         // cannot (that's used for sourcing files anyways).
         env_var_t path_var(L"n/a", exp_path);
-        result = path_get_cdpath(path_var, out_path, wd, vars);
+        result = path_get_cdpath(path_var, out_path, wd, vars, allow_stale);
     }
     return result;
 }
@@ -6,6 +6,8 @@
 
 #include <stddef.h>
 
+#include <vector>
+
 #include "common.h"
 #include "env.h"
 
@@ -45,6 +47,24 @@ bool path_get_path(const wcstring &cmd, wcstring *output_or_NULL,
 /// Return all the paths that match the given command.
 wcstring_list_t path_get_paths(const wcstring &cmd);
 
+/// path_get_path remembers where it found commands, and only searches $PATH again when that might
+/// give a different answer. This describes one of the remembered commands.
+struct path_cache_item_t {
+    wcstring command;
+    wcstring path;
+    /// How often the command was looked up since it was found.
+    unsigned long hits;
+};
+
+/// Returns the remembered commands, sorted by name.
+std::vector<path_cache_item_t> path_cache_items();
+
+/// Forgets where the given command was found. Returns false if it was not remembered.
+bool path_cache_forget(const wcstring &cmd);
+
+/// Forgets all remembered commands.
+void path_cache_reset();
+
 /// Returns the full path of the specified directory, using the CDPATH variable as a list of base
 /// directories for relative paths. The returned string is allocated using halloc and the specified
 /// context.
@@ -59,17 +79,22 @@ wcstring_list_t path_get_paths(const wcstring &cmd);
 /// \param wd The working directory, or NULL to use the default. The working directory should have a
 /// slash appended at the end.
 /// \param vars The environment variable snapshot to use (for the CDPATH variable)
+/// \param allow_stale If set, the result may have been found earlier in the same second. This is
+/// for highlighting, which resolves the same directories on every keystroke; cd itself must see
+/// directories created just before it runs.
 /// \return 0 if the command can not be found, the path of the command otherwise. The path should be
 /// free'd with free().
 bool path_get_cdpath(const env_var_t &dir, wcstring *out_or_NULL, const wchar_t *wd = NULL,
-                     const env_vars_snapshot_t &vars = env_vars_snapshot_t::current());
+                     const env_vars_snapshot_t &vars = env_vars_snapshot_t::current(),
+                     bool allow_stale = false);
 
 /// Returns whether the path can be used for an implicit cd command; if so, also returns the path by
 /// reference (if desired). This requires it to start with one of the allowed prefixes (., .., ~)
-/// and resolve to a directory.
+/// and resolve to a directory. allow_stale is as for path_get_cdpath.
 bool path_can_be_implicit_cd(const wcstring &path, wcstring *out_path = NULL,
                              const wchar_t *wd = NULL,
-                             const env_vars_snapshot_t &vars = env_vars_snapshot_t::current());
+                             const env_vars_snapshot_t &vars = env_vars_snapshot_t::current(),
+                             bool allow_stale = false);
 
 /// Remove double slashes and trailing slashes from a path, e.g. transform foo//bar/ into foo/bar.
 /// The string is modified in-place.
@@ -0,0 +1,118 @@
+// Lookup tables for fixed sets of names, like the builtins and the keywords.
+#ifndef FISH_PERFECT_HASH_H
+#define FISH_PERFECT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+// A map from a fixed set of names to values, built with a perfect hash: no two names share a slot,
+// so a lookup hashes the name twice and compares it with at most one name, rather than binary
+// searching with string comparisons.
+//
+// This uses "hash and displace". The names are first hashed into buckets of a few names each.
+// Starting with the biggest bucket, each bucket is then given the first seed that hashes all its
+// names into slots no other name has taken. A lookup hashes the name to find its bucket, and then
+// again with the bucket's seed to find its slot. The names must be distinct and outlive the table,
+// as they are not copied.
+template <typename T>
+class perfect_hash_t {
+    struct slot_t {
+        const wchar_t *name = NULL;
+        size_t len = 0;
+        T value{};
+    };
+
+    std::vector<uint32_t> bucket_seeds;
+    std::vector<slot_t> slots;
+    T missing;
+
+    /// FNV-1a, with the seed folded into the offset basis and a final mix so that the low bits,
+    /// which pick the slot, depend on the whole name.
+    static uint32_t hash(const wchar_t *name, size_t len, uint32_t seed) {
+        uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+        for (size_t i = 0; i < len; i++) {
+            h ^= static_cast<uint32_t>(name[i]);
+            h *= 16777619u;
+        }
+        h ^= h >> 15;
+        h *= 0x2c1b3c6du;
+        h ^= h >> 12;
+        return h;
+    }
+
+    static size_t power_of_two_at_least(size_t n) {
+        size_t result = 1;
+        while (result < n) result *= 2;
+        return result;
+    }
+
+   public:
+    typedef std::pair<const wchar_t *, T> entry_t;
+
+    /// Build a table of the given names and their values. Looking up any other name gives missing.
+    perfect_hash_t(const std::vector<entry_t> &entries, T missing_value) : missing(missing_value) {
+        const size_t bucket_count = power_of_two_at_least(std::max<size_t>(entries.size() / 2, 1));
+        const size_t slot_count = power_of_two_at_least(std::max<size_t>(entries.size() * 2, 1));
+        bucket_seeds.assign(bucket_count, 0);
+        slots.resize(slot_count);
+
+        std::vector<std::vector<size_t>> buckets(bucket_count);
+        for (size_t i = 0; i < entries.size(); i++) {
+            const wchar_t *name = entries.at(i).first;
+            buckets.at(hash(name, wcslen(name), 0) & (bucket_count - 1)).push_back(i);
+        }
+        std::vector<size_t> order(bucket_count);
+        for (size_t i = 0; i < bucket_count; i++) order.at(i) = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return buckets.at(a).size() > buckets.at(b).size();
+        });
+
+        std::vector<size_t> taken;
+        for (size_t bucket : order) {
+            const std::vector<size_t> &members = buckets.at(bucket);
+            if (members.empty()) break;
+            for (uint32_t seed = 1;; seed++) {
+                taken.clear();
+                for (size_t i : members) {
+                    const wchar_t *name = entries.at(i).first;
+                    size_t slot = hash(name, wcslen(name), seed) & (slot_count - 1);
+                    if (slots.at(slot).name ||
+                        std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                        break;
+                    }
+                    taken.push_back(slot);
+                }
+                if (taken.size() < members.size()) continue;
+
+                bucket_seeds.at(bucket) = seed;
+                for (size_t j = 0; j < members.size(); j++) {
+                    slot_t &slot = slots.at(taken.at(j));
+                    slot.name = entries.at(members.at(j)).first;
+                    slot.len = wcslen(slot.name);
+                    slot.value = entries.at(members.at(j)).second;
+                }
+                break;
+            }
+        }
+    }
+
+    /// Returns the value of the name of the given length, or the missing value.
+    T get(const wchar_t *name, size_t len) const {
+        uint32_t seed = bucket_seeds[hash(name, len, 0) & (bucket_seeds.size() - 1)];
+        if (seed == 0) return missing;
+        const slot_t &slot = slots[hash(name, len, seed) & (slots.size() - 1)];
+        if (slot.len != len || !slot.name || wmemcmp(slot.name, name, len) != 0) return missing;
+        return slot.value;
+    }
+
+    T get(const wcstring &name) const { return get(name.data(), name.size()); }
+};
+
+#endif
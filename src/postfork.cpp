@@ -3,6 +3,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#if FISH_USE_VFORK
+#include <sched.h>
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,6 +23,7 @@
 #include "postfork.h"
 #include "proc.h"
 #include "signal.h"
+#include "trace.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 #ifndef JOIN_THREADS_BEFORE_FORK
@@ -299,10 +303,12 @@ pid_t execute_fork(bool wait_for_threads_to_die) {
     int i;
 
     g_fork_count++;
+    FISH_TRACE(fork_start);
 
     for (i = 0; i < FORK_LAPS; i++) {
         pid = fork();
         if (pid >= 0) {
+            if (pid > 0) FISH_TRACE1(fork_done, pid);
             return pid;
         }
 
@@ -326,6 +332,83 @@ pid_t execute_fork(bool wait_for_threads_to_die) {
     return 0;
 }
 
+/// Start a child outside of any job, as described for spawn_with_output_fds. Its stdin is \p in_fd,
+/// or /dev/null if that is -1. If \p own_group is set, it is put in a new process group.
+static pid_t spawn_with_fds(const char *path, const char *const *argv, const char *const *envv,
+                            int in_fd, int out_fd, int err_fd, bool own_group) {
+    if (is_main_thread()) g_fork_count++;
+#if FISH_USE_POSIX_SPAWN
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    if (posix_spawnattr_init(&attr) != 0) return -1;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        posix_spawnattr_destroy(&attr);
+        return -1;
+    }
+
+    // Unless the child gets a process group of its own, it gets the same terminal signals as we do.
+    sigset_t sigdefault, sigmask;
+    get_signals_with_handlers(&sigdefault);
+    sigemptyset(&sigmask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (own_group) flags |= POSIX_SPAWN_SETPGROUP;
+    int err = posix_spawnattr_setflags(&attr, flags);
+    if (!err) err = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    if (!err) err = posix_spawnattr_setsigmask(&attr, &sigmask);
+    if (!err && own_group) err = posix_spawnattr_setpgroup(&attr, 0);
+    if (!err && in_fd < 0) {
+        err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    } else if (!err) {
+        err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (!err) err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    if (!err) err = posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    pid_t pid = -1;
+    if (!err) {
+        err = posix_spawn(&pid, path, &actions, &attr, const_cast<char *const *>(argv),
+                          const_cast<char *const *>(envv));
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+#else
+    // Everything the child does before it execs is safe after fork(), so there is no need to wait
+    // for other threads.
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Threads other than the main one have all signals blocked; the child should not.
+        sigset_t sigmask;
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+        signal_reset_handlers();
+        if (own_group) setpgid(0, 0);
+        if (in_fd < 0) in_fd = open("/dev/null", O_RDONLY);
+        if (in_fd < 0 || dup2(in_fd, STDIN_FILENO) < 0 || dup2(out_fd, STDOUT_FILENO) < 0 ||
+            dup2(err_fd, STDERR_FILENO) < 0) {
+            _exit(STATUS_NOT_EXECUTABLE);
+        }
+        execve(path, const_cast<char *const *>(argv), const_cast<char *const *>(envv));
+        _exit(errno == ENOENT ? STATUS_CMD_UNKNOWN : STATUS_NOT_EXECUTABLE);
+    }
+    return pid;
+#endif
+}
+
+pid_t spawn_with_output_fds(const char *path, const char *const *argv, const char *const *envv,
+                            int out_fd, int err_fd) {
+    return spawn_with_fds(path, argv, envv, -1, out_fd, err_fd, false);
+}
+
+pid_t spawn_coprocess(const char *path, const char *const *argv, const char *const *envv,
+                      int in_fd, int out_fd) {
+    return spawn_with_fds(path, argv, envv, in_fd, out_fd, STDERR_FILENO, true);
+}
+
 #if FISH_USE_POSIX_SPAWN
 bool fork_actions_make_spawn_properties(posix_spawnattr_t *attr,
                                         posix_spawn_file_actions_t *actions, job_t *j, process_t *p,
@@ -528,12 +611,54 @@ void safe_report_exec_error(int err, const char *actual_cmd, const char *const *
     }
 }
 
+#if FISH_USE_VFORK
+namespace {
+/// What the trampoline of a vfork child needs.
+struct vfork_child_t {
+    int (*child_main)(void *);
+    void *arg;
+    sigset_t saved_mask;
+};
+}  // namespace
+
+/// The stack of a vfork child. Only one child runs on it at a time, since we are suspended until
+/// it has execed or exited, after which it is ours again.
+static char vfork_child_stack[256 * 1024] __attribute__((aligned(16)));
+
+static int vfork_child_trampoline(void *arg) {
+    const vfork_child_t *child = static_cast<const vfork_child_t *>(arg);
+    // Our memory is the parent's, so none of its signal handlers may run in here. Reset them
+    // before restoring the signal mask the parent had.
+    signal_reset_handlers();
+    sigprocmask(SIG_SETMASK, &child->saved_mask, NULL);
+    return child->child_main(child->arg);
+}
+
+pid_t execute_vfork(int (*child_main)(void *), void *arg) {
+    ASSERT_IS_MAIN_THREAD();
+    vfork_child_t child = {child_main, arg, sigset_t()};
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    DIE_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &all_signals, &child.saved_mask));
+
+    g_fork_count++;
+    FISH_TRACE(fork_start);
+    pid_t pid = clone(vfork_child_trampoline, vfork_child_stack + sizeof vfork_child_stack,
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    int saved_errno = errno;
+    DIE_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &child.saved_mask, NULL));
+    errno = saved_errno;
+    FISH_TRACE1(fork_done, pid);
+    return pid;
+}
+#endif
+
 /// Perform output from builtins. May be called from a forked child, so don't do anything that may
 /// allocate memory, etc.
-bool do_builtin_io(const char *out, size_t outlen, const char *err, size_t errlen) {
+bool do_builtin_io(const wchar_t *out, size_t outlen, const wchar_t *err, size_t errlen) {
     int saved_errno = 0;
     bool success = true;
-    if (out && outlen && write_loop(STDOUT_FILENO, out, outlen) < 0) {
+    if (out && outlen && write_wide_loop(STDOUT_FILENO, out, outlen) < 0) {
         saved_errno = errno;
         if (errno != EPIPE) {
             debug_safe(0, "Error while writing to stdout");
@@ -543,7 +668,7 @@ bool do_builtin_io(const char *out, size_t outlen, const char *err, size_t errle
         success = false;
     }
 
-    if (err && errlen && write_loop(STDERR_FILENO, err, errlen) < 0) {
+    if (err && errlen && write_wide_loop(STDERR_FILENO, err, errlen) < 0) {
         saved_errno = errno;
         success = false;
     }
@@ -13,6 +13,13 @@
 #ifndef FISH_USE_POSIX_SPAWN
 #define FISH_USE_POSIX_SPAWN HAVE_SPAWN_H
 #endif
+#ifndef FISH_USE_VFORK
+#ifdef __linux__
+#define FISH_USE_VFORK 1
+#else
+#define FISH_USE_VFORK 0
+#endif
+#endif
 
 class io_chain_t;
 class job_t;
@@ -40,8 +47,28 @@ int setup_child_process(process_t *p, const io_chain_t &io_chain);
 /// wait for threads to die.
 pid_t execute_fork(bool wait_for_threads_to_die);
 
-/// Perform output from builtins. Returns true on success.
-bool do_builtin_io(const char *out, size_t outlen, const char *err, size_t errlen);
+/// Start a child running the program at \p path with the given arguments and environment, outside
+/// of any job. Its stdin is /dev/null, and its stdout and stderr are \p out_fd and \p err_fd. This
+/// may be called from any thread. Returns the pid of the child, or -1 with errno set.
+pid_t spawn_with_output_fds(const char *path, const char *const *argv, const char *const *envv,
+                            int out_fd, int err_fd);
+
+/// Like spawn_with_output_fds, but the child's stdin is \p in_fd, its stderr is ours, and it is put
+/// in a process group of its own, so that the terminal signals meant for us don't reach it.
+pid_t spawn_coprocess(const char *path, const char *const *argv, const char *const *envv,
+                      int in_fd, int out_fd);
+
+#if FISH_USE_VFORK
+/// Start a child that shares our memory, like vfork() does, and call child_main(arg) in it. Returns
+/// the pid of the child, or -1 on failure. We are suspended until the child execs or exits, so
+/// child_main must do one of those. It may only do what is safe after fork(), and must not write
+/// to any memory but its own stack. Signal handlers are back to their defaults when it is called.
+pid_t execute_vfork(int (*child_main)(void *), void *arg);
+#endif
+
+/// Perform output from builtins. The wide output is converted while it is written, a chunk at a
+/// time, so no narrow copy of the whole output is ever made. Returns true on success.
+bool do_builtin_io(const wchar_t *out, size_t outlen, const wchar_t *err, size_t errlen);
 
 /// Report an error from failing to exec or posix_spawn a command.
 void safe_report_exec_error(int err, const char *actual_cmd, const char *const *argv,
@@ -7,8 +7,12 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
@@ -26,20 +30,30 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#include <sys/resource.h>
 #include <sys/time.h>  // IWYU pragma: keep
 #include <sys/types.h>
 
 #include <algorithm>  // IWYU pragma: keep
+#include <initializer_list>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "common.h"
+#include "env.h"
 #include "event.h"
+#include "exec.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "iothread.h"
 #include "output.h"
 #include "parse_tree.h"
 #include "parser.h"
+#include "postfork.h"
 #include "proc.h"
 #include "reader.h"
 #include "sanity.h"
@@ -47,12 +61,59 @@
 #include "util.h"
 #include "wutil.h"  // IWYU pragma: keep
 
-/// Size of buffer for reading buffered output.
-#define BUFFER_SIZE 4096
-
 /// Status of last process to exit.
 static int last_status = 0;
 
+namespace {
+/// A co-process started with coproc_start.
+struct coprocess_t {
+    pid_t pid;
+    /// The write end of the pipe to its stdin, and the read end of the one from its stdout.
+    int in_fd;
+    int out_fd;
+    /// What it has written that is not part of an answer yet.
+    std::string pending;
+    /// Whether it has been reaped.
+    bool exited;
+};
+}  // anonymous namespace
+
+/// The running co-processes, by name.
+static std::map<wcstring, coprocess_t> s_coprocesses;
+
+/// Note that the co-process with the given pid has exited. Returns false if there is none.
+static bool coproc_note_exit(pid_t pid) {
+    for (auto &entry : s_coprocesses) {
+        if (entry.second.pid == pid) {
+            entry.second.exited = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// The children given to proc_adopt_child that have not been reaped.
+static std::set<pid_t> s_adopted_children;
+
+/// Note that the child with the given pid has changed state, if it is an adopted one. Returns false
+/// if it is not.
+static bool adopted_child_note_status(pid_t pid, int status) {
+    auto where = s_adopted_children.find(pid);
+    if (where == s_adopted_children.end()) return false;
+    if (WIFEXITED(status) || WIFSIGNALED(status)) s_adopted_children.erase(where);
+    return true;
+}
+
+void proc_adopt_child(pid_t pid) {
+    ASSERT_IS_MAIN_THREAD();
+    s_adopted_children.insert(pid);
+}
+
+void proc_kill_adopted_child(pid_t pid, int sig) {
+    ASSERT_IS_MAIN_THREAD();
+    if (s_adopted_children.count(pid)) kill(pid, sig);
+}
+
 bool job_list_is_empty(void) {
     ASSERT_IS_MAIN_THREAD();
     return parser_t::principal_parser().job_list().empty();
@@ -141,6 +202,8 @@ void job_promote(job_t *job) {
 }
 
 void proc_destroy() {
+    while (!s_coprocesses.empty()) coproc_stop(s_coprocesses.begin()->first);
+
     job_list_t &jobs = parser_t::principal_parser().job_list();
     while (!jobs.empty()) {
         job_t *job = jobs.front().get();
@@ -279,6 +342,25 @@ static void mark_process_status(process_t *p, int status) {
     }
 }
 
+/// Jobs whose state may have changed since process_clean_after_marking last looked at them, in the
+/// order the changes were seen. Reaping walks only these, so its cost does not grow with the number
+/// of quiet background jobs. A job is in here if and only if it has JOB_STATE_CHANGED set; when a
+/// job is destroyed its entries are set to NULL.
+static std::vector<job_t *> s_changed_jobs;
+
+/// Jobs that a non-interactive reap skipped because they want a status message, which only an
+/// interactive reap may print. A job is in here if and only if it has JOB_AWAITING_NOTIFICATION
+/// set.
+static std::vector<job_t *> s_unnotified_jobs;
+
+/// Queue the given job for the next reap.
+static void job_note_state_change(job_t *j) {
+    ASSERT_IS_MAIN_THREAD();
+    if (j->get_flag(JOB_STATE_CHANGED)) return;
+    j->set_flag(JOB_STATE_CHANGED, true);
+    s_changed_jobs.push_back(j);
+}
+
 void job_mark_process_as_failed(job_t *job, const process_t *failed_proc) {
     // The given process failed to even lift off (e.g. posix_spawn failed) and so doesn't have a
     // valid pid. Mark it and everything after it as dead.
@@ -289,13 +371,61 @@ void job_mark_process_as_failed(job_t *job, const process_t *failed_proc) {
             p->completed = true;
         }
     }
+    job_note_state_change(job);
+}
+
+/// Resources used by child processes since fish started, and since the last call to
+/// proc_take_usage_since_last.
+static proc_usage_t s_total_usage;
+static proc_usage_t s_recent_usage;
+
+static uint64_t timeval_to_usec(const struct timeval &tv) {
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/// Add the resources used by a child that exited, as reported by wait4.
+static void note_child_usage(const struct rusage &usage) {
+    uint64_t max_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+    max_rss_kb /= 1024;  // macOS reports bytes rather than kilobytes
+#endif
+    for (proc_usage_t *total : {&s_total_usage, &s_recent_usage}) {
+        total->user_usec += timeval_to_usec(usage.ru_utime);
+        total->system_usec += timeval_to_usec(usage.ru_stime);
+        total->max_rss_kb = std::max(total->max_rss_kb, max_rss_kb);
+        total->reaped++;
+    }
+}
+
+void proc_note_spawn(uint64_t usec) {
+    ASSERT_IS_MAIN_THREAD();
+    for (proc_usage_t *total : {&s_total_usage, &s_recent_usage}) {
+        total->spawned++;
+        total->spawn_usec += usec;
+    }
+}
+
+proc_usage_t proc_get_usage() {
+    ASSERT_IS_MAIN_THREAD();
+    return s_total_usage;
+}
+
+proc_usage_t proc_take_usage_since_last() {
+    ASSERT_IS_MAIN_THREAD();
+    proc_usage_t result = s_recent_usage;
+    s_recent_usage = proc_usage_t();
+    return result;
 }
 
 /// Handle status update for child \c pid.
 ///
 /// \param pid the pid of the process whose status changes
 /// \param status the status as returned by wait
-static void handle_child_status(pid_t pid, int status) {
+/// \param usage the resources it used, as returned by wait4
+static void handle_child_status(pid_t pid, int status, const struct rusage &usage) {
+    // A stopped child reports what it used so far, and will report all of it again when it exits.
+    if (WIFEXITED(status) || WIFSIGNALED(status)) note_child_usage(usage);
+
     job_t *j = NULL;
     const process_t *found_proc = NULL;
 
@@ -305,12 +435,16 @@ static void handle_child_status(pid_t pid, int status) {
         for (process_ptr_t &p : j->processes) {
             if (pid == p->pid) {
                 mark_process_status(p.get(), status);
+                job_note_state_change(j);
                 found_proc = p.get();
                 break;
             }
             prev = p.get();
         }
     }
+    // Co-processes and adopted children are not jobs, and don't make the shell act on their
+    // signals.
+    if (!found_proc && (coproc_note_exit(pid) || adopted_child_note_status(pid, status))) return;
 
     // If the child process was not killed by a signal or other than SIGINT or SIGQUIT we're done.
     if (!WIFSIGNALED(status) || (WTERMSIG(status) != SIGINT && WTERMSIG(status) != SIGQUIT)) {
@@ -358,7 +492,9 @@ process_t::process_t()
 #ifdef HAVE__PROC_SELF_STAT
       ,
       last_time(),
-      last_jiffies(0)
+      last_jiffies(0),
+      prev_time(),
+      prev_jiffies(0)
 #endif
 {
 }
@@ -371,7 +507,15 @@ process_t::process_t()
 job_t::job_t(job_id_t jobid, const io_chain_t &bio)
     : block_io(bio), pgid(-2), tmodes(), job_id(jobid), flags(0) {}
 
-job_t::~job_t() { release_job_id(job_id); }
+job_t::~job_t() {
+    if (get_flag(JOB_STATE_CHANGED)) {
+        std::replace(s_changed_jobs.begin(), s_changed_jobs.end(), this, (job_t *)NULL);
+    }
+    if (get_flag(JOB_AWAITING_NOTIFICATION)) {
+        std::replace(s_unnotified_jobs.begin(), s_unnotified_jobs.end(), this, (job_t *)NULL);
+    }
+    release_job_id(job_id);
+}
 
 /// Return all the IO redirections. Start with the block IO, then walk over the processes.
 io_chain_t job_t::all_io_redirections() const {
@@ -416,7 +560,7 @@ static int process_mark_finished_children(bool wants_await) {
 
     if (wants_waitpid) {
         for (;;) {
-            // Call waitpid until we get 0/ECHILD. If we wait, it's only on the first iteration. So
+            // Call wait4 until we get 0/ECHILD. If we wait, it's only on the first iteration. So
             // we want to set NOHANG (don't wait) unless wants_await is true and this is the first
             // iteration.
             int options = WUNTRACED;
@@ -425,10 +569,11 @@ static int process_mark_finished_children(bool wants_await) {
             }
 
             int status = -1;
-            pid_t pid = waitpid(-1, &status, options);
+            struct rusage usage;
+            pid_t pid = wait4(-1, &status, options, &usage);
             if (pid > 0) {
                 // We got a valid pid.
-                handle_child_status(pid, status);
+                handle_child_status(pid, status, usage);
                 processed_count += 1;
             } else if (pid == 0) {
                 // No ready-and-waiting children, we're done.
@@ -450,6 +595,42 @@ static int process_mark_finished_children(bool wants_await) {
     return processed_count;
 }
 
+/// A nonblocking self-pipe which is written to from signal handlers, so that select_try can sleep
+/// until either job output or a child status change arrives, instead of polling with a timeout.
+static int s_wakeup_pipe[2] = {-1, -1};
+
+void job_init_wakeup_pipe() {
+    ASSERT_IS_MAIN_THREAD();
+    if (s_wakeup_pipe[0] >= 0) return;
+    int fds[2];
+    if (exec_pipe(fds) != 0) return;
+    if (make_fd_nonblocking(fds[0]) != 0 || make_fd_nonblocking(fds[1]) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    s_wakeup_pipe[0] = fds[0];
+    s_wakeup_pipe[1] = fds[1];
+}
+
+void job_wake_waiters() {
+    if (s_wakeup_pipe[1] < 0) return;
+    // This is called from signal handlers, so preserve errno. If the pipe is full, there is
+    // already a wakeup pending and losing this byte is harmless.
+    int saved_errno = errno;
+    const char c = 0;
+    ssize_t ignored = write(s_wakeup_pipe[1], &c, 1);
+    UNUSED(ignored);
+    errno = saved_errno;
+}
+
+/// Read everything out of the wakeup pipe.
+static void drain_wakeup_pipe() {
+    char buff[64];
+    while (read(s_wakeup_pipe[0], buff, sizeof buff) > 0) {
+    }
+}
+
 /// This is called from a signal handler. The signal is always SIGCHLD.
 void job_handle_signal(int signal, siginfo_t *info, void *context) {
     UNUSED(signal);
@@ -457,6 +638,7 @@ void job_handle_signal(int signal, siginfo_t *info, void *context) {
     UNUSED(context);
     // This is the only place that this generation count is modified. It's OK if it overflows.
     s_sigchld_generation_cnt += 1;
+    job_wake_waiters();
 }
 
 /// Given a command like "cat file", truncate it to a reasonable length.
@@ -515,7 +697,6 @@ void proc_fire_event(const wchar_t *msg, int type, pid_t pid, int status) {
 
 static int process_clean_after_marking(bool allow_interactive) {
     ASSERT_IS_MAIN_THREAD();
-    job_t *jnext;
     int found = 0;
 
     // this function may fire an event handler, we do not want to call ourselves recursively (to avoid
@@ -530,18 +711,31 @@ static int process_clean_after_marking(bool allow_interactive) {
     // don't try to print in that case (#3222)
     const bool interactive = allow_interactive && cur_term != NULL;
 
+    // Jobs that earlier reaps could not tell the user about get their turn now.
+    if (interactive) {
+        for (job_t *j : s_unnotified_jobs) {
+            if (!j) continue;
+            j->set_flag(JOB_AWAITING_NOTIFICATION, false);
+            job_note_state_change(j);
+        }
+        s_unnotified_jobs.clear();
+    }
 
-    job_iterator_t jobs;
-    const size_t job_count = jobs.count();
-    jnext = jobs.next();
-    while (jnext) {
-        job_t *j = jnext;
-        jnext = jobs.next();
+    const size_t job_count = parser_t::principal_parser().job_list().size();
+    // Event handlers may run jobs and so queue more changes, hence the size is checked each time.
+    for (size_t idx = 0; idx < s_changed_jobs.size(); idx++) {
+        job_t *j = s_changed_jobs.at(idx);
+        if (!j) continue;  // the job was removed after its change was queued
+        j->set_flag(JOB_STATE_CHANGED, false);
 
         // If we are reaping only jobs who do not need status messages sent to the console, do not
-        // consider reaping jobs that need status messages.
+        // consider reaping jobs that need status messages. Keep them for an interactive reap.
         if ((!j->get_flag(JOB_SKIP_NOTIFICATION)) && (!interactive) &&
             (!j->get_flag(JOB_FOREGROUND))) {
+            if (!j->get_flag(JOB_AWAITING_NOTIFICATION)) {
+                j->set_flag(JOB_AWAITING_NOTIFICATION, true);
+                s_unnotified_jobs.push_back(j);
+            }
             continue;
         }
 
@@ -630,6 +824,7 @@ static int process_clean_after_marking(bool allow_interactive) {
             j->set_flag(JOB_NOTIFIED, true);
         }
     }
+    s_changed_jobs.clear();
 
     if (found) fflush(stdout);
 
@@ -655,65 +850,129 @@ int job_reap(bool allow_interactive) {
     return found;
 }
 
+long jiffies_sample_interval_ms = JIFFIES_SAMPLE_INTERVAL_MS;
+
 #ifdef HAVE__PROC_SELF_STAT
 
-/// Maximum length of a /proc/[PID]/stat filename.
-#define FN_SIZE 256
-
-/// Get the CPU time for the specified process.
-unsigned long proc_get_jiffies(process_t *p) {
-    if (p->pid <= 0) return 0;
-
-    wchar_t fn[FN_SIZE];
-    char state;
-    int pid, ppid, pgrp, session, tty_nr, tpgid, exit_signal, processor;
-    long int cutime, cstime, priority, nice, placeholder, itrealvalue, rss;
-    unsigned long int flags, minflt, cminflt, majflt, cmajflt, utime, stime, starttime, vsize, rlim,
-        startcode, endcode, startstack, kstkesp, kstkeip, signal, blocked, sigignore, sigcatch,
-        wchan, nswap, cnswap;
-    char comm[1024];
-
-    swprintf(fn, FN_SIZE, L"/proc/%d/stat", p->pid);
-    FILE *f = wfopen(fn, "r");
-    if (!f) return 0;
-
-    // TODO: replace the use of fscanf() as it is brittle and should never be used.
-    int count = fscanf(f,
-                       "%9d %1023s %c %9d %9d %9d %9d %9d %9lu "
-                       "%9lu %9lu %9lu %9lu %9lu %9lu %9ld %9ld %9ld "
-                       "%9ld %9ld %9ld %9lu %9lu %9ld %9lu %9lu %9lu "
-                       "%9lu %9lu %9lu %9lu %9lu %9lu %9lu %9lu %9lu "
-                       "%9lu %9d %9d ",
-                       &pid, comm, &state, &ppid, &pgrp, &session, &tty_nr, &tpgid, &flags, &minflt,
-                       &cminflt, &majflt, &cmajflt, &utime, &stime, &cutime, &cstime, &priority,
-                       &nice, &placeholder, &itrealvalue, &starttime, &vsize, &rss, &rlim,
-                       &startcode, &endcode, &startstack, &kstkesp, &kstkeip, &signal, &blocked,
-                       &sigignore, &sigcatch, &wchan, &nswap, &cnswap, &exit_signal, &processor);
-    fclose(f);
-    if (count < 17) return 0;
-    return utime + stime + cutime + cstime;
-}
-
-/// Update the CPU time for all jobs.
+unsigned long proc_get_jiffies(pid_t pid) {
+    if (pid <= 0) return 0;
+
+    char fn[64];
+    snprintf(fn, sizeof fn, "/proc/%d/stat", (int)pid);
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    // The line is about 300 bytes; the command name in it is at most 16.
+    char buff[1024];
+    ssize_t amt = read(fd, buff, sizeof buff - 1);
+    close(fd);
+    if (amt <= 0) return 0;
+    buff[amt] = '\0';
+
+    // The command name is in parentheses and may contain anything, including spaces and
+    // parentheses, so skip to the last closing one. The state field follows; utime, stime, cutime
+    // and cstime are the 12th to 15th fields after it.
+    const char *cursor = strrchr(buff, ')');
+    if (!cursor) return 0;
+    cursor++;
+    for (int field = 0; field < 11; field++) {
+        while (*cursor == ' ') cursor++;
+        while (*cursor && *cursor != ' ') cursor++;
+    }
+    unsigned long result = 0;
+    for (int field = 0; field < 4; field++) {
+        char *end = NULL;
+        long val = strtol(cursor, &end, 10);
+        if (end == cursor) return 0;
+        result += val;
+        cursor = end;
+    }
+    return result;
+}
+
+/// Record a new cpu time sample for a process, keeping the previous one.
+static void process_add_jiffies_sample(process_t *p, const struct timeval &when,
+                                       unsigned long jiffies) {
+    p->prev_time = p->last_time;
+    p->prev_jiffies = p->last_jiffies;
+    p->last_time = when;
+    p->last_jiffies = jiffies;
+}
+
+/// Whether a process is running and so worth sampling.
+static bool process_wants_jiffies_sample(const process_t *p) {
+    return p->pid > 0 && !p->completed;
+}
+
+/// Whether a sample taken at the given time is older than jiffies_sample_interval_ms.
+static bool jiffies_sample_is_stale(const struct timeval &when, const struct timeval &now) {
+    long long age_usec = (now.tv_sec - when.tv_sec) * 1000000LL + (now.tv_usec - when.tv_usec);
+    return age_usec >= jiffies_sample_interval_ms * 1000LL;
+}
+
 void proc_update_jiffies() {
-    job_t *job;
-    job_iterator_t j;
+    ASSERT_IS_MAIN_THREAD();
+    // Whether a background sample is under way, and when the last one was started.
+    static bool s_sample_pending = false;
+    static struct timeval s_last_sample_time = {};
 
-    for (job = j.next(); job; job = j.next()) {
-        for (process_ptr_t &p : job->processes) {
-            gettimeofday(&p->last_time, 0);
-            p->last_jiffies = proc_get_jiffies(p.get());
+    struct timeval now;
+    gettimeofday(&now, 0);
+    if (s_sample_pending || !jiffies_sample_is_stale(s_last_sample_time, now)) return;
+
+    typedef std::vector<std::pair<pid_t, unsigned long>> samples_t;
+    auto samples = std::make_shared<samples_t>();
+    job_iterator_t jobs;
+    while (job_t *job = jobs.next()) {
+        for (const process_ptr_t &p : job->processes) {
+            if (process_wants_jiffies_sample(p.get())) samples->push_back({p->pid, 0});
         }
     }
+    if (samples->empty()) return;
+
+    s_sample_pending = true;
+    s_last_sample_time = now;
+    iothread_perform(
+        [=]() {
+            for (auto &sample : *samples) sample.second = proc_get_jiffies(sample.first);
+            std::sort(samples->begin(), samples->end());
+        },
+        [=]() {
+            s_sample_pending = false;
+            // The jobs may have changed while we were away, so look the processes up by pid.
+            job_iterator_t jobs;
+            while (job_t *job = jobs.next()) {
+                for (process_ptr_t &p : job->processes) {
+                    if (!process_wants_jiffies_sample(p.get())) continue;
+                    auto where = std::lower_bound(samples->begin(), samples->end(),
+                                                  std::make_pair(p->pid, 0UL));
+                    if (where == samples->end() || where->first != p->pid) continue;
+                    process_add_jiffies_sample(p.get(), now, where->second);
+                }
+            }
+        });
+}
+
+void proc_refresh_jiffies(job_t *j) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    for (process_ptr_t &p : j->processes) {
+        if (!process_wants_jiffies_sample(p.get())) continue;
+        // A process sampled only once has no usage to report yet, so sample it again.
+        bool sampled_twice = p->prev_time.tv_sec != 0;
+        if (sampled_twice && !jiffies_sample_is_stale(p->last_time, now)) continue;
+        process_add_jiffies_sample(p.get(), now, proc_get_jiffies(p->pid));
+    }
 }
 
 #endif
 
-/// Check if there are buffers associated with the job, and select on them for a while if available.
+/// Check if there are buffers associated with the job, and select on them if available. If the
+/// wakeup pipe exists, this sleeps until a buffer is readable or a signal such as SIGCHLD arrives;
+/// otherwise it gives up after a short timeout.
 ///
 /// \param j the job to test
 ///
-/// \return 1 if buffers were available, zero otherwise
+/// \return 1 if buffers were available, zero otherwise, or -1 if the job has no buffers
 static int select_try(job_t *j) {
     fd_set fds;
     int maxfd = -1;
@@ -724,8 +983,10 @@ static int select_try(job_t *j) {
     for (size_t idx = 0; idx < chain.size(); idx++) {
         const io_data_t *io = chain.at(idx).get();
         if (io->io_mode == IO_BUFFER) {
-            const io_pipe_t *io_pipe = static_cast<const io_pipe_t *>(io);
-            int fd = io_pipe->pipe_fd[0];
+            const io_buffer_t *io_buffer = static_cast<const io_buffer_t *>(io);
+            int fd = io_buffer->pipe_fd[0];
+            if (fd < 0) continue;  // no pipe was made for this buffer
+            if (io_buffer->output_discarded()) continue;  // nothing is read from it any more
             // fwprintf( stderr, L"fd %d on job %ls\n", fd, j->command );
             FD_SET(fd, &fds);
             maxfd = maxi(maxfd, fd);
@@ -734,16 +995,26 @@ static int select_try(job_t *j) {
     }
 
     if (maxfd >= 0) {
-        int retval;
+        const int wakeup_fd = s_wakeup_pipe[0];
         struct timeval tv;
+        struct timeval *timeout = NULL;
+        if (wakeup_fd >= 0) {
+            FD_SET(wakeup_fd, &fds);
+        } else {
+            tv.tv_sec = 0;
+            tv.tv_usec = 10000;
+            timeout = &tv;
+        }
 
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000;
-
-        retval = select(maxfd + 1, &fds, 0, 0, &tv);
+        int retval = select(maxi(maxfd, wakeup_fd) + 1, &fds, 0, 0, timeout);
         if (retval == 0) {
             debug(3, L"select_try hit timeout");
         }
+        if (retval > 0 && wakeup_fd >= 0 && FD_ISSET(wakeup_fd, &fds)) {
+            // A signal woke us. The caller looks for finished children either way.
+            drain_wakeup_pipe();
+            retval -= 1;
+        }
         return retval > 0;
     }
 
@@ -765,13 +1036,10 @@ static void read_try(job_t *j) {
         }
     }
 
-    if (buff) {
+    if (buff && buff->has_pipe()) {
         debug(3, L"proc::read_try('%ls')", j->command_wcstr());
         while (1) {
-            char b[BUFFER_SIZE];
-            long l;
-
-            l = read_blocked(buff->pipe_fd[0], b, BUFFER_SIZE);
+            long l = buff->append_from_fd(buff->pipe_fd[0]);
             if (l == 0) {
                 break;
             } else if (l < 0) {
@@ -780,8 +1048,6 @@ static void read_try(job_t *j) {
                     wperror(L"read_try");
                 }
                 break;
-            } else {
-                buff->out_buffer_append(b, l);
             }
         }
     }
@@ -799,6 +1065,8 @@ bool terminal_give_to_job(job_t *j, int cont) {
         return true;
     }
 
+    // The job may change the terminal modes, and gets any SIGWINCH while it has the terminal.
+    reader_forget_tty_modes();
     signal_block();
 
     // It may not be safe to call tcsetpgrp if we've already done so, as at that point we are no
@@ -943,6 +1211,9 @@ void job_continue(job_t *j, bool cont) {
     // Put job first in the job list.
     job_promote(j);
     j->set_flag(JOB_NOTIFIED, false);
+    // Its processes may have completed without a SIGCHLD while it was launched, and continuing it
+    // may allow a new stop notification.
+    job_note_state_change(j);
 
     CHECK_BLOCK();
     debug(4, L"%ls job %d, gid %d (%ls), %ls, %ls", cont ? L"Continue" : L"Start", j->job_id,
@@ -1108,9 +1379,131 @@ void proc_pop_interactive() {
 
 pid_t proc_wait_any() {
     int pid_status;
-    pid_t pid = waitpid(-1, &pid_status, WUNTRACED);
+    struct rusage usage;
+    pid_t pid = wait4(-1, &pid_status, WUNTRACED, &usage);
     if (pid == -1) return -1;
-    handle_child_status(pid, pid_status);
+    handle_child_status(pid, pid_status, usage);
     process_clean_after_marking(is_interactive);
     return pid;
 }
+
+int coproc_start(const wcstring &name, const wcstring &path, const wcstring_list_t &argv) {
+    ASSERT_IS_MAIN_THREAD();
+    assert(!s_coprocesses.count(name));
+    std::vector<std::string> narrow_args;
+    narrow_args.reserve(argv.size());
+    for (const wcstring &arg : argv) narrow_args.push_back(wcs2string(arg));
+    null_terminated_array_t<char> argv_array(narrow_args);
+
+    int in_pipe[2], out_pipe[2];
+    if (exec_pipe(in_pipe) != 0) return errno;
+    if (exec_pipe(out_pipe) != 0) {
+        int saved_errno = errno;
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        return saved_errno;
+    }
+    pid_t pid = spawn_coprocess(wcs2string(path).c_str(), argv_array.get(), env_export_arr(),
+                                in_pipe[0], out_pipe[1]);
+    int saved_errno = errno;
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (pid < 0) {
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        return saved_errno;
+    }
+
+    coprocess_t &coproc = s_coprocesses[name];
+    coproc.pid = pid;
+    coproc.in_fd = in_pipe[1];
+    coproc.out_fd = out_pipe[0];
+    coproc.exited = false;
+    return 0;
+}
+
+/// If the co-process has written a whole answer, move its lines to \p response and return true.
+static bool coproc_take_answer(coprocess_t *coproc, wcstring_list_t *response) {
+    const std::string &pending = coproc->pending;
+    size_t end;
+    if (!pending.empty() && pending.at(0) == '\n') {
+        end = 0;
+    } else {
+        end = pending.find("\n\n");
+        if (end == std::string::npos) return false;
+        end++;
+    }
+
+    response->clear();
+    size_t start = 0;
+    while (start < end) {
+        size_t line_end = pending.find('\n', start);
+        response->push_back(str2wcstring(pending.data() + start, line_end - start));
+        start = line_end + 1;
+    }
+    coproc->pending.erase(0, end + 1);
+    return true;
+}
+
+coproc_result_t coproc_request(const wcstring &name, const wcstring &request, long timeout_ms,
+                               wcstring_list_t *response) {
+    ASSERT_IS_MAIN_THREAD();
+    assert(request.find(L'\n') == wcstring::npos);
+    auto iter = s_coprocesses.find(name);
+    if (iter == s_coprocesses.end()) return COPROC_UNKNOWN;
+    coprocess_t &coproc = iter->second;
+
+    std::string narrow = wcs2string(request);
+    narrow.push_back('\n');
+    if (coproc.exited || write_loop(coproc.in_fd, narrow.data(), narrow.size()) < 0) {
+        coproc_stop(name);
+        return COPROC_EXITED;
+    }
+
+    const double deadline = timef() + timeout_ms / 1000.0;
+    char buff[4096];
+    while (!coproc_take_answer(&coproc, response)) {
+        int poll_ms = -1;
+        if (timeout_ms >= 0) {
+            double remaining = deadline - timef();
+            poll_ms = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+        }
+        struct pollfd pfd = {coproc.out_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, poll_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) {
+            // A late answer would be taken for that of the next request.
+            coproc_stop(name);
+            return COPROC_TIMED_OUT;
+        }
+
+        long rc = ready < 0 ? -1 : read(coproc.out_fd, buff, sizeof buff);
+        if (rc > 0) {
+            coproc.pending.append(buff, rc);
+        } else if (rc == 0 || (errno != EINTR && errno != EAGAIN)) {
+            coproc_stop(name);
+            return COPROC_EXITED;
+        }
+    }
+    return COPROC_OK;
+}
+
+bool coproc_stop(const wcstring &name) {
+    ASSERT_IS_MAIN_THREAD();
+    auto iter = s_coprocesses.find(name);
+    if (iter == s_coprocesses.end()) return false;
+    const coprocess_t &coproc = iter->second;
+    close(coproc.in_fd);
+    close(coproc.out_fd);
+    // It is reaped like any other child; the signal also reaches anything it started.
+    if (!coproc.exited && kill(-coproc.pid, SIGTERM) == -1) kill(coproc.pid, SIGTERM);
+    s_coprocesses.erase(iter);
+    return true;
+}
+
+wcstring_list_t coproc_get_names() {
+    ASSERT_IS_MAIN_THREAD();
+    wcstring_list_t names;
+    for (const auto &entry : s_coprocesses) names.push_back(entry.first);
+    return names;
+}
@@ -7,6 +7,7 @@
 
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>  // IWYU pragma: keep
 #include <termios.h>
 #include <unistd.h>
@@ -125,10 +126,14 @@ class process_t {
     /// Special flag to tell the evaluation function for count to print the help information.
     int count_help_magic;
 #ifdef HAVE__PROC_SELF_STAT
-    /// Last time of cpu time check.
+    /// Time of the latest cpu time sample.
     struct timeval last_time;
-    /// Number of jiffies spent in process at last cpu time check.
+    /// Number of jiffies spent in process at the latest cpu time sample.
     unsigned long last_jiffies;
+    /// Time of the cpu time sample before the latest one.
+    struct timeval prev_time;
+    /// Number of jiffies spent in process at the sample before the latest one.
+    unsigned long prev_jiffies;
 #endif
 };
 
@@ -152,7 +157,13 @@ enum job_flag_t {
     /// Whether the job is under job control.
     JOB_CONTROL = 1 << 5,
     /// Whether the job wants to own the terminal when in the foreground.
-    JOB_TERMINAL = 1 << 6
+    JOB_TERMINAL = 1 << 6,
+    /// Whether the job is queued for job_reap because its state may have changed since it was
+    /// last looked at.
+    JOB_STATE_CHANGED = 1 << 7,
+    /// Whether the job is queued for the next interactive job_reap, because only that may tell the
+    /// user about it.
+    JOB_AWAITING_NOTIFICATION = 1 << 8
 };
 
 typedef int job_id_t;
@@ -317,6 +328,7 @@ bool job_is_completed(const job_t *j);
 void job_continue(job_t *j, bool cont);
 
 /// Notify the user about stopped or terminated jobs. Delete terminated jobs from the job list.
+/// Only jobs whose state changed since the last call are looked at.
 ///
 /// \param interactive whether interactive jobs should be reaped as well
 int job_reap(bool interactive);
@@ -324,20 +336,40 @@ int job_reap(bool interactive);
 /// Signal handler for SIGCHLD. Mark any processes with relevant information.
 void job_handle_signal(int signal, siginfo_t *info, void *con);
 
+/// Create the pipe that signal handlers use to wake the main thread while it waits for a job.
+/// Called when the signal handlers are installed.
+void job_init_wakeup_pipe();
+
+/// Wake the main thread if it is waiting for a job. This is async-signal safe.
+void job_wake_waiters();
+
 /// Send the specified signal to all processes in the specified job.
 int job_signal(job_t *j, int signal);
 
 /// Mark a process as failed to execute (and therefore completed).
 void job_mark_process_as_failed(job_t *job, const process_t *p);
 
+/// The default of the least number of milliseconds between two cpu time samples of a process.
+#define JIFFIES_SAMPLE_INTERVAL_MS 1000
+
+/// The least number of milliseconds between two cpu time samples of a process. This can be
+/// overridden by the fish_jobs_cpu_interval_ms variable.
+extern long jiffies_sample_interval_ms;
+
 #ifdef HAVE__PROC_SELF_STAT
-/// Use the procfs filesystem to look up how many jiffies of cpu time was used by this process. This
-/// function is only available on systems with the procfs file entry 'stat', i.e. Linux.
-unsigned long proc_get_jiffies(process_t *p);
+/// Use the procfs filesystem to look up how many jiffies of cpu time was used by the process with
+/// the given pid, or 0 if that is not known. This function is only available on systems with the
+/// procfs file entry 'stat', i.e. Linux. It is safe to call from any thread.
+unsigned long proc_get_jiffies(pid_t pid);
 
-/// Update process time usage for all processes by calling the proc_get_jiffies function for every
-/// process of every job.
+/// Sample the cpu time of every running process of every job on a background thread, unless a
+/// sample is already under way or the last one is younger than jiffies_sample_interval_ms.
 void proc_update_jiffies();
+
+/// Sample the cpu time of those running processes of the given job that were sampled at most once,
+/// or whose latest sample is older than jiffies_sample_interval_ms, so their cpu usage between
+/// their two latest samples is reasonably current.
+void proc_refresh_jiffies(job_t *j);
 #endif
 
 /// Perform a set of simple sanity checks on the job list. This includes making sure that only one
@@ -367,6 +399,78 @@ int proc_format_status(int status);
 /// Wait for any process finishing.
 pid_t proc_wait_any();
 
+/// Resources used by child processes, as reported by wait4 when they are reaped, and the time spent
+/// starting them.
+struct proc_usage_t {
+    /// CPU time, in microseconds.
+    uint64_t user_usec = 0;
+    uint64_t system_usec = 0;
+    /// The largest maximum resident set size of any one of them, in kilobytes.
+    uint64_t max_rss_kb = 0;
+    /// How many were reaped.
+    uint64_t reaped = 0;
+    /// How many were started, and the time spent in fork, vfork or posix_spawn doing so, in
+    /// microseconds.
+    uint64_t spawned = 0;
+    uint64_t spawn_usec = 0;
+};
+
+/// Note that a child process was started, which took \p usec microseconds.
+void proc_note_spawn(uint64_t usec);
+
+/// Returns the usage of all child processes since fish started.
+proc_usage_t proc_get_usage();
+
+/// Returns the usage of child processes started or reaped since the last call, and starts over.
+/// Processes that are still running, such as background jobs, are counted when they are reaped.
+proc_usage_t proc_take_usage_since_last();
+
+/// Note a child that the shell started for itself outside of any job, such as the one running an
+/// asynchronous prompt. It is reaped along with jobs, and its exit status is ignored. Only the main
+/// thread reaps children, so only it can tell whether the pid still belongs to the child; this and
+/// proc_kill_adopted_child are main thread only. Call it right after starting the child.
+void proc_adopt_child(pid_t pid);
+
+/// Send \p sig to a child given to proc_adopt_child, unless it has been reaped already, in which
+/// case its pid may belong to some other process by now.
+void proc_kill_adopted_child(pid_t pid, int sig);
+
+// Co-processes are long-lived helpers started by the coproc builtin, so that a prompt, say, can ask
+// one for information instead of starting commands every time. A co-process reads requests, one
+// per line, from its stdin, and answers each with any number of lines on its stdout followed by an
+// empty line. It is not a job: it runs in a process group of its own, so terminal signals don't
+// reach it, and it is stopped when fish exits. All of these are main thread only.
+
+/// The result of coproc_request.
+enum coproc_result_t {
+    COPROC_OK,
+    /// There is no co-process of that name.
+    COPROC_UNKNOWN,
+    /// The co-process exited or closed its stdout before answering, and is gone.
+    COPROC_EXITED,
+    /// No answer came in time. The co-process is stopped, as its answers could no longer be matched
+    /// with the requests.
+    COPROC_TIMED_OUT
+};
+
+/// Start the program at \p path with the given arguments, including the zeroth, as the co-process
+/// with the given name, which must not be in use. Returns 0, or an errno value if it could not be
+/// started.
+int coproc_start(const wcstring &name, const wcstring &path, const wcstring_list_t &argv);
+
+/// Send a request, which must not contain a newline, to the named co-process, and store the lines of
+/// its answer in \p response. Waits at most \p timeout_ms milliseconds, or forever if it is
+/// negative.
+coproc_result_t coproc_request(const wcstring &name, const wcstring &request, long timeout_ms,
+                               wcstring_list_t *response);
+
+/// Stop the named co-process, by closing its stdin and sending it SIGTERM. Returns false if there
+/// is none.
+bool coproc_stop(const wcstring &name);
+
+/// Returns the names of the running co-processes, sorted.
+wcstring_list_t coproc_get_names();
+
 #endif
 
 bool terminal_give_to_job(job_t *j, int cont);
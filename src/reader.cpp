@@ -16,6 +16,7 @@
 // IWYU pragma: no_include <type_traits>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #ifdef HAVE_SIGINFO_H
 #include <siginfo.h>
@@ -27,8 +28,11 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -41,7 +45,10 @@
 #include <functional>
 #include <memory>
 #include <stack>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "builtin_functions.h"
 #include "color.h"
 #include "common.h"
 #include "complete.h"
@@ -65,6 +72,7 @@
 #include "parse_tree.h"
 #include "parse_util.h"
 #include "parser.h"
+#include "postfork.h"
 #include "proc.h"
 #include "reader.h"
 #include "sanity.h"
@@ -72,12 +80,22 @@
 #include "signal.h"
 #include "tokenizer.h"
 #include "util.h"
+#include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 // Name of the variable that tells how long it took, in milliseconds, for the previous
 // interactive command to complete.
 #define ENV_cmd_duration L"cmd_duration"
 
+// Names of the variables that tell what the processes started by the previous interactive command
+// used: CPU time in milliseconds, the largest maximum resident set size in kilobytes, how many were
+// started, and the time spent starting them in microseconds.
+#define ENV_cmd_user_time L"cmd_user_time"
+#define ENV_cmd_system_time L"cmd_system_time"
+#define ENV_cmd_max_rss L"cmd_max_rss"
+#define ENV_cmd_process_count L"cmd_process_count"
+#define ENV_cmd_spawn_time L"cmd_spawn_time"
+
 /// Maximum length of prefix string when printing completion list. Longer prefixes will be
 /// ellipsized.
 #define PREFIX_MAX_LEN 9
@@ -98,6 +116,34 @@
 /// The name of the function for getting the input mode indicator.
 #define MODE_PROMPT_FUNCTION_NAME L"fish_mode_prompt"
 
+/// The variable that makes the prompt be run asynchronously when it is set.
+#define ASYNC_PROMPT_VAR_NAME L"fish_async_prompt"
+
+/// The variable listing the variables and files that the prompt depends on.
+#define PROMPT_WATCH_VAR_NAME L"fish_prompt_watch"
+
+/// Separates the left and right prompt in the output of an asynchronous prompt run.
+#define ASYNC_PROMPT_SEPARATOR L'\x1e'
+
+/// How often an asynchronous prompt run checks whether it is still wanted, in milliseconds.
+#define ASYNC_PROMPT_POLL_MS 50
+
+/// The most distinct history items the autosuggestion index holds.
+#define AUTOSUGGEST_INDEX_SIZE 4096
+
+/// How long, in seconds, the autosuggestion index reuses whether an item is a valid suggestion.
+#define AUTOSUGGEST_VALIDITY_TTL 2.0
+
+/// How long, in milliseconds, the prompt waits for input before preloading completions, unless
+/// fish_preload_delay_ms says otherwise.
+#define PRELOAD_DELAY_DEFAULT_MS 1000
+
+/// How many of the newest history items are counted to find the most frequent commands.
+#define PRELOAD_HISTORY_ITEMS 1000
+
+/// How many of the most frequent commands have their completions preloaded.
+#define PRELOAD_COMMANDS 16
+
 /// The default title for the reader. This is used by reader_readline.
 #define DEFAULT_TITLE L"echo $_ \" \"; __fish_pwd"
 
@@ -144,17 +190,179 @@ static unsigned int read_generation_count() {
 
 static void set_command_line_and_position(editable_line_t *el, const wcstring &new_str, size_t pos);
 
+/// Approximately how much memory an edit takes.
+static size_t line_edit_memory(const line_edit_t &edit) {
+    return sizeof edit + (edit.removed.size() + edit.inserted.size()) * sizeof(wchar_t);
+}
+
+void editable_line_t::record_edit(line_edit_t edit, bool mergeable) {
+    this->text.replace(edit.offset, edit.removed.size(), edit.inserted);
+    for (const line_edit_t &undone : this->redo_edits) this->edit_memory -= line_edit_memory(undone);
+    this->redo_edits.clear();
+
+    // Merge characters typed one at a time into the last insertion until a new word starts, and
+    // characters deleted one at a time into the last deletion.
+    if (mergeable && this->may_merge_edit && !this->undo_edits.empty()) {
+        line_edit_t &last = this->undo_edits.back();
+        bool merged = false;
+        this->edit_memory -= line_edit_memory(last);
+        if (edit.removed.empty() && last.removed.empty()) {
+            bool starts_word = iswspace(last.inserted.back()) && !iswspace(edit.inserted.front());
+            if (edit.offset == last.offset + last.inserted.size() && !starts_word) {
+                last.inserted.append(edit.inserted);
+                merged = true;
+            }
+        } else if (edit.inserted.empty() && last.inserted.empty()) {
+            if (edit.offset + edit.removed.size() == last.offset) {
+                // Deleting backwards.
+                last.removed.insert(0, edit.removed);
+                last.offset = edit.offset;
+                merged = true;
+            } else if (edit.offset == last.offset) {
+                // Deleting forwards.
+                last.removed.append(edit.removed);
+                merged = true;
+            }
+        }
+        this->edit_memory += line_edit_memory(last);
+        if (merged) return;
+    }
+
+    this->edit_memory += line_edit_memory(edit);
+    this->undo_edits.push_back(std::move(edit));
+    while (this->edit_memory > UNDO_MEMORY_LIMIT && this->undo_edits.size() > 1) {
+        this->edit_memory -= line_edit_memory(this->undo_edits.front());
+        this->undo_edits.pop_front();
+    }
+    this->may_merge_edit = mergeable;
+}
+
 void editable_line_t::insert_string(const wcstring &str, size_t start, size_t len) {
     // Clamp the range to something valid.
     size_t string_length = str.size();
     start = mini(start, string_length);      //!OCLINT(parameter reassignment)
     len = mini(len, string_length - start);  //!OCLINT(parameter reassignment)
-    this->text.insert(this->position, str, start, len);
+    if (len == 0) return;
+    this->record_edit({this->position, wcstring(), str.substr(start, len), this->position},
+                      len == 1);
     this->position += len;
 }
 
+void editable_line_t::erase_substring(size_t offset, size_t length) {
+    if (length == 0) return;
+    this->record_edit({offset, this->text.substr(offset, length), wcstring(), this->position},
+                      length == 1);
+}
+
+void editable_line_t::replace_substring(size_t offset, size_t length,
+                                        const wcstring &replacement) {
+    if (length == 0 && replacement.empty()) return;
+    this->record_edit({offset, this->text.substr(offset, length), replacement, this->position},
+                      false);
+}
+
+void editable_line_t::set_text(const wcstring &new_text) {
+    // Only the middle part that differs changes.
+    size_t max_prefix = mini(this->text.size(), new_text.size());
+    size_t prefix = 0;
+    while (prefix < max_prefix && this->text.at(prefix) == new_text.at(prefix)) prefix++;
+    size_t suffix = 0;
+    while (suffix < max_prefix - prefix &&
+           this->text.at(this->text.size() - 1 - suffix) ==
+               new_text.at(new_text.size() - 1 - suffix)) {
+        suffix++;
+    }
+    this->replace_substring(prefix, this->text.size() - prefix - suffix,
+                            new_text.substr(prefix, new_text.size() - prefix - suffix));
+}
+
+bool editable_line_t::undo() {
+    if (this->undo_edits.empty()) return false;
+    line_edit_t edit = std::move(this->undo_edits.back());
+    this->undo_edits.pop_back();
+    this->text.replace(edit.offset, edit.inserted.size(), edit.removed);
+    this->position = mini(edit.cursor, this->text.size());
+    this->redo_edits.push_back(std::move(edit));
+    this->may_merge_edit = false;
+    return true;
+}
+
+bool editable_line_t::redo() {
+    if (this->redo_edits.empty()) return false;
+    line_edit_t edit = std::move(this->redo_edits.back());
+    this->redo_edits.pop_back();
+    this->text.replace(edit.offset, edit.removed.size(), edit.inserted);
+    this->position = edit.offset + edit.inserted.size();
+    this->undo_edits.push_back(std::move(edit));
+    this->may_merge_edit = false;
+    return true;
+}
+
+void editable_line_t::clear_undo() {
+    this->undo_edits.clear();
+    this->redo_edits.clear();
+    this->edit_memory = 0;
+    this->may_merge_edit = false;
+}
+
+/// The completions of the last tab completion, kept so that typing more of the token can narrow
+/// them instead of completing again.
+struct last_completion_t {
+    /// The completions as they came from the complete function, before they were sorted and
+    /// prioritized: better matches for the old token may be worse ones for the new.
+    std::vector<completion_t> comps;
+    /// The command line and cursor position they were made for, and where the token starts.
+    wcstring text;
+    size_t position = 0;
+    size_t token_start = 0;
+    /// The variable generation when they were made. Conditions and completion functions may
+    /// depend on variables, and running a command changes some.
+    uint64_t env_generation = 0;
+};
+
 /// A struct describing the state of the interactive reader. These states can be stacked, in case
 /// reader_readline() calls are nested. This happens when the 'read' builtin is used.
+/// Everything the output of the prompt commands depends on, as far as we know. If this is the same
+/// as for the last run, the output of that run may be used again.
+struct prompt_deps_t {
+    /// The prompt commands and, if they are functions, their definitions.
+    wcstring left_prompt;
+    wcstring right_prompt;
+    function_definition_ref_t left_def;
+    function_definition_ref_t right_def;
+    /// Whether the user declared the dependencies, and the values they named. Without a
+    /// declaration the prompt is always run again.
+    bool watching = false;
+    wcstring_list_t watched;
+    std::vector<maybe_t<env_var_t>> vars;
+    std::vector<file_id_t> files;
+
+    /// Return whether the output for \p rhs is the output for these dependencies too, because all
+    /// of them are the same.
+    bool unchanged_from(const prompt_deps_t &rhs) const {
+        if (!watching || !rhs.watching || !same_prompt(rhs) || watched != rhs.watched ||
+            files != rhs.files) {
+            return false;
+        }
+        for (size_t i = 0; i < vars.size(); i++) {
+            const maybe_t<env_var_t> &var = vars[i], &old = rhs.vars[i];
+            if (var.has_value() != old.has_value()) return false;
+            // Electric variables like $status get a new generation every time, so fall back to
+            // comparing their values.
+            if (var && var->get_generation() != old->get_generation() && !(*var == *old)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Return whether these are for the same prompt commands as \p rhs.
+    bool same_prompt(const prompt_deps_t &rhs) const {
+        return left_prompt == rhs.left_prompt && right_prompt == rhs.right_prompt &&
+               left_def == rhs.left_def && right_def == rhs.right_def;
+    }
+};
+
 class reader_data_t {
    public:
     /// String containing the whole current commandline.
@@ -206,9 +414,21 @@ class reader_data_t {
     wcstring left_prompt_buff;
     /// The output of the last evaluation of the right prompt command.
     wcstring right_prompt_buff;
+    /// The output of the mode prompt, which comes before the left prompt.
+    wcstring mode_prompt_buff;
+    /// The output of the left and right prompt from their last run, and what it depended on. It is
+    /// shown while an asynchronous run is in progress, and reused if its dependencies are
+    /// unchanged.
+    wcstring cached_left_prompt;
+    wcstring cached_right_prompt;
+    bool has_cached_prompt;
+    prompt_deps_t cached_prompt_deps;
+    /// The dependencies of the asynchronous prompt run in progress.
+    prompt_deps_t pending_prompt_deps;
     /// Completion support.
     wcstring cycle_command_line;
     size_t cycle_cursor_pos;
+    last_completion_t last_completion;
     /// Color is the syntax highlighting for buff.  The format is that color[i] is the
     /// classification (according to the enum in highlight.h) of buff[i].
     std::vector<highlight_spec_t> colors;
@@ -272,6 +492,7 @@ class reader_data_t {
           sel_begin_pos(0),
           sel_start_pos(0),
           sel_stop_pos(0),
+          has_cached_prompt(false),
           cycle_cursor_pos(0),
           complete_func(0),
           highlight_function(0),
@@ -322,12 +543,35 @@ static void reader_super_highlight_me_plenty(int highlight_pos_adjust = 0, bool
 /// Variable to keep track of forced exits - see \c reader_exit_forced();
 static bool exit_forced;
 
+/// The terminal modes we last set, which are one of the above or shell_modes, and g_fork_count
+/// when we did. Only another process can change them behind our back, so until one is started or
+/// given the terminal, setting the same modes again would be a wasted syscall.
+static const struct termios *tty_modes_in_effect = NULL;
+static int tty_modes_fork_count = 0;
+
+/// Returns the modes last set if they are certainly still in effect, or NULL.
+static const struct termios *tty_modes_known() {
+    return tty_modes_fork_count == g_fork_count ? tty_modes_in_effect : NULL;
+}
+
+/// Set the terminal modes, unless they are known to be in effect already. Returns the result of
+/// tcsetattr.
+static int set_tty_modes(const struct termios *modes) {
+    if (tty_modes_known() == modes) return 0;
+    int result = tcsetattr(STDIN_FILENO, TCSANOW, modes);
+    tty_modes_in_effect = result == 0 ? modes : NULL;
+    tty_modes_fork_count = g_fork_count;
+    return result;
+}
+
+void reader_forget_tty_modes() { tty_modes_in_effect = NULL; }
+
 /// Give up control of terminal.
 static void term_donate() {
     set_color(rgb_color_t::normal(), rgb_color_t::normal());
 
     while (1) {
-        if (tcsetattr(STDIN_FILENO, TCSANOW, &tty_modes_for_external_cmds) == -1) {
+        if (set_tty_modes(&tty_modes_for_external_cmds) == -1) {
             if (errno == EIO) redirect_tty_output();
             if (errno != EINTR) {
                 debug(1, _(L"Could not set terminal mode for new job"));
@@ -355,8 +599,12 @@ static void update_buff_pos(editable_line_t *el, size_t buff_pos) {
 
 /// Grab control of terminal.
 static void term_steal() {
+    // SIGWINCH goes to whoever has the terminal, so the window size may have changed without us
+    // noticing if another process has been running since the terminal was donated.
+    if (!tty_modes_known()) invalidate_termsize();
+
     while (1) {
-        if (tcsetattr(STDIN_FILENO, TCSANOW, &shell_modes) == -1) {
+        if (set_tty_modes(&shell_modes) == -1) {
             if (errno == EIO) redirect_tty_output();
             if (errno != EINTR) {
                 debug(1, _(L"Could not set terminal mode for shell"));
@@ -366,8 +614,6 @@ static void term_steal() {
         } else
             break;
     }
-
-    invalidate_termsize();
 }
 
 bool reader_exit_forced() { return exit_forced; }
@@ -475,14 +721,13 @@ static void reader_kill(editable_line_t *el, size_t begin_idx, size_t length, in
         kill_replace(old, data->kill_item);
     }
 
+    el->erase_substring(begin_idx, length);
     if (el->position > begin_idx) {
         // Move the buff position back by the number of characters we deleted, but don't go past
         // buff_pos.
         size_t backtrack = mini(el->position - begin_idx, length);
         update_buff_pos(el, el->position - backtrack);
     }
-
-    el->text.erase(begin_idx, length);
     data->command_line_changed(el);
 
     reader_super_highlight_me_plenty();
@@ -559,6 +804,17 @@ void reader_data_t::pager_selection_changed() {
 /// Expand abbreviations at the given cursor position. Does NOT inspect 'data'.
 bool reader_expand_abbreviation_in_command(const wcstring &cmdline, size_t cursor_pos,
                                            wcstring *output) {
+    // Abbreviation names can not contain spaces, so unless an abbreviation is named somewhere in
+    // the word around the cursor there is nothing to expand, and no need to parse the command line.
+    // Words with quotes or escapes are left to the parser.
+    size_t word_begin = cursor_pos, word_end = cursor_pos;
+    while (word_begin > 0 && !iswspace(cmdline.at(word_begin - 1))) word_begin--;
+    while (word_end < cmdline.size() && !iswspace(cmdline.at(word_end))) word_end++;
+    if (cmdline.find_first_of(L"'\"\\", word_begin) >= word_end &&
+        !abbreviation_in_word(cmdline, word_begin, word_end, cursor_pos)) {
+        return false;
+    }
+
     // See if we are at "command position". Get the surrounding command substitution, and get the
     // extent of the first token.
     const wchar_t *const buff = cmdline.c_str();
@@ -640,7 +896,7 @@ bool reader_data_t::expand_abbreviation_as_necessary(size_t cursor_backtrack) {
             // lengths.
             size_t new_buff_pos = el->position + new_cmdline.size() - el->text.size();
 
-            el->text = std::move(new_cmdline);
+            el->set_text(new_cmdline);
             update_buff_pos(el, new_buff_pos);
             data->command_line_changed(el);
             result = true;
@@ -690,28 +946,205 @@ void reader_write_title(const wcstring &cmd, bool reset_cursor_position) {
 
     wcstring_list_t lst;
     proc_push_interactive(0);
-    if (exec_subshell(fish_title_command, lst, false /* ignore exit status */) != -1 &&
-        !lst.empty()) {
-        fputws(L"\e]0;", stdout);
+    const bool have_title =
+        exec_subshell(fish_title_command, lst, false /* ignore exit status */) != -1 &&
+        !lst.empty();
+    proc_pop_interactive();
+
+    // Write the title and what follows it at once.
+    scoped_output_frame_t frame;
+    if (have_title) {
+        wcstring title = L"\e]0;";
         for (size_t i = 0; i < lst.size(); i++) {
-            fputws(lst.at(i).c_str(), stdout);
+            title.append(lst.at(i));
         }
-        ignore_result(write(STDOUT_FILENO, "\a", 1));
+        title.push_back(L'\a');
+        writestr(title.c_str());
     }
 
-    proc_pop_interactive();
     set_color(rgb_color_t::reset(), rgb_color_t::reset());
-    if (reset_cursor_position && !lst.empty()) {
+    if (reset_cursor_position && have_title) {
         // Put the cursor back at the beginning of the line (issue #2453).
-        ignore_result(write(STDOUT_FILENO, "\r", 1));
+        output_write_bytes("\r", 1);
+    }
+}
+
+/// Every run of the prompt gets a new generation count, and so does every command that is run, so
+/// an asynchronous prompt run can tell when its output is no longer wanted.
+static std::atomic<unsigned int> s_prompt_generation;
+
+/// The output of an asynchronous prompt run.
+struct async_prompt_result_t {
+    unsigned int generation = 0;
+    /// The child that ran the prompt, and whether its output was read to the end.
+    pid_t pid = -1;
+    bool ok = false;
+    wcstring left;
+    wcstring right;
+};
+
+/// Return whether the prompt should be run asynchronously. This is only done for the shell's own
+/// prompt, and only if the user asked for it.
+static bool prompt_is_async() {
+    return data->left_prompt == LEFT_PROMPT_FUNCTION_NAME &&
+           !env_get(ASYNC_PROMPT_VAR_NAME).missing_or_empty();
+}
+
+/// Return a script that makes a child fish print the prompts as they would be printed here. The
+/// child gets the definitions of the prompt functions, the values of the global variables that are
+/// not exported, and the status of the last command. Exported variables are in its environment,
+/// and it reads universal variables itself.
+static wcstring async_prompt_script() {
+    wcstring script;
+    for (const wcstring &name : env_get_names(ENV_GLOBAL | ENV_UNEXPORT)) {
+        if (name == L"umask") continue;
+        auto var = env_get(name, ENV_GLOBAL);
+        if (!var || var->read_only()) continue;
+        script.append(L"set -g ");
+        script.append(escape_string(name, ESCAPE_ALL));
+        for (const wcstring &val : var->as_list()) {
+            script.push_back(L' ');
+            script.append(escape_string(val, ESCAPE_ALL));
+        }
+        script.push_back(L'\n');
+    }
+
+    script.append(L"function __fish_async_prompt_status\n    return $argv[1]\nend\n");
+    const wcstring status = to_string(proc_get_last_status());
+    const wcstring prompts[] = {data->left_prompt, data->right_prompt};
+    for (size_t i = 0; i < sizeof prompts / sizeof *prompts; i++) {
+        if (i > 0) script.append(L"echo -n \\x1e\n");
+        if (prompts[i].empty()) continue;
+        if (function_exists(prompts[i])) script.append(functions_def(prompts[i]) + L"\n");
+        script.append(L"__fish_async_prompt_status " + status + L"\n" + prompts[i] + L"\n");
+    }
+    return script;
+}
+
+/// Read the prompts printed by the child fish with the given pid from \p fd, and close it. This
+/// runs in a background thread, and gives up early if the generation count changes. It leaves the
+/// child to the main thread, which reaps it and so is the only one that may signal it.
+static async_prompt_result_t read_async_prompt(unsigned int generation, pid_t pid, int fd) {
+    async_prompt_result_t result;
+    result.generation = generation;
+    result.pid = pid;
+
+    std::string output;
+    bool done = false;
+    while (!done && s_prompt_generation == generation) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, ASYNC_PROMPT_POLL_MS) <= 0) continue;
+        char buf[4096];
+        ssize_t amt = read(fd, buf, sizeof buf);
+        if (amt > 0) {
+            output.append(buf, amt);
+        } else if (amt == 0 || errno != EINTR) {
+            done = true;
+        }
+    }
+    close(fd);
+    if (!done) return result;
+
+    // Treat the output the way exec_prompt treats the output of the prompt command substitutions:
+    // a trailing newline is dropped from the left prompt, and the right prompt is a single line.
+    const wcstring text = str2wcstring(output);
+    size_t sep = text.find(ASYNC_PROMPT_SEPARATOR);
+    result.left = text.substr(0, sep);
+    if (!result.left.empty() && result.left.back() == L'\n') result.left.pop_back();
+    if (sep != wcstring::npos) {
+        for (wchar_t c : text.substr(sep + 1)) {
+            if (c != L'\n') result.right.push_back(c);
+        }
     }
+    result.ok = true;
+    return result;
+}
+
+/// Called on the main thread when an asynchronous prompt run is done. If the prompt it was for is
+/// still shown, it is replaced.
+static void async_prompt_completed(async_prompt_result_t result) {
+    // A run that was given up on may still be going.
+    if (!result.ok) proc_kill_adopted_child(result.pid, SIGTERM);
+    if (!data || !result.ok || result.generation != s_prompt_generation) return;
+    data->cached_left_prompt = std::move(result.left);
+    data->cached_right_prompt = std::move(result.right);
+    data->cached_prompt_deps = std::move(data->pending_prompt_deps);
+    wcstring left = data->mode_prompt_buff + data->cached_left_prompt;
+    if (left == data->left_prompt_buff && data->cached_right_prompt == data->right_prompt_buff) {
+        return;
+    }
+    data->left_prompt_buff = std::move(left);
+    data->right_prompt_buff = data->cached_right_prompt;
+    s_reset(&data->screen, screen_reset_current_line_and_prompt);
+    reader_repaint_needed();
+    reader_repaint_if_needed();
+}
+
+/// Start running the prompt in the background. Its output replaces the cached prompt when done.
+static void start_async_prompt() {
+    const auto bin_dir = env_get(L"__fish_bin_dir");
+    if (!bin_dir) return;
+    const std::string fish_path = wcs2string(bin_dir->as_string() + L"/fish");
+    const std::string script = wcs2string(async_prompt_script());
+
+    // The child is started here, so that it is known to the main thread before it can be reaped.
+    const char *const argv[] = {"fish", "-c", script.c_str(), NULL};
+    int pipes[2];
+    if (fish_pipe_cloexec(pipes) == -1) return;
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    pid_t pid = -1;
+    if (null_fd >= 0) {
+        pid = spawn_with_output_fds(fish_path.c_str(), argv, env_export_arr(), pipes[1], null_fd);
+        close(null_fd);
+    }
+    close(pipes[1]);
+    if (pid < 0) {
+        close(pipes[0]);
+        return;
+    }
+    proc_adopt_child(pid);
+
+    const unsigned int generation = s_prompt_generation;
+    const int fd = pipes[0];
+    iothread_perform([=]() { return read_async_prompt(generation, pid, fd); },
+                     &async_prompt_completed);
+}
+
+/// Return what the output of the prompt commands depends on right now.
+static prompt_deps_t get_prompt_deps() {
+    prompt_deps_t deps;
+    deps.left_prompt = data->left_prompt;
+    deps.right_prompt = data->right_prompt;
+    deps.left_def = function_get_definition_ref(data->left_prompt);
+    deps.right_def = function_get_definition_ref(data->right_prompt);
+
+    const auto watch = env_get(PROMPT_WATCH_VAR_NAME);
+    if (watch) {
+        deps.watching = true;
+        deps.watched = watch->as_list();
+        for (const wcstring &item : deps.watched) {
+            if (item.find(L'/') != wcstring::npos) {
+                deps.files.push_back(file_id_for_path(item));
+            } else {
+                deps.vars.push_back(env_get(item));
+            }
+        }
+    }
+    return deps;
 }
 
 /// Reexecute the prompt command. The output is inserted into data->prompt_buff.
 static void exec_prompt() {
+    // The command is done, so write out the universal variables it changed.
+    env_universal_flush();
+
+    // Any asynchronous run of the previous prompt is now out of date.
+    s_prompt_generation++;
+
     // Clear existing prompts.
     data->left_prompt_buff.clear();
     data->right_prompt_buff.clear();
+    data->mode_prompt_buff.clear();
 
     // Do not allow the exit status of the prompts to leak through.
     const bool apply_exit_status = false;
@@ -720,35 +1153,61 @@ static void exec_prompt() {
     if (data->left_prompt.size() || data->right_prompt.size()) {
         proc_push_interactive(0);
 
-        // Prepend any mode indicator to the left prompt (issue #1988).
+        // Prepend any mode indicator to the left prompt (issue #1988). It is always run right away,
+        // because it is expected to change as soon as the mode does.
         if (function_exists(MODE_PROMPT_FUNCTION_NAME)) {
             wcstring_list_t mode_indicator_list;
             exec_subshell(MODE_PROMPT_FUNCTION_NAME, mode_indicator_list, apply_exit_status);
             // We do not support multiple lines in the mode indicator, so just concatenate all of
             // them.
             for (size_t i = 0; i < mode_indicator_list.size(); i++) {
-                data->left_prompt_buff += mode_indicator_list.at(i);
+                data->mode_prompt_buff += mode_indicator_list.at(i);
             }
         }
-
-        if (!data->left_prompt.empty()) {
-            wcstring_list_t prompt_list;
-            // Ignore return status.
-            exec_subshell(data->left_prompt, prompt_list, apply_exit_status);
-            for (size_t i = 0; i < prompt_list.size(); i++) {
-                if (i > 0) data->left_prompt_buff += L'\n';
-                data->left_prompt_buff += prompt_list.at(i);
+        data->left_prompt_buff = data->mode_prompt_buff;
+
+        // If nothing the prompt depends on has changed, the output of its last run is used again.
+        // An asynchronous prompt shows that output until the new one is done. The first time there
+        // is nothing to show, so it is run right here like any other prompt.
+        prompt_deps_t deps = get_prompt_deps();
+        if (data->has_cached_prompt && deps.unchanged_from(data->cached_prompt_deps)) {
+            data->left_prompt_buff += data->cached_left_prompt;
+            data->right_prompt_buff = data->cached_right_prompt;
+        } else if (prompt_is_async() && data->has_cached_prompt &&
+                   deps.same_prompt(data->cached_prompt_deps)) {
+            data->left_prompt_buff += data->cached_left_prompt;
+            data->right_prompt_buff = data->cached_right_prompt;
+            data->pending_prompt_deps = std::move(deps);
+            start_async_prompt();
+        } else {
+            wcstring left, right;
+            if (!data->left_prompt.empty()) {
+                wcstring_list_t prompt_list;
+                // Ignore return status.
+                exec_subshell(data->left_prompt, prompt_list, apply_exit_status);
+                for (size_t i = 0; i < prompt_list.size(); i++) {
+                    if (i > 0) left += L'\n';
+                    left += prompt_list.at(i);
+                }
             }
-        }
 
-        if (!data->right_prompt.empty()) {
-            wcstring_list_t prompt_list;
-            // Status is ignored.
-            exec_subshell(data->right_prompt, prompt_list, apply_exit_status);
-            for (size_t i = 0; i < prompt_list.size(); i++) {
-                // Right prompt does not support multiple lines, so just concatenate all of them.
-                data->right_prompt_buff += prompt_list.at(i);
+            if (!data->right_prompt.empty()) {
+                wcstring_list_t prompt_list;
+                // Status is ignored.
+                exec_subshell(data->right_prompt, prompt_list, apply_exit_status);
+                for (size_t i = 0; i < prompt_list.size(); i++) {
+                    // Right prompt does not support multiple lines, so just concatenate all of
+                    // them.
+                    right += prompt_list.at(i);
+                }
             }
+
+            data->left_prompt_buff += left;
+            data->right_prompt_buff = right;
+            data->cached_left_prompt = std::move(left);
+            data->cached_right_prompt = std::move(right);
+            data->cached_prompt_deps = std::move(deps);
+            data->has_cached_prompt = true;
         }
 
         proc_pop_interactive();
@@ -760,6 +1219,21 @@ static void exec_prompt() {
     reader_write_title(L"", false);
 }
 
+/// Set the variables describing what the processes of the previous interactive command used.
+static void set_env_cmd_usage(const proc_usage_t &usage) {
+    const struct {
+        const wchar_t *name;
+        uint64_t value;
+    } vars[] = {{ENV_cmd_user_time, usage.user_usec / 1000},
+                {ENV_cmd_system_time, usage.system_usec / 1000},
+                {ENV_cmd_max_rss, usage.max_rss_kb},
+                {ENV_cmd_process_count, usage.spawned},
+                {ENV_cmd_spawn_time, usage.spawn_usec}};
+    for (const auto &var : vars) {
+        env_set_one(var.name, ENV_UNEXPORT, to_string((unsigned long long)var.value));
+    }
+}
+
 void reader_init() {
     DIE_ON_FAILURE(pthread_key_create(&generation_count_key, NULL));
 
@@ -767,6 +1241,7 @@ void reader_init() {
     // in a function like `fish_prompt` or `fish_right_prompt` it is defined at the time the first
     // prompt is written.
     env_set_one(ENV_cmd_duration, ENV_UNEXPORT, L"0");
+    set_env_cmd_usage(proc_usage_t());
 
     // Save the initial terminal mode.
     tcgetattr(STDIN_FILENO, &terminal_mode_on_startup);
@@ -801,7 +1276,7 @@ void reader_init() {
     //
     // TODO: Remove this condition when issue #2315 and #1041 are addressed.
     if (is_interactive_session) {
-        tcsetattr(STDIN_FILENO, TCSANOW, &shell_modes);
+        set_tty_modes(&shell_modes);
     }
 
     // We do this not because we actually need the window size but for its side-effect of correctly
@@ -816,7 +1291,7 @@ void reader_destroy() { pthread_key_delete(generation_count_key); }
 void restore_term_mode() {
     if (getpid() != tcgetpgrp(STDIN_FILENO)) return;
 
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &terminal_mode_on_startup) == -1 && errno == EIO) {
+    if (set_tty_modes(&terminal_mode_on_startup) == -1 && errno == EIO) {
         redirect_tty_output();
     }
 }
@@ -918,7 +1393,9 @@ static bool command_ends_paging(wchar_t c, bool focused_on_search_field) {
         case R_VI_ARG_DIGIT:
         case R_VI_DELETE_TO:
         case R_BEGINNING_OF_BUFFER:
-        case R_END_OF_BUFFER: {
+        case R_END_OF_BUFFER:
+        case R_UNDO:
+        case R_REDO: {
             // These commands operate on the search field if that's where the focus is.
             return !focused_on_search_field;
         }
@@ -937,9 +1414,14 @@ static void remove_backward() {
     // width at least 1.
     int width;
     do {
+        width = fish_wcwidth(el->text.at(el->position - 1));
+        el->erase_substring(el->position - 1, 1);
         update_buff_pos(el, el->position - 1);
-        width = fish_wcwidth(el->text.at(el->position));
-        el->text.erase(el->position, 1);
+        // Keep the colors of the rest of the line with their characters, so the screen sees that
+        // they only moved.
+        if (el == &data->command_line && el->position < data->colors.size()) {
+            data->colors.erase(data->colors.begin() + el->position);
+        }
     } while (width == 0 && el->position > 0);
     data->command_line_changed(el);
     data->suppress_autosuggestion = true;
@@ -972,8 +1454,15 @@ static bool insert_string(editable_line_t *el, const wcstring &str,
         size_t range_end =
             (has_expansion_triggering_char ? char_triggering_expansion_pos + 1 : len);
 
-        // Insert from the cursor up to but not including the range end.
+        // Insert from the cursor up to but not including the range end. The new characters take
+        // the color of the one before them until they are highlighted, and the colors of the rest
+        // of the line stay with their characters.
         assert(range_end > cursor);
+        if (el == &data->command_line && el->position <= data->colors.size()) {
+            std::vector<highlight_spec_t> &colors = data->colors;
+            highlight_spec_t color = el->position > 0 ? colors.at(el->position - 1) : 0;
+            colors.insert(colors.begin() + el->position, range_end - cursor, color);
+        }
         el->insert_string(str, cursor, range_end - cursor);
 
         update_buff_pos(el, el->position);
@@ -1128,6 +1617,160 @@ static void completion_insert(const wchar_t *val, complete_flags_t flags) {
     reader_set_buffer_maintaining_pager(new_command_line, cursor);
 }
 
+namespace {
+/// Background requests of one kind, such as highlighting. At most one of them waits in the iothread
+/// queue: a request made while another one has not started yet replaces it, since only the result
+/// for the latest command line is wanted. This keeps fast typing or pasting from queueing a request
+/// for every key.
+template <typename T>
+class coalesced_requests_t {
+    std::mutex lock;
+    /// The latest request that has not started yet, if any.
+    std::function<T(void)> pending;
+    void (*const completion)(T);
+    const iothread_priority_t priority;
+
+   public:
+    coalesced_requests_t(void (*c)(T), iothread_priority_t p) : completion(c), priority(p) {}
+
+    void perform(std::function<T(void)> &&handler) {
+        scoped_lock locker(lock);
+        const bool queued = static_cast<bool>(pending);
+        pending = std::move(handler);
+        if (queued) return;
+        iothread_perform(
+            [this]() -> T {
+                std::function<T(void)> handler;
+                {
+                    scoped_lock locker(lock);
+                    handler.swap(pending);
+                }
+                return handler();
+            },
+            completion, priority);
+    }
+};
+
+/// An index of the most recent distinct single-line history items, for history autosuggestions.
+/// The items are sorted, so the ones starting with the command line are a contiguous range and are
+/// found without scanning the history. Each item keeps its autosuggestion hint, worked out the
+/// first time it is a candidate, and whether it was valid when last checked, so typing does not
+/// parse items or probe the filesystem again for every key.
+///
+/// The index belongs to one history and working directory. It is rebuilt when the history gains
+/// an item, which running any command does.
+class autosuggest_index_t {
+    struct entry_t {
+        wcstring str;
+        path_list_t required_paths;
+        /// 0 for the most recent item.
+        size_t recency;
+        bool has_hint = false;
+        autosuggest_hint_t hint;
+        /// Whether the item was a valid suggestion, and the time it was checked, if ever.
+        bool valid = false;
+        double validated_at = -1;
+    };
+
+    /// Sorted by str.
+    std::vector<entry_t> entries;
+
+    const history_t *history = NULL;
+    size_t history_size = 0;
+    wcstring newest_item;
+    wcstring working_directory;
+
+    /// Whether every item in the history is in the index, so there are none older to search.
+    bool complete = false;
+
+   public:
+    /// Whether the index is for the given history, and is up to date.
+    bool is_current(const history_t *hist, size_t size, const wcstring &newest) const {
+        return history == hist && history_size == size && newest_item == newest;
+    }
+
+    bool is_complete() const { return complete; }
+
+    /// Fill the index from the most recent items of \p hist. Returns false if the request went
+    /// stale first.
+    bool build(history_t *hist, size_t size, const wcstring &newest) {
+        entries.clear();
+        history = NULL;
+        std::unordered_set<wcstring> seen;
+        size_t idx = 1;
+        for (; idx <= size && entries.size() < AUTOSUGGEST_INDEX_SIZE; idx++) {
+            if (idx % 256 == 0 && reader_thread_job_is_stale()) return false;
+            history_item_t item = hist->item_at_index(idx);
+            if (item.empty()) break;
+
+            // Skip items with newlines because they make terrible autosuggestions.
+            const wcstring &str = item.str();
+            if (str.find(L'\n') != wcstring::npos || !seen.insert(str).second) continue;
+            entry_t entry;
+            entry.str = str;
+            entry.required_paths = item.get_required_paths();
+            entry.recency = entries.size();
+            entries.push_back(std::move(entry));
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const entry_t &a, const entry_t &b) { return a.str < b.str; });
+
+        history = hist;
+        history_size = size;
+        newest_item = newest;
+        working_directory.clear();
+        complete = idx > size;
+        return true;
+    }
+
+    /// Find the most recent valid item starting with \p prefix, and put it in \p out_suggestion.
+    /// Every item starting with the prefix which was found to be invalid is added to
+    /// \p out_rejected. Returns false if there is none, or the request went stale.
+    bool lookup(const wcstring &prefix, const wcstring &wd, const env_vars_snapshot_t &vars,
+                wcstring *out_suggestion, wcstring_list_t *out_rejected) {
+        // Validity depends on the working directory.
+        if (wd != working_directory) {
+            for (entry_t &entry : entries) entry.validated_at = -1;
+            working_directory = wd;
+        }
+
+        std::vector<entry_t *> matches;
+        auto iter = std::lower_bound(
+            entries.begin(), entries.end(), prefix,
+            [](const entry_t &entry, const wcstring &str) { return entry.str < str; });
+        for (; iter != entries.end() && string_prefixes_string(prefix, iter->str); ++iter) {
+            matches.push_back(&*iter);
+        }
+        std::sort(matches.begin(), matches.end(),
+                  [](const entry_t *a, const entry_t *b) { return a->recency < b->recency; });
+
+        const double now = timef();
+        for (entry_t *entry : matches) {
+            if (reader_thread_job_is_stale()) return false;
+            if (entry->validated_at < 0 || now - entry->validated_at >= AUTOSUGGEST_VALIDITY_TTL) {
+                if (!entry->has_hint) {
+                    history_item_t item(entry->str);
+                    item.set_required_paths(entry->required_paths);
+                    entry->hint = autosuggest_hint_from_history(item);
+                    entry->has_hint = true;
+                }
+                entry->valid = autosuggest_validate_hint(entry->hint, wd, vars);
+                entry->validated_at = now;
+            }
+            if (entry->valid) {
+                *out_suggestion = entry->str;
+                return true;
+            }
+            out_rejected->push_back(entry->str);
+        }
+        return false;
+    }
+};
+}  // namespace
+
+/// The autosuggestion index, shared by autosuggestion requests on background threads.
+static owning_lock<autosuggest_index_t> s_autosuggest_index;
+
 struct autosuggestion_result_t {
     wcstring suggestion;
     wcstring search_string;
@@ -1160,16 +1803,39 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
             return nothing;
         }
 
-        history_search_t searcher(*history, search_string, HISTORY_SEARCH_TYPE_PREFIX);
-        while (!reader_thread_job_is_stale() && searcher.go_backwards()) {
-            history_item_t item = searcher.current_item();
+        // Look in the recent history first, through the index.
+        const size_t history_size = history->size();
+        const wcstring newest = history_size ? history->item_at_index(1).str() : wcstring();
+        wcstring suggestion;
+        wcstring_list_t rejected;
+        bool searched_everything;
+        {
+            auto &&index = s_autosuggest_index.acquire();
+            if (!index.value.is_current(history, history_size, newest) &&
+                !index.value.build(history, history_size, newest)) {
+                return nothing;
+            }
+            if (index.value.lookup(search_string, working_directory, vars, &suggestion,
+                                   &rejected)) {
+                return {std::move(suggestion), search_string};
+            }
+            searched_everything = index.value.is_complete();
+        }
+
+        // Then search older items, skipping the ones the index already turned down.
+        if (!searched_everything) {
+            history_search_t searcher(*history, search_string, HISTORY_SEARCH_TYPE_PREFIX);
+            searcher.skip_matches(rejected);
+            while (!reader_thread_job_is_stale() && searcher.go_backwards()) {
+                history_item_t item = searcher.current_item();
 
-            // Skip items with newlines because they make terrible autosuggestions.
-            if (item.str().find('\n') != wcstring::npos) continue;
+                // Skip items with newlines because they make terrible autosuggestions.
+                if (item.str().find('\n') != wcstring::npos) continue;
 
-            if (autosuggest_validate_from_history(item, working_directory, vars)) {
-                // The command autosuggestion was handled specially, so we're done.
-                return {searcher.current_string(), search_string};
+                if (autosuggest_validate_from_history(item, working_directory, vars)) {
+                    // The command autosuggestion was handled specially, so we're done.
+                    return {searcher.current_string(), search_string};
+                }
             }
         }
 
@@ -1189,7 +1855,7 @@ static std::function<autosuggestion_result_t(void)> get_autosuggestion_performer
         // Try normal completions.
         std::vector<completion_t> completions;
         complete(search_string, &completions, COMPLETION_REQUEST_AUTOSUGGESTION);
-        completions_sort_and_prioritize(&completions);
+        completions_sort_and_prioritize(&completions, 1);
         if (!completions.empty()) {
             const completion_t &comp = completions.at(0);
             size_t cursor = cursor_pos;
@@ -1231,7 +1897,9 @@ static void update_autosuggestion(void) {
         !data->command_line.empty() && data->history_search.is_at_end()) {
         const editable_line_t *el = data->active_edit_line();
         auto performer = get_autosuggestion_performer(el->text, el->position, data->history);
-        iothread_perform(performer, &autosuggest_completed);
+        static coalesced_requests_t<autosuggestion_result_t> s_autosuggestion_requests(
+            &autosuggest_completed, iothread_priority_autosuggest);
+        s_autosuggestion_requests.perform(std::move(performer));
     }
 }
 
@@ -1245,15 +1913,19 @@ static void accept_autosuggestion(bool full) {
         // Accept the autosuggestion.
         if (full) {
             // Just take the whole thing.
-            data->command_line.text = data->autosuggestion;
+            data->command_line.set_text(data->autosuggestion);
         } else {
             // Accept characters up to a word separator.
             move_word_state_machine_t state(move_word_style_punctuation);
-            for (size_t idx = data->command_line.size(); idx < data->autosuggestion.size(); idx++) {
-                wchar_t wc = data->autosuggestion.at(idx);
-                if (!state.consume_char(wc)) break;
-                data->command_line.text.push_back(wc);
+            size_t end = data->command_line.size();
+            while (end < data->autosuggestion.size() &&
+                   state.consume_char(data->autosuggestion.at(end))) {
+                end++;
             }
+            data->command_line.replace_substring(
+                data->command_line.size(), 0,
+                data->autosuggestion.substr(data->command_line.size(),
+                                            end - data->command_line.size()));
         }
         update_buff_pos(&data->command_line, data->command_line.size());
         data->command_line_changed(&data->command_line);
@@ -1358,6 +2030,34 @@ static fuzzy_match_type_t get_best_match_type(const std::vector<completion_t> &c
 /// completions after inserting it.
 ///
 /// Return true if we inserted text into the command line, false if we did not.
+/// Narrows the completions of the last tab completion to ones for the token ending at the cursor,
+/// if the command line is the same except for characters typed at the end of that token. Returns
+/// false if it is not, or if the last completions can't tell what there is to complete now.
+static bool narrow_last_completions(const editable_line_t *el, size_t token_start,
+                                    completion_request_flags_t flags,
+                                    std::vector<completion_t> *out_comps) {
+    const last_completion_t &last = data->last_completion;
+    if (last.comps.empty() || last.env_generation != env_get_generation() ||
+        last.token_start != token_start || el->position < last.position) {
+        return false;
+    }
+    const size_t added = el->position - last.position;
+    if (el->text.size() != last.text.size() + added ||
+        el->text.compare(0, last.position, last.text, 0, last.position) != 0 ||
+        el->text.compare(el->position, wcstring::npos, last.text, last.position,
+                         wcstring::npos) != 0) {
+        return false;
+    }
+
+    const wcstring old_token(last.text, token_start, last.position - token_start);
+    const wcstring new_token(el->text, token_start, el->position - token_start);
+    std::vector<completion_t> comps = last.comps;
+    // If nothing is left, the candidates may depend on the token; ask for them again.
+    if (!completions_narrow(&comps, old_token, new_token, flags) || comps.empty()) return false;
+    *out_comps = std::move(comps);
+    return true;
+}
+
 static bool handle_completions(const std::vector<completion_t> &comp,
                                bool cont_after_prefix_insertion) {
     bool done = false;
@@ -1650,7 +2350,7 @@ void reader_sanity_check() {
 /// Set the specified string as the current buffer.
 static void set_command_line_and_position(editable_line_t *el, const wcstring &new_str,
                                           size_t pos) {
-    el->text = new_str;
+    el->set_text(new_str);
     update_buff_pos(el, pos);
     data->command_line_changed(el);
     reader_super_highlight_me_plenty();
@@ -1843,7 +2543,7 @@ static void reader_set_buffer_maintaining_pager(const wcstring &b, size_t pos) {
     // Callers like to pass us pointers into ourselves, so be careful! I don't know if we can use
     // operator= with a pointer to our interior, so use an intermediate.
     size_t command_line_len = b.size();
-    data->command_line.text = b;
+    data->command_line.set_text(b);
     data->command_line_changed(&data->command_line);
 
     // Don't set a position past the command line length.
@@ -1910,12 +2610,15 @@ void reader_run_command(parser_t &parser, const wcstring &cmd) {
     term_donate();
 
     gettimeofday(&time_before, NULL);
+    proc_take_usage_since_last();
 
     parser.eval(cmd, io_chain_t(), TOP);
     job_reap(1);
+    highlight_forget_path_probes();
 
     gettimeofday(&time_after, NULL);
     set_env_cmd_duration(&time_after, &time_before);
+    set_env_cmd_usage(proc_take_usage_since_last());
 
     term_steal();
 
@@ -2107,10 +2810,28 @@ static std::function<highlight_result_t(void)> get_highlight_performer(const wcs
             pthread_setspecific(generation_count_key, (void *)(uintptr_t)generation_count));
         std::vector<highlight_spec_t> colors(text.size(), 0);
         highlight_func(text, colors, match_highlight_pos, NULL /* error */, vars);
+        // The highlighter may have stopped early, in which case the colors are incomplete.
+        if (reader_thread_job_is_stale()) return {};
         return {std::move(colors), text};
     };
 }
 
+/// Prefetch the function and completions for the command of the process under the cursor, which
+/// are likely to be needed soon, so that loading them does not stall the prompt.
+/// Returns whether cmd is a plain name, which can be autoloaded. Anything that needs expanding is
+/// left alone.
+static bool can_autoload_command(const wcstring &cmd) {
+    return !cmd.empty() && cmd.find_first_of(L"/$*?{}()~'\"\\") == wcstring::npos;
+}
+
+static void reader_prefetch_command(const editable_line_t *el) {
+    const wchar_t *begin = NULL, *end = NULL;
+    parse_util_process_extent(el->text.c_str(), el->position, &begin, &end);
+    if (!begin || !end || begin >= end) return;
+    const wcstring cmd = tok_first(wcstring(begin, end));
+    if (can_autoload_command(cmd)) complete_prefetch(cmd);
+}
+
 /// Call specified external highlighting function and then do search highlighting. Lastly, clear the
 /// background color under the cursor to avoid repaint issues on terminals where e.g. syntax
 /// highlighting maykes characters under the sursor unreadable.
@@ -2125,7 +2846,9 @@ static void reader_super_highlight_me_plenty(int match_highlight_pos_adjust, boo
     long match_highlight_pos = (long)el->position + match_highlight_pos_adjust;
     assert(match_highlight_pos >= 0);
 
+#ifndef FISH_NO_SANITY_CHECKS
     reader_sanity_check();
+#endif
 
     auto highlight_performer = get_highlight_performer(el->text, match_highlight_pos, no_io);
     if (no_io) {
@@ -2133,7 +2856,10 @@ static void reader_super_highlight_me_plenty(int match_highlight_pos_adjust, boo
         highlight_complete(highlight_performer());
     } else {
         // Highlighting including I/O proceeds in the background.
-        iothread_perform(highlight_performer, &highlight_complete);
+        static coalesced_requests_t<highlight_result_t> s_highlight_requests(
+            &highlight_complete, iothread_priority_highlight);
+        s_highlight_requests.perform(std::move(highlight_performer));
+        reader_prefetch_command(el);
     }
     highlight_search();
 
@@ -2224,6 +2950,73 @@ static bool selection_is_at_top() {
 }
 
 /// Read interactively. Read input from stdin while providing editing facilities.
+/// Returns the commands that the newest items of the given history start with most often, most
+/// frequent first.
+static wcstring_list_t most_frequent_commands(history_t &history) {
+    std::unordered_map<wcstring, size_t> counts;
+    for (size_t i = 1; i <= PRELOAD_HISTORY_ITEMS; i++) {
+        const history_item_t item = history.item_at_index(i);
+        if (item.empty()) break;
+        const wcstring cmd = tok_first(item.str());
+        if (can_autoload_command(cmd)) counts[cmd]++;
+    }
+
+    std::vector<std::pair<size_t, wcstring>> by_count;
+    for (auto &entry : counts) by_count.emplace_back(entry.second, entry.first);
+    std::sort(by_count.begin(), by_count.end(),
+              [](const std::pair<size_t, wcstring> &a, const std::pair<size_t, wcstring> &b) {
+                  return a.first != b.first ? a.first > b.first : a.second < b.second;
+              });
+    wcstring_list_t result;
+    for (size_t i = 0; i < by_count.size() && i < PRELOAD_COMMANDS; i++) {
+        result.push_back(std::move(by_count.at(i).second));
+    }
+    return result;
+}
+
+/// The commands whose completions are still to be preloaded, the next one last.
+static wcstring_list_t s_preload_commands;
+static bool s_preload_started = false;
+
+/// Returns how long the prompt waits for input before preloading, or -1 if it does not.
+static long preload_delay_ms() {
+    auto delay = env_get(L"fish_preload_delay_ms");
+    if (delay.missing_or_empty()) return PRELOAD_DELAY_DEFAULT_MS;
+    long ms = fish_wcstol(delay->as_string().c_str());
+    if (errno) return PRELOAD_DELAY_DEFAULT_MS;
+    return ms > 0 ? ms : -1;
+}
+
+/// Called when the prompt has waited a while for input. The first time, reads the $PATH
+/// directories in the background and starts reading the completion files of the most frequent
+/// commands in history. Then loads those completions, one command at a time, until the user types
+/// something, so that the first completion of the session need not wait for them.
+static void reader_preload_at_idle() {
+    if (!s_preload_started) {
+        s_preload_started = true;
+        s_preload_commands =
+            most_frequent_commands(history_t::history_with_name(history_session_id()));
+        for (const wcstring &cmd : s_preload_commands) complete_prefetch(cmd);
+        std::reverse(s_preload_commands.begin(), s_preload_commands.end());
+
+        wcstring_list_t dirs;
+        auto paths = env_get(L"PATH");
+        if (!paths.missing_or_empty()) {
+            for (const wcstring &dir : paths->as_list()) {
+                if (string_prefixes_string(L"/", dir)) dirs.push_back(dir);
+            }
+        }
+        if (!dirs.empty()) {
+            iothread_perform([dirs]() { wildcard_warm_command_dirs(dirs); });
+        }
+    }
+
+    while (!s_preload_commands.empty() && !input_common_stdin_has_input()) {
+        complete_preload(s_preload_commands.back());
+        s_preload_commands.pop_back();
+    }
+}
+
 static int read_i(void) {
     reader_push(history_session_id().c_str());
     reader_set_complete_function(&complete);
@@ -2254,16 +3047,19 @@ static int read_i(void) {
             reader_set_right_prompt(L"");
         }
 
+        input_common_set_idle_handler(preload_delay_ms(), reader_preload_at_idle);
+
         // Put buff in temporary string and clear buff, so that we can handle a call to
         // reader_set_buffer during evaluation.
         const wchar_t *tmp = reader_readline(0);
+        input_common_set_idle_handler(-1, nullptr);
 
         if (data->end_loop) {
             handle_end_loop();
         } else if (tmp) {
             const wcstring command = tmp;
             update_buff_pos(&data->command_line, 0);
-            data->command_line.text.clear();
+            data->command_line.clear();
             data->command_line_changed(&data->command_line);
             wcstring_list_t argv(1, command);
             event_fire_generic(L"fish_preexec", &argv);
@@ -2325,7 +3121,7 @@ static wchar_t unescaped_quote(const wcstring &str, size_t pos) {
 static bool text_ends_in_comment(const wcstring &text) {
     tokenizer_t tok(text.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS);
     tok_t token;
-    while (tok.next(&token)) {
+    while (tok.next_range(&token)) {
         ;  // pass
     }
     return token.type == TOK_COMMENT;
@@ -2352,16 +3148,23 @@ const wchar_t *reader_readline(int nchars) {
     data->search_buff.clear();
     data->search_mode = NO_SEARCH;
 
+    // Undo goes no further back than the command line this starts with.
+    data->command_line.clear_undo();
+
     exec_prompt();
 
     reader_super_highlight_me_plenty();
     s_reset(&data->screen, screen_reset_abandon_line);
     reader_repaint();
 
-    // Get the current terminal modes. These will be restored when the function returns.
-    if (tcgetattr(STDIN_FILENO, &old_modes) == -1 && errno == EIO) redirect_tty_output();
+    // Get the current terminal modes, unless we know them. These will be restored when the function
+    // returns.
+    const struct termios *known_modes = tty_modes_known();
+    if (!known_modes && tcgetattr(STDIN_FILENO, &old_modes) == -1 && errno == EIO) {
+        redirect_tty_output();
+    }
     // Set the new modes.
-    if (tcsetattr(0, TCSANOW, &shell_modes) == -1) {
+    if (set_tty_modes(&shell_modes) == -1) {
         if (errno == EIO) redirect_tty_output();
         wperror(L"tcsetattr");
     }
@@ -2565,10 +3368,26 @@ const wchar_t *reader_readline(int nchars) {
                     const wcstring buffcpy = wcstring(cmdsub_begin, token_end);
 
                     // fwprintf(stderr, L"Complete (%ls)\n", buffcpy.c_str());
-                    complete_flags_t complete_flags = COMPLETION_REQUEST_DEFAULT |
-                                                      COMPLETION_REQUEST_DESCRIPTIONS |
-                                                      COMPLETION_REQUEST_FUZZY_MATCH;
-                    data->complete_func(buffcpy, &comp, complete_flags);
+                    // Completions run scripts, so they can't leave the main thread; but if the
+                    // user types something while they do, give up and handle that instead. Tab
+                    // again starts over, and conditions already run are remembered.
+                    complete_flags_t complete_flags =
+                        COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS |
+                        COMPLETION_REQUEST_FUZZY_MATCH | COMPLETION_REQUEST_CANCEL_ON_INPUT;
+                    const size_t token_start = token_begin - buff;
+                    if (!narrow_last_completions(el, token_start, complete_flags, &comp)) {
+                        if (!data->complete_func(buffcpy, &comp, complete_flags)) {
+                            comp.clear();
+                            comp_empty = true;
+                            break;
+                        }
+                        data->last_completion.env_generation = env_get_generation();
+                    }
+                    last_completion_t &last = data->last_completion;
+                    last.comps = comp;
+                    last.text = el->text;
+                    last.position = el->position;
+                    last.token_start = token_start;
 
                     // Munge our completions.
                     completions_sort_and_prioritize(&comp);
@@ -3139,6 +3958,17 @@ const wchar_t *reader_readline(int nchars) {
                 data->sel_stop_pos = data->command_line.position;
                 break;
             }
+            case R_UNDO:
+            case R_REDO: {
+                editable_line_t *el = data->active_edit_line();
+                if (c == R_UNDO ? el->undo() : el->redo()) {
+                    update_buff_pos(el, el->position);
+                    data->command_line_changed(el);
+                    reader_super_highlight_me_plenty();
+                    reader_repaint_needed();
+                }
+                break;
+            }
             case R_KILL_SELECTION: {
                 bool newv = (last_char != R_KILL_SELECTION);
                 size_t start, len;
@@ -3147,6 +3977,31 @@ const wchar_t *reader_readline(int nchars) {
                 }
                 break;
             }
+            case R_BEGIN_BRACKETED_PASTE: {
+                // Insert the whole paste at once, so the command line only changes, and is only
+                // highlighted, once. Terminals send line breaks as carriage returns.
+                wcstring text = input_read_bracketed_paste();
+                std::replace(text.begin(), text.end(), L'\r', L'\n');
+
+                // If the paste goes into an open single-quoted string, make it a literal part of
+                // that string rather than code, by escaping the characters that would end it.
+                editable_line_t *el = data->active_edit_line();
+                wchar_t quote = L'\0';
+                parse_util_get_parameter_info(el->text, el->position, &quote, NULL, NULL);
+                if (quote == L'\'') {
+                    wcstring escaped;
+                    for (wchar_t wc : text) {
+                        if (wc == L'\'' || wc == L'\\') escaped.push_back(L'\\');
+                        escaped.push_back(wc);
+                    }
+                    text.swap(escaped);
+                }
+
+                insert_string(el, text);
+                // End paging upon inserting into the normal command line.
+                if (el == &data->command_line) clear_pager();
+                break;
+            }
             case R_FORWARD_JUMP: {
                 editable_line_t *el = data->active_edit_line();
                 wchar_t target = input_function_pop_arg();
@@ -3224,6 +4079,9 @@ const wchar_t *reader_readline(int nchars) {
 
     ignore_result(write(STDOUT_FILENO, "\n", 1));
 
+    // The prompt is no longer shown, so an asynchronous run of it is of no use.
+    s_prompt_generation++;
+
     // Ensure we have no pager contents when we exit.
     if (!data->pager.empty()) {
         // Clear to end of screen to erase the pager contents.
@@ -3233,7 +4091,14 @@ const wchar_t *reader_readline(int nchars) {
     }
 
     if (!reader_exit_forced()) {
-        if (tcsetattr(0, TCSANOW, &old_modes) == -1) {
+        int result;
+        if (known_modes) {
+            result = set_tty_modes(known_modes);
+        } else {
+            result = tcsetattr(STDIN_FILENO, TCSANOW, &old_modes);
+            reader_forget_tty_modes();
+        }
+        if (result == -1) {
             if (errno == EIO) redirect_tty_output();
             wperror(L"tcsetattr");  // return to previous mode
         }
@@ -3258,83 +4123,245 @@ int reader_has_pager_contents() {
     return !data->current_page_rendering.screen_data.empty();
 }
 
-/// Read non-interactively.  Read input from stdin without displaying the prompt, using syntax
-/// highlighting. This is used for reading scripts and init files.
-static int read_ni(int fd, const io_chain_t &io) {
-    parser_t &parser = parser_t::principal_parser();
-    FILE *in_stream;
-    wchar_t *buff = 0;
+/// Files at least this large are mapped into memory to read them.
+#define READ_NI_MMAP_MIN_SIZE 4096
+
+/// Read the contents of the regular file fd by mapping it into memory, decoding them straight into
+/// a string of the right size. This saves copying them through stdio and a growing buffer, which is
+/// how scripts and autoloaded function libraries are otherwise read. Returns false, without
+/// reading anything, if the file can not be mapped, so it can be read the usual way.
+static bool read_ni_mapped(int fd, wcstring *out) {
+    struct stat buf;
+    if (fstat(fd, &buf) == -1 || !S_ISREG(buf.st_mode)) return false;
+    // Read from the current offset, like reading would. A script read from stdin shares the offset
+    // with the commands it runs, so leave it at the end afterwards.
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0 || buf.st_size - start < READ_NI_MMAP_MIN_SIZE) return false;
+    size_t len = (size_t)buf.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return false;
+    *out = str2wcstring(static_cast<const char *>(map) + start, len - (size_t)start);
+    munmap(map, len);
+    lseek(fd, len, SEEK_SET);
+    return true;
+}
+
+/// Read the contents of fd through stdio, then close it. Returns false if fd could not be opened
+/// as a stream, and sets *read_error if reading or closing it failed. Nothing is returned of a file
+/// that could not be read completely.
+static bool read_ni_stream(int fd, wcstring *out, bool *read_error) {
+    FILE *in_stream = fdopen(fd, "r");
+    if (in_stream == 0) return false;
+
     std::vector<char> acc;
+    while (!feof(in_stream)) {
+        char buff[4096];
+        size_t c = fread(buff, 1, 4096, in_stream);
+
+        if (ferror(in_stream)) {
+            if (errno == EINTR) {
+                // We got a signal, just keep going. Be sure that we call insert() below because
+                // we may get data as well as EINTR.
+                clearerr(in_stream);
+            } else if ((errno == EAGAIN || errno == EWOULDBLOCK) && make_fd_blocking(fd) == 0) {
+                // We succeeded in making the fd blocking, keep going.
+                clearerr(in_stream);
+            } else {
+                // Fatal error.
+                debug(1, _(L"Error while reading from file descriptor"));
+                // Reset buffer on error. We won't evaluate incomplete files.
+                acc.clear();
+                break;
+            }
+        }
 
-    int des = (fd == STDIN_FILENO ? dup(STDIN_FILENO) : fd);
-    int res = 0;
+        acc.insert(acc.end(), buff, buff + c);
+    }
 
-    if (des == -1) {
-        wperror(L"dup");
-        return 1;
+    *out = acc.empty() ? wcstring() : str2wcstring(&acc.at(0), acc.size());
+
+    if (fclose(in_stream)) {
+        debug(1, _(L"Error while closing input stream"));
+        wperror(L"fclose");
+        *read_error = true;
     }
+    return true;
+}
 
-    in_stream = fdopen(des, "r");
-    if (in_stream != 0) {
-        while (!feof(in_stream)) {
-            char buff[4096];
-            size_t c = fread(buff, 1, 4096, in_stream);
-
-            if (ferror(in_stream)) {
-                if (errno == EINTR) {
-                    // We got a signal, just keep going. Be sure that we call insert() below because
-                    // we may get data as well as EINTR.
-                    clearerr(in_stream);
-                } else if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
-                           make_fd_blocking(des) == 0) {
-                    // We succeeded in making the fd blocking, keep going.
-                    clearerr(in_stream);
-                } else {
-                    // Fatal error.
-                    debug(1, _(L"Error while reading from file descriptor"));
-                    // Reset buffer on error. We won't evaluate incomplete files.
-                    acc.clear();
-                    break;
-                }
-            }
+/// A script read in streaming mode is run in batches of jobs, started whenever at least this much
+/// of it has been read since the last batch.
+#define READ_NI_STREAM_BATCH_SIZE (64 * 1024)
+
+/// Return the length of the leading part of src that holds complete top-level jobs. The last job is
+/// never included, as the rest of the script may continue it. All of src is returned if it has a
+/// syntax error, so that the error is reported.
+static size_t read_ni_complete_jobs_length(const wcstring &src) {
+    parse_node_tree_t tree;
+    // Unterminated blocks and tokens are just jobs that continue in the part not yet read.
+    if (!parse_tree_from_string(src,
+                                parse_flag_leave_unterminated | parse_flag_accept_incomplete_tokens,
+                                &tree, NULL)) {
+        return src.size();
+    }
+    if (tree.empty()) return 0;
 
-            acc.insert(acc.end(), buff, buff + c);
+    size_t last_job_start = 0;
+    const parse_node_t *list = &tree.at(0);
+    while (const parse_node_t *job = tree.next_node_in_node_list(*list, symbol_job, &list)) {
+        if (job->has_source()) last_job_start = job->source_start;
+    }
+    return last_job_start;
+}
+
+/// Run the script text src, which follows first_line lines of the script. If it has a syntax error,
+/// run only the lines before the one with the error, if they are complete by themselves, and report
+/// the error. Returns whether all of src was run.
+static bool read_ni_eval(const wcstring &src, const io_chain_t &io, int first_line) {
+    parser_t &parser = parser_t::principal_parser();
+    parse_error_list_t errors;
+    parse_node_tree_t tree;
+    if (!parse_util_detect_errors(src, &errors, false /* do not accept incomplete */, &tree)) {
+        parser.eval(src, io, TOP, std::move(tree), first_line);
+        return true;
+    }
+
+    size_t error_start = errors.at(0).source_start, before_len = 0;
+    if (error_start != SOURCE_LOCATION_UNKNOWN && error_start > 0 && error_start <= src.size()) {
+        before_len = src.rfind(L'\n', error_start - 1) + 1;  // 0 if there is no newline
+    }
+    wcstring before = src.substr(0, before_len);
+    parse_error_list_t before_errors;
+    parse_node_tree_t before_tree;
+    if (before_len > 0 && !parse_util_detect_errors(before, &before_errors, false, &before_tree)) {
+        parser.eval(before, io, TOP, std::move(before_tree), first_line);
+        first_line += std::count(before.begin(), before.end(), L'\n');
+        for (parse_error_t &error : errors) {
+            if (error.source_start != SOURCE_LOCATION_UNKNOWN) error.source_start -= before_len;
         }
+    } else {
+        before_len = 0;
+    }
+
+    wcstring sb;
+    parser.get_backtrace(src.substr(before_len), errors, sb, first_line);
+    fwprintf(stderr, L"%ls", sb.c_str());
+    return false;
+}
 
-        wcstring str = acc.empty() ? wcstring() : str2wcstring(&acc.at(0), acc.size());
-        acc.clear();
+/// Read the script in fd and run its top-level jobs as they are read, instead of reading and
+/// parsing all of it first, then close fd. Only the text of the jobs not yet run is kept, so a
+/// large generated script starts running at once and its parse tree is never resident in full.
+/// Unlike read_ni, jobs before a syntax error have already run when it is reported.
+static int read_ni_streaming(int fd, const io_chain_t &io) {
+    parser_t &parser = parser_t::principal_parser();
+    std::vector<char> buff(READ_NI_STREAM_BATCH_SIZE);
+    // Input not yet decoded, because it does not end in a newline. Decoding whole lines only
+    // never splits a multibyte character.
+    std::string partial_line;
+    // Decoded text of the jobs not yet run, and the number of lines of the script before it.
+    wcstring pending;
+    int first_line = 0;
+    // Jobs are looked for again once pending reaches this size. It doubles while a single job keeps
+    // growing, like a long function definition, so the job is not parsed over and over.
+    size_t batch_size = READ_NI_STREAM_BATCH_SIZE;
+    bool at_start = true, at_eof = false;
+    int res = 0;
 
-        if (fclose(in_stream)) {
-            debug(1, _(L"Error while closing input stream"));
-            wperror(L"fclose");
+    while (!at_eof) {
+        ssize_t amt = read(fd, &buff.at(0), buff.size());
+        if (amt < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && make_fd_blocking(fd) == 0) continue;
+            // We won't evaluate the incomplete rest of the script.
+            debug(1, _(L"Error while reading from file descriptor"));
+            wperror(L"read");
             res = 1;
+            break;
         }
+        at_eof = (amt == 0);
+        partial_line.append(&buff.at(0), (size_t)amt);
+
+        // This is 0 if there is no newline yet.
+        size_t decode_len = at_eof ? partial_line.size() : partial_line.rfind('\n') + 1;
+        pending.append(str2wcstring(partial_line.data(), decode_len));
+        partial_line.erase(0, decode_len);
 
         // Swallow a BOM (issue #1518).
-        if (!str.empty() && str.at(0) == UTF8_BOM_WCHAR) {
-            str.erase(0, 1);
+        if (at_start && !pending.empty()) {
+            if (pending.at(0) == UTF8_BOM_WCHAR) pending.erase(0, 1);
+            at_start = false;
         }
-
-        parse_error_list_t errors;
-        parse_node_tree_t tree;
-        if (!parse_util_detect_errors(str, &errors, false /* do not accept incomplete */, &tree)) {
-            parser.eval(str, io, TOP, std::move(tree));
-        } else {
-            wcstring sb;
-            parser.get_backtrace(str, errors, sb);
-            fwprintf(stderr, L"%ls", sb.c_str());
-            res = 1;
+        if (!at_eof && pending.size() < batch_size) continue;
+
+        size_t run_len = at_eof ? pending.size() : read_ni_complete_jobs_length(pending);
+        if (run_len > 0) {
+            const wcstring src = pending.substr(0, run_len);
+            if (!read_ni_eval(src, io, first_line)) {
+                // Whatever follows a syntax error is not run.
+                res = 1;
+                break;
+            }
+            first_line += std::count(src.begin(), src.end(), L'\n');
+            pending.erase(0, run_len);
         }
-    } else {
+        batch_size = std::max((size_t)READ_NI_STREAM_BATCH_SIZE, 2 * pending.size());
+        if (shell_is_exiting() || parser.is_cancelling()) break;
+    }
+
+    close(fd);
+    return res;
+}
+
+/// Read non-interactively.  Read input from stdin without displaying the prompt, using syntax
+/// highlighting. This is used for reading scripts and init files.
+static int read_ni(int fd, const io_chain_t &io, const wchar_t *path, bool streaming) {
+    parser_t &parser = parser_t::principal_parser();
+    int des = (fd == STDIN_FILENO ? dup(STDIN_FILENO) : fd);
+    int res = 0;
+
+    if (des == -1) {
+        wperror(L"dup");
+        return 1;
+    }
+
+    if (streaming) return read_ni_streaming(des, io);
+
+    wcstring str;
+    bool read_error = false;
+    if (read_ni_mapped(des, &str)) {
+        close(des);
+    } else if (!read_ni_stream(des, &str, &read_error)) {
         debug(1, _(L"Error while opening input stream"));
         wperror(L"fdopen");
-        free(buff);
+        return 1;
+    }
+    if (read_error) res = 1;
+
+    // Swallow a BOM (issue #1518).
+    if (!str.empty() && str.at(0) == UTF8_BOM_WCHAR) {
+        str.erase(0, 1);
+    }
+
+    parse_error_list_t errors;
+    parse_node_tree_t tree;
+    parser_test_error_bits_t errs;
+    if (path) {
+        errs = parse_util_detect_errors_in_file(path, str, &errors, &tree);
+    } else {
+        errs = parse_util_detect_errors(str, &errors, false /* do not accept incomplete */, &tree);
+    }
+    if (!errs) {
+        parser.eval(str, io, TOP, std::move(tree));
+    } else {
+        wcstring sb;
+        parser.get_backtrace(str, errors, sb);
+        fwprintf(stderr, L"%ls", sb.c_str());
         res = 1;
     }
     return res;
 }
 
-int reader_read(int fd, const io_chain_t &io) {
+int reader_read(int fd, const io_chain_t &io, const wchar_t *path, bool streaming) {
     int res;
 
     // If reader_read is called recursively through the '.' builtin, we need to preserve
@@ -3356,7 +4383,7 @@ int reader_read(int fd, const io_chain_t &io) {
     }
     proc_push_interactive(inter);
 
-    res = shell_is_interactive() ? read_i() : read_ni(fd, io);
+    res = shell_is_interactive() ? read_i() : read_ni(fd, io, path, streaming);
 
     // If the exit command was called in a script, only exit the script, not the program.
     if (data) data->end_loop = 0;
@@ -6,6 +6,7 @@
 
 #include <stddef.h>
 
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -18,10 +19,39 @@ class history_t;
 class env_vars_snapshot_t;
 class io_chain_t;
 
+/// The most memory the undo history of a command line may use, approximately. The oldest edits are
+/// forgotten to stay under it, except that the most recent one is always kept.
+#define UNDO_MEMORY_LIMIT (1024 * 1024)
+
+/// A change to an editable_line_t, kept so that it can be undone. Only the text that changed is
+/// stored, so the undo history of a long command line takes little more memory than its edits.
+struct line_edit_t {
+    /// Where in the line the edit happened.
+    size_t offset;
+    /// The text the edit removed, and the text it put in its place.
+    wcstring removed;
+    wcstring inserted;
+    /// The cursor position before the edit.
+    size_t cursor;
+};
+
 /// Helper class for storing a command line.
 class editable_line_t {
+    /// Edits that can be undone, oldest first.
+    std::deque<line_edit_t> undo_edits;
+    /// Edits that have been undone and can be redone, most recently undone last.
+    std::vector<line_edit_t> redo_edits;
+    /// Approximately how much memory undo_edits and redo_edits use.
+    size_t edit_memory;
+    /// Whether the next insertion or deletion may be merged into the last edit, so that typing a
+    /// word or deleting characters one at a time is undone at once.
+    bool may_merge_edit;
+
+    /// Record an edit about to be made, and make it.
+    void record_edit(line_edit_t edit, bool mergeable);
+
    public:
-    /// The command line.
+    /// The command line. Change it through the functions below, so the change can be undone.
     wcstring text;
     /// The current position of the cursor in the command line.
     size_t position;
@@ -33,21 +63,48 @@ class editable_line_t {
 
     bool empty() const { return text.empty(); }
 
+    /// Empty the line and forget its undo history.
     void clear() {
         text.clear();
         position = 0;
+        clear_undo();
     }
 
     wchar_t at(size_t idx) { return text.at(idx); }
 
-    editable_line_t() : text(), position(0) {}
+    editable_line_t() : edit_memory(0), may_merge_edit(false), text(), position(0) {}
 
     /// Inserts a substring of str given by start, len at the cursor position.
     void insert_string(const wcstring &str, size_t start = 0, size_t len = wcstring::npos);
+
+    /// Remove length characters at offset. Characters deleted one at a time are undone together.
+    /// The cursor is left alone.
+    void erase_substring(size_t offset, size_t length);
+
+    /// Replace length characters at offset with replacement. The cursor is left alone.
+    void replace_substring(size_t offset, size_t length, const wcstring &replacement);
+
+    /// Replace the whole line, recording only the part that differs. The cursor is left alone.
+    void set_text(const wcstring &new_text);
+
+    /// Revert the most recent edit that has not been undone, putting the cursor back where it was.
+    /// Returns false if there is none.
+    bool undo();
+
+    /// Make the most recently undone edit again. Returns false if there is none.
+    bool redo();
+
+    /// Forget the undo history, as when the line is reused for a new command.
+    void clear_undo();
+
+    /// Returns the number of edits that can be undone.
+    size_t undo_count() const { return undo_edits.size(); }
 };
 
-/// Read commands from \c fd until encountering EOF.
-int reader_read(int fd, const io_chain_t &io);
+/// Read commands from \c fd until encountering EOF. If \c path is not NULL, it is the path of the
+/// script being read, and its parse tree may be cached on disk. If \c streaming is set, a script is
+/// run job by job as it is read rather than once it has been read and checked in full.
+int reader_read(int fd, const io_chain_t &io, const wchar_t *path = NULL, bool streaming = false);
 
 /// Tell the shell that it should exit after the currently running command finishes.
 void reader_exit(int do_exit, int force);
@@ -64,6 +121,10 @@ void reader_destroy();
 /// Restore the term mode at startup.
 void restore_term_mode();
 
+/// Forget which terminal modes the reader last set, because something else may have changed them
+/// or the window size since, like a job that was given the terminal.
+void reader_forget_tty_modes();
+
 /// Returns the filename of the file currently read.
 const wchar_t *reader_current_filename();
 
@@ -157,7 +218,10 @@ void reader_pop();
 ///
 /// - The command to be completed as a null terminated array of wchar_t
 /// - An array_list_t in which completions will be inserted.
-typedef void (*complete_function_t)(const wcstring &, std::vector<completion_t> *,
+/// - The flags of the request.
+///
+/// It returns false if it was cancelled before finding all completions.
+typedef bool (*complete_function_t)(const wcstring &, std::vector<completion_t> *,
                                     completion_request_flags_t);
 void reader_set_complete_function(complete_function_t);
 
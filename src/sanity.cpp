@@ -20,10 +20,12 @@ void sanity_lose() {
 }
 
 bool sanity_check() {
+#ifndef FISH_NO_SANITY_CHECKS
     if (!insane && shell_is_interactive()) history_sanity_check();
     if (!insane) reader_sanity_check();
     if (!insane) kill_sanity_check();
     if (!insane) proc_sanity_check();
+#endif
     return insane;
 }
 
@@ -5,7 +5,9 @@
 /// Call this function to tell the program it is not in a sane state.
 void sanity_lose();
 
-/// Perform sanity checks, return 1 if program is in a sane state 0 otherwise.
+/// Perform sanity checks, return 1 if program is in a sane state 0 otherwise. The checks are left
+/// out of builds configured with FISH_NO_SANITY_CHECKS, which only report earlier calls to
+/// sanity_lose.
 bool sanity_check();
 
 /// Try and determine if ptr is a valid pointer. If not, loose sanity.
@@ -36,6 +36,7 @@
 #include "env.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "highlight.h"
+#include "lru.h"
 #include "output.h"
 #include "pager.h"
 #include "screen.h"
@@ -50,7 +51,6 @@
 /// A helper value for an invalid location.
 #define INVALID_LOCATION (screen_data_t::cursor_t(-1, -1))
 
-enum prompt_type_t { UNKNOWN_PROMPT, LEFT_PROMPT, RIGHT_PROMPT };
 
 static void invalidate_soft_wrap(screen_t *scr);
 
@@ -83,18 +83,6 @@ class scoped_buffer_t {
 // Note this is deliberately exported so that init_curses can clear it.
 cached_esc_sequences_t cached_esc_sequences;
 
-/// Tests if the specified narrow character sequence is present at the specified position of the
-/// specified wide character string. All of \c seq must match, but str may be longer than seq.
-static size_t try_sequence(const char *seq, const wchar_t *str) {
-    for (size_t i = 0;; i++) {
-        if (!seq[i]) return i;
-        if (seq[i] != str[i]) return 0;
-    }
-
-    DIE("unexpectedly fell off end of try_sequence()");
-    return 0;  // this should never be executed
-}
-
 /// Returns the number of columns left until the next tab stop, given the current cursor postion.
 static size_t next_tab_stop(size_t current_line_width) {
     // Assume tab stops every 8 characters if undefined.
@@ -207,60 +195,105 @@ static bool is_csi_style_escape_seq(const wchar_t *code, size_t *resulting_lengt
     return true;
 }
 
-/// Detect whether the escape sequence sets foreground/background color. Note that 24-bit color
-/// sequences are detected by `is_csi_style_escape_seq()` if they use the ANSI X3.64 pattern for
-/// such sequences. This function only handles those escape sequences for setting color that rely on
-/// the terminfo definition and which might use a different pattern.
-static bool is_color_escape_seq(const wchar_t *code, size_t *resulting_length) {
-    if (!cur_term) return false;
-
-    // Detect these terminfo color escapes with parameter value up to max_colors, all of which
-    // don't move the cursor.
-    char *const esc[] = {
-        set_a_foreground, set_a_background, set_foreground, set_background,
+/// The most colors whose terminfo sequences we recognize. Terminals with direct color claim
+/// millions, but those sequences are caught as CSI-style ones anyway.
+#define ESCAPE_TABLE_MAX_COLORS 256
+
+namespace {
+/// The escape sequences described by terminfo that may appear in a prompt: those setting colors
+/// and other visual attributes, none of which move the cursor. They are kept in a trie, so the one
+/// at the start of a string is found in a single pass over it, instead of asking tparm for every
+/// color of every capability.
+class terminfo_escape_table_t {
+    typedef std::pair<wchar_t, size_t> child_t;
+    struct node_t {
+        /// The children of the node, sorted by character.
+        std::vector<child_t> children;
+        /// Whether a sequence ends here.
+        bool terminal = false;
     };
-
-    for (size_t p = 0; p < sizeof esc / sizeof *esc; p++) {
-        if (!esc[p]) continue;
-
-        for (int k = 0; k < max_colors; k++) {
-            size_t esc_seq_len = try_sequence(tparm(esc[p], k), code);
-            if (esc_seq_len) {
-                *resulting_length = esc_seq_len;
-                return true;
+    std::vector<node_t> nodes;
+    bool built = false;
+
+    static bool child_before(const child_t &child, wchar_t wc) { return child.first < wc; }
+
+    void add(const char *seq) {
+        if (seq == NULL || seq[0] == '\0') return;
+        size_t node = 0;
+        for (size_t i = 0; seq[i]; i++) {
+            const wchar_t c = (unsigned char)seq[i];
+            auto &children = nodes[node].children;
+            auto where = std::lower_bound(children.begin(), children.end(), c, child_before);
+            if (where != children.end() && where->first == c) {
+                node = where->second;
+            } else {
+                size_t child = nodes.size();
+                children.insert(where, std::make_pair(c, child));
+                nodes.push_back(node_t());
+                node = child;
             }
         }
+        nodes[node].terminal = true;
     }
 
-    return false;
-}
+    void build() {
+        nodes.assign(1, node_t());
+        built = true;
+        if (!cur_term) return;
 
-/// Detect whether the escape sequence sets one of the terminal attributes that affects how text is
-/// displayed other than the color.
-static bool is_visual_escape_seq(const wchar_t *code, size_t *resulting_length) {
-    if (!cur_term) return false;
-    char *const esc2[] = {
-        enter_bold_mode,      exit_attribute_mode,    enter_underline_mode,  exit_underline_mode,
-        enter_standout_mode,  exit_standout_mode,     flash_screen,          enter_subscript_mode,
-        exit_subscript_mode,  enter_superscript_mode, exit_superscript_mode, enter_blink_mode,
-        enter_italics_mode,   exit_italics_mode,      enter_reverse_mode,    enter_shadow_mode,
-        exit_shadow_mode,     enter_standout_mode,    exit_standout_mode,    enter_secure_mode,
-        enter_dim_mode,       enter_blink_mode,       enter_protected_mode,  enter_alt_charset_mode,
-        exit_alt_charset_mode};
-
-    for (size_t p = 0; p < sizeof esc2 / sizeof *esc2; p++) {
-        if (!esc2[p]) continue;
-        // Test both padded and unpadded version, just to be safe. Most versions of tparm don't
-        // actually seem to do anything these days.
-        size_t esc_seq_len = maxi(try_sequence(tparm(esc2[p]), code), try_sequence(esc2[p], code));
-        if (esc_seq_len) {
-            *resulting_length = esc_seq_len;
-            return true;
+        char *const color_caps[] = {
+            set_a_foreground, set_a_background, set_foreground, set_background,
+        };
+        const int color_count = mini((int)max_colors, ESCAPE_TABLE_MAX_COLORS);
+        for (char *cap : color_caps) {
+            if (!cap) continue;
+            for (int k = 0; k < color_count; k++) add(tparm(cap, k));
+        }
+
+        char *const visual_caps[] = {
+            enter_bold_mode,       exit_attribute_mode,    enter_underline_mode,
+            exit_underline_mode,   enter_standout_mode,    exit_standout_mode,
+            flash_screen,          enter_subscript_mode,   exit_subscript_mode,
+            enter_superscript_mode, exit_superscript_mode, enter_blink_mode,
+            enter_italics_mode,    exit_italics_mode,      enter_reverse_mode,
+            enter_shadow_mode,     exit_shadow_mode,       enter_secure_mode,
+            enter_dim_mode,        enter_protected_mode,   enter_alt_charset_mode,
+            exit_alt_charset_mode};
+        for (char *cap : visual_caps) {
+            if (!cap) continue;
+            // Add both the padded and unpadded version, just to be safe. Most versions of tparm
+            // don't actually seem to do anything these days.
+            add(tparm(cap));
+            add(cap);
         }
     }
 
-    return false;
-}
+   public:
+    /// Returns the length of the longest sequence at the start of \p code, or 0 if there is none.
+    size_t match(const wchar_t *code) {
+        if (!built) build();
+        size_t node = 0, result = 0;
+        for (size_t i = 0; code[i]; i++) {
+            const auto &children = nodes[node].children;
+            auto where = std::lower_bound(children.begin(), children.end(), code[i], child_before);
+            if (where == children.end() || where->first != code[i]) break;
+            node = where->second;
+            if (nodes[node].terminal) result = i + 1;
+        }
+        return result;
+    }
+
+    void clear() {
+        nodes.clear();
+        built = false;
+    }
+};
+}  // namespace
+
+static terminfo_escape_table_t s_terminfo_escapes;
+
+/// Counters for cached_esc_sequences and s_prompt_layouts.
+static screen_cache_stats_t s_screen_cache_stats;
 
 /// Returns the number of characters in the escape code starting at 'code'. We only handle sequences
 /// that begin with \e. If it doesn't we return zero. We also return zero if we don't recognize the
@@ -270,14 +303,34 @@ size_t escape_code_length(const wchar_t *code) {
     if (*code != L'\e') return 0;
 
     size_t esc_seq_len = cached_esc_sequences.find_entry(code);
-    if (esc_seq_len) return esc_seq_len;
-
-    bool found = is_color_escape_seq(code, &esc_seq_len);
-    if (!found) found = is_visual_escape_seq(code, &esc_seq_len);
-    if (!found) found = is_screen_name_escape_seq(code, &esc_seq_len);
-    if (!found) found = is_iterm2_escape_seq(code, &esc_seq_len);
-    if (!found) found = is_single_byte_escape_seq(code, &esc_seq_len);
-    if (!found) found = is_csi_style_escape_seq(code, &esc_seq_len);
+    if (esc_seq_len) {
+        s_screen_cache_stats.escape_hits++;
+        return esc_seq_len;
+    }
+    s_screen_cache_stats.escape_misses++;
+
+    // Sequences from terminfo come first, then the generic patterns, picked by the character after
+    // the escape.
+    esc_seq_len = s_terminfo_escapes.match(code);
+    bool found = esc_seq_len > 0;
+    if (!found) {
+        switch (code[1]) {
+            case L'k': {
+                found = is_screen_name_escape_seq(code, &esc_seq_len);
+                break;
+            }
+            case L']': {
+                found = is_iterm2_escape_seq(code, &esc_seq_len);
+                break;
+            }
+            case L'[': {
+                found = is_single_byte_escape_seq(code, &esc_seq_len) ||
+                        is_csi_style_escape_seq(code, &esc_seq_len);
+                break;
+            }
+            default: { break; }
+        }
+    }
     if (!found) found = is_two_byte_escape_seq(code, &esc_seq_len);
     if (found) cached_esc_sequences.add_entry(wcstring(code, esc_seq_len));
     return esc_seq_len;
@@ -290,26 +343,35 @@ struct prompt_layout_t {
     size_t last_line_width;  // width of the last line
 };
 
-// These are used by `calc_prompt_layout()` to avoid redundant calculations.
-static const wchar_t *cached_left_prompt = wcsdup(L"");
-static const wchar_t *cached_right_prompt = wcsdup(L"");
-static prompt_layout_t cached_left_prompt_layout = {1, 0, 0};
-static prompt_layout_t cached_right_prompt_layout = {1, 0, 0};
+/// The most prompt layouts we remember.
+#define PROMPT_LAYOUT_CACHE_SIZE 16
+
+namespace {
+/// Layouts of recent prompts, keyed by the prompt. Most repaints show a prompt seen before: the
+/// same left and right prompts, or ones alternating between a few states.
+class prompt_layout_cache_t : public lru_cache_t<prompt_layout_cache_t, prompt_layout_t> {
+    typedef lru_cache_t<prompt_layout_cache_t, prompt_layout_t> super;
+
+   public:
+    prompt_layout_cache_t() : super(PROMPT_LAYOUT_CACHE_SIZE) {}
+};
+}  // namespace
+
+static prompt_layout_cache_t s_prompt_layouts;
 
 /// Calculate layout information for the given prompt. Does some clever magic to detect common
 /// escape sequences that may be embeded in a prompt, such as those to set visual attributes.
-static prompt_layout_t calc_prompt_layout(const wchar_t *prompt, prompt_type_t which_prompt) {
-    if (which_prompt == LEFT_PROMPT && wcscmp(cached_left_prompt, prompt) == 0) {
-        return cached_left_prompt_layout;
-    }
-    if (which_prompt == RIGHT_PROMPT && wcscmp(cached_right_prompt, prompt) == 0) {
-        return cached_right_prompt_layout;
+static prompt_layout_t calc_prompt_layout(const wcstring &prompt) {
+    if (const prompt_layout_t *cached = s_prompt_layouts.get(prompt)) {
+        s_screen_cache_stats.prompt_hits++;
+        return *cached;
     }
+    s_screen_cache_stats.prompt_misses++;
 
     prompt_layout_t prompt_layout = {1, 0, 0};
     size_t current_line_width = 0;
 
-    for (int j = 0; prompt[j]; j++) {
+    for (size_t j = 0; j < prompt.size(); j++) {
         if (prompt[j] == L'\e') {
             // This is the start of an escape code. Skip over it if it's at least one char long.
             size_t len = escape_code_length(&prompt[j]);
@@ -333,26 +395,30 @@ static prompt_layout_t calc_prompt_layout(const wchar_t *prompt, prompt_type_t w
     }
 
     prompt_layout.last_line_width = current_line_width;
-    if (which_prompt == LEFT_PROMPT) {
-        free((void *)cached_left_prompt);
-        cached_left_prompt = wcsdup(prompt);
-        cached_left_prompt_layout = prompt_layout;
-    }
-    if (which_prompt == RIGHT_PROMPT) {
-        free((void *)cached_right_prompt);
-        cached_right_prompt = wcsdup(prompt);
-        cached_right_prompt_layout = prompt_layout;
-    }
+    s_prompt_layouts.insert(prompt, prompt_layout);
     return prompt_layout;
 }
 
+void screen_forget_terminal_sequences() {
+    cached_esc_sequences.clear();
+    s_terminfo_escapes.clear();
+    s_prompt_layouts.evict_all_nodes();
+}
+
+screen_cache_stats_t screen_cache_stats() {
+    screen_cache_stats_t stats = s_screen_cache_stats;
+    stats.escape_entries = cached_esc_sequences.size();
+    stats.prompt_entries = s_prompt_layouts.size();
+    return stats;
+}
+
 static size_t calc_prompt_lines(const wcstring &prompt) {
     // Hack for the common case where there's no newline at all. I don't know if a newline can
     // appear in an escape sequence, so if we detect a newline we have to defer to
     // calc_prompt_width_and_lines.
     size_t result = 1;
     if (prompt.find(L'\n') != wcstring::npos || prompt.find(L'\f') != wcstring::npos) {
-        result = calc_prompt_layout(prompt.c_str(), UNKNOWN_PROMPT).line_count;
+        result = calc_prompt_layout(prompt).line_count;
     }
     return result;
 }
@@ -417,7 +483,7 @@ static void s_check_status(screen_t *s) {
         // move to the beginning of the line, reset the modelled screen contents, and then set the
         // modeled cursor y-pos to its earlier value.
         int prev_line = s->actual.cursor.y;
-        write_loop(STDOUT_FILENO, "\r", 1);
+        output_write_bytes("\r", 1);
         s_reset(s, screen_reset_current_line_and_prompt);
         s->actual.cursor.y = prev_line;
     }
@@ -625,6 +691,82 @@ static size_t line_shared_prefix(const line_t &a, const line_t &b) {
     return idx;
 }
 
+/// Returns the length of the "shared suffix" of the two lines after their first \p prefix
+/// characters, which is the run of matching text and colors at their ends.
+static size_t line_shared_suffix(const line_t &a, const line_t &b, size_t prefix) {
+    size_t len = 0, max = std::min(a.size(), b.size()) - prefix;
+    while (len < max) {
+        size_t aidx = a.size() - len - 1, bidx = b.size() - len - 1;
+        if (a.char_at(aidx) != b.char_at(bidx) || a.color_at(aidx) != b.color_at(bidx)) break;
+        len++;
+    }
+    return len;
+}
+
+/// Returns whether every character in the line takes exactly one column.
+static bool line_is_single_width(const line_t &line) {
+    for (size_t idx = 0; idx < line.size(); idx++) {
+        if (fish_wcwidth(line.char_at(idx)) != 1) return false;
+    }
+    return true;
+}
+
+/// Returns the sequence that inserts (if \p count is positive) or deletes (if it is negative)
+/// characters at the cursor, shifting the rest of the line. Returns an empty string if the terminal
+/// can't.
+static std::string shift_line_sequence(int count) {
+    std::string result;
+    if (count == 0 || !cur_term) return result;
+    const char *single = count > 0 ? insert_character : delete_character;
+    char *multi = count > 0 ? parm_ich : parm_dch;
+    size_t steps = (size_t)abs(count);
+    bool have_single = single != NULL && single[0] != '\0';
+    bool have_multi = multi != NULL && multi[0] != '\0';
+    if (have_multi && (!have_single || steps * strlen(single) > strlen(multi))) {
+        result = tparm(multi, (int)steps);
+    } else if (have_single) {
+        for (size_t i = 0; i < steps; i++) result.append(single);
+    }
+    return result;
+}
+
+/// Checks whether line \p i can be redrawn by shifting the characters at its end that are already
+/// on the screen into place, instead of writing them again. This is what makes inserting or
+/// deleting in the middle of a long command line cheap. If so, returns the index in the desired
+/// line where writing can stop in \p out_write_end, and the sequence that shifts the rest (which
+/// may be empty if nothing moves) in \p out_shift.
+static bool line_can_shift(const screen_t *scr, size_t i, size_t start_pos,
+                           size_t right_prompt_width, int screen_width, size_t *out_write_end,
+                           std::string *out_shift) {
+    const line_t &o_line = scr->desired.line(i);
+    const line_t &s_line = scr->actual.line(i);
+
+    // Wrapped lines and right prompt changes are left to the normal redraw.
+    if (o_line.is_soft_wrapped || s_line.is_soft_wrapped) return false;
+    if (i > 0 && scr->desired.line(i - 1).is_soft_wrapped) return false;
+    if (i == 0 && right_prompt_width != scr->last_right_prompt_width) return false;
+    const size_t width = (size_t)screen_width;
+    if (o_line.size() >= width || s_line.size() >= width) return false;
+
+    // Characters stand for columns from here on.
+    if (!line_is_single_width(o_line) || !line_is_single_width(s_line)) return false;
+
+    const size_t prefix = line_shared_prefix(o_line, s_line);
+    if (prefix < start_pos) return false;
+    const size_t suffix = line_shared_suffix(o_line, s_line, prefix);
+    if (suffix == 0) return false;
+
+    const int shift = (int)o_line.size() - (int)s_line.size();
+    std::string sequence = shift_line_sequence(shift);
+    if (shift != 0 && sequence.empty()) return false;
+    // Writing the suffix again takes at least a byte per character.
+    if (sequence.size() >= suffix) return false;
+
+    *out_write_end = o_line.size() - suffix;
+    *out_shift = std::move(sequence);
+    return true;
+}
+
 // We are about to output one or more characters onto the screen at the given x, y. If we are at the
 // end of previous line, and the previous line is marked as soft wrapping, then tweak the screen so
 // we believe we are already in the target position. This lets the terminal take care of wrapping,
@@ -706,9 +848,9 @@ static bool test_stuff(screen_t *scr)
 /// Update the screen to match the desired output.
 static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *right_prompt) {
     // if (test_stuff(scr)) return;
-    const size_t left_prompt_width = calc_prompt_layout(left_prompt, LEFT_PROMPT).last_line_width;
+    const size_t left_prompt_width = calc_prompt_layout(left_prompt).last_line_width;
     const size_t right_prompt_width =
-        calc_prompt_layout(right_prompt, RIGHT_PROMPT).last_line_width;
+        calc_prompt_layout(right_prompt).last_line_width;
 
     int screen_width = common_get_width();
 
@@ -793,6 +935,13 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             }
         }
 
+        // Maybe the end of the line only needs to move.
+        size_t write_end = o_line.size();
+        std::string shift_sequence;
+        const bool shift_line = !should_clear_screen_this_line && !need_clear_lines &&
+                                line_can_shift(scr, i, start_pos, right_prompt_width, screen_width,
+                                               &write_end, &shift_sequence);
+
         // Skip over skip_remaining width worth of characters.
         size_t j = 0;
         for (; j < o_line.size(); j++) {
@@ -808,8 +957,15 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             if (width > 0) break;
         }
 
+        if (shift_line && !shift_sequence.empty()) {
+            // Inserted or deleted characters take the background color.
+            s_move(scr, &output, current_width, (int)i);
+            s_set_color(scr, &output, 0xffffffff);
+            s_write_mbs(&output, const_cast<char *>(shift_sequence.c_str()));
+        }
+
         // Now actually output stuff.
-        for (; j < o_line.size(); j++) {
+        for (; j < write_end; j++) {
             // If we are about to output into the last column, clear the screen first. If we clear
             // the screen after we output into the last column, it can erase the last character due
             // to the sticky right cursor. If we clear the screen too early, we can defeat soft
@@ -839,7 +995,13 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         // Clear the remainder of the line if we need to clear and if we didn't write to the end of
         // the line. If we did write to the end of the line, the "sticky right edge" (as part of
         // auto_right_margin) means that we'll be clearing the last character we wrote!
-        if (has_cleared_screen) {
+        if (shift_line) {
+            // The line ends where it should, except that deleting pulls the right prompt left.
+            if (i == 0 && right_prompt_width > 0 && o_line.size() < s_line.size()) {
+                current_width = (int)o_line.size();
+                clear_remainder = true;
+            }
+        } else if (has_cleared_screen) {
             // Already cleared everything.
             clear_remainder = false;
         } else if (need_clear_lines && current_width < screen_width) {
@@ -857,8 +1019,13 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             s_write_mbs(&output, clr_eol);
         }
 
-        // Output any rprompt if this is the first line.
-        if (i == 0 && right_prompt_width > 0) {  //!OCLINT(Use early exit/continue)
+        // Output any rprompt if this is the first line, unless it is already there and nothing on
+        // the line disturbed it.
+        const bool right_prompt_intact = !need_clear_lines && !has_cleared_screen &&
+                                         !clear_remainder && shift_sequence.empty() &&
+                                         scr->actual_right_prompt == right_prompt;
+        if (i == 0 && right_prompt_width > 0 &&
+            !right_prompt_intact) {  //!OCLINT(Use early exit/continue)
             s_move(scr, &output, (int)(screen_width - right_prompt_width), (int)i);
             s_set_color(scr, &output, 0xffffffff);
             s_write_str(&output, right_prompt);
@@ -892,13 +1059,19 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
     s_set_color(scr, &output, 0xffffffff);
 
     if (!output.empty()) {
-        write_loop(STDOUT_FILENO, &output.at(0), output.size());
+        output_write_bytes(&output.at(0), output.size());
     }
+    scr->last_update_bytes = output.size();
+    scr->total_update_bytes += output.size();
+    scr->update_count++;
+    debug(4, L"Screen update %lu wrote %lu bytes, %llu in total", scr->update_count,
+          (unsigned long)scr->last_update_bytes, scr->total_update_bytes);
 
     // We have now synced our actual screen against our desired screen. Note that this is a big
     // assignment!
     scr->actual = scr->desired;
     scr->last_right_prompt_width = right_prompt_width;
+    scr->actual_right_prompt = right_prompt;
 }
 
 /// Returns true if we are using a dumb terminal.
@@ -947,8 +1120,8 @@ static screen_layout_t compute_layout(screen_t *s, size_t screen_width,
     const wchar_t *right_prompt = right_prompt_str.c_str();
     const wchar_t *autosuggestion = autosuggestion_str.c_str();
 
-    prompt_layout_t left_prompt_layout = calc_prompt_layout(left_prompt, LEFT_PROMPT);
-    prompt_layout_t right_prompt_layout = calc_prompt_layout(right_prompt, RIGHT_PROMPT);
+    prompt_layout_t left_prompt_layout = calc_prompt_layout(left_prompt);
+    prompt_layout_t right_prompt_layout = calc_prompt_layout(right_prompt);
 
     size_t left_prompt_width = left_prompt_layout.last_line_width;
     size_t right_prompt_width = right_prompt_layout.last_line_width;
@@ -1104,18 +1277,22 @@ void s_write(screen_t *s, const wcstring &left_prompt, const wcstring &right_pro
         const std::string prompt_narrow = wcs2string(left_prompt);
         const std::string command_line_narrow = wcs2string(explicit_command_line);
 
-        write_loop(STDOUT_FILENO, "\r", 1);
-        write_loop(STDOUT_FILENO, prompt_narrow.c_str(), prompt_narrow.size());
-        write_loop(STDOUT_FILENO, command_line_narrow.c_str(), command_line_narrow.size());
+        scoped_output_frame_t frame;
+        output_write_bytes("\r", 1);
+        output_write_bytes(prompt_narrow.c_str(), prompt_narrow.size());
+        output_write_bytes(command_line_narrow.c_str(), command_line_narrow.size());
 
         return;
     }
 
+    // Any reset for output behind our back is written together with the update.
+    output_begin_frame();
     s_check_status(s);
     const size_t screen_width = common_get_width();
 
     // Completely ignore impossibly small screens.
     if (screen_width < 4) {
+        output_end_frame();
         return;
     }
 
@@ -1175,6 +1352,8 @@ void s_write(screen_t *s, const wcstring &left_prompt, const wcstring &right_pro
     s->desired.append_lines(pager.screen_data);
 
     s_update(s, layout.left_prompt.c_str(), layout.right_prompt.c_str());
+    // The output must have been written before its effect on the tty's timestamps is saved.
+    output_end_frame();
     s_save_status(s);
 }
 void s_reset(screen_t *s, screen_reset_mode_t mode) {
@@ -1226,6 +1405,7 @@ void s_reset(screen_t *s, screen_reset_mode_t mode) {
     }
 
     if (repaint_prompt) s->actual_left_prompt.clear();
+    s->actual_right_prompt.clear();
     s->actual.resize(0);
     s->need_clear_lines = true;
     s->need_clear_screen = s->need_clear_screen || clear_to_eos;
@@ -1291,14 +1471,13 @@ void s_reset(screen_t *s, screen_reset_mode_t mode) {
         abandon_line_string.append(L"\e[2K");
 
         const std::string narrow_abandon_line_string = wcs2string(abandon_line_string);
-        write_loop(STDOUT_FILENO, narrow_abandon_line_string.c_str(),
-                   narrow_abandon_line_string.size());
+        output_write_bytes(narrow_abandon_line_string.c_str(), narrow_abandon_line_string.size());
         s->actual.cursor.x = 0;
     }
 
     if (!abandon_line) {
         // This should prevent resetting the cursor position during the next repaint.
-        write_loop(STDOUT_FILENO, "\r", 1);
+        output_write_bytes("\r", 1);
         s->actual.cursor.x = 0;
     }
 
@@ -1312,7 +1491,7 @@ bool screen_force_clear_to_end() {
         data_buffer_t output;
         s_write_mbs(&output, clr_eos);
         if (!output.empty()) {
-            write_loop(STDOUT_FILENO, &output.at(0), output.size());
+            output_write_bytes(&output.at(0), output.size());
             result = true;
         }
     }
@@ -1323,6 +1502,7 @@ screen_t::screen_t()
     : desired(),
       actual(),
       actual_left_prompt(),
+      actual_right_prompt(),
       last_right_prompt_width(),
       actual_width(SCREEN_WIDTH_UNINITIALIZED),
       soft_wrap_location(INVALID_LOCATION),
@@ -1330,6 +1510,9 @@ screen_t::screen_t()
       need_clear_lines(false),
       need_clear_screen(false),
       actual_lines_before_reset(0),
+      last_update_bytes(0),
+      total_update_bytes(0),
+      update_count(0),
       prev_buff_1(),
       prev_buff_2(),
       post_buff_1(),
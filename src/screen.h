@@ -11,6 +11,7 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <wchar.h>
 
@@ -121,6 +122,8 @@ class screen_t {
     screen_data_t actual;
     /// A string containing the prompt which was last printed to the screen.
     wcstring actual_left_prompt;
+    /// The right prompt which was last printed to the screen, if it is still there.
+    wcstring actual_right_prompt;
     /// Last right prompt width.
     size_t last_right_prompt_width;
     /// The actual width of the screen at the time of the last screen write.
@@ -140,6 +143,12 @@ class screen_t {
     /// is used when resizing the window larger: if the cursor jumps to the line above, we need to
     /// remember to clear the subsequent lines.
     size_t actual_lines_before_reset;
+    /// The number of bytes written by the last screen update, and by all of them, for measuring how
+    /// much redrawing costs.
+    size_t last_update_bytes;
+    unsigned long long total_update_bytes;
+    /// The number of screen updates.
+    unsigned long update_count;
     /// These status buffers are used to check if any output has occurred other than from fish's
     /// main loop, in which case we need to redraw.
     struct stat prev_buff_1, prev_buff_2, post_buff_1, post_buff_2;
@@ -237,7 +246,25 @@ class cached_esc_sequences_t {
 };
 
 // Singleton that is exposed so that the cache can be invalidated when terminal related variables
-// change by calling `cached_esc_sequences.clear()`.
+// change, which screen_forget_terminal_sequences() does.
 extern cached_esc_sequences_t cached_esc_sequences;
 
+/// Forget the escape sequences and prompt layouts worked out for the terminal, because it changed.
+void screen_forget_terminal_sequences();
+
+/// Counters describing the caches of escape sequences and prompt layouts.
+struct screen_cache_stats_t {
+    /// Escape sequences recognized so far, and how often one was or was not already known.
+    size_t escape_entries;
+    uint64_t escape_hits;
+    uint64_t escape_misses;
+    /// Prompt layouts remembered, and how often a prompt's layout was or was not among them.
+    size_t prompt_entries;
+    uint64_t prompt_hits;
+    uint64_t prompt_misses;
+};
+
+/// Returns the counters of the caches of escape sequences and prompt layouts.
+screen_cache_stats_t screen_cache_stats();
+
 #endif
@@ -213,6 +213,7 @@ static void handle_hup(int sig, siginfo_t *info, void *context) {
         default_handler(sig, 0, 0);
     } else {
         reader_exit(1, 1);
+        job_wake_waiters();
     }
 }
 
@@ -336,6 +337,7 @@ void signal_set_handlers() {
     sigaction(SIGPIPE, &act, 0);
 
     // Whether or not we're interactive we want SIGCHLD to not interrupt restartable syscalls.
+    job_init_wakeup_pipe();
     act.sa_flags = SA_SIGINFO;
     act.sa_sigaction = &handle_chld;
     act.sa_flags = SA_SIGINFO | SA_RESTART;
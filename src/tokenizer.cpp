@@ -4,6 +4,7 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
@@ -74,6 +75,16 @@ tokenizer_t::tokenizer_t(const wchar_t *b, tok_flags_t flags)
 }
 
 bool tokenizer_t::next(struct tok_t *result) {
+    if (!this->next_range(result)) {
+        return false;
+    }
+    if (result->type == TOK_STRING) {
+        result->text.assign(this->orig_buff + result->offset, result->length);
+    }
+    return true;
+}
+
+bool tokenizer_t::next_range(struct tok_t *result) {
     assert(result != NULL);
     if (!this->has_next) {
         return false;
@@ -87,7 +98,11 @@ bool tokenizer_t::next(struct tok_t *result) {
     // be overwritten soon, which will trigger a new allocation and a copy. So our attempt to re-use
     // result->text's storage will have failed. To ensure that doesn't happen, use assign() with
     // wchar_t.
-    result->text.assign(this->last_token.data(), this->last_token.size());
+    if (this->last_type == TOK_STRING) {
+        result->text.clear();
+    } else {
+        result->text.assign(this->last_token.data(), this->last_token.size());
+    }
 
     result->type = this->last_type;
     result->offset = this->last_pos;
@@ -134,14 +149,46 @@ static bool tok_is_string_character(wchar_t c, bool is_first) {
     }
 }
 
-/// Quick test to catch the most common 'non-magical' characters, makes read_string slightly faster
-/// by adding a fast path for the most common characters. This is obviously not a suitable
-/// replacement for iswalpha.
-static int myal(wchar_t c) { return (c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z'); }
+/// A set of ASCII characters, as a bitmap. Other characters are never in the set.
+struct tok_char_set_t {
+    uint64_t bits[2];
+
+    bool contains(wchar_t c) const {
+        return static_cast<uint32_t>(c) < 128 && ((bits[c >> 6] >> (c & 63)) & 1);
+    }
+};
+
+/// Returns the set of the characters of the given string literal, including its terminating nul.
+template <size_t N>
+static tok_char_set_t tok_char_set(const wchar_t (&chars)[N]) {
+    tok_char_set_t result = {{0, 0}};
+    for (wchar_t c : chars) result.bits[c >> 6] |= uint64_t(1) << (c & 63);
+    return result;
+}
+
+/// The characters that read_string must look at in each of its modes, indexed by the mode. Runs of
+/// other characters, which make up most of a typical string, are skipped with one table lookup per
+/// character rather than a switch.
+static const tok_char_set_t tok_special_chars[] = {
+    // Regular text: escapes, subshells, brackets, quotes and separators. The caret is only a
+    // separator at the start of a token, but is rare enough to always take the slow path.
+    tok_char_set(L"\\([\'\" \n|\t;\r<>&^"),
+    // Inside a subshell: escapes, quotes and parentheses.
+    tok_char_set(L"\\\'\"()"),
+    // Inside array brackets: escapes, subshells and the closing bracket.
+    tok_char_set(L"\\(]"),
+    // Inside array brackets and a subshell, like a subshell.
+    tok_char_set(L"\\\'\"()")};
+
+/// Returns the first character at or after the given one in the given set. Since the terminating
+/// nul is in every set, this never runs past the end of the string.
+static const wchar_t *tok_skip_plain(const wchar_t *cursor, const tok_char_set_t &set) {
+    while (!set.contains(*cursor)) cursor++;
+    return cursor;
+}
 
 /// Read the next token as a string.
 void tokenizer_t::read_string() {
-    long len;
     int do_loop = 1;
     size_t paran_count = 0;
     // Up to 96 open parens, before we give up on good error reporting.
@@ -161,140 +208,144 @@ void tokenizer_t::read_string() {
     } mode = mode_regular_text;
 
     while (1) {
-        if (!myal(*this->buff)) {
-            if (*this->buff == L'\\') {
-                const wchar_t *error_location = this->buff;
-                this->buff++;
-                if (*this->buff == L'\0') {
-                    if ((!this->accept_unfinished)) {
-                        TOK_CALL_ERROR(this, TOK_UNTERMINATED_ESCAPE, UNTERMINATED_ESCAPE_ERROR,
-                                       error_location);
-                        return;
-                    }
-                    // Since we are about to increment tok->buff, decrement it first so the
-                    // increment doesn't go past the end of the buffer. See issue #389.
-                    this->buff--;
-                    do_loop = 0;
-                }
+        const wchar_t *special = tok_skip_plain(this->buff, tok_special_chars[mode]);
+        if (special != this->buff) {
+            this->buff = special;
+            is_first = false;
+        }
 
-                this->buff++;
-                continue;
+        if (*this->buff == L'\\') {
+            const wchar_t *error_location = this->buff;
+            this->buff++;
+            if (*this->buff == L'\0') {
+                if ((!this->accept_unfinished)) {
+                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_ESCAPE, UNTERMINATED_ESCAPE_ERROR,
+                                   error_location);
+                    return;
+                }
+                // Since we are about to increment tok->buff, decrement it first so the
+                // increment doesn't go past the end of the buffer. See issue #389.
+                this->buff--;
+                do_loop = 0;
             }
 
-            switch (mode) {
-                case mode_regular_text: {
-                    switch (*this->buff) {
-                        case L'(': {
-                            paran_count = 1;
-                            paran_offsets[0] = this->buff - this->orig_buff;
-                            mode = mode_subshell;
-                            break;
-                        }
-                        case L'[': {
-                            if (this->buff != start) {
-                                mode = mode_array_brackets;
-                                offset_of_bracket = this->buff - this->orig_buff;
-                            }
-                            break;
+            this->buff++;
+            continue;
+        }
+
+        switch (mode) {
+            case mode_regular_text: {
+                switch (*this->buff) {
+                    case L'(': {
+                        paran_count = 1;
+                        paran_offsets[0] = this->buff - this->orig_buff;
+                        mode = mode_subshell;
+                        break;
+                    }
+                    case L'[': {
+                        if (this->buff != start) {
+                            mode = mode_array_brackets;
+                            offset_of_bracket = this->buff - this->orig_buff;
                         }
-                        case L'\'':
-                        case L'"': {
-                            const wchar_t *end = quote_end(this->buff);
-                            if (end) {
-                                this->buff = end;
-                            } else {
-                                const wchar_t *error_loc = this->buff;
-                                this->buff += wcslen(this->buff);
-
-                                if (!this->accept_unfinished) {
-                                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
-                                                   error_loc);
-                                    return;
-                                }
-                                do_loop = 0;
+                        break;
+                    }
+                    case L'\'':
+                    case L'"': {
+                        const wchar_t *end = quote_end(this->buff);
+                        if (end) {
+                            this->buff = end;
+                        } else {
+                            const wchar_t *error_loc = this->buff;
+                            this->buff += wcslen(this->buff);
+
+                            if (!this->accept_unfinished) {
+                                TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
+                                               error_loc);
+                                return;
                             }
-                            break;
+                            do_loop = 0;
                         }
-                        default: {
-                            if (!tok_is_string_character(*(this->buff), is_first)) {
-                                do_loop = 0;
-                            }
-                            break;
+                        break;
+                    }
+                    default: {
+                        if (!tok_is_string_character(*(this->buff), is_first)) {
+                            do_loop = 0;
                         }
+                        break;
                     }
-                    break;
                 }
+                break;
+            }
 
-                case mode_array_brackets_and_subshell:
-                case mode_subshell: {
-                    switch (*this->buff) {
-                        case L'\'':
-                        case L'\"': {
-                            const wchar_t *end = quote_end(this->buff);
-                            if (end) {
-                                this->buff = end;
-                            } else {
-                                const wchar_t *error_loc = this->buff;
-                                this->buff += wcslen(this->buff);
-                                if ((!this->accept_unfinished)) {
-                                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
-                                                   error_loc);
-                                    return;
-                                }
-                                do_loop = 0;
-                            }
-                            break;
-                        }
-                        case L'(': {
-                            if (paran_count < paran_offsets_max) {
-                                paran_offsets[paran_count] = this->buff - this->orig_buff;
-                            }
-                            paran_count++;
-                            break;
-                        }
-                        case L')': {
-                            assert(paran_count > 0);
-                            paran_count--;
-                            if (paran_count == 0) {
-                                mode =
-                                    (mode == mode_array_brackets_and_subshell ? mode_array_brackets
-                                                                              : mode_regular_text);
+            case mode_array_brackets_and_subshell:
+            case mode_subshell: {
+                switch (*this->buff) {
+                    case L'\'':
+                    case L'\"': {
+                        const wchar_t *end = quote_end(this->buff);
+                        if (end) {
+                            this->buff = end;
+                        } else {
+                            const wchar_t *error_loc = this->buff;
+                            this->buff += wcslen(this->buff);
+                            if ((!this->accept_unfinished)) {
+                                TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
+                                               error_loc);
+                                return;
                             }
-                            break;
-                        }
-                        case L'\0': {
                             do_loop = 0;
-                            break;
                         }
-                        default: {
-                            break;  // ignore other chars
+                        break;
+                    }
+                    case L'(': {
+                        if (paran_count < paran_offsets_max) {
+                            paran_offsets[paran_count] = this->buff - this->orig_buff;
                         }
+                        paran_count++;
+                        break;
+                    }
+                    case L')': {
+                        assert(paran_count > 0);
+                        paran_count--;
+                        if (paran_count == 0) {
+                            mode =
+                                (mode == mode_array_brackets_and_subshell ? mode_array_brackets
+                                                                          : mode_regular_text);
+                        }
+                        break;
+                    }
+                    case L'\0': {
+                        do_loop = 0;
+                        break;
+                    }
+                    default: {
+                        break;  // ignore other chars
                     }
-                    break;
                 }
+                break;
+            }
 
-                case mode_array_brackets: {
-                    switch (*this->buff) {
-                        case L'(': {
-                            paran_count = 1;
-                            paran_offsets[0] = this->buff - this->orig_buff;
-                            mode = mode_array_brackets_and_subshell;
-                            break;
-                        }
-                        case L']': {
-                            mode = mode_regular_text;
-                            break;
-                        }
-                        case L'\0': {
-                            do_loop = 0;
-                            break;
-                        }
-                        default: {
-                            break;  // ignore other chars
-                        }
+            case mode_array_brackets: {
+                switch (*this->buff) {
+                    case L'(': {
+                        paran_count = 1;
+                        paran_offsets[0] = this->buff - this->orig_buff;
+                        mode = mode_array_brackets_and_subshell;
+                        break;
+                    }
+                    case L']': {
+                        mode = mode_regular_text;
+                        break;
+                    }
+                    case L'\0': {
+                        do_loop = 0;
+                        break;
+                    }
+                    default: {
+                        break;  // ignore other chars
                     }
-                    break;
                 }
+                break;
             }
         }
 
@@ -332,9 +383,6 @@ void tokenizer_t::read_string() {
         return;
     }
 
-    len = this->buff - start;
-
-    this->last_token.assign(start, len);
     this->last_type = TOK_STRING;
 }
 
@@ -548,6 +596,7 @@ void tokenizer_t::tok_next() {
             break;
         }
         case L'&': {
+            this->last_token.clear();
             this->last_type = TOK_BACKGROUND;
             this->buff++;
             break;
@@ -609,8 +658,8 @@ wcstring tok_first(const wcstring &str) {
     wcstring result;
     tokenizer_t t(str.c_str(), TOK_SQUASH_ERRORS);
     tok_t token;
-    if (t.next(&token) && token.type == TOK_STRING) {
-        result = std::move(token.text);
+    if (t.next_range(&token) && token.type == TOK_STRING) {
+        result.assign(str, token.offset, token.length);
     }
     return result;
 }
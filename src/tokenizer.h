@@ -51,7 +51,8 @@ enum tokenizer_error {
 typedef unsigned int tok_flags_t;
 
 struct tok_t {
-    // The text of the token, or an error message for type error.
+    // The text of the token, or an error message for type error. Left empty for string tokens by
+    // tokenizer_t::next_range.
     wcstring text;
     // The type of the token.
     token_type type;
@@ -78,7 +79,8 @@ class tokenizer_t {
     const wchar_t *buff;
     /// A copy of the original string.
     const wchar_t *orig_buff;
-    /// The last token.
+    /// The text of the last token, if it is not a string. String tokens are not copied: their text
+    /// is the range of orig_buff given by their offset and length.
     wcstring last_token;
     /// Type of last token.
     enum token_type last_type;
@@ -119,6 +121,11 @@ class tokenizer_t {
 
     /// Returns the next token by reference. Returns true if we got one, false if we're at the end.
     bool next(struct tok_t *result);
+
+    /// Like next(), but leaves result->text empty for string tokens, whose text is instead the
+    /// token's length characters of the tokenized string starting at its offset. This saves a
+    /// string copy per token for callers that have the source at hand.
+    bool next_range(struct tok_t *result);
 };
 
 /// Returns only the first token from the specified string. This is a convenience function, used to
@@ -0,0 +1,49 @@
+// Trace points for profiling a running shell with perf, bpftrace or SystemTap.
+//
+// When fish is configured with trace points (WITH_TRACE_POINTS in CMake, --enable-trace-points with
+// autoconf), each FISH_TRACE macro becomes a USDT probe in the "fish" provider. An unused probe is
+// a single nop, so a shell built this way can be profiled in production without being restarted:
+//
+//   bpftrace -e 'usdt:/usr/bin/fish:fish:exec_job_start { @start[arg0] = nsecs; }
+//                usdt:/usr/bin/fish:fish:exec_job_done /@start[arg0]/ {
+//                    @usec = hist((nsecs - @start[arg0]) / 1000); delete(@start[arg0]); }'
+//
+// Otherwise the macros expand to nothing, and their arguments are not evaluated. Arguments are
+// integers or pointers, never strings built for the occasion. Strings are passed as they are
+// stored, so command names are narrow, while other text is wide: wchar_t is 32 bits on Linux.
+//
+// fish:exec_job_start(job_id, process_count)    exec_job starts launching a job.
+// fish:exec_job_done(job_id, pgid)              exec_job returns: a foreground job has finished.
+// fish:fork_start()                             fish is about to fork, or vfork.
+// fish:fork_done(pid)                           the parent side of a fork, after it returns.
+// fish:spawn_start(path)                        posix_spawn is about to run the narrow path.
+// fish:spawn_done(pid, path)                    posix_spawn returned, with pid 0 if it failed.
+// fish:parse_start(text, length)                parsing a wide source string starts.
+// fish:parse_done(length, node_count, success)  parsing it is done.
+// fish:expand_start(text, length)               expanding a wide string starts, past the fast paths.
+// fish:expand_done(length, result_count, expand_error_t)
+// fish:env_set(key, mode)                       a variable with the given wide name is set.
+// fish:autoload_start(name)                     a function or completion file is being loaded.
+// fish:autoload_done(name, found)
+// fish:history_save_start(new_item_count)       the history file is being saved.
+// fish:history_save_done(success)
+#ifndef FISH_TRACE_H
+#define FISH_TRACE_H
+
+#ifdef FISH_TRACE_POINTS
+#include <sys/sdt.h>
+
+#define FISH_TRACE(name) DTRACE_PROBE(fish, name)
+#define FISH_TRACE1(name, a) DTRACE_PROBE1(fish, name, a)
+#define FISH_TRACE2(name, a, b) DTRACE_PROBE2(fish, name, a, b)
+#define FISH_TRACE3(name, a, b, c) DTRACE_PROBE3(fish, name, a, b, c)
+#else
+#define FISH_TRACE(name) \
+    do {                 \
+    } while (0)
+#define FISH_TRACE1(name, a) FISH_TRACE(name)
+#define FISH_TRACE2(name, a, b) FISH_TRACE(name)
+#define FISH_TRACE3(name, a, b, c) FISH_TRACE(name)
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 // Helper functions for working with wcstring.
 #include "config.h"  // IWYU pragma: keep
 
+#include <wchar.h>
+
 #include "common.h"
 #include "wcstringutil.h"
 
@@ -29,3 +31,17 @@ wcstring_range wcstring_tok(wcstring& str, const wcstring& needle, wcstring_rang
     str[next_pos] = L'\0';
     return std::make_pair(pos, next_pos - pos);
 }
+
+const wchar_t* wcs_find(const wchar_t* haystack, const wchar_t* haystack_end,
+                        const wchar_t* needle, size_t needle_len) {
+    assert(needle_len > 0);
+    while (static_cast<size_t>(haystack_end - haystack) >= needle_len) {
+        // Only positions where the whole needle still fits can start a match.
+        size_t candidates = haystack_end - haystack - needle_len + 1;
+        const wchar_t* hit = wmemchr(haystack, needle[0], candidates);
+        if (hit == NULL) break;
+        if (wmemcmp(hit + 1, needle + 1, needle_len - 1) == 0) return hit;
+        haystack = hit + 1;
+    }
+    return haystack_end;
+}
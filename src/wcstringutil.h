@@ -21,6 +21,25 @@ typedef std::pair<wcstring::size_type, wcstring::size_type> wcstring_range;
 wcstring_range wcstring_tok(wcstring& str, const wcstring& needle,
                             wcstring_range last = wcstring_range(0, 0));
 
+/// Returns the first occurrence of the needle, which must not be empty, in the range from haystack
+/// to haystack_end, or haystack_end if there is none. Candidates are found with wmemchr on the
+/// needle's first character, which libc scans with vector instructions.
+const wchar_t* wcs_find(const wchar_t* haystack, const wchar_t* haystack_end,
+                        const wchar_t* needle, size_t needle_len);
+
+/// The search used by split_about. Plain wide character ranges go through wcs_find().
+template <typename ITER>
+ITER split_about_search(ITER haystack_start, ITER haystack_end, ITER needle_start,
+                        ITER needle_end) {
+    return std::search(haystack_start, haystack_end, needle_start, needle_end);
+}
+
+inline const wchar_t* split_about_search(const wchar_t* haystack_start,
+                                         const wchar_t* haystack_end, const wchar_t* needle_start,
+                                         const wchar_t* needle_end) {
+    return wcs_find(haystack_start, haystack_end, needle_start, needle_end - needle_start);
+}
+
 /// Given iterators into a string (forward or reverse), splits the haystack iterators
 /// about the needle sequence, up to max times. Inserts splits into the output array.
 /// If the iterators are forward, this does the normal thing.
@@ -36,7 +55,8 @@ void split_about(ITER haystack_start, ITER haystack_end, ITER needle_start, ITER
         if (needle_start == needle_end) {  // empty needle, we split on individual elements
             split_point = haystack_cursor + 1;
         } else {
-            split_point = std::search(haystack_cursor, haystack_end, needle_start, needle_end);
+            split_point =
+                split_about_search(haystack_cursor, haystack_end, needle_start, needle_end);
         }
         if (split_point == haystack_end) {  // not found
             break;
@@ -4,21 +4,32 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "common.h"
 #include "complete.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "iothread.h"
+#include "lru.h"
 #include "reader.h"
 #include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
@@ -243,7 +254,7 @@ static bool wildcard_complete_internal(const wchar_t *str, const wchar_t *wc,
         // Note: out_completion may be empty if the completion really is empty, e.g. tab-completing
         // 'foo' when a file 'foo' exists.
         complete_flags_t local_flags = flags | (full_replacement ? COMPLETE_REPLACES_TOKEN : 0);
-        append_completion(out, out_completion, out_desc, local_flags, match);
+        append_completion(out, std::move(out_completion), std::move(out_desc), local_flags, match);
         return match_acceptable;
     } else if (next_wc_char_pos > 0) {
         // Here we have a non-wildcard prefix. Note that we don't do fuzzy matching for stuff before
@@ -325,6 +336,97 @@ bool wildcard_match(const wcstring &str, const wcstring &wc, bool leading_dots_f
     return match != fuzzy_match_none;
 }
 
+static bool is_any_string(wchar_t c) { return c == ANY_STRING || c == ANY_STRING_RECURSIVE; }
+
+wildcard_pattern_t::wildcard_pattern_t(const wcstring &wildcard, bool leading_dots)
+    : wc(wildcard.c_str()), leading_dots_fail_to_match(leading_dots) {
+    // Like wildcard_match, this stops at an embedded null.
+    size_t start = 0;
+    while (start < wc.size() && is_any_string(wc.at(start))) start++;
+    any_char_first = start < wc.size() && wc.at(start) == ANY_CHAR;
+
+    start = 0;
+    for (;;) {
+        size_t end = start;
+        piece_t piece = {start, 0, true};
+        while (end < wc.size() && !is_any_string(wc.at(end))) {
+            if (wc.at(end) == ANY_CHAR) piece.literal = false;
+            end++;
+        }
+        piece.length = end - start;
+        pieces.push_back(piece);
+        if (end == wc.size()) break;
+
+        // Adjacent ANY_STRINGs are the same as one.
+        has_any_string = true;
+        while (end < wc.size() && is_any_string(wc.at(end))) end++;
+        start = end;
+    }
+}
+
+/// Returns whether the piece matches the string at its start, which must have room for it.
+bool wildcard_pattern_t::piece_matches_at(const piece_t &piece, const wchar_t *str) const {
+    const wchar_t *pc = wc.c_str() + piece.start;
+    if (piece.literal) return wmemcmp(pc, str, piece.length) == 0;
+    for (size_t i = 0; i < piece.length; i++) {
+        if (pc[i] != ANY_CHAR && pc[i] != str[i]) return false;
+    }
+    return true;
+}
+
+/// Returns the first position at which the piece matches inside str[start, end), or npos.
+size_t wildcard_pattern_t::find_piece(const piece_t &piece, const wchar_t *str, size_t start,
+                                      size_t end) const {
+    if (end - start < piece.length) return wcstring::npos;
+    const size_t last = end - piece.length;
+    const wchar_t first = wc.at(piece.start);
+    for (size_t pos = start; pos <= last; pos++) {
+        if (first != ANY_CHAR) {
+            // Skip ahead to where the first character is.
+            const wchar_t *found = wmemchr(str + pos, first, last - pos + 1);
+            if (!found) return wcstring::npos;
+            pos = found - str;
+        }
+        if (piece_matches_at(piece, str + pos)) return pos;
+    }
+    return wcstring::npos;
+}
+
+bool wildcard_pattern_t::matches(const wcstring &string) const {
+    const wchar_t *const str = string.c_str();
+    const size_t len = wcslen(str);
+
+    // The same rules for dots as wildcard_match_internal.
+    if (leading_dots_fail_to_match && (!wcscmp(str, L".") || !wcscmp(str, L".."))) {
+        return wcscmp(str, wc.c_str()) == 0;
+    }
+    if (str[0] == L'.') {
+        if (any_char_first) return false;
+        if (leading_dots_fail_to_match && !wc.empty() && is_any_string(wc.at(0))) return false;
+    }
+
+    const piece_t &head = pieces.front();
+    if (!has_any_string) return len == head.length && piece_matches_at(head, str);
+
+    // The pieces have fixed lengths, so taking the first place each middle piece fits leaves the
+    // most room for the rest.
+    const piece_t &tail = pieces.back();
+    if (len < head.length + tail.length) return false;
+    if (!piece_matches_at(head, str) || !piece_matches_at(tail, str + len - tail.length)) {
+        return false;
+    }
+    size_t pos = head.length;
+    const size_t end = len - tail.length;
+    for (size_t i = 1; i + 1 < pieces.size(); i++) {
+        const piece_t &piece = pieces.at(i);
+        if (piece.length == 0) continue;
+        size_t found = find_piece(piece, str, pos, end);
+        if (found == wcstring::npos) return false;
+        pos = found + piece.length;
+    }
+    return true;
+}
+
 /// Obtain a description string for the file specified by the filename.
 ///
 /// The returned value is a string constant and should not be free'd.
@@ -335,6 +437,65 @@ bool wildcard_match(const wcstring &str, const wcstring &wc, bool leading_dots_f
 /// \param stat_res The result of calling stat on the file
 /// \param buf The struct buf output of calling stat on the file
 /// \param err The errno value after a failed stat call on the file.
+/// Maximum number of files whose executability is kept for describing them.
+#define FILE_DESC_CACHE_SIZE 4096
+
+namespace {
+/// Whether a file was executable by us when its data and inode had the given change times.
+struct file_desc_cache_entry_t {
+    time_t mtime;
+    time_t ctime;
+    bool executable;
+};
+
+class file_desc_cache_t : public lru_cache_t<file_desc_cache_t, file_desc_cache_entry_t> {
+    typedef lru_cache_t<file_desc_cache_t, file_desc_cache_entry_t> super;
+
+   public:
+    wildcard_cache_stats_t stats;
+    file_desc_cache_t() : super(FILE_DESC_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+/// Executability of the files described recently, keyed by device and inode. Describing a file
+/// otherwise only takes its stat, which we need anyway for its size; the access check is what's
+/// worth not repeating on every tab. Shared by the threads walking directories.
+static owning_lock<file_desc_cache_t> s_file_desc_cache;
+
+wildcard_cache_stats_t file_desc_cache_stats() { return s_file_desc_cache.acquire().value.stats; }
+
+/// Returns whether we can execute the file at the given path, whose stat is given. Writing to the
+/// file or changing its mode, owner or links changes its mtime or ctime, so a cached answer is good
+/// as long as those are the same. An answer found in the second the file changed may miss later
+/// changes in that second, so those are never kept.
+static bool file_is_executable(const wcstring &filename, const struct stat &buf) {
+    if (!S_ISREG(buf.st_mode) || !(buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) return false;
+    wcstring key = to_string(static_cast<long long>(buf.st_dev));
+    key.push_back(L':');
+    key.append(to_string(static_cast<long long>(buf.st_ino)));
+    {
+        auto &&cache = s_file_desc_cache.acquire();
+        const file_desc_cache_entry_t *entry = cache.value.get(key);
+        if (entry && entry->mtime == buf.st_mtime && entry->ctime == buf.st_ctime) {
+            cache.value.stats.hits++;
+            return entry->executable;
+        }
+        cache.value.stats.misses++;
+    }
+
+    // Weird group permissions and other such issues make it non-trivial to find out if we can
+    // actually execute a file using the result from stat. It is much safer to use the access
+    // function, since it tells us exactly what we want to know.
+    const bool executable = waccess(filename, X_OK) == 0;
+    const time_t now = time(NULL);
+    if (buf.st_mtime < now && buf.st_ctime < now) {
+        auto &&cache = s_file_desc_cache.acquire();
+        cache.value.evict_node(key);
+        cache.value.insert(std::move(key), {buf.st_mtime, buf.st_ctime, executable});
+    }
+    return executable;
+}
+
 static wcstring file_get_desc(const wcstring &filename, int lstat_res, const struct stat &lbuf,
                               int stat_res, const struct stat &buf, int err) {
     if (lstat_res) {
@@ -346,10 +507,7 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
             if (S_ISDIR(buf.st_mode)) {
                 return COMPLETE_DIRECTORY_SYMLINK_DESC;
             }
-            if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH) && waccess(filename, X_OK) == 0) {
-                // Weird group permissions and other such issues make it non-trivial to find out if
-                // we can actually execute a file using the result from stat. It is much safer to
-                // use the access function, since it tells us exactly what we want to know.
+            if (file_is_executable(filename, buf)) {
                 return COMPLETE_EXEC_LINK_DESC;
             }
 
@@ -370,10 +528,7 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
         return COMPLETE_SOCKET_DESC;
     } else if (S_ISDIR(buf.st_mode)) {
         return COMPLETE_DIRECTORY_DESC;
-    } else if (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXGRP) && waccess(filename, X_OK) == 0) {
-        // Weird group permissions and other such issues make it non-trivial to find out if we can
-        // actually execute a file using the result from stat. It is much safer to use the access
-        // function, since it tells us exactly what we want to know.
+    } else if (file_is_executable(filename, buf)) {
         return COMPLETE_EXEC_DESC;
     }
 
@@ -382,20 +537,34 @@ static wcstring file_get_desc(const wcstring &filename, int lstat_res, const str
 
 /// Test if the given file is an executable (if EXECUTABLES_ONLY) or directory (if
 /// DIRECTORIES_ONLY). If it matches, call wildcard_complete() with some description that we make
-/// up. Note that the filename came from a readdir() call, so we know it exists.
+/// up. Note that the filename came from a readdir() call, so we know it exists. known_type is the
+/// type readdir gave for it (see wreaddir_with_type), or 0.
 static bool wildcard_test_flags_then_complete(const wcstring &filepath, const wcstring &filename,
                                               const wchar_t *wc, expand_flags_t expand_flags,
-                                              std::vector<completion_t> *out) {
+                                              std::vector<completion_t> *out, mode_t known_type) {
     // Check if it will match before stat().
     if (!wildcard_complete(filename, wc, NULL, NULL, NULL, expand_flags, 0)) {
         return false;
     }
 
+    // If readdir told us the type and it isn't a symlink, we may not need to stat at all: only
+    // descriptions need more than the type (and executables the access check below).
+    const bool need_directory = expand_flags & DIRECTORIES_ONLY;
+    const bool executables_only = expand_flags & EXECUTABLES_ONLY;
+    const bool type_is_final = known_type != 0 && !S_ISLNK(known_type);
+    if (type_is_final) {
+        if (need_directory && !S_ISDIR(known_type)) return false;
+        if (executables_only && !S_ISREG(known_type)) return false;
+    }
+
     struct stat lstat_buf = {}, stat_buf = {};
     int stat_res = -1;
     int stat_errno = 0;
-    int lstat_res = lwstat(filepath, &lstat_buf);
-    if (lstat_res >= 0) {
+    int lstat_res = -1;
+    if (type_is_final && (expand_flags & EXPAND_NO_DESCRIPTIONS)) {
+        stat_buf.st_mode = known_type;
+        stat_res = 0;
+    } else if ((lstat_res = lwstat(filepath, &lstat_buf)) >= 0) {
         if (S_ISLNK(lstat_buf.st_mode)) {
             stat_res = wstat(filepath, &stat_buf);
 
@@ -414,14 +583,16 @@ static bool wildcard_test_flags_then_complete(const wcstring &filepath, const wc
     const bool is_directory = stat_res == 0 && S_ISDIR(stat_buf.st_mode);
     const bool is_executable = stat_res == 0 && S_ISREG(stat_buf.st_mode);
 
-    const bool need_directory = expand_flags & DIRECTORIES_ONLY;
     if (need_directory && !is_directory) {
         return false;
     }
 
-    const bool executables_only = expand_flags & EXECUTABLES_ONLY;
-    if (executables_only && (!is_executable || waccess(filepath, X_OK) != 0)) {
-        return false;
+    if (executables_only) {
+        if (!is_executable) return false;
+        // Without a full stat, there's nothing to cache the answer by.
+        bool can_execute = lstat_res >= 0 ? file_is_executable(filepath, stat_buf)
+                                          : waccess(filepath, X_OK) == 0;
+        if (!can_execute) return false;
     }
 
     // Compute the description.
@@ -444,6 +615,34 @@ static bool wildcard_test_flags_then_complete(const wcstring &filepath, const wc
     return wildcard_complete(filename, wc, desc.c_str(), NULL, out, expand_flags, 0);
 }
 
+/// Maximum number of background threads walking the directories of a recursive wildcard.
+#define WILDCARD_PARALLEL_THREADS 8
+
+/// How deep the directories of a recursive wildcard are split up between threads. Subdirectories
+/// further down are walked by the thread that got their parent. Splitting more than one level
+/// keeps the threads busy when one directory holds most of the tree.
+#define WILDCARD_PARALLEL_DEPTH 2
+
+/// Returns how many background threads to walk recursive wildcards with. This is none with a
+/// single processor, where they only add overhead.
+static size_t wildcard_parallel_threads() {
+    static const size_t threads =
+        std::min((size_t)WILDCARD_PARALLEL_THREADS,
+                 (size_t)std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return threads;
+}
+
+/// Maximum number of directories found by fuzzy matching that one expansion descends into.
+#define WILDCARD_FUZZY_DIR_BUDGET 256
+
+namespace {
+/// A directory read by a wildcard expansion, and its mtime then, or -1 if it could not be opened.
+struct wildcard_dir_stamp_t {
+    wcstring path;
+    time_t mtime;
+};
+}  // anonymous namespace
+
 class wildcard_expander_t {
     // The working directory to resolve paths against
     const wcstring working_directory;
@@ -461,8 +660,21 @@ class wildcard_expander_t {
     bool did_add;
     // Whether some parent expansion is fuzzy, and therefore completions always prepend their prefix
     // This variable is a little suspicious - it should be passed along, not stored here
-    // If we ever try to do parallel wildcard expansion we'll have to remove this
+    // Expanders for subdirectories expanded in parallel get a copy of it.
     bool has_fuzzy_ancestor;
+    // Whether any expander of this expansion was interrupted. Subdirectories expanded in parallel
+    // get their own expanders, and interruption can only be checked on the thread the expansion
+    // started on, so they share the flag of the first one.
+    std::atomic<bool> own_interrupt_flag{false};
+    std::atomic<bool> *const interrupt_flag;
+    const pthread_t interrupt_thread;
+    // How many parallel expansions of subdirectories this expander is nested in.
+    const int parallel_depth;
+    // How many more directories found by fuzzy matching we may descend into. Fuzzy matches at
+    // each level of a path like /u/l/b multiply, which on big filesystems would take forever.
+    size_t fuzzy_dir_budget = WILDCARD_FUZZY_DIR_BUDGET;
+    // If set, the directories we open get recorded here, so the results can be cached.
+    std::vector<wildcard_dir_stamp_t> *dir_stamps = NULL;
 
     /// We are a trailing slash - expand at the end.
     void expand_trailing_slash(const wcstring &base_dir, const wcstring &prefix);
@@ -475,6 +687,12 @@ class wildcard_expander_t {
                                      const wcstring &wc_segment, const wchar_t *wc_remainder,
                                      const wcstring &prefix);
 
+    /// Expand wc in each of the given directories, on several threads. This is for recursive
+    /// wildcards, which may have to walk big trees. The results are added in the same order as
+    /// expanding the directories one after the other would.
+    void expand_in_parallel(const std::vector<std::pair<wcstring, file_id_t>> &dirs,
+                            const wchar_t *wc, const wcstring &prefix);
+
     /// Given a directory base_dir, which is opened as base_dir_fp, expand an intermediate literal
     /// segment. Use a fuzzy matching algorithm.
     void expand_literal_intermediate_segment_with_fuzz(const wcstring &base_dir, DIR *base_dir_fp,
@@ -491,19 +709,22 @@ class wildcard_expander_t {
 
     /// Indicate whether we should cancel wildcard expansion. This latches 'interrupt'.
     bool interrupted() {
-        if (!did_interrupt) {
+        if (!did_interrupt && *interrupt_flag) {
+            did_interrupt = true;
+        } else if (!did_interrupt && pthread_equal(pthread_self(), interrupt_thread)) {
             did_interrupt =
                 (is_main_thread() ? reader_interrupted() : reader_thread_job_is_stale());
+            if (did_interrupt) *interrupt_flag = true;
         }
         return did_interrupt;
     }
 
-    void add_expansion_result(const wcstring &result) {
+    void add_expansion_result(wcstring result) {
         // This function is only for the non-completions case.
         assert(!static_cast<bool>(this->flags &
                                   EXPAND_FOR_COMPLETIONS));  //!OCLINT(multiple unary operator)
         if (this->completion_set.insert(result).second) {
-            append_completion(this->resolved_completions, result);
+            append_completion(this->resolved_completions, std::move(result));
             this->did_add = true;
         }
     }
@@ -560,7 +781,8 @@ class wildcard_expander_t {
     }
 
     void try_add_completion_result(const wcstring &filepath, const wcstring &filename,
-                                   const wcstring &wildcard, const wcstring &prefix) {
+                                   const wcstring &wildcard, const wcstring &prefix,
+                                   mode_t known_type) {
         // This function is only for the completions case.
         assert(this->flags & EXPAND_FOR_COMPLETIONS);
 
@@ -569,7 +791,7 @@ class wildcard_expander_t {
 
         size_t before = this->resolved_completions->size();
         if (wildcard_test_flags_then_complete(abs_path, filename, wildcard.c_str(), this->flags,
-                                              this->resolved_completions)) {
+                                              this->resolved_completions, known_type)) {
             // Hack. We added this completion result based on the last component of the wildcard.
             // Prepend our prefix to each wildcard that replaces its token.
             // Note that prepend_token_prefix is a no-op unless COMPLETE_REPLACES_TOKEN is set
@@ -603,9 +825,28 @@ class wildcard_expander_t {
     DIR *open_dir(const wcstring &base_dir) const {
         wcstring path = this->working_directory;
         append_path_component(path, base_dir);
-        return wopendir(path);
+        DIR *dir = wopendir(path);
+        if (this->dir_stamps) {
+            struct stat buf;
+            time_t mtime = (dir && fstat(dirfd(dir), &buf) == 0) ? buf.st_mtime : -1;
+            this->dir_stamps->push_back({std::move(path), mtime});
+        }
+        return dir;
     }
 
+    // Make an expander for a subdirectory expanded in parallel by the given one.
+    wildcard_expander_t(const wildcard_expander_t &parent, std::vector<completion_t> *r)
+        : working_directory(parent.working_directory),
+          visited_files(parent.visited_files),
+          flags(parent.flags),
+          resolved_completions(r),
+          did_interrupt(false),
+          did_add(false),
+          has_fuzzy_ancestor(parent.has_fuzzy_ancestor),
+          interrupt_flag(parent.interrupt_flag),
+          interrupt_thread(parent.interrupt_thread),
+          parallel_depth(parent.parallel_depth + 1) {}
+
    public:
     wildcard_expander_t(const wcstring &wd, expand_flags_t f, std::vector<completion_t> *r)
         : working_directory(wd),
@@ -613,7 +854,10 @@ class wildcard_expander_t {
           resolved_completions(r),
           did_interrupt(false),
           did_add(false),
-          has_fuzzy_ancestor(false) {
+          has_fuzzy_ancestor(false),
+          interrupt_flag(&own_interrupt_flag),
+          interrupt_thread(pthread_self()),
+          parallel_depth(0) {
         assert(resolved_completions != NULL);
 
         // Insert initial completions into our set to avoid duplicates.
@@ -623,6 +867,9 @@ class wildcard_expander_t {
         }
     }
 
+    // Record the directories read by the expansion into the given list.
+    void record_dirs(std::vector<wildcard_dir_stamp_t> *stamps) { this->dir_stamps = stamps; }
+
     // Do wildcard expansion. This is recursive.
     void expand(const wcstring &base_dir, const wchar_t *wc, const wcstring &prefix);
 
@@ -650,9 +897,10 @@ void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir, const
         DIR *dir = open_dir(base_dir);
         if (dir) {
             wcstring next;
-            while (wreaddir(dir, next) && !interrupted()) {
+            mode_t type;
+            while (wreaddir_with_type(dir, next, &type) && !interrupted()) {
                 if (!next.empty() && next.at(0) != L'.') {
-                    this->try_add_completion_result(base_dir + next, next, L"", prefix);
+                    this->try_add_completion_result(base_dir + next, next, L"", prefix, type);
                 }
             }
             closedir(dir);
@@ -664,10 +912,14 @@ void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir,
                                                       const wcstring &wc_segment,
                                                       const wchar_t *wc_remainder,
                                                       const wcstring &prefix) {
+    // Find the matching directories before expanding any, so that they can be expanded in
+    // parallel.
+    std::vector<std::pair<wcstring, file_id_t>> subdirs;
+    // Note that it's critical we ignore leading dots here, else we may descend into . and ..
+    const wildcard_pattern_t pattern(wc_segment, true);
     wcstring name_str;
     while (!interrupted() && wreaddir_for_dirs(base_dir_fp, &name_str)) {
-        // Note that it's critical we ignore leading dots here, else we may descend into . and ..
-        if (!wildcard_match(name_str, wc_segment, true)) {
+        if (!pattern.matches(name_str)) {
             // Doesn't match the wildcard for this segment, skip it.
             continue;
         }
@@ -680,7 +932,7 @@ void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir,
         }
 
         const file_id_t file_id = file_id_t::file_id_from_stat(&buf);
-        if (!this->visited_files.insert(file_id).second) {
+        if (this->visited_files.count(file_id)) {
             // Symlink loop! This directory was already visited, so skip it.
             continue;
         }
@@ -688,11 +940,59 @@ void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir,
         // We made it through. Perform normal wildcard expansion on this new directory, starting at
         // our tail_wc, which includes the ANY_STRING_RECURSIVE guy.
         full_path.push_back(L'/');
-        this->expand(full_path, wc_remainder, prefix + wc_segment + L'/');
+        subdirs.emplace_back(std::move(full_path), file_id);
+    }
+
+    const wcstring child_prefix = prefix + wc_segment + L'/';
+    if (wc_remainder[0] == ANY_STRING_RECURSIVE && subdirs.size() > 1 &&
+        this->parallel_depth < WILDCARD_PARALLEL_DEPTH && wildcard_parallel_threads() > 0) {
+        this->expand_in_parallel(subdirs, wc_remainder, child_prefix);
+        return;
+    }
+    for (const auto &subdir : subdirs) {
+        if (interrupted()) break;
+        this->visited_files.insert(subdir.second);
+        this->expand(subdir.first, wc_remainder, child_prefix);
 
         // Now remove the visited file. This is for #2414: only directories "beneath" us should be
         // considered visited.
-        this->visited_files.erase(file_id);
+        this->visited_files.erase(subdir.second);
+    }
+}
+
+void wildcard_expander_t::expand_in_parallel(
+    const std::vector<std::pair<wcstring, file_id_t>> &dirs, const wchar_t *wc,
+    const wcstring &prefix) {
+    std::vector<std::vector<completion_t>> results(dirs.size());
+    std::vector<char> added(dirs.size(), false);
+    std::vector<std::vector<wildcard_dir_stamp_t>> stamps(dirs.size());
+    iothread_perform_parallel(dirs.size(), wildcard_parallel_threads(), [&](size_t idx) {
+        wildcard_expander_t child(*this, &results.at(idx));
+        if (this->dir_stamps) child.record_dirs(&stamps.at(idx));
+        if (child.interrupted()) return;
+        child.visited_files.insert(dirs.at(idx).second);
+        child.expand(dirs.at(idx).first, wc, prefix);
+        added.at(idx) = child.did_add;
+    });
+    if (interrupted()) return;
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if (this->dir_stamps) {
+            this->dir_stamps->insert(this->dir_stamps->end(),
+                                     std::make_move_iterator(stamps.at(i).begin()),
+                                     std::make_move_iterator(stamps.at(i).end()));
+        }
+        if (this->flags & EXPAND_FOR_COMPLETIONS) {
+            this->resolved_completions->insert(this->resolved_completions->end(),
+                                               std::make_move_iterator(results.at(i).begin()),
+                                               std::make_move_iterator(results.at(i).end()));
+            this->did_add = this->did_add || added.at(i);
+        } else {
+            // Each expander only avoided duplicates among its own results.
+            for (completion_t &result : results.at(i)) {
+                this->add_expansion_result(std::move(result.completion));
+            }
+        }
     }
 }
 
@@ -707,6 +1007,9 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
     // Mark that we are fuzzy for the duration of this function
     const scoped_push<bool> scoped_fuzzy(&this->has_fuzzy_ancestor, true);
 
+    // Find all the matching subdirectories before descending into any of them, so we can visit
+    // the best matches first.
+    std::vector<std::pair<string_fuzzy_match_t, wcstring>> candidates;
     while (!interrupted() && wreaddir_for_dirs(base_dir_fp, &name_str)) {
         // Don't bother with . and ..
         if (name_str == L"." || name_str == L"..") {
@@ -719,14 +1022,34 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
         if (match.type == fuzzy_match_none || match.type == fuzzy_match_exact) {
             continue;
         }
+        candidates.emplace_back(match, std::move(name_str));
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const std::pair<string_fuzzy_match_t, wcstring> &a,
+                        const std::pair<string_fuzzy_match_t, wcstring> &b) {
+                         return a.first.compare(b.first) < 0;
+                     });
+
+    // The best match type of the completions found through our candidates so far.
+    fuzzy_match_type_t best_type = fuzzy_match_none;
+    for (const auto &candidate : candidates) {
+        const string_fuzzy_match_t &match = candidate.first;
+        const wcstring &name = candidate.second;
+        // Completions found here are at least as fuzzy as our match, and only the completions of
+        // the best match type are kept. Once better candidates found some, the rest would only
+        // find completions that get thrown away.
+        if (interrupted() || match.type > best_type || this->fuzzy_dir_budget == 0) {
+            break;
+        }
 
-        wcstring new_full_path = base_dir + name_str;
+        wcstring new_full_path = base_dir + name;
         new_full_path.push_back(L'/');
         struct stat buf;
         if (0 != wstat(new_full_path, &buf) || !S_ISDIR(buf.st_mode)) {
             /* We either can't stat it, or we did but it's not a directory */
             continue;
         }
+        this->fuzzy_dir_budget--;
 
         // Determine the effective prefix for our children
         // Normally this would be the wildcard segment, but here we know our segment doesn't have
@@ -734,7 +1057,7 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
         // ("literal") and we are doing fuzzy expansion, which means we replace the segment with
         // files found
         // through fuzzy matching
-        const wcstring child_prefix = prefix + name_str + L'/';
+        const wcstring child_prefix = prefix + name + L'/';
 
         // Ok, this directory matches. Recurse to it. Then mark each resulting completion as fuzzy.
         const size_t before = this->resolved_completions->size();
@@ -754,6 +1077,7 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
                 // Our match is fuzzier.
                 c->match = match;
             }
+            best_type = std::min(best_type, c->match.type);
         }
     }
 }
@@ -761,12 +1085,16 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
 void wildcard_expander_t::expand_last_segment(const wcstring &base_dir, DIR *base_dir_fp,
                                               const wcstring &wc, const wcstring &prefix) {
     wcstring name_str;
-    while (wreaddir(base_dir_fp, name_str)) {
+    mode_t type;
+    // Only used for normal wildcard expansion, completions match differently.
+    const wildcard_pattern_t pattern(flags & EXPAND_FOR_COMPLETIONS ? wcstring() : wc,
+                                     true /* skip files with leading dots */);
+    while (wreaddir_with_type(base_dir_fp, name_str, &type)) {
         if (flags & EXPAND_FOR_COMPLETIONS) {
-            this->try_add_completion_result(base_dir + name_str, name_str, wc, prefix);
+            this->try_add_completion_result(base_dir + name_str, name_str, wc, prefix, type);
         } else {
             // Normal wildcard expansion, not for completions.
-            if (wildcard_match(name_str, wc, true /* skip files with leading dots */)) {
+            if (pattern.matches(name_str)) {
                 this->add_expansion_result(base_dir + name_str);
             }
         }
@@ -879,6 +1207,116 @@ void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc,
     }
 }
 
+/// Maximum number of wildcard expansions whose results are kept.
+#define WILDCARD_CACHE_SIZE 64
+
+/// Expansions reading more directories than this are not kept.
+#define WILDCARD_CACHE_MAX_DIRS 1024
+
+namespace {
+/// The results of a wildcard expansion, and the directories it read.
+struct wildcard_cache_entry_t {
+    std::vector<wildcard_dir_stamp_t> dirs;
+    time_t expanded_at;
+    wcstring_list_t results;
+};
+
+class wildcard_cache_t : public lru_cache_t<wildcard_cache_t, wildcard_cache_entry_t> {
+    typedef lru_cache_t<wildcard_cache_t, wildcard_cache_entry_t> super;
+
+   public:
+    wildcard_cache_stats_t stats;
+    wildcard_cache_t() : super(WILDCARD_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+/// Cached wildcard expansions, keyed by working directory, wildcard and flags. Main thread only.
+static wildcard_cache_t s_wildcard_cache;
+
+wildcard_cache_stats_t wildcard_cache_stats() {
+    ASSERT_IS_MAIN_THREAD();
+    return s_wildcard_cache.stats;
+}
+
+/// Returns whether the directories read by a cached expansion are all as they were. Every name
+/// added to or removed from a directory changes its mtime; an expansion made in the second a
+/// directory changed may miss later changes in that second, so those are never kept.
+static bool wildcard_cache_entry_is_current(const wildcard_cache_entry_t &entry) {
+    for (const wildcard_dir_stamp_t &stamp : entry.dirs) {
+        struct stat buf;
+        bool exists = wstat(stamp.path, &buf) == 0;
+        if (stamp.mtime < 0 ? exists : (!exists || buf.st_mtime != stamp.mtime)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Add the given expansion results to output, skipping the ones already there, and return the
+/// status of wildcard_expand_string.
+static int wildcard_add_cached_results(const wcstring_list_t &results,
+                                       std::vector<completion_t> *output) {
+    std::unordered_set<wcstring> present;
+    for (const completion_t &comp : *output) present.insert(comp.completion);
+    bool added = false;
+    for (const wcstring &result : results) {
+        if (present.insert(result).second) {
+            append_completion(output, result);
+            added = true;
+        }
+    }
+    return added ? 1 : 0;
+}
+
+/// Like wildcard_expand_string, but reusing the results of an earlier identical expansion if none
+/// of the directories it read changed since.
+static int wildcard_expand_cached(const wcstring &wc, const wcstring &working_directory,
+                                  expand_flags_t flags, const wcstring &prefix,
+                                  const wcstring &base_dir, const wcstring &effective_wc,
+                                  std::vector<completion_t> *output) {
+    ASSERT_IS_MAIN_THREAD();
+    wcstring key = working_directory;
+    key.push_back(L'\0');
+    key.append(wc);
+    key.push_back(L'\0');
+    key.append(to_string(static_cast<long>(flags)));
+
+    wildcard_cache_t &cache = s_wildcard_cache;
+    if (const wildcard_cache_entry_t *entry = cache.get(key)) {
+        if (wildcard_cache_entry_is_current(*entry)) {
+            cache.stats.hits++;
+            return wildcard_add_cached_results(entry->results, output);
+        }
+        cache.evict_node(key);
+    }
+    cache.stats.misses++;
+
+    wildcard_cache_entry_t entry;
+    entry.expanded_at = time(NULL);
+    std::vector<completion_t> expanded;
+    wildcard_expander_t expander(prefix, flags, &expanded);
+    expander.record_dirs(&entry.dirs);
+    expander.expand(base_dir, effective_wc.c_str(), base_dir);
+    for (completion_t &comp : expanded) {
+        entry.results.push_back(std::move(comp.completion));
+    }
+
+    int status = expander.status_code();
+    if (status < 0) {
+        // Interrupted, so the results may be incomplete.
+        wildcard_add_cached_results(entry.results, output);
+        return status;
+    }
+    status = wildcard_add_cached_results(entry.results, output);
+
+    bool cacheable = entry.dirs.size() <= WILDCARD_CACHE_MAX_DIRS;
+    for (const wildcard_dir_stamp_t &stamp : entry.dirs) {
+        if (stamp.mtime >= entry.expanded_at) cacheable = false;
+    }
+    if (cacheable) cache.insert(std::move(key), std::move(entry));
+    return status;
+}
+
 int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory,
                            expand_flags_t flags, std::vector<completion_t> *output) {
     assert(output != NULL);
@@ -918,7 +1356,113 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory
         effective_wc = wc;
     }
 
+    // Completions are expanded on background threads, and carry descriptions that may go stale.
+    if (!(flags & EXPAND_FOR_COMPLETIONS) && is_main_thread()) {
+        return wildcard_expand_cached(wc, working_directory, flags, prefix, base_dir, effective_wc,
+                                      output);
+    }
+
     wildcard_expander_t expander(prefix, flags, output);
     expander.expand(base_dir, effective_wc.c_str(), base_dir);
     return expander.status_code();
 }
+
+/// Maximum number of background threads reading $PATH directories for one command completion.
+#define COMMAND_DIR_SCAN_THREADS 16
+
+/// Maximum number of directories whose listings are kept for command completion.
+#define COMMAND_DIR_LISTINGS_MAX 256
+
+namespace {
+/// An entry of a directory, and its type as given by wreaddir_with_type. The type of a name can
+/// only change by replacing the file, which changes the directory's mtime too.
+struct command_dir_entry_t {
+    wcstring name;
+    mode_t type;
+};
+typedef std::vector<command_dir_entry_t> command_dir_entry_list_t;
+
+/// The entries of a directory in $PATH, as read for command completion.
+struct command_dir_listing_t {
+    time_t mtime;
+    time_t listed_at;
+    std::shared_ptr<const command_dir_entry_list_t> names;
+};
+}  // anonymous namespace
+
+static owning_lock<std::unordered_map<wcstring, command_dir_listing_t>> s_command_dir_listings;
+
+/// Returns the entries of the given directory, reading it only if it changed since we last did.
+static std::shared_ptr<const command_dir_entry_list_t> command_dir_names(const wcstring &dir) {
+    struct stat buf;
+    if (wstat(dir, &buf) != 0) return NULL;
+    {
+        auto &&listings = s_command_dir_listings.acquire();
+        auto where = listings.value.find(dir);
+        // A listing made in the second the directory changed may miss later changes in that second.
+        if (where != listings.value.end() && where->second.mtime == buf.st_mtime &&
+            where->second.mtime < where->second.listed_at) {
+            return where->second.names;
+        }
+    }
+
+    const time_t listed_at = time(NULL);
+    DIR *dirp = wopendir(dir);
+    if (!dirp) return NULL;
+    auto names = std::make_shared<command_dir_entry_list_t>();
+    command_dir_entry_t entry;
+    while (wreaddir_with_type(dirp, entry.name, &entry.type)) {
+        names->push_back(entry);
+    }
+    closedir(dirp);
+
+    auto &&listings = s_command_dir_listings.acquire();
+    if (listings.value.size() >= COMMAND_DIR_LISTINGS_MAX) listings.value.clear();
+    listings.value[dir] = {buf.st_mtime, listed_at, names};
+    return names;
+}
+
+void wildcard_warm_command_dirs(const wcstring_list_t &dirs) {
+    iothread_perform_parallel(dirs.size(), COMMAND_DIR_SCAN_THREADS,
+                              [&](size_t idx) { command_dir_names(dirs.at(idx)); });
+}
+
+int wildcard_complete_command(const wcstring &wc, const wcstring_list_t &dirs,
+                              expand_flags_t flags, std::vector<completion_t> *output) {
+    assert(output != NULL);
+    assert(!wc.empty() && wc.find(L'/') == wcstring::npos && !wildcard_has(wc, true));
+    assert((flags & EXPAND_FOR_COMPLETIONS) && (flags & EXECUTABLES_ONLY));
+    if (wc.find(L'\0') != wcstring::npos) {
+        return 0;
+    }
+
+    // Only the calling thread can tell whether it was interrupted. Once it was, the directories
+    // not yet started are skipped.
+    const bool main_thread = is_main_thread();
+    const pthread_t caller = pthread_self();
+    std::atomic<bool> interrupted{false};
+    std::vector<std::vector<completion_t>> results(dirs.size());
+    iothread_perform_parallel(dirs.size(), COMMAND_DIR_SCAN_THREADS, [&](size_t idx) {
+        if (pthread_equal(pthread_self(), caller) && !interrupted) {
+            interrupted = main_thread ? reader_interrupted() : reader_thread_job_is_stale();
+        }
+        if (interrupted) return;
+        auto names = command_dir_names(dirs.at(idx));
+        if (!names) return;
+        for (const command_dir_entry_t &entry : *names) {
+            wcstring abs_path = dirs.at(idx);
+            append_path_component(abs_path, entry.name);
+            wildcard_test_flags_then_complete(abs_path, entry.name, wc.c_str(), flags,
+                                              &results.at(idx), entry.type);
+        }
+    });
+    if (interrupted) return -1;
+
+    bool did_add = false;
+    for (std::vector<completion_t> &result : results) {
+        did_add = did_add || !result.empty();
+        output->insert(output->end(), std::make_move_iterator(result.begin()),
+                       std::make_move_iterator(result.end()));
+    }
+    return did_add ? 1 : 0;
+}
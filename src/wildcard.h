@@ -3,6 +3,8 @@
 #ifndef FISH_WILDCARD_H
 #define FISH_WILDCARD_H
 
+#include <stdint.h>
+
 #include <vector>
 
 #include "common.h"
@@ -35,6 +37,9 @@ enum {
 /// If wildcard_expand encounters any errors (such as insufficient priviliges) during matching, no
 /// error messages will be printed and wildcard_expand will continue the matching process.
 ///
+/// Expansions other than for completions made on the main thread are cached, and reused for as long
+/// as none of the directories they read change.
+///
 /// \param wc The wildcard string
 /// \param working_directory The working directory
 /// \param flags flags for the search. Can be any combination of EXPAND_FOR_COMPLETIONS and
@@ -45,6 +50,36 @@ enum {
 int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory,
                            expand_flags_t flags, std::vector<completion_t> *out);
 
+/// How often wildcard_expand_string reused the results of an earlier expansion.
+struct wildcard_cache_stats_t {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+/// Returns the counts of wildcard expansions answered from, and missing in, the cache.
+wildcard_cache_stats_t wildcard_cache_stats();
+
+/// Returns the counts of checks whether a file completed with a description is executable which
+/// were answered from, and missing in, the cache.
+wildcard_cache_stats_t file_desc_cache_stats();
+
+/// Completes a command name from the executables in the given directories, like calling
+/// wildcard_expand_string with each directory as the working directory. The directories are read
+/// concurrently, and their listings are kept until they change.
+///
+/// \param wc The command name, which may contain neither slashes nor wildcards
+/// \param dirs The absolute paths of the directories to search, usually from $PATH
+/// \param flags flags for the search. Must include EXPAND_FOR_COMPLETIONS and EXECUTABLES_ONLY
+/// \param out The list in which to put the output
+///
+/// \return 1 if matches where found, 0 otherwise. Return -1 on abort (I.e. ^C was pressed).
+int wildcard_complete_command(const wcstring &wc, const wcstring_list_t &dirs,
+                              expand_flags_t flags, std::vector<completion_t> *out);
+
+/// Reads the listings of the given directories that wildcard_complete_command would need, so that
+/// it can complete command names without reading them.
+void wildcard_warm_command_dirs(const wcstring_list_t &dirs);
+
 /// Test whether the given wildcard matches the string. Does not perform any I/O.
 ///
 /// \param str The string to test
@@ -56,6 +91,37 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &working_directory
 bool wildcard_match(const wcstring &str, const wcstring &wc,
                     bool leading_dots_fail_to_match = false);
 
+/// A wildcard prepared for matching many strings, with the same results as wildcard_match. The
+/// wildcard is split at its ANY_STRINGs into pieces of fixed length, which are found with plain
+/// string searches: the first must be at the start of the string, and the last at the end.
+class wildcard_pattern_t {
+    struct piece_t {
+        size_t start;
+        size_t length;
+        // Whether the piece has no ANY_CHAR, so it can be compared and searched for directly.
+        bool literal;
+    };
+
+    wcstring wc;
+    bool leading_dots_fail_to_match;
+    // Whether the wildcard contains ANY_STRING or ANY_STRING_RECURSIVE.
+    bool has_any_string = false;
+    // Whether the first character after any leading ANY_STRINGs is an ANY_CHAR, which never
+    // matches a leading dot.
+    bool any_char_first = false;
+    // The pieces between the ANY_STRINGs, including empty ones at the ends.
+    std::vector<piece_t> pieces;
+
+    bool piece_matches_at(const piece_t &piece, const wchar_t *str) const;
+    size_t find_piece(const piece_t &piece, const wchar_t *str, size_t start, size_t end) const;
+
+   public:
+    explicit wildcard_pattern_t(const wcstring &wc, bool leading_dots_fail_to_match = false);
+
+    /// Test whether the wildcard matches the string.
+    bool matches(const wcstring &str) const;
+};
+
 /// Check if the specified string contains wildcards.
 bool wildcard_has(const wcstring &, bool internal);
 bool wildcard_has(const wchar_t *, bool internal);
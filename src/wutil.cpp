@@ -22,6 +22,7 @@
 
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "lru.h"
 #include "wutil.h"     // IWYU pragma: keep
 
 typedef std::string cstring;
@@ -86,7 +87,9 @@ bool wreaddir_resolving(DIR *dir, const wcstring &dir_path, wcstring &out_name,
     return true;
 }
 
-bool wreaddir(DIR *dir, wcstring &out_name) {
+bool wreaddir(DIR *dir, wcstring &out_name) { return wreaddir_with_type(dir, out_name, NULL); }
+
+bool wreaddir_with_type(DIR *dir, wcstring &out_name, mode_t *out_type) {
     // We need to use a union to ensure that the dirent struct is large enough to avoid stomping on
     // the stack. Some platforms incorrectly defined the `d_name[]` member as being one element
     // long when it should be at least NAME_MAX + 1.
@@ -103,6 +106,45 @@ bool wreaddir(DIR *dir, wcstring &out_name) {
     }
 
     out_name = str2wcstring(d_u.d.d_name);
+    if (out_type == NULL) return true;
+
+    mode_t type = 0;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+    switch (d_u.d.d_type) {
+        case DT_DIR: {
+            type = S_IFDIR;
+            break;
+        }
+        case DT_REG: {
+            type = S_IFREG;
+            break;
+        }
+        case DT_LNK: {
+            type = S_IFLNK;
+            break;
+        }
+        case DT_FIFO: {
+            type = S_IFIFO;
+            break;
+        }
+        case DT_SOCK: {
+            type = S_IFSOCK;
+            break;
+        }
+        case DT_CHR: {
+            type = S_IFCHR;
+            break;
+        }
+        case DT_BLK: {
+            type = S_IFBLK;
+            break;
+        }
+        default: {
+            break;  // DT_UNKNOWN, the file system doesn't say
+        }
+    }
+#endif  // HAVE_STRUCT_DIRENT_D_TYPE
+    *out_type = type;
     return true;
 }
 
@@ -121,7 +163,8 @@ bool wreaddir_for_dirs(DIR *dir, wcstring *out_name) {
                 break;  // these may be directories
             }
             default: {
-                break;  // nothing else can
+                result = NULL;  // nothing else can, so look at the next one
+                break;
             }
         }
 #else
@@ -338,6 +381,86 @@ void safe_perror(const char *message) {
     errno = err;
 }
 
+/// The number of directories whose real path we remember.
+#define REALPATH_CACHE_SIZE 256
+
+namespace {
+/// The real path of a directory, and the device and inode the directory had.
+struct realpath_cache_entry_t {
+    std::string resolved;
+    dev_t dev;
+    ino_t ino;
+};
+
+/// Cache of the real paths of absolute directory paths, keyed by the path as given.
+class realpath_cache_t
+    : public lru_cache_t<realpath_cache_t, realpath_cache_entry_t, std::string> {
+    typedef lru_cache_t<realpath_cache_t, realpath_cache_entry_t, std::string> super;
+
+   public:
+    realpath_cache_t() : super(REALPATH_CACHE_SIZE) {}
+};
+}  // anonymous namespace
+
+static owning_lock<realpath_cache_t> s_realpath_cache;
+
+static bool realpath_uncached(const std::string &path, std::string *out) {
+    char buff[PATH_MAX];
+    if (!realpath(path.c_str(), buff)) return false;
+    out->assign(buff);
+    return true;
+}
+
+/// Like realpath(), but remembers the real paths of directories. realpath() makes a system call for
+/// each component of the path, while a remembered directory is checked with two stats: the path
+/// given and its real path must both still be the directory with the same device and inode. A
+/// directory that is not remembered is resolved from its parent, which usually is, so paths in the
+/// same tree are cheap to resolve too. Directories can't be hard linked, so a device and inode stands
+/// for a single real path.
+static bool realpath_cached(const std::string &path, std::string *out) {
+    // What relative paths refer to depends on the working directory.
+    struct stat path_buf;
+    if (path.empty() || path.at(0) != '/' || stat(path.c_str(), &path_buf) != 0 ||
+        !S_ISDIR(path_buf.st_mode)) {
+        return realpath_uncached(path, out);
+    }
+
+    std::string resolved;
+    {
+        auto &&locker = s_realpath_cache.acquire();
+        const realpath_cache_entry_t *cached = locker.value.get(path);
+        if (cached && cached->dev == path_buf.st_dev && cached->ino == path_buf.st_ino) {
+            resolved = cached->resolved;
+        }
+    }
+    struct stat resolved_buf;
+    if (!resolved.empty() && stat(resolved.c_str(), &resolved_buf) == 0 &&
+        resolved_buf.st_dev == path_buf.st_dev && resolved_buf.st_ino == path_buf.st_ino) {
+        *out = std::move(resolved);
+        return true;
+    }
+
+    // If the last component is a plain directory, the real path is that of its parent followed by
+    // it. Otherwise let realpath() sort out the symlinks, dots and doubled slashes.
+    size_t sep_idx = path.rfind('/');
+    const std::string leaf = path.substr(sep_idx + 1);
+    struct stat leaf_buf;
+    if (leaf.empty() || leaf == "." || leaf == ".." || lstat(path.c_str(), &leaf_buf) != 0 ||
+        S_ISLNK(leaf_buf.st_mode) ||
+        !realpath_cached(sep_idx == 0 ? std::string("/") : path.substr(0, sep_idx), &resolved)) {
+        if (!realpath_uncached(path, &resolved)) return false;
+    } else {
+        if (resolved != "/") resolved.push_back('/');
+        resolved.append(leaf);
+    }
+
+    auto &&locker = s_realpath_cache.acquire();
+    locker.value.evict_node(path);
+    locker.value.insert(path, realpath_cache_entry_t{resolved, path_buf.st_dev, path_buf.st_ino});
+    *out = std::move(resolved);
+    return true;
+}
+
 maybe_t<wcstring> wrealpath(const wcstring &pathname) {
     if (pathname.empty()) return none();
 
@@ -350,30 +473,26 @@ maybe_t<wcstring> wrealpath(const wcstring &pathname) {
         narrow_path.erase(narrow_path.size() - 1, 1);
     }
 
-    char tmpbuf[PATH_MAX];
-    char *narrow_res = realpath(narrow_path.c_str(), tmpbuf);
-    if (narrow_res) {
-        real_path.append(narrow_res);
-    } else {
+    if (!realpath_cached(narrow_path, &real_path)) {
         size_t pathsep_idx = narrow_path.rfind('/');
         if (pathsep_idx == 0) {
             // If the only pathsep is the first character then it's an absolute path with a
             // single path component and thus doesn't need conversion.
             real_path = narrow_path;
         } else {
-            char tmpbuff[PATH_MAX];
             if (pathsep_idx == cstring::npos) {
                 // No pathsep means a single path component relative to pwd.
-                narrow_res = realpath(".", tmpbuff);
-                assert(narrow_res != NULL && "realpath unexpectedly returned null");
+                bool found = realpath_uncached(".", &real_path);
+                assert(found && "realpath unexpectedly failed");
+                (void)found;
                 pathsep_idx = 0;
             } else {
                 // Only call realpath() on the portion up to the last component.
-                narrow_res = realpath(narrow_path.substr(0, pathsep_idx).c_str(), tmpbuff);
-                if (!narrow_res) return none();
+                if (!realpath_cached(narrow_path.substr(0, pathsep_idx), &real_path)) {
+                    return none();
+                }
                 pathsep_idx++;
             }
-            real_path.append(narrow_res);
             // This test is to deal with pathological cases such as /../../x => //x.
             if (real_path.size() > 1) real_path.append("/");
             real_path.append(narrow_path.substr(pathsep_idx, cstring::npos));
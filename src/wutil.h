@@ -68,6 +68,11 @@ bool wreaddir(DIR *dir, wcstring &out_name);
 bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, wcstring &out_name,
                         bool *out_is_dir);
 
+/// Like wreaddir, but also returns the type of the file as the S_IFMT bits of its mode, if readdir
+/// tells us without a stat, or 0 if it does not. Symlinks are not resolved, so their type is
+/// S_IFLNK. out_type may be NULL.
+bool wreaddir_with_type(DIR *dir, wcstring &out_name, mode_t *out_type);
+
 /// Like wreaddir, but skip items that are known to not be directories. If this requires a stat
 /// (i.e. the file is a symlink), then return it. Note that this does not guarantee that everything
 /// returned is a directory, it's just an optimization for cases where we would check for
@@ -0,0 +1,16 @@
+# Benchmark: autoloading functions from a directory in $fish_function_path.
+# Usage: fish autoload.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+# The function files are written to SCRATCH_DIR by the first, untimed, run.
+set -l n (math 2000 \* $argv[1])
+set -l dir $argv[2]/autoload-$n
+if not test -d $dir
+    mkdir -p $dir
+    for i in (seq $n)
+        printf 'function bench_autoload_%d\n    set -l result (string repeat -n 2 %d)\n    echo $result\nend\n' $i $i >$dir/bench_autoload_$i.fish
+    end
+end
+set fish_function_path $dir $fish_function_path
+for i in (seq $n)
+    functions -q bench_autoload_$i
+end
+echo $n
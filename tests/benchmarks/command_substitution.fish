@@ -0,0 +1,11 @@
+# Benchmark: command substitutions of builtins and functions.
+# Usage: fish command_substitution.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 5000 \* $argv[1])
+function bench_output
+    echo $argv
+end
+for i in (seq $n)
+    set -l a (echo $i)
+    set -l b (bench_output $i)
+end
+math 2 \* $n
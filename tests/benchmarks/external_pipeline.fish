@@ -0,0 +1,9 @@
+# Benchmark: running external commands, alone and in pipelines.
+# Usage: fish external_pipeline.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 200 \* $argv[1])
+for i in (seq $n)
+    command true
+    echo $i | command cat >/dev/null
+    echo $i | command cat | command cat >/dev/null
+end
+math 3 \* $n
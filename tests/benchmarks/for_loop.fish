@@ -0,0 +1,10 @@
+# Benchmark: iterations of a for loop over a list.
+# Usage: fish for_loop.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 50000 \* $argv[1])
+set -l items (seq $n)
+for i in $items
+end
+for i in $items
+    set -l j $i
+end
+math 2 \* $n
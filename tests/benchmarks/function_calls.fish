@@ -0,0 +1,9 @@
+# Benchmark: calling a small function with arguments.
+# Usage: fish function_calls.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 20000 \* $argv[1])
+function bench_noop
+end
+for i in (seq $n)
+    bench_noop $i
+end
+echo $n
@@ -0,0 +1,16 @@
+# Benchmark: appending to, indexing into, assigning elements of and erasing elements of a list
+# with set.
+# Usage: fish set_list.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 1000 \* $argv[1])
+set -l list
+for i in (seq $n)
+    set list $list $i
+end
+for i in (seq $n)
+    set list[$i] x$list[$i]
+end
+for i in (seq $n)
+    set -l item $list[-1]
+    set -e list[-1]
+end
+math 3 \* $n
@@ -0,0 +1,11 @@
+# Benchmark: the string builtin's most used subcommands on short strings.
+# Usage: fish string.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 5000 \* $argv[1])
+for i in (seq $n)
+    string length -- some-text-$i >/dev/null
+    string match -q -- 'some-*' some-text-$i
+    string replace -r -- '-(\d+)$' '_$1' some-text-$i >/dev/null
+    string split -- - a-b-c-$i >/dev/null
+    string join -- , a b $i >/dev/null
+end
+math 5 \* $n
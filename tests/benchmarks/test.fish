@@ -0,0 +1,10 @@
+# Benchmark: the test builtin comparing numbers and strings and checking files.
+# Usage: fish test.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 10000 \* $argv[1])
+for i in (seq $n)
+    test $i -gt 0
+    test "$i" = x
+    test -n "$i"
+    test -d /
+end
+math 4 \* $n
@@ -0,0 +1,8 @@
+# Benchmark: iterations of a while loop counting with math and test.
+# Usage: fish while_loop.fish SCALE SCRATCH_DIR. Prints the number of operations done.
+set -l n (math 5000 \* $argv[1])
+set -l i 0
+while test $i -lt $n
+    set i (math $i + 1)
+end
+echo $n